@@ -175,6 +175,22 @@ const char* buf_rptr(buf_t buf, size_t* avail)
     return buf->rptr;
 }
 
+size_t buf_rview(buf_t buf, const char* ptr[2], size_t avail[2])
+{
+    ptr[0] = buf_rptr(buf, &(avail[0]));
+    if (buf->wptr > buf->rptr || avail[0] == 0)
+    {
+        ptr[1] = NULL;
+        avail[1] = 0;
+    }
+    else
+    {
+        ptr[1] = buf->data;
+        avail[1] = buf->wptr - buf->data;
+    }
+    return avail[0] + avail[1];
+}
+
 size_t buf_rmove(buf_t buf, size_t size)
 {
     if (buf->wptr > buf->rptr)
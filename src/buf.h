@@ -51,6 +51,10 @@ size_t buf_wmove(buf_t buf, size_t size);
 const char* buf_rptr(buf_t buf, size_t* avail);
 /* Return number of bytes readable after the read ptr been moved size bytes */
 size_t buf_rmove(buf_t buf, size_t size);
+/* Return pointers to all of the readable part of the buffer without moving
+ * the read ptr. As the data may wrap around the end of the buffer there are
+ * two parts, avail[1] is zero if it doesn't. Returns the total available */
+size_t buf_rview(buf_t buf, const char* ptr[2], size_t avail[2]);
 
 /* Try to skip size bytes, returns the number of bytes actually skipped */
 size_t buf_skip(buf_t buf, size_t size);
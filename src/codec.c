@@ -0,0 +1,560 @@
+/*
+ * Copyright (C) 2011, Joel Klinghed.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the project nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE PROJECT AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE PROJECT OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "common.h"
+
+#include "codec.h"
+
+#include <string.h>
+#include <time.h>
+#if HAVE_ZLIB
+# include <zlib.h>
+#endif
+#if HAVE_ZSTD
+# include <zstd.h>
+#endif
+
+#if HAVE_ZLIB
+static const int ZLIB_LEVEL = Z_DEFAULT_COMPRESSION;
+#endif
+#if HAVE_ZSTD
+/* The lowest levels are already better than zlib on XML and cost
+ * a lot less CPU */
+static const int ZSTD_LEVEL = 1;
+/* Each tunnel has its own codecs, a smaller window than the default keeps
+ * their memory down. Also the largest window accepted from the other end */
+static const int ZSTD_WINDOW_LOG = 17;
+#endif
+
+typedef enum _flush_t
+{
+    FLUSH_NONE = 0,
+    FLUSH_SYNC,
+    FLUSH_FINISH,
+    /* End the stream and start a new one, see codec_restart */
+    FLUSH_RESTART,
+} flush_t;
+
+struct _codec_t
+{
+    codec_method_t method;
+    bool compress;
+    /* Compressing, flush requested and not yet fully written */
+    flush_t flush;
+    /* Compressing, input was consumed since the last flush */
+    bool dirty;
+    /* The last codec_run filled the output, there might be more */
+    bool full;
+    /* The end of the stream has been seen (decompressing) or asked for
+     * (compressing) */
+    bool done;
+    /* Nothing was consumed or written since the start or the end of the
+     * last stream (a frame for zstd) */
+    bool boundary;
+    /* Decompressing, stop at the next boundary (stop) and stopped there */
+    bool stop, stopped;
+    /* Skipping wanted and in use */
+    bool skip, skipping;
+    codec_stats_t stats;
+    uint64_t cpu_nsec;
+#if HAVE_ZLIB
+    z_stream z;
+#endif
+#if HAVE_ZSTD
+    ZSTD_CCtx* zc;
+    ZSTD_DCtx* zd;
+#endif
+};
+
+unsigned int codec_methods(void)
+{
+    unsigned int methods = 1 << CODEC_NONE;
+#if HAVE_ZLIB
+    methods |= 1 << CODEC_ZLIB;
+#endif
+#if HAVE_ZSTD
+    methods |= 1 << CODEC_ZSTD;
+#endif
+    return methods;
+}
+
+codec_method_t codec_pick(unsigned int methods1, unsigned int methods2)
+{
+    unsigned int both = methods1 & methods2;
+    if (both & (1 << CODEC_ZSTD))
+    {
+        return CODEC_ZSTD;
+    }
+    if (both & (1 << CODEC_ZLIB))
+    {
+        return CODEC_ZLIB;
+    }
+    return CODEC_NONE;
+}
+
+const char* codec_method_str(codec_method_t method)
+{
+    switch (method)
+    {
+    case CODEC_NONE:
+        return "none";
+    case CODEC_ZLIB:
+        return "zlib";
+    case CODEC_ZSTD:
+        return "zstd";
+    }
+    return "unknown";
+}
+
+codec_t codec_new(codec_method_t method, bool compress)
+{
+    codec_t codec;
+    if (method == CODEC_NONE || !(codec_methods() & (1 << method)))
+    {
+        return NULL;
+    }
+    codec = calloc(1, sizeof(struct _codec_t));
+    if (codec == NULL)
+    {
+        return NULL;
+    }
+    codec->method = method;
+    codec->compress = compress;
+    codec->boundary = true;
+    switch (method)
+    {
+    case CODEC_NONE:
+        break;
+    case CODEC_ZLIB:
+#if HAVE_ZLIB
+        if ((compress ? deflateInit(&codec->z, ZLIB_LEVEL)
+             : inflateInit(&codec->z)) != Z_OK)
+        {
+            free(codec);
+            return NULL;
+        }
+#endif
+        break;
+    case CODEC_ZSTD:
+#if HAVE_ZSTD
+        if (compress)
+        {
+            codec->zc = ZSTD_createCCtx();
+            if (codec->zc == NULL)
+            {
+                free(codec);
+                return NULL;
+            }
+            ZSTD_CCtx_setParameter(codec->zc, ZSTD_c_compressionLevel,
+                                   ZSTD_LEVEL);
+            ZSTD_CCtx_setParameter(codec->zc, ZSTD_c_windowLog,
+                                   ZSTD_WINDOW_LOG);
+        }
+        else
+        {
+            codec->zd = ZSTD_createDCtx();
+            if (codec->zd == NULL)
+            {
+                free(codec);
+                return NULL;
+            }
+            ZSTD_DCtx_setParameter(codec->zd, ZSTD_d_windowLogMax,
+                                   ZSTD_WINDOW_LOG);
+        }
+#endif
+        break;
+    }
+    return codec;
+}
+
+void codec_free(codec_t codec)
+{
+    if (codec == NULL)
+    {
+        return;
+    }
+    switch (codec->method)
+    {
+    case CODEC_NONE:
+        break;
+    case CODEC_ZLIB:
+#if HAVE_ZLIB
+        if (codec->compress)
+        {
+            deflateEnd(&codec->z);
+        }
+        else
+        {
+            inflateEnd(&codec->z);
+        }
+#endif
+        break;
+    case CODEC_ZSTD:
+#if HAVE_ZSTD
+        ZSTD_freeCCtx(codec->zc);
+        ZSTD_freeDCtx(codec->zd);
+#endif
+        break;
+    }
+    free(codec);
+}
+
+/* The codecs never block so the time spent in them is close enough to the
+ * CPU time, and unlike CLOCK_THREAD_CPUTIME_ID reading the monotonic clock
+ * isn't a system call */
+static uint64_t cpu_nsec(void)
+{
+#if HAVE_CLOCK_GETTIME && defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+    {
+        return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    }
+#endif
+    return 0;
+}
+
+#if HAVE_ZLIB
+static ssize_t zlib_run(codec_t codec, buf_t input, char* output,
+                        size_t avail)
+{
+    z_stream* z = &codec->z;
+    int ret;
+    z->next_out = (Bytef*)output;
+    z->avail_out = avail;
+    if (codec->skip != codec->skipping)
+    {
+        /* What was given before is still compressed the old way */
+        z->next_in = Z_NULL;
+        z->avail_in = 0;
+        ret = deflateParams(z, codec->skip ? Z_NO_COMPRESSION : ZLIB_LEVEL,
+                            Z_DEFAULT_STRATEGY);
+        if (z->avail_out < avail)
+        {
+            codec->boundary = false;
+        }
+        if (ret == Z_OK)
+        {
+            codec->skipping = codec->skip;
+        }
+        else if (ret != Z_BUF_ERROR)
+        {
+            return -1;
+        }
+    }
+    while (z->avail_out > 0)
+    {
+        size_t inavail, outavail = z->avail_out;
+        const char* in = buf_rptr(input, &inavail);
+        int flush = Z_NO_FLUSH;
+        if (inavail == 0)
+        {
+            if (codec->compress ? codec->flush == FLUSH_NONE : !codec->full)
+            {
+                break;
+            }
+            if (codec->flush == FLUSH_SYNC)
+            {
+                flush = Z_SYNC_FLUSH;
+            }
+            else if (codec->flush != FLUSH_NONE)
+            {
+                flush = Z_FINISH;
+            }
+        }
+        else if (codec->done && !codec->compress)
+        {
+            /* Another stream follows the end of the last */
+            if (inflateReset(z) != Z_OK)
+            {
+                return -1;
+            }
+            codec->done = false;
+        }
+        z->next_in = (Bytef*)in;
+        z->avail_in = inavail;
+        ret = codec->compress ? deflate(z, flush) : inflate(z, Z_NO_FLUSH);
+        buf_rmove(input, inavail - z->avail_in);
+        codec->stats.in += inavail - z->avail_in;
+        if (z->avail_in < inavail || z->avail_out < outavail)
+        {
+            codec->boundary = false;
+        }
+        if (ret == Z_STREAM_END)
+        {
+            codec->boundary = true;
+            if (codec->compress)
+            {
+                if (codec->flush == FLUSH_RESTART && deflateReset(z) != Z_OK)
+                {
+                    return -1;
+                }
+                codec->flush = FLUSH_NONE;
+                break;
+            }
+            codec->done = true;
+            if (codec->stop)
+            {
+                codec->stopped = true;
+                break;
+            }
+        }
+        else if (ret == Z_BUF_ERROR)
+        {
+            /* No progress was possible, nothing left to flush */
+            if (flush == Z_SYNC_FLUSH)
+            {
+                codec->flush = FLUSH_NONE;
+            }
+            break;
+        }
+        else if (ret != Z_OK)
+        {
+            return -1;
+        }
+        if (inavail == 0)
+        {
+            if (flush == Z_SYNC_FLUSH && z->avail_out > 0)
+            {
+                codec->flush = FLUSH_NONE;
+            }
+            break;
+        }
+    }
+    return avail - z->avail_out;
+}
+#endif
+
+#if HAVE_ZSTD
+static ssize_t zstd_run(codec_t codec, buf_t input, char* output,
+                        size_t avail)
+{
+    ZSTD_outBuffer out;
+    ZSTD_inBuffer in;
+    size_t ret;
+    out.dst = output;
+    out.size = avail;
+    out.pos = 0;
+    if (codec->skip != codec->skipping)
+    {
+        /* The level can only be changed between frames */
+        in.src = NULL;
+        in.size = in.pos = 0;
+        ret = ZSTD_compressStream2(codec->zc, &out, &in, ZSTD_e_end);
+        if (ZSTD_isError(ret))
+        {
+            return -1;
+        }
+        if (ret > 0)
+        {
+            codec->boundary = false;
+            return out.pos;
+        }
+        codec->boundary = true;
+        ZSTD_CCtx_setParameter(codec->zc, ZSTD_c_compressionLevel,
+                               codec->skip ? ZSTD_minCLevel() : ZSTD_LEVEL);
+        codec->skipping = codec->skip;
+    }
+    while (out.pos < out.size)
+    {
+        size_t inavail, before = out.pos;
+        ZSTD_EndDirective end = ZSTD_e_continue;
+        in.src = buf_rptr(input, &inavail);
+        in.size = inavail;
+        in.pos = 0;
+        if (inavail == 0)
+        {
+            if (codec->compress ? codec->flush == FLUSH_NONE : !codec->full)
+            {
+                break;
+            }
+            end = codec->flush == FLUSH_SYNC ? ZSTD_e_flush : ZSTD_e_end;
+        }
+        if (codec->compress)
+        {
+            ret = ZSTD_compressStream2(codec->zc, &out, &in, end);
+        }
+        else
+        {
+            ret = ZSTD_decompressStream(codec->zd, &out, &in);
+        }
+        if (ZSTD_isError(ret))
+        {
+            return -1;
+        }
+        buf_rmove(input, in.pos);
+        codec->stats.in += in.pos;
+        if (in.pos > 0 || out.pos > before)
+        {
+            codec->boundary = false;
+        }
+        if (ret == 0 && (!codec->compress || end == ZSTD_e_end))
+        {
+            codec->boundary = true;
+            if (codec->stop)
+            {
+                codec->stopped = true;
+                break;
+            }
+        }
+        if (inavail == 0)
+        {
+            if (codec->compress && ret == 0)
+            {
+                codec->flush = FLUSH_NONE;
+            }
+            break;
+        }
+        if (in.pos == 0 && out.pos == before)
+        {
+            break;
+        }
+    }
+    return out.pos;
+}
+#endif
+
+ssize_t codec_run(codec_t codec, buf_t input, void* output, size_t avail)
+{
+    ssize_t ret = -1;
+    uint64_t start;
+    uint64_t in = codec->stats.in;
+    if (codec->stop && codec->boundary)
+    {
+        codec->stopped = true;
+    }
+    if (avail == 0 || codec->stopped)
+    {
+        return 0;
+    }
+    start = cpu_nsec();
+    switch (codec->method)
+    {
+    case CODEC_NONE:
+        break;
+    case CODEC_ZLIB:
+#if HAVE_ZLIB
+        ret = zlib_run(codec, input, output, avail);
+#endif
+        break;
+    case CODEC_ZSTD:
+#if HAVE_ZSTD
+        ret = zstd_run(codec, input, output, avail);
+#endif
+        break;
+    }
+    codec->cpu_nsec += cpu_nsec() - start;
+    if (ret < 0)
+    {
+        return -1;
+    }
+    if (codec->stats.in > in)
+    {
+        codec->dirty = true;
+    }
+    codec->full = (size_t)ret == avail;
+    codec->stats.out += ret;
+    return ret;
+}
+
+bool codec_pending(codec_t codec)
+{
+    return codec->full || codec->flush != FLUSH_NONE;
+}
+
+bool codec_flush(codec_t codec)
+{
+    assert(codec->compress);
+    if (!codec->dirty)
+    {
+        return false;
+    }
+    codec->dirty = false;
+    if (codec->flush == FLUSH_NONE)
+    {
+        codec->flush = FLUSH_SYNC;
+    }
+    return true;
+}
+
+void codec_finish(codec_t codec)
+{
+    assert(codec->compress);
+    if (codec->done)
+    {
+        return;
+    }
+    codec->done = true;
+    codec->dirty = false;
+    codec->flush = FLUSH_FINISH;
+}
+
+void codec_restart(codec_t codec)
+{
+    assert(codec->compress);
+    if (codec->done || codec->boundary)
+    {
+        return;
+    }
+    codec->dirty = false;
+    codec->flush = FLUSH_RESTART;
+}
+
+bool codec_boundary(codec_t codec)
+{
+    return codec->boundary && !codec_pending(codec);
+}
+
+void codec_stop(codec_t codec, bool stop)
+{
+    assert(!codec->compress);
+    codec->stop = stop;
+    codec->stopped = stop && codec->boundary;
+}
+
+bool codec_stopped(codec_t codec)
+{
+    return codec->stopped;
+}
+
+void codec_skip(codec_t codec, bool skip)
+{
+    assert(codec->compress);
+    if (skip && !codec->skip)
+    {
+        codec->stats.skips++;
+    }
+    codec->skip = skip;
+}
+
+void codec_stats(codec_t codec, codec_stats_t* stats)
+{
+    *stats = codec->stats;
+    stats->cpu_usec = codec->cpu_nsec / 1000;
+}
@@ -0,0 +1,103 @@
+/*
+ * Copyright (C) 2011, Joel Klinghed.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the project nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE PROJECT AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE PROJECT OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef CODEC_H
+#define CODEC_H
+
+/* Streaming compression of tunnel data, one codec for each direction.
+ * Which methods are available depends on what libraries were found by
+ * configure */
+
+typedef struct _codec_t* codec_t;
+
+typedef enum _codec_method_t
+{
+    CODEC_NONE = 0,
+    CODEC_ZLIB,
+    CODEC_ZSTD,
+} codec_method_t;
+
+#include "buf.h"
+#include <sys/types.h>
+
+/* Mask of the methods this build can use, bit n set for method n.
+ * CODEC_NONE is always included */
+unsigned int codec_methods(void);
+/* The best method set in both masks */
+codec_method_t codec_pick(unsigned int methods1, unsigned int methods2);
+const char* codec_method_str(codec_method_t method);
+
+/* Returns NULL if the method isn't available (or is CODEC_NONE) */
+codec_t codec_new(codec_method_t method, bool compress);
+void codec_free(codec_t codec);
+
+/* Run the data in input through the codec, writing at most avail bytes to
+ * output. Returns the number of bytes written, or -1 if the input can't be
+ * decompressed. If less than avail bytes are written all of input has been
+ * consumed */
+ssize_t codec_run(codec_t codec, buf_t input, void* output, size_t avail);
+/* true if codec_run has more to write even without more input */
+bool codec_pending(codec_t codec);
+
+/* Compressing only. Make everything given to the codec so far come out of
+ * the following codec_run calls, so that it can be decompressed at the
+ * other end. Returns false if there was nothing to flush */
+bool codec_flush(codec_t codec);
+/* Compressing only. No more input is coming, end the stream. Calling it
+ * again does nothing */
+void codec_finish(codec_t codec);
+/* Compressing only. End the stream once everything given so far is
+ * written, what follows is a new stream that doesn't depend on anything
+ * before it. Does nothing if nothing was given since the last end */
+void codec_restart(codec_t codec);
+/* true if the codec is between streams with nothing left to write */
+bool codec_boundary(codec_t codec);
+/* Decompressing only. While stop is true codec_run stops at the end of
+ * the current stream, or right away if between streams, and leaves the
+ * rest of input alone */
+void codec_stop(codec_t codec, bool stop);
+/* true if codec_run has stopped, see codec_stop */
+bool codec_stopped(codec_t codec);
+/* Compressing only. While skip is true the input is already compressed
+ * (images, video and so on) and spending time on it is a waste */
+void codec_skip(codec_t codec, bool skip);
+
+typedef struct
+{
+    /* Bytes consumed from input and written to output */
+    uint64_t in, out;
+    /* Time spent (de)compressing, 0 if it can't be measured */
+    uint64_t cpu_usec;
+    /* Number of times codec_skip started skipping */
+    unsigned long skips;
+} codec_stats_t;
+
+void codec_stats(codec_t codec, codec_stats_t* stats);
+
+#endif /* CODEC_H */
@@ -41,6 +41,13 @@
 #include "vector.h"
 #include "timers.h"
 #include "http_proxy.h"
+#include "gena.h"
+#include "worker.h"
+#include "outq.h"
+#include "codec.h"
+#include "svcindex.h"
+#include "slotmap.h"
+#include "strtab.h"
 
 #include <string.h>
 #include <stdio.h>
@@ -49,6 +56,10 @@
 #include <errno.h>
 #include <pwd.h>
 #include <signal.h>
+#include <poll.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/wait.h>
 #if HAVE_UUID_CREATE
 # include <uuid.h>
 #elif HAVE_UUID_GENERATE
@@ -56,19 +67,85 @@
 #endif
 
 static const uint16_t DEFAULT_PORT = 24232;
-static const uint16_t DEFAULT_FIRST_TUNNEL_PORT = 24235;
-static const uint16_t DEFAULT_LAST_TUNNEL_PORT = 24240;
+static const uint16_t DEFAULT_TUNNEL_PORT = 24235;
 static const time_t REMOTE_EXPIRE_BUFFER = 10; /* send keep-alive 10 seconds
                                                 * before the service expires */
 static const time_t REMOTE_EXPIRE_TTL = 9000;
 
 static const size_t SERVER_BUFFER_IN = 1024;
-static const size_t SERVER_BUFFER_OUT = 1024;
+/* Size of the blocks in the output queue to a server */
+static const size_t SERVER_BLOCK_OUT = 4096;
+static const int DEFAULT_SERVER_HIGH_WATER = 256 * 1024;
+/* Max number of blocks sent in one writev */
+#define SERVER_IOV (16)
+
+/* Priority classes of the packages to a server, sent in this order */
+enum
+{
+    SERVER_PRIO_TUNNEL = 0,
+    SERVER_PRIO_SERVICE,
+    SERVER_PRIO_RESYNC,
+    SERVER_PRIOS
+};
 static const size_t TUNNEL_BUFFER_LOCAL = 8192;
 static const size_t TUNNEL_BUFFER_DAEMON = 8192;
+/* Bytes a busy tunnel may read before the other busy tunnels of the
+ * worker get their turn */
+static const int DEFAULT_TUNNEL_QUANTUM = 32 * 1024;
+/* Bytes read from a server link before the other sockets of the main
+ * thread get their turn, see selector_set_budget */
+static const int DEFAULT_IO_BUDGET = 64 * 1024;
+/* Bytes per second and burst of responses to M-SEARCH from each sender,
+ * see ssdp_set_search_limit */
+static const int DEFAULT_SEARCH_RATE = 128 * 1024;
+static const int DEFAULT_SEARCH_BURST = 1024 * 1024;
+/* At startup ssdp:all is searched for this many times, this far apart,
+ * as a single M-SEARCH is easily lost */
+static const unsigned int DISCOVER_SEARCHES = 3;
+static const unsigned long DISCOVER_INTERVAL = 1000;
+/* Seconds between saving the local services to state_file, 0 means only
+ * when quitting */
+static const int DEFAULT_STATE_INTERVAL = 300;
+/* Services read from state_file expire after at most this many seconds
+ * unless they answer the startup search or announce themselves again */
+static const time_t STATE_RESTORE_TTL = 180;
+static const char STATE_HEADER[] = "upnpproxy-state 1";
+/* How long the server links get to drain before handing over, links that
+ * still haven't are left behind and reconnect. Then how long the new
+ * daemon gets to answer */
+static const unsigned long HANDOVER_DRAIN_TIMEOUT = 2000;
+static const int HANDOVER_ACK_TIMEOUT = 5000;
+/* First in the handover, changes with the format */
+static const uint32_t HANDOVER_MAGIC = 0x75706803;
+/* A rate limited tunnel can burst this part of a second */
+static const unsigned long TUNNEL_RATE_BURST_DIV = 4;
 
 /* Every 30 sec */
 static const unsigned long SERVER_RECONNECT_TIMER = 30 * 1000;
+/* Time a connection to the tunnel port has to send its token */
+static const unsigned long TUNNEL_TOKEN_TIMEOUT = 30 * 1000;
+/* Time to wait for PKG_HELLO from a new server connection before deciding
+ * it is an older daemon. A hello arriving later still upgrades the link */
+static const unsigned long SERVER_HELLO_TIMEOUT = 1000;
+/* Time a connection to the service port has to send its Request-Line */
+static const unsigned long SERVICE_REQUEST_TIMEOUT = 30 * 1000;
+
+/* The paths in the locations of services behind the service port start
+ * with this followed by the route of the service, in hex */
+static const char SERVICE_ROUTE_PREFIX[] = "/upnpproxy-";
+/* Longest Request-Line read by the main thread to find the route */
+#define SERVICE_LINE_MAX (2048)
+/* Number of clients to remember the last route of, see service_client_t */
+static const size_t SERVICE_CLIENTS_MAX = 64;
+
+/* Time a connection for the events has to finish its exchange */
+static const unsigned long GENA_EXCHANGE_TIMEOUT = 30 * 1000;
+/* Longest header of a GENA message read by the main thread */
+#define GENA_HEAD_MAX (4096)
+
+/* Default number of worker threads is the number of CPUs up to this */
+static const int DEFAULT_MAX_WORKER_THREADS = 4;
+static const int MAX_WORKER_THREADS = 64;
 
 typedef struct _daemon_t* daemon_t;
 
@@ -91,18 +168,48 @@ typedef struct _server_t
     conn_state_t state;
     socket_t sock;
 
-    buf_t in, out;
+    buf_t in;
+    outq_t out;
+    /* true if packages has been written to out since the last
+     * daemon_flush_servers */
+    bool dirty;
+    /* true while out is above the high water mark, no new tunnels to the
+     * services of the server are accepted until it has drained */
+    bool congested;
+    /* Packages written to out and socket_write calls needed to send them */
+    unsigned long pkgs_written, pkg_writes;
 
     /* Local as in created by this server - at me */
     map_t local_tunnels;
 
-    /* Remote as in created by me - at this server */
-    uint32_t remote_tunnel_id;
-    map_t remote_tunnels;
+    /* Remote as in created by me - at this server. The IDs are handed out
+     * by the slotmap, so a late package for a closed tunnel can't hit a
+     * new one that got the same slot */
+    slotmap_t remote_tunnels;
 
-    vector_t waiting_pkgs;
+    /* Ids of the local services left to send after connecting, see
+     * daemon_server_resync */
+    vector_t resync;
+    size_t resync_pos;
+
+    /* Protocol version agreed on with the server using PKG_HELLO, the
+     * resync waits until hello_done so that it can use the compact
+     * encoding */
+    unsigned int version;
+    bool hello_done;
+    timecb_t hello_timecb;
+    /* Dictionaries for the compact encoding, one per direction. The outq
+     * class is used as channel in dict_out */
+    pkg_dict_t dict_in, dict_out;
+    /* Compression methods offered in our hello and the one picked from
+     * those and the methods in the hello of the server. Tunnels created by
+     * us at the server are compressed with it */
+    unsigned int compress_offered;
+    codec_method_t compress;
 } server_t;
 
+/* The strings are interned in daemon->strings, so they compare by
+ * pointer and the services of a device share the copies */
 typedef struct _localservice_t
 {
     uint32_t id;
@@ -117,6 +224,7 @@ typedef struct _localservice_t
     char* service_version_pos;
     char* usn_version_pos;
     unsigned int version_max;
+    /* On the daemon_now clock, like the ssdp_notify_t it came from */
     time_t expires;
     timecb_t expirecb;
     daemon_t daemon;
@@ -131,7 +239,10 @@ typedef struct _remoteservice_t
     char* usn_version_pos;
     unsigned int version_max;
     char* host;
+    /* Either the service has a listening socket of its own or it is
+     * reached through the service port with route, the other is -1 or 0 */
     socket_t sock;
+    uint32_t route;
     timecb_t touchcb;
 } remoteservice_t;
 
@@ -140,27 +251,53 @@ typedef struct _conn_t
     buf_t buf;
     socket_t sock;
     conn_state_t state;
+    /* Set if the tunnel is compressed. Data read from sock is put in zbuf
+     * and goes through codec on the way to the other conn. The local conn
+     * compresses and also shows what it reads to sniff, to see which
+     * content is already compressed. Everything sniff writes to sniffbuf
+     * is thrown away. The daemon conn decompresses */
+    codec_t codec;
+    buf_t zbuf;
+    http_proxy_t sniff;
+    buf_t sniffbuf;
+    /* sock is closed but the codec still has data for the other conn */
+    bool draining;
 } conn_t;
 
+typedef struct _tunnel_io_t tunnel_io_t;
+
+typedef struct _tunnel_listen_t tunnel_listen_t;
+
+/* Where a tunnel is in the handover, see daemon_handover_start */
+typedef enum _detach_t
+{
+    DETACH_NONE = 0,
+    /* Given to the worker with tunnel_io_detach_job */
+    DETACH_WAIT,
+    /* The worker let go of the sockets, the new daemon can have them */
+    DETACH_READY,
+    /* Too busy to hand over, the new daemon closes it */
+    DETACH_BUSY,
+} detach_t;
+
 typedef struct _tunnel_t
 {
     uint32_t id;
-    /* Local conn is the connection on the daemon side to either a client
-     * or service depending on "remote".
-     * Daemon conn is the connection to the other daemon. */
-    conn_t local_conn, daemon_conn;
     /* Remote == true if remoteservice is the source, ie the tunnel is created
      * at this daemon. */
     bool remote;
+    /* stasis == true until the connection to the other daemon is setup */
     bool stasis;
-    http_proxy_t proxy;
+    /* The port of its own a tunnel with a version 1 server listens on
+     * while in stasis, see daemon_listen_tunnel. NULL otherwise */
+    tunnel_listen_t* listen;
+    /* The connections of the tunnel, run by one of the workers */
+    tunnel_io_t* io;
     union {
         struct
         {
             localservice_t* service;
             server_t* server;
-            char* remote_host;
-            char* local_host;
         } local;
         struct
         {
@@ -170,13 +307,181 @@ typedef struct _tunnel_t
     } source;
 } tunnel_t;
 
-typedef struct _tunnel_port_t
+/* The data part of a tunnel. Created by the main thread and then only
+ * touched by the worker it was given to until the worker hands it back
+ * with either tunnel_io_lost_job or tunnel_io_closed_job */
+struct _tunnel_io_t
+{
+    daemon_t daemon;
+    worker_t worker;
+    size_t worker_idx;
+    uint32_t id;
+    bool remote;
+
+    /* Only used by the main thread */
+    tunnel_t* tunnel;
+    bool lost;
+    detach_t detach;
+    /* Jobs given to the worker that it hasn't answered yet, a lost tunnel
+     * is freed by the last answer */
+    unsigned int jobs;
+
+    /* Only used by the worker after tunnel_io_adopt_job */
+    /* Local conn is the connection on the daemon side to either a client
+     * or service depending on "remote".
+     * Daemon conn is the connection to the other daemon. */
+    conn_t local_conn, daemon_conn;
+    bool stasis, dead;
+    /* If send_token is true, token is sent when daemon conn is connected */
+    bool send_token;
+    char token[PKG_TUNNEL_TOKEN_SIZE];
+    http_proxy_t proxy;
+    char* source_host, *target_host;
+    codec_method_t compress;
+    /* Remove the route from requests to the local service, see
+     * SERVICE_ROUTE_PREFIX */
+    bool strip_route;
+    /* What the main thread read from the local conn to route it, goes
+     * first to the other daemon */
+    char* head;
+    size_t headlen;
+    /* What the old daemon had read from (resume_in, still compressed) and
+     * had for (resume_out, in stasis) the other daemon when it handed the
+     * tunnel over */
+    char* resume_in, *resume_out;
+    size_t resume_inlen, resume_outlen;
+    /* Handing over, detaching while the codecs are taken to the end of
+     * their streams and frozen once the sockets are out of the selector,
+     * see tunnel_io_detach_job */
+    bool detaching, frozen;
+
+    /* Set by the worker before posting tunnel_io_lost_job */
+    bool daemon_alive;
+
+    /* Scheduling, set by the main thread and then only used by the
+     * worker. budget is what the tunnel may still read before the other
+     * busy tunnels of the worker get their turn, it is reset to quantum
+     * when it gets its turn. throttled is set when reading stopped because
+     * of the budget or the rate limit and backlogged while it waits in the
+     * queue of the worker */
+    size_t quantum, budget;
+    bool throttled, backlogged;
+    /* Token bucket, rate in bytes per second or 0 if not limited */
+    unsigned long rate, tokens;
+    /* timers_now of the worker */
+    uint64_t refilled;
+    timecb_t ratecb;
+};
+
+/* The tunnels of a worker that ran out of budget with data left to move,
+ * each gets another quantum in the order they ran out every time
+ * tunnel_sched_job runs. Only touched by the worker */
+typedef struct _tunnel_sched_t
+{
+    vector_t queue, running;
+    /* true while tunnel_sched_job is posted but not yet run */
+    bool posted;
+} tunnel_sched_t;
+
+typedef struct _tunnel_rate_t
+{
+    /* A service type or the start of one */
+    char* type;
+    unsigned long rate;
+} tunnel_rate_t;
+
+typedef struct _tunnel_attach_t
 {
+    tunnel_io_t* io;
+    socket_t sock;
+    conn_state_t state;
+    bool send_token;
+    char token[PKG_TUNNEL_TOKEN_SIZE];
+} tunnel_attach_t;
+
+/* A client connection accepted on the service port, waiting for the
+ * Request-Line that says which service it is for. Or for the whole header
+ * if it is a subscription to events */
+typedef struct _service_pending_t
+{
+    daemon_t daemon;
+    /* Set if accepted on the socket of the service, which needs no route */
+    remoteservice_t* remote;
+    socket_t sock;
+    struct sockaddr* addr;
+    socklen_t addrlen;
+    char line[SERVICE_LINE_MAX];
+    size_t got;
+    timecb_t timeoutcb;
+} service_pending_t;
+
+typedef struct _service_route_t
+{
+    uint32_t route;
+    remoteservice_t* remote;
+} service_route_t;
+
+/* Descriptions often refer to the rest of the service with absolute
+ * paths, which don't have the route. Those requests go to the service the
+ * client last asked for with a route */
+typedef struct _service_client_t
+{
+    struct sockaddr* addr;
+    socklen_t addrlen;
+    uint32_t route;
+} service_client_t;
+
+/* Servers talking version 1 know nothing about the shared tunnel port,
+ * each tunnel with them listens on a port of its own until the server
+ * connects */
+struct _tunnel_listen_t
+{
+    daemon_t daemon;
     socket_t sock;
     tunnel_t* tunnel;
     server_t* server;
+};
+
+/* A connection accepted on the tunnel port, waiting for its token */
+typedef struct _tunnel_pending_t
+{
+    daemon_t daemon;
+    socket_t sock;
+    struct sockaddr* addr;
+    socklen_t addrlen;
+    char token[PKG_TUNNEL_TOKEN_SIZE];
+    size_t got;
+    timecb_t timeoutcb;
+} tunnel_pending_t;
+
+/* Events (GENA), the subscriptions are kept by daemon->gena. The main
+ * thread runs the connections for it */
+
+/* A request of the main thread, NOTIFY to a client say. The connection is
+ * closed once the header of the response is read */
+typedef struct _gena_exchange_t
+{
+    daemon_t daemon;
+    socket_t sock;
+    bool sent;
+    char* out;
+    size_t outlen, outpos;
+    char in[GENA_HEAD_MAX];
+    size_t got;
+    timecb_t timeoutcb;
+    gena_done_t done;
+    void* userdata;
+} gena_exchange_t;
+
+/* A connection accepted on gena_sock, waiting for the whole NOTIFY */
+typedef struct _gena_incoming_t
+{
     daemon_t daemon;
-} tunnel_port_t;
+    socket_t sock;
+    char* data;
+    size_t got, size;
+    timecb_t timeoutcb;
+} gena_incoming_t;
 
 struct _daemon_t
 {
@@ -189,34 +494,134 @@ struct _daemon_t
     selector_t selector;
     timers_t timers;
 
+    /* control is the mailbox of the main thread, the tunnels are run by
+     * the workers. If there are no worker threads the only worker is
+     * control */
+    worker_t control;
+    worker_t* worker;
+    size_t* worker_load;
+    tunnel_sched_t* worker_sched;
+    size_t workers;
+    int worker_threads;
+
     ssdp_t ssdp;
 
     char* bind_multicast;
+    uint16_t multicast_port;
     char* bind_server;
     char* bind_services;
     char* bind_tunnelport;
     uint16_t server_port;
     socket_t serv_sock;
 
-    server_t* server;
+    /* Each server is allocated on its own, timers, the selector, tunnels
+     * and remote services point to them */
+    server_t** server;
     size_t servers;
-
-    uint32_t local_id;
-    map_t locals;
+    bool servers_dirty;
+    size_t server_high_water;
+    /* Compression methods to offer servers, a mask as codec_methods() */
+    unsigned int compress_methods;
+
+    /* Scheduling of new tunnels, see tunnel_io_t */
+    size_t tunnel_quantum;
+    size_t io_budget;
+    vector_t tunnel_rates;
+    /* Limit on responses to M-SEARCH, see ssdp_set_search_limit */
+    unsigned long search_rate, search_burst;
+    /* Searches left of the startup burst, see daemon_discover_cb */
+    unsigned int discover_left;
+    timecb_t discover_timecb;
+    /* Where the local services are saved to survive a restart, NULL if
+     * they are not, see daemon_save_state */
+    char* state_file;
+    unsigned long state_interval;
+    timecb_t state_timecb;
+
+    /* Service IDs are handed out by the slotmap, see remote_tunnels */
+    slotmap_t locals;
     map_t remotes;
+    /* locals by service type and USN without the versions, remotes by
+     * the whole type and USN, see service_key */
+    svcindex_t local_index;
+    svcindex_t remote_index;
+    /* The strings of localservice_t and the server, opt and nls of
+     * remoteservice_t */
+    strtab_t strings;
 
     char* ssdp_s;
     uuid_t uuid;
 
-    uint16_t tunnel_port_first;
-    size_t tunnel_port_count;
-    tunnel_port_t* tunnel_port;
+    /* All tunnels share one listening port, tunnel_pending holds the
+     * accepted connections that has yet to send their token */
+    uint16_t tunnel_port;
+    socket_t tunnel_sock;
+    vector_t tunnel_pending;
+
+    /* If service_port isn't 0 the services of servers that can strip the
+     * routes share one listening port. service_routes maps the routes to
+     * the services, service_clients is a list of service_client_t with
+     * the most recent last */
+    uint16_t service_port;
+    socket_t service_sock;
+    vector_t service_pending;
+    uint32_t service_route;
+    map_t service_routes;
+    vector_t service_clients;
+
+    /* Events, see gena_t. The local services send their events to
+     * gena_sock, -1 until the first subscription at one */
+    gena_t gena;
+    socket_t gena_sock;
+    vector_t gena_incoming;
+    vector_t gena_exchanges;
+
+    /* The executable started by daemon_handover_start */
+    char* exe;
+    /* While handing over, the socket to the new daemon and its pid.
+     * handover_waiting is the number of tunnels in DETACH_WAIT */
+    socket_t handover_peer;
+    pid_t handover_pid;
+    timecb_t handover_timecb;
+    size_t handover_waiting;
+    bool handed_over;
+    /* Given with -H, the socket to take over from the old daemon with */
+    socket_t handover_sock;
 };
 
+typedef struct _config_server_t
+{
+    struct sockaddr* host;
+    socklen_t hostlen;
+} config_server_t;
+
+/* The config file as read by config_read, load_config only applies what
+ * differs from the running daemon */
+typedef struct _config_t
+{
+    char* bind_multicast, *bind_server, *bind_services, *bind_tunnelport;
+    uint16_t multicast_port, server_port, tunnel_port, service_port;
+    int worker_threads;
+    size_t server_high_water;
+    unsigned int compress_methods;
+    size_t tunnel_quantum, io_budget;
+    unsigned long search_rate, search_burst;
+    /* NULL if there is to be no state file */
+    char* state_file;
+    unsigned long state_interval;
+    vector_t tunnel_rates;
+    /* config_server_t */
+    vector_t servers;
+} config_t;
+
 static bool handle_args(daemon_t daemon, int argc, char** argv, int* exitcode);
 static bool load_config(daemon_t daemon);
 static int run_daemon(daemon_t daemon);
 static void free_daemon(daemon_t daemon);
+static char* daemon_cache_file(const char* name);
+static void daemon_setup_state_timer(daemon_t daemon);
+static void daemon_save_state(daemon_t daemon);
+static void daemon_load_state(daemon_t daemon);
 
 static void server_init(daemon_t daemon,
                         server_t* srv,
@@ -224,8 +629,6 @@ static void server_init(daemon_t daemon,
 static void server_free(daemon_t daemon, server_t* srv);
 static void server_free2(server_t* srv);
 
-static uint32_t localservice_hash(const void* _local);
-static bool localservice_eq(const void* _l1, const void* _l2);
 static void localservice_free(void* _local);
 
 static uint32_t remoteservice_hash(const void* _remote);
@@ -236,24 +639,34 @@ static bool daemon_setup_remote_server(daemon_t daemon, server_t* srv);
 
 static void daemon_server_flush_output(server_t* server);
 static void daemon_server_write_pkg(server_t* server, pkg_t* pkg, bool flush);
+static void daemon_flush_servers(daemon_t daemon);
+static void daemon_log_stats(daemon_t daemon);
+static void daemon_server_connected(server_t* server);
+static void daemon_server_hello_done(server_t* server, unsigned int version,
+                                     unsigned int compress);
+static bool daemon_server_resync(server_t* server);
+static size_t daemon_server_queue_pkg(server_t* server, pkg_t* pkg,
+                                      unsigned int prio);
 
-static void daemon_tunnel_flush(tunnel_t* tunnel);
-
-static bool parse_location(const char* location, char** proto,
-                           struct sockaddr** host, socklen_t* hostlen,
-                           char** path);
-static char* build_location(const char* proto, const struct sockaddr* host,
-                            socklen_t hostlen, const char* path);
+static void daemon_tunnel_flush(tunnel_io_t* io);
 
 static long daemon_remoteservice_touch(void* userdata);
 static long daemon_localservice_expire(void* userdata);
 
+static void daemon_gena_drop_server(daemon_t daemon, server_t* srv,
+                                    bool tell);
+
 int main(int argc, char** argv)
 {
     struct _daemon_t daemon;
     int exitcode;
     memset(&daemon, 0, sizeof(daemon));
     daemon.serv_sock = -1;
+    daemon.tunnel_sock = -1;
+    daemon.service_sock = -1;
+    daemon.gena_sock = -1;
+    daemon.handover_peer = -1;
+    daemon.handover_sock = -1;
     daemon.daemonize = true;
     daemon.log = log_open();
 #if HAVE_UUID_CREATE
@@ -275,7 +688,8 @@ int main(int argc, char** argv)
         return EXIT_FAILURE;
     }
 
-    if (daemon.daemonize)
+    /* A daemon taking over is already in the background */
+    if (daemon.daemonize && daemon.handover_sock < 0)
     {
         pid_t pid = fork();
         if (pid == 0)
@@ -316,6 +730,7 @@ static void print_usage(void)
     fputs("Mandatory arguments to long options are mandatory for short options too.\n", stdout);
     fputs("  -C, --config=FILE    load config from FILE instead of default\n", stdout);
     fputs("  -D, --debug          run in debug mode, do not fork into background and log to stderr\n", stdout);
+    fputs("  -H, --handover=FD    take over from the daemon that started this one, used by SIGUSR2\n", stdout);
     fputs("  -h, --help           display this text and exit\n", stdout);
     fputs("  -V, --version        display version and exit\n", stdout);
     fputs("\n", stdout);
@@ -334,12 +749,14 @@ bool handle_args(daemon_t daemon, int argc, char** argv, int* exitcode)
         { "version", no_argument, NULL, 'V' },
         { "debug",   no_argument, NULL, 'D' },
         { "config",  required_argument, NULL, 'C' },
+        { "handover", required_argument, NULL, 'H' },
         { NULL,      0,           NULL, '\0' }
     };
 #endif
-    static const char* short_opts = "hVDC:";
+    static const char* short_opts = "hVDC:H:";
     bool usage = false, version = false, debug = false, error = false;
     const char* cfg = NULL;
+    socket_t handover = -1;
     opterr = 1;
     for (;;)
     {
@@ -367,6 +784,21 @@ bool handle_args(daemon_t daemon, int argc, char** argv, int* exitcode)
         case 'D':
             debug = true;
             break;
+        case 'H':
+        {
+            char* end;
+            long fd = strtol(optarg, &end, 10);
+            if (*optarg == '\0' || *end != '\0' || fd < 0 || fd > INT_MAX)
+            {
+                fprintf(stderr, "Invalid handover socket: %s\n", optarg);
+                error = true;
+            }
+            else
+            {
+                handover = (socket_t)fd;
+            }
+            break;
+        }
         case '?':
         default:
             error = true;
@@ -404,10 +836,23 @@ bool handle_args(daemon_t daemon, int argc, char** argv, int* exitcode)
     {
         daemon->daemonize = false;
     }
+    /* Both are needed again by daemon_handover_start, after the chdir in
+     * main */
     if (cfg != NULL)
     {
-        daemon->cfgfile = strdup(cfg);
+        daemon->cfgfile = realpath(cfg, NULL);
+        if (daemon->cfgfile == NULL)
+        {
+            daemon->cfgfile = strdup(cfg);
+        }
+    }
+    daemon->exe = strchr(argv[0], '/') != NULL ? realpath(argv[0], NULL)
+        : NULL;
+    if (daemon->exe == NULL)
+    {
+        daemon->exe = strdup(argv[0]);
     }
+    daemon->handover_sock = handover;
     return true;
 }
 
@@ -457,6 +902,98 @@ static bool valid_bind(log_t log, const char* key, const char* bindaddr)
     return true;
 }
 
+/* value is auto, none or the name of a method, methods is set to the mask
+ * to offer other servers */
+static bool valid_compression(log_t log, const char* key, const char* value,
+                              unsigned int* methods)
+{
+    int method;
+    if (value == NULL || strcmp(value, "auto") == 0)
+    {
+        *methods = codec_methods();
+        return true;
+    }
+    for (method = CODEC_NONE; method <= CODEC_ZSTD; ++method)
+    {
+        if (strcmp(value, codec_method_str(method)) == 0)
+        {
+            if (!(codec_methods() & (1 << method)))
+            {
+                log_printf(log, LVL_ERR,
+                           "Compression given for `%s` is not available: `%s`",
+                           key, value);
+                return false;
+            }
+            *methods = (1 << CODEC_NONE) | (1 << method);
+            return true;
+        }
+    }
+    log_printf(log, LVL_ERR,
+               "Not a valid compression given for `%s`: `%s`", key, value);
+    return false;
+}
+
+static void free_tunnel_rates(vector_t rates)
+{
+    size_t i;
+    if (rates == NULL)
+    {
+        return;
+    }
+    for (i = 0; i < vector_size(rates); ++i)
+    {
+        free(((tunnel_rate_t*)vector_get(rates, i))->type);
+    }
+    vector_free(rates);
+}
+
+/* list is <service type>=<bytes per second> separated by space or comma */
+static bool valid_tunnel_rates(log_t log, const char* key, const char* list,
+                               vector_t* rates)
+{
+    bool err = false;
+    *rates = vector_new(sizeof(tunnel_rate_t));
+    if (list != NULL)
+    {
+        char* tmp = strdup(list);
+        char* token = strtok(tmp, " ,");
+        while (token != NULL)
+        {
+            tunnel_rate_t rate;
+            char* pos = strrchr(token, '=');
+            char* end = NULL;
+            long _tmp = -1;
+            if (pos != NULL && pos > token)
+            {
+                *pos = '\0';
+                ++pos;
+                errno = 0;
+                _tmp = strtol(pos, &end, 10);
+            }
+            if (_tmp <= 0 || errno || end == NULL || *end != '\0')
+            {
+                log_printf(log, LVL_ERR,
+                           "An invalid rate limit found in `%s`: `%s`",
+                           key, token);
+                err = true;
+                break;
+            }
+            rate.type = strdup(token);
+            rate.rate = _tmp;
+            vector_push(*rates, &rate);
+            token = strtok(NULL, " ,");
+        }
+        free(tmp);
+    }
+    if (err)
+    {
+        free_tunnel_rates(*rates);
+        *rates = NULL;
+        return false;
+    }
+    return true;
+}
+
 static bool valid_port(log_t log, const char* key, int port)
 {
     if (port < 0 || port > 0xffff)
@@ -469,12 +1006,27 @@ static bool valid_port(log_t log, const char* key, int port)
     return true;
 }
 
-static bool valid_servers(daemon_t daemon, const char* key, const char* list,
-                          server_t** server, size_t* servers)
+static void free_config_servers(vector_t servers)
+{
+    size_t i;
+    if (servers == NULL)
+    {
+        return;
+    }
+    for (i = 0; i < vector_size(servers); ++i)
+    {
+        free(((config_server_t*)vector_get(servers, i))->host);
+    }
+    vector_free(servers);
+}
+
+/* list is <host>[:<port>] separated by space or comma, a server listed
+ * twice is only used once */
+static bool valid_servers(log_t log, const char* key, const char* list,
+                          vector_t* servers)
 {
-    server_t* srv = NULL;
-    size_t srvcnt = 0, alloc = 0;
     bool err = false;
+    *servers = vector_new(sizeof(config_server_t));
     if (list != NULL)
     {
         char* tmp = strdup(list);
@@ -482,9 +1034,9 @@ static bool valid_servers(daemon_t daemon, const char* key, const char* list,
         while (token != NULL)
         {
             char* pos = strchr(token, ':');
-            struct sockaddr* host;
-            socklen_t hostlen;
+            config_server_t srv;
             uint16_t port;
+            size_t i;
             if (pos == NULL)
             {
                 port = DEFAULT_PORT;
@@ -500,7 +1052,7 @@ static bool valid_servers(daemon_t daemon, const char* key, const char* list,
                 if (errno || _tmp < 0 || _tmp > 0xffff
                     || end == NULL || *end != '\0')
                 {
-                    log_printf(daemon->log, LVL_ERR,
+                    log_printf(log, LVL_ERR,
                                "An invalid port found in `%s`: `%s`",
                                key, pos);
                     err = true;
@@ -508,54 +1060,42 @@ static bool valid_servers(daemon_t daemon, const char* key, const char* list,
                 }
                 port = (uint16_t)(_tmp & 0xffff);
             }
-            host = parse_addr(token, port, &hostlen, true);
-            if (host == NULL)
+            srv.host = parse_addr(token, port, &srv.hostlen, true);
+            if (srv.host == NULL)
             {
-                log_printf(daemon->log, LVL_ERR,
+                log_printf(log, LVL_ERR,
                            "An invalid host found in `%s`: `%s`",
                            key, token);
                 err = true;
                 break;
             }
-            if (srvcnt == alloc)
+            for (i = 0; i < vector_size(*servers); ++i)
             {
-                size_t na = alloc * 2;
-                server_t* s;
-                if (na < 4) na = 4;
-                s = realloc(srv, na * sizeof(server_t));
-                if (s == NULL)
+                config_server_t* other = vector_get(*servers, i);
+                if (socket_samehostandport(other->host, other->hostlen,
+                                           srv.host, srv.hostlen))
                 {
-                    na = alloc + 10;
-                    s = realloc(srv, na * sizeof(server_t));
-                    if (s == NULL)
-                    {
-                        free(host);
-                        err = true;
-                        break;
-                    }
+                    break;
                 }
-                srv = s;
-                alloc = na;
             }
-            server_init(daemon, srv + srvcnt, host, hostlen);
-            ++srvcnt;
+            if (i < vector_size(*servers))
+            {
+                free(srv.host);
+            }
+            else
+            {
+                vector_push(*servers, &srv);
+            }
             token = strtok(NULL, " ,");
         }
         free(tmp);
     }
     if (err)
     {
-        size_t s;
-        for (s = 0; s < srvcnt; ++s)
-        {
-            server_free2(srv + s);
-        }
-        free(srv);
+        free_config_servers(*servers);
+        *servers = NULL;
         return false;
     }
-
-    *server = srv;
-    *servers = srvcnt;
     return true;
 }
 
@@ -713,6 +1253,67 @@ static inline bool same_upnp_version(const char* search_urn, const char* search_
     return search_version <= max_version;
 }
 
+/* Length of the type and USN used as key in the service indexes, without
+ * the versions if the positions of them are given */
+static void service_key(const char* nt, const char* nt_pos,
+                        const char* usn, const char* usn_pos,
+                        size_t* ntlen, size_t* usnlen)
+{
+    *ntlen = nt_pos != NULL ? (size_t)(nt_pos - nt) : strlen(nt);
+    *usnlen = usn_pos != NULL ? (size_t)(usn_pos - usn) : strlen(usn);
+}
+
+static void local_index_add(daemon_t daemon, localservice_t* local)
+{
+    size_t ntlen, usnlen;
+    service_key(local->service, local->service_version_pos,
+                local->usn, local->usn_version_pos, &ntlen, &usnlen);
+    svcindex_add(daemon->local_index, local->service, ntlen,
+                 local->usn, usnlen, local);
+}
+
+static void local_index_remove(daemon_t daemon, localservice_t* local)
+{
+    size_t ntlen, usnlen;
+    service_key(local->service, local->service_version_pos,
+                local->usn, local->usn_version_pos, &ntlen, &usnlen);
+    svcindex_remove(daemon->local_index, local->service, ntlen,
+                    local->usn, usnlen, local);
+}
+
+/* The local service notify is about. nt_pos, usn_pos and version are from
+ * find_upnp_version on the type and USN of notify */
+static localservice_t* daemon_find_local(daemon_t daemon,
+                                         const ssdp_notify_t* notify,
+                                         const char* nt_pos,
+                                         const char* usn_pos,
+                                         unsigned int version)
+{
+    void* const* locals;
+    size_t ntlen, usnlen, count, i;
+    service_key(notify->nt, nt_pos, notify->usn, usn_pos, &ntlen, &usnlen);
+    locals = svcindex_get(daemon->local_index, notify->nt, ntlen,
+                          notify->usn, usnlen, &count);
+    for (i = 0; i < count; ++i)
+    {
+        localservice_t* local = locals[i];
+        if ((strcmp(local->usn, notify->usn) == 0 &&
+             strcmp(local->service, notify->nt) == 0) ||
+            (same_upnp_version(notify->nt, nt_pos, version,
+                               local->service, local->service_version_pos,
+                               local->version_max)
+             &&
+             ((local->usn_version_pos == NULL && usn_pos == NULL) ||
+              same_upnp_version(notify->usn, usn_pos, version,
+                                local->usn, local->usn_version_pos,
+                                local->version_max))))
+        {
+            return local;
+        }
+    }
+    return NULL;
+}
+
 static void daemon_ssdp_search_cb(void* userdata, ssdp_search_t* search)
 {
     daemon_t daemon = (daemon_t)userdata;
@@ -760,15 +1361,23 @@ static void daemon_ssdp_search_cb(void* userdata, ssdp_search_t* search)
     }
 }
 
-static bool daemon_add_local(daemon_t daemon, ssdp_notify_t* notify)
+/* Seconds on the clock of the timers, the same as ssdp_now */
+static time_t daemon_now(daemon_t daemon)
+{
+    return timers_now(daemon->timers) / 1000;
+}
+
+/* Add the service with a new ID if id is 0, returns NULL on error */
+static localservice_t* daemon_new_local(daemon_t daemon,
+                                        ssdp_notify_t* notify, uint32_t id)
 {
     localservice_t local, *localptr;
-    time_t now = time(NULL);
+    time_t now = daemon_now(daemon);
     assert(notify->usn);
     if (notify->nt == NULL || notify->location == NULL ||
         notify->expires <= now)
     {
-        return false;
+        return NULL;
     }
     memset(&local, 0, sizeof(localservice_t));
     if (!parse_location(notify->location, NULL,
@@ -776,13 +1385,13 @@ static bool daemon_add_local(daemon_t daemon, ssdp_notify_t* notify)
     {
         log_printf(daemon->log, LVL_WARN, "Bad local service location: %s",
                    notify->location);
-        return false;
+        return NULL;
     }
-    local.usn = strdup(notify->usn);
-    local.service = strdup(notify->nt);
-    local.server = safestrdup(notify->server);
-    local.opt = safestrdup(notify->opt);
-    local.nls = safestrdup(notify->nls);
+    local.usn = strtab_intern(daemon->strings, notify->usn);
+    local.service = strtab_intern(daemon->strings, notify->nt);
+    local.server = strtab_intern(daemon->strings, notify->server);
+    local.opt = strtab_intern(daemon->strings, notify->opt);
+    local.nls = strtab_intern(daemon->strings, notify->nls);
 
     local.service_version_pos = find_upnp_version(local.service,
                                                   &(local.version_max));
@@ -796,21 +1405,44 @@ static bool daemon_add_local(daemon_t daemon, ssdp_notify_t* notify)
         }
     }
 
-    local.location = strdup(notify->location);
+    local.location = strtab_intern(daemon->strings, notify->location);
     local.expires = notify->expires;
     local.daemon = daemon;
-    for (;;)
+    if (id != 0)
     {
-        local.id = ++daemon->local_id;
-        if (map_get(daemon->locals, &local) == NULL)
+        local.id = id;
+        localptr = slotmap_put_id(daemon->locals, &local, id);
+        if (localptr == NULL)
         {
-            break;
+            free(local.host);
+            strtab_release(daemon->strings, local.usn);
+            strtab_release(daemon->strings, local.location);
+            strtab_release(daemon->strings, local.service);
+            strtab_release(daemon->strings, local.server);
+            strtab_release(daemon->strings, local.opt);
+            strtab_release(daemon->strings, local.nls);
+            return NULL;
         }
     }
-    localptr = map_put(daemon->locals, &local);
+    else
+    {
+        localptr = slotmap_put(daemon->locals, &local, &local.id);
+    }
+    localptr->id = local.id;
+    local_index_add(daemon, localptr);
     localptr->expirecb = timers_add(daemon->timers,
                                     (localptr->expires - now) * 1000,
                                     localptr, daemon_localservice_expire);
+    return localptr;
+}
+
+static bool daemon_add_local(daemon_t daemon, ssdp_notify_t* notify)
+{
+    localservice_t* localptr = daemon_new_local(daemon, notify, 0);
+    if (localptr == NULL)
+    {
+        return false;
+    }
 
     {
         /* Tell all connected servers about the new service */
@@ -821,32 +1453,51 @@ static bool daemon_add_local(daemon_t daemon, ssdp_notify_t* notify)
                         localptr->nls);
         for (i = 0; i < daemon->servers; ++i)
         {
-            daemon_server_write_pkg(daemon->server + i, &pkg, true);
+            daemon_server_write_pkg(daemon->server[i], &pkg, true);
         }
     }
 
     return true;
 }
 
+/* Replace *str with the interned value, returns false if they were the
+ * same already */
+static bool daemon_update_str(daemon_t daemon, char** str, char* value)
+{
+    if (value == *str)
+    {
+        strtab_release(daemon->strings, value);
+        return false;
+    }
+    strtab_release(daemon->strings, *str);
+    *str = value;
+    return true;
+}
+
 static void daemon_update_local(daemon_t daemon, localservice_t* local,
                                 ssdp_notify_t* notify)
 {
+    char* service, *usn, *location;
+    bool reindex;
     if (notify->nts != NULL && strcmp(notify->nts, "ssdp:byebye") == 0)
     {
-        map_remove(daemon->locals, local);
+        slotmap_remove(daemon->locals, local->id);
         return;
     }
-    if (strcmp(local->service, notify->nt) != 0)
+    service = strtab_intern(daemon->strings, notify->nt);
+    usn = strtab_intern(daemon->strings, notify->usn);
+    reindex = service != local->service || usn != local->usn;
+    if (reindex)
+    {
+        local_index_remove(daemon, local);
+    }
+    if (daemon_update_str(daemon, &(local->service), service))
     {
-        free(local->service);
-        local->service = strdup(notify->nt);
         local->service_version_pos = find_upnp_version(local->service,
                                                        &(local->version_max));
     }
-    if (strcmp(local->usn, notify->usn) != 0)
+    if (daemon_update_str(daemon, &(local->usn), usn))
     {
-        free(local->usn);
-        local->usn = strdup(notify->usn);
         if (local->service_version_pos != NULL)
         {
             unsigned int x;
@@ -861,65 +1512,55 @@ static void daemon_update_local(daemon_t daemon, localservice_t* local,
             local->usn_version_pos = NULL;
         }
     }
-    if (strcmp(local->location, notify->location) != 0)
+    if (reindex)
+    {
+        local_index_add(daemon, local);
+    }
+    location = strtab_intern(daemon->strings, notify->location);
+    if (location != local->location)
     {
         struct sockaddr* host;
         socklen_t hostlen;
         if (parse_location(notify->location, NULL, &host, &hostlen, NULL))
         {
-            free(local->location);
+            daemon_update_str(daemon, &(local->location), location);
             free(local->host);
-            local->location = strdup(notify->location);
             local->host = host;
             local->hostlen = hostlen;
+            location = NULL;
         }
     }
-    if (safestrcmp(local->server, notify->server) != 0)
-    {
-        free(local->server);
-        local->server = safestrdup(notify->server);
-    }
-    if (safestrcmp(local->nls, notify->nls) != 0)
-    {
-        free(local->nls);
-        local->nls = safestrdup(notify->nls);
-    }
-    if (safestrcmp(local->opt, notify->opt) != 0)
-    {
-        free(local->opt);
-        local->opt = safestrdup(notify->opt);
-    }
+    strtab_release(daemon->strings, location);
+    daemon_update_str(daemon, &(local->server),
+                      strtab_intern(daemon->strings, notify->server));
+    daemon_update_str(daemon, &(local->nls),
+                      strtab_intern(daemon->strings, notify->nls));
+    daemon_update_str(daemon, &(local->opt),
+                      strtab_intern(daemon->strings, notify->opt));
     if (local->expires != notify->expires)
     {
         local->expires = notify->expires;
         if (local->expirecb != NULL)
         {
             timecb_reschedule(local->expirecb,
-                              (local->expires - time(NULL)) * 1000);
+                              (local->expires - daemon_now(daemon)) * 1000);
         }
         else
         {
             local->expirecb = timers_add(local->daemon->timers,
-                                         (local->expires - time(NULL)) * 1000,
+                                         (local->expires - daemon_now(daemon)) * 1000,
                                          local, daemon_localservice_expire);
         }
     }
 }
 
-static void daemon_ssdp_search_resp_cb(void* userdata, ssdp_search_t* search,
-                                       ssdp_notify_t* notify)
+/* Add or update the local service, for answers to our searches and the
+ * services read from state_file */
+static void daemon_seen_local(daemon_t daemon, ssdp_notify_t* notify)
 {
-    daemon_t daemon = (daemon_t)userdata;
-    size_t i;
-    bool reset_nt = false;
+    localservice_t* local;
     char* service_pos, * usn_pos = NULL;
     unsigned int version;
-    assert(search->st && notify->usn);
-    if (notify->nt == NULL)
-    {
-        notify->nt = search->st;
-        reset_nt = true;
-    }
     service_pos = find_upnp_version(notify->nt, &version);
     if (service_pos != NULL)
     {
@@ -930,35 +1571,38 @@ static void daemon_ssdp_search_resp_cb(void* userdata, ssdp_search_t* search,
             usn_pos = NULL;
         }
     }
-    for (i = map_begin(daemon->locals); i != map_end(daemon->locals);
-         i = map_next(daemon->locals, i))
+    local = daemon_find_local(daemon, notify, service_pos, usn_pos, version);
+    if (local != NULL)
     {
-        localservice_t* local = map_getat(daemon->locals, i);
-        if ((strcmp(local->usn, notify->usn) == 0 &&
-             strcmp(local->service, notify->nt) == 0) ||
-            (same_upnp_version(notify->nt, service_pos, version,
-                               local->service, local->service_version_pos,
-                               local->version_max)
-             &&
-             ((local->usn_version_pos == NULL && usn_pos == NULL) ||
-              same_upnp_version(notify->usn, usn_pos, version,
-                                local->usn, local->usn_version_pos,
-                                local->version_max))))
-        {
-            daemon_update_local(daemon, local, notify);
-            if (reset_nt) notify->nt = NULL;
-            return;
-        }
+        daemon_update_local(daemon, local, notify);
+    }
+    else
+    {
+        daemon_add_local(daemon, notify);
     }
-    daemon_add_local(daemon, notify);
-    if (reset_nt) notify->nt = NULL;
 }
 
-static void daemon_ssdp_notify_cb(void* userdata, ssdp_notify_t* notify)
+static void daemon_ssdp_search_resp_cb(void* userdata, ssdp_search_t* search,
+                                       ssdp_notify_t* notify)
 {
     daemon_t daemon = (daemon_t)userdata;
-    size_t i;
-    char* nt_pos, * usn_pos = NULL;
+    bool reset_nt = false;
+    assert(search->st && notify->usn);
+    if (notify->nt == NULL)
+    {
+        notify->nt = search->st;
+        reset_nt = true;
+    }
+    daemon_seen_local(daemon, notify);
+    if (reset_nt) notify->nt = NULL;
+}
+
+static void daemon_ssdp_notify_cb(void* userdata, ssdp_notify_t* notify)
+{
+    daemon_t daemon = (daemon_t)userdata;
+    localservice_t* local;
+    size_t count;
+    char* nt_pos, * usn_pos = NULL;
     unsigned int version;
     nt_pos = find_upnp_version(notify->nt, &version);
     if (nt_pos != NULL)
@@ -970,35 +1614,18 @@ static void daemon_ssdp_notify_cb(void* userdata, ssdp_notify_t* notify)
             usn_pos = NULL;
         }
     }
-    for (i = map_begin(daemon->remotes); i != map_end(daemon->remotes);
-         i = map_next(daemon->remotes, i))
+    svcindex_get(daemon->remote_index, notify->nt, strlen(notify->nt),
+                 notify->usn, strlen(notify->usn), &count);
+    if (count > 0)
     {
-        remoteservice_t* remote = map_getat(daemon->remotes, i);
-        if (strcmp(remote->notify.usn, notify->usn) == 0 &&
-            strcmp(remote->notify.nt, notify->nt) == 0)
-        {
-            /* One of our own */
-            return;
-        }
+        /* One of our own */
+        return;
     }
-    for (i = map_begin(daemon->locals); i != map_end(daemon->locals);
-         i = map_next(daemon->locals, i))
+    local = daemon_find_local(daemon, notify, nt_pos, usn_pos, version);
+    if (local != NULL)
     {
-        localservice_t* local = map_getat(daemon->locals, i);
-        if ((strcmp(local->usn, notify->usn) == 0 &&
-             strcmp(local->service, notify->nt) == 0) ||
-            (same_upnp_version(notify->nt, nt_pos, version,
-                               local->service, local->service_version_pos,
-                               local->version_max)
-             &&
-             ((local->usn_version_pos == NULL && usn_pos == NULL) ||
-              same_upnp_version(notify->usn, usn_pos, version,
-                                local->usn, local->usn_version_pos,
-                                local->version_max))))
-        {
-            daemon_update_local(daemon, local, notify);
-            return;
-        }
+        daemon_update_local(daemon, local, notify);
+        return;
     }
     if (strcmp(notify->nts, "ssdp:alive") == 0)
     {
@@ -1006,14 +1633,31 @@ static void daemon_ssdp_notify_cb(void* userdata, ssdp_notify_t* notify)
     }
 }
 
-static bool daemon_setup_ssdp(daemon_t daemon)
+static long daemon_discover_cb(void* userdata)
 {
+    daemon_t daemon = userdata;
     ssdp_search_t search;
+    memset(&search, 0, sizeof(search));
+    search.s = daemon->ssdp_s;
+    search.st = (char*)"ssdp:all";
+    search.mx = 1;
+    ssdp_search_all(daemon->ssdp, &search);
+    if (--daemon->discover_left > 0)
+    {
+        return 0;
+    }
+    daemon->discover_timecb = NULL;
+    return -1;
+}
+
+static bool daemon_setup_ssdp(daemon_t daemon)
+{
     assert(daemon->selector != NULL && daemon->ssdp == NULL);
     daemon->ssdp = ssdp_new(daemon->log,
                             daemon->selector,
                             daemon->timers,
                             daemon->bind_multicast,
+                            daemon->multicast_port,
                             daemon, daemon_ssdp_search_cb,
                             daemon_ssdp_search_resp_cb,
                             daemon_ssdp_notify_cb);
@@ -1022,15 +1666,21 @@ static bool daemon_setup_ssdp(daemon_t daemon)
         log_puts(daemon->log, LVL_ERR, "Failed to setup SSDP");
         return false;
     }
-    search.host = ssdp_getnotifyhost(daemon->ssdp, &search.hostlen);
-    if (search.host != NULL)
+    ssdp_set_search_limit(daemon->ssdp, daemon->search_rate,
+                          daemon->search_burst);
+    /* Search now and a few more times to find the local services quickly,
+     * with a short MX as nobody is waiting for the answers but us */
+    if (daemon->discover_timecb != NULL)
     {
-        search.s = daemon->ssdp_s;
-        search.st = (char*)"ssdp:all";
-        search.mx = 3;
-        ssdp_search(daemon->ssdp, &search);
-
-        free(search.host);
+        timecb_cancel(daemon->discover_timecb);
+        daemon->discover_timecb = NULL;
+    }
+    daemon->discover_left = DISCOVER_SEARCHES;
+    if (daemon_discover_cb(daemon) == 0)
+    {
+        daemon->discover_timecb = timers_add(daemon->timers,
+                                             DISCOVER_INTERVAL, daemon,
+                                             daemon_discover_cb);
     }
     return true;
 }
@@ -1062,12 +1712,35 @@ static long reconnect_server(void* userdata)
 
 static void daemon_lost_server(daemon_t daemon, server_t* srv, bool wait)
 {
+    daemon_gena_drop_server(daemon, srv, false);
     if (srv->sock >= 0)
     {
         selector_remove(daemon->selector, srv->sock);
         socket_close(srv->sock);
         srv->sock = -1;
     }
+    if (srv->out != NULL)
+    {
+        /* The next connection must start with a whole package */
+        outq_clear(srv->out);
+    }
+    if (srv->in != NULL)
+    {
+        buf_skip(srv->in, buf_ravail(srv->in));
+    }
+    srv->dirty = false;
+    srv->congested = false;
+    vector_removerange(srv->resync, 0, vector_size(srv->resync));
+    srv->resync_pos = 0;
+    if (srv->hello_timecb != NULL)
+    {
+        timecb_cancel(srv->hello_timecb);
+        srv->hello_timecb = NULL;
+    }
+    /* Anything queued until the next hello is sent as version 1 */
+    srv->version = 1;
+    srv->hello_done = false;
+    srv->compress = CODEC_NONE;
     if (srv->state == CONN_CONNECTED)
     {
         daemon_clear_remotes(daemon, srv);
@@ -1082,287 +1755,373 @@ static void daemon_lost_server(daemon_t daemon, server_t* srv, bool wait)
     }
 }
 
-static bool parse_location(const char* location, char** proto,
-                           struct sockaddr** host, socklen_t* hostlen,
-                           char** path)
+static void daemon_lost_tunnel(tunnel_t* tunnel);
+static void daemon_tunnel_attach(tunnel_t* tunnel, socket_t sock,
+                                 conn_state_t state, const char* token);
+
+static void tunnel_pending_free(tunnel_pending_t* pending, bool close_sock)
 {
-    const char* pos, *last;
-    char* tmp = NULL;
-    uint16_t port;
-    assert(location != NULL);
-    if (proto != NULL) *proto = NULL;
-    if (path != NULL) *path = NULL;
-    if (host != NULL) *host = NULL;
-    if (hostlen != NULL) *hostlen = 0;
-    pos = strstr(location, "://");
-    if (pos == NULL)
+    daemon_t daemon = pending->daemon;
+    size_t i;
+    for (i = 0; i < vector_size(daemon->tunnel_pending); ++i)
     {
-        if (proto != NULL)
+        if (*((tunnel_pending_t**)vector_get(daemon->tunnel_pending, i))
+            == pending)
         {
-            *proto = strdup("http");
+            vector_remove(daemon->tunnel_pending, i);
+            break;
         }
-        last = location;
     }
-    else
+    if (pending->timeoutcb != NULL)
     {
-        if (proto != NULL)
-        {
-            *proto = strndup(location, pos - location);
-        }
-        last = pos + 3;
+        timecb_cancel(pending->timeoutcb);
     }
-    pos = strchr(last, '/');
-    if (pos == NULL)
+    selector_remove(daemon->selector, pending->sock);
+    if (close_sock)
     {
-        tmp = strdup(last);
-        last = last + strlen(last);
+        socket_close(pending->sock);
     }
-    else
+    free(pending->addr);
+    free(pending);
+}
+
+static long tunnel_pending_timeout(void* userdata)
+{
+    tunnel_pending_t* pending = userdata;
+    char* tmp;
+    asprinthost(&tmp, pending->addr, pending->addrlen);
+    log_printf(pending->daemon->log, LVL_WARN,
+               "Tunnel connection from %s never sent a token", tmp);
+    free(tmp);
+    pending->timeoutcb = NULL;
+    tunnel_pending_free(pending, true);
+    return -1;
+}
+
+/* Find the tunnel in stasis the token is for */
+static tunnel_t* daemon_find_tunnel(daemon_t daemon,
+                                    const struct sockaddr* addr,
+                                    socklen_t addrlen,
+                                    const pkg_tunnel_token_t* token)
+{
+    server_t* server = NULL;
+    tunnel_t key, *tunnel;
+    size_t i, samehost = 0;
+    for (i = 0; i < daemon->servers; ++i)
     {
-        tmp = strndup(last, pos - last);
-        last = pos + 1;
+        server_t* srv = daemon->server[i];
+        if (!socket_samehost(srv->host, srv->hostlen, addr, addrlen))
+        {
+            continue;
+        }
+        if (addr_getport(srv->host, srv->hostlen) == token->server_port)
+        {
+            server = srv;
+            break;
+        }
+        if (samehost++ == 0)
+        {
+            server = srv;
+        }
     }
-    if (path != NULL)
+    if (server == NULL ||
+        (samehost > 1 &&
+         addr_getport(server->host, server->hostlen) != token->server_port))
     {
-        *path = strdup(last);
+        /* Unknown host, or can't tell which of the servers on the host
+         * sent it */
+        return NULL;
     }
-    if (tmp[0] == '[')
+    key.id = token->tunnel_id;
+    if (token->local)
     {
-        pos = strstr(tmp, "]:");
+        key.remote = false;
+        key.source.local.server = server;
+        tunnel = map_get(server->local_tunnels, &key);
     }
     else
     {
-        pos = strchr(tmp, ':');
+        tunnel = slotmap_get(server->remote_tunnels, token->tunnel_id);
+        if (tunnel != NULL && !tunnel->source.remote.listening)
+        {
+            return NULL;
+        }
     }
-    if (pos == NULL)
+    if (tunnel == NULL || !tunnel->stasis)
     {
-        /* TODO: Use proto to check the correct default value */
-        port = 80;
+        return NULL;
     }
-    else
+    return tunnel;
+}
+
+static void tunnel_pending_read_cb(void* userdata, socket_t sock)
+{
+    tunnel_pending_t* pending = userdata;
+    daemon_t daemon = pending->daemon;
+    pkg_tunnel_token_t token;
+    tunnel_t* tunnel;
+    ssize_t got;
+    char* tmp;
+    assert(pending->sock == sock);
+
+    got = socket_read(sock, pending->token + pending->got,
+                      PKG_TUNNEL_TOKEN_SIZE - pending->got);
+    if (got <= 0)
     {
-        unsigned long x;
-        char* end;
-        if (*pos == ']') ++pos;
-        tmp[pos - tmp] = '\0';
-        ++pos;
-        errno = 0;
-        x = strtoul(pos, &end, 10);
-        if (errno || !end || (*end != '/' && *end != '\0') || x < 1 || x >= 65535)
+        if (got < 0 && socket_blockingerror(sock))
         {
-            return false;
+            return;
         }
-        port = (uint16_t)x;
+        tunnel_pending_free(pending, true);
+        return;
     }
-    if (host != NULL)
+    pending->got += got;
+    if (pending->got < PKG_TUNNEL_TOKEN_SIZE)
     {
-        if (tmp[0] == '[')
-        {
-            size_t len = strlen(tmp);
-            if (tmp[len - 1] == ']')
-            {
-                memmove(tmp, tmp + 1, len - 2);
-                tmp[len - 2] = '\0';
-            }
-        }
-        *host = parse_addr(tmp, port, hostlen, false);
-        if (*host == NULL)
-        {
-            return false;
-        }
+        return;
     }
-    free(tmp);
-    return true;
+
+    if (!pkg_tunnel_token_read(pending->token, &token))
+    {
+        asprinthost(&tmp, pending->addr, pending->addrlen);
+        log_printf(daemon->log, LVL_WARN,
+                   "Invalid token on tunnel connection from %s", tmp);
+        free(tmp);
+        tunnel_pending_free(pending, true);
+        return;
+    }
+
+    tunnel = daemon_find_tunnel(daemon, pending->addr, pending->addrlen,
+                                &token);
+    if (tunnel == NULL)
+    {
+        asprinthost(&tmp, pending->addr, pending->addrlen);
+        log_printf(daemon->log, LVL_WARN,
+                   "Tunnel connection from %s for unknown tunnel %lu", tmp,
+                   (unsigned long)token.tunnel_id);
+        free(tmp);
+        tunnel_pending_free(pending, true);
+        return;
+    }
+
+    tunnel_pending_free(pending, false);
+    tunnel->stasis = false;
+    daemon_tunnel_attach(tunnel, sock, CONN_CONNECTED, NULL);
+}
+
+static void tunnel_port_accept_cb(void* userdata, socket_t sock,
+                                  socket_t s)
+{
+    daemon_t daemon = userdata;
+    tunnel_pending_t* pending;
+    struct sockaddr* addr;
+    socklen_t addrlen;
+    assert(daemon->tunnel_sock == sock);
+
+    if (s < 0)
+    {
+        log_printf(daemon->log, LVL_WARN,
+                   "Error accepting tunnel connection: %s",
+                   socket_strerror(sock));
+        return;
+    }
+    addr = socket_getpeeraddr(s, &addrlen);
+    if (addr == NULL)
+    {
+        /* Gone already */
+        socket_close(s);
+        return;
+    }
+    socket_setblocking(s, false);
+
+    pending = calloc(1, sizeof(tunnel_pending_t));
+    pending->daemon = daemon;
+    pending->sock = s;
+    pending->addr = addr;
+    pending->addrlen = addrlen;
+    pending->timeoutcb = timers_add(daemon->timers, TUNNEL_TOKEN_TIMEOUT,
+                                    pending, tunnel_pending_timeout);
+    vector_push(daemon->tunnel_pending, &pending);
+    selector_add(daemon->selector, s, pending, tunnel_pending_read_cb, NULL);
 }
 
-static char* build_location(const char* proto, const struct sockaddr* host,
-                            socklen_t hostlen, const char* path)
+static void daemon_setup_tunnel_port(daemon_t daemon)
 {
-    char* ret = NULL, * tmp = NULL, * pos;
-    unsigned int port;
-    assert(proto != NULL && host != NULL && path != NULL);
-    assert(*proto != '\0');
-    if (path[0] == '/')
+    assert(daemon->selector != NULL && daemon->tunnel_sock < 0);
+    if (daemon->tunnel_port == 0)
     {
-        ++path;
+        return;
     }
-    asprinthost(&tmp, host, hostlen);
-    pos = strchr(tmp, ':');
-    assert(pos != NULL);
-    port = strtoul(pos + 1, NULL, 10);
-    *pos = '\0';
-    if (addr_is_ipv6(host, hostlen))
+    daemon->tunnel_sock = socket_tcp_listen(daemon->bind_tunnelport,
+                                            daemon->tunnel_port);
+    if (daemon->tunnel_sock >= 0)
     {
-        if (asprintf(&ret, "%s://[%s]:%u/%s", proto, tmp, port, path) == -1)
-        {
-            free(tmp);
-            return NULL;
-        }
+        selector_add_listener(daemon->selector, daemon->tunnel_sock, daemon,
+                              tunnel_port_accept_cb);
     }
     else
     {
-        if (asprintf(&ret, "%s://%s:%u/%s", proto, tmp, port, path) == -1)
-        {
-            free(tmp);
-            return NULL;
-        }
+        log_printf(daemon->log, LVL_WARN,
+                   "Unable to listen for tunnel connections on %s:%u: %s",
+                   daemon->bind_tunnelport != NULL
+                   ? daemon->bind_tunnelport : "*",
+                   daemon->tunnel_port,
+                   socket_strerror(daemon->tunnel_sock));
+        daemon->tunnel_sock = -1;
     }
-    free(tmp);
-    return ret;
 }
 
-static void daemon_lost_tunnel(tunnel_t* tunnel);
-static void tunnel_read_cb(void* userdata, socket_t sock);
-static void tunnel_write_cb(void* userdata, socket_t sock);
+/* Port other daemons should connect to for tunnels, or 0 if they
+ * can't */
+static uint16_t daemon_listen_tunnel_port(daemon_t daemon)
+{
+    return daemon->tunnel_sock >= 0 ? daemon->tunnel_port : 0;
+}
+
+/* Token to send when connecting to the tunnel port of the other daemon */
+static void daemon_tunnel_token(tunnel_t* tunnel, char* data)
+{
+    pkg_tunnel_token_t token;
+    token.server_port = tunnel->io->daemon->server_port;
+    token.tunnel_id = tunnel->id;
+    token.local = tunnel->remote;
+    pkg_tunnel_token_write(data, &token);
+}
+
+/* Servers talking version 2 or later use the shared tunnel port and send
+ * a token first on each tunnel connection */
+static bool server_tunnel_token(const server_t* server)
+{
+    return server->version >= 2;
+}
 
-static void tunnel_port_read_cb(void* userdata, socket_t in_sock)
+static void tunnel_listen_free(tunnel_listen_t* listen)
 {
-    tunnel_port_t* tunnel_port = userdata;
+    assert(listen->tunnel->listen == listen);
+    listen->tunnel->listen = NULL;
+    selector_remove(listen->daemon->selector, listen->sock);
+    socket_close(listen->sock);
+    free(listen);
+}
+
+static void tunnel_listen_accept_cb(void* userdata, socket_t sock)
+{
+    tunnel_listen_t* listen = userdata;
+    daemon_t daemon = listen->daemon;
+    tunnel_t* tunnel = listen->tunnel;
     struct sockaddr* addr;
     socklen_t addrlen;
-    socket_t sock;
-    tunnel_t* tunnel = tunnel_port->tunnel;
-    assert(tunnel_port->sock == in_sock);
+    socket_t s;
+    assert(listen->sock == sock);
 
-    sock = socket_accept(tunnel_port->sock, &addr, &addrlen);
-    if (sock < 0)
+    s = socket_accept(sock, &addr, &addrlen);
+    if (s < 0)
     {
         char* tmp;
-        if (socket_blockingerror(tunnel_port->sock))
+        if (socket_blockingerror(sock))
         {
             return;
         }
-
-        asprinthost(&tmp,
-                    tunnel_port->server->host, tunnel_port->server->hostlen);
-        log_printf(tunnel_port->daemon->log, LVL_WARN,
+        asprinthost(&tmp, listen->server->host, listen->server->hostlen);
+        log_printf(daemon->log, LVL_WARN,
                    "Error accepting tunnel connection from server %s: %s",
-                   tmp, socket_strerror(tunnel_port->sock));
+                   tmp, socket_strerror(sock));
         free(tmp);
-
-        daemon_lost_tunnel(tunnel_port->tunnel);
+        daemon_lost_tunnel(tunnel);
         return;
     }
-
-    if (!socket_samehost(tunnel_port->server->host,
-                         tunnel_port->server->hostlen,
+    if (!socket_samehost(listen->server->host, listen->server->hostlen,
                          addr, addrlen))
     {
         char* srv, *host;
-        asprinthost(&srv,
-                    tunnel_port->server->host, tunnel_port->server->hostlen);
+        asprinthost(&srv, listen->server->host, listen->server->hostlen);
         asprinthost(&host, addr, addrlen);
-        log_printf(tunnel_port->daemon->log, LVL_WARN,
+        log_printf(daemon->log, LVL_WARN,
                    "Error accepting tunnel connection from %s expected server %s",
                    host, srv);
         free(host);
         free(srv);
         free(addr);
-        socket_close(sock);
+        socket_close(s);
         return;
     }
     free(addr);
 
-    selector_remove(tunnel_port->daemon->selector, tunnel_port->sock);
-    socket_close(tunnel_port->sock);
-    tunnel_port->sock = -1;
-    tunnel_port->tunnel = NULL;
-    tunnel_port->server = NULL;
-
-    if (tunnel->daemon_conn.state != CONN_CONNECTED)
-    {
-        if (tunnel->daemon_conn.state == CONN_CONNECTING)
-        {
-            selector_remove(tunnel_port->daemon->selector,
-                            tunnel->daemon_conn.sock);
-            socket_close(tunnel->daemon_conn.sock);
-        }
-        tunnel->stasis = false;
-        tunnel->daemon_conn.sock = sock;
-        socket_setblocking(sock, false);
-        selector_add(tunnel_port->daemon->selector,
-                     tunnel->daemon_conn.sock,
-                     tunnel, tunnel_read_cb, tunnel_write_cb);
-        tunnel->daemon_conn.state = CONN_CONNECTED;
-    }
-    else
-    {
-        socket_close(sock);
-    }
+    tunnel_listen_free(listen);
+    tunnel->stasis = false;
+    socket_setblocking(s, false);
+    daemon_tunnel_attach(tunnel, s, CONN_CONNECTED, NULL);
 }
 
-static uint16_t daemon_allocate_tunnel_port(daemon_t daemon, tunnel_t* tunnel,
-                                            server_t* server)
+/* Listen on a port of its own for the tunnel, returns the port or 0 */
+static uint16_t daemon_listen_tunnel(daemon_t daemon, tunnel_t* tunnel,
+                                     server_t* server)
 {
-    size_t i;
-    if (daemon->tunnel_port_first == 0 || daemon->tunnel_port_count == 0)
+    tunnel_listen_t* listen;
+    struct sockaddr* addr;
+    socklen_t addrlen;
+    uint16_t port;
+    socket_t s;
+    assert(tunnel->listen == NULL);
+    if (daemon->tunnel_port == 0)
     {
+        /* Configured to never listen */
         return 0;
     }
-    for (i = 0; i < daemon->tunnel_port_count; ++i)
-    {
-        if (daemon->tunnel_port[i].tunnel == NULL)
-        {
-            socket_t s = socket_tcp_listen(daemon->bind_tunnelport,
-                                           daemon->tunnel_port_first + i);
-            if (s < 0)
-            {
-                continue;
-            }
-            socket_setblocking(s, true);
-            daemon->tunnel_port[i].daemon = daemon;
-            daemon->tunnel_port[i].tunnel = tunnel;
-            daemon->tunnel_port[i].server = server;
-            daemon->tunnel_port[i].sock = s;
-            selector_add(daemon->selector, s, daemon->tunnel_port + i,
-                         tunnel_port_read_cb, NULL);
-            return daemon->tunnel_port_first + i;
-        }
-    }
-    log_printf(daemon->log, LVL_WARN, "No tunnel ports available");
-    return 0;
-}
-
-static void daemon_release_tunnel_port(daemon_t daemon, tunnel_t* tunnel)
-{
-    size_t i;
-    if (daemon->tunnel_port_first == 0)
+    s = socket_tcp_listen(daemon->bind_tunnelport, 0);
+    if (s < 0 || !socket_setblocking(s, false))
     {
-        return;
+        log_printf(daemon->log, LVL_WARN,
+                   "Unable to listen for tunnel connection: %s",
+                   socket_strerror(s));
+        socket_close(s);
+        return 0;
     }
-    for (i = 0; i < daemon->tunnel_port_count; ++i)
+    addr = socket_getsockaddr(s, &addrlen);
+    port = addr != NULL ? addr_getport(addr, addrlen) : 0;
+    free(addr);
+    if (port == 0)
     {
-        if (daemon->tunnel_port[i].tunnel == tunnel)
-        {
-            if (daemon->tunnel_port[i].sock >= 0)
-            {
-                selector_remove(daemon->selector,
-                                daemon->tunnel_port[i].sock);
-                socket_close(daemon->tunnel_port[i].sock);
-                daemon->tunnel_port[i].sock = -1;
-            }
-            daemon->tunnel_port[i].tunnel = NULL;
-            return;
-        }
+        socket_close(s);
+        return 0;
     }
+    listen = malloc(sizeof(tunnel_listen_t));
+    listen->daemon = daemon;
+    listen->sock = s;
+    listen->tunnel = tunnel;
+    listen->server = server;
+    tunnel->listen = listen;
+    selector_add(daemon->selector, s, listen, tunnel_listen_accept_cb, NULL);
+    return port;
 }
 
-static void close_conn(daemon_t daemon, conn_t* conn)
+/* Port the server should connect to for the tunnel, or 0 if it has to
+ * listen instead */
+static uint16_t daemon_tunnel_port(daemon_t daemon, tunnel_t* tunnel,
+                                   server_t* server)
 {
-    if (conn->sock >= 0)
+    if (server_tunnel_token(server))
     {
-        selector_remove(daemon->selector, conn->sock);
-        socket_close(conn->sock);
-        conn->sock = -1;
+        return daemon_listen_tunnel_port(daemon);
     }
-    conn->state = CONN_DEAD;
+    return daemon_listen_tunnel(daemon, tunnel, server);
 }
 
 static void daemon_lost_tunnel(tunnel_t* tunnel)
 {
+    bool daemon_alive;
+    if (tunnel->io->lost)
+    {
+        daemon_alive = tunnel->io->daemon_alive;
+    }
+    else
+    {
+        daemon_alive = !tunnel->stasis;
+    }
+
     if (tunnel->remote)
     {
-        if (tunnel->daemon_conn.state > CONN_DEAD)
+        if (daemon_alive)
         {
             pkg_t pkg;
             pkg_close_tunnel(&pkg, tunnel->id, true);
@@ -1371,7 +2130,7 @@ static void daemon_lost_tunnel(tunnel_t* tunnel)
     }
     else
     {
-        if (tunnel->daemon_conn.state > CONN_DEAD)
+        if (daemon_alive)
         {
             pkg_t pkg;
             pkg_close_tunnel(&pkg, tunnel->id, false);
@@ -1381,7 +2140,8 @@ static void daemon_lost_tunnel(tunnel_t* tunnel)
 
     if (tunnel->remote)
     {
-        map_remove(tunnel->source.remote.service->source->remote_tunnels, tunnel);
+        slotmap_remove(tunnel->source.remote.service->source->remote_tunnels,
+                       tunnel->id);
     }
     else
     {
@@ -1404,82 +2164,434 @@ static bool local_tunnel_eq(const void* _t1, const void* _t2)
     return t1->id == t2->id;
 }
 
-static uint32_t remote_tunnel_hash(const void* _tunnel)
-{
-    const tunnel_t* tunnel = _tunnel;
-    assert(tunnel->remote);
-    return tunnel->id;
-}
-
-static bool remote_tunnel_eq(const void* _t1, const void* _t2)
-{
-    const tunnel_t* t1 = _t1;
-    const tunnel_t* t2 = _t2;
-    assert(t1->remote && t2->remote);
-    return t1->id == t2->id;
-}
+/* Tunnel IO, everything between here and daemon_tunnel_start is run by
+ * the worker owning the tunnel */
 
-static void free_conn(daemon_t daemon, conn_t* conn)
+static void tunnel_read_cb(void* userdata, socket_t sock);
+static void tunnel_write_cb(void* userdata, socket_t sock);
+static void tunnel_io_lost_job(void* userdata);
+static void tunnel_io_closed_job(void* userdata);
+static void tunnel_io_detached_job(void* userdata);
+static void tunnel_io_done_job(void* userdata);
+static void tunnel_io_restart_peer_job(void* userdata);
+static void tunnel_io_try_detach(tunnel_io_t* io);
+static void tunnel_io_resume(tunnel_io_t* io);
+static void tunnel_sched_job(void* userdata);
+static long tunnel_rate_timecb(void* userdata);
+static void sniff_data(conn_t* conn, const char* data, size_t size);
+
+static unsigned long tunnel_io_burst(tunnel_io_t* io)
 {
-    close_conn(daemon, conn);
-    buf_free(conn->buf);
+    unsigned long burst = io->rate / TUNNEL_RATE_BURST_DIV;
+    return burst > TUNNEL_BUFFER_LOCAL ? burst : TUNNEL_BUFFER_LOCAL;
 }
 
-static void tunnel_free(tunnel_t* tunnel)
+/* Add the tokens the rate has given since the last time */
+static void tunnel_io_refill(tunnel_io_t* io)
 {
-    daemon_t daemon;
-    if (tunnel->remote)
-    {
-        daemon = tunnel->source.remote.service->source->daemon;
-    }
-    else
+    unsigned long burst = tunnel_io_burst(io);
+    uint64_t now = timers_now(worker_timers(io->worker));
+    uint64_t ms, add;
+    ms = now - io->refilled;
+    add = (ms * io->rate) / 1000;
+    if (add == 0)
     {
-        daemon = tunnel->source.local.server->daemon;
+        return;
     }
-    if (tunnel->stasis)
+    if (add >= burst - io->tokens)
     {
-        daemon_release_tunnel_port(daemon, tunnel);
+        io->tokens = burst;
+        io->refilled = now;
     }
-    free_conn(daemon, &tunnel->local_conn);
-    free_conn(daemon, &tunnel->daemon_conn);
-    http_proxy_free(tunnel->proxy);
-    if (!tunnel->remote)
+    else
     {
-        free(tunnel->source.local.remote_host);
-        free(tunnel->source.local.local_host);
+        io->tokens += add;
+        io->refilled += ms;
     }
 }
 
-static void remote_tunnel_free(void* _tunnel)
+/* Bytes the tunnel may read now, 0 if it has to wait for its next turn or
+ * for the rate limit */
+static size_t tunnel_io_allowance(tunnel_io_t* io)
 {
-    tunnel_free((tunnel_t*)_tunnel);
+    size_t allow = io->budget;
+    if (io->rate > 0 && allow > 0)
+    {
+        tunnel_io_refill(io);
+        if (io->tokens < allow)
+        {
+            allow = io->tokens;
+        }
+    }
+    return allow;
 }
 
-static void local_tunnel_free(void* _tunnel)
+static void tunnel_io_used(tunnel_io_t* io, size_t bytes)
 {
-    tunnel_free((tunnel_t*)_tunnel);
+    assert(bytes <= io->budget);
+    io->budget -= bytes;
+    if (io->rate > 0)
+    {
+        io->tokens -= bytes < io->tokens ? bytes : io->tokens;
+    }
 }
 
-static bool flush_conn(daemon_t daemon, tunnel_t* tunnel,
-                       conn_t* in_conn, conn_t* out_conn,
-                       http_proxy_t proxy,
-                       bool* wait_read, bool* wait_write)
+/* Reading was stopped by tunnel_io_allowance, wait for the rate limit or
+ * the next turn */
+static void tunnel_io_throttle(tunnel_io_t* io)
 {
-    switch (in_conn->state)
+    tunnel_sched_t* sched;
+    if (io->budget > 0)
     {
-    case CONN_DEAD:
-        return true;
-    case CONN_CONNECTING:
-        *wait_read = true;
-        *wait_write = true;
-        return true;
-    case CONN_CONNECTED:
-        break;
+        /* Out of tokens, wait until there is enough for a buffer */
+        unsigned long delay;
+        assert(io->rate > 0);
+        if (io->ratecb != NULL)
+        {
+            return;
+        }
+        delay = io->tokens < TUNNEL_BUFFER_LOCAL
+            ? ((TUNNEL_BUFFER_LOCAL - io->tokens) * 1000 + io->rate - 1)
+            / io->rate : 1;
+        io->ratecb = timers_add(worker_timers(io->worker),
+                                delay > 0 ? delay : 1, io,
+                                tunnel_rate_timecb);
+        return;
+    }
+    if (io->backlogged)
+    {
+        return;
+    }
+    sched = io->daemon->worker_sched + io->worker_idx;
+    if (sched->queue == NULL)
+    {
+        sched->queue = vector_new(sizeof(tunnel_io_t*));
+        sched->running = vector_new(sizeof(tunnel_io_t*));
+    }
+    io->backlogged = true;
+    vector_push(sched->queue, &io);
+    if (!sched->posted)
+    {
+        /* Posting to ourself lets the sockets that are ready now go
+         * first */
+        sched->posted = true;
+        worker_post(io->worker, tunnel_sched_job, sched);
+    }
+}
+
+/* Give each tunnel waiting in the queue another quantum */
+static void tunnel_sched_job(void* userdata)
+{
+    tunnel_sched_t* sched = userdata;
+    vector_t running = sched->queue;
+    size_t i;
+    sched->queue = sched->running;
+    sched->running = running;
+    sched->posted = false;
+    for (i = 0; i < vector_size(running); ++i)
+    {
+        tunnel_io_t* io = *((tunnel_io_t**)vector_get(running, i));
+        io->backlogged = false;
+        daemon_tunnel_flush(io);
+    }
+    vector_removerange(running, 0, vector_size(running));
+}
+
+static long tunnel_rate_timecb(void* userdata)
+{
+    tunnel_io_t* io = userdata;
+    io->ratecb = NULL;
+    daemon_tunnel_flush(io);
+    return -1;
+}
+
+static void close_conn(tunnel_io_t* io, conn_t* conn)
+{
+    if (conn->sock >= 0)
+    {
+        if (io->worker != NULL)
+        {
+            selector_remove(worker_selector(io->worker), conn->sock);
+        }
+        socket_close(conn->sock);
+        conn->sock = -1;
+    }
+    conn->state = CONN_DEAD;
+}
+
+static void free_conn(tunnel_io_t* io, conn_t* conn)
+{
+    close_conn(io, conn);
+    if (conn->buf != NULL)
+    {
+        worker_buf_free(io->worker, conn->buf);
+        conn->buf = NULL;
+    }
+    codec_free(conn->codec);
+    conn->codec = NULL;
+    http_proxy_free(conn->sniff);
+    conn->sniff = NULL;
+    if (conn->zbuf != NULL)
+    {
+        worker_buf_free(io->worker, conn->zbuf);
+        conn->zbuf = NULL;
+    }
+    if (conn->sniffbuf != NULL)
+    {
+        worker_buf_free(io->worker, conn->sniffbuf);
+        conn->sniffbuf = NULL;
+    }
+    conn->draining = false;
+}
+
+static double ratio(uint64_t a, uint64_t b)
+{
+    return b > 0 ? (double)a / b : 1.0;
+}
+
+static void tunnel_io_log_compression(tunnel_io_t* io)
+{
+    codec_stats_t sent, recv;
+    if (io->local_conn.codec == NULL || io->daemon_conn.codec == NULL)
+    {
+        return;
+    }
+    codec_stats(io->local_conn.codec, &sent);
+    codec_stats(io->daemon_conn.codec, &recv);
+    log_printf(io->daemon->log, LVL_INFO,
+               "%s tunnel %lu (%s): sent %lu bytes as %lu (%.1fx) in %lu.%03lu ms, "
+               "received %lu bytes as %lu (%.1fx) in %lu.%03lu ms, "
+               "%lu compressed bodies not recompressed",
+               io->remote ? "Remote" : "Local", (unsigned long)io->id,
+               codec_method_str(io->compress),
+               (unsigned long)sent.in, (unsigned long)sent.out,
+               ratio(sent.in, sent.out),
+               (unsigned long)(sent.cpu_usec / 1000),
+               (unsigned long)(sent.cpu_usec % 1000),
+               (unsigned long)recv.in, (unsigned long)recv.out,
+               ratio(recv.out, recv.in),
+               (unsigned long)(recv.cpu_usec / 1000),
+               (unsigned long)(recv.cpu_usec % 1000),
+               sent.skips);
+}
+
+/* Answer tunnel_io_detach_job, the main thread looks at frozen */
+static void tunnel_io_detach_done(tunnel_io_t* io)
+{
+    io->detaching = false;
+    worker_post(io->daemon->control, tunnel_io_detached_job, io);
+}
+
+static void tunnel_io_teardown(tunnel_io_t* io)
+{
+    if (io->detaching)
+    {
+        tunnel_io_detach_done(io);
+    }
+    io->daemon_alive = io->daemon_conn.state > CONN_DEAD;
+    tunnel_io_log_compression(io);
+    if (io->ratecb != NULL)
+    {
+        timecb_cancel(io->ratecb);
+        io->ratecb = NULL;
+    }
+    if (io->backlogged)
+    {
+        tunnel_sched_t* sched = io->daemon->worker_sched + io->worker_idx;
+        size_t i;
+        for (i = 0; i < vector_size(sched->queue); ++i)
+        {
+            if (*((tunnel_io_t**)vector_get(sched->queue, i)) == io)
+            {
+                vector_remove(sched->queue, i);
+                break;
+            }
+        }
+        io->backlogged = false;
+    }
+    free_conn(io, &io->local_conn);
+    free_conn(io, &io->daemon_conn);
+    http_proxy_free(io->proxy);
+    io->proxy = NULL;
+    io->dead = true;
+}
+
+/* Same as daemon_lost_tunnel but from the worker */
+static void tunnel_io_lost(tunnel_io_t* io)
+{
+    tunnel_io_teardown(io);
+    worker_post(io->daemon->control, tunnel_io_lost_job, io);
+}
+
+static void tunnel_io_adopt_job(void* userdata)
+{
+    tunnel_io_t* io = userdata;
+    selector_t selector = worker_selector(io->worker);
+
+    io->local_conn.buf = worker_buf_new(io->worker, TUNNEL_BUFFER_LOCAL);
+    io->daemon_conn.buf = worker_buf_new(io->worker, TUNNEL_BUFFER_DAEMON);
+    io->proxy = http_proxy_new(io->source_host, io->target_host,
+                               io->local_conn.buf);
+    if (io->strip_route)
+    {
+        http_proxy_strip_segment(io->proxy, SERVICE_ROUTE_PREFIX);
+    }
+    if (io->rate > 0)
+    {
+        io->tokens = tunnel_io_burst(io);
+        io->refilled = timers_now(worker_timers(io->worker));
+    }
+    if (io->compress != CODEC_NONE)
+    {
+        /* The sniffer only looks, it has no hosts to rewrite */
+        io->local_conn.codec = codec_new(io->compress, true);
+        io->local_conn.zbuf = worker_buf_new(io->worker, TUNNEL_BUFFER_LOCAL);
+        io->local_conn.sniffbuf = worker_buf_new(io->worker,
+                                                 TUNNEL_BUFFER_LOCAL);
+        io->local_conn.sniff = http_proxy_new("", "", io->local_conn.sniffbuf);
+        io->daemon_conn.codec = codec_new(io->compress, false);
+        io->daemon_conn.zbuf = worker_buf_new(io->worker,
+                                              TUNNEL_BUFFER_DAEMON);
+    }
+    if (io->headlen > 0)
+    {
+        /* Always fits, the buffers are new and larger than
+         * SERVICE_LINE_MAX */
+        if (io->local_conn.codec != NULL)
+        {
+            buf_write(io->local_conn.zbuf, io->head, io->headlen);
+            sniff_data(&io->local_conn, io->head, io->headlen);
+        }
+        else
+        {
+            buf_write(io->daemon_conn.buf, io->head, io->headlen);
+        }
+    }
+    free(io->head);
+    io->head = NULL;
+    io->headlen = 0;
+    /* Checked by daemon_handover_read_tunnel to fit */
+    if (io->resume_inlen > 0)
+    {
+        buf_write(io->daemon_conn.zbuf, io->resume_in, io->resume_inlen);
+    }
+    if (io->resume_outlen > 0)
+    {
+        buf_write(io->daemon_conn.buf, io->resume_out, io->resume_outlen);
+    }
+    free(io->resume_in);
+    free(io->resume_out);
+    io->resume_in = io->resume_out = NULL;
+    io->resume_inlen = io->resume_outlen = 0;
+
+    selector_add(selector, io->local_conn.sock,
+                 io, tunnel_read_cb, tunnel_write_cb);
+    if (io->local_conn.state == CONN_CONNECTED)
+    {
+        selector_chkwrite(selector, io->local_conn.sock, false);
+    }
+    if (io->daemon_conn.state != CONN_DEAD)
+    {
+        selector_add(selector, io->daemon_conn.sock,
+                     io, tunnel_read_cb, tunnel_write_cb);
+    }
+
+    if (io->compress != CODEC_NONE &&
+        (io->local_conn.codec == NULL || io->daemon_conn.codec == NULL))
+    {
+        log_printf(io->daemon->log, LVL_ERR,
+                   "%s tunnel unable to setup %s compression",
+                   io->remote ? "Remote" : "Local",
+                   codec_method_str(io->compress));
+        tunnel_io_lost(io);
+    }
+}
+
+static void tunnel_io_attach_job(void* userdata)
+{
+    tunnel_attach_t* attach = userdata;
+    tunnel_io_t* io = attach->io;
+
+    if (io->dead)
+    {
+        /* Lost before the other daemon got here, the main thread
+         * already knows */
+        socket_close(attach->sock);
+    }
+    else
+    {
+        assert(io->daemon_conn.state == CONN_DEAD);
+        if (io->detaching || io->frozen)
+        {
+            /* A paused link was still read, see daemon_tunnel_attach */
+            tunnel_io_resume(io);
+        }
+        io->stasis = false;
+        io->daemon_conn.sock = attach->sock;
+        io->daemon_conn.state = attach->state;
+        io->send_token = attach->send_token;
+        memcpy(io->token, attach->token, PKG_TUNNEL_TOKEN_SIZE);
+        selector_add(worker_selector(io->worker), io->daemon_conn.sock,
+                     io, tunnel_read_cb, tunnel_write_cb);
+    }
+    free(attach);
+}
+
+static void tunnel_io_close_job(void* userdata)
+{
+    tunnel_io_t* io = userdata;
+    if (!io->dead)
+    {
+        tunnel_io_teardown(io);
+    }
+    worker_post(io->daemon->control, tunnel_io_closed_job, io);
+}
+
+/* The conn to the other daemon goes through the ring of the worker, when
+ * it has one, see selector_recv */
+static ssize_t conn_read(tunnel_io_t* io, conn_t* conn, void* data,
+                         size_t size)
+{
+    if (conn == &io->daemon_conn)
+    {
+        return selector_recv(worker_selector(io->worker), conn->sock,
+                             data, size);
     }
+    return socket_read(conn->sock, data, size);
+}
+
+static ssize_t conn_write(tunnel_io_t* io, conn_t* conn, const void* data,
+                          size_t size)
+{
+    if (conn == &io->daemon_conn)
+    {
+        return selector_send(worker_selector(io->worker), conn->sock,
+                             data, size);
+    }
+    return socket_write(conn->sock, data, size);
+}
+
+/* While detaching nothing more is read from the local conn, and nothing
+ * from the daemon conn once its codec is at the end of the stream */
+static bool conn_held(tunnel_io_t* io, conn_t* conn)
+{
+    return io->detaching &&
+        (conn == &io->local_conn || codec_stopped(conn->codec));
+}
+
+/* The read half of flush_conn, moves what can be read from in_conn to the
+ * proxy or out_conn. Returns -1 if the tunnel was lost, 0 if in_conn was
+ * closed and 1 otherwise */
+static int read_conn(tunnel_io_t* io,
+                     conn_t* in_conn, conn_t* out_conn,
+                     http_proxy_t proxy,
+                     bool* wait_read, bool* wait_write)
+{
+    log_t log = io->daemon->log;
 
     for (;;)
     {
-        size_t avail;
+        size_t avail, allow;
         ssize_t ret;
         void* ptr;
         if (proxy != NULL)
@@ -1493,138 +2605,362 @@ static bool flush_conn(daemon_t daemon, tunnel_t* tunnel,
         if (avail == 0)
         {
             *wait_write = true;
-            break;
+            return 1;
+        }
+        allow = tunnel_io_allowance(io);
+        if (allow == 0)
+        {
+            io->throttled = true;
+            *wait_read = true;
+            return 1;
         }
-        ret = socket_read(in_conn->sock, ptr, avail);
+        ret = conn_read(io, in_conn, ptr, avail < allow ? avail : allow);
         if (ret < 0)
         {
             if (socket_blockingerror(in_conn->sock))
             {
                 *wait_read = true;
-                break;
+                return 1;
             }
             else
             {
-                log_printf(daemon->log, LVL_WARN,
+                log_printf(log, LVL_WARN,
                            "%s tunnel %s connection returned error when reading: %s",
-                           tunnel->remote ? "Remote" : "Local",
-                           in_conn == &tunnel->local_conn ? "local" : "daemon",
+                           io->remote ? "Remote" : "Local",
+                           in_conn == &io->local_conn ? "local" : "daemon",
                            socket_strerror(in_conn->sock));
-                daemon_lost_tunnel(tunnel);
-                return false;
+                tunnel_io_lost(io);
+                return -1;
             }
         }
         else if (ret == 0)
         {
             if (buf_ravail(in_conn->buf) > 0)
             {
-                log_printf(daemon->log, LVL_WARN,
+                log_printf(log, LVL_WARN,
                            "%s tunnel %s connection closed before sending %lu bytes of queued data",
-                           tunnel->remote ? "Remote" : "Local",
-                           in_conn == &tunnel->local_conn ? "local" : "daemon",
+                           io->remote ? "Remote" : "Local",
+                           in_conn == &io->local_conn ? "local" : "daemon",
                            (unsigned long)buf_ravail(in_conn->buf));
             }
             if (proxy != NULL)
             {
                 http_proxy_flush(proxy, true);
             }
-            close_conn(daemon, in_conn);
-            return true;
+            close_conn(io, in_conn);
+            return 0;
         }
+        tunnel_io_used(io, ret);
         if (proxy != NULL)
         {
             if (http_proxy_wmove(proxy, ret) == 0)
             {
-                break;
+                return 1;
             }
         }
         else
         {
             if (buf_wmove(out_conn->buf, ret) == 0)
             {
-                break;
+                return 1;
             }
         }
     }
 
+}
+
+/* Show data read from conn to its sniffer */
+static void sniff_data(conn_t* conn, const char* data, size_t size)
+{
+    while (size > 0)
+    {
+        size_t done = http_proxy_write(conn->sniff, data, size);
+        data += done;
+        size -= done;
+        if (done == 0 && buf_ravail(conn->sniffbuf) == 0)
+        {
+            /* Stuck on a header larger than it can hold, the worst that
+             * can happen is that media is compressed again */
+            break;
+        }
+        buf_skip(conn->sniffbuf, buf_ravail(conn->sniffbuf));
+        http_proxy_flush(conn->sniff, false);
+    }
+    buf_skip(conn->sniffbuf, buf_ravail(conn->sniffbuf));
+}
+
+/* Same as read_conn for a compressed tunnel, what is read from in_conn goes
+ * through its codec on the way. Also called for a draining in_conn */
+static int read_conn_codec(tunnel_io_t* io,
+                           conn_t* in_conn, conn_t* out_conn,
+                           http_proxy_t proxy,
+                           bool* wait_read, bool* wait_write)
+{
+    log_t log = io->daemon->log;
+
     for (;;)
     {
+        size_t avail, allow;
         ssize_t ret;
-        size_t avail;
-        const void* ptr = buf_rptr(in_conn->buf, &avail);
+        void* ptr;
+        if (proxy != NULL)
+        {
+            ptr = http_proxy_wptr(proxy, &avail);
+        }
+        else
+        {
+            ptr = buf_wptr(out_conn->buf, &avail);
+        }
         if (avail == 0)
         {
+            if (in_conn->draining)
+            {
+                return 0;
+            }
+            *wait_write = true;
+            return 1;
+        }
+        if (in_conn->sniff != NULL)
+        {
+            codec_skip(in_conn->codec,
+                       !http_proxy_compressible(in_conn->sniff));
+        }
+        ret = codec_run(in_conn->codec, in_conn->zbuf, ptr, avail);
+        if (ret < 0)
+        {
+            log_printf(log, LVL_WARN,
+                       "%s tunnel %s connection sent data that can't be decompressed",
+                       io->remote ? "Remote" : "Local",
+                       in_conn == &io->local_conn ? "local" : "daemon");
+            tunnel_io_lost(io);
+            return -1;
+        }
+        if (proxy != NULL)
+        {
+            http_proxy_wmove(proxy, ret);
+        }
+        else
+        {
+            buf_wmove(out_conn->buf, ret);
+        }
+        if ((size_t)ret == avail)
+        {
+            continue;
+        }
+
+        /* All of zbuf is consumed, or the codec stopped */
+        if (in_conn->draining)
+        {
+            if (in_conn->sniff != NULL)
+            {
+                codec_finish(in_conn->codec);
+            }
+            if (codec_pending(in_conn->codec))
+            {
+                continue;
+            }
+            in_conn->draining = false;
             if (proxy != NULL)
             {
-                http_proxy_flush(proxy, false);
+                http_proxy_flush(proxy, true);
             }
-            break;
+            return 0;
+        }
+        if (conn_held(io, in_conn))
+        {
+            *wait_read = true;
+            return 1;
         }
-        ret = socket_write(in_conn->sock, ptr, avail);
+
+        ptr = buf_wptr(in_conn->zbuf, &avail);
+        allow = tunnel_io_allowance(io);
+        ret = allow > 0 ? conn_read(io, in_conn, ptr,
+                                    avail < allow ? avail : allow) : -1;
         if (ret < 0)
         {
-            if (socket_blockingerror(in_conn->sock))
+            if (allow == 0 || socket_blockingerror(in_conn->sock))
             {
-                *wait_write = true;
-                break;
+                if (allow == 0)
+                {
+                    io->throttled = true;
+                }
+                /* Make what has been read so far reach the other end */
+                if (in_conn->sniff != NULL && codec_flush(in_conn->codec))
+                {
+                    continue;
+                }
+                *wait_read = true;
+                return 1;
             }
             else
             {
-                log_printf(daemon->log, LVL_WARN,
-                           "%s tunnel %s connection returned error when writing: %s",
-                           tunnel->remote ? "Remote" : "Local",
-                           in_conn == &tunnel->local_conn ? "local" : "daemon",
+                log_printf(log, LVL_WARN,
+                           "%s tunnel %s connection returned error when reading: %s",
+                           io->remote ? "Remote" : "Local",
+                           in_conn == &io->local_conn ? "local" : "daemon",
                            socket_strerror(in_conn->sock));
-                daemon_lost_tunnel(tunnel);
-                return false;
+                tunnel_io_lost(io);
+                return -1;
             }
         }
         else if (ret == 0)
         {
-            log_printf(daemon->log, LVL_WARN,
-                       "%s tunnel %s connection closed when sending %lu bytes of queued data",
-                       tunnel->remote ? "Remote" : "Local",
-                       in_conn == &tunnel->local_conn ? "local" : "daemon",
-                       (unsigned long)avail);
-            close_conn(daemon, in_conn);
-            return true;
-        }
-        if (buf_rmove(in_conn->buf, ret) == 0)
-        {
+            if (buf_ravail(in_conn->buf) > 0)
+            {
+                log_printf(log, LVL_WARN,
+                           "%s tunnel %s connection closed before sending %lu bytes of queued data",
+                           io->remote ? "Remote" : "Local",
+                           in_conn == &io->local_conn ? "local" : "daemon",
+                           (unsigned long)buf_ravail(in_conn->buf));
+            }
+            close_conn(io, in_conn);
+            if (in_conn->sniff != NULL)
+            {
+                /* The end of the stream is still to be written */
+                in_conn->draining = true;
+                continue;
+            }
             if (proxy != NULL)
             {
-                http_proxy_flush(proxy, false);
+                http_proxy_flush(proxy, true);
             }
-            break;
+            return 0;
         }
-        if (proxy != NULL)
+        tunnel_io_used(io, ret);
+        if (in_conn->sniff != NULL)
         {
-            http_proxy_flush(proxy, false);
+            sniff_data(in_conn, ptr, ret);
         }
+        buf_wmove(in_conn->zbuf, ret);
     }
-
-    return true;
 }
 
-static void daemon_tunnel_flush(tunnel_t* tunnel)
+static bool flush_conn(tunnel_io_t* io,
+                       conn_t* in_conn, conn_t* out_conn,
+                       http_proxy_t proxy,
+                       bool* wait_read, bool* wait_write)
 {
-    daemon_t daemon;
-    bool local_read = false, local_write = false;
-    bool daemon_read = false, daemon_write = false;
+    log_t log = io->daemon->log;
 
-    if (tunnel->remote)
-    {
-        daemon = tunnel->source.remote.service->source->daemon;
-    }
-    else
+    switch (in_conn->state)
     {
-        daemon = tunnel->source.local.server->daemon;
+    case CONN_DEAD:
+        if (in_conn->draining)
+        {
+            /* Nothing to wait for on a closed socket */
+            *wait_read = false;
+            *wait_write = false;
+            return read_conn_codec(io, in_conn, out_conn, proxy,
+                                   wait_read, wait_write) >= 0;
+        }
+        return true;
+    case CONN_CONNECTING:
+        *wait_read = true;
+        *wait_write = true;
+        return true;
+    case CONN_CONNECTED:
+        break;
+    }
+
+    switch (in_conn->codec != NULL
+            ? read_conn_codec(io, in_conn, out_conn, proxy,
+                              wait_read, wait_write)
+            : read_conn(io, in_conn, out_conn, proxy, wait_read, wait_write))
+    {
+    case -1:
+        return false;
+    case 0:
+        return true;
+    }
+
+    for (;;)
+    {
+        ssize_t ret;
+        size_t avail;
+        const void* ptr = buf_rptr(in_conn->buf, &avail);
+        if (avail == 0)
+        {
+            if (proxy != NULL)
+            {
+                http_proxy_flush(proxy, false);
+            }
+            break;
+        }
+        ret = conn_write(io, in_conn, ptr, avail);
+        if (ret < 0)
+        {
+            if (socket_blockingerror(in_conn->sock))
+            {
+                *wait_write = true;
+                break;
+            }
+            else
+            {
+                log_printf(log, LVL_WARN,
+                           "%s tunnel %s connection returned error when writing: %s",
+                           io->remote ? "Remote" : "Local",
+                           in_conn == &io->local_conn ? "local" : "daemon",
+                           socket_strerror(in_conn->sock));
+                tunnel_io_lost(io);
+                return false;
+            }
+        }
+        else if (ret == 0)
+        {
+            log_printf(log, LVL_WARN,
+                       "%s tunnel %s connection closed when sending %lu bytes of queued data",
+                       io->remote ? "Remote" : "Local",
+                       in_conn == &io->local_conn ? "local" : "daemon",
+                       (unsigned long)avail);
+            close_conn(io, in_conn);
+            return true;
+        }
+        if (buf_rmove(in_conn->buf, ret) == 0)
+        {
+            if (proxy != NULL)
+            {
+                http_proxy_flush(proxy, false);
+            }
+            break;
+        }
+        if (proxy != NULL)
+        {
+            http_proxy_flush(proxy, false);
+        }
+    }
+
+    return true;
+}
+
+/* A closed conn may have left data for the other one, the tunnel stays
+ * until it is sent. Sends through the ring rarely finish in one go */
+static bool tunnel_io_leftover(conn_t* closed, conn_t* other)
+{
+    return other->state == CONN_CONNECTED &&
+        (closed->draining || buf_ravail(other->buf) > 0);
+}
+
+static void daemon_tunnel_flush(tunnel_io_t* io)
+{
+    selector_t selector = worker_selector(io->worker);
+    bool local_read = false, local_write = false;
+    bool daemon_read = false, daemon_write = false;
+
+    if (io->frozen)
+    {
+        /* The sockets are waiting for the new daemon */
+        return;
     }
+    if (!io->backlogged)
+    {
+        /* Not waiting for its turn, so this is a new one */
+        io->budget = io->quantum;
+    }
+    io->throttled = false;
 
     for (;;)
     {
-        if (!flush_conn(daemon, tunnel,
-                        &(tunnel->local_conn), &(tunnel->daemon_conn),
+        if (!flush_conn(io, &(io->local_conn), &(io->daemon_conn),
                         NULL,
                         &local_read, &local_write))
         {
@@ -1634,9 +2970,8 @@ static void daemon_tunnel_flush(tunnel_t* tunnel)
         {
             break;
         }
-        if (!flush_conn(daemon, tunnel,
-                        &(tunnel->daemon_conn), &(tunnel->local_conn),
-                        tunnel->proxy,
+        if (!flush_conn(io, &(io->daemon_conn), &(io->local_conn),
+                        io->proxy,
                         &daemon_read, &daemon_write))
         {
             return;
@@ -1645,1122 +2980,4448 @@ static void daemon_tunnel_flush(tunnel_t* tunnel)
         {
             break;
         }
-        if (tunnel->local_conn.state != CONN_CONNECTED ||
-            tunnel->daemon_conn.state != CONN_CONNECTED)
+        if (io->local_conn.state != CONN_CONNECTED ||
+            io->daemon_conn.state != CONN_CONNECTED)
         {
-            break;
+            /* A closed local conn might still have the end of its
+             * compressed stream for the daemon conn */
+            if (!io->local_conn.draining ||
+                io->daemon_conn.state != CONN_CONNECTED || daemon_write)
+            {
+                break;
+            }
         }
-        if (daemon_read && buf_ravail(tunnel->daemon_conn.buf) == 0 &&
-            local_read && buf_ravail(tunnel->local_conn.buf) == 0)
+        if (daemon_read && buf_ravail(io->daemon_conn.buf) == 0 &&
+            local_read && buf_ravail(io->local_conn.buf) == 0)
         {
             break;
         }
     }
 
-    if (!tunnel->stasis)
+    if (!io->stasis)
     {
-        if (tunnel->remote)
+        if (io->remote)
         {
-            if (tunnel->local_conn.state == CONN_DEAD)
+            if (io->local_conn.state == CONN_DEAD &&
+                !tunnel_io_leftover(&(io->local_conn), &(io->daemon_conn)))
             {
-                daemon_lost_tunnel(tunnel);
+                tunnel_io_lost(io);
                 return;
             }
         }
         else
         {
-            if (tunnel->daemon_conn.state == CONN_DEAD)
+            if (io->daemon_conn.state == CONN_DEAD &&
+                !tunnel_io_leftover(&(io->daemon_conn), &(io->local_conn)))
             {
-                daemon_lost_tunnel(tunnel);
+                tunnel_io_lost(io);
                 return;
             }
         }
     }
 
-    if (tunnel->local_conn.state != CONN_DEAD)
+    /* A throttled tunnel doesn't read until it's its turn again */
+    if (io->local_conn.state != CONN_DEAD)
     {
-        selector_chk(daemon->selector, tunnel->local_conn.sock,
-                     local_read, local_write);
+        selector_chk(selector, io->local_conn.sock,
+                     local_read && !io->throttled &&
+                     !conn_held(io, &io->local_conn), local_write);
     }
-    if (tunnel->daemon_conn.state != CONN_DEAD)
+    if (io->daemon_conn.state != CONN_DEAD)
     {
-        selector_chk(daemon->selector, tunnel->daemon_conn.sock,
-                     daemon_read, daemon_write);
+        selector_chk(selector, io->daemon_conn.sock,
+                     daemon_read && !io->throttled &&
+                     !conn_held(io, &io->daemon_conn), daemon_write);
     }
-}
-
-static void tunnel_read_cb(void* userdata, socket_t sock)
-{
-    tunnel_t* tunnel = userdata;
-    daemon_t daemon;
-
-    if (tunnel->remote)
+    if (io->throttled)
     {
-        daemon = tunnel->source.remote.service->source->daemon;
+        tunnel_io_throttle(io);
     }
-    else
+    if (io->detaching)
     {
-        daemon = tunnel->source.local.server->daemon;
+        tunnel_io_try_detach(io);
     }
+}
 
-    if (tunnel->remote)
+static void tunnel_read_cb(void* userdata, socket_t sock)
+{
+    tunnel_io_t* io = userdata;
+
+    if (io->remote)
     {
-        if (tunnel->daemon_conn.sock == sock &&
-            tunnel->daemon_conn.state == CONN_CONNECTING)
+        if (io->daemon_conn.sock == sock &&
+            io->daemon_conn.state == CONN_CONNECTING)
         {
             ssize_t ret;
             char tmp[1];
-            ret = socket_read(tunnel->daemon_conn.sock, tmp, 1);
-            if (!(ret < 0 && socket_blockingerror(tunnel->daemon_conn.sock)))
+            ret = socket_read(io->daemon_conn.sock, tmp, 1);
+            if (!(ret < 0 && socket_blockingerror(io->daemon_conn.sock)))
             {
-                log_printf(daemon->log, LVL_WARN,
+                log_printf(io->daemon->log, LVL_WARN,
                            "Unable to connect tunnel to remote daemon: %s",
-                           socket_strerror(tunnel->daemon_conn.sock));
-                daemon_lost_tunnel(tunnel);
+                           socket_strerror(io->daemon_conn.sock));
+                tunnel_io_lost(io);
                 return;
             }
         }
     }
     else
     {
-        if (tunnel->local_conn.sock == sock &&
-            tunnel->local_conn.state == CONN_CONNECTING)
+        if (io->local_conn.sock == sock &&
+            io->local_conn.state == CONN_CONNECTING)
         {
             ssize_t ret;
             char tmp[1];
-            ret = socket_read(tunnel->local_conn.sock, tmp, 1);
-            if (!(ret < 0 && socket_blockingerror(tunnel->local_conn.sock)))
+            ret = socket_read(io->local_conn.sock, tmp, 1);
+            if (!(ret < 0 && socket_blockingerror(io->local_conn.sock)))
             {
-                log_printf(daemon->log, LVL_WARN,
+                log_printf(io->daemon->log, LVL_WARN,
                            "Unable to connect to local service: %s",
-                           socket_strerror(tunnel->local_conn.sock));
-                daemon_lost_tunnel(tunnel);
+                           socket_strerror(io->local_conn.sock));
+                tunnel_io_lost(io);
                 return;
             }
         }
     }
 
-    daemon_tunnel_flush(tunnel);
+    daemon_tunnel_flush(io);
 }
 
 static void tunnel_write_cb(void* userdata, socket_t sock)
 {
-    tunnel_t* tunnel = userdata;
+    tunnel_io_t* io = userdata;
 
-    if (tunnel->daemon_conn.sock == sock &&
-        tunnel->daemon_conn.state == CONN_CONNECTING)
+    if (io->daemon_conn.sock == sock &&
+        io->daemon_conn.state == CONN_CONNECTING)
     {
-        tunnel->daemon_conn.state = CONN_CONNECTED;
+        io->daemon_conn.state = CONN_CONNECTED;
+        if (io->send_token)
+        {
+            /* The token always fits in the empty send buffer of a new
+             * connection */
+            ssize_t ret = socket_write(sock, io->token,
+                                       PKG_TUNNEL_TOKEN_SIZE);
+            io->send_token = false;
+            if (ret != PKG_TUNNEL_TOKEN_SIZE)
+            {
+                log_printf(io->daemon->log, LVL_WARN,
+                           "Unable to connect tunnel to remote daemon: %s",
+                           socket_strerror(sock));
+                tunnel_io_lost(io);
+                return;
+            }
+        }
     }
 
-    if (!tunnel->remote)
+    if (!io->remote)
     {
-        if (tunnel->local_conn.sock == sock &&
-            tunnel->local_conn.state == CONN_CONNECTING)
+        if (io->local_conn.sock == sock &&
+            io->local_conn.state == CONN_CONNECTING)
         {
-            tunnel->local_conn.state = CONN_CONNECTED;
+            io->local_conn.state = CONN_CONNECTED;
         }
     }
 
-    daemon_tunnel_flush(tunnel);
+    daemon_tunnel_flush(io);
 }
 
-static void remoteservice_read_cb(void* userdata, socket_t sock)
+/* Handing over. Nothing may be on the way through the tunnel, and a
+ * compressed tunnel needs both codecs between streams as their state
+ * can't be handed over. The local codec is restarted and the other daemon
+ * asked to do the same with restart_tunnel, the daemon codec then stops
+ * at the end of its stream and whatever follows it is for the new
+ * daemon */
+
+static bool tunnel_io_quiet(tunnel_io_t* io)
 {
-    remoteservice_t *remote = userdata;
-    tunnel_t tunnel, *tunnelptr;
-    pkg_t pkg;
-    uint16_t port;
-    assert(remote->sock == sock);
-    memset(&tunnel, 0, sizeof(tunnel_t));
-    tunnel.local_conn.sock = socket_accept(sock, NULL, NULL);
-    if (tunnel.local_conn.sock < 0)
+    conn_t* local = &io->local_conn, *remote = &io->daemon_conn;
+    return !io->dead && !io->send_token && !local->draining &&
+        (local->state == CONN_CONNECTED ||
+         (io->stasis && local->state == CONN_CONNECTING)) &&
+        remote->state == (io->stasis ? CONN_DEAD : CONN_CONNECTED) &&
+        buf_ravail(local->buf) == 0 &&
+        (io->stasis || buf_ravail(remote->buf) == 0) &&
+        (local->zbuf == NULL || buf_ravail(local->zbuf) == 0) &&
+        (remote->zbuf == NULL || buf_ravail(remote->zbuf) == 0) &&
+        http_proxy_idle(io->proxy);
+}
+
+/* Take the sockets out of the selector, they stay open until either the
+ * new daemon has them or tunnel_io_resume_job */
+static void tunnel_io_freeze(tunnel_io_t* io)
+{
+    selector_t selector = worker_selector(io->worker);
+    selector_remove(selector, io->local_conn.sock);
+    if (io->daemon_conn.state != CONN_DEAD)
     {
-        return;
+        selector_remove(selector, io->daemon_conn.sock);
     }
-    socket_setblocking(tunnel.local_conn.sock, false);
-    tunnel.local_conn.state = CONN_CONNECTED;
-    tunnel.remote = true;
-    tunnel.source.remote.service = remote;
-    tunnel.local_conn.buf = buf_new(TUNNEL_BUFFER_LOCAL);
-    tunnel.daemon_conn.state = CONN_DEAD;
-    tunnel.daemon_conn.sock = -1;
-    tunnel.daemon_conn.buf = buf_new(TUNNEL_BUFFER_DAEMON);
-    tunnel.proxy = http_proxy_new("", "", tunnel.local_conn.buf);
-    for (;;)
+    io->frozen = true;
+}
+
+static void tunnel_io_detach_job(void* userdata)
+{
+    tunnel_io_t* io = userdata;
+    if (!tunnel_io_quiet(io))
+    {
+        tunnel_io_detach_done(io);
+    }
+    else if (io->local_conn.codec == NULL)
     {
-        tunnel.id = ++remote->source->remote_tunnel_id;
-        if (map_get(remote->source->remote_tunnels, &tunnel) == NULL)
+        if (io->stasis ||
+            selector_idle(worker_selector(io->worker), io->daemon_conn.sock))
         {
-            break;
+            tunnel_io_freeze(io);
         }
+        tunnel_io_detach_done(io);
+    }
+    else
+    {
+        io->detaching = true;
+        codec_restart(io->local_conn.codec);
+        if (!io->stasis)
+        {
+            codec_stop(io->daemon_conn.codec, true);
+            worker_post(io->daemon->control, tunnel_io_restart_peer_job, io);
+        }
+        daemon_tunnel_flush(io);
     }
-    tunnelptr = map_put(remote->source->remote_tunnels, &tunnel);
-    selector_add(remote->source->daemon->selector,
-                 tunnelptr->local_conn.sock,
-                 tunnelptr, tunnel_read_cb, tunnel_write_cb);
-    selector_chkwrite(remote->source->daemon->selector,
-                      tunnelptr->local_conn.sock, false);
-
-    port = daemon_allocate_tunnel_port(remote->source->daemon, tunnelptr,
-                                       remote->source);
-
-    tunnelptr->stasis = true;
-    tunnelptr->source.remote.listening = (port > 0);
-    pkg_create_tunnel(&pkg, remote->source_id, tunnelptr->id, remote->host,
-                      port);
-    daemon_server_write_pkg(remote->source, &pkg, true);
 }
 
-static void daemon_add_remote(daemon_t daemon, server_t* server,
-                              pkg_new_service_t* new_service)
+static void tunnel_io_give_up(tunnel_io_t* io)
 {
-    remoteservice_t remote, *remoteptr;
-    struct sockaddr* host;
-    socklen_t hostlen;
-    char* proto, *path;
-    memset(&remote, 0, sizeof(remoteservice_t));
-    remote.sock = -1;
-    remote.source_id = new_service->service_id;
-    remote.source = server;
-    remote.notify.host = ssdp_getnotifyhost(daemon->ssdp,
-                                            &(remote.notify.hostlen));
-    if (remote.notify.host == NULL)
+    if (!io->stasis)
     {
-        log_puts(daemon->log, LVL_ERR, "No SSDP multicast host");
-        return;
+        codec_stop(io->daemon_conn.codec, false);
     }
-    remote.sock = socket_tcp_listen(daemon->bind_services, 0);
-    if (remote.sock < 0 || !socket_setblocking(remote.sock, false))
+    tunnel_io_detach_done(io);
+    daemon_tunnel_flush(io);
+}
+
+/* With the ring the worker might have read more from the daemon conn, it
+ * goes to zbuf after what the codec left there. Returns -1 if it doesn't
+ * fit or the conn is closing, 0 if a send is still going on and 1 once
+ * the socket can be handed over */
+static int tunnel_io_drain(tunnel_io_t* io)
+{
+    selector_t selector = worker_selector(io->worker);
+    conn_t* conn = &io->daemon_conn;
+    while (!selector_idle(selector, conn->sock))
     {
-        log_printf(daemon->log, LVL_WARN, "Unable to listen for service: %s", socket_strerror(remote.sock));
-        socket_close(remote.sock);
-        free(remote.notify.host);
-        return;
+        size_t avail;
+        void* ptr = buf_wptr(conn->zbuf, &avail);
+        ssize_t ret;
+        if (avail == 0)
+        {
+            return -1;
+        }
+        ret = conn_read(io, conn, ptr, avail);
+        if (ret > 0)
+        {
+            buf_wmove(conn->zbuf, ret);
+            continue;
+        }
+        if (ret < 0 && socket_blockingerror(conn->sock))
+        {
+            selector_chkwrite(selector, conn->sock, true);
+            return 0;
+        }
+        return -1;
     }
-    host = socket_getsockaddr(remote.sock, &hostlen);
-    if (host == NULL)
+    return 1;
+}
+
+static void tunnel_io_try_detach(tunnel_io_t* io)
+{
+    conn_t* local = &io->local_conn, *remote = &io->daemon_conn;
+    if (io->stasis)
     {
-        log_puts(daemon->log, LVL_WARN, "Unable to get socket name for service socket");
-        socket_close(remote.sock);
-        free(remote.notify.host);
-        free(host);
-        return;
+        /* Nothing is sent, the end of the stream has to fit in buf */
+        if (!codec_boundary(local->codec))
+        {
+            tunnel_io_give_up(io);
+            return;
+        }
     }
-    if (addr_is_any(host, hostlen))
+    else
     {
-        /* This won't do, we need an actual address */
-        uint16_t port = addr_getport(host, hostlen);
-        free(host);
-        host = socket_getlocalhost(remote.sock, port, &hostlen);
+        if (!codec_stopped(remote->codec))
+        {
+            /* The other daemon hasn't restarted yet */
+            return;
+        }
+        if (!http_proxy_idle(io->proxy))
+        {
+            /* The end of the stream was in the middle of a message */
+            tunnel_io_give_up(io);
+            return;
+        }
+        if (!codec_boundary(local->codec) || buf_ravail(local->buf) > 0 ||
+            buf_ravail(remote->buf) > 0)
+        {
+            return;
+        }
+        switch (tunnel_io_drain(io))
+        {
+        case -1:
+            tunnel_io_give_up(io);
+            return;
+        case 0:
+            return;
+        }
     }
-    if (!parse_location(new_service->location, &proto, NULL, NULL, &path))
+    tunnel_io_freeze(io);
+    tunnel_io_detach_done(io);
+}
+
+/* Undo tunnel_io_detach_job */
+static void tunnel_io_resume(tunnel_io_t* io)
+{
+    if (io->detaching)
     {
-        log_printf(daemon->log, LVL_WARN, "Unable to parse location: %s",
-                   new_service->location);
-        socket_close(remote.sock);
-        free(remote.notify.host);
-        free(host);
-        free(proto);
-        free(path);
-        return;
+        tunnel_io_detach_done(io);
     }
-    remote.notify.location = build_location(proto, host, hostlen, path);
-    if (remote.notify.location == NULL)
+    if (io->daemon_conn.codec != NULL)
     {
-        log_puts(daemon->log, LVL_ERR, "Unable to build location");
-        socket_close(remote.sock);
-        free(remote.notify.host);
-        free(host);
-        free(proto);
-        free(path);
-        return;
+        codec_stop(io->daemon_conn.codec, false);
     }
-    free(proto);
-    free(path);
-    asprinthost(&(remote.host), host, hostlen);
-    free(host);
-    if (new_service->server != NULL)
+    if (io->frozen)
     {
-        remote.notify.server = strdup(new_service->server);
+        selector_t selector = worker_selector(io->worker);
+        io->frozen = false;
+        selector_add(selector, io->local_conn.sock,
+                     io, tunnel_read_cb, tunnel_write_cb);
+        if (io->local_conn.state == CONN_CONNECTED)
+        {
+            selector_chkwrite(selector, io->local_conn.sock, false);
+        }
+        if (io->daemon_conn.state != CONN_DEAD)
+        {
+            selector_add(selector, io->daemon_conn.sock,
+                         io, tunnel_read_cb, tunnel_write_cb);
+        }
     }
-    if (new_service->opt != NULL)
+    if (!io->dead)
     {
-        remote.notify.opt = strdup(new_service->opt);
+        daemon_tunnel_flush(io);
     }
-    if (new_service->nls != NULL)
+}
+
+/* The handover failed, carry on */
+static void tunnel_io_resume_job(void* userdata)
+{
+    tunnel_io_t* io = userdata;
+    tunnel_io_resume(io);
+    worker_post(io->daemon->control, tunnel_io_done_job, io);
+}
+
+/* The other daemon is handing the tunnel over, end the stream to it */
+static void tunnel_io_restart_job(void* userdata)
+{
+    tunnel_io_t* io = userdata;
+    if (!io->dead && !io->frozen && io->local_conn.codec != NULL)
     {
-        remote.notify.nls = strdup(new_service->nls);
+        codec_restart(io->local_conn.codec);
+        daemon_tunnel_flush(io);
     }
-    remote.notify.usn = strdup(new_service->usn);
-    remote.notify.nt = strdup(new_service->service);
-    remote.notify.expires = time(NULL) + REMOTE_EXPIRE_TTL;
+    worker_post(io->daemon->control, tunnel_io_done_job, io);
+}
 
-    remote.nt_version_pos = find_upnp_version(remote.notify.nt,
-                                              &remote.version_max);
-    if (remote.nt_version_pos != NULL)
+/* Main thread side of the tunnel IO */
+
+/* Takes ownership of source_host and target_host */
+static tunnel_io_t* tunnel_io_new(daemon_t daemon, tunnel_t* tunnel,
+                                  char* source_host, char* target_host)
+{
+    tunnel_io_t* io = calloc(1, sizeof(tunnel_io_t));
+    io->daemon = daemon;
+    io->id = tunnel->id;
+    io->remote = tunnel->remote;
+    io->tunnel = tunnel;
+    io->local_conn.sock = -1;
+    io->daemon_conn.sock = -1;
+    io->source_host = source_host;
+    io->target_host = target_host;
+    io->quantum = daemon->tunnel_quantum;
+    return io;
+}
+
+/* Rate limit for tunnels to services of type, 0 if none */
+static unsigned long daemon_tunnel_rate(daemon_t daemon, const char* type)
+{
+    size_t i;
+    for (i = 0; i < vector_size(daemon->tunnel_rates); ++i)
     {
-        unsigned int x;
-        remote.usn_version_pos = find_upnp_version(remote.notify.usn,
-                                                   &x);
-        if (x != remote.version_max)
+        tunnel_rate_t* rate = vector_get(daemon->tunnel_rates, i);
+        if (strncmp(type, rate->type, strlen(rate->type)) == 0)
         {
-            remote.usn_version_pos = NULL;
+            return rate->rate;
         }
     }
-
-    remoteptr = map_put(daemon->remotes, &remote);
-    selector_add(daemon->selector, remote.sock, remoteptr,
-                 remoteservice_read_cb, NULL);
-    ssdp_notify(daemon->ssdp, &(remoteptr->notify));
-    remoteptr->touchcb = timers_add(daemon->timers,
-                                    (REMOTE_EXPIRE_TTL - REMOTE_EXPIRE_BUFFER) * 1000,
-                                    remoteptr,
-                                    daemon_remoteservice_touch);
+    return 0;
 }
 
-static void daemon_del_remote(daemon_t daemon, server_t* server,
-                              pkg_old_service_t* old_service)
+static void tunnel_io_free(tunnel_io_t* io)
 {
-    remoteservice_t key;
-    key.source_id = old_service->service_id;
-    key.source = server;
-    map_remove(daemon->remotes, &key);
-}
+    if (io->worker != NULL)
+    {
+        assert(io->daemon->worker_load[io->worker_idx] > 0);
+        io->daemon->worker_load[io->worker_idx]--;
+    }
+    else
+    {
+        /* Never started */
+        close_conn(io, &io->local_conn);
+        close_conn(io, &io->daemon_conn);
+    }
+    free(io->source_host);
+    free(io->target_host);
+    free(io->head);
+    free(io->resume_in);
+    free(io->resume_out);
+    free(io);
+}
 
-static void daemon_create_tunnel(daemon_t daemon, server_t* server,
-                                 pkg_create_tunnel_t* create_tunnel)
+static void tunnel_io_lost_job(void* userdata)
+{
+    tunnel_io_t* io = userdata;
+    if (io->tunnel == NULL)
+    {
+        /* Already closed by the main thread, tunnel_io_closed_job will
+         * free it */
+        return;
+    }
+    io->lost = true;
+    daemon_lost_tunnel(io->tunnel);
+    assert(io->tunnel == NULL);
+    if (io->jobs == 0)
+    {
+        tunnel_io_free(io);
+    }
+}
+
+static void tunnel_io_closed_job(void* userdata)
+{
+    tunnel_io_t* io = userdata;
+    /* The answers come before this */
+    assert(io->jobs == 0);
+    tunnel_io_free(io);
+}
+
+static void tunnel_io_done_job(void* userdata)
+{
+    tunnel_io_t* io = userdata;
+    assert(io->jobs > 0);
+    if (--io->jobs == 0 && io->lost)
+    {
+        tunnel_io_free(io);
+    }
+}
+
+/* Give the tunnel a job, answered by tunnel_io_done_job or for
+ * tunnel_io_detach_job by tunnel_io_detached_job */
+static void tunnel_io_post(tunnel_io_t* io, worker_job_t job)
+{
+    io->jobs++;
+    worker_post(io->worker, job, io);
+}
+
+/* Hand the tunnel to the least busy worker */
+static void daemon_tunnel_start(tunnel_t* tunnel)
+{
+    tunnel_io_t* io = tunnel->io;
+    daemon_t daemon = io->daemon;
+    size_t i, best = 0;
+    assert(io->worker == NULL);
+    for (i = 1; i < daemon->workers; ++i)
+    {
+        if (daemon->worker_load[i] < daemon->worker_load[best])
+        {
+            best = i;
+        }
+    }
+    daemon->worker_load[best]++;
+    io->worker = daemon->worker[best];
+    io->worker_idx = best;
+    io->stasis = tunnel->stasis;
+    worker_post(io->worker, tunnel_io_adopt_job, io);
+}
+
+/* Give the connection to the other daemon to a started tunnel.
+ * If token isn't NULL it is sent as soon as the connection is made */
+static void daemon_tunnel_attach(tunnel_t* tunnel, socket_t sock,
+                                 conn_state_t state, const char* token)
+{
+    tunnel_attach_t* attach = malloc(sizeof(tunnel_attach_t));
+    assert(tunnel->io->worker != NULL);
+    if (tunnel->io->detach == DETACH_WAIT)
+    {
+        tunnel->io->daemon->handover_waiting--;
+    }
+    if (tunnel->io->detach != DETACH_NONE)
+    {
+        /* Not in stasis anymore, too late to hand it over */
+        tunnel->io->detach = DETACH_BUSY;
+    }
+    attach->io = tunnel->io;
+    attach->sock = sock;
+    attach->state = state;
+    attach->send_token = token != NULL;
+    if (token != NULL)
+    {
+        memcpy(attach->token, token, PKG_TUNNEL_TOKEN_SIZE);
+    }
+    worker_post(tunnel->io->worker, tunnel_io_attach_job, attach);
+}
+
+static void tunnel_free(tunnel_t* tunnel)
+{
+    tunnel_io_t* io = tunnel->io;
+    if (tunnel->listen != NULL)
+    {
+        tunnel_listen_free(tunnel->listen);
+    }
+    io->tunnel = NULL;
+    if (io->detach == DETACH_WAIT)
+    {
+        io->daemon->handover_waiting--;
+    }
+    io->detach = DETACH_NONE;
+    if (io->worker == NULL)
+    {
+        tunnel_io_free(io);
+    }
+    else if (!io->lost)
+    {
+        worker_post(io->worker, tunnel_io_close_job, io);
+    }
+}
+
+static void remote_tunnel_free(void* _tunnel)
+{
+    tunnel_free((tunnel_t*)_tunnel);
+}
+
+static void local_tunnel_free(void* _tunnel)
+{
+    tunnel_free((tunnel_t*)_tunnel);
+}
+
+/* Create a tunnel to remote for the client connection s. head is what
+ * has been read from s already, if anything */
+static void daemon_remoteservice_tunnel(remoteservice_t* remote, socket_t s,
+                                        const char* head, size_t headlen)
 {
+    daemon_t daemon = remote->source->daemon;
     tunnel_t tunnel, *tunnelptr;
-    localservice_t key;
-    key.id = create_tunnel->service_id;
+    pkg_t pkg;
+    uint16_t port;
     memset(&tunnel, 0, sizeof(tunnel_t));
-    tunnel.id = create_tunnel->tunnel_id;
-    tunnel.remote = false;
-    tunnel.source.local.server = server;
-    tunnel.source.local.service = map_get(daemon->locals, &key);
-    if (tunnel.source.local.service == NULL)
+    tunnel.remote = true;
+    tunnel.source.remote.service = remote;
+    tunnelptr = slotmap_put(remote->source->remote_tunnels, &tunnel,
+                            &tunnel.id);
+    tunnelptr->id = tunnel.id;
+    tunnelptr->io = tunnel_io_new(daemon, tunnelptr, strdup(""), strdup(""));
+    tunnelptr->io->local_conn.sock = s;
+    tunnelptr->io->local_conn.state = CONN_CONNECTED;
+    tunnelptr->io->compress = remote->source->compress;
+    tunnelptr->io->rate = daemon_tunnel_rate(daemon, remote->notify.nt);
+    if (headlen > 0)
+    {
+        tunnelptr->io->head = malloc(headlen);
+        memcpy(tunnelptr->io->head, head, headlen);
+        tunnelptr->io->headlen = headlen;
+    }
+
+    port = daemon_tunnel_port(daemon, tunnelptr, remote->source);
+
+    tunnelptr->stasis = true;
+    tunnelptr->source.remote.listening = (port > 0);
+    daemon_tunnel_start(tunnelptr);
+    pkg_create_tunnel(&pkg, remote->source_id, tunnelptr->id, remote->host,
+                      port, tunnelptr->io->compress);
+    daemon_server_write_pkg(remote->source, &pkg, true);
+}
+
+static void daemon_service_pending(daemon_t daemon, socket_t s,
+                                   struct sockaddr* addr, socklen_t addrlen,
+                                   remoteservice_t* remote);
+
+static void remoteservice_read_cb(void* userdata, socket_t sock)
+{
+    remoteservice_t *remote = userdata;
+    struct sockaddr* addr;
+    socklen_t addrlen;
+    socket_t s;
+    assert(remote->sock == sock);
+    s = socket_accept(sock, &addr, &addrlen);
+    if (s < 0)
     {
-        pkg_t pkg;
-        char* tmp;
-        asprinthost(&tmp, server->host, server->hostlen);
-        log_printf(daemon->log, LVL_WARN, "Server %s requesting a tunnel for non-existant service %lu",
-                   tmp, (unsigned long)key.id);
-        free(tmp);
-        pkg_setup_tunnel(&pkg, create_tunnel->tunnel_id, false, 0);
-        daemon_server_write_pkg(server, &pkg, true);
         return;
     }
-    tunnel.local_conn.sock = socket_tcp_connect2(
-                                 tunnel.source.local.service->host,
-                                 tunnel.source.local.service->hostlen,
-                                 false, daemon->bind_services);
-    if (tunnel.local_conn.sock < 0)
+    socket_setblocking(s, false);
+    if (remote->source->version >= 4)
     {
-        pkg_t pkg;
-        char* tmp;
-        asprinthost(&tmp, tunnel.source.local.service->host,
-                    tunnel.source.local.service->hostlen);
-        log_printf(daemon->log, LVL_WARN, "Unable to create tunnel to %s", tmp);
-        free(tmp);
-        pkg_setup_tunnel(&pkg, create_tunnel->tunnel_id, false, 0);
-        daemon_server_write_pkg(server, &pkg, true);
+        /* Could be a subscription to events, which is answered here */
+        daemon_service_pending(remote->source->daemon, s, addr, addrlen,
+                               remote);
         return;
     }
-    tunnel.source.local.remote_host = strdup(create_tunnel->host);
-    asprinthost(&(tunnel.source.local.local_host),
-                tunnel.source.local.service->host,
-                tunnel.source.local.service->hostlen);
-    tunnel.local_conn.state = CONN_CONNECTING;
-    tunnel.local_conn.buf = buf_new(TUNNEL_BUFFER_LOCAL);
-    tunnel.daemon_conn.buf = buf_new(TUNNEL_BUFFER_DAEMON);
-    tunnel.proxy = http_proxy_new(tunnel.source.local.remote_host,
-                                  tunnel.source.local.local_host,
-                                  tunnel.local_conn.buf);
+    free(addr);
+    daemon_remoteservice_tunnel(remote, s, NULL, 0);
+}
 
-    tunnelptr = map_put(server->local_tunnels, &tunnel);
+static uint32_t service_route_hash(const void* _route)
+{
+    return ((const service_route_t*)_route)->route;
+}
 
-    selector_add(daemon->selector, tunnelptr->local_conn.sock,
-                 tunnelptr, tunnel_read_cb, tunnel_write_cb);
+static bool service_route_eq(const void* _r1, const void* _r2)
+{
+    return ((const service_route_t*)_r1)->route ==
+        ((const service_route_t*)_r2)->route;
+}
 
-    if (create_tunnel->port > 0)
+static void service_pending_free(service_pending_t* pending, bool close_sock)
+{
+    daemon_t daemon = pending->daemon;
+    size_t i;
+    for (i = 0; i < vector_size(daemon->service_pending); ++i)
     {
-        pkg_t pkg;
-        struct sockaddr* host = calloc(1, server->hostlen);
-        memcpy(host, server->host, server->hostlen);
-        addr_setport(host, server->hostlen, create_tunnel->port);
-        tunnelptr->daemon_conn.state = CONN_CONNECTING;
-        tunnelptr->daemon_conn.sock = socket_tcp_connect2(host, server->hostlen,
-                                                          false,
-                                                          daemon->bind_server);
-        if (tunnelptr->daemon_conn.sock < 0)
+        if (*((service_pending_t**)vector_get(daemon->service_pending, i))
+            == pending)
+        {
+            vector_remove(daemon->service_pending, i);
+            break;
+        }
+    }
+    if (pending->timeoutcb != NULL)
+    {
+        timecb_cancel(pending->timeoutcb);
+    }
+    selector_remove(daemon->selector, pending->sock);
+    if (close_sock)
+    {
+        socket_close(pending->sock);
+    }
+    free(pending->addr);
+    free(pending);
+}
+
+static long service_pending_timeout(void* userdata)
+{
+    service_pending_t* pending = userdata;
+    pending->timeoutcb = NULL;
+    service_pending_free(pending, true);
+    return -1;
+}
+
+/* Answer a request on the service port that can't be routed and close
+ * the connection. Best effort, the socket is new so the reply fits */
+static void service_pending_reply(service_pending_t* pending,
+                                  const char* status)
+{
+    char tmp[128];
+    int len = snprintf(tmp, sizeof(tmp),
+                       "HTTP/1.1 %s\r\n"
+                       "Content-Length: 0\r\n"
+                       "Connection: close\r\n"
+                       "\r\n", status);
+    if (len > 0 && (size_t)len < sizeof(tmp))
+    {
+        socket_write(pending->sock, tmp, len);
+    }
+    service_pending_free(pending, true);
+}
+
+/* Remember route as the last one used by the client at addr */
+static void daemon_service_client(daemon_t daemon,
+                                  const struct sockaddr* addr,
+                                  socklen_t addrlen, uint32_t route)
+{
+    service_client_t client;
+    size_t i;
+    for (i = vector_size(daemon->service_clients); i > 0; --i)
+    {
+        service_client_t* c = vector_get(daemon->service_clients, i - 1);
+        if (socket_samehost(c->addr, c->addrlen, addr, addrlen))
+        {
+            if (i == vector_size(daemon->service_clients))
+            {
+                c->route = route;
+                return;
+            }
+            free(c->addr);
+            vector_remove(daemon->service_clients, i - 1);
+            break;
+        }
+    }
+    if (vector_size(daemon->service_clients) == SERVICE_CLIENTS_MAX)
+    {
+        service_client_t* c = vector_get(daemon->service_clients, 0);
+        free(c->addr);
+        vector_remove(daemon->service_clients, 0);
+    }
+    client.addr = malloc(addrlen);
+    memcpy(client.addr, addr, addrlen);
+    client.addrlen = addrlen;
+    client.route = route;
+    vector_push(daemon->service_clients, &client);
+}
+
+/* Find the service for the Request-Line in line, or NULL */
+static remoteservice_t* daemon_service_route(daemon_t daemon,
+                                             const struct sockaddr* addr,
+                                             socklen_t addrlen,
+                                             const char* line)
+{
+    const size_t prefixlen = sizeof(SERVICE_ROUTE_PREFIX) - 1;
+    service_route_t key, *route;
+    const char* uri = strpbrk(line, " \t");
+    size_t i;
+    if (uri == NULL)
+    {
+        return NULL;
+    }
+    while (*uri == ' ' || *uri == '\t')
+    {
+        ++uri;
+    }
+    if (strncmp(uri, SERVICE_ROUTE_PREFIX, prefixlen) == 0)
+    {
+        unsigned long x;
+        char* end;
+        errno = 0;
+        x = strtoul(uri + prefixlen, &end, 16);
+        if (errno || end == uri + prefixlen || x == 0 || x > 0xffffffff ||
+            (*end != '/' && *end != '?' && *end != ' ' && *end != '\t'))
+        {
+            return NULL;
+        }
+        key.route = x;
+        route = map_get(daemon->service_routes, &key);
+        if (route != NULL)
+        {
+            daemon_service_client(daemon, addr, addrlen, key.route);
+            return route->remote;
+        }
+        return NULL;
+    }
+    for (i = vector_size(daemon->service_clients); i > 0; --i)
+    {
+        service_client_t* c = vector_get(daemon->service_clients, i - 1);
+        if (socket_samehost(c->addr, c->addrlen, addr, addrlen))
+        {
+            key.route = c->route;
+            route = map_get(daemon->service_routes, &key);
+            return route != NULL ? route->remote : NULL;
+        }
+    }
+    return NULL;
+}
+
+static void daemon_gena_pending(service_pending_t* pending,
+                                remoteservice_t* remote);
+
+static void service_pending_read_cb(void* userdata, socket_t sock)
+{
+    service_pending_t* pending = userdata;
+    daemon_t daemon = pending->daemon;
+    remoteservice_t* remote;
+    ssize_t got;
+    char* eol;
+    assert(pending->sock == sock);
+
+    got = socket_read(sock, pending->line + pending->got,
+                      SERVICE_LINE_MAX - 1 - pending->got);
+    if (got <= 0)
+    {
+        if (got < 0 && socket_blockingerror(sock))
         {
-            char* tmp;
-            asprinthost(&tmp, host, server->hostlen);
-            log_printf(daemon->log, LVL_WARN,
-                       "Unable to connect tunnel to %s", tmp);
-            free(tmp);
-            pkg_setup_tunnel(&pkg, create_tunnel->tunnel_id, false, 0);
-            daemon_server_write_pkg(server, &pkg, true);
-            free(host);
-            map_remove(server->local_tunnels, tunnelptr);
             return;
         }
-        free(host);
+        service_pending_free(pending, true);
+        return;
+    }
+    pending->got += got;
+    pending->line[pending->got] = '\0';
+    eol = memchr(pending->line, '\n', pending->got);
+    if (eol == NULL)
+    {
+        if (pending->got == SERVICE_LINE_MAX - 1)
+        {
+            service_pending_reply(pending, "414 Request-URI Too Long");
+        }
+        return;
+    }
 
-        pkg_setup_tunnel(&pkg, create_tunnel->tunnel_id, true, 0);
-        daemon_server_write_pkg(server, &pkg, true);
-        tunnelptr->stasis = false;
+    if (pending->remote != NULL)
+    {
+        remote = pending->remote;
+    }
+    else
+    {
+        *eol = '\0';
+        remote = daemon_service_route(daemon, pending->addr,
+                                      pending->addrlen, pending->line);
+        *eol = '\n';
+    }
+    if (remote == NULL)
+    {
+        service_pending_reply(pending, "404 Not Found");
+        return;
+    }
+    if (remote->source->congested)
+    {
+        service_pending_reply(pending, "503 Service Unavailable");
+        return;
+    }
+    if (remote->source->version >= 4 &&
+        (strncmp(pending->line, "SUBSCRIBE ", 10) == 0 ||
+         strncmp(pending->line, "UNSUBSCRIBE ", 12) == 0))
+    {
+        daemon_gena_pending(pending, remote);
+        return;
+    }
+    daemon_remoteservice_tunnel(remote, sock, pending->line, pending->got);
+    service_pending_free(pending, false);
+}
+
+/* Wait for the request on s to see where it goes, remote is the service
+ * if s was accepted on its socket */
+static void daemon_service_pending(daemon_t daemon, socket_t s,
+                                   struct sockaddr* addr, socklen_t addrlen,
+                                   remoteservice_t* remote)
+{
+    service_pending_t* pending = calloc(1, sizeof(service_pending_t));
+    pending->daemon = daemon;
+    pending->remote = remote;
+    pending->sock = s;
+    pending->addr = addr;
+    pending->addrlen = addrlen;
+    pending->timeoutcb = timers_add(daemon->timers, SERVICE_REQUEST_TIMEOUT,
+                                    pending, service_pending_timeout);
+    vector_push(daemon->service_pending, &pending);
+    selector_add(daemon->selector, s, pending, service_pending_read_cb, NULL);
+}
+
+static void service_port_accept_cb(void* userdata, socket_t sock,
+                                   socket_t s)
+{
+    daemon_t daemon = userdata;
+    struct sockaddr* addr;
+    socklen_t addrlen;
+    assert(daemon->service_sock == sock);
+
+    if (s < 0)
+    {
+        log_printf(daemon->log, LVL_WARN,
+                   "Error accepting service connection: %s",
+                   socket_strerror(sock));
+        return;
+    }
+    addr = socket_getpeeraddr(s, &addrlen);
+    if (addr == NULL)
+    {
+        socket_close(s);
+        return;
+    }
+    socket_setblocking(s, false);
+    daemon_service_pending(daemon, s, addr, addrlen, NULL);
+}
+
+static void daemon_setup_service_port(daemon_t daemon)
+{
+    assert(daemon->selector != NULL && daemon->service_sock < 0);
+    if (daemon->service_port == 0)
+    {
+        return;
+    }
+    daemon->service_sock = socket_tcp_listen(daemon->bind_services,
+                                             daemon->service_port);
+    if (daemon->service_sock >= 0 &&
+        socket_setblocking(daemon->service_sock, false))
+    {
+        selector_add_listener(daemon->selector, daemon->service_sock, daemon,
+                              service_port_accept_cb);
+    }
+    else
+    {
+        log_printf(daemon->log, LVL_WARN,
+                   "Unable to listen for service connections on %s:%u: %s",
+                   daemon->bind_services != NULL
+                   ? daemon->bind_services : "*",
+                   daemon->service_port,
+                   socket_strerror(daemon->service_sock));
+        socket_close(daemon->service_sock);
+        daemon->service_sock = -1;
+    }
+}
+
+static void daemon_close_service_port(daemon_t daemon)
+{
+    if (daemon->service_sock >= 0)
+    {
+        selector_remove(daemon->selector, daemon->service_sock);
+        socket_close(daemon->service_sock);
+        daemon->service_sock = -1;
+    }
+    if (daemon->service_pending != NULL)
+    {
+        while (vector_size(daemon->service_pending) > 0)
+        {
+            service_pending_free(*((service_pending_t**)vector_get(
+                                       daemon->service_pending, 0)), true);
+        }
+    }
+}
+
+static void gena_exchange_free(gena_exchange_t* ex)
+{
+    daemon_t daemon = ex->daemon;
+    if (ex->sent)
+    {
+        size_t i;
+        for (i = 0; i < vector_size(daemon->gena_exchanges); ++i)
+        {
+            if (*((gena_exchange_t**)vector_get(daemon->gena_exchanges, i))
+                == ex)
+            {
+                vector_remove(daemon->gena_exchanges, i);
+                break;
+            }
+        }
+        selector_remove(daemon->selector, ex->sock);
+    }
+    if (ex->timeoutcb != NULL)
+    {
+        timecb_cancel(ex->timeoutcb);
+    }
+    socket_close(ex->sock);
+    free(ex->out);
+    free(ex);
+}
+
+static void gena_exchange_finish(gena_exchange_t* ex,
+                                 const gena_response_t* resp)
+{
+    gena_done_t done = ex->done;
+    void* userdata = ex->userdata;
+    gena_exchange_free(ex);
+    if (done != NULL)
+    {
+        done(userdata, resp);
+    }
+}
+
+static long gena_exchange_timeout(void* userdata)
+{
+    gena_exchange_t* ex = userdata;
+    ex->timeoutcb = NULL;
+    gena_exchange_finish(ex, NULL);
+    return -1;
+}
+
+static void gena_exchange_read_cb(void* userdata, socket_t sock)
+{
+    gena_exchange_t* ex = userdata;
+    gena_response_t resp;
+    ssize_t got;
+    int ret;
+    got = socket_read(sock, ex->in + ex->got, sizeof(ex->in) - ex->got);
+    if (got <= 0)
+    {
+        if (got < 0 && socket_blockingerror(sock))
+        {
+            return;
+        }
+        gena_exchange_finish(ex, NULL);
+        return;
+    }
+    ex->got += got;
+    ret = gena_parse_response(ex->in, ex->got, &resp);
+    if (ret == 0)
+    {
+        if (ex->got == sizeof(ex->in))
+        {
+            gena_exchange_finish(ex, NULL);
+        }
+        return;
+    }
+    if (ret < 0)
+    {
+        gena_exchange_finish(ex, NULL);
+        return;
+    }
+    gena_exchange_finish(ex, &resp);
+    gena_response_free(&resp);
+}
+
+static void gena_exchange_write_cb(void* userdata, socket_t sock)
+{
+    gena_exchange_t* ex = userdata;
+    if (ex->outpos < ex->outlen)
+    {
+        ssize_t got = socket_write(sock, ex->out + ex->outpos,
+                                   ex->outlen - ex->outpos);
+        if (got < 0)
+        {
+            if (!socket_blockingerror(sock))
+            {
+                gena_exchange_finish(ex, NULL);
+            }
+            return;
+        }
+        ex->outpos += got;
+    }
+    if (ex->outpos == ex->outlen)
+    {
+        selector_chkwrite(ex->daemon->selector, sock, false);
+    }
+}
+
+/* Start connecting to addr. The request is given to gena_exchange_send,
+ * the local address of the connection is known by then */
+static gena_exchange_t* gena_exchange_new(daemon_t daemon,
+                                          const struct sockaddr* addr,
+                                          socklen_t addrlen)
+{
+    gena_exchange_t* ex;
+    socket_t sock = socket_tcp_connect2(addr, addrlen, false,
+                                        daemon->bind_services);
+    if (sock < 0)
+    {
+        return NULL;
+    }
+    ex = calloc(1, sizeof(gena_exchange_t));
+    ex->daemon = daemon;
+    ex->sock = sock;
+    return ex;
+}
+
+/* Send msg, which is freed with the exchange. done is called with the
+ * response unless the exchange is freed before that */
+static void gena_exchange_send(gena_exchange_t* ex, char* msg, size_t len,
+                               gena_done_t done, void* userdata)
+{
+    daemon_t daemon = ex->daemon;
+    assert(!ex->sent);
+    ex->sent = true;
+    ex->out = msg;
+    ex->outlen = len;
+    ex->done = done;
+    ex->userdata = userdata;
+    vector_push(daemon->gena_exchanges, &ex);
+    ex->timeoutcb = timers_add(daemon->timers, GENA_EXCHANGE_TIMEOUT, ex,
+                               gena_exchange_timeout);
+    selector_add(daemon->selector, ex->sock, ex, gena_exchange_read_cb,
+                 gena_exchange_write_cb);
+}
+
+/* Send the event as parts, see pkg_event_t */
+static void daemon_gena_send_event(server_t* server, uint32_t watch_id,
+                                   const char* body, size_t len)
+{
+    size_t pos = 0;
+    do
+    {
+        size_t part = len - pos > PKG_EVENT_PART ? PKG_EVENT_PART : len - pos;
+        pkg_t pkg;
+        pkg_event(&pkg, watch_id, pos + part == len, (char*)body + pos, part);
+        daemon_server_write_pkg(server, &pkg, true);
+        pos += part;
+    } while (pos < len);
+}
+
+/* The ops of daemon->gena, the links are the servers */
+
+static void gena_op_subscribe(void* userdata, void* link,
+                              uint32_t service_id, uint32_t watch_id,
+                              const char* path)
+{
+    pkg_t pkg;
+    pkg_subscribe(&pkg, service_id, watch_id, (char*)path);
+    daemon_server_write_pkg(link, &pkg, true);
+}
+
+static void gena_op_unsubscribe(void* userdata, void* link,
+                                uint32_t watch_id, bool local)
+{
+    pkg_t pkg;
+    pkg_unsubscribe(&pkg, watch_id, local);
+    daemon_server_write_pkg(link, &pkg, true);
+}
+
+static void gena_op_event(void* userdata, void* link, uint32_t watch_id,
+                          const char* body, size_t len)
+{
+    daemon_gena_send_event(link, watch_id, body, len);
+}
+
+static void* gena_op_connect(void* userdata, const struct sockaddr* addr,
+                             socklen_t addrlen)
+{
+    return gena_exchange_new(userdata, addr, addrlen);
+}
+
+static uint16_t daemon_gena_port(daemon_t daemon);
+
+static char* gena_op_callback(void* userdata, void* conn, const char* path)
+{
+    gena_exchange_t* ex = conn;
+    uint16_t port = daemon_gena_port(userdata);
+    socklen_t hostlen;
+    struct sockaddr* host;
+    char* ret;
+    if (port == 0)
+    {
+        return NULL;
+    }
+    host = socket_getsockaddr(ex->sock, &hostlen);
+    if (host == NULL)
+    {
+        return NULL;
+    }
+    addr_setport(host, hostlen, port);
+    ret = build_location("http", host, hostlen, path);
+    free(host);
+    return ret;
+}
+
+static void gena_op_send(void* userdata, void* conn, char* msg, size_t len,
+                         gena_done_t done, void* done_userdata)
+{
+    gena_exchange_send(conn, msg, len, done, done_userdata);
+}
+
+static void gena_op_cancel(void* userdata, void* conn)
+{
+    gena_exchange_free(conn);
+}
+
+static const gena_ops_t daemon_gena_ops = {
+    gena_op_subscribe,
+    gena_op_unsubscribe,
+    gena_op_event,
+    gena_op_connect,
+    gena_op_callback,
+    gena_op_send,
+    gena_op_cancel,
+};
+
+static void daemon_gena_event(daemon_t daemon, server_t* server,
+                              pkg_event_view_t* event)
+{
+    size_t len = pkg_str_len(&(event->data));
+    bool ok;
+    if (len > event->data.len[0])
+    {
+        /* Split by the end of the ring */
+        char* tmp = pkg_str_dup(&(event->data));
+        ok = gena_link_event(daemon->gena, server, event->watch_id, tmp, len,
+                             event->last);
+        free(tmp);
+    }
+    else
+    {
+        ok = gena_link_event(daemon->gena, server, event->watch_id,
+                             event->data.ptr[0], len, event->last);
+    }
+    if (!ok)
+    {
+        char* tmp;
+        asprinthost(&tmp, server->host, server->hostlen);
+        log_printf(daemon->log, LVL_WARN,
+                   "Server %s sent a too large event, dropped the"
+                   " subscription", tmp);
+        free(tmp);
+    }
+}
+
+/* The path of the event URL uri without host and route, NULL if it isn't
+ * one */
+static char* gena_event_path(const char* uri)
+{
+    const size_t prefixlen = sizeof(SERVICE_ROUTE_PREFIX) - 1;
+    if (strncasecmp(uri, "http://", 7) == 0)
+    {
+        uri = strchr(uri + 7, '/');
+        if (uri == NULL)
+        {
+            return NULL;
+        }
+    }
+    if (*uri != '/')
+    {
+        return NULL;
+    }
+    if (strncmp(uri, SERVICE_ROUTE_PREFIX, prefixlen) == 0)
+    {
+        size_t x = strspn(uri + prefixlen, "0123456789abcdefABCDEF");
+        if (x > 0 && uri[prefixlen + x] == '/')
+        {
+            uri += prefixlen + x;
+        }
+    }
+    return strdup(uri);
+}
+
+/* Answer the subscription request on pending once the whole header is
+ * in */
+static void daemon_gena_pending(service_pending_t* pending,
+                                remoteservice_t* remote)
+{
+    gena_request_t req;
+    char* resp, *path;
+    size_t len;
+    int ret = gena_parse_request(pending->line, pending->got, &req);
+    if (ret == 0)
+    {
+        if (pending->got == SERVICE_LINE_MAX - 1)
+        {
+            service_pending_reply(pending, "400 Bad Request");
+        }
+        return;
+    }
+    if (ret < 0)
+    {
+        service_pending_reply(pending, "400 Bad Request");
+        return;
+    }
+    path = gena_event_path(req.uri);
+    resp = gena_client_request(pending->daemon->gena, remote->source, remote,
+                               remote->source_id, path, &req, &len);
+    free(path);
+    gena_request_free(&req);
+    if (resp != NULL)
+    {
+        socket_write(pending->sock, resp, len);
+        free(resp);
+    }
+    service_pending_free(pending, true);
+}
+
+/* Drop the watches of remote and the connections waiting for it */
+static void daemon_gena_drop_remote(daemon_t daemon, remoteservice_t* remote)
+{
+    size_t i;
+    if (daemon->service_pending != NULL)
+    {
+        i = 0;
+        while (i < vector_size(daemon->service_pending))
+        {
+            service_pending_t* pending = *((service_pending_t**)vector_get(
+                                               daemon->service_pending, i));
+            if (pending->remote == remote)
+            {
+                service_pending_free(pending, true);
+            }
+            else
+            {
+                ++i;
+            }
+        }
+    }
+    if (daemon->gena != NULL)
+    {
+        gena_drop_service(daemon->gena, remote);
+    }
+}
+
+static void gena_incoming_read_cb(void* userdata, socket_t sock);
+static long gena_incoming_timeout(void* userdata);
+
+static void gena_port_accept_cb(void* userdata, socket_t sock)
+{
+    daemon_t daemon = userdata;
+    gena_incoming_t* in;
+    socket_t s;
+    assert(daemon->gena_sock == sock);
+    s = socket_accept(sock, NULL, NULL);
+    if (s < 0)
+    {
+        return;
+    }
+    socket_setblocking(s, false);
+    in = calloc(1, sizeof(gena_incoming_t));
+    in->daemon = daemon;
+    in->sock = s;
+    in->timeoutcb = timers_add(daemon->timers, GENA_EXCHANGE_TIMEOUT, in,
+                               gena_incoming_timeout);
+    vector_push(daemon->gena_incoming, &in);
+    selector_add(daemon->selector, s, in, gena_incoming_read_cb, NULL);
+}
+
+/* The port the local services send their events to, 0 if there is none */
+static uint16_t daemon_gena_port(daemon_t daemon)
+{
+    struct sockaddr* addr;
+    socklen_t addrlen;
+    uint16_t port;
+    if (daemon->gena_sock < 0)
+    {
+        daemon->gena_sock = socket_tcp_listen(daemon->bind_services, 0);
+        if (daemon->gena_sock < 0 ||
+            !socket_setblocking(daemon->gena_sock, false))
+        {
+            log_printf(daemon->log, LVL_WARN,
+                       "Unable to listen for events: %s",
+                       socket_strerror(daemon->gena_sock));
+            socket_close(daemon->gena_sock);
+            daemon->gena_sock = -1;
+            return 0;
+        }
+        selector_add(daemon->selector, daemon->gena_sock, daemon,
+                     gena_port_accept_cb, NULL);
+    }
+    addr = socket_getsockaddr(daemon->gena_sock, &addrlen);
+    if (addr == NULL)
+    {
+        return 0;
+    }
+    port = addr_getport(addr, addrlen);
+    free(addr);
+    return port;
+}
+
+static void daemon_gena_subscribe(daemon_t daemon, server_t* server,
+                                  pkg_subscribe_view_t* subscribe)
+{
+    localservice_t* local = slotmap_get(daemon->locals,
+                                        subscribe->service_id);
+    char* path = pkg_str_dup(&(subscribe->path));
+    gena_link_subscribe(daemon->gena, server, subscribe->watch_id,
+                        local != NULL ? local->host : NULL,
+                        local != NULL ? local->hostlen : 0, path);
+    free(path);
+}
+
+/* Drop the watches of srv and the watchers it has here. The server is
+ * told if tell, else it is gone already */
+static void daemon_gena_drop_server(daemon_t daemon, server_t* srv,
+                                    bool tell)
+{
+    if (daemon->gena != NULL)
+    {
+        gena_drop_link(daemon->gena, srv, tell);
+    }
+}
+
+static void gena_incoming_free(gena_incoming_t* in)
+{
+    daemon_t daemon = in->daemon;
+    size_t i;
+    for (i = 0; i < vector_size(daemon->gena_incoming); ++i)
+    {
+        if (*((gena_incoming_t**)vector_get(daemon->gena_incoming, i)) == in)
+        {
+            vector_remove(daemon->gena_incoming, i);
+            break;
+        }
+    }
+    if (in->timeoutcb != NULL)
+    {
+        timecb_cancel(in->timeoutcb);
+    }
+    selector_remove(daemon->selector, in->sock);
+    socket_close(in->sock);
+    free(in->data);
+    free(in);
+}
+
+static long gena_incoming_timeout(void* userdata)
+{
+    gena_incoming_t* in = userdata;
+    in->timeoutcb = NULL;
+    gena_incoming_free(in);
+    return -1;
+}
+
+/* Best effort, the socket is new so the reply fits */
+static void gena_incoming_reply(gena_incoming_t* in, const char* status)
+{
+    size_t len;
+    char* msg = gena_status(status, &len);
+    if (msg != NULL)
+    {
+        socket_write(in->sock, msg, len);
+        free(msg);
+    }
+    gena_incoming_free(in);
+}
+
+static void gena_incoming_read_cb(void* userdata, socket_t sock)
+{
+    gena_incoming_t* in = userdata;
+    gena_request_t req;
+    const char* status;
+    ssize_t got;
+    size_t need;
+    int ret;
+    assert(in->sock == sock);
+    if (in->data == NULL)
+    {
+        in->size = GENA_HEAD_MAX;
+        in->data = malloc(in->size);
+    }
+    got = socket_read(sock, in->data + in->got, in->size - in->got);
+    if (got <= 0)
+    {
+        if (got < 0 && socket_blockingerror(sock))
+        {
+            return;
+        }
+        gena_incoming_free(in);
+        return;
+    }
+    in->got += got;
+    ret = gena_parse_request(in->data, in->got, &req);
+    if (ret == 0)
+    {
+        if (in->got == in->size)
+        {
+            gena_incoming_reply(in, "400 Bad Request");
+        }
+        return;
+    }
+    if (ret < 0)
+    {
+        gena_incoming_reply(in, "400 Bad Request");
+        return;
+    }
+    if (req.method != GENA_NOTIFY)
+    {
+        gena_request_free(&req);
+        gena_incoming_reply(in, "405 Method Not Allowed");
+        return;
+    }
+    if (req.content_length > GENA_BODY_MAX)
+    {
+        gena_request_free(&req);
+        gena_incoming_reply(in, "413 Request Entity Too Large");
+        return;
+    }
+    need = req.headlen + req.content_length;
+    if (in->got < need)
+    {
+        if (in->size < need)
+        {
+            in->size = need;
+            in->data = realloc(in->data, in->size);
+        }
+        gena_request_free(&req);
+        return;
+    }
+    status = gena_service_notify(in->daemon->gena, &req,
+                                 in->data + req.headlen, req.content_length);
+    gena_request_free(&req);
+    gena_incoming_reply(in, status);
+}
+
+/* As pkg_str_nulldup but interned in daemon->strings */
+static char* daemon_intern_pkg_str(daemon_t daemon, const pkg_str_t* str)
+{
+    size_t len = pkg_str_len(str);
+    char* tmp, *ret;
+    if (len == 0)
+    {
+        return NULL;
+    }
+    if (str->len[0] == len)
+    {
+        return strtab_internn(daemon->strings, str->ptr[0], len);
+    }
+    /* Split by the end of the ring */
+    tmp = pkg_str_dup(str);
+    ret = strtab_internn(daemon->strings, tmp, len);
+    free(tmp);
+    return ret;
+}
+
+static void daemon_put_remote(daemon_t daemon, remoteservice_t* remote);
+
+static void daemon_add_remote(daemon_t daemon, server_t* server,
+                              pkg_new_service_view_t* new_service)
+{
+    remoteservice_t remote;
+    struct sockaddr* host;
+    socklen_t hostlen;
+    char* proto, *path, *location;
+    memset(&remote, 0, sizeof(remoteservice_t));
+    remote.sock = -1;
+    remote.source_id = new_service->service_id;
+    remote.source = server;
+    remote.notify.host = ssdp_getnotifyhost(daemon->ssdp,
+                                            &(remote.notify.hostlen));
+    if (remote.notify.host == NULL)
+    {
+        log_puts(daemon->log, LVL_ERR, "No SSDP multicast host");
+        return;
+    }
+    if (daemon->service_sock >= 0 && server->version >= 3)
+    {
+        /* The server strips the route, so the service port will do */
+        service_route_t route;
+        for (;;)
+        {
+            route.route = ++daemon->service_route;
+            if (route.route != 0 &&
+                map_get(daemon->service_routes, &route) == NULL)
+            {
+                break;
+            }
+        }
+        remote.route = route.route;
+        host = socket_getsockaddr(daemon->service_sock, &hostlen);
+    }
+    else
+    {
+        remote.sock = socket_tcp_listen(daemon->bind_services, 0);
+        if (remote.sock < 0 || !socket_setblocking(remote.sock, false))
+        {
+            log_printf(daemon->log, LVL_WARN, "Unable to listen for service: %s", socket_strerror(remote.sock));
+            socket_close(remote.sock);
+            free(remote.notify.host);
+            return;
+        }
+        host = socket_getsockaddr(remote.sock, &hostlen);
+    }
+    if (host == NULL)
+    {
+        log_puts(daemon->log, LVL_WARN, "Unable to get socket name for service socket");
+        socket_close(remote.sock);
+        free(remote.notify.host);
+        free(host);
+        return;
+    }
+    if (addr_is_any(host, hostlen))
+    {
+        /* This won't do, we need an actual address */
+        uint16_t port = addr_getport(host, hostlen);
+        free(host);
+        host = socket_getlocalhost(remote.route != 0 ? daemon->service_sock
+                                   : remote.sock, port, &hostlen);
+    }
+    location = pkg_str_dup(&(new_service->location));
+    if (!parse_location(location, &proto, NULL, NULL, &path))
+    {
+        log_printf(daemon->log, LVL_WARN, "Unable to parse location: %s",
+                   location);
+        socket_close(remote.sock);
+        free(remote.notify.host);
+        free(host);
+        free(proto);
+        free(path);
+        free(location);
+        return;
+    }
+    free(location);
+    if (remote.route != 0)
+    {
+        char* tmp;
+        if (asprintf(&tmp, "%s%lx/%s", SERVICE_ROUTE_PREFIX + 1,
+                     (unsigned long)remote.route, path) == -1)
+        {
+            tmp = NULL;
+        }
+        free(path);
+        path = tmp;
+    }
+    remote.notify.location = path != NULL
+        ? build_location(proto, host, hostlen, path) : NULL;
+    if (remote.notify.location == NULL)
+    {
+        log_puts(daemon->log, LVL_ERR, "Unable to build location");
+        socket_close(remote.sock);
+        free(remote.notify.host);
+        free(host);
+        free(proto);
+        free(path);
+        return;
+    }
+    free(proto);
+    free(path);
+    asprinthost(&(remote.host), host, hostlen);
+    free(host);
+    remote.notify.server = daemon_intern_pkg_str(daemon,
+                                                 &(new_service->server));
+    remote.notify.opt = daemon_intern_pkg_str(daemon, &(new_service->opt));
+    remote.notify.nls = daemon_intern_pkg_str(daemon, &(new_service->nls));
+    remote.notify.usn = pkg_str_dup(&(new_service->usn));
+    remote.notify.nt = pkg_str_dup(&(new_service->service));
+    daemon_put_remote(daemon, &remote);
+}
+
+/* Add the remote service, announce it and keep announcing it. notify.host,
+ * location, usn, nt, host and either sock or route has to be set */
+static void daemon_put_remote(daemon_t daemon, remoteservice_t* _remote)
+{
+    remoteservice_t remote = *_remote, *remoteptr;
+    server_t* server = remote.source;
+    remote.notify.expires = daemon_now(daemon) + REMOTE_EXPIRE_TTL;
+
+    remote.nt_version_pos = find_upnp_version(remote.notify.nt,
+                                              &remote.version_max);
+    if (remote.nt_version_pos != NULL)
+    {
+        unsigned int x;
+        remote.usn_version_pos = find_upnp_version(remote.notify.usn,
+                                                   &x);
+        if (x != remote.version_max)
+        {
+            remote.usn_version_pos = NULL;
+        }
+    }
+
+    remoteptr = map_put(daemon->remotes, &remote);
+    svcindex_add(daemon->remote_index,
+                 remoteptr->notify.nt, strlen(remoteptr->notify.nt),
+                 remoteptr->notify.usn, strlen(remoteptr->notify.usn),
+                 remoteptr);
+    if (remote.route != 0)
+    {
+        service_route_t route;
+        route.route = remote.route;
+        route.remote = remoteptr;
+        map_put(daemon->service_routes, &route);
+    }
+    else
+    {
+        selector_add(daemon->selector, remote.sock, remoteptr,
+                     remoteservice_read_cb, NULL);
+        if (server->congested)
+        {
+            selector_chkread(daemon->selector, remote.sock, false);
+        }
+    }
+    ssdp_notify(daemon->ssdp, &(remoteptr->notify));
+    remoteptr->touchcb = timers_add(daemon->timers,
+                                    (REMOTE_EXPIRE_TTL - REMOTE_EXPIRE_BUFFER) * 1000,
+                                    remoteptr,
+                                    daemon_remoteservice_touch);
+}
+
+static void daemon_del_remote(daemon_t daemon, server_t* server,
+                              pkg_old_service_t* old_service)
+{
+    remoteservice_t key;
+    key.source_id = old_service->service_id;
+    key.source = server;
+    map_remove(daemon->remotes, &key);
+}
+
+static void daemon_create_tunnel(daemon_t daemon, server_t* server,
+                                 pkg_create_tunnel_view_t* create_tunnel)
+{
+    tunnel_t tunnel, *tunnelptr;
+    socket_t sock;
+    char* local_host;
+    memset(&tunnel, 0, sizeof(tunnel_t));
+    tunnel.id = create_tunnel->tunnel_id;
+    tunnel.remote = false;
+    tunnel.source.local.server = server;
+    tunnel.source.local.service = slotmap_get(daemon->locals,
+                                              create_tunnel->service_id);
+    if (tunnel.source.local.service == NULL)
+    {
+        pkg_t pkg;
+        char* tmp;
+        asprinthost(&tmp, server->host, server->hostlen);
+        log_printf(daemon->log, LVL_WARN, "Server %s requesting a tunnel for non-existant service %lu",
+                   tmp, (unsigned long)create_tunnel->service_id);
+        free(tmp);
+        pkg_setup_tunnel(&pkg, create_tunnel->tunnel_id, false, 0);
+        daemon_server_write_pkg(server, &pkg, true);
+        return;
+    }
+    if (create_tunnel->compress >= 8 ||
+        !(codec_methods() & (1 << create_tunnel->compress)))
+    {
+        pkg_t pkg;
+        char* tmp;
+        asprinthost(&tmp, server->host, server->hostlen);
+        log_printf(daemon->log, LVL_WARN, "Server %s requesting a tunnel with unknown compression %u",
+                   tmp, (unsigned int)create_tunnel->compress);
+        free(tmp);
+        pkg_setup_tunnel(&pkg, create_tunnel->tunnel_id, false, 0);
+        daemon_server_write_pkg(server, &pkg, true);
+        return;
+    }
+    sock = socket_tcp_connect2(tunnel.source.local.service->host,
+                               tunnel.source.local.service->hostlen,
+                               false, daemon->bind_services);
+    if (sock < 0)
+    {
+        pkg_t pkg;
+        char* tmp;
+        asprinthost(&tmp, tunnel.source.local.service->host,
+                    tunnel.source.local.service->hostlen);
+        log_printf(daemon->log, LVL_WARN, "Unable to create tunnel to %s", tmp);
+        free(tmp);
+        pkg_setup_tunnel(&pkg, create_tunnel->tunnel_id, false, 0);
+        daemon_server_write_pkg(server, &pkg, true);
+        return;
+    }
+
+    tunnelptr = map_put(server->local_tunnels, &tunnel);
+    asprinthost(&local_host, tunnel.source.local.service->host,
+                tunnel.source.local.service->hostlen);
+    tunnelptr->io = tunnel_io_new(daemon, tunnelptr,
+                                  pkg_str_dup(&(create_tunnel->host)),
+                                  local_host);
+    tunnelptr->io->local_conn.sock = sock;
+    tunnelptr->io->local_conn.state = CONN_CONNECTING;
+    tunnelptr->io->compress = create_tunnel->compress;
+    tunnelptr->io->rate =
+        daemon_tunnel_rate(daemon, tunnel.source.local.service->service);
+    /* The server might have given the service a route on its service
+     * port */
+    tunnelptr->io->strip_route = server->version >= 3;
+
+    if (create_tunnel->port > 0)
+    {
+        pkg_t pkg;
+        struct sockaddr* host = calloc(1, server->hostlen);
+        memcpy(host, server->host, server->hostlen);
+        addr_setport(host, server->hostlen, create_tunnel->port);
+        sock = socket_tcp_connect2(host, server->hostlen, false,
+                                   daemon->bind_server);
+        if (sock < 0)
+        {
+            char* tmp;
+            asprinthost(&tmp, host, server->hostlen);
+            log_printf(daemon->log, LVL_WARN,
+                       "Unable to connect tunnel to %s", tmp);
+            free(tmp);
+            pkg_setup_tunnel(&pkg, create_tunnel->tunnel_id, false, 0);
+            daemon_server_write_pkg(server, &pkg, true);
+            free(host);
+            map_remove(server->local_tunnels, tunnelptr);
+            return;
+        }
+        free(host);
+        tunnelptr->io->daemon_conn.sock = sock;
+        tunnelptr->io->daemon_conn.state = CONN_CONNECTING;
+        if (server_tunnel_token(server))
+        {
+            tunnelptr->io->send_token = true;
+            daemon_tunnel_token(tunnelptr, tunnelptr->io->token);
+        }
+
+        pkg_setup_tunnel(&pkg, create_tunnel->tunnel_id, true, 0);
+        daemon_server_write_pkg(server, &pkg, true);
+        tunnelptr->stasis = false;
+
+        daemon_tunnel_start(tunnelptr);
+    }
+    else
+    {
+        uint16_t port = daemon_tunnel_port(daemon, tunnelptr, server);
+        pkg_t pkg;
+        if (port == 0)
+        {
+            log_printf(daemon->log, LVL_WARN,
+                       "Neither of the servers listens for tunnel connections");
+            pkg_setup_tunnel(&pkg, create_tunnel->tunnel_id, false, 0);
+            daemon_server_write_pkg(server, &pkg, true);
+            map_remove(server->local_tunnels, tunnelptr);
+            return;
+        }
+
+        tunnelptr->stasis = true;
+        daemon_tunnel_start(tunnelptr);
+
+        pkg_setup_tunnel(&pkg, create_tunnel->tunnel_id, true, port);
+        daemon_server_write_pkg(server, &pkg, true);
+    }
+}
+
+static void daemon_close_tunnel(daemon_t daemon, server_t* server,
+                                pkg_close_tunnel_t* close_tunnel)
+{
+    tunnel_t key;
+    key.id = close_tunnel->tunnel_id;
+    if (close_tunnel->local)
+    {
+        key.remote = false;
+        key.source.local.server = server;
+        map_remove(server->local_tunnels, &key);
+    }
+    else
+    {
+        slotmap_remove(server->remote_tunnels, close_tunnel->tunnel_id);
+    }
+}
+
+static void daemon_restart_tunnel(daemon_t daemon, server_t* server,
+                                  pkg_restart_tunnel_t* restart_tunnel)
+{
+    tunnel_t key, *tunnel;
+    key.id = restart_tunnel->tunnel_id;
+    if (restart_tunnel->local)
+    {
+        key.remote = false;
+        key.source.local.server = server;
+        tunnel = map_get(server->local_tunnels, &key);
+    }
+    else
+    {
+        tunnel = slotmap_get(server->remote_tunnels,
+                             restart_tunnel->tunnel_id);
+    }
+    if (tunnel == NULL || tunnel->io->compress == CODEC_NONE ||
+        tunnel->io->worker == NULL)
+    {
+        return;
+    }
+    tunnel_io_post(tunnel->io, tunnel_io_restart_job);
+}
+
+static void daemon_setup_tunnel(daemon_t daemon, server_t* server,
+                                pkg_setup_tunnel_t* setup_tunnel)
+{
+    tunnel_t* tunnel;
+    tunnel = slotmap_get(server->remote_tunnels, setup_tunnel->tunnel_id);
+    if (tunnel == NULL)
+    {
+        char* tmp;
+        asprinthost(&tmp, server->host, server->hostlen);
+        log_printf(daemon->log, LVL_WARN, "Got setup from server %s for non-existant tunnel %lu", tmp, (unsigned long)setup_tunnel->tunnel_id);
+        free(tmp);
+        return;
+    }
+    assert(tunnel->source.remote.listening || tunnel->stasis);
+    if (!setup_tunnel->ok)
+    {
+        char* tmp;
+        asprinthost(&tmp, server->host, server->hostlen);
+        log_printf(daemon->log, LVL_WARN, "Server %s failed to setup tunnel %lu", tmp, (unsigned long)setup_tunnel->tunnel_id);
+        free(tmp);
+        slotmap_remove(server->remote_tunnels, tunnel->id);
+        return;
+    }
+    if (tunnel->stasis && !tunnel->source.remote.listening)
+    {
+        struct sockaddr* host;
+        socket_t sock;
+        char token[PKG_TUNNEL_TOKEN_SIZE];
+        if (setup_tunnel->port == 0)
+        {
+            char* tmp;
+            asprinthost(&tmp, server->host, server->hostlen);
+            log_printf(daemon->log, LVL_WARN, "Server %s failed to provide a port for tunnel %lu", tmp, (unsigned long)setup_tunnel->tunnel_id);
+            free(tmp);
+            daemon_lost_tunnel(tunnel);
+            return;
+        }
+        host = calloc(1, server->hostlen);
+        memcpy(host, server->host, server->hostlen);
+        addr_setport(host, server->hostlen, setup_tunnel->port);
+
+        sock = socket_tcp_connect2(host, server->hostlen, false,
+                                   daemon->bind_server);
+        if (sock < 0)
+        {
+            char* tmp;
+            asprinthost(&tmp, host, server->hostlen);
+            log_printf(daemon->log, LVL_WARN,
+                       "Unable to connect tunnel to %s", tmp);
+            free(tmp);
+            free(host);
+            daemon_lost_tunnel(tunnel);
+            return;
+        }
+        free(host);
+
+        tunnel->stasis = false;
+        if (server_tunnel_token(server))
+        {
+            daemon_tunnel_token(tunnel, token);
+            daemon_tunnel_attach(tunnel, sock, CONN_CONNECTING, token);
+        }
+        else
+        {
+            daemon_tunnel_attach(tunnel, sock, CONN_CONNECTING, NULL);
+        }
+    }
+}
+
+static void daemon_server_incoming_cb(void* userdata, socket_t sock)
+{
+    server_t* server = userdata;
+    daemon_t daemon = server->daemon;
+    size_t avail = 0, total = 0;
+    char* ptr;
+    bool data_done;
+
+    switch (server->state)
+    {
+    case CONN_DEAD:
+        return;
+    case CONN_CONNECTING:
+    {
+        char tmp[1];
+        ssize_t got = socket_read(sock, tmp, 1);
+        if (got <= 0)
+        {
+            char* tmp;
+            if (socket_blockingerror(sock))
+            {
+                return;
+            }
+
+            asprinthost(&tmp, server->host, server->hostlen);
+            if (got == 0)
+            {
+                log_printf(daemon->log, LVL_WARN,
+                           "Unable to connect to server %s: Connection closed",
+                           tmp);
+            }
+            else
+            {
+                log_printf(daemon->log, LVL_WARN,
+                           "Unable to connect to server %s: %s",
+                           tmp, socket_strerror(sock));
+            }
+            free(tmp);
+            daemon_lost_server(daemon, server, true);
+            return;
+        }
+        else
+        {
+            /* Data can arrive before the writable callback was called
+             * when both daemons connect at the same time, the connection
+             * is done so don't throw away what was read */
+            server->state = CONN_CONNECTED;
+            daemon_server_connected(server);
+            buf_write(server->in, tmp, 1);
+        }
+        break;
+    }
+    case CONN_CONNECTED:
+        break;
+    }
+
+    data_done = false;
+    while (!data_done)
+    {
+        ptr = buf_wptr(server->in, &avail);
+        if (avail > 0)
+        {
+            ssize_t got = socket_read(sock, ptr, avail);
+            if (got < 0)
+            {
+                if (socket_blockingerror(sock))
+                {
+                    data_done = true;
+                }
+                else
+                {
+	                char* tmp;
+                    asprinthost(&tmp, server->host, server->hostlen);
+                    log_printf(daemon->log, LVL_WARN,
+                               "Lost connection with server %s: %s",
+                               tmp,
+                               socket_strerror(sock));
+                    free(tmp);
+                    daemon_lost_server(daemon, server, !server->got_any_data);
+                    return;
+                }
+            }
+            else if (got == 0)
+            {
+                char* tmp;
+                asprinthost(&tmp, server->host, server->hostlen);
+                log_printf(daemon->log, LVL_WARN,
+                           "Lost connection with server %s: Connection closed",
+                           tmp);
+                free(tmp);
+                daemon_lost_server(daemon, server, !server->got_any_data);
+                return;
+            }
+            else
+            {
+                server->got_any_data = true;
+                buf_wmove(server->in, got);
+                total += got;
+            }
+        }
+
+        for (;;)
+        {
+            pkg_view_t pkg;
+            if (pkg_peek(server->in, server->dict_in, &pkg))
+            {
+                if (!server->hello_done && pkg.type != PKG_HELLO)
+                {
+                    /* Older daemons start with something else */
+                    daemon_server_hello_done(server, 1, 0);
+                }
+                switch (pkg.type)
+                {
+                case PKG_NEW_SERVICE:
+                    daemon_add_remote(daemon, server, &(pkg.content.new_service));
+                    break;
+                case PKG_OLD_SERVICE:
+                    daemon_del_remote(daemon, server, &(pkg.content.old_service));
+                    break;
+                case PKG_CREATE_TUNNEL:
+                    daemon_create_tunnel(daemon, server, &(pkg.content.create_tunnel));
+                    break;
+                case PKG_SETUP_TUNNEL:
+                    daemon_setup_tunnel(daemon, server, &(pkg.content.setup_tunnel));
+                    break;
+                case PKG_CLOSE_TUNNEL:
+                    daemon_close_tunnel(daemon, server, &(pkg.content.close_tunnel));
+                    break;
+                case PKG_RESTART_TUNNEL:
+                    daemon_restart_tunnel(daemon, server, &(pkg.content.restart_tunnel));
+                    break;
+                case PKG_HELLO:
+                    /* Older daemons never send it, so one after the hello
+                     * timeout is from a slow link and the server already
+                     * talks the version of our hello */
+                    if (!server->hello_done || server->version == 1)
+                    {
+                        daemon_server_hello_done(server,
+                                                 pkg.content.hello.version,
+                                                 pkg.content.hello.compress);
+                    }
+                    break;
+                case PKG_SUBSCRIBE:
+                    daemon_gena_subscribe(daemon, server, &(pkg.content.subscribe));
+                    break;
+                case PKG_UNSUBSCRIBE:
+                    gena_link_unsubscribe(daemon->gena, server,
+                                          pkg.content.unsubscribe.watch_id,
+                                          pkg.content.unsubscribe.local);
+                    break;
+                case PKG_EVENT:
+                    daemon_gena_event(daemon, server, &(pkg.content.event));
+                    break;
+                }
+                pkg_read(server->in, &pkg);
+            }
+            else
+            {
+                assert(avail > 0);
+                break;
+            }
+        }
+
+        if (!data_done && total >= selector_budget(daemon->selector))
+        {
+            /* A server sending a lot, a resync of many services say,
+             * mustn't keep the other sockets waiting */
+            selector_requeue(daemon->selector, sock);
+            break;
+        }
+    }
+}
+
+static int _daemon_server_flush_output(server_t* server);
+
+static long daemon_server_hello_timeout(void* userdata)
+{
+    server_t* server = userdata;
+    server->hello_timecb = NULL;
+    daemon_server_hello_done(server, 1, 0);
+    return -1;
+}
+
+static void daemon_server_hello_done(server_t* server, unsigned int version,
+                                     unsigned int compress)
+{
+    daemon_t daemon = server->daemon;
+    char* tmp;
+    if (server->hello_timecb != NULL)
+    {
+        timecb_cancel(server->hello_timecb);
+        server->hello_timecb = NULL;
+    }
+    server->hello_done = true;
+    server->version = version < 1 ? 1 :
+        (version > PKG_VERSION ? PKG_VERSION : version);
+    server->compress = codec_pick(server->compress_offered, compress);
+    asprinthost(&tmp, server->host, server->hostlen);
+    log_printf(daemon->log, LVL_INFO,
+               "Server %s talks protocol version %u, tunnel compression %s",
+               tmp, server->version, codec_method_str(server->compress));
+    free(tmp);
+    /* Start the resync, or after a late hello send what is left of it in
+     * the new version */
+    if (!server->dirty)
+    {
+        server->dirty = true;
+        daemon->servers_dirty = true;
+    }
+}
+
+static void daemon_server_connected(server_t* server)
+{
+    size_t i;
+    daemon_t daemon = server->daemon;
+    pkg_t pkg;
+    assert(server->state == CONN_CONNECTED);
+
+    /* The hello goes first, the answer decides how the rest is sent */
+    server->version = 1;
+    server->hello_done = false;
+    pkg_dict_clear(server->dict_in);
+    pkg_dict_clear(server->dict_out);
+    server->compress_offered = daemon->compress_methods;
+    server->compress = CODEC_NONE;
+    pkg_hello(&pkg, PKG_VERSION, server->compress_offered);
+    daemon_server_queue_pkg(server, &pkg, SERVER_PRIO_TUNNEL);
+    if (server->hello_timecb == NULL)
+    {
+        server->hello_timecb = timers_add(daemon->timers,
+                                          SERVER_HELLO_TIMEOUT, server,
+                                          daemon_server_hello_timeout);
+    }
+
+    /* Only remember which services to send, daemon_server_resync sends them
+     * as the link has room */
+    vector_removerange(server->resync, 0, vector_size(server->resync));
+    server->resync_pos = 0;
+    for (i = slotmap_begin(daemon->locals); i != slotmap_end(daemon->locals);
+         i = slotmap_next(daemon->locals, i))
+    {
+        localservice_t* local = slotmap_getat(daemon->locals, i);
+        vector_push(server->resync, &(local->id));
+    }
+    if (!server->dirty)
+    {
+        server->dirty = true;
+        daemon->servers_dirty = true;
+    }
+}
+
+static void daemon_server_writable_cb(void* userdata, socket_t sock)
+{
+    server_t* server = userdata;
+    int flushret;
+
+    switch (server->state)
+    {
+    case CONN_DEAD:
+        return;
+    case CONN_CONNECTING:
+        server->state = CONN_CONNECTED;
+        daemon_server_connected(server);
+        break;
+    case CONN_CONNECTED:
+        break;
+    }
+
+    flushret = _daemon_server_flush_output(server);
+    if (flushret == 0)
+    {
+        selector_chkwrite(server->daemon->selector, server->sock, false);
+    }
+}
+
+static void daemon_server_accept_cb(void* userdata, socket_t sock)
+{
+    daemon_t daemon = (daemon_t)userdata;
+    struct sockaddr* addr;
+    socklen_t addrlen;
+    char* tmp;
+    size_t i;
+    socket_t s = socket_accept(daemon->serv_sock, &addr, &addrlen);
+    if (s < 0)
+    {
+        return;
+    }
+    for (i = 0; i < daemon->servers; ++i)
+    {
+        if (socket_samehost(daemon->server[i]->host, daemon->server[i]->hostlen,
+                            addr, addrlen))
+        {
+            switch (daemon->server[i]->state)
+            {
+            case CONN_DEAD:
+                if (daemon->server[i]->reconnect_timecb != NULL)
+                {
+                    timecb_cancel(daemon->server[i]->reconnect_timecb);
+                    daemon->server[i]->reconnect_timecb = NULL;
+                }
+                daemon->server[i]->state = CONN_CONNECTED;
+                daemon->server[i]->sock = s;
+                daemon_server_connected(daemon->server[i]);
+                socket_setblocking(s, false);
+                selector_add(daemon->selector, daemon->server[i]->sock,
+                             daemon->server[i],
+                             daemon_server_incoming_cb,
+                             daemon_server_writable_cb);
+                selector_chkwrite(daemon->selector, daemon->server[i]->sock,
+                                  false);
+                daemon_server_flush_output(daemon->server[i]);
+                break;
+            case CONN_CONNECTING:
+                selector_remove(daemon->selector, daemon->server[i]->sock);
+                socket_close(daemon->server[i]->sock);
+                daemon->server[i]->state = CONN_CONNECTED;
+                daemon->server[i]->sock = s;
+                daemon_server_connected(daemon->server[i]);
+                socket_setblocking(s, false);
+                selector_add(daemon->selector, daemon->server[i]->sock,
+                             daemon->server[i],
+                             daemon_server_incoming_cb,
+                             daemon_server_writable_cb);
+                selector_chkwrite(daemon->selector, daemon->server[i]->sock,
+                                  false);
+                break;
+            case CONN_CONNECTED:
+                socket_close(s);
+                break;
+            }
+            free(addr);
+            return;
+        }
+    }
+    socket_close(s);
+    asprinthost(&tmp, addr, addrlen);
+    free(addr);
+    log_printf(daemon->log, LVL_INFO, "Unexpected server connection from %s",
+               tmp);
+    free(tmp);
+}
+
+static bool daemon_setup_server(daemon_t daemon)
+{
+    assert(daemon->selector != NULL && daemon->serv_sock < 0);
+    daemon->serv_sock = socket_tcp_listen(daemon->bind_server,
+                                          daemon->server_port);
+    if (daemon->serv_sock >= 0)
+    {
+        selector_add(daemon->selector, daemon->serv_sock, daemon,
+                     daemon_server_accept_cb, NULL);
+        return true;
+    }
+    else
+    {
+        log_printf(daemon->log, LVL_ERR,
+                   "Unable to listen for server connections on %s:%u: %s",
+                   daemon->bind_server != NULL ? daemon->bind_server : "*",
+                   daemon->server_port,
+                   socket_strerror(daemon->serv_sock));
+        return false;
+    }
+}
+
+static bool daemon_setup_remote_server(daemon_t daemon, server_t* srv)
+{
+    assert(daemon->selector != NULL && srv->host != NULL && srv->sock < 0 && srv->state == CONN_DEAD);
+    if (srv->in == NULL)
+    {
+        srv->in = buf_new(SERVER_BUFFER_IN);
+    }
+    if (srv->out == NULL)
+    {
+        srv->out = outq_new(SERVER_BLOCK_OUT, daemon->server_high_water,
+                            SERVER_PRIOS);
+    }
+    if (srv->dict_in == NULL)
+    {
+        srv->dict_in = pkg_dict_new();
+        srv->dict_out = pkg_dict_new();
+    }
+    srv->state = CONN_CONNECTING;
+    srv->sock = socket_tcp_connect2(srv->host, srv->hostlen, false,
+                                    daemon->bind_server);
+    if (srv->sock < 0)
+    {
+        char* tmp;
+        srv->state = CONN_DEAD;
+        asprinthost(&tmp, srv->host, srv->hostlen);
+        log_printf(daemon->log, LVL_WARN,
+                   "Unable to setup remote server (%s) socket: %s",
+                   tmp, socket_strerror(srv->sock));
+        free(tmp);
+        return false;
+    }
+    selector_add(daemon->selector, srv->sock, srv, daemon_server_incoming_cb,
+                 daemon_server_writable_cb);
+    return true;
+}
+
+static int default_worker_threads(void)
+{
+#ifdef _SC_NPROCESSORS_ONLN
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus > DEFAULT_MAX_WORKER_THREADS)
+    {
+        return DEFAULT_MAX_WORKER_THREADS;
+    }
+    return cpus > 0 ? (int)cpus : 0;
+#else
+    return 0;
+#endif
+}
+
+static void config_free(config_t* config)
+{
+    free(config->bind_multicast);
+    free(config->bind_server);
+    free(config->bind_services);
+    free(config->bind_tunnelport);
+    free(config->state_file);
+    free_tunnel_rates(config->tunnel_rates);
+    free_config_servers(config->servers);
+}
+
+/* Read and check daemon->cfgfile, nothing in daemon but the log is
+ * touched */
+static bool config_read(daemon_t daemon, config_t* config)
+{
+    cfg_t cfg;
+    const char* log, *bind_multicast, *bind_server, *bind_services;
+    const char* bind_tunnelport, *servers, *compression, *tunnel_rate_limits;
+    const char* state_file;
+    int tunnel_quantum, io_budget, search_rate, search_burst, state_interval;
+    int server_port, multicast_port, tunnel_port, service_port;
+    int server_high_water;
+
+    memset(config, 0, sizeof(config_t));
+    if (daemon->cfgfile == NULL)
+    {
+        daemon->cfgfile = find_config();
+    }
+
+    cfg = cfg_open(daemon->cfgfile, daemon->log);
+    if (cfg == NULL)
+    {
+        return false;
+    }
+
+    if (!daemon->debug)
+    {
+        log = cfg_getstr(cfg, "log", "syslog:info");
+        if (!log_reopen(daemon->log, log))
+        {
+            cfg_close(cfg);
+            return false;
+        }
+    }
+
+    bind_multicast = cfg_getstr(cfg, "bind_multicast", NULL);
+    if (!valid_bind(daemon->log, "bind_multicast", bind_multicast))
+    {
+        goto error;
+    }
+    multicast_port = cfg_getint(cfg, "multicast_port", SSDP_PORT);
+    if (!valid_port(daemon->log, "multicast_port", multicast_port))
+    {
+        goto error;
+    }
+    bind_server = cfg_getstr(cfg, "bind_server", NULL);
+    if (!valid_bind(daemon->log, "bind_server", bind_server))
+    {
+        goto error;
+    }
+    bind_services = cfg_getstr(cfg, "bind_services", NULL);
+    if (!valid_bind(daemon->log, "bind_services", bind_services))
+    {
+        goto error;
+    }
+    bind_tunnelport = cfg_getstr(cfg, "bind_tunnels", NULL);
+    if (!valid_bind(daemon->log, "bind_tunnels", bind_tunnelport))
+    {
+        goto error;
+    }
+    server_port = cfg_getint(cfg, "server_port", DEFAULT_PORT);
+    if (!valid_port(daemon->log, "server_port", server_port))
+    {
+        goto error;
+    }
+    /* first_tunnel_port is what tunnel_port used to be called when each
+     * tunnel had its own port */
+    tunnel_port = cfg_getint(cfg, "tunnel_port",
+                             cfg_getint(cfg, "first_tunnel_port",
+                                        DEFAULT_TUNNEL_PORT));
+    if (!valid_port(daemon->log, "tunnel_port", tunnel_port))
+    {
+        goto error;
+    }
+    service_port = cfg_getint(cfg, "service_port", 0);
+    if (service_port != 0 &&
+        !valid_port(daemon->log, "service_port", service_port))
+    {
+        goto error;
+    }
+    config->worker_threads = cfg_getint(cfg, "worker_threads",
+                                        default_worker_threads());
+    if (config->worker_threads < 0 ||
+        config->worker_threads > MAX_WORKER_THREADS)
+    {
+        log_printf(daemon->log, LVL_ERR,
+                   "Not a valid number given for `worker_threads`: %d",
+                   config->worker_threads);
+        goto error;
+    }
+    server_high_water = cfg_getint(cfg, "server_high_water",
+                                   DEFAULT_SERVER_HIGH_WATER);
+    if (server_high_water < 0)
+    {
+        log_printf(daemon->log, LVL_ERR,
+                   "Not a valid size given for `server_high_water`: %d",
+                   server_high_water);
+        goto error;
+    }
+    compression = cfg_getstr(cfg, "compression", NULL);
+    if (!valid_compression(daemon->log, "compression", compression,
+                           &config->compress_methods))
+    {
+        goto error;
+    }
+    tunnel_quantum = cfg_getint(cfg, "tunnel_quantum", DEFAULT_TUNNEL_QUANTUM);
+    if (tunnel_quantum <= 0)
+    {
+        log_printf(daemon->log, LVL_ERR,
+                   "Not a valid size given for `tunnel_quantum`: %d",
+                   tunnel_quantum);
+        goto error;
+    }
+    io_budget = cfg_getint(cfg, "io_budget", DEFAULT_IO_BUDGET);
+    if (io_budget <= 0)
+    {
+        log_printf(daemon->log, LVL_ERR,
+                   "Not a valid size given for `io_budget`: %d", io_budget);
+        goto error;
+    }
+    search_rate = cfg_getint(cfg, "search_rate", DEFAULT_SEARCH_RATE);
+    if (search_rate < 0)
+    {
+        log_printf(daemon->log, LVL_ERR,
+                   "Not a valid size given for `search_rate`: %d",
+                   search_rate);
+        goto error;
+    }
+    search_burst = cfg_getint(cfg, "search_burst", DEFAULT_SEARCH_BURST);
+    if (search_burst <= 0)
+    {
+        log_printf(daemon->log, LVL_ERR,
+                   "Not a valid size given for `search_burst`: %d",
+                   search_burst);
+        goto error;
+    }
+    state_file = cfg_getstr(cfg, "state_file", NULL);
+    state_interval = cfg_getint(cfg, "state_interval", DEFAULT_STATE_INTERVAL);
+    if (state_interval < 0)
+    {
+        log_printf(daemon->log, LVL_ERR,
+                   "Not a valid interval given for `state_interval`: %d",
+                   state_interval);
+        goto error;
+    }
+    tunnel_rate_limits = cfg_getstr(cfg, "tunnel_rate_limits", NULL);
+    if (!valid_tunnel_rates(daemon->log, "tunnel_rate_limits",
+                            tunnel_rate_limits, &config->tunnel_rates))
+    {
+        goto error;
+    }
+    servers = cfg_getstr(cfg, "servers", NULL);
+    if (!valid_servers(daemon->log, "servers", servers, &config->servers))
+    {
+        goto error;
+    }
+
+    config->bind_multicast = safestrdup(bind_multicast);
+    config->bind_server = safestrdup(bind_server);
+    config->bind_services = safestrdup(bind_services);
+    config->bind_tunnelport = safestrdup(bind_tunnelport);
+    config->multicast_port = (uint16_t)multicast_port;
+    config->server_port = (uint16_t)server_port;
+    config->tunnel_port = (uint16_t)tunnel_port;
+    config->service_port = (uint16_t)service_port;
+    config->server_high_water = server_high_water;
+    config->tunnel_quantum = tunnel_quantum;
+    config->io_budget = io_budget;
+    config->search_rate = search_rate;
+    config->search_burst = search_burst;
+    /* Empty means no state_file at all */
+    if (state_file == NULL)
+    {
+        config->state_file = daemon_cache_file("upnpproxy.state");
+    }
+    else
+    {
+        config->state_file = *state_file != '\0' ? strdup(state_file) : NULL;
+    }
+    config->state_interval = state_interval;
+    cfg_close(cfg);
+    return true;
+
+ error:
+    config_free(config);
+    cfg_close(cfg);
+    return false;
+}
+
+/* Take the server out of config->servers if it is there */
+static bool config_take_server(config_t* config, const struct sockaddr* host,
+                               socklen_t hostlen)
+{
+    size_t i;
+    for (i = 0; i < vector_size(config->servers); ++i)
+    {
+        config_server_t* srv = vector_get(config->servers, i);
+        if (socket_samehostandport(srv->host, srv->hostlen, host, hostlen))
+        {
+            free(srv->host);
+            vector_remove(config->servers, i);
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Called after trying to replace the listening socket old with *sock. If
+ * that failed the old one is kept */
+static void daemon_swap_listener(daemon_t daemon, socket_t* sock,
+                                 socket_t old, const char* name)
+{
+    if (old < 0)
+    {
+        return;
+    }
+    if (*sock >= 0)
+    {
+        selector_remove(daemon->selector, old);
+        socket_close(old);
+    }
+    else
+    {
+        log_printf(daemon->log, LVL_WARN,
+                   "Keeping the old %s socket", name);
+        *sock = old;
+    }
+}
+
+/* The links to servers, tunnels and multicast memberships that the change
+ * doesn't concern are left as they are */
+static void daemon_apply_config(daemon_t daemon, config_t* config)
+{
+    bool update_ssdp = false, update_server = false, update_tunnel = false;
+    bool update_service = false;
+    uint16_t old_server_port = daemon->server_port;
+    uint16_t old_tunnel_port = daemon->tunnel_port;
+    uint16_t old_service_port = daemon->service_port;
+    size_t i;
+
+    if (safestrcmp(config->bind_multicast, daemon->bind_multicast) != 0)
+    {
+        update_ssdp = true;
+        free(daemon->bind_multicast);
+        daemon->bind_multicast = safestrdup(config->bind_multicast);
+    }
+
+    if (config->multicast_port != daemon->multicast_port)
+    {
+        update_ssdp = true;
+        daemon->multicast_port = config->multicast_port;
+    }
+
+    if (safestrcmp(config->bind_server, daemon->bind_server) != 0)
+    {
+        update_server = true;
+        free(daemon->bind_server);
+        daemon->bind_server = safestrdup(config->bind_server);
+    }
+
+    if (safestrcmp(config->bind_services, daemon->bind_services) != 0)
+    {
+        /* TODO: Cause rebinding of current remote service sockets */
+        update_service = true;
+        free(daemon->bind_services);
+        daemon->bind_services = safestrdup(config->bind_services);
+    }
+
+    if (safestrcmp(config->bind_tunnelport, daemon->bind_tunnelport) != 0)
+    {
+        update_tunnel = true;
+        free(daemon->bind_tunnelport);
+        daemon->bind_tunnelport = safestrdup(config->bind_tunnelport);
+    }
+
+    if (config->tunnel_port != daemon->tunnel_port)
+    {
+        update_tunnel = true;
+        daemon->tunnel_port = config->tunnel_port;
+    }
+
+    if (config->service_port != daemon->service_port)
+    {
+        update_service = true;
+        daemon->service_port = config->service_port;
+    }
+
+    if (config->server_port != daemon->server_port)
+    {
+        update_server = true;
+        daemon->server_port = config->server_port;
+    }
+
+    if (config->worker_threads != daemon->worker_threads)
+    {
+        if (daemon->workers > 0)
+        {
+            log_puts(daemon->log, LVL_INFO,
+                     "Change of `worker_threads` needs a restart");
+        }
+        else
+        {
+            daemon->worker_threads = config->worker_threads;
+        }
+    }
+
+    if (config->server_high_water != daemon->server_high_water)
+    {
+        daemon->server_high_water = config->server_high_water;
+        for (i = 0; i < daemon->servers; ++i)
+        {
+            if (daemon->server[i]->out != NULL)
+            {
+                outq_set_high_water(daemon->server[i]->out,
+                                    daemon->server_high_water);
+            }
+        }
+    }
+
+    /* Used from the next hello, servers already connected keep the
+     * method they agreed on */
+    daemon->compress_methods = config->compress_methods;
+
+    /* Tunnels already running keep their quantum and rate */
+    daemon->tunnel_quantum = config->tunnel_quantum;
+    daemon->io_budget = config->io_budget;
+    if (daemon->selector != NULL)
+    {
+        selector_set_budget(daemon->selector, daemon->io_budget);
+    }
+    daemon->search_rate = config->search_rate;
+    daemon->search_burst = config->search_burst;
+    if (daemon->ssdp != NULL)
+    {
+        ssdp_set_search_limit(daemon->ssdp, daemon->search_rate,
+                              daemon->search_burst);
+    }
+    free_tunnel_rates(daemon->tunnel_rates);
+    daemon->tunnel_rates = config->tunnel_rates;
+    config->tunnel_rates = NULL;
+
+    free(daemon->state_file);
+    daemon->state_file = config->state_file;
+    config->state_file = NULL;
+    daemon->state_interval = config->state_interval;
+    daemon_setup_state_timer(daemon);
+
+    if (update_ssdp && daemon->ssdp != NULL)
+    {
+        /* The remote services are announced again on the new port */
+        ssdp_rebind(daemon->ssdp, daemon->bind_multicast,
+                    daemon->multicast_port);
+        for (i = map_begin(daemon->remotes); i != map_end(daemon->remotes);
+             i = map_next(daemon->remotes, i))
+        {
+            remoteservice_t* remote = map_getat(daemon->remotes, i);
+            free(remote->notify.host);
+            remote->notify.host = ssdp_getnotifyhost(daemon->ssdp,
+                                                     &(remote->notify.hostlen));
+            if (remote->notify.host != NULL)
+            {
+                ssdp_notify(daemon->ssdp, &(remote->notify));
+            }
+        }
+    }
+    /* The old listening socket goes first if the port is the same, else
+     * only once the new one is listening */
+    if (update_server && daemon->serv_sock >= 0)
+    {
+        socket_t old = daemon->serv_sock;
+        daemon->serv_sock = -1;
+        if (daemon->server_port == old_server_port)
+        {
+            selector_remove(daemon->selector, old);
+            socket_close(old);
+            old = -1;
+        }
+        daemon_setup_server(daemon);
+        daemon_swap_listener(daemon, &daemon->serv_sock, old, "server");
+    }
+    if (update_tunnel && daemon->selector != NULL)
+    {
+        /* Tunnels already told about the old port will fail, the ones
+         * that has connected are not affected */
+        socket_t old = daemon->tunnel_sock;
+        daemon->tunnel_sock = -1;
+        if (old >= 0 && (daemon->tunnel_port == old_tunnel_port ||
+                         daemon->tunnel_port == 0))
+        {
+            selector_remove(daemon->selector, old);
+            socket_close(old);
+            old = -1;
+        }
+        daemon_setup_tunnel_port(daemon);
+        daemon_swap_listener(daemon, &daemon->tunnel_sock, old, "tunnel");
+    }
+    if (update_service && daemon->selector != NULL)
+    {
+        /* Like the tunnel port, services already announced with the old
+         * port are unreachable until they are announced again. Clients
+         * already accepted are not affected */
+        socket_t old = daemon->service_sock;
+        daemon->service_sock = -1;
+        if (old >= 0 && (daemon->service_port == old_service_port ||
+                         daemon->service_port == 0))
+        {
+            selector_remove(daemon->selector, old);
+            socket_close(old);
+            old = -1;
+        }
+        daemon_setup_service_port(daemon);
+        daemon_swap_listener(daemon, &daemon->service_sock, old, "service");
+    }
+
+    /* Servers in both keep their links, tunnels and services, only the
+     * removed ones are dropped and only the new ones connected */
+    for (i = daemon->servers; i > 0; --i)
+    {
+        server_t* srv = daemon->server[i - 1];
+        if (!config_take_server(config, srv->host, srv->hostlen))
+        {
+            if (daemon->selector != NULL)
+            {
+                char* tmp;
+                asprinthost(&tmp, srv->host, srv->hostlen);
+                log_printf(daemon->log, LVL_INFO, "Dropping server %s", tmp);
+                free(tmp);
+            }
+            server_free(daemon, srv);
+        }
+    }
+    if (vector_size(config->servers) > 0)
+    {
+        size_t added = vector_size(config->servers);
+        daemon->server = realloc(daemon->server,
+                                 (daemon->servers + added) * sizeof(server_t*));
+        for (i = 0; i < added; ++i)
+        {
+            config_server_t* cs = vector_get(config->servers, i);
+            server_t* srv = malloc(sizeof(server_t));
+            server_init(daemon, srv, cs->host, cs->hostlen);
+            cs->host = NULL;
+            daemon->server[daemon->servers++] = srv;
+            if (daemon->selector != NULL)
+            {
+                daemon_setup_remote_server(daemon, srv);
+            }
+        }
+    }
+}
+
+bool load_config(daemon_t daemon)
+{
+    config_t config;
+    if (!config_read(daemon, &config))
+    {
+        return false;
+    }
+    daemon_apply_config(daemon, &config);
+    config_free(&config);
+    return true;
+}
+
+void free_daemon(daemon_t daemon)
+{
+    if (daemon->tunnel_sock >= 0)
+    {
+        selector_remove(daemon->selector, daemon->tunnel_sock);
+        socket_close(daemon->tunnel_sock);
+        daemon->tunnel_sock = -1;
+    }
+    if (daemon->tunnel_pending != NULL)
+    {
+        while (vector_size(daemon->tunnel_pending) > 0)
+        {
+            tunnel_pending_free(*((tunnel_pending_t**)vector_get(
+                                      daemon->tunnel_pending, 0)), true);
+        }
+        vector_free(daemon->tunnel_pending);
+        daemon->tunnel_pending = NULL;
+    }
+    daemon_close_service_port(daemon);
+    vector_free(daemon->service_pending);
+    daemon->service_pending = NULL;
+    if (daemon->serv_sock >= 0)
+    {
+        selector_remove(daemon->selector, daemon->serv_sock);
+        socket_close(daemon->serv_sock);
+        daemon->serv_sock = -1;
+    }
+    while (daemon->servers > 0)
+    {
+        server_free(daemon, daemon->server[daemon->servers - 1]);
+    }
+    free(daemon->server);
+    gena_free(daemon->gena);
+    daemon->gena = NULL;
+    if (daemon->gena_exchanges != NULL)
+    {
+        while (vector_size(daemon->gena_exchanges) > 0)
+        {
+            gena_exchange_free(*((gena_exchange_t**)vector_get(
+                                     daemon->gena_exchanges, 0)));
+        }
+        vector_free(daemon->gena_exchanges);
+    }
+    if (daemon->gena_incoming != NULL)
+    {
+        while (vector_size(daemon->gena_incoming) > 0)
+        {
+            gena_incoming_free(*((gena_incoming_t**)vector_get(
+                                     daemon->gena_incoming, 0)));
+        }
+        vector_free(daemon->gena_incoming);
+    }
+    if (daemon->gena_sock >= 0)
+    {
+        selector_remove(daemon->selector, daemon->gena_sock);
+        socket_close(daemon->gena_sock);
+        daemon->gena_sock = -1;
+    }
+    slotmap_free(daemon->locals);
+    map_free(daemon->remotes);
+    map_free(daemon->service_routes);
+    svcindex_free(daemon->local_index);
+    svcindex_free(daemon->remote_index);
+    strtab_free(daemon->strings);
+    if (daemon->service_clients != NULL)
+    {
+        size_t i;
+        for (i = 0; i < vector_size(daemon->service_clients); ++i)
+        {
+            free(((service_client_t*)vector_get(daemon->service_clients,
+                                                 i))->addr);
+        }
+        vector_free(daemon->service_clients);
+    }
+    if (daemon->workers > 0)
+    {
+        /* Stop the workers first, they hand their tunnels back to control */
+        size_t i;
+        for (i = 0; i < daemon->workers; ++i)
+        {
+            if (daemon->worker[i] != daemon->control)
+            {
+                worker_free(daemon->worker[i]);
+            }
+        }
+    }
+    worker_free(daemon->control);
+    if (daemon->worker_sched != NULL)
+    {
+        size_t i;
+        for (i = 0; i < daemon->workers; ++i)
+        {
+            vector_free(daemon->worker_sched[i].queue);
+            vector_free(daemon->worker_sched[i].running);
+        }
+        free(daemon->worker_sched);
+    }
+    free(daemon->worker);
+    free(daemon->worker_load);
+    daemon->workers = 0;
+    free_tunnel_rates(daemon->tunnel_rates);
+    ssdp_free(daemon->ssdp);
+    selector_free(daemon->selector);
+    timers_free(daemon->timers);
+    log_close(daemon->log);
+    free(daemon->ssdp_s);
+#if HAVE_UUID_CREATE
+    /* noop */
+#elif HAVE_UUID_GENERATE
+    uuid_clear(daemon->uuid);
+#endif
+    free(daemon->bind_multicast);
+    free(daemon->bind_server);
+    free(daemon->bind_services);
+    free(daemon->bind_tunnelport);
+    free(daemon->state_file);
+    free(daemon->cfgfile);
+    free(daemon->exe);
+    if (daemon->handover_timecb != NULL)
+    {
+        timecb_cancel(daemon->handover_timecb);
+    }
+    socket_close(daemon->handover_peer);
+    socket_close(daemon->handover_sock);
+}
+
+static bool daemon_quit = false, daemon_reload = false, daemon_stats = false;
+
+void daemon_quit_cb(int signum)
+{
+    daemon_quit = true;
+}
+
+void daemon_reload_cb(int signum)
+{
+    daemon_reload = true;
+}
+
+void daemon_stats_cb(int signum)
+{
+    daemon_stats = true;
+}
+
+static bool daemon_handover = false;
+
+void daemon_handover_cb(int signum)
+{
+    daemon_handover = true;
+}
+
+/* Handover. On SIGUSR2 the daemon starts a new one with -H and a UNIX
+ * socket, asks the workers to let go of the tunnels of the links (see
+ * tunnel_io_detach_job), stops reading and waits for the server links to
+ * drain. It then sends its listening sockets, the drained links, the
+ * sockets of their remote services, of the tunnels the workers let go of
+ * and of the connections yet to send their token over the socket with
+ * what the new daemon needs to carry on with them: the local services
+ * with their IDs, the dictionaries and unread data of the links, the
+ * remote services and the tunnels with what they had buffered. The new
+ * daemon closes the tunnels that were too busy. Once it answers the old
+ * daemon quits without saying goodbye. If anything goes wrong before that
+ * it carries on as before, tunnels included */
+
+typedef struct _handover_msg_t
+{
+    char* data;
+    size_t size, alloc, pos;
+    bool error;
+    /* The sockets to send, or the ones received */
+    vector_t fds;
+} handover_msg_t;
+
+static void msg_put(handover_msg_t* msg, const void* data, size_t size)
+{
+    if (size == 0)
+    {
+        /* data may be NULL then */
+        return;
+    }
+    if (msg->size + size > msg->alloc)
+    {
+        size_t na = msg->alloc == 0 ? 4096 : msg->alloc * 2;
+        char* tmp;
+        while (na < msg->size + size)
+        {
+            na *= 2;
+        }
+        tmp = realloc(msg->data, na);
+        if (tmp == NULL)
+        {
+            msg->error = true;
+            return;
+        }
+        msg->data = tmp;
+        msg->alloc = na;
+    }
+    memcpy(msg->data + msg->size, data, size);
+    msg->size += size;
+}
+
+static void msg_put_u32(handover_msg_t* msg, uint32_t value)
+{
+    msg_put(msg, &value, sizeof(value));
+}
+
+static void msg_put_bytes(handover_msg_t* msg, const void* data, size_t size)
+{
+    msg_put_u32(msg, (uint32_t)size);
+    msg_put(msg, data, size);
+}
+
+/* NULL is told apart from "" */
+static void msg_put_str(handover_msg_t* msg, const char* str)
+{
+    if (str == NULL)
+    {
+        msg_put_u32(msg, (uint32_t)~0);
+    }
+    else
+    {
+        msg_put_bytes(msg, str, strlen(str));
+    }
+}
+
+static void msg_put_fd(handover_msg_t* msg, socket_t sock)
+{
+    if (sock < 0)
+    {
+        msg_put_u32(msg, (uint32_t)~0);
+        return;
+    }
+    msg_put_u32(msg, (uint32_t)vector_size(msg->fds));
+    vector_push(msg->fds, &sock);
+}
+
+static bool msg_get(handover_msg_t* msg, void* data, size_t size)
+{
+    if (msg->error || msg->size - msg->pos < size)
+    {
+        msg->error = true;
+        memset(data, 0, size);
+        return false;
+    }
+    memcpy(data, msg->data + msg->pos, size);
+    msg->pos += size;
+    return true;
+}
+
+static uint32_t msg_get_u32(handover_msg_t* msg)
+{
+    uint32_t value;
+    msg_get(msg, &value, sizeof(value));
+    return value;
+}
+
+/* Returns an allocated copy, NULL if it was NULL or on error */
+static char* msg_get_str(handover_msg_t* msg)
+{
+    uint32_t len = msg_get_u32(msg);
+    char* str;
+    if (msg->error || len == (uint32_t)~0)
+    {
+        return NULL;
+    }
+    if (msg->size - msg->pos < len)
+    {
+        msg->error = true;
+        return NULL;
+    }
+    str = malloc(len + 1);
+    memcpy(str, msg->data + msg->pos, len);
+    str[len] = '\0';
+    msg->pos += len;
+    return str;
+}
+
+/* Sets data to an allocated copy of the bytes, NULL if there are none.
+ * Returns false on error or if there are more than max, skipping them */
+static bool msg_get_buf(handover_msg_t* msg, size_t max, char** data,
+                        size_t* len)
+{
+    uint32_t size = msg_get_u32(msg);
+    *data = NULL;
+    *len = 0;
+    if (msg->error || msg->size - msg->pos < size)
+    {
+        msg->error = true;
+        return false;
+    }
+    msg->pos += size;
+    if (size > max)
+    {
+        return false;
+    }
+    if (size > 0)
+    {
+        *data = malloc(size);
+        memcpy(*data, msg->data + msg->pos - size, size);
+        *len = size;
+    }
+    return true;
+}
+
+/* The socket is taken from msg->fds, the ones left are closed at the end */
+static socket_t msg_get_fd(handover_msg_t* msg)
+{
+    uint32_t idx = msg_get_u32(msg);
+    socket_t* sock;
+    socket_t ret;
+    if (msg->error || idx == (uint32_t)~0)
+    {
+        return -1;
+    }
+    if (idx >= vector_size(msg->fds))
+    {
+        msg->error = true;
+        return -1;
+    }
+    sock = vector_get(msg->fds, idx);
+    ret = *sock;
+    *sock = -1;
+    return ret;
+}
+
+static void msg_free(handover_msg_t* msg)
+{
+    size_t i;
+    free(msg->data);
+    for (i = 0; i < vector_size(msg->fds); ++i)
+    {
+        socket_close(*((socket_t*)vector_get(msg->fds, i)));
+    }
+    vector_free(msg->fds);
+}
+
+/* Read exactly size bytes, adding the sockets sent with them to fds */
+static bool handover_read(socket_t sock, void* data, size_t size,
+                          vector_t fds)
+{
+    char* ptr = data;
+    while (size > 0)
+    {
+        int got_fds[SOCKET_FDS_MAX];
+        size_t count = SOCKET_FDS_MAX, i;
+        ssize_t got = socket_recv_fds(sock, ptr, size, got_fds, &count);
+        for (i = 0; i < count; ++i)
+        {
+            vector_push(fds, got_fds + i);
+        }
+        if (got <= 0)
+        {
+            return false;
+        }
+        ptr += got;
+        size -= got;
+    }
+    return true;
+}
+
+static bool handover_server(server_t* srv)
+{
+    return srv->state == CONN_CONNECTED && srv->hello_done;
+}
+
+/* Stop or start reading everything the new daemon takes over */
+static void daemon_handover_pause(daemon_t daemon, bool pause)
+{
+    size_t i;
+    if (daemon->serv_sock >= 0)
+    {
+        selector_chkread(daemon->selector, daemon->serv_sock, !pause);
+    }
+    if (daemon->tunnel_sock >= 0)
+    {
+        selector_chkread(daemon->selector, daemon->tunnel_sock, !pause);
+    }
+    if (daemon->service_sock >= 0)
+    {
+        selector_chkread(daemon->selector, daemon->service_sock, !pause);
+    }
+    for (i = 0; i < daemon->servers; ++i)
+    {
+        if (daemon->server[i]->state == CONN_CONNECTED)
+        {
+            selector_chkread(daemon->selector, daemon->server[i]->sock,
+                             !pause);
+        }
+    }
+    for (i = map_begin(daemon->remotes); i != map_end(daemon->remotes);
+         i = map_next(daemon->remotes, i))
+    {
+        remoteservice_t* remote = map_getat(daemon->remotes, i);
+        if (remote->sock >= 0)
+        {
+            selector_chkread(daemon->selector, remote->sock,
+                             !pause && !remote->source->congested);
+        }
+    }
+    for (i = 0; i < vector_size(daemon->tunnel_pending); ++i)
+    {
+        tunnel_pending_t* pending =
+            *((tunnel_pending_t**)vector_get(daemon->tunnel_pending, i));
+        selector_chkread(daemon->selector, pending->sock, !pause);
+    }
+}
+
+/* The server of the tunnel is handed over */
+static void daemon_handover_detach(daemon_t daemon, server_t* srv,
+                                   tunnel_t* tunnel)
+{
+    tunnel_io_t* io = tunnel->io;
+    if (tunnel->listen != NULL ||
+        (io->compress != CODEC_NONE && srv->version < 5))
+    {
+        /* The port is the old daemons own, or the other daemon can't
+         * take a new compressed stream */
+        io->detach = DETACH_BUSY;
+        return;
+    }
+    io->detach = DETACH_WAIT;
+    daemon->handover_waiting++;
+    tunnel_io_post(io, tunnel_io_detach_job);
+}
+
+static void tunnel_io_detached_job(void* userdata)
+{
+    tunnel_io_t* io = userdata;
+    if (io->tunnel != NULL && io->detach == DETACH_WAIT)
+    {
+        io->daemon->handover_waiting--;
+        if (io->frozen)
+        {
+            io->detach = DETACH_READY;
+        }
+        else
+        {
+            io->detach = DETACH_BUSY;
+            log_printf(io->daemon->log, LVL_INFO,
+                       "%s tunnel %lu is busy, it won't be handed over",
+                       io->remote ? "Remote" : "Local",
+                       (unsigned long)io->id);
+        }
+    }
+    tunnel_io_done_job(io);
+}
+
+/* Asked for by the worker in tunnel_io_detach_job */
+static void tunnel_io_restart_peer_job(void* userdata)
+{
+    tunnel_io_t* io = userdata;
+    tunnel_t* tunnel = io->tunnel;
+    pkg_t pkg;
+    if (tunnel == NULL || io->detach != DETACH_WAIT)
+    {
+        return;
+    }
+    pkg_restart_tunnel(&pkg, tunnel->id, tunnel->remote);
+    daemon_server_write_pkg(tunnel->remote
+                            ? tunnel->source.remote.service->source
+                            : tunnel->source.local.server, &pkg, true);
+}
+
+/* The handover failed, give the tunnel back to its worker */
+static void daemon_handover_resume(tunnel_t* tunnel)
+{
+    tunnel_io_t* io = tunnel->io;
+    if (io->detach == DETACH_WAIT || io->detach == DETACH_READY)
+    {
+        tunnel_io_post(io, tunnel_io_resume_job);
+    }
+    io->detach = DETACH_NONE;
+}
+
+static long daemon_handover_timeout(void* userdata);
+
+static void daemon_handover_start(daemon_t daemon)
+{
+    socket_t pair[2];
+    char fdstr[16];
+    char* argv[8];
+    size_t argc = 0, i, j;
+    long fd, maxfd;
+    pid_t pid;
+    if (daemon->handover_peer >= 0)
+    {
+        return;
+    }
+    if (!socket_unix_pair(pair))
+    {
+        log_printf(daemon->log, LVL_ERR, "Unable to hand over: %s",
+                   strerror(errno));
+        return;
+    }
+    snprintf(fdstr, sizeof(fdstr), "%d", pair[1]);
+    argv[argc++] = daemon->exe;
+    if (daemon->debug)
+    {
+        argv[argc++] = (char*)"-D";
+    }
+    if (daemon->cfgfile != NULL)
+    {
+        argv[argc++] = (char*)"-C";
+        argv[argc++] = daemon->cfgfile;
+    }
+    argv[argc++] = (char*)"-H";
+    argv[argc++] = fdstr;
+    argv[argc] = NULL;
+    maxfd = sysconf(_SC_OPEN_MAX);
+    if (maxfd < 0)
+    {
+        maxfd = 1024;
+    }
+    pid = fork();
+    if (pid == 0)
+    {
+        if (daemon->daemonize)
+        {
+            /* The standard descriptors were closed by main, sockets might
+             * have gotten their numbers since */
+            int null = open("/dev/null", O_RDWR);
+            for (fd = 0; fd < 3; ++fd)
+            {
+                if (fd != pair[1] && fd != null)
+                {
+                    dup2(null, fd);
+                }
+            }
+        }
+        for (fd = 3; fd < maxfd; ++fd)
+        {
+            if (fd != pair[1])
+            {
+                close(fd);
+            }
+        }
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    socket_close(pair[1]);
+    if (pid < 0)
+    {
+        log_printf(daemon->log, LVL_ERR, "Unable to hand over: %s",
+                   strerror(errno));
+        socket_close(pair[0]);
+        return;
+    }
+    log_printf(daemon->log, LVL_INFO, "Handing over to new daemon %ld",
+               (long)pid);
+    daemon->handover_peer = pair[0];
+    daemon->handover_pid = pid;
+    for (i = 0; i < daemon->servers; ++i)
+    {
+        server_t* srv = daemon->server[i];
+        if (!handover_server(srv))
+        {
+            continue;
+        }
+        /* Subscriptions are not handed over, the clients subscribe again
+         * when their renewals fail */
+        daemon_gena_drop_server(daemon, srv, true);
+        for (j = map_begin(srv->local_tunnels);
+             j != map_end(srv->local_tunnels);
+             j = map_next(srv->local_tunnels, j))
+        {
+            daemon_handover_detach(daemon, srv,
+                                   map_getat(srv->local_tunnels, j));
+        }
+        for (j = slotmap_begin(srv->remote_tunnels);
+             j != slotmap_end(srv->remote_tunnels);
+             j = slotmap_next(srv->remote_tunnels, j))
+        {
+            daemon_handover_detach(daemon, srv,
+                                   slotmap_getat(srv->remote_tunnels, j));
+        }
+    }
+    daemon_handover_pause(daemon, true);
+    daemon->handover_timecb = timers_add(daemon->timers,
+                                         HANDOVER_DRAIN_TIMEOUT, daemon,
+                                         daemon_handover_timeout);
+}
+
+static bool daemon_handover_drained(daemon_t daemon)
+{
+    size_t i;
+    for (i = 0; i < daemon->servers; ++i)
+    {
+        if (handover_server(daemon->server[i]) &&
+            !outq_empty(daemon->server[i]->out))
+        {
+            return false;
+        }
+    }
+    return daemon->handover_waiting == 0;
+}
 
-        selector_add(daemon->selector, tunnelptr->daemon_conn.sock,
-                     tunnelptr, tunnel_read_cb, tunnel_write_cb);
-    }
-    else
+static void daemon_handover_write_dict(handover_msg_t* msg, pkg_dict_t dict)
+{
+    unsigned int ch;
+    for (ch = 0; ch < PKG_DICT_CHANNELS; ++ch)
     {
-        uint16_t port = daemon_allocate_tunnel_port(daemon, tunnelptr, server);
-        pkg_t pkg;
-        if (port == 0)
+        size_t i, count = pkg_dict_entries(dict, ch);
+        msg_put_u32(msg, (uint32_t)count);
+        for (i = 0; i < count; ++i)
         {
-            log_printf(daemon->log, LVL_WARN,
-                       "None of the servers had a port available");
-            pkg_setup_tunnel(&pkg, create_tunnel->tunnel_id, false, 0);
-            daemon_server_write_pkg(server, &pkg, true);
-            map_remove(server->local_tunnels, tunnelptr);
-            return;
+            size_t len;
+            const char* str = pkg_dict_entry(dict, ch, i, &len);
+            msg_put_bytes(msg, str, len);
         }
-
-        tunnelptr->daemon_conn.state = CONN_DEAD;
-        tunnelptr->daemon_conn.sock = -1;
-        tunnelptr->stasis = true;
-
-        pkg_setup_tunnel(&pkg, create_tunnel->tunnel_id, true, port);
-        daemon_server_write_pkg(server, &pkg, true);
     }
 }
 
-static void daemon_close_tunnel(daemon_t daemon, server_t* server,
-                                pkg_close_tunnel_t* close_tunnel)
+/* The ones not ready are only sent for the new daemon to close */
+static void daemon_handover_write_tunnel(handover_msg_t* msg,
+                                         tunnel_t* tunnel)
 {
-    tunnel_t key;
-    key.id = close_tunnel->tunnel_id;
-    if (close_tunnel->local)
+    tunnel_io_t* io = tunnel->io;
+    const char* ptr[2];
+    size_t avail[2];
+    msg_put_u32(msg, tunnel->id);
+    msg_put_u32(msg, tunnel->remote ? 1 : 0);
+    msg_put_u32(msg, tunnel->remote
+                ? tunnel->source.remote.service->source_id
+                : tunnel->source.local.service->id);
+    msg_put_u32(msg, io->detach == DETACH_READY ? 1 : 0);
+    if (io->detach != DETACH_READY)
     {
-        key.remote = false;
-        key.source.local.server = server;
-        map_remove(server->local_tunnels, &key);
+        return;
+    }
+    /* Frozen, nothing touches io until tunnel_io_resume_job */
+    msg_put_str(msg, tunnel->remote ? NULL : io->source_host);
+    msg_put_u32(msg, io->compress);
+    msg_put_u32(msg, io->stasis ? 1 : 0);
+    msg_put_u32(msg, tunnel->remote && tunnel->source.remote.listening
+                ? 1 : 0);
+    msg_put_u32(msg, io->local_conn.state);
+    msg_put_fd(msg, io->local_conn.sock);
+    msg_put_fd(msg, io->daemon_conn.state != CONN_DEAD
+               ? io->daemon_conn.sock : -1);
+    if (io->daemon_conn.zbuf != NULL)
+    {
+        buf_rview(io->daemon_conn.zbuf, ptr, avail);
+    }
+    else
+    {
+        avail[0] = avail[1] = 0;
+    }
+    msg_put_u32(msg, (uint32_t)(avail[0] + avail[1]));
+    msg_put(msg, ptr[0], avail[0]);
+    msg_put(msg, ptr[1], avail[1]);
+    if (io->stasis)
+    {
+        buf_rview(io->daemon_conn.buf, ptr, avail);
     }
     else
     {
-        key.remote = true;
-        map_remove(server->remote_tunnels, &key);
+        avail[0] = avail[1] = 0;
     }
+    msg_put_u32(msg, (uint32_t)(avail[0] + avail[1]));
+    msg_put(msg, ptr[0], avail[0]);
+    msg_put(msg, ptr[1], avail[1]);
 }
 
-static void daemon_setup_tunnel(daemon_t daemon, server_t* server,
-                                pkg_setup_tunnel_t* setup_tunnel)
+static void daemon_handover_write(daemon_t daemon, handover_msg_t* msg)
 {
-    tunnel_t key, *tunnel;
-    key.id = setup_tunnel->tunnel_id;
-    key.remote = true;
-    tunnel = map_get(server->remote_tunnels, &key);
-    if (tunnel == NULL)
-    {
-        char* tmp;
-        asprinthost(&tmp, server->host, server->hostlen);
-        log_printf(daemon->log, LVL_WARN, "Got setup from server %s for non-existant tunnel %lu", tmp, (unsigned long)setup_tunnel->tunnel_id);
-        free(tmp);
-        return;
-    }
-    assert(tunnel->source.remote.listening || tunnel->stasis);
-    if (!setup_tunnel->ok)
+    time_t now = daemon_now(daemon);
+    size_t i, j, count;
+    msg_put_fd(msg, daemon->serv_sock);
+    msg_put_fd(msg, daemon->tunnel_sock);
+    msg_put_fd(msg, daemon->service_sock);
+    msg_put_u32(msg, daemon->service_route);
+
+    /* Tunnel connections still waiting for their token */
+    msg_put_u32(msg, (uint32_t)vector_size(daemon->tunnel_pending));
+    for (i = 0; i < vector_size(daemon->tunnel_pending); ++i)
+    {
+        tunnel_pending_t* pending =
+            *((tunnel_pending_t**)vector_get(daemon->tunnel_pending, i));
+        msg_put_fd(msg, pending->sock);
+        msg_put_bytes(msg, pending->token, pending->got);
+    }
+
+    msg_put_u32(msg, (uint32_t)slotmap_size(daemon->locals));
+    for (i = slotmap_begin(daemon->locals); i != slotmap_end(daemon->locals);
+         i = slotmap_next(daemon->locals, i))
+    {
+        localservice_t* local = slotmap_getat(daemon->locals, i);
+        msg_put_u32(msg, local->id);
+        msg_put_u32(msg, local->expires > now ?
+                    (uint32_t)(local->expires - now) : 0);
+        msg_put_str(msg, local->usn);
+        msg_put_str(msg, local->service);
+        msg_put_str(msg, local->location);
+        msg_put_str(msg, local->server);
+        msg_put_str(msg, local->opt);
+        msg_put_str(msg, local->nls);
+    }
+
+    count = 0;
+    for (i = 0; i < daemon->servers; ++i)
     {
-        char* tmp;
-        asprinthost(&tmp, server->host, server->hostlen);
-        log_printf(daemon->log, LVL_WARN, "Server %s failed to setup tunnel %lu", tmp, (unsigned long)setup_tunnel->tunnel_id);
-        free(tmp);
-        map_remove(server->remote_tunnels, tunnel);
-        return;
+        server_t* srv = daemon->server[i];
+        if (handover_server(srv) && outq_empty(srv->out))
+        {
+            ++count;
+        }
     }
-    if (tunnel->daemon_conn.state == CONN_DEAD &&
-        !tunnel->source.remote.listening)
+    msg_put_u32(msg, (uint32_t)count);
+    for (i = 0; i < daemon->servers; ++i)
     {
-        struct sockaddr* host;
-        if (setup_tunnel->port == 0)
+        server_t* srv = daemon->server[i];
+        const char* ptr[2];
+        size_t avail[2];
+        if (!handover_server(srv) || !outq_empty(srv->out))
         {
-            char* tmp;
-            asprinthost(&tmp, server->host, server->hostlen);
-            log_printf(daemon->log, LVL_WARN, "Server %s failed to provide a port for tunnel %lu", tmp, (unsigned long)setup_tunnel->tunnel_id);
-            free(tmp);
-            daemon_lost_tunnel(tunnel);
-            return;
+            continue;
         }
-        host = calloc(1, server->hostlen);
-        memcpy(host, server->host, server->hostlen);
-        addr_setport(host, server->hostlen, setup_tunnel->port);
-
-        tunnel->daemon_conn.state = CONN_CONNECTING;
-        tunnel->daemon_conn.sock = socket_tcp_connect2(host, server->hostlen,
-                                                       false,
-                                                       daemon->bind_server);
-        if (tunnel->daemon_conn.sock < 0)
+        msg_put_bytes(msg, srv->host, srv->hostlen);
+        msg_put_fd(msg, srv->sock);
+        msg_put_u32(msg, srv->version);
+        msg_put_u32(msg, srv->compress_offered);
+        msg_put_u32(msg, srv->compress);
+        daemon_handover_write_dict(msg, srv->dict_in);
+        daemon_handover_write_dict(msg, srv->dict_out);
+        buf_rview(srv->in, ptr, avail);
+        msg_put_u32(msg, (uint32_t)(avail[0] + avail[1]));
+        msg_put(msg, ptr[0], avail[0]);
+        msg_put(msg, ptr[1], avail[1]);
+
+        msg_put_u32(msg, (uint32_t)(vector_size(srv->resync) -
+                                    srv->resync_pos));
+        for (j = srv->resync_pos; j < vector_size(srv->resync); ++j)
         {
-            char* tmp;
-            asprinthost(&tmp, host, server->hostlen);
-            log_printf(daemon->log, LVL_WARN,
-                       "Unable to connect tunnel to %s", tmp);
-            free(tmp);
-            free(host);
-            daemon_lost_tunnel(tunnel);
-            return;
+            msg_put_u32(msg, *((uint32_t*)vector_get(srv->resync, j)));
         }
-        free(host);
 
-        tunnel->stasis = false;
+        count = 0;
+        for (j = map_begin(daemon->remotes); j != map_end(daemon->remotes);
+             j = map_next(daemon->remotes, j))
+        {
+            remoteservice_t* remote = map_getat(daemon->remotes, j);
+            if (remote->source == srv)
+            {
+                ++count;
+            }
+        }
+        msg_put_u32(msg, (uint32_t)count);
+        for (j = map_begin(daemon->remotes); j != map_end(daemon->remotes);
+             j = map_next(daemon->remotes, j))
+        {
+            remoteservice_t* remote = map_getat(daemon->remotes, j);
+            if (remote->source != srv)
+            {
+                continue;
+            }
+            msg_put_u32(msg, remote->source_id);
+            msg_put_str(msg, remote->notify.usn);
+            msg_put_str(msg, remote->notify.nt);
+            msg_put_str(msg, remote->notify.location);
+            msg_put_str(msg, remote->notify.server);
+            msg_put_str(msg, remote->notify.opt);
+            msg_put_str(msg, remote->notify.nls);
+            msg_put_str(msg, remote->host);
+            msg_put_fd(msg, remote->sock);
+            msg_put_u32(msg, remote->route);
+        }
 
-        selector_add(daemon->selector, tunnel->daemon_conn.sock,
-                     tunnel, tunnel_read_cb, tunnel_write_cb);
+        msg_put_u32(msg, (uint32_t)(map_size(srv->local_tunnels) +
+                                    slotmap_size(srv->remote_tunnels)));
+        for (j = map_begin(srv->local_tunnels);
+             j != map_end(srv->local_tunnels);
+             j = map_next(srv->local_tunnels, j))
+        {
+            daemon_handover_write_tunnel(msg,
+                                         map_getat(srv->local_tunnels, j));
+        }
+        for (j = slotmap_begin(srv->remote_tunnels);
+             j != slotmap_end(srv->remote_tunnels);
+             j = slotmap_next(srv->remote_tunnels, j))
+        {
+            daemon_handover_write_tunnel(msg,
+                                         slotmap_getat(srv->remote_tunnels,
+                                                       j));
+        }
     }
 }
 
-static void daemon_server_incoming_cb(void* userdata, socket_t sock)
+static bool daemon_handover_send(daemon_t daemon, handover_msg_t* msg)
 {
-    server_t* server = userdata;
-    daemon_t daemon = server->daemon;
-    size_t avail = 0;
-    char* ptr;
-    bool data_done;
+    socket_t sock = daemon->handover_peer;
+    uint32_t header[3];
+    size_t i, fds = vector_size(msg->fds);
+    const char* ptr;
+    size_t left;
+    struct pollfd pfd;
+    char ack;
+    int ret;
 
-    switch (server->state)
-    {
-    case CONN_DEAD:
-        return;
-    case CONN_CONNECTING:
+    if (!socket_setblocking(sock, true))
     {
-        char tmp[1];
-        ssize_t got = socket_read(sock, tmp, 1);
-        if (got <= 0)
+        return false;
+    }
+    /* The sockets go SOCKET_FDS_MAX at a time, with the number in each
+     * batch. The first has the header */
+    header[0] = HANDOVER_MAGIC;
+    header[1] = (uint32_t)fds;
+    header[2] = (uint32_t)msg->size;
+    i = 0;
+    do
+    {
+        size_t n = fds - i < SOCKET_FDS_MAX ? fds - i : SOCKET_FDS_MAX;
+        uint32_t batch = (uint32_t)n;
+        const int* fdptr = n > 0 ? vector_get(msg->fds, i) : NULL;
+        if (i == 0)
         {
-            char* tmp;
-            if (socket_blockingerror(sock))
-            {
-                return;
-            }
-
-            asprinthost(&tmp, server->host, server->hostlen);
-            if (got == 0)
+            if (!socket_send_fds(sock, header, sizeof(header), fdptr, n))
             {
-                log_printf(daemon->log, LVL_WARN,
-                           "Unable to connect to server %s: Connection closed",
-                           tmp);
-            }
-            else
-            {
-                log_printf(daemon->log, LVL_WARN,
-                           "Unable to connect to server %s: %s",
-                           tmp, socket_strerror(sock));
+                return false;
             }
-            free(tmp);
-            daemon_lost_server(daemon, server, true);
-            return;
         }
-        else
+        else if (!socket_send_fds(sock, &batch, sizeof(batch), fdptr, n))
         {
-            char* tmp;
-            asprinthost(&tmp, server->host, server->hostlen);
-            log_printf(daemon->log, LVL_INFO,
-                       "Incoming data for server %s before connection done.",
-                       tmp);
-            free(tmp);
-            daemon_lost_server(daemon, server, true);
-            return;
+            return false;
         }
-        return;
-    }
-    case CONN_CONNECTED:
-        break;
+        i += n;
+    } while (i < fds);
+    ptr = msg->data;
+    left = msg->size;
+    while (left > 0)
+    {
+        ssize_t wrote = socket_write(sock, ptr, left);
+        if (wrote <= 0)
+        {
+            return false;
+        }
+        ptr += wrote;
+        left -= wrote;
     }
 
-    data_done = false;
-    while (!data_done)
+    /* Wait for the new daemon to take over */
+    pfd.fd = sock;
+    pfd.events = POLLIN;
+    do
     {
-        ptr = buf_wptr(server->in, &avail);
-        if (avail > 0)
+        ret = poll(&pfd, 1, HANDOVER_ACK_TIMEOUT);
+    } while (ret < 0 && errno == EINTR);
+    if (ret <= 0)
+    {
+        if (ret == 0)
         {
-            ssize_t got = socket_read(sock, ptr, avail);
-            if (got < 0)
-            {
-                if (socket_blockingerror(sock))
-                {
-                    data_done = true;
-                }
-                else
-                {
-	                char* tmp;
-                    asprinthost(&tmp, server->host, server->hostlen);
-                    log_printf(daemon->log, LVL_WARN,
-                               "Lost connection with server %s: %s",
-                               tmp,
-                               socket_strerror(sock));
-                    free(tmp);
-                    daemon_lost_server(daemon, server, !server->got_any_data);
-                    return;
-                }
-            }
-            else if (got == 0)
-            {
-                char* tmp;
-                asprinthost(&tmp, server->host, server->hostlen);
-                log_printf(daemon->log, LVL_WARN,
-                           "Lost connection with server %s: Connection closed",
-                           tmp);
-                free(tmp);
-                daemon_lost_server(daemon, server, !server->got_any_data);
-                return;
-            }
-            else
-            {
-                server->got_any_data = true;
-                buf_wmove(server->in, got);
-            }
+            errno = ETIMEDOUT;
         }
+        return false;
+    }
+    return socket_read(sock, &ack, 1) == 1 && ack == 1;
+}
 
-        for (;;)
+/* Send what the new daemon takes over, or carry on if it can't */
+static void daemon_handover_finish(daemon_t daemon)
+{
+    handover_msg_t msg;
+    size_t i, j;
+    bool ok;
+    memset(&msg, 0, sizeof(msg));
+    msg.fds = vector_new(sizeof(socket_t));
+    daemon_handover_write(daemon, &msg);
+    ok = !msg.error && daemon_handover_send(daemon, &msg);
+    if (ok)
+    {
+        log_printf(daemon->log, LVL_INFO,
+                   "Handed over %lu sockets to new daemon %ld, quitting",
+                   (unsigned long)vector_size(msg.fds),
+                   (long)daemon->handover_pid);
+        daemon->handed_over = true;
+    }
+    else
+    {
+        log_printf(daemon->log, LVL_ERR,
+                   "Hand over to new daemon %ld failed: %s",
+                   (long)daemon->handover_pid, strerror(errno));
+        kill(daemon->handover_pid, SIGKILL);
+        waitpid(daemon->handover_pid, NULL, 0);
+        daemon_handover_pause(daemon, false);
+        for (i = 0; i < daemon->servers; ++i)
         {
-            pkg_t pkg;
-            if (pkg_peek(server->in, &pkg))
+            server_t* srv = daemon->server[i];
+            for (j = map_begin(srv->local_tunnels);
+                 j != map_end(srv->local_tunnels);
+                 j = map_next(srv->local_tunnels, j))
             {
-                switch (pkg.type)
-                {
-                case PKG_NEW_SERVICE:
-                    daemon_add_remote(daemon, server, &(pkg.content.new_service));
-                    break;
-                case PKG_OLD_SERVICE:
-                    daemon_del_remote(daemon, server, &(pkg.content.old_service));
-                    break;
-                case PKG_CREATE_TUNNEL:
-                    daemon_create_tunnel(daemon, server, &(pkg.content.create_tunnel));
-                    break;
-                case PKG_SETUP_TUNNEL:
-                    daemon_setup_tunnel(daemon, server, &(pkg.content.setup_tunnel));
-                    break;
-                case PKG_CLOSE_TUNNEL:
-                    daemon_close_tunnel(daemon, server, &(pkg.content.close_tunnel));
-                    break;
-                }
-                pkg_read(server->in, &pkg);
+                daemon_handover_resume(map_getat(srv->local_tunnels, j));
             }
-            else
+            for (j = slotmap_begin(srv->remote_tunnels);
+                 j != slotmap_end(srv->remote_tunnels);
+                 j = slotmap_next(srv->remote_tunnels, j))
             {
-                assert(avail > 0);
-                break;
+                daemon_handover_resume(slotmap_getat(srv->remote_tunnels,
+                                                     j));
             }
         }
+        daemon->handover_waiting = 0;
     }
-}
-
-static int _daemon_server_flush_output(server_t* server);
-
-static void daemon_server_connected(server_t* server)
-{
-    size_t i;
-    daemon_t daemon = server->daemon;
-    assert(server->state == CONN_CONNECTED);
-
-    for (i = map_begin(daemon->locals); i != map_end(daemon->locals);
-         i = map_next(daemon->locals, i))
+    /* The sockets are still ours, don't close them */
+    vector_removerange(msg.fds, 0, vector_size(msg.fds));
+    msg_free(&msg);
+    socket_close(daemon->handover_peer);
+    daemon->handover_peer = -1;
+    if (daemon->handover_timecb != NULL)
     {
-        pkg_t pkg;
-        localservice_t* local = map_getat(daemon->locals, i);
-        pkg_new_service(&pkg, local->id, local->usn, local->location,
-                        local->service, local->server, local->opt,
-                        local->nls);
-        daemon_server_write_pkg(server, &pkg, false);
+        timecb_cancel(daemon->handover_timecb);
+        daemon->handover_timecb = NULL;
     }
 }
 
-static void daemon_server_writable_cb(void* userdata, socket_t sock)
+static long daemon_handover_timeout(void* userdata)
 {
-    server_t* server = userdata;
-    pkg_t* pkg;
-    bool reflush = false;
-    int flushret;
+    daemon_t daemon = userdata;
+    daemon->handover_timecb = NULL;
+    /* Links still not drained are left behind, they reconnect. So are the
+     * tunnels that didn't get between streams in time */
+    daemon_handover_finish(daemon);
+    return -1;
+}
 
-    switch (server->state)
+/* A listening socket from the old daemon is only kept if it is on the
+ * port the config asks for */
+static socket_t daemon_handover_listener(daemon_t daemon, socket_t sock,
+                                         uint16_t port)
+{
+    struct sockaddr* addr;
+    socklen_t addrlen;
+    if (sock < 0)
     {
-    case CONN_DEAD:
-        return;
-    case CONN_CONNECTING:
-        server->state = CONN_CONNECTED;
-        daemon_server_connected(server);
-        break;
-    case CONN_CONNECTED:
-        break;
+        return -1;
     }
-
-    flushret = _daemon_server_flush_output(server);
-    if (flushret < 0)
+    addr = socket_getsockaddr(sock, &addrlen);
+    if (port == 0 || addr == NULL || addr_getport(addr, addrlen) != port ||
+        !socket_setblocking(sock, false))
     {
-        return;
+        free(addr);
+        socket_close(sock);
+        return -1;
     }
+    free(addr);
+    return sock;
+}
 
-    while (vector_size(server->waiting_pkgs) > 0)
+static bool daemon_handover_read_dict(handover_msg_t* msg, pkg_dict_t dict)
+{
+    unsigned int ch;
+    for (ch = 0; ch < PKG_DICT_CHANNELS; ++ch)
     {
-        size_t idx;
-        reflush = true;
-        for (idx = 0; idx < vector_size(server->waiting_pkgs); ++idx)
+        uint32_t i, count = msg_get_u32(msg);
+        for (i = 0; i < count && !msg->error; ++i)
         {
-            pkg = *((pkg_t**)vector_get(server->waiting_pkgs, idx));
-            if (!pkg_write(server->out, pkg))
+            uint32_t len = msg_get_u32(msg);
+            if (msg->error || msg->size - msg->pos < len)
             {
-                break;
+                msg->error = true;
+                return false;
             }
-            else
+            if (!pkg_dict_append(dict, ch, msg->data + msg->pos, len))
             {
-                pkg_free(pkg);
+                msg->error = true;
+                return false;
             }
+            msg->pos += len;
         }
-        vector_removerange(server->waiting_pkgs, 0, idx);
-    }
-
-    if (reflush)
-    {
-        flushret = _daemon_server_flush_output(server);
-    }
-
-    if (flushret == 0)
-    {
-        selector_chkwrite(server->daemon->selector, server->sock, false);
     }
+    return !msg->error;
 }
 
-static void daemon_server_accept_cb(void* userdata, socket_t sock)
+/* Same as tunnel_port_accept_cb, with what was read of the token */
+static void daemon_handover_read_pending(daemon_t daemon,
+                                         handover_msg_t* msg)
 {
-    daemon_t daemon = (daemon_t)userdata;
+    tunnel_pending_t* pending;
     struct sockaddr* addr;
     socklen_t addrlen;
-    char* tmp;
-    size_t i;
-    socket_t s = socket_accept(daemon->serv_sock, &addr, &addrlen);
-    if (s < 0)
-    {
+    socket_t s = msg_get_fd(msg);
+    char* token;
+    size_t got;
+    if (!msg_get_buf(msg, PKG_TUNNEL_TOKEN_SIZE - 1, &token, &got) ||
+        s < 0 || daemon->tunnel_sock < 0)
+    {
+        free(token);
+        socket_close(s);
         return;
     }
-    for (i = 0; i < daemon->servers; ++i)
+    addr = socket_getpeeraddr(s, &addrlen);
+    if (addr == NULL || !socket_setblocking(s, false))
     {
-        if (socket_samehost(daemon->server[i].host, daemon->server[i].hostlen,
-                            addr, addrlen))
+        free(addr);
+        free(token);
+        socket_close(s);
+        return;
+    }
+    pending = calloc(1, sizeof(tunnel_pending_t));
+    pending->daemon = daemon;
+    pending->sock = s;
+    pending->addr = addr;
+    pending->addrlen = addrlen;
+    if (got > 0)
+    {
+        memcpy(pending->token, token, got);
+        pending->got = got;
+    }
+    free(token);
+    pending->timeoutcb = timers_add(daemon->timers, TUNNEL_TOKEN_TIMEOUT,
+                                    pending, tunnel_pending_timeout);
+    vector_push(daemon->tunnel_pending, &pending);
+    selector_add(daemon->selector, s, pending, tunnel_pending_read_cb, NULL);
+}
+
+static void daemon_handover_read_local(daemon_t daemon, handover_msg_t* msg)
+{
+    ssdp_notify_t notify;
+    uint32_t id, left;
+    memset(&notify, 0, sizeof(notify));
+    id = msg_get_u32(msg);
+    left = msg_get_u32(msg);
+    notify.usn = msg_get_str(msg);
+    notify.nt = msg_get_str(msg);
+    notify.location = msg_get_str(msg);
+    notify.server = msg_get_str(msg);
+    notify.opt = msg_get_str(msg);
+    notify.nls = msg_get_str(msg);
+    if (!msg->error && notify.usn != NULL && left > 0)
+    {
+        notify.expires = daemon_now(daemon) + left;
+        if (daemon_new_local(daemon, &notify, id) == NULL)
         {
-            switch (daemon->server[i].state)
-            {
-            case CONN_DEAD:
-                if (daemon->server[i].reconnect_timecb != NULL)
-                {
-                    timecb_cancel(daemon->server[i].reconnect_timecb);
-                    daemon->server[i].reconnect_timecb = NULL;
-                }
-                daemon->server[i].state = CONN_CONNECTED;
-                daemon->server[i].sock = s;
-                daemon_server_connected(daemon->server + i);
-                socket_setblocking(s, false);
-                selector_add(daemon->selector, daemon->server[i].sock,
-                             daemon->server + i,
-                             daemon_server_incoming_cb,
-                             daemon_server_writable_cb);
-                selector_chkwrite(daemon->selector, daemon->server[i].sock,
-                                  false);
-                daemon_server_flush_output(daemon->server + i);
-                break;
-            case CONN_CONNECTING:
-                selector_remove(daemon->selector, daemon->server[i].sock);
-                socket_close(daemon->server[i].sock);
-                daemon->server[i].state = CONN_CONNECTED;
-                daemon->server[i].sock = s;
-                socket_setblocking(s, false);
-                selector_add(daemon->selector, daemon->server[i].sock,
-                             daemon->server + i,
-                             daemon_server_incoming_cb,
-                             daemon_server_writable_cb);
-                selector_chkwrite(daemon->selector, daemon->server[i].sock,
-                                  false);
-                break;
-            case CONN_CONNECTED:
-                socket_close(s);
-                break;
-            }
-            return;
+            log_printf(daemon->log, LVL_WARN,
+                       "Unable to take over local service %s", notify.usn);
         }
     }
-    socket_close(s);
-    asprinthost(&tmp, addr, addrlen);
-    free(addr);
-    log_printf(daemon->log, LVL_INFO, "Unexpected server connection from %s",
-               tmp);
-    free(tmp);
+    free(notify.usn);
+    free(notify.nt);
+    free(notify.location);
+    free(notify.server);
+    free(notify.opt);
+    free(notify.nls);
 }
 
-static bool daemon_setup_server(daemon_t daemon)
+/* srv is NULL if the server isn't in the config anymore, the remote
+ * service is then dropped */
+static void daemon_handover_read_remote(daemon_t daemon, server_t* srv,
+                                        handover_msg_t* msg)
 {
-    assert(daemon->selector != NULL && daemon->serv_sock < 0);
-    daemon->serv_sock = socket_tcp_listen(daemon->bind_server,
-                                          daemon->server_port);
-    if (daemon->serv_sock >= 0)
+    remoteservice_t remote;
+    char* server, *opt, *nls;
+    memset(&remote, 0, sizeof(remote));
+    remote.source_id = msg_get_u32(msg);
+    remote.source = srv;
+    remote.notify.usn = msg_get_str(msg);
+    remote.notify.nt = msg_get_str(msg);
+    remote.notify.location = msg_get_str(msg);
+    server = msg_get_str(msg);
+    opt = msg_get_str(msg);
+    nls = msg_get_str(msg);
+    remote.host = msg_get_str(msg);
+    remote.sock = msg_get_fd(msg);
+    remote.route = msg_get_u32(msg);
+    if (remote.route != 0)
+    {
+        service_route_t key;
+        key.route = remote.route;
+        /* The route is useless without the service port */
+        if (daemon->service_sock < 0 ||
+            map_get(daemon->service_routes, &key) != NULL)
+        {
+            srv = NULL;
+        }
+        else if (remote.route > daemon->service_route)
+        {
+            daemon->service_route = remote.route;
+        }
+    }
+    if (srv != NULL && !msg->error && remote.notify.usn != NULL &&
+        remote.notify.nt != NULL && remote.notify.location != NULL &&
+        remote.host != NULL && (remote.sock >= 0 || remote.route != 0) &&
+        (remote.sock < 0 || socket_setblocking(remote.sock, false)))
     {
-        selector_add(daemon->selector, daemon->serv_sock, daemon,
-                     daemon_server_accept_cb, NULL);
-        return true;
+        remote.notify.host = ssdp_getnotifyhost(daemon->ssdp,
+                                                &(remote.notify.hostlen));
+    }
+    if (remote.notify.host == NULL)
+    {
+        socket_close(remote.sock);
+        free(remote.notify.usn);
+        free(remote.notify.nt);
+        free(remote.notify.location);
+        free(remote.host);
     }
     else
     {
-        log_printf(daemon->log, LVL_ERR,
-                   "Unable to listen for server connections on %s:%u: %s",
-                   daemon->bind_server != NULL ? daemon->bind_server : "*",
-                   daemon->server_port,
-                   socket_strerror(daemon->serv_sock));
-        return false;
+        remote.notify.server = strtab_intern(daemon->strings, server);
+        remote.notify.opt = strtab_intern(daemon->strings, opt);
+        remote.notify.nls = strtab_intern(daemon->strings, nls);
+        daemon_put_remote(daemon, &remote);
     }
+    free(server);
+    free(opt);
+    free(nls);
 }
 
-static bool daemon_setup_remote_server(daemon_t daemon, server_t* srv)
+/* srv is NULL if its link wasn't taken over, the tunnel is then dropped.
+ * If the tunnel can't be taken over the server is told to close it */
+static void daemon_handover_read_tunnel(daemon_t daemon, server_t* srv,
+                                        handover_msg_t* msg)
 {
-    assert(daemon->selector != NULL && srv->host != NULL && srv->sock < 0 && srv->state == CONN_DEAD);
-    if (srv->in == NULL)
+    tunnel_t tunnel, *tunnelptr = NULL;
+    uint32_t service, compress = CODEC_NONE, local_state = CONN_DEAD;
+    char* host = NULL, *in = NULL, *out = NULL;
+    size_t inlen = 0, outlen = 0;
+    socket_t local_sock = -1, daemon_sock = -1;
+    bool ok;
+    memset(&tunnel, 0, sizeof(tunnel));
+    tunnel.id = msg_get_u32(msg);
+    tunnel.remote = msg_get_u32(msg) != 0;
+    service = msg_get_u32(msg);
+    ok = msg_get_u32(msg) != 0;
+    if (ok)
+    {
+        bool listening;
+        host = msg_get_str(msg);
+        compress = msg_get_u32(msg);
+        tunnel.stasis = msg_get_u32(msg) != 0;
+        listening = msg_get_u32(msg) != 0;
+        local_state = msg_get_u32(msg);
+        local_sock = msg_get_fd(msg);
+        daemon_sock = msg_get_fd(msg);
+        ok = msg_get_buf(msg, TUNNEL_BUFFER_DAEMON, &in, &inlen);
+        ok = msg_get_buf(msg, TUNNEL_BUFFER_DAEMON, &out, &outlen) && ok;
+        /* Only a compressed stream can have been read ahead of, and only
+         * a tunnel in stasis has nowhere to send its data yet */
+        ok = ok && !msg->error && compress < 8 &&
+            (codec_methods() & (1 << compress)) &&
+            (inlen == 0 || compress != CODEC_NONE) &&
+            (outlen == 0 || tunnel.stasis) &&
+            (local_state == CONN_CONNECTED ||
+             (tunnel.stasis && local_state == CONN_CONNECTING)) &&
+            local_sock >= 0 && (daemon_sock >= 0) != tunnel.stasis &&
+            socket_setblocking(local_sock, false) &&
+            (daemon_sock < 0 || socket_setblocking(daemon_sock, false));
+        if (tunnel.remote)
+        {
+            tunnel.source.remote.listening = listening;
+        }
+    }
+    if (srv == NULL || !ok)
     {
-        srv->in = buf_new(SERVER_BUFFER_IN);
+        /* Nothing to take over */
     }
-    if (srv->out == NULL)
+    else if (tunnel.remote)
     {
-        srv->out = buf_new(SERVER_BUFFER_OUT);
+        remoteservice_t key;
+        key.source_id = service;
+        key.source = srv;
+        tunnel.source.remote.service = map_get(daemon->remotes, &key);
+        if (tunnel.source.remote.service != NULL)
+        {
+            tunnelptr = slotmap_put_id(srv->remote_tunnels, &tunnel,
+                                       tunnel.id);
+        }
+        if (tunnelptr != NULL)
+        {
+            tunnelptr->io = tunnel_io_new(daemon, tunnelptr, strdup(""),
+                                          strdup(""));
+            tunnelptr->io->rate =
+                daemon_tunnel_rate(daemon,
+                                   tunnel.source.remote.service->notify.nt);
+        }
     }
-    srv->state = CONN_CONNECTING;
-    srv->sock = socket_tcp_connect2(srv->host, srv->hostlen, false,
-                                    daemon->bind_server);
-    if (srv->sock < 0)
+    else
     {
-        char* tmp;
-        srv->state = CONN_DEAD;
-        asprinthost(&tmp, srv->host, srv->hostlen);
-        log_printf(daemon->log, LVL_WARN,
-                   "Unable to setup remote server (%s) socket: %s",
-                   tmp, socket_strerror(srv->sock));
-        free(tmp);
-        return false;
+        tunnel.source.local.server = srv;
+        tunnel.source.local.service = slotmap_get(daemon->locals, service);
+        if (tunnel.source.local.service != NULL && host != NULL)
+        {
+            char* local_host;
+            tunnelptr = map_put(srv->local_tunnels, &tunnel);
+            asprinthost(&local_host, tunnel.source.local.service->host,
+                        tunnel.source.local.service->hostlen);
+            tunnelptr->io = tunnel_io_new(daemon, tunnelptr, host,
+                                          local_host);
+            host = NULL;
+            tunnelptr->io->rate =
+                daemon_tunnel_rate(daemon,
+                                   tunnel.source.local.service->service);
+            tunnelptr->io->strip_route = srv->version >= 3;
+        }
     }
-    selector_add(daemon->selector, srv->sock, srv, daemon_server_incoming_cb,
-                 daemon_server_writable_cb);
-    return true;
+    free(host);
+    if (tunnelptr == NULL)
+    {
+        free(in);
+        free(out);
+        socket_close(local_sock);
+        socket_close(daemon_sock);
+        if (srv != NULL && !msg->error)
+        {
+            pkg_t pkg;
+            pkg_close_tunnel(&pkg, tunnel.id, tunnel.remote);
+            daemon_server_write_pkg(srv, &pkg, true);
+            if (tunnel.remote)
+            {
+                slotmap_retire(srv->remote_tunnels, tunnel.id);
+            }
+        }
+        return;
+    }
+    tunnelptr->io->compress = compress;
+    tunnelptr->io->local_conn.sock = local_sock;
+    tunnelptr->io->local_conn.state = local_state;
+    tunnelptr->io->daemon_conn.sock = daemon_sock;
+    tunnelptr->io->daemon_conn.state = daemon_sock >= 0 ? CONN_CONNECTED
+        : CONN_DEAD;
+    tunnelptr->io->resume_in = in;
+    tunnelptr->io->resume_inlen = inlen;
+    tunnelptr->io->resume_out = out;
+    tunnelptr->io->resume_outlen = outlen;
+    daemon_tunnel_start(tunnelptr);
 }
 
-bool load_config(daemon_t daemon)
+static void daemon_handover_read_server(daemon_t daemon, handover_msg_t* msg)
 {
-    cfg_t cfg;
-    const char* log, *bind_multicast, *bind_server, *bind_services;
-    const char* bind_tunnelport, *servers;
-    int server_port, tunnel_first_port, tunnel_last_port;
-    bool update_ssdp = false, update_server = false;
-    server_t* server;
-    size_t server_cnt;
+    struct sockaddr* host;
+    socklen_t hostlen;
+    server_t* srv = NULL;
+    socket_t sock;
+    uint32_t i, count, version, offered, compress;
+    size_t j;
 
-    if (daemon->cfgfile == NULL)
+    hostlen = msg_get_u32(msg);
+    if (msg->error || msg->size - msg->pos < hostlen)
     {
-        daemon->cfgfile = find_config();
+        msg->error = true;
+        return;
     }
-
-    cfg = cfg_open(daemon->cfgfile, daemon->log);
-    if (cfg == NULL)
+    host = (struct sockaddr*)(msg->data + msg->pos);
+    for (j = 0; j < daemon->servers; ++j)
     {
-        return false;
+        if (daemon->server[j]->state == CONN_DEAD &&
+            socket_samehostandport(daemon->server[j]->host,
+                                   daemon->server[j]->hostlen,
+                                   host, hostlen))
+        {
+            srv = daemon->server[j];
+            break;
+        }
     }
-
-    if (!daemon->debug)
+    msg->pos += hostlen;
+    sock = msg_get_fd(msg);
+    version = msg_get_u32(msg);
+    offered = msg_get_u32(msg);
+    compress = msg_get_u32(msg);
+    if (srv != NULL)
     {
-        log = cfg_getstr(cfg, "log", "syslog:info");
-        if (!log_reopen(daemon->log, log))
+        if (srv->in == NULL)
         {
-            cfg_close(cfg);
-            return false;
+            srv->in = buf_new(SERVER_BUFFER_IN);
+        }
+        if (srv->out == NULL)
+        {
+            srv->out = outq_new(SERVER_BLOCK_OUT, daemon->server_high_water,
+                                SERVER_PRIOS);
+        }
+        if (srv->dict_in == NULL)
+        {
+            srv->dict_in = pkg_dict_new();
+            srv->dict_out = pkg_dict_new();
         }
+        daemon_handover_read_dict(msg, srv->dict_in);
+        daemon_handover_read_dict(msg, srv->dict_out);
+    }
+    else
+    {
+        pkg_dict_t dict = pkg_dict_new();
+        daemon_handover_read_dict(msg, dict);
+        pkg_dict_clear(dict);
+        daemon_handover_read_dict(msg, dict);
+        pkg_dict_free(dict);
+    }
+    count = msg_get_u32(msg);
+    if (msg->error || msg->size - msg->pos < count ||
+        (srv != NULL && buf_write(srv->in, msg->data + msg->pos,
+                                  count) != count))
+    {
+        msg->error = true;
+        socket_close(sock);
+        return;
     }
+    msg->pos += count;
 
-    bind_multicast = cfg_getstr(cfg, "bind_multicast", NULL);
-    if (!valid_bind(daemon->log, "bind_multicast", bind_multicast))
+    count = msg_get_u32(msg);
+    for (i = 0; i < count && !msg->error; ++i)
     {
-        cfg_close(cfg);
-        return false;
+        uint32_t id = msg_get_u32(msg);
+        if (srv != NULL)
+        {
+            vector_push(srv->resync, &id);
+        }
     }
-    bind_server = cfg_getstr(cfg, "bind_server", NULL);
-    if (!valid_bind(daemon->log, "bind_server", bind_server))
+
+    if (srv != NULL && sock >= 0 && !msg->error &&
+        socket_setblocking(sock, false))
     {
-        cfg_close(cfg);
-        return false;
+        char* tmp;
+        srv->sock = sock;
+        srv->state = CONN_CONNECTED;
+        srv->got_any_data = true;
+        srv->hello_done = true;
+        srv->version = version;
+        srv->compress_offered = offered;
+        srv->compress = compress;
+        srv->resync_pos = 0;
+        if (vector_size(srv->resync) > 0)
+        {
+            srv->dirty = true;
+            daemon->servers_dirty = true;
+        }
+        selector_add(daemon->selector, srv->sock, srv,
+                     daemon_server_incoming_cb, daemon_server_writable_cb);
+        selector_chkwrite(daemon->selector, srv->sock, false);
+        asprinthost(&tmp, srv->host, srv->hostlen);
+        log_printf(daemon->log, LVL_INFO, "Took over link to server %s", tmp);
+        free(tmp);
     }
-    bind_services = cfg_getstr(cfg, "bind_services", NULL);
-    if (!valid_bind(daemon->log, "bind_services", bind_services))
+    else
     {
-        cfg_close(cfg);
-        return false;
+        socket_close(sock);
+        if (srv != NULL)
+        {
+            buf_skip(srv->in, buf_ravail(srv->in));
+            vector_removerange(srv->resync, 0, vector_size(srv->resync));
+        }
+        srv = NULL;
     }
-    bind_tunnelport = cfg_getstr(cfg, "bind_tunnels", NULL);
-    if (!valid_bind(daemon->log, "bind_tunnels", bind_tunnelport))
+
+    count = msg_get_u32(msg);
+    for (i = 0; i < count && !msg->error; ++i)
     {
-        cfg_close(cfg);
-        return false;
+        daemon_handover_read_remote(daemon, srv, msg);
     }
-    server_port = cfg_getint(cfg, "server_port", DEFAULT_PORT);
-    if (!valid_port(daemon->log, "server_port", server_port))
+    count = msg_get_u32(msg);
+    for (i = 0; i < count && !msg->error; ++i)
     {
-        cfg_close(cfg);
-        return false;
+        daemon_handover_read_tunnel(daemon, srv, msg);
+    }
+}
+
+/* Take over from the daemon that started us with -H. Returns false if
+ * nothing was taken over, the old daemon carries on then */
+static bool daemon_handover_receive(daemon_t daemon)
+{
+    handover_msg_t msg;
+    socket_t sock = daemon->handover_sock;
+    uint32_t header[3], i, count;
+    char ack = 1;
+    bool ok = false;
+
+    daemon->handover_sock = -1;
+    memset(&msg, 0, sizeof(msg));
+    msg.fds = vector_new(sizeof(socket_t));
+    if (!socket_setblocking(sock, true) ||
+        !handover_read(sock, header, sizeof(header), msg.fds) ||
+        header[0] != HANDOVER_MAGIC)
+    {
+        log_puts(daemon->log, LVL_ERR,
+                 "Nothing to take over from the old daemon");
+        goto out;
+    }
+    while (vector_size(msg.fds) < header[1])
+    {
+        uint32_t batch;
+        if (!handover_read(sock, &batch, sizeof(batch), msg.fds))
+        {
+            break;
+        }
     }
-    tunnel_first_port = cfg_getint(cfg, "first_tunnel_port", DEFAULT_FIRST_TUNNEL_PORT);
-    if (!valid_port(daemon->log, "first_tunnel_port", tunnel_first_port))
+    msg.alloc = msg.size = header[2];
+    msg.data = malloc(msg.size > 0 ? msg.size : 1);
+    if (vector_size(msg.fds) != header[1] ||
+        !handover_read(sock, msg.data, msg.size, msg.fds))
     {
-        cfg_close(cfg);
-        return false;
+        log_puts(daemon->log, LVL_ERR,
+                 "Lost the old daemon while taking over");
+        goto out;
     }
-    tunnel_last_port = cfg_getint(cfg, "last_tunnel_port", DEFAULT_LAST_TUNNEL_PORT);
-    if (!valid_port(daemon->log, "last_tunnel_port", tunnel_last_port))
+
+    daemon->serv_sock = daemon_handover_listener(daemon, msg_get_fd(&msg),
+                                                 daemon->server_port);
+    if (daemon->serv_sock >= 0)
     {
-        cfg_close(cfg);
-        return false;
+        selector_add(daemon->selector, daemon->serv_sock, daemon,
+                     daemon_server_accept_cb, NULL);
     }
-    if (tunnel_first_port > tunnel_last_port)
+    daemon->tunnel_sock = daemon_handover_listener(daemon, msg_get_fd(&msg),
+                                                   daemon->tunnel_port);
+    if (daemon->tunnel_sock >= 0)
     {
-        log_printf(daemon->log, LVL_ERR,
-                   "Not a valid port given for `last_tunnel_port`: %d",
-                   tunnel_last_port);
-        return false;
+        selector_add_listener(daemon->selector, daemon->tunnel_sock, daemon,
+                              tunnel_port_accept_cb);
     }
-    servers = cfg_getstr(cfg, "servers", NULL);
-    if (!valid_servers(daemon, "servers", servers, &server, &server_cnt))
+    daemon->service_sock = daemon_handover_listener(daemon, msg_get_fd(&msg),
+                                                    daemon->service_port);
+    if (daemon->service_sock >= 0)
     {
-        cfg_close(cfg);
-        return false;
+        selector_add_listener(daemon->selector, daemon->service_sock, daemon,
+                              service_port_accept_cb);
     }
+    daemon->service_route = msg_get_u32(&msg);
 
-
-    if (safestrcmp(bind_multicast, daemon->bind_multicast) != 0)
+    count = msg_get_u32(&msg);
+    for (i = 0; i < count && !msg.error; ++i)
     {
-        update_ssdp = true;
-        free(daemon->bind_multicast);
-        daemon->bind_multicast = safestrdup(bind_multicast);
+        daemon_handover_read_pending(daemon, &msg);
     }
-
-    if (safestrcmp(bind_server, daemon->bind_server) != 0)
+    count = msg_get_u32(&msg);
+    for (i = 0; i < count && !msg.error; ++i)
     {
-        update_server = true;
-        free(daemon->bind_server);
-        daemon->bind_server = safestrdup(bind_server);
+        daemon_handover_read_local(daemon, &msg);
     }
-
-    if (safestrcmp(bind_services, daemon->bind_services) != 0)
+    count = msg_get_u32(&msg);
+    for (i = 0; i < count && !msg.error; ++i)
     {
-        /* TODO: Cause rebinding of current remote service sockets */
-        free(daemon->bind_services);
-        daemon->bind_services = safestrdup(bind_services);
+        daemon_handover_read_server(daemon, &msg);
     }
-
-    if (safestrcmp(bind_tunnelport, daemon->bind_tunnelport) != 0)
+    if (msg.error)
     {
-        free(daemon->bind_tunnelport);
-        daemon->bind_tunnelport = safestrdup(bind_tunnelport);
+        log_puts(daemon->log, LVL_ERR,
+                 "Unable to read what the old daemon handed over");
+        goto out;
+    }
+    if (socket_write(sock, &ack, 1) != 1)
+    {
+        log_puts(daemon->log, LVL_ERR,
+                 "Lost the old daemon while taking over");
+        goto out;
     }
+    log_printf(daemon->log, LVL_INFO,
+               "Took over %lu sockets and %lu local services from the old "
+               "daemon", (unsigned long)vector_size(msg.fds),
+               (unsigned long)slotmap_size(daemon->locals));
+    ok = true;
 
-    if (daemon->tunnel_port_first != (uint16_t)tunnel_first_port ||
-        daemon->tunnel_port_first + daemon->tunnel_port_count + 1
-        != (uint16_t)tunnel_last_port)
+ out:
+    msg_free(&msg);
+    socket_close(sock);
+    return ok;
+}
+
+static char* daemon_cache_file(const char* name)
+{
+    const char* dir = getenv("XDG_CACHE_HOME");
+    char* tmp2 = NULL;
+    char* tmp = NULL;
+    if (dir == NULL || *dir == '\0')
     {
-        size_t nc = (tunnel_last_port - tunnel_first_port) + 1, i;
-        if (tunnel_first_port > 0)
+        const char* home = getenv("HOME");
+        if (home == NULL || *home == '\0')
         {
-            daemon->tunnel_port_first = tunnel_first_port;
-            if (nc != daemon->tunnel_port_count)
+            struct passwd* pw = getpwuid(getuid());
+            if (pw != NULL)
             {
-                size_t in_use = 0, j;
-                for (i = 0; i < daemon->tunnel_port_count; ++i)
-                {
-                    if (daemon->tunnel_port[i].tunnel != NULL)
-                    {
-                        ++in_use;
-                        break;
-                    }
-                }
-                if (nc < in_use)
-                {
-                    nc = in_use;
-                }
-                i = 0;
-                j = 0;
-                for (; in_use > 0; ++j)
-                {
-                    if (daemon->tunnel_port[j].tunnel != NULL)
-                    {
-                        daemon->tunnel_port[i] = daemon->tunnel_port[j];
-                        ++i;
-                        --in_use;
-                    }
-                }
-                daemon->tunnel_port = realloc(daemon->tunnel_port, nc * sizeof(tunnel_port_t));
-                memset(daemon->tunnel_port + i, 0,
-                       (nc - i) * sizeof(tunnel_port_t));
-                for (j = i; j < nc; ++j)
-                {
-                    daemon->tunnel_port[j].sock = -1;
-                }
-                daemon->tunnel_port_count = nc;
+                home = pw->pw_dir;
             }
         }
-        else
+        if (home != NULL && *home != '\0')
         {
-            bool all_empty = true;
-            for (i = 0; i < daemon->tunnel_port_count; ++i)
-            {
-                if (daemon->tunnel_port[i].tunnel != NULL)
-                {
-                    all_empty = false;
-                    break;
-                }
-            }
-            if (all_empty)
+            if (asprintf(&tmp2, "%s/.cache", home) == -1)
             {
-                daemon->tunnel_port_count = 0;
-                free(daemon->tunnel_port);
-                daemon->tunnel_port = NULL;
+                return NULL;
             }
-            daemon->tunnel_port_first = 0;
+            dir = tmp2;
         }
     }
-
-    if (server_port != daemon->server_port)
+    if (dir != NULL && *dir != '\0')
     {
-        update_server = true;
-        daemon->server_port = (uint16_t)server_port;
+        if (asprintf(&tmp, "%s/%s", dir, name) == -1)
+        {
+            tmp = NULL;
+        }
     }
+    free(tmp2);
+    return tmp;
+}
 
-    if (update_ssdp && daemon->ssdp != NULL)
+/* state_file has STATE_HEADER on the first line, then a line per local
+ * service with its tab separated wall clock expire time, USN, type,
+ * location, server, opt and nls */
+static bool state_field_ok(const char* str)
+{
+    return str == NULL || strpbrk(str, "\t\r\n") == NULL;
+}
+
+static void daemon_save_state(daemon_t daemon)
+{
+    FILE* fh;
+    char* tmp;
+    size_t i;
+    time_t now, wall;
+    if (daemon->state_file == NULL || daemon->locals == NULL)
     {
-        ssdp_free(daemon->ssdp);
-        daemon->ssdp = NULL;
-        daemon_setup_ssdp(daemon);
+        return;
     }
-    if (update_server && daemon->serv_sock >= 0)
+    if (asprintf(&tmp, "%s.tmp", daemon->state_file) == -1)
     {
-        selector_remove(daemon->selector, daemon->serv_sock);
-        socket_close(daemon->serv_sock);
-        daemon->serv_sock = -1;
-        daemon_setup_server(daemon);
+        return;
     }
-
+    fh = fopen(tmp, "wt");
+    if (fh == NULL)
     {
-        size_t i, j, oldcnt = daemon->servers;
-
-        for (i = daemon->servers; i > 0; --i)
+        char* pos = strrchr(tmp, '/');
+        if (pos != NULL)
         {
-            bool found = false;
-            server_t* srv = daemon->server + (i - 1);
-            for (j = server_cnt; j > 0; --j)
-            {
-                if (socket_samehostandport(srv->host, srv->hostlen,
-                                           server[j - 1].host,
-                                           server[j - 1].hostlen))
-                {
-                    found = true;
-                    server_free2(server + (j - 1));
-                    --server_cnt;
-                    memmove(server + j - 1, server + j,
-                            (server_cnt - (j - 1)) * sizeof(server_t));
-                    break;
-                }
-            }
-            if (!found)
+            *pos = '\0';
+            if (mkdir_p(tmp))
             {
-                server_free(daemon, srv);
+                *pos = '/';
+                fh = fopen(tmp, "wt");
             }
+            *pos = '/';
         }
-        if (server_cnt > 0)
+    }
+    if (fh == NULL)
+    {
+        log_printf(daemon->log, LVL_WARN, "Unable to save state to `%s`: %s",
+                   tmp, strerror(errno));
+        free(tmp);
+        return;
+    }
+    now = daemon_now(daemon);
+    wall = time(NULL);
+    fprintf(fh, "%s\n", STATE_HEADER);
+    for (i = slotmap_begin(daemon->locals); i != slotmap_end(daemon->locals);
+         i = slotmap_next(daemon->locals, i))
+    {
+        localservice_t* local = slotmap_getat(daemon->locals, i);
+        if (local->expires <= now ||
+            !state_field_ok(local->usn) || !state_field_ok(local->service) ||
+            !state_field_ok(local->location) ||
+            !state_field_ok(local->server) || !state_field_ok(local->opt) ||
+            !state_field_ok(local->nls))
         {
-            size_t newcnt = daemon->servers + server_cnt;
-            if (newcnt > oldcnt)
-            {
-                daemon->server = realloc(daemon->server,
-                                         newcnt * sizeof(server_t));
-            }
-            memcpy(daemon->server + daemon->servers,
-                   server, server_cnt * sizeof(server_t));
-            i = daemon->servers;
-            daemon->servers = newcnt;
-            if (daemon->selector != NULL)
-            {
-                for (; i < daemon->servers; ++i)
-                {
-                    daemon_setup_remote_server(daemon, daemon->server + i);
-                }
-            }
+            continue;
         }
-        free(server);
-        server = NULL;
-        server_cnt = 0;
+        fprintf(fh, "%ld\t%s\t%s\t%s\t%s\t%s\t%s\n",
+                (long)(wall + (local->expires - now)),
+                local->usn, local->service, local->location,
+                local->server != NULL ? local->server : "",
+                local->opt != NULL ? local->opt : "",
+                local->nls != NULL ? local->nls : "");
+    }
+    if (fclose(fh) != 0 || rename(tmp, daemon->state_file) != 0)
+    {
+        log_printf(daemon->log, LVL_WARN, "Unable to save state to `%s`: %s",
+                   daemon->state_file, strerror(errno));
+        unlink(tmp);
+        free(tmp);
+        return;
     }
+    free(tmp);
+}
 
-    cfg_close(cfg);
-
-    return true;
+/* Split off the next tab separated field of *line, empty fields are NULL */
+static char* state_field(char** line)
+{
+    char* ret = *line, * end;
+    if (ret == NULL)
+    {
+        return NULL;
+    }
+    end = strchr(ret, '\t');
+    if (end != NULL)
+    {
+        *end = '\0';
+        *line = end + 1;
+    }
+    else
+    {
+        *line = NULL;
+    }
+    return *ret != '\0' ? ret : NULL;
 }
 
-void free_daemon(daemon_t daemon)
+/* Read the local services saved by the last run. They are announced to
+ * the servers right away but only kept for STATE_RESTORE_TTL unless seen
+ * again, the startup search refreshes the ones still around */
+static void daemon_load_state(daemon_t daemon)
 {
-    if (daemon->tunnel_port_first > 0)
+    FILE* fh;
+    char* line = NULL;
+    size_t linelen = 0, cnt = 0;
+    ssize_t ret;
+    time_t now, wall;
+    if (daemon->state_file == NULL)
     {
-        size_t i;
-        for (i = 0; i < daemon->tunnel_port_count; ++i)
+        return;
+    }
+    fh = fopen(daemon->state_file, "rt");
+    if (fh == NULL)
+    {
+        if (errno != ENOENT)
         {
-            if (daemon->tunnel_port[i].sock >= 0)
-            {
-                selector_remove(daemon->selector, daemon->tunnel_port[i].sock);
-                socket_close(daemon->tunnel_port[i].sock);
-                daemon->tunnel_port[i].sock = -1;
-            }
+            log_printf(daemon->log, LVL_WARN,
+                       "Unable to read state from `%s`: %s",
+                       daemon->state_file, strerror(errno));
         }
-        free(daemon->tunnel_port);
-        daemon->tunnel_port_first = 0;
+        return;
     }
-    if (daemon->serv_sock >= 0)
+    ret = getline(&line, &linelen, fh);
+    if (ret == -1 ||
+        strncmp(line, STATE_HEADER, sizeof(STATE_HEADER) - 1) != 0 ||
+        (line[sizeof(STATE_HEADER) - 1] != '\n' &&
+         line[sizeof(STATE_HEADER) - 1] != '\0'))
     {
-        selector_remove(daemon->selector, daemon->serv_sock);
-        socket_close(daemon->serv_sock);
-        daemon->serv_sock = -1;
+        log_printf(daemon->log, LVL_WARN, "Ignoring unknown state in `%s`",
+                   daemon->state_file);
+        free(line);
+        fclose(fh);
+        return;
     }
-    while (daemon->servers > 0)
+    now = daemon_now(daemon);
+    wall = time(NULL);
+    while ((ret = getline(&line, &linelen, fh)) != -1)
     {
-        server_free(daemon, daemon->server + daemon->servers - 1);
-    }
-    free(daemon->server);
-    map_free(daemon->locals);
-    map_free(daemon->remotes);
-    ssdp_free(daemon->ssdp);
-    selector_free(daemon->selector);
-    timers_free(daemon->timers);
-    log_close(daemon->log);
-    free(daemon->ssdp_s);
-#if HAVE_UUID_CREATE
-    /* noop */
-#elif HAVE_UUID_GENERATE
-    uuid_clear(daemon->uuid);
-#endif
-    free(daemon->bind_multicast);
-    free(daemon->bind_server);
-    free(daemon->cfgfile);
+        ssdp_notify_t notify;
+        char* pos = line, * expires, * end;
+        long left;
+        if (ret > 0 && line[ret - 1] == '\n')
+        {
+            line[ret - 1] = '\0';
+        }
+        memset(&notify, 0, sizeof(notify));
+        expires = state_field(&pos);
+        notify.usn = state_field(&pos);
+        notify.nt = state_field(&pos);
+        notify.location = state_field(&pos);
+        notify.server = state_field(&pos);
+        notify.opt = state_field(&pos);
+        notify.nls = state_field(&pos);
+        if (expires == NULL || notify.usn == NULL || notify.nt == NULL ||
+            notify.location == NULL)
+        {
+            continue;
+        }
+        left = strtol(expires, &end, 10) - (long)wall;
+        if (*end != '\0' || left <= 0)
+        {
+            continue;
+        }
+        notify.expires = now + (left < STATE_RESTORE_TTL ?
+                                left : STATE_RESTORE_TTL);
+        daemon_seen_local(daemon, &notify);
+        ++cnt;
+    }
+    free(line);
+    fclose(fh);
+    log_printf(daemon->log, LVL_INFO, "Restored %lu local services from `%s`",
+               (unsigned long)cnt, daemon->state_file);
 }
 
-static bool daemon_quit = false, daemon_reload = false;
-
-void daemon_quit_cb(int signum)
+static long daemon_state_cb(void* userdata)
 {
-    daemon_quit = true;
+    daemon_t daemon = userdata;
+    daemon_save_state(daemon);
+    return 0;
 }
 
-void daemon_reload_cb(int signum)
+/* Start, stop or reschedule the saving of state_file to match the config */
+static void daemon_setup_state_timer(daemon_t daemon)
 {
-    daemon_reload = true;
+    if (daemon->timers == NULL)
+    {
+        return;
+    }
+    if (daemon->state_timecb != NULL)
+    {
+        timecb_cancel(daemon->state_timecb);
+        daemon->state_timecb = NULL;
+    }
+    if (daemon->state_file != NULL && daemon->state_interval > 0)
+    {
+        daemon->state_timecb = timers_add(daemon->timers,
+                                          daemon->state_interval * 1000,
+                                          daemon, daemon_state_cb);
+    }
 }
 
 static char* daemon_generate_uid(daemon_t daemon)
@@ -2777,37 +7438,7 @@ static char* daemon_generate_uid(daemon_t daemon)
 #endif
     if (is_null)
     {
-        const char* dir = getenv("XDG_CACHE_HOME");
-        char* tmp2 = NULL;
-        char* tmp = NULL;
-        if (dir == NULL || *dir == '\0')
-        {
-            const char* home = getenv("HOME");
-            if (home == NULL || *home == '\0')
-            {
-                struct passwd* pw = getpwuid(getuid());
-                if (pw != NULL)
-                {
-                    home = pw->pw_dir;
-                }
-            }
-            if (home != NULL && *home != '\0')
-            {
-                if (asprintf(&tmp2, "%s/.cache", home) == -1)
-                {
-                    return NULL;
-                }
-                dir = tmp2;
-            }
-        }
-        if (dir != NULL && *dir != '\0')
-        {
-            if (asprintf(&tmp, "%s/upnpproxy.cache", dir) == -1)
-            {
-                return NULL;
-            }
-            free(tmp2);
-        }
+        char* tmp = daemon_cache_file("upnpproxy.cache");
         if (tmp != NULL)
         {
             FILE* fh = fopen(tmp, "rt");
@@ -2931,47 +7562,140 @@ static char* daemon_generate_uid(daemon_t daemon)
     return uid;
 }
 
+static void daemon_setup_workers(daemon_t daemon)
+{
+    size_t i;
+    daemon->workers = daemon->worker_threads > 0 ? daemon->worker_threads : 1;
+    daemon->worker = calloc(daemon->workers, sizeof(worker_t));
+    daemon->worker_load = calloc(daemon->workers, sizeof(size_t));
+    daemon->worker_sched = calloc(daemon->workers, sizeof(tunnel_sched_t));
+    if (daemon->worker_threads == 0)
+    {
+        daemon->worker[0] = daemon->control;
+        return;
+    }
+    for (i = 0; i < daemon->workers; ++i)
+    {
+        daemon->worker[i] = worker_new();
+        if (daemon->worker[i] == NULL)
+        {
+            break;
+        }
+    }
+    if (i == 0)
+    {
+        log_puts(daemon->log, LVL_WARN,
+                 "Unable to start worker threads, running tunnels in the main thread");
+        daemon->worker[0] = daemon->control;
+        daemon->workers = 1;
+    }
+    else if (i < daemon->workers)
+    {
+        log_printf(daemon->log, LVL_WARN,
+                   "Only able to start %lu of %lu worker threads",
+                   (unsigned long)i, (unsigned long)daemon->workers);
+        daemon->workers = i;
+    }
+}
+
 int run_daemon(daemon_t daemon)
 {
     size_t i;
+    bool handed_over = false;
     daemon->selector = selector_new();
     if (daemon->selector == NULL)
     {
         log_puts(daemon->log, LVL_ERR, "Unable to create selector");
         return EXIT_FAILURE;
     }
+    log_printf(daemon->log, LVL_INFO, "Waiting for events with %s",
+               selector_backend(daemon->selector));
+    selector_set_budget(daemon->selector, daemon->io_budget);
     daemon->timers = timers_new();
     if (daemon->timers == NULL)
     {
         log_puts(daemon->log, LVL_ERR, "Unable to create timers");
         return EXIT_FAILURE;
     }
+    selector_set_timers(daemon->selector, daemon->timers);
+
+    daemon->control = worker_new_inline(daemon->selector, daemon->timers);
+    if (daemon->control == NULL)
+    {
+        log_puts(daemon->log, LVL_ERR, "Unable to create main thread mailbox");
+        return EXIT_FAILURE;
+    }
+    daemon_setup_workers(daemon);
 
     daemon->ssdp_s = daemon_generate_uid(daemon);
-    daemon->locals = map_new(sizeof(struct _localservice_t), localservice_hash,
-                             localservice_eq, localservice_free);
+    daemon->locals = slotmap_new(sizeof(struct _localservice_t),
+                                 localservice_free);
     daemon->remotes = map_new(sizeof(struct _remoteservice_t),
                               remoteservice_hash,
                               remoteservice_eq, remoteservice_free);
-
-    if (!daemon_setup_server(daemon))
+    daemon->local_index = svcindex_new();
+    daemon->strings = strtab_new();
+    daemon->remote_index = svcindex_new();
+    daemon->tunnel_pending = vector_new(sizeof(tunnel_pending_t*));
+    daemon->service_pending = vector_new(sizeof(service_pending_t*));
+    daemon->service_clients = vector_new(sizeof(service_client_t));
+    daemon->service_routes = map_new(sizeof(service_route_t),
+                                     service_route_hash, service_route_eq,
+                                     NULL);
+    daemon->gena = gena_new(daemon->log, daemon->timers, daemon->ssdp_s,
+                            &daemon_gena_ops, daemon);
+    daemon->gena_incoming = vector_new(sizeof(gena_incoming_t*));
+    daemon->gena_exchanges = vector_new(sizeof(gena_exchange_t*));
+    if (!daemon_setup_ssdp(daemon))
     {
         return EXIT_FAILURE;
     }
-    if (!daemon_setup_ssdp(daemon))
+
+    if (daemon->handover_sock >= 0)
+    {
+        /* The old daemon carries on if this fails, so this one must go
+         * without a word */
+        handed_over = daemon_handover_receive(daemon);
+        if (!handed_over)
+        {
+            ssdp_free(daemon->ssdp);
+            daemon->ssdp = NULL;
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (daemon->serv_sock < 0 && !daemon_setup_server(daemon))
     {
         return EXIT_FAILURE;
     }
+    if (daemon->tunnel_sock < 0)
+    {
+        daemon_setup_tunnel_port(daemon);
+    }
+    if (daemon->service_sock < 0)
+    {
+        daemon_setup_service_port(daemon);
+    }
+    if (!handed_over)
+    {
+        daemon_load_state(daemon);
+    }
+    daemon_setup_state_timer(daemon);
 
     for (i = 0; i < daemon->servers; ++i)
     {
-        daemon_setup_remote_server(daemon, daemon->server + i);
+        if (daemon->server[i]->state == CONN_DEAD)
+        {
+            daemon_setup_remote_server(daemon, daemon->server[i]);
+        }
     }
 
     signal(SIGINT, daemon_quit_cb);
     signal(SIGTERM, daemon_quit_cb);
     signal(SIGQUIT, daemon_quit_cb);
     signal(SIGHUP, daemon_reload_cb);
+    signal(SIGUSR1, daemon_stats_cb);
+    signal(SIGUSR2, daemon_handover_cb);
     signal(SIGPIPE, SIG_IGN);
 
     for (;;)
@@ -2981,14 +7705,27 @@ int run_daemon(daemon_t daemon)
         if (daemon_quit)
         {
             log_puts(daemon->log, LVL_INFO, "Caught INT/TERM/QUIT signal, so quitting");
+            daemon_save_state(daemon);
             break;
         }
-        if (daemon_reload)
+        /* The handover refers to the servers by index */
+        if (daemon_reload && daemon->handover_peer < 0)
         {
             log_puts(daemon->log, LVL_INFO, "Caught HUP signal, so reloading config");
             load_config(daemon);
             daemon_reload = false;
         }
+        if (daemon_stats)
+        {
+            daemon_log_stats(daemon);
+            daemon_stats = false;
+        }
+        if (daemon_handover)
+        {
+            log_puts(daemon->log, LVL_INFO, "Caught USR2 signal, so handing over to a new daemon");
+            daemon_handover_start(daemon);
+            daemon_handover = false;
+        }
 
         timeout_ms = timers_tick(daemon->timers);
         if (timeout_ms == 0)
@@ -2997,6 +7734,22 @@ int run_daemon(daemon_t daemon)
             timeout_ms = 2 * 60 * 60 * 1000;
         }
 
+        /* Everything written to the servers during the last selector tick
+         * and by the timers goes out here, before blocking */
+        daemon_flush_servers(daemon);
+
+        if (daemon->handover_peer >= 0 && daemon_handover_drained(daemon))
+        {
+            daemon_handover_finish(daemon);
+        }
+        if (daemon->handed_over)
+        {
+            /* The services live on in the new daemon, no byebyes */
+            ssdp_free(daemon->ssdp);
+            daemon->ssdp = NULL;
+            break;
+        }
+
         if (!selector_tick(daemon->selector, timeout_ms))
         {
             log_printf(daemon->log, LVL_ERR, "Selector failed: %s",
@@ -3018,9 +7771,8 @@ void server_init(daemon_t daemon, server_t* srv,
     srv->sock = -1;
     srv->local_tunnels = map_new(sizeof(tunnel_t), local_tunnel_hash,
                                  local_tunnel_eq, local_tunnel_free);
-    srv->remote_tunnels = map_new(sizeof(tunnel_t), remote_tunnel_hash,
-                                  remote_tunnel_eq, remote_tunnel_free);
-    srv->waiting_pkgs = vector_new(sizeof(pkg_t*));
+    srv->remote_tunnels = slotmap_new(sizeof(tunnel_t), remote_tunnel_free);
+    srv->resync = vector_new(sizeof(uint32_t));
 }
 
 void server_free2(server_t* srv)
@@ -3036,19 +7788,18 @@ void server_free2(server_t* srv)
         socket_close(srv->sock);
         srv->sock = -1;
     }
-    map_free(srv->local_tunnels);
-    map_free(srv->remote_tunnels);
-    if (srv->waiting_pkgs != NULL)
+    if (srv->hello_timecb != NULL)
     {
-        size_t i;
-        for (i = 0; i < vector_size(srv->waiting_pkgs); ++i)
-        {
-            pkg_free(*((pkg_t**)vector_get(srv->waiting_pkgs, i)));
-        }
-        vector_free(srv->waiting_pkgs);
+        timecb_cancel(srv->hello_timecb);
+        srv->hello_timecb = NULL;
     }
+    map_free(srv->local_tunnels);
+    slotmap_free(srv->remote_tunnels);
     buf_free(srv->in);
-    buf_free(srv->out);
+    outq_free(srv->out);
+    pkg_dict_free(srv->dict_in);
+    pkg_dict_free(srv->dict_out);
+    vector_free(srv->resync);
     free(srv->host);
 }
 
@@ -3060,6 +7811,7 @@ void server_free(daemon_t daemon, server_t* srv)
         timecb_cancel(srv->reconnect_timecb);
         srv->reconnect_timecb = NULL;
     }
+    daemon_gena_drop_server(daemon, srv, false);
     if (srv->sock >= 0)
     {
         if (srv->state == CONN_CONNECTED)
@@ -3072,21 +7824,14 @@ void server_free(daemon_t daemon, server_t* srv)
     }
     server_free2(srv);
 
-    idx = srv - daemon->server;
-    assert(idx < daemon->servers);
+    for (idx = 0; daemon->server[idx] != srv; ++idx)
+    {
+        assert(idx + 1 < daemon->servers);
+    }
     --daemon->servers;
     memmove(daemon->server + idx, daemon->server + idx + 1,
-            (daemon->servers - idx) * sizeof(server_t));
-}
-
-uint32_t localservice_hash(const void* _local)
-{
-    return ((localservice_t*)_local)->id;
-}
-
-bool localservice_eq(const void* _l1, const void* _l2)
-{
-    return ((localservice_t*)_l1)->id == ((localservice_t*)_l2)->id;
+            (daemon->servers - idx) * sizeof(server_t*));
+    free(srv);
 }
 
 void localservice_free(void* _local)
@@ -3105,16 +7850,20 @@ void localservice_free(void* _local)
         pkg_old_service(&pkg, local->id);
         for (i = 0; i < local->daemon->servers; ++i)
         {
-            daemon_server_write_pkg(local->daemon->server + i, &pkg, true);
+            daemon_server_write_pkg(local->daemon->server[i], &pkg, true);
         }
     }
+    if (local->daemon != NULL)
+    {
+        local_index_remove(local->daemon, local);
+    }
     free(local->host);
-    free(local->usn);
-    free(local->location);
-    free(local->service);
-    free(local->server);
-    free(local->opt);
-    free(local->nls);
+    strtab_release(local->daemon->strings, local->usn);
+    strtab_release(local->daemon->strings, local->location);
+    strtab_release(local->daemon->strings, local->service);
+    strtab_release(local->daemon->strings, local->server);
+    strtab_release(local->daemon->strings, local->opt);
+    strtab_release(local->daemon->strings, local->nls);
 }
 
 uint32_t remoteservice_hash(const void* _remote)
@@ -3150,21 +7899,62 @@ void remoteservice_free(void* _remote)
         socket_close(remote->sock);
         remote->sock = -1;
     }
+    if (remote->notify.nt != NULL && remote->notify.usn != NULL)
+    {
+        svcindex_remove(daemon->remote_index,
+                        remote->notify.nt, strlen(remote->notify.nt),
+                        remote->notify.usn, strlen(remote->notify.usn),
+                        remote);
+    }
+    if (remote->route != 0)
+    {
+        service_route_t key;
+        key.route = remote->route;
+        map_remove(daemon->service_routes, &key);
+        remote->route = 0;
+    }
+    daemon_gena_drop_remote(daemon, remote);
 
     free(remote->notify.host);
     free(remote->notify.location);
-    free(remote->notify.server);
+    strtab_release(daemon->strings, remote->notify.server);
     free(remote->notify.usn);
     free(remote->notify.nt);
-    free(remote->notify.opt);
-    free(remote->notify.nls);
+    strtab_release(daemon->strings, remote->notify.opt);
+    strtab_release(daemon->strings, remote->notify.nls);
     free(remote->host);
 }
 
+/* While the output queue of a server is above the high water mark no new
+ * tunnels are accepted for its services, the packages needed to set them
+ * up would only make the queue longer */
+static void daemon_server_congested(server_t* server, bool congested)
+{
+    daemon_t daemon = server->daemon;
+    size_t i;
+    char* tmp;
+    server->congested = congested;
+    for (i = map_begin(daemon->remotes); i != map_end(daemon->remotes);
+         i = map_next(daemon->remotes, i))
+    {
+        remoteservice_t* remote = map_getat(daemon->remotes, i);
+        if (remote->source == server && remote->sock >= 0)
+        {
+            selector_chkread(daemon->selector, remote->sock, !congested);
+        }
+    }
+    asprinthost(&tmp, server->host, server->hostlen);
+    log_printf(daemon->log, LVL_INFO,
+               congested ? "Server %s is falling behind, %lu bytes queued"
+               : "Server %s has caught up, %lu bytes queued",
+               tmp, (unsigned long)outq_size(server->out));
+    free(tmp);
+}
+
 static int _daemon_server_flush_output(server_t* server)
 {
-    size_t avail;
-    const char* ptr;
+    struct iovec iov[SERVER_IOV];
+    int cnt;
     ssize_t got;
     if (server->state != CONN_CONNECTED)
     {
@@ -3172,12 +7962,17 @@ static int _daemon_server_flush_output(server_t* server)
     }
     for (;;)
     {
-        ptr = buf_rptr(server->out, &avail);
-        if (avail == 0)
+        cnt = outq_iov(server->out, iov, SERVER_IOV);
+        if (cnt == 0)
         {
+            if (daemon_server_resync(server))
+            {
+                continue;
+            }
             return 0;
         }
-        got = socket_write(server->sock, ptr, avail);
+        got = socket_writev(server->sock, iov, cnt);
+        server->pkg_writes++;
         if (got <= 0)
         {
             char* tmp;
@@ -3195,7 +7990,11 @@ static int _daemon_server_flush_output(server_t* server)
             daemon_lost_server(server->daemon, server, false);
             return -1;
         }
-        buf_rmove(server->out, got);
+        outq_consume(server->out, got);
+        if (server->congested && outq_drained(server->out))
+        {
+            daemon_server_congested(server, false);
+        }
     }
 }
 
@@ -3207,49 +8006,190 @@ static void daemon_server_flush_output(server_t* server)
     }
 }
 
+static size_t daemon_server_queue_pkg(server_t* server, pkg_t* pkg,
+                                      unsigned int prio)
+{
+    /* The queue grows as needed so the package is serialized right into it,
+     * and only once */
+    size_t size;
+    if (server->version >= 2)
+    {
+        /* Room is made for the worst case, only what is written is
+         * queued. Each class is a channel as the order within a class is
+         * kept */
+        assert(SERVER_PRIOS <= PKG_DICT_CHANNELS);
+        size = pkg_write_dict(outq_wbuf(server->out, prio,
+                                        pkg_size_dict(pkg)),
+                              pkg, server->dict_out, prio);
+    }
+    else
+    {
+        size = pkg_size(pkg);
+        if (!pkg_write(outq_wbuf(server->out, prio, size), pkg))
+        {
+            size = 0;
+        }
+    }
+    if (size == 0)
+    {
+        assert(false);
+        return 0;
+    }
+    outq_wrote(server->out, prio, size);
+    server->pkgs_written++;
+
+    if (!server->congested && outq_full(server->out))
+    {
+        daemon_server_congested(server, true);
+    }
+    return size;
+}
+
 static void daemon_server_write_pkg(server_t* server, pkg_t* pkg, bool flush)
 {
-    unsigned char try;
+    unsigned int prio = SERVER_PRIO_SERVICE;
 
     if (server->state == CONN_DEAD)
     {
         return;
     }
 
-    for (try = 0; try < 2; ++try)
+    switch (pkg->type)
     {
-        if (pkg_write(server->out, pkg))
-        {
-            if (flush)
-            {
-                daemon_server_flush_output(server);
-            }
-            return;
-        }
+    case PKG_NEW_SERVICE:
+    case PKG_OLD_SERVICE:
+    case PKG_SUBSCRIBE:
+    case PKG_UNSUBSCRIBE:
+    case PKG_EVENT:
+        prio = SERVER_PRIO_SERVICE;
+        break;
+    case PKG_CREATE_TUNNEL:
+    case PKG_SETUP_TUNNEL:
+    case PKG_CLOSE_TUNNEL:
+    case PKG_RESTART_TUNNEL:
+    case PKG_HELLO:
+        /* Someone is waiting for these */
+        prio = SERVER_PRIO_TUNNEL;
+        break;
+    }
+    daemon_server_queue_pkg(server, pkg, prio);
 
-        if (try == 0)
+    if (flush && !server->dirty)
+    {
+        /* Sent by daemon_flush_servers at the end of the tick together with
+         * any other packages written until then */
+        server->dirty = true;
+        server->daemon->servers_dirty = true;
+    }
+}
+
+/* Queue the next part of the services to send after connecting. Only
+ * called when everything else has been sent, so the resync goes at the pace
+ * of the link and other packages never has to wait for more than a block of
+ * it. Returns false if there was nothing left to send */
+static bool daemon_server_resync(server_t* server)
+{
+    daemon_t daemon = server->daemon;
+    size_t queued = 0;
+    if (!server->hello_done)
+    {
+        return false;
+    }
+    while (queued < SERVER_BLOCK_OUT &&
+           server->resync_pos < vector_size(server->resync))
+    {
+        localservice_t* local;
+        pkg_t pkg;
+        uint32_t id;
+        id = *((uint32_t*)vector_get(server->resync, server->resync_pos));
+        server->resync_pos++;
+        local = slotmap_get(daemon->locals, id);
+        if (local == NULL)
         {
-            daemon_server_flush_output(server);
+            /* Gone since the connect, OLD_SERVICE already sent */
+            continue;
         }
-        else
+        pkg_new_service(&pkg, local->id, local->usn, local->location,
+                        local->service, local->server, local->opt,
+                        local->nls);
+        queued += daemon_server_queue_pkg(server, &pkg, SERVER_PRIO_RESYNC);
+    }
+    if (server->resync_pos >= vector_size(server->resync) &&
+        server->resync_pos > 0)
+    {
+        vector_removerange(server->resync, 0, vector_size(server->resync));
+        server->resync_pos = 0;
+    }
+    return queued > 0;
+}
+
+void daemon_flush_servers(daemon_t daemon)
+{
+    size_t i;
+    if (!daemon->servers_dirty)
+    {
+        return;
+    }
+    daemon->servers_dirty = false;
+    for (i = 0; i < daemon->servers; ++i)
+    {
+        if (daemon->server[i]->dirty)
         {
-            pkg_t* pkgcpy = pkg_dup(pkg);
-            if (pkgcpy != NULL)
-            {
-                vector_push(server->waiting_pkgs, &pkgcpy);
-            }
-            return;
+            daemon->server[i]->dirty = false;
+            daemon_server_flush_output(daemon->server[i]);
         }
     }
 }
 
+void daemon_log_stats(daemon_t daemon)
+{
+    size_t i, subscribers, upstreams;
+    if (daemon->ssdp != NULL)
+    {
+        ssdp_stats_t stats;
+        ssdp_stats(daemon->ssdp, &stats);
+        log_printf(daemon->log, LVL_INFO,
+                   "SSDP: %lu searches, %lu duplicates merged, "
+                   "%lu over the rate limit, %lu responses (%lu bytes), "
+                   "%lu responses over the rate limit",
+                   stats.searches, stats.duplicates, stats.limited,
+                   stats.answers, (unsigned long)stats.answer_bytes,
+                   stats.answers_limited);
+    }
+    for (i = 0; i < daemon->servers; ++i)
+    {
+        server_t* srv = daemon->server[i];
+        char* tmp;
+        asprinthost(&tmp, srv->host, srv->hostlen);
+        log_printf(daemon->log, LVL_INFO,
+                   "Server %s: %lu packages in %lu writes (%.1f per write), "
+                   "protocol version %u, dictionaries %lu bytes out %lu in, "
+                   "tunnel compression %s",
+                   tmp, srv->pkgs_written, srv->pkg_writes,
+                   srv->pkg_writes > 0
+                   ? (double)srv->pkgs_written / srv->pkg_writes : 0.0,
+                   srv->version,
+                   srv->dict_out != NULL
+                   ? (unsigned long)pkg_dict_size(srv->dict_out) : 0UL,
+                   srv->dict_in != NULL
+                   ? (unsigned long)pkg_dict_size(srv->dict_in) : 0UL,
+                   codec_method_str(srv->compress));
+        free(tmp);
+    }
+    gena_stats(daemon->gena, &subscribers, &upstreams);
+    log_printf(daemon->log, LVL_INFO,
+               "Events: %lu subscribers, %lu subscriptions at services",
+               (unsigned long)subscribers, (unsigned long)upstreams);
+}
+
 static long daemon_remoteservice_touch(void* userdata)
 {
     remoteservice_t* remote = userdata;
 
     if (remote->source->daemon->ssdp != NULL)
     {
-        remote->notify.expires = time(NULL) + REMOTE_EXPIRE_TTL;
+        remote->notify.expires = daemon_now(remote->source->daemon) +
+            REMOTE_EXPIRE_TTL;
         ssdp_notify(remote->source->daemon->ssdp, &(remote->notify));
     }
 
@@ -3260,6 +8200,6 @@ static long daemon_localservice_expire(void* userdata)
 {
     localservice_t* local = userdata;
     local->expirecb = NULL;
-    map_remove(local->daemon->locals, local);
+    slotmap_remove(local->daemon->locals, local->id);
     return -1;
 }
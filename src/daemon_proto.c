@@ -30,6 +30,7 @@
 #include "common.h"
 
 #include "daemon_proto.h"
+#include "map.h"
 #include <string.h>
 
 static void pkg_freecontent(pkg_t* pkg);
@@ -54,7 +55,7 @@ void pkg_old_service(pkg_t* pkg, uint32_t service_id)
     pkg->content.old_service.service_id = service_id;
 }
 
-void pkg_create_tunnel(pkg_t* pkg, uint32_t service_id, uint32_t tunnel_id, char* host, uint16_t port)
+void pkg_create_tunnel(pkg_t* pkg, uint32_t service_id, uint32_t tunnel_id, char* host, uint16_t port, uint8_t compress)
 {
     pkg->type = PKG_CREATE_TUNNEL;
     assert(host != NULL);
@@ -62,6 +63,7 @@ void pkg_create_tunnel(pkg_t* pkg, uint32_t service_id, uint32_t tunnel_id, char
     pkg->content.create_tunnel.tunnel_id = tunnel_id;
     pkg->content.create_tunnel.host = host;
     pkg->content.create_tunnel.port = port;
+    pkg->content.create_tunnel.compress = compress;
 }
 
 void pkg_setup_tunnel(pkg_t* pkg, uint32_t tunnel_id, bool ok, uint16_t port)
@@ -79,6 +81,48 @@ void pkg_close_tunnel(pkg_t* pkg, uint32_t tunnel_id, bool local)
     pkg->content.close_tunnel.local = local;
 }
 
+void pkg_restart_tunnel(pkg_t* pkg, uint32_t tunnel_id, bool local)
+{
+    pkg->type = PKG_RESTART_TUNNEL;
+    pkg->content.restart_tunnel.tunnel_id = tunnel_id;
+    pkg->content.restart_tunnel.local = local;
+}
+
+void pkg_hello(pkg_t* pkg, uint8_t version, uint8_t compress)
+{
+    pkg->type = PKG_HELLO;
+    pkg->content.hello.version = version;
+    pkg->content.hello.compress = compress;
+}
+
+void pkg_subscribe(pkg_t* pkg, uint32_t service_id, uint32_t watch_id,
+                   char* path)
+{
+    pkg->type = PKG_SUBSCRIBE;
+    assert(path != NULL);
+    pkg->content.subscribe.service_id = service_id;
+    pkg->content.subscribe.watch_id = watch_id;
+    pkg->content.subscribe.path = path;
+}
+
+void pkg_unsubscribe(pkg_t* pkg, uint32_t watch_id, bool local)
+{
+    pkg->type = PKG_UNSUBSCRIBE;
+    pkg->content.unsubscribe.watch_id = watch_id;
+    pkg->content.unsubscribe.local = local;
+}
+
+void pkg_event(pkg_t* pkg, uint32_t watch_id, bool last, char* data,
+               size_t len)
+{
+    pkg->type = PKG_EVENT;
+    assert(len <= PKG_EVENT_PART && (data != NULL || len == 0));
+    pkg->content.event.watch_id = watch_id;
+    pkg->content.event.last = last;
+    pkg->content.event.data = data;
+    pkg->content.event.len = len;
+}
+
 typedef struct _write_ptr_t
 {
     buf_t buf;
@@ -88,6 +132,11 @@ typedef struct _write_ptr_t
 
 static void write_raw(write_ptr_t wptr, const void* data, size_t len)
 {
+    if (len == 0)
+    {
+        /* data may be NULL then */
+        return;
+    }
     if (wptr->ptravail >= len)
     {
         memcpy(wptr->ptr, data, len);
@@ -166,20 +215,14 @@ static void write_nullstr(write_ptr_t wptr, const char* str)
     }
 }
 
-bool pkg_write(buf_t buf, pkg_t* pkg)
+static uint32_t pkg_len(const pkg_t* pkg, uint8_t* pkgtype)
 {
-    struct _write_ptr_t wptr;
     uint32_t pkglen = 0;
-    uint8_t pkgtype = 0;
-    wptr.totavail = buf_wavail(buf);
-    if (wptr.totavail < 6)
-    {
-        return false;
-    }
+    *pkgtype = 0;
     switch (pkg->type)
     {
     case PKG_NEW_SERVICE:
-        pkgtype = 1;
+        *pkgtype = 1;
         pkglen = 4 +
             4 + strlen(pkg->content.new_service.usn) +
             4 + strlen(pkg->content.new_service.location) +
@@ -192,22 +235,62 @@ bool pkg_write(buf_t buf, pkg_t* pkg)
                  ? strlen(pkg->content.new_service.nls) : 0);
         break;
     case PKG_OLD_SERVICE:
-        pkgtype = 2;
+        *pkgtype = 2;
         pkglen = 4;
         break;
     case PKG_CREATE_TUNNEL:
-        pkgtype = 10;
-        pkglen = 8 + 4 + strlen(pkg->content.create_tunnel.host) + 2;
+        *pkgtype = 10;
+        pkglen = 8 + 4 + strlen(pkg->content.create_tunnel.host) + 2 + 1;
         break;
     case PKG_SETUP_TUNNEL:
-        pkgtype = 11;
+        *pkgtype = 11;
         pkglen = 4 + 1 + 2;
         break;
     case PKG_CLOSE_TUNNEL:
-        pkgtype = 12;
+        *pkgtype = 12;
         pkglen = 4 + 1;
         break;
+    case PKG_RESTART_TUNNEL:
+        *pkgtype = 13;
+        pkglen = 4 + 1;
+        break;
+    case PKG_HELLO:
+        *pkgtype = 20;
+        pkglen = 1 + 1;
+        break;
+    case PKG_SUBSCRIBE:
+        *pkgtype = 30;
+        pkglen = 8 + 4 + strlen(pkg->content.subscribe.path);
+        break;
+    case PKG_UNSUBSCRIBE:
+        *pkgtype = 31;
+        pkglen = 4 + 1;
+        break;
+    case PKG_EVENT:
+        *pkgtype = 32;
+        pkglen = 4 + 1 + 4 + pkg->content.event.len;
+        break;
+    }
+    return pkglen;
+}
+
+size_t pkg_size(const pkg_t* pkg)
+{
+    uint8_t pkgtype;
+    return 6 + pkg_len(pkg, &pkgtype);
+}
+
+bool pkg_write(buf_t buf, const pkg_t* pkg)
+{
+    struct _write_ptr_t wptr;
+    uint32_t pkglen;
+    uint8_t pkgtype;
+    wptr.totavail = buf_wavail(buf);
+    if (wptr.totavail < 6)
+    {
+        return false;
     }
+    pkglen = pkg_len(pkg, &pkgtype);
     if (6 + pkglen > wptr.totavail)
     {
         return false;
@@ -238,6 +321,7 @@ bool pkg_write(buf_t buf, pkg_t* pkg)
         write_uint32(&wptr, pkg->content.create_tunnel.tunnel_id);
         write_str(&wptr, pkg->content.create_tunnel.host);
         write_uint16(&wptr, pkg->content.create_tunnel.port);
+        write_uint8(&wptr, pkg->content.create_tunnel.compress);
         write_done(&wptr);
         return true;
     case PKG_SETUP_TUNNEL:
@@ -251,266 +335,967 @@ bool pkg_write(buf_t buf, pkg_t* pkg)
         write_uint8(&wptr, pkg->content.close_tunnel.local ? 1 : 0);
         write_done(&wptr);
         return true;
+    case PKG_RESTART_TUNNEL:
+        write_uint32(&wptr, pkg->content.restart_tunnel.tunnel_id);
+        write_uint8(&wptr, pkg->content.restart_tunnel.local ? 1 : 0);
+        write_done(&wptr);
+        return true;
+    case PKG_HELLO:
+        write_uint8(&wptr, pkg->content.hello.version);
+        write_uint8(&wptr, pkg->content.hello.compress);
+        write_done(&wptr);
+        return true;
+    case PKG_SUBSCRIBE:
+        write_uint32(&wptr, pkg->content.subscribe.service_id);
+        write_uint32(&wptr, pkg->content.subscribe.watch_id);
+        write_str(&wptr, pkg->content.subscribe.path);
+        write_done(&wptr);
+        return true;
+    case PKG_UNSUBSCRIBE:
+        write_uint32(&wptr, pkg->content.unsubscribe.watch_id);
+        write_uint8(&wptr, pkg->content.unsubscribe.local ? 1 : 0);
+        write_done(&wptr);
+        return true;
+    case PKG_EVENT:
+        write_uint32(&wptr, pkg->content.event.watch_id);
+        write_uint8(&wptr, pkg->content.event.last ? 1 : 0);
+        write_nstr(&wptr, pkg->content.event.data, pkg->content.event.len);
+        write_done(&wptr);
+        return true;
     default:
         assert(false);
         return false;
     }
 }
 
+/* Limits for each channel of a dictionary, the writer stops adding strings
+ * when reached and the reader refuses to go past them */
+#define DICT_MAX_ENTRIES (4096)
+#define DICT_MAX_BYTES (64 * 1024)
+/* Maximum number of strings added for each string in a package */
+#define DICT_MAX_ADDS (16)
+
+/* Compact new_service has the strings in this order, so that usn can end
+ * with a reference to service. The first byte has the channel in the top
+ * two bits and which strings are non-empty in the rest */
+enum
+{
+    DICT_SERVICE = 0,
+    DICT_USN,
+    DICT_LOCATION,
+    DICT_SERVER,
+    DICT_OPT,
+    DICT_NLS,
+    DICT_STRINGS
+};
+
+typedef struct
+{
+    char* str;
+    size_t len;
+} dict_entry_t;
+
+/* Element of the index used by the writer, str points to an entry */
+typedef struct
+{
+    const char* str;
+    size_t len;
+    uint32_t hash;
+    uint32_t idx;
+} dict_key_t;
+
+typedef struct
+{
+    dict_entry_t* entry;
+    size_t entries, alloc, bytes;
+    /* Only used by the writer, created on first write */
+    map_t index;
+} dict_channel_t;
+
+struct _pkg_dict_t
+{
+    dict_channel_t channel[PKG_DICT_CHANNELS];
+};
+
+/* How a string is sent: entry prefix (if any), the literal part
+ * [start, end) of the string and entry suffix (if any) */
+typedef struct
+{
+    uint32_t prefix, suffix; /* Entry index + 1, 0 for none */
+    size_t start, end;
+    bool exact;
+    unsigned int adds;
+    size_t add[DICT_MAX_ADDS]; /* Length of the prefixes added */
+} dict_str_t;
+
+static uint32_t str_hash(const char* str, size_t len)
+{
+    /* FNV-1a */
+    uint32_t hash = 2166136261u;
+    while (len-- > 0)
+    {
+        hash ^= (uint8_t)*str++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static uint32_t dict_key_hash(const void* _key)
+{
+    return ((const dict_key_t*)_key)->hash;
+}
+
+static bool dict_key_eq(const void* _k1, const void* _k2)
+{
+    const dict_key_t* k1 = _k1, *k2 = _k2;
+    return k1->hash == k2->hash && k1->len == k2->len &&
+        memcmp(k1->str, k2->str, k1->len) == 0;
+}
+
+static bool is_separator(char c)
+{
+    return c == ':' || c == '/';
+}
+
+/* Strings are split where separators start or end, so that both "uuid:x"
+ * and "uuid:x::" are found in "uuid:x::upnp:rootdevice" */
+static bool is_boundary(const char* str, size_t len, size_t p)
+{
+    if (p == 0 || p >= len)
+    {
+        return false;
+    }
+    return is_separator(str[p - 1]) != is_separator(str[p]);
+}
+
+pkg_dict_t pkg_dict_new(void)
+{
+    return calloc(1, sizeof(struct _pkg_dict_t));
+}
+
+static void channel_clear(dict_channel_t* ch, size_t keep)
+{
+    while (ch->entries > keep)
+    {
+        dict_entry_t* entry = ch->entry + --ch->entries;
+        if (ch->index != NULL)
+        {
+            dict_key_t key;
+            key.str = entry->str;
+            key.len = entry->len;
+            key.hash = str_hash(entry->str, entry->len);
+            map_remove(ch->index, &key);
+        }
+        ch->bytes -= entry->len;
+        free(entry->str);
+    }
+}
+
+void pkg_dict_free(pkg_dict_t dict)
+{
+    unsigned int i;
+    if (dict == NULL)
+    {
+        return;
+    }
+    for (i = 0; i < PKG_DICT_CHANNELS; ++i)
+    {
+        channel_clear(dict->channel + i, 0);
+        map_free(dict->channel[i].index);
+        free(dict->channel[i].entry);
+    }
+    free(dict);
+}
+
+void pkg_dict_clear(pkg_dict_t dict)
+{
+    unsigned int i;
+    for (i = 0; i < PKG_DICT_CHANNELS; ++i)
+    {
+        channel_clear(dict->channel + i, 0);
+    }
+}
+
+size_t pkg_dict_size(pkg_dict_t dict)
+{
+    size_t size = 0;
+    unsigned int i;
+    for (i = 0; i < PKG_DICT_CHANNELS; ++i)
+    {
+        size += dict->channel[i].bytes;
+    }
+    return size;
+}
+
+static bool channel_room(const dict_channel_t* ch, size_t len)
+{
+    return ch->entries < DICT_MAX_ENTRIES &&
+        ch->bytes + len <= DICT_MAX_BYTES;
+}
+
+/* Takes ownership of str, the caller checks channel_room first */
+static void channel_add(dict_channel_t* ch, char* str, size_t len)
+{
+    if (ch->entries == ch->alloc)
+    {
+        size_t na = ch->alloc == 0 ? 64 : ch->alloc * 2;
+        ch->entry = realloc(ch->entry, na * sizeof(dict_entry_t));
+        ch->alloc = na;
+    }
+    ch->entry[ch->entries].str = str;
+    ch->entry[ch->entries].len = len;
+    if (ch->index != NULL)
+    {
+        dict_key_t key;
+        key.str = str;
+        key.len = len;
+        key.hash = str_hash(str, len);
+        key.idx = ch->entries;
+        map_put(ch->index, &key);
+    }
+    ch->entries++;
+    ch->bytes += len;
+}
+
+size_t pkg_dict_entries(pkg_dict_t dict, unsigned int channel)
+{
+    assert(channel < PKG_DICT_CHANNELS);
+    return dict->channel[channel].entries;
+}
+
+const char* pkg_dict_entry(pkg_dict_t dict, unsigned int channel, size_t idx,
+                           size_t* len)
+{
+    const dict_channel_t* ch;
+    assert(channel < PKG_DICT_CHANNELS);
+    ch = dict->channel + channel;
+    assert(idx < ch->entries);
+    *len = ch->entry[idx].len;
+    return ch->entry[idx].str;
+}
+
+bool pkg_dict_append(pkg_dict_t dict, unsigned int channel,
+                     const char* str, size_t len)
+{
+    dict_channel_t* ch;
+    char* copy;
+    assert(channel < PKG_DICT_CHANNELS);
+    ch = dict->channel + channel;
+    if (!channel_room(ch, len))
+    {
+        return false;
+    }
+    copy = malloc(len + 1);
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    channel_add(ch, copy, len);
+    return true;
+}
+
+/* Returns entry index + 1, 0 if not found */
+static uint32_t channel_find(const dict_channel_t* ch, const char* str,
+                             size_t len)
+{
+    dict_key_t key, *found;
+    key.str = str;
+    key.len = len;
+    key.hash = str_hash(str, len);
+    found = map_get(ch->index, &key);
+    return found != NULL ? found->idx + 1 : 0;
+}
+
+static void dict_plan_add(dict_channel_t* ch, const char* str, size_t len,
+                          dict_str_t* plan)
+{
+    char* copy;
+    if (plan->adds == DICT_MAX_ADDS || !channel_room(ch, len) ||
+        channel_find(ch, str, len) != 0)
+    {
+        return;
+    }
+    copy = malloc(len + 1);
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    channel_add(ch, copy, len);
+    plan->add[plan->adds++] = len;
+}
+
+/* Decide how to send str and add the new parts of it to the channel */
+static void dict_plan(dict_channel_t* ch, const char* str, size_t len,
+                      dict_str_t* plan)
+{
+    size_t p;
+    memset(plan, 0, sizeof(dict_str_t));
+    plan->end = len;
+    plan->prefix = channel_find(ch, str, len);
+    if (plan->prefix != 0)
+    {
+        plan->start = len;
+        plan->exact = true;
+        return;
+    }
+    /* Longest known suffix */
+    for (p = 1; p < len; ++p)
+    {
+        if (is_boundary(str, len, p))
+        {
+            plan->suffix = channel_find(ch, str + p, len - p);
+            if (plan->suffix != 0)
+            {
+                plan->end = p;
+                break;
+            }
+        }
+    }
+    /* Longest known prefix */
+    for (p = plan->end; p > 0; --p)
+    {
+        if (p == len || is_boundary(str, len, p))
+        {
+            plan->prefix = channel_find(ch, str, p);
+            if (plan->prefix != 0)
+            {
+                plan->start = p;
+                break;
+            }
+        }
+    }
+    /* Remember the new prefixes, and the whole string unless it ended with
+     * a known suffix (then it is most likely just as easy to send again) */
+    for (p = plan->start + 1; p <= plan->end && p < len; ++p)
+    {
+        if (is_boundary(str, len, p) &&
+            (plan->suffix != 0 || plan->adds + 1 < DICT_MAX_ADDS))
+        {
+            dict_plan_add(ch, str, p, plan);
+        }
+    }
+    if (plan->suffix == 0)
+    {
+        dict_plan_add(ch, str, len, plan);
+    }
+}
+
+static size_t varint_size(uint32_t value)
+{
+    size_t size = 1;
+    while (value >= 0x80)
+    {
+        value >>= 7;
+        ++size;
+    }
+    return size;
+}
+
+static void write_varint(write_ptr_t wptr, uint32_t value)
+{
+    uint8_t tmp[5];
+    size_t len = 0;
+    while (value >= 0x80)
+    {
+        tmp[len++] = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    tmp[len++] = value;
+    write_raw(wptr, tmp, len);
+}
+
+static size_t dict_str_size(const dict_str_t* plan)
+{
+    size_t size;
+    unsigned int i;
+    size = varint_size(plan->prefix << 1);
+    if (plan->exact)
+    {
+        return size;
+    }
+    size += varint_size(plan->end - plan->start) + (plan->end - plan->start);
+    size += varint_size(plan->suffix) + varint_size(plan->adds);
+    for (i = 0; i < plan->adds; ++i)
+    {
+        size += varint_size(plan->add[i]);
+    }
+    return size;
+}
+
+static void write_dict_str(write_ptr_t wptr, const char* str,
+                           const dict_str_t* plan)
+{
+    unsigned int i;
+    if (plan->exact)
+    {
+        write_varint(wptr, plan->prefix << 1);
+        return;
+    }
+    write_varint(wptr, (plan->prefix << 1) | 1);
+    write_varint(wptr, plan->end - plan->start);
+    write_raw(wptr, str + plan->start, plan->end - plan->start);
+    write_varint(wptr, plan->suffix);
+    write_varint(wptr, plan->adds);
+    for (i = 0; i < plan->adds; ++i)
+    {
+        write_varint(wptr, plan->add[i]);
+    }
+}
+
+size_t pkg_size_dict(const pkg_t* pkg)
+{
+    const char* str[DICT_STRINGS];
+    size_t size;
+    unsigned int i;
+    if (pkg->type != PKG_NEW_SERVICE)
+    {
+        return pkg_size(pkg);
+    }
+    str[DICT_SERVICE] = pkg->content.new_service.service;
+    str[DICT_USN] = pkg->content.new_service.usn;
+    str[DICT_LOCATION] = pkg->content.new_service.location;
+    str[DICT_SERVER] = pkg->content.new_service.server;
+    str[DICT_OPT] = pkg->content.new_service.opt;
+    str[DICT_NLS] = pkg->content.new_service.nls;
+    /* Header, channel and string mask, service_id */
+    size = 6 + 1 + varint_size(pkg->content.new_service.service_id);
+    for (i = 0; i < DICT_STRINGS; ++i)
+    {
+        if (str[i] != NULL)
+        {
+            /* Prefix and suffix, literal and its length, the adds */
+            size_t len = strlen(str[i]), lensize = varint_size(len);
+            size += 2 * varint_size(DICT_MAX_ENTRIES << 1 | 1) +
+                len + lensize + 1 + DICT_MAX_ADDS * lensize;
+        }
+    }
+    return size;
+}
+
+size_t pkg_write_dict(buf_t buf, const pkg_t* pkg, pkg_dict_t dict,
+                      unsigned int channel)
+{
+    struct _write_ptr_t wptr;
+    const char* str[DICT_STRINGS];
+    size_t len[DICT_STRINGS];
+    dict_str_t plan[DICT_STRINGS];
+    dict_channel_t* ch;
+    uint32_t pkglen;
+    uint8_t mask = 0;
+    unsigned int i;
+    if (pkg->type != PKG_NEW_SERVICE)
+    {
+        return pkg_write(buf, pkg) ? pkg_size(pkg) : 0;
+    }
+    assert(channel < PKG_DICT_CHANNELS);
+    wptr.totavail = buf_wavail(buf);
+    /* Check against the worst case, the dictionary must not be changed
+     * unless the package is written */
+    if (pkg_size_dict(pkg) > wptr.totavail)
+    {
+        return 0;
+    }
+    ch = dict->channel + channel;
+    if (ch->index == NULL)
+    {
+        size_t e;
+        ch->index = map_new(sizeof(dict_key_t), dict_key_hash, dict_key_eq,
+                            NULL);
+        for (e = 0; e < ch->entries; ++e)
+        {
+            dict_key_t key;
+            key.str = ch->entry[e].str;
+            key.len = ch->entry[e].len;
+            key.hash = str_hash(key.str, key.len);
+            key.idx = e;
+            map_put(ch->index, &key);
+        }
+    }
+    str[DICT_SERVICE] = pkg->content.new_service.service;
+    str[DICT_USN] = pkg->content.new_service.usn;
+    str[DICT_LOCATION] = pkg->content.new_service.location;
+    str[DICT_SERVER] = pkg->content.new_service.server;
+    str[DICT_OPT] = pkg->content.new_service.opt;
+    str[DICT_NLS] = pkg->content.new_service.nls;
+    pkglen = 1 + varint_size(pkg->content.new_service.service_id);
+    for (i = 0; i < DICT_STRINGS; ++i)
+    {
+        len[i] = str[i] != NULL ? strlen(str[i]) : 0;
+        if (len[i] > 0)
+        {
+            mask |= 1 << i;
+            dict_plan(ch, str[i], len[i], plan + i);
+            pkglen += dict_str_size(plan + i);
+        }
+    }
+
+    wptr.buf = buf;
+    wptr.org = wptr.ptr = buf_wptr(buf, &(wptr.ptravail));
+    write_uint32(&wptr, pkglen);
+    write_uint8(&wptr, 3);
+    write_uint8(&wptr, 0);
+    write_uint8(&wptr, channel << 6 | mask);
+    write_varint(&wptr, pkg->content.new_service.service_id);
+    for (i = 0; i < DICT_STRINGS; ++i)
+    {
+        if (len[i] > 0)
+        {
+            write_dict_str(&wptr, str[i], plan + i);
+        }
+    }
+    write_done(&wptr);
+    return 6 + pkglen;
+}
+
+/* Reads from the (at most two) parts of a package in the buffer */
 typedef struct _read_ptr_t
 {
-    buf_t buf;
-    const char* org, *ptr;
-    size_t ptravail, totavail;
+    const char* ptr[2];
+    size_t avail[2];
+    bool err;
 }* read_ptr_t;
 
-static void read_raw(read_ptr_t rptr, void* data, size_t len)
+/* Return a view of the next len bytes, sets err if there isn't enough */
+static void read_raw(read_ptr_t rptr, pkg_str_t* str, size_t len)
 {
-    if (rptr->ptravail >= len)
+    if (len > rptr->avail[0] + rptr->avail[1])
+    {
+        rptr->err = true;
+        memset(str, 0, sizeof(pkg_str_t));
+        return;
+    }
+    memset(str, 0, sizeof(pkg_str_t));
+    str->ptr[0] = rptr->ptr[0];
+    if (len <= rptr->avail[0])
     {
-        memcpy(data, rptr->ptr, len);
-        rptr->ptr += len;
-        rptr->ptravail -= len;
-        if (rptr->ptravail > 0)
+        str->len[0] = len;
+        rptr->ptr[0] += len;
+        rptr->avail[0] -= len;
+        if (rptr->avail[0] > 0 || rptr->avail[1] == 0)
         {
             return;
         }
-        else
+        len = 0;
+    }
+    else
+    {
+        str->len[0] = rptr->avail[0];
+        str->ptr[1] = rptr->ptr[1];
+        str->len[1] = len - rptr->avail[0];
+        len = str->len[1];
+    }
+    rptr->ptr[0] = rptr->ptr[1] + len;
+    rptr->avail[0] = rptr->avail[1] - len;
+    rptr->ptr[1] = NULL;
+    rptr->avail[1] = 0;
+}
+
+/* Copy the first len bytes of str to data */
+static void str_ncopy(const pkg_str_t* str, void* data, size_t len)
+{
+    char* ptr = data;
+    unsigned int i;
+    for (i = 0; i < PKG_STR_PARTS && len > 0; ++i)
+    {
+        size_t l = str->len[i] < len ? str->len[i] : len;
+        if (l > 0)
         {
-            len = 0;
+            memcpy(ptr, str->ptr[i], l);
+            ptr += l;
+            len -= l;
         }
     }
+}
+
+static void str_copy(const pkg_str_t* str, void* data)
+{
+    str_ncopy(str, data, pkg_str_len(str));
+}
+
+static void str_append(pkg_str_t* str, const char* ptr, size_t len)
+{
+    unsigned int i;
+    if (len == 0)
     {
-        size_t read = rptr->ptr - rptr->org;
-        buf_rmove(rptr->buf, read);
-        rptr->totavail -= read;
+        return;
     }
-    assert(rptr->totavail >= len);
-    buf_read(rptr->buf, data, len);
-    rptr->totavail -= len;
-    rptr->org = rptr->ptr = buf_rptr(rptr->buf, &(rptr->ptravail));
-    assert(rptr->ptravail == rptr->totavail);
+    for (i = 0; i < PKG_STR_PARTS; ++i)
+    {
+        if (str->len[i] == 0)
+        {
+            str->ptr[i] = ptr;
+            str->len[i] = len;
+            return;
+        }
+    }
+    assert(false);
 }
 
-static void read_done(read_ptr_t rptr)
+/* Read len bytes, returns a pointer into the buffer unless they are split
+ * in which case they are copied to tmp. Returns NULL if there isn't enough */
+static const uint8_t* read_fixed(read_ptr_t rptr, uint8_t* tmp, size_t len)
 {
-    buf_rmove(rptr->buf, rptr->ptr - rptr->org);
+    pkg_str_t str;
+    read_raw(rptr, &str, len);
+    if (rptr->err)
+    {
+        return NULL;
+    }
+    if (str.len[0] == len)
+    {
+        return (const uint8_t*)str.ptr[0];
+    }
+    str_copy(&str, tmp);
+    return tmp;
 }
 
 static uint32_t read_uint32(read_ptr_t rptr)
 {
     uint8_t tmp[4];
-    read_raw(rptr, tmp, 4);
-    return tmp[0] << 24 | tmp[1] << 16 | tmp[2] << 8 | tmp[3];
+    const uint8_t* ptr = read_fixed(rptr, tmp, 4);
+    if (ptr == NULL)
+    {
+        return 0;
+    }
+    return ptr[0] << 24 | ptr[1] << 16 | ptr[2] << 8 | ptr[3];
 }
 
 static uint16_t read_uint16(read_ptr_t rptr)
 {
     uint8_t tmp[2];
-    read_raw(rptr, tmp, 2);
-    return tmp[0] << 8 | tmp[1];
+    const uint8_t* ptr = read_fixed(rptr, tmp, 2);
+    if (ptr == NULL)
+    {
+        return 0;
+    }
+    return ptr[0] << 8 | ptr[1];
 }
 
 static uint8_t read_uint8(read_ptr_t rptr)
 {
     uint8_t tmp;
-    read_raw(rptr, &tmp, 1);
-    return tmp;
+    const uint8_t* ptr = read_fixed(rptr, &tmp, 1);
+    if (ptr == NULL)
+    {
+        return 0;
+    }
+    return ptr[0];
+}
+
+/* For fields added at the end of a package, older daemons don't send
+ * them */
+static uint8_t read_opt_uint8(read_ptr_t rptr, uint8_t value)
+{
+    if (rptr->avail[0] + rptr->avail[1] == 0)
+    {
+        return value;
+    }
+    return read_uint8(rptr);
 }
 
-static char* read_str(read_ptr_t rptr)
+static void read_str(read_ptr_t rptr, pkg_str_t* str)
 {
     uint32_t len = read_uint32(rptr);
-    char* str = malloc(len + 1);
-    str[len] = '\0';
     read_raw(rptr, str, len);
-    return str;
 }
 
-static char* read_nullstr(read_ptr_t rptr)
+static uint32_t read_varint(read_ptr_t rptr)
 {
-    uint32_t len = read_uint32(rptr);
-    if (len > 0)
+    uint32_t value = 0;
+    unsigned int shift;
+    for (shift = 0; shift < 35; shift += 7)
     {
-        char* str = malloc(len + 1);
-        str[len] = '\0';
-        read_raw(rptr, str, len);
-        return str;
+        uint8_t byte = read_uint8(rptr);
+        value |= (uint32_t)(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0)
+        {
+            return value;
+        }
     }
-    return NULL;
+    rptr->err = true;
+    return 0;
 }
 
-bool pkg_peek(buf_t buf, pkg_t* pkg)
+/* Read a string written by write_dict_str, adding to ch as the writer did */
+static void read_dict_str(read_ptr_t rptr, dict_channel_t* ch,
+                          pkg_str_t* str)
+{
+    uint32_t head = read_varint(rptr), prefix = head >> 1, suffix, adds;
+    pkg_str_t literal;
+    size_t len;
+    memset(str, 0, sizeof(pkg_str_t));
+    if (rptr->err || prefix > ch->entries)
+    {
+        rptr->err = true;
+        return;
+    }
+    if (prefix > 0)
+    {
+        str_append(str, ch->entry[prefix - 1].str, ch->entry[prefix - 1].len);
+    }
+    if ((head & 1) == 0)
+    {
+        if (prefix == 0)
+        {
+            rptr->err = true;
+        }
+        return;
+    }
+    len = read_varint(rptr);
+    read_raw(rptr, &literal, len);
+    suffix = read_varint(rptr);
+    adds = read_varint(rptr);
+    if (rptr->err || suffix > ch->entries || adds > DICT_MAX_ADDS)
+    {
+        rptr->err = true;
+        return;
+    }
+    str_append(str, literal.ptr[0], literal.len[0]);
+    str_append(str, literal.ptr[1], literal.len[1]);
+    if (suffix > 0)
+    {
+        str_append(str, ch->entry[suffix - 1].str, ch->entry[suffix - 1].len);
+    }
+    len = pkg_str_len(str);
+    while (adds-- > 0)
+    {
+        uint32_t add = read_varint(rptr);
+        char* copy;
+        if (rptr->err || add == 0 || add > len || !channel_room(ch, add))
+        {
+            rptr->err = true;
+            return;
+        }
+        copy = malloc(add + 1);
+        str_ncopy(str, copy, add);
+        copy[add] = '\0';
+        channel_add(ch, copy, add);
+    }
+}
+
+size_t pkg_str_len(const pkg_str_t* str)
+{
+    size_t len = 0;
+    unsigned int i;
+    for (i = 0; i < PKG_STR_PARTS; ++i)
+    {
+        len += str->len[i];
+    }
+    return len;
+}
+
+bool pkg_str_eq(const pkg_str_t* str, const char* cstr)
+{
+    size_t len = cstr != NULL ? strlen(cstr) : 0;
+    unsigned int i;
+    if (len != pkg_str_len(str))
+    {
+        return false;
+    }
+    for (i = 0; i < PKG_STR_PARTS; ++i)
+    {
+        if (str->len[i] > 0)
+        {
+            if (memcmp(str->ptr[i], cstr, str->len[i]) != 0)
+            {
+                return false;
+            }
+            cstr += str->len[i];
+        }
+    }
+    return true;
+}
+
+char* pkg_str_dup(const pkg_str_t* str)
+{
+    size_t len = pkg_str_len(str);
+    char* ret = malloc(len + 1);
+    if (ret == NULL)
+    {
+        return NULL;
+    }
+    str_copy(str, ret);
+    ret[len] = '\0';
+    return ret;
+}
+
+char* pkg_str_nulldup(const pkg_str_t* str)
+{
+    return pkg_str_len(str) > 0 ? pkg_str_dup(str) : NULL;
+}
+
+bool pkg_peek(buf_t buf, pkg_dict_t dict, pkg_view_t* pkg)
 {
     struct _read_ptr_t rptr;
     uint32_t pkglen;
     uint8_t pkgtype, pkgversion;
-    uint8_t header[6];
+    size_t avail;
+    dict_channel_t* ch = NULL;
+    size_t ch_entries = 0;
     for (;;)
     {
-        rptr.totavail = buf_ravail(buf);
-        if (rptr.totavail < 6)
+        avail = buf_rview(buf, rptr.ptr, rptr.avail);
+        if (avail < 6)
         {
             return false;
         }
-        buf_peek(buf, header, 6);
-        pkglen = (header[0] << 24) | (header[1] << 16) | (header[2] << 8)
-            | header[3];
-        pkgtype = header[4];
-        pkgversion = header[5];
+        rptr.err = false;
+        pkglen = read_uint32(&rptr);
+        pkgtype = read_uint8(&rptr);
+        pkgversion = read_uint8(&rptr);
 
-        if (rptr.totavail < 6 + pkglen)
+        if (avail - 6 < pkglen)
         {
             /* need more data */
             return false;
         }
 
+        pkg->size = 6 + (size_t)pkglen;
         if (pkgversion != 0 ||
-            !((pkgtype >= 1 && pkgtype <= 2) ||
-              (pkgtype >= 10 && pkgtype <= 12)))
+            !((pkgtype >= 1 && pkgtype <= 3) ||
+              (pkgtype >= 10 && pkgtype <= 13) || pkgtype == 20 ||
+              (pkgtype >= 30 && pkgtype <= 32)) ||
+            (pkgtype == 3 && dict == NULL))
         {
             /* skip package */
-            assert(false);
-            buf_skip(buf, 6 + pkglen);
+            buf_skip(buf, pkg->size);
             continue;
         }
 
-        buf_skip(buf, 6);
-        rptr.totavail -= 6;
-        rptr.buf = buf;
-        rptr.ptr = rptr.org = buf_rptr(buf, &(rptr.ptravail));
-
-        pkg->tmp1 = 0;
-        pkg->tmp2 = false;
+        /* Don't read past the end of the package */
+        if (rptr.avail[0] >= pkglen)
+        {
+            rptr.avail[0] = pkglen;
+            rptr.avail[1] = 0;
+        }
+        else
+        {
+            rptr.avail[1] = pkglen - rptr.avail[0];
+        }
 
         switch (pkgtype)
         {
         case 1:
             pkg->type = PKG_NEW_SERVICE;
             pkg->content.new_service.service_id = read_uint32(&rptr);
-            if (rptr.ptravail >= pkglen - 4)
+            read_str(&rptr, &(pkg->content.new_service.usn));
+            read_str(&rptr, &(pkg->content.new_service.location));
+            read_str(&rptr, &(pkg->content.new_service.service));
+            read_str(&rptr, &(pkg->content.new_service.server));
+            read_str(&rptr, &(pkg->content.new_service.opt));
+            read_str(&rptr, &(pkg->content.new_service.nls));
+            break;
+        case 2:
+            pkg->type = PKG_OLD_SERVICE;
+            pkg->content.old_service.service_id = read_uint32(&rptr);
+            break;
+        case 3:
+        {
+            /* Compact new_service, see pkg_write_dict */
+            pkg_str_t* str[DICT_STRINGS];
+            uint8_t channel, mask;
+            unsigned int i;
+            pkg->type = PKG_NEW_SERVICE;
+            mask = read_uint8(&rptr);
+            channel = mask >> 6;
+            pkg->content.new_service.service_id = read_varint(&rptr);
+            if (rptr.err)
             {
-                uint8_t* ptr = (uint8_t*)rptr.ptr;
-                uint32_t len;
-                len = ptr[0] << 24 | ptr[1] << 16 | ptr[2] << 8 | ptr[3];
-                ptr += 4;
-                pkg->content.new_service.usn = (char*)ptr;
-                ptr += len;
-                len = ptr[0] << 24 | ptr[1] << 16 | ptr[2] << 8 | ptr[3];
-                ptr[0] = '\0';
-                ptr += 4;
-                pkg->content.new_service.location = (char*)ptr;
-                ptr += len;
-                len = ptr[0] << 24 | ptr[1] << 16 | ptr[2] << 8 | ptr[3];
-                ptr[0] = '\0';
-                ptr += 4;
-                pkg->content.new_service.service = (char*)ptr;
-                ptr += len;
-                len = ptr[0] << 24 | ptr[1] << 16 | ptr[2] << 8 | ptr[3];
-                ptr[0] = '\0';
-                ptr += 4;
-                if (len > 0)
-                {
-                    pkg->content.new_service.server = (char*)ptr;
-                    ptr += len;
-                }
-                else
-                {
-                    pkg->content.new_service.server = NULL;
-                }
-                len = ptr[0] << 24 | ptr[1] << 16 | ptr[2] << 8 | ptr[3];
-                ptr[0] = '\0';
-                ptr += 4;
-                if (len > 0)
-                {
-                    pkg->content.new_service.opt = (char*)ptr;
-                    ptr += len;
-                }
-                else
-                {
-                    pkg->content.new_service.opt = NULL;
-                }
-                len = ptr[0] << 24 | ptr[1] << 16 | ptr[2] << 8 | ptr[3];
-                ptr[0] = '\0';
-                ptr += 4;
-                if (len > 0)
+                break;
+            }
+            ch = dict->channel + channel;
+            ch_entries = ch->entries;
+            str[DICT_SERVICE] = &(pkg->content.new_service.service);
+            str[DICT_USN] = &(pkg->content.new_service.usn);
+            str[DICT_LOCATION] = &(pkg->content.new_service.location);
+            str[DICT_SERVER] = &(pkg->content.new_service.server);
+            str[DICT_OPT] = &(pkg->content.new_service.opt);
+            str[DICT_NLS] = &(pkg->content.new_service.nls);
+            for (i = 0; i < DICT_STRINGS && !rptr.err; ++i)
+            {
+                if (mask & (1 << i))
                 {
-                    pkg->content.new_service.nls = malloc(len + 1);
-                    memcpy(pkg->content.new_service.nls, ptr, len);
-                    pkg->content.new_service.nls[len] = '\0';
-                    ptr += len;
+                    read_dict_str(&rptr, ch, str[i]);
                 }
                 else
                 {
-                    pkg->content.new_service.nls = NULL;
+                    memset(str[i], 0, sizeof(pkg_str_t));
                 }
-                pkg->tmp1 = (char*)ptr - rptr.org;
-                pkg->tmp2 = true;
-                return true;
-            }
-            else
-            {
-                pkg->content.new_service.usn = read_str(&rptr);
-                pkg->content.new_service.location = read_str(&rptr);
-                pkg->content.new_service.service = read_str(&rptr);
-                pkg->content.new_service.server = read_nullstr(&rptr);
-                pkg->content.new_service.opt = read_nullstr(&rptr);
-                pkg->content.new_service.nls = read_nullstr(&rptr);
-                read_done(&rptr);
             }
-            return true;
-        case 2:
-            pkg->type = PKG_OLD_SERVICE;
-            pkg->content.old_service.service_id = read_uint32(&rptr);
-            read_done(&rptr);
-            return true;
+            break;
+        }
         case 10:
             pkg->type = PKG_CREATE_TUNNEL;
             pkg->content.create_tunnel.service_id = read_uint32(&rptr);
             pkg->content.create_tunnel.tunnel_id = read_uint32(&rptr);
-            pkg->content.create_tunnel.host = read_str(&rptr);
+            read_str(&rptr, &(pkg->content.create_tunnel.host));
             pkg->content.create_tunnel.port = read_uint16(&rptr);
-            read_done(&rptr);
-            return true;
+            pkg->content.create_tunnel.compress = read_opt_uint8(&rptr, 0);
+            break;
         case 11:
             pkg->type = PKG_SETUP_TUNNEL;
             pkg->content.setup_tunnel.tunnel_id = read_uint32(&rptr);
             pkg->content.setup_tunnel.ok = read_uint8(&rptr) != 0;
             pkg->content.setup_tunnel.port = read_uint16(&rptr);
-            read_done(&rptr);
-            return true;
+            break;
         case 12:
             pkg->type = PKG_CLOSE_TUNNEL;
             pkg->content.close_tunnel.tunnel_id = read_uint32(&rptr);
             pkg->content.close_tunnel.local = read_uint8(&rptr) != 0;
-            read_done(&rptr);
-            return true;
+            break;
+        case 13:
+            pkg->type = PKG_RESTART_TUNNEL;
+            pkg->content.restart_tunnel.tunnel_id = read_uint32(&rptr);
+            pkg->content.restart_tunnel.local = read_uint8(&rptr) != 0;
+            break;
+        case 20:
+            pkg->type = PKG_HELLO;
+            pkg->content.hello.version = read_uint8(&rptr);
+            pkg->content.hello.compress = read_opt_uint8(&rptr, 0);
+            break;
+        case 30:
+            pkg->type = PKG_SUBSCRIBE;
+            pkg->content.subscribe.service_id = read_uint32(&rptr);
+            pkg->content.subscribe.watch_id = read_uint32(&rptr);
+            read_str(&rptr, &(pkg->content.subscribe.path));
+            break;
+        case 31:
+            pkg->type = PKG_UNSUBSCRIBE;
+            pkg->content.unsubscribe.watch_id = read_uint32(&rptr);
+            pkg->content.unsubscribe.local = read_uint8(&rptr) != 0;
+            break;
+        case 32:
+            pkg->type = PKG_EVENT;
+            pkg->content.event.watch_id = read_uint32(&rptr);
+            pkg->content.event.last = read_uint8(&rptr) != 0;
+            read_str(&rptr, &(pkg->content.event.data));
+            if (pkg_str_len(&(pkg->content.event.data)) > PKG_EVENT_PART)
+            {
+                rptr.err = true;
+            }
+            break;
         default:
             assert(false);
-            buf_skip(buf, pkglen);
+            buf_skip(buf, pkg->size);
             continue;
         }
+        if (rptr.err)
+        {
+            /* Invalid package, skip it and anything it added */
+            if (ch != NULL)
+            {
+                channel_clear(ch, ch_entries);
+                ch = NULL;
+            }
+            buf_skip(buf, pkg->size);
+            continue;
+        }
+        return true;
     }
 }
 
-void pkg_read(buf_t buf, pkg_t* pkg)
+void pkg_read(buf_t buf, const pkg_view_t* pkg)
 {
-    if (!pkg->tmp2)
-    {
-        pkg_freecontent(pkg);
-    }
-    else
-    {
-        /* Bit of an ugly hack */
-        if (pkg->type == PKG_NEW_SERVICE)
-        {
-            free(pkg->content.new_service.nls);
-        }
-    }
-    buf_rmove(buf, pkg->tmp1);
+    buf_skip(buf, pkg->size);
 }
 
-pkg_t* pkg_dup(const pkg_t* pkg)
+pkg_t* pkg_dup(const pkg_view_t* pkg)
 {
     pkg_t* ret = calloc(1, sizeof(pkg_t));
     if (ret == NULL)
@@ -519,15 +1304,12 @@ pkg_t* pkg_dup(const pkg_t* pkg)
     {
     case PKG_NEW_SERVICE:
         pkg_new_service(ret, pkg->content.new_service.service_id,
-                        strdup(pkg->content.new_service.usn),
-                        strdup(pkg->content.new_service.location),
-                        strdup(pkg->content.new_service.service),
-                        pkg->content.new_service.server != NULL ?
-                        strdup(pkg->content.new_service.server) : NULL,
-                        pkg->content.new_service.opt != NULL ?
-                        strdup(pkg->content.new_service.opt) : NULL,
-                        pkg->content.new_service.nls != NULL ?
-                        strdup(pkg->content.new_service.nls) : NULL);
+                        pkg_str_dup(&(pkg->content.new_service.usn)),
+                        pkg_str_dup(&(pkg->content.new_service.location)),
+                        pkg_str_dup(&(pkg->content.new_service.service)),
+                        pkg_str_nulldup(&(pkg->content.new_service.server)),
+                        pkg_str_nulldup(&(pkg->content.new_service.opt)),
+                        pkg_str_nulldup(&(pkg->content.new_service.nls)));
         break;
     case PKG_OLD_SERVICE:
         pkg_old_service(ret, pkg->content.old_service.service_id);
@@ -535,8 +1317,9 @@ pkg_t* pkg_dup(const pkg_t* pkg)
     case PKG_CREATE_TUNNEL:
         pkg_create_tunnel(ret, pkg->content.create_tunnel.service_id,
                           pkg->content.create_tunnel.tunnel_id,
-                          pkg->content.create_tunnel.host,
-                          pkg->content.create_tunnel.port);
+                          pkg_str_dup(&(pkg->content.create_tunnel.host)),
+                          pkg->content.create_tunnel.port,
+                          pkg->content.create_tunnel.compress);
         break;
     case PKG_SETUP_TUNNEL:
         pkg_setup_tunnel(ret, pkg->content.setup_tunnel.tunnel_id,
@@ -547,6 +1330,29 @@ pkg_t* pkg_dup(const pkg_t* pkg)
         pkg_close_tunnel(ret, pkg->content.close_tunnel.tunnel_id,
                          pkg->content.close_tunnel.local);
         break;
+    case PKG_RESTART_TUNNEL:
+        pkg_restart_tunnel(ret, pkg->content.restart_tunnel.tunnel_id,
+                           pkg->content.restart_tunnel.local);
+        break;
+    case PKG_HELLO:
+        pkg_hello(ret, pkg->content.hello.version,
+                  pkg->content.hello.compress);
+        break;
+    case PKG_SUBSCRIBE:
+        pkg_subscribe(ret, pkg->content.subscribe.service_id,
+                      pkg->content.subscribe.watch_id,
+                      pkg_str_dup(&(pkg->content.subscribe.path)));
+        break;
+    case PKG_UNSUBSCRIBE:
+        pkg_unsubscribe(ret, pkg->content.unsubscribe.watch_id,
+                        pkg->content.unsubscribe.local);
+        break;
+    case PKG_EVENT:
+        pkg_event(ret, pkg->content.event.watch_id,
+                  pkg->content.event.last,
+                  pkg_str_dup(&(pkg->content.event.data)),
+                  pkg_str_len(&(pkg->content.event.data)));
+        break;
     }
 
     return ret;
@@ -567,9 +1373,18 @@ void pkg_freecontent(pkg_t* pkg)
     case PKG_CREATE_TUNNEL:
         free(pkg->content.create_tunnel.host);
         break;
+    case PKG_SUBSCRIBE:
+        free(pkg->content.subscribe.path);
+        break;
+    case PKG_EVENT:
+        free(pkg->content.event.data);
+        break;
     case PKG_OLD_SERVICE:
+    case PKG_UNSUBSCRIBE:
     case PKG_SETUP_TUNNEL:
     case PKG_CLOSE_TUNNEL:
+    case PKG_RESTART_TUNNEL:
+    case PKG_HELLO:
         break;
     }
 }
@@ -582,3 +1397,33 @@ void pkg_free(pkg_t* pkg)
     pkg_freecontent(pkg);
     free(pkg);
 }
+
+/* Token is 'T', flags (1 if local), uint16 server_port, uint32 tunnel_id */
+static const uint8_t TUNNEL_TOKEN_MAGIC = 'T';
+
+void pkg_tunnel_token_write(void* data, const pkg_tunnel_token_t* token)
+{
+    uint8_t* ptr = data;
+    ptr[0] = TUNNEL_TOKEN_MAGIC;
+    ptr[1] = token->local ? 1 : 0;
+    ptr[2] = token->server_port >> 8;
+    ptr[3] = token->server_port & 0xff;
+    ptr[4] = token->tunnel_id >> 24;
+    ptr[5] = (token->tunnel_id >> 16) & 0xff;
+    ptr[6] = (token->tunnel_id >> 8) & 0xff;
+    ptr[7] = token->tunnel_id & 0xff;
+}
+
+bool pkg_tunnel_token_read(const void* data, pkg_tunnel_token_t* token)
+{
+    const uint8_t* ptr = data;
+    if (ptr[0] != TUNNEL_TOKEN_MAGIC || ptr[1] > 1)
+    {
+        return false;
+    }
+    token->local = ptr[1] != 0;
+    token->server_port = ((uint16_t)ptr[2] << 8) | ptr[3];
+    token->tunnel_id = ((uint32_t)ptr[4] << 24) | ((uint32_t)ptr[5] << 16) |
+        ((uint32_t)ptr[6] << 8) | ptr[7];
+    return true;
+}
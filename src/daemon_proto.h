@@ -65,6 +65,9 @@ typedef struct
     /* Port the server listens on for a connection. May be 0 which means
      * the receive server must response with a setup_tunnel. */
     uint16_t port;
+    /* How the data in the tunnel is compressed, 0 for not at all. Picked
+     * by the requesting daemon from what both daemons sent in hello */
+    uint8_t compress;
 } pkg_create_tunnel_t;
 
 /* Response to create_tunnel */
@@ -85,6 +88,77 @@ typedef struct
                  * that did the create_tunnel. false otherwise. */
 } pkg_close_tunnel_t;
 
+/* Sent by a daemon about to hand its tunnels over to a new process (see
+ * daemon_handover_start) that wants to move a compressed tunnel. The
+ * receiving daemon ends the compressed stream it sends in the tunnel and
+ * starts a new one, so the new process can pick it up without the codec
+ * state of the old. Only sent to daemons talking version 5 */
+typedef struct
+{
+    uint32_t tunnel_id;
+    bool local; /* true if the server sending restart_tunnel is the same
+                 * that did the create_tunnel. false otherwise. */
+} pkg_restart_tunnel_t;
+
+/* Sent when a daemon has clients subscribed to the events of a service
+ * (GENA, see gena.h). The receiving daemon forwards the events of the
+ * service at path with event packages until either daemon sends
+ * unsubscribe. The watch_id is generated by the requesting daemon and
+ * must be unique for the path and daemon. */
+typedef struct
+{
+    uint32_t service_id;
+    uint32_t watch_id;
+    /* Path of the event URL on the service, without any route */
+    char* path;
+} pkg_subscribe_t;
+
+/* Can be sent by either daemon to signal that no more events will be
+ * sent or are wanted for the watch */
+typedef struct
+{
+    uint32_t watch_id;
+    bool local; /* true if the server sending unsubscribe is the same that
+                 * did the subscribe. false otherwise. */
+} pkg_unsubscribe_t;
+
+/* Part of the body of an event for a watch. Bodies are split in parts of
+ * at most PKG_EVENT_PART bytes, so that they fit the input buffer of the
+ * other daemon and don't hold up the other packages. The first event of
+ * a watch has all the evented variables of the service */
+typedef struct
+{
+    uint32_t watch_id;
+    bool last; /* true for the last part of the body */
+    char* data;
+    size_t len;
+} pkg_event_t;
+
+#define PKG_EVENT_PART (768)
+
+/* Sent by both daemons as the first package on a new connection.
+ * Daemons not knowing about it skip it, and never send it, so a daemon
+ * that gets anything else first talks version 1 */
+typedef struct
+{
+    /* Highest protocol version the sender talks, PKG_VERSION */
+    uint8_t version;
+    /* Mask of the methods the sender can compress tunnels with, bit n
+     * set for method n. 0 if none */
+    uint8_t compress;
+} pkg_hello_t;
+
+/* Version 1 is the original encoding, each tunnel has a port of its own.
+ * Version 2 adds the compact new_service encoding, see pkg_write_dict,
+ * and the tunnel token, see pkg_tunnel_token_t.
+ * Version 3 has no new packages, but daemons talking it strip routes
+ * from the requests in the tunnels they create, so services can share
+ * one port.
+ * Version 4 adds subscribe, unsubscribe and event.
+ * Version 5 adds restart_tunnel, and daemons talking it accept a new
+ * compressed stream after the end of the last in a tunnel */
+#define PKG_VERSION (5)
+
 typedef enum
 {
     PKG_NEW_SERVICE,
@@ -92,6 +166,11 @@ typedef enum
     PKG_CREATE_TUNNEL,
     PKG_SETUP_TUNNEL,
     PKG_CLOSE_TUNNEL,
+    PKG_HELLO,
+    PKG_SUBSCRIBE,
+    PKG_UNSUBSCRIBE,
+    PKG_EVENT,
+    PKG_RESTART_TUNNEL,
 } pkg_type_t;
 
 typedef struct
@@ -104,32 +183,184 @@ typedef struct
         pkg_create_tunnel_t create_tunnel;
         pkg_setup_tunnel_t setup_tunnel;
         pkg_close_tunnel_t close_tunnel;
+        pkg_hello_t hello;
+        pkg_subscribe_t subscribe;
+        pkg_unsubscribe_t unsubscribe;
+        pkg_event_t event;
+        pkg_restart_tunnel_t restart_tunnel;
     } content;
-    size_t tmp1;
-    bool tmp2;
 } pkg_t;
 
+#define PKG_STR_PARTS (4)
+
+/* A string in a package returned by pkg_peek. Points into the buffer the
+ * package was peeked from (and the dictionary, see pkg_dict_t) and is only
+ * valid until pkg_read. The buffer is a ring so the string may be split in
+ * parts, unused parts have zero length. The string is not NUL terminated. */
+typedef struct
+{
+    const char* ptr[PKG_STR_PARTS];
+    size_t len[PKG_STR_PARTS];
+} pkg_str_t;
+
+/* pkg_new_service_t as returned by pkg_peek. An empty server, opt or nls
+ * is the same as NULL */
+typedef struct
+{
+    uint32_t service_id;
+    pkg_str_t usn;
+    pkg_str_t location;
+    pkg_str_t service;
+    pkg_str_t server;
+    pkg_str_t opt;
+    pkg_str_t nls;
+} pkg_new_service_view_t;
+
+/* pkg_create_tunnel_t as returned by pkg_peek */
+typedef struct
+{
+    uint32_t service_id;
+    uint32_t tunnel_id;
+    pkg_str_t host;
+    uint16_t port;
+    uint8_t compress;
+} pkg_create_tunnel_view_t;
+
+/* pkg_subscribe_t as returned by pkg_peek */
+typedef struct
+{
+    uint32_t service_id;
+    uint32_t watch_id;
+    pkg_str_t path;
+} pkg_subscribe_view_t;
+
+/* pkg_event_t as returned by pkg_peek */
+typedef struct
+{
+    uint32_t watch_id;
+    bool last;
+    pkg_str_t data;
+} pkg_event_view_t;
+
+typedef struct
+{
+    pkg_type_t type;
+    union
+    {
+        pkg_new_service_view_t new_service;
+        pkg_old_service_t old_service;
+        pkg_create_tunnel_view_t create_tunnel;
+        pkg_setup_tunnel_t setup_tunnel;
+        pkg_close_tunnel_t close_tunnel;
+        pkg_hello_t hello;
+        pkg_subscribe_view_t subscribe;
+        pkg_unsubscribe_t unsubscribe;
+        pkg_event_view_t event;
+        pkg_restart_tunnel_t restart_tunnel;
+    } content;
+    size_t size; /* Bytes used by the package in the buffer */
+} pkg_view_t;
+
+size_t pkg_str_len(const pkg_str_t* str);
+/* Compare with a NUL terminated string, NULL is the same as "" */
+bool pkg_str_eq(const pkg_str_t* str, const char* cstr);
+/* Copy the string into a newly allocated NUL terminated string */
+char* pkg_str_dup(const pkg_str_t* str);
+/* Same as pkg_str_dup but returns NULL if the string is empty */
+char* pkg_str_nulldup(const pkg_str_t* str);
+
 #include "buf.h"
 
 /* Will only copy the pointers, not their data */
 void pkg_new_service(pkg_t* pkg, uint32_t service_id, char* usn, char* location,
                      char* service, char* server, char* opt, char* nls);
 void pkg_old_service(pkg_t* pkg, uint32_t service_id);
-void pkg_create_tunnel(pkg_t* pkg, uint32_t service_id, uint32_t tunnel_id, char* host, uint16_t port);
+void pkg_create_tunnel(pkg_t* pkg, uint32_t service_id, uint32_t tunnel_id, char* host, uint16_t port, uint8_t compress);
 void pkg_setup_tunnel(pkg_t* pkg, uint32_t tunnel_id, bool ok, uint16_t port);
 void pkg_close_tunnel(pkg_t* pkg, uint32_t tunnel_id, bool local);
+void pkg_restart_tunnel(pkg_t* pkg, uint32_t tunnel_id, bool local);
+void pkg_hello(pkg_t* pkg, uint8_t version, uint8_t compress);
+void pkg_subscribe(pkg_t* pkg, uint32_t service_id, uint32_t watch_id,
+                   char* path);
+void pkg_unsubscribe(pkg_t* pkg, uint32_t watch_id, bool local);
+/* len must be at most PKG_EVENT_PART */
+void pkg_event(pkg_t* pkg, uint32_t watch_id, bool last, char* data,
+               size_t len);
 
-/* Duplicate the given package */
-pkg_t* pkg_dup(const pkg_t* pkg);
+/* Copy a package returned by pkg_peek so that it can be kept after
+ * pkg_read */
+pkg_t* pkg_dup(const pkg_view_t* pkg);
 void pkg_free(pkg_t* pkg);
 
+/* Number of bytes pkg_write needs for the package */
+size_t pkg_size(const pkg_t* pkg);
 /* If pkg_write returns true, the pointers in pkg is now OK to free.
  * If pkg_write returns false, the buffer is full */
-bool pkg_write(buf_t buf, pkg_t* pkg);
-/* If pkg_peek returns true, pkg now contains a full package.
+bool pkg_write(buf_t buf, const pkg_t* pkg);
+/* Strings earlier sent on a link, used by the compact (version 2)
+ * new_service encoding to send them as references instead. One is needed
+ * for each direction of a link, the writer and reader must start out with
+ * the same (empty) dictionary.
+ * A dictionary has PKG_DICT_CHANNELS independent channels, packages must
+ * be read in the order they were written within a channel but may be
+ * reordered between channels. */
+typedef struct _pkg_dict_t* pkg_dict_t;
+
+#define PKG_DICT_CHANNELS (4) /* Must fit in two bits */
+
+pkg_dict_t pkg_dict_new(void);
+void pkg_dict_free(pkg_dict_t dict);
+/* Forget all strings, for a new connection */
+void pkg_dict_clear(pkg_dict_t dict);
+/* Bytes of strings in the dictionary */
+size_t pkg_dict_size(pkg_dict_t dict);
+/* The strings of a channel in the order they were added. A dictionary
+ * with the same strings appended in the same order continues the link */
+size_t pkg_dict_entries(pkg_dict_t dict, unsigned int channel);
+const char* pkg_dict_entry(pkg_dict_t dict, unsigned int channel, size_t idx,
+                           size_t* len);
+/* Returns false if the channel is full */
+bool pkg_dict_append(pkg_dict_t dict, unsigned int channel,
+                     const char* str, size_t len);
+
+/* Maximum number of bytes pkg_write_dict needs for the package */
+size_t pkg_size_dict(const pkg_t* pkg);
+/* Same as pkg_write except that new_service packages are written in the
+ * compact encoding using (and adding to) channel in dict. Only to be used
+ * once the other side has said it talks version 2.
+ * Returns the number of bytes written, 0 if the buffer is full */
+size_t pkg_write_dict(buf_t buf, const pkg_t* pkg, pkg_dict_t dict,
+                      unsigned int channel);
+
+/* If pkg_peek returns true, pkg now contains a full package. Nothing is
+ * copied or allocated, the strings in pkg point into buf.
+ * dict is needed to read compact new_service packages, if NULL they are
+ * skipped. As reading them adds to dict every pkg_peek returning true must
+ * be followed by pkg_read before peeking again.
  * If pkg_peek returns false, more data is needed to make a full package */
-bool pkg_peek(buf_t buf, pkg_t* pkg);
-/* If pkg_peek returned true, call pkg_read. Any pointers in pkg is now freed */
-void pkg_read(buf_t buf, pkg_t* pkg);
+bool pkg_peek(buf_t buf, pkg_dict_t dict, pkg_view_t* pkg);
+/* If pkg_peek returned true, call pkg_read to consume the package.
+ * The strings in pkg are no longer valid after this */
+void pkg_read(buf_t buf, const pkg_view_t* pkg);
+
+/* Sent by the connecting daemon as the first bytes of every tunnel
+ * connection, so that the daemon listening on the shared tunnel port knows
+ * which tunnel the connection belongs to. Only between daemons talking
+ * version 2 or later, older daemons send the tunnel data right away */
+typedef struct
+{
+    /* server_port of the connecting daemon, tells servers on the same
+     * host apart */
+    uint16_t server_port;
+    uint32_t tunnel_id;
+    bool local; /* true if the connecting daemon is the same that did the
+                 * create_tunnel. false otherwise. */
+} pkg_tunnel_token_t;
+
+#define PKG_TUNNEL_TOKEN_SIZE (8)
+
+void pkg_tunnel_token_write(void* data, const pkg_tunnel_token_t* token);
+/* Returns false if data (PKG_TUNNEL_TOKEN_SIZE bytes) isn't a valid token */
+bool pkg_tunnel_token_read(const void* data, pkg_tunnel_token_t* token);
 
 #endif /* DAEMON_PROTO_H */
@@ -0,0 +1,1642 @@
+/*
+ * Copyright (C) 2011, Joel Klinghed.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the project nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE PROJECT AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE PROJECT OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "common.h"
+
+#include "gena.h"
+#include "map.h"
+#include "slotmap.h"
+#include "vector.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+/* Longest time a client subscription to events lasts without a renewal,
+ * also what the subscriptions at the services ask for */
+static const long GENA_TIMEOUT = 1800;
+/* Subscriptions at the services are renewed this many seconds before they
+ * time out, or halfway if they are shorter than twice this */
+static const long GENA_RENEW_BEFORE = 60;
+/* Events waiting to be sent to a subscriber, more are dropped which the
+ * client sees as a gap in SEQ */
+static const size_t GENA_QUEUE_MAX = 32;
+/* The path of the callback URL given to the services, followed by the ID
+ * of the subscription in hex */
+static const char GENA_CALLBACK_PREFIX[] = "/upnpproxy-event/";
+static const char GENA_SERVER[] = "UPnP/1.0 upnpproxy/" VERSION;
+
+static const char PROPERTYSET_START[] =
+    "<?xml version=\"1.0\"?>\r\n"
+    "<e:propertyset xmlns:e=\"urn:schemas-upnp-org:event-1-0\">";
+static const char PROPERTYSET_END[] = "</e:propertyset>\r\n";
+static const char PROPERTY_START[] = "<e:property>";
+static const char PROPERTY_END[] = "</e:property>";
+
+typedef struct _var_t
+{
+    char* name;
+    /* The XML of the variable, what was inside the property element */
+    char* xml;
+    size_t xmllen;
+} var_t;
+
+struct _gena_state_t
+{
+    var_t* var;
+    size_t vars, alloc;
+    bool updated;
+};
+
+static char* dup_range(const char* start, const char* end)
+{
+    char* ret = malloc(end - start + 1);
+    memcpy(ret, start, end - start);
+    ret[end - start] = '\0';
+    return ret;
+}
+
+/* Length of the header including the empty line, 0 if not all there */
+static size_t head_length(const char* data, size_t len)
+{
+    size_t i;
+    for (i = 0; i + 1 < len; ++i)
+    {
+        if (data[i] == '\n')
+        {
+            if (data[i + 1] == '\n')
+            {
+                return i + 2;
+            }
+            if (data[i + 1] == '\r' && i + 2 < len && data[i + 2] == '\n')
+            {
+                return i + 3;
+            }
+        }
+    }
+    return 0;
+}
+
+/* Get the next line before end, without the line break */
+static bool next_line(const char** pos, const char* end,
+                      const char** line, const char** lineend)
+{
+    const char* eol;
+    if (*pos >= end)
+    {
+        return false;
+    }
+    eol = memchr(*pos, '\n', end - *pos);
+    if (eol == NULL)
+    {
+        eol = end;
+    }
+    *line = *pos;
+    *lineend = eol;
+    *pos = eol < end ? eol + 1 : end;
+    if (*lineend > *line && (*lineend)[-1] == '\r')
+    {
+        --(*lineend);
+    }
+    return true;
+}
+
+/* If the line is the header name, returns true and its trimmed value */
+static bool header_value(const char* line, const char* lineend,
+                         const char* name, const char** value,
+                         const char** valueend)
+{
+    size_t namelen = strlen(name);
+    if ((size_t)(lineend - line) <= namelen || line[namelen] != ':' ||
+        strncasecmp(line, name, namelen) != 0)
+    {
+        return false;
+    }
+    line += namelen + 1;
+    while (line < lineend && (*line == ' ' || *line == '\t'))
+    {
+        ++line;
+    }
+    while (lineend > line && (lineend[-1] == ' ' || lineend[-1] == '\t'))
+    {
+        --lineend;
+    }
+    *value = line;
+    *valueend = lineend;
+    return true;
+}
+
+static bool parse_ulong(const char* start, const char* end,
+                        unsigned long max, unsigned long* value)
+{
+    unsigned long x = 0;
+    if (start == end)
+    {
+        return false;
+    }
+    for (; start < end; ++start)
+    {
+        if (*start < '0' || *start > '9' ||
+            x > (max - (*start - '0')) / 10)
+        {
+            return false;
+        }
+        x = x * 10 + (*start - '0');
+    }
+    *value = x;
+    return true;
+}
+
+/* "Second-1800" or "Second-infinite" */
+static long parse_timeout(const char* start, const char* end)
+{
+    unsigned long x;
+    if (end - start < 7 || strncasecmp(start, "Second-", 7) != 0)
+    {
+        return GENA_TIMEOUT_NONE;
+    }
+    start += 7;
+    if (end - start == 8 && strncasecmp(start, "infinite", 8) == 0)
+    {
+        return GENA_TIMEOUT_INFINITE;
+    }
+    if (!parse_ulong(start, end, 0x7fffffff, &x) || x == 0)
+    {
+        return GENA_TIMEOUT_NONE;
+    }
+    return x;
+}
+
+int gena_parse_request(const char* data, size_t len, gena_request_t* req)
+{
+    const char* pos, *end, *line, *lineend, *value, *valueend, *sp, *sp2;
+    size_t headlen = head_length(data, len);
+    unsigned long x;
+    if (headlen == 0)
+    {
+        return 0;
+    }
+    memset(req, 0, sizeof(gena_request_t));
+    req->timeout = GENA_TIMEOUT_NONE;
+    req->headlen = headlen;
+    pos = data;
+    end = data + headlen;
+    if (!next_line(&pos, end, &line, &lineend))
+    {
+        return -1;
+    }
+    sp = memchr(line, ' ', lineend - line);
+    sp2 = sp != NULL ? memchr(sp + 1, ' ', lineend - (sp + 1)) : NULL;
+    if (sp == NULL || sp2 == NULL || sp2 == sp + 1 ||
+        lineend - (sp2 + 1) < 5 || memcmp(sp2 + 1, "HTTP/", 5) != 0)
+    {
+        return -1;
+    }
+    if (sp - line == 9 && memcmp(line, "SUBSCRIBE", 9) == 0)
+    {
+        req->method = GENA_SUBSCRIBE;
+    }
+    else if (sp - line == 11 && memcmp(line, "UNSUBSCRIBE", 11) == 0)
+    {
+        req->method = GENA_UNSUBSCRIBE;
+    }
+    else if (sp - line == 6 && memcmp(line, "NOTIFY", 6) == 0)
+    {
+        req->method = GENA_NOTIFY;
+    }
+    else
+    {
+        req->method = GENA_OTHER;
+    }
+    req->uri = dup_range(sp + 1, sp2);
+    while (next_line(&pos, end, &line, &lineend))
+    {
+        if (header_value(line, lineend, "CALLBACK", &value, &valueend))
+        {
+            const char* url_end;
+            free(req->callback);
+            req->callback = NULL;
+            if (value < valueend && *value == '<' &&
+                (url_end = memchr(value, '>', valueend - value)) != NULL &&
+                url_end > value + 1)
+            {
+                req->callback = dup_range(value + 1, url_end);
+            }
+            else
+            {
+                gena_request_free(req);
+                return -1;
+            }
+        }
+        else if (header_value(line, lineend, "SID", &value, &valueend))
+        {
+            free(req->sid);
+            req->sid = dup_range(value, valueend);
+        }
+        else if (header_value(line, lineend, "NT", &value, &valueend))
+        {
+            free(req->nt);
+            req->nt = dup_range(value, valueend);
+        }
+        else if (header_value(line, lineend, "NTS", &value, &valueend))
+        {
+            free(req->nts);
+            req->nts = dup_range(value, valueend);
+        }
+        else if (header_value(line, lineend, "TIMEOUT", &value, &valueend))
+        {
+            req->timeout = parse_timeout(value, valueend);
+        }
+        else if (header_value(line, lineend, "SEQ", &value, &valueend))
+        {
+            if (!parse_ulong(value, valueend, 0xffffffff, &x))
+            {
+                gena_request_free(req);
+                return -1;
+            }
+            req->has_seq = true;
+            req->seq = x;
+        }
+        else if (header_value(line, lineend, "Content-Length", &value,
+                              &valueend))
+        {
+            if (!parse_ulong(value, valueend, 0x7fffffff, &x))
+            {
+                gena_request_free(req);
+                return -1;
+            }
+            req->content_length = x;
+        }
+    }
+    return 1;
+}
+
+void gena_request_free(gena_request_t* req)
+{
+    free(req->uri);
+    free(req->callback);
+    free(req->sid);
+    free(req->nt);
+    free(req->nts);
+    req->uri = req->callback = req->sid = req->nt = req->nts = NULL;
+}
+
+int gena_parse_response(const char* data, size_t len, gena_response_t* resp)
+{
+    const char* pos, *end, *line, *lineend, *value, *valueend;
+    size_t headlen = head_length(data, len);
+    unsigned long x;
+    if (headlen == 0)
+    {
+        return 0;
+    }
+    memset(resp, 0, sizeof(gena_response_t));
+    resp->timeout = GENA_TIMEOUT_NONE;
+    resp->headlen = headlen;
+    pos = data;
+    end = data + headlen;
+    /* HTTP/1.1 200 OK */
+    if (!next_line(&pos, end, &line, &lineend) || lineend - line < 12 ||
+        memcmp(line, "HTTP/", 5) != 0 ||
+        (value = memchr(line, ' ', lineend - line)) == NULL ||
+        lineend - value < 4 ||
+        !parse_ulong(value + 1, value + 4, 999, &x) ||
+        (value + 4 < lineend && value[4] != ' '))
+    {
+        return -1;
+    }
+    resp->status = x;
+    while (next_line(&pos, end, &line, &lineend))
+    {
+        if (header_value(line, lineend, "SID", &value, &valueend))
+        {
+            free(resp->sid);
+            resp->sid = dup_range(value, valueend);
+        }
+        else if (header_value(line, lineend, "TIMEOUT", &value, &valueend))
+        {
+            resp->timeout = parse_timeout(value, valueend);
+        }
+    }
+    return 1;
+}
+
+void gena_response_free(gena_response_t* resp)
+{
+    free(resp->sid);
+    resp->sid = NULL;
+}
+
+static void format_timeout(char* str, size_t size, long timeout)
+{
+    if (timeout == GENA_TIMEOUT_NONE)
+    {
+        str[0] = '\0';
+    }
+    else if (timeout == GENA_TIMEOUT_INFINITE)
+    {
+        snprintf(str, size, "TIMEOUT: Second-infinite\r\n");
+    }
+    else
+    {
+        snprintf(str, size, "TIMEOUT: Second-%ld\r\n", timeout);
+    }
+}
+
+static char* done(char* str, int ret, size_t* len)
+{
+    if (ret < 0)
+    {
+        *len = 0;
+        return NULL;
+    }
+    *len = ret;
+    return str;
+}
+
+char* gena_subscribe(const char* path, const char* host, const char* callback,
+                     const char* sid, long timeout, size_t* len)
+{
+    char tmp[64], *ret;
+    int x;
+    assert((callback != NULL) != (sid != NULL));
+    format_timeout(tmp, sizeof(tmp), timeout);
+    if (callback != NULL)
+    {
+        x = asprintf(&ret,
+                     "SUBSCRIBE %s HTTP/1.1\r\n"
+                     "HOST: %s\r\n"
+                     "CALLBACK: <%s>\r\n"
+                     "NT: upnp:event\r\n"
+                     "%s"
+                     "Content-Length: 0\r\n"
+                     "\r\n", path, host, callback, tmp);
+    }
+    else
+    {
+        x = asprintf(&ret,
+                     "SUBSCRIBE %s HTTP/1.1\r\n"
+                     "HOST: %s\r\n"
+                     "SID: %s\r\n"
+                     "%s"
+                     "Content-Length: 0\r\n"
+                     "\r\n", path, host, sid, tmp);
+    }
+    return done(ret, x, len);
+}
+
+char* gena_unsubscribe(const char* path, const char* host, const char* sid,
+                       size_t* len)
+{
+    char* ret;
+    int x = asprintf(&ret,
+                     "UNSUBSCRIBE %s HTTP/1.1\r\n"
+                     "HOST: %s\r\n"
+                     "SID: %s\r\n"
+                     "Content-Length: 0\r\n"
+                     "\r\n", path, host, sid);
+    return done(ret, x, len);
+}
+
+char* gena_notify(const char* path, const char* host, const char* sid,
+                  uint32_t seq, const char* body, size_t bodylen,
+                  size_t* len)
+{
+    char* ret, *tmp;
+    int x = asprintf(&ret,
+                     "NOTIFY %s HTTP/1.1\r\n"
+                     "HOST: %s\r\n"
+                     "CONTENT-TYPE: text/xml; charset=\"utf-8\"\r\n"
+                     "CONTENT-LENGTH: %lu\r\n"
+                     "NT: upnp:event\r\n"
+                     "NTS: upnp:propchange\r\n"
+                     "SID: %s\r\n"
+                     "SEQ: %lu\r\n"
+                     "Connection: close\r\n"
+                     "\r\n", path, host, (unsigned long)bodylen, sid,
+                     (unsigned long)seq);
+    if (x < 0)
+    {
+        *len = 0;
+        return NULL;
+    }
+    tmp = realloc(ret, x + bodylen + 1);
+    if (tmp == NULL)
+    {
+        free(ret);
+        *len = 0;
+        return NULL;
+    }
+    memcpy(tmp + x, body, bodylen);
+    tmp[x + bodylen] = '\0';
+    *len = x + bodylen;
+    return tmp;
+}
+
+char* gena_response(const char* status, const char* server, const char* sid,
+                    long timeout, size_t* len)
+{
+    char timeout_str[64], date[64], *ret;
+    time_t now = time(NULL);
+    struct tm tm;
+    int x;
+    if (gmtime_r(&now, &tm) == NULL ||
+        strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &tm) == 0)
+    {
+        date[0] = '\0';
+    }
+    if (sid != NULL)
+    {
+        format_timeout(timeout_str, sizeof(timeout_str), timeout);
+    }
+    else
+    {
+        timeout_str[0] = '\0';
+    }
+    x = asprintf(&ret,
+                 "HTTP/1.1 %s\r\n"
+                 "DATE: %s\r\n"
+                 "%s%s%s"
+                 "%s%s%s"
+                 "%s"
+                 "Content-Length: 0\r\n"
+                 "Connection: close\r\n"
+                 "\r\n", status, date,
+                 server != NULL ? "SERVER: " : "",
+                 server != NULL ? server : "", server != NULL ? "\r\n" : "",
+                 sid != NULL ? "SID: " : "", sid != NULL ? sid : "",
+                 sid != NULL ? "\r\n" : "",
+                 timeout_str);
+    return done(ret, x, len);
+}
+
+uint32_t gena_next_seq(uint32_t seq)
+{
+    return seq == 0xffffffff ? 1 : seq + 1;
+}
+
+gena_state_t gena_state_new(void)
+{
+    return calloc(1, sizeof(struct _gena_state_t));
+}
+
+void gena_state_free(gena_state_t state)
+{
+    size_t i;
+    if (state == NULL)
+    {
+        return;
+    }
+    for (i = 0; i < state->vars; ++i)
+    {
+        free(state->var[i].name);
+        free(state->var[i].xml);
+    }
+    free(state->var);
+    free(state);
+}
+
+static const char* skip_space(const char* pos, const char* end)
+{
+    while (pos < end &&
+           (*pos == ' ' || *pos == '\t' || *pos == '\r' || *pos == '\n'))
+    {
+        ++pos;
+    }
+    return pos;
+}
+
+static const char* find(const char* pos, const char* end, const char* str)
+{
+    size_t len = strlen(str);
+    while (pos + len <= end)
+    {
+        const char* x = memchr(pos, str[0], end - pos);
+        if (x == NULL || x + len > end)
+        {
+            return NULL;
+        }
+        if (memcmp(x, str, len) == 0)
+        {
+            return x;
+        }
+        pos = x + 1;
+    }
+    return NULL;
+}
+
+/* Skip whitespace, comments and processing instructions */
+static const char* skip_misc(const char* pos, const char* end)
+{
+    for (;;)
+    {
+        pos = skip_space(pos, end);
+        if (end - pos >= 4 && memcmp(pos, "<!--", 4) == 0)
+        {
+            pos = find(pos + 4, end, "-->");
+            if (pos == NULL)
+            {
+                return NULL;
+            }
+            pos += 3;
+        }
+        else if (end - pos >= 2 && memcmp(pos, "<?", 2) == 0)
+        {
+            pos = find(pos + 2, end, "?>");
+            if (pos == NULL)
+            {
+                return NULL;
+            }
+            pos += 2;
+        }
+        else
+        {
+            return pos;
+        }
+    }
+}
+
+static bool is_name_end(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '>' ||
+        c == '/';
+}
+
+/* pos points at a '<', returns the end of the qualified name of the
+ * element and sets local to the start of its name without prefix */
+static const char* element_name(const char* pos, const char* end,
+                                const char** local)
+{
+    const char* start = pos + 1;
+    *local = start;
+    for (pos = start; pos < end && !is_name_end(*pos); ++pos)
+    {
+        if (*pos == ':')
+        {
+            *local = pos + 1;
+        }
+    }
+    return pos < end && pos > start ? pos : NULL;
+}
+
+static bool local_is(const char* local, const char* name_end,
+                     const char* name)
+{
+    size_t len = strlen(name);
+    return (size_t)(name_end - local) == len && memcmp(local, name, len) == 0;
+}
+
+static void state_put(gena_state_t state, const char* name,
+                      const char* name_end, const char* xml,
+                      const char* xml_end)
+{
+    size_t i, namelen = name_end - name;
+    var_t* var = NULL;
+    for (i = 0; i < state->vars; ++i)
+    {
+        if (strlen(state->var[i].name) == namelen &&
+            memcmp(state->var[i].name, name, namelen) == 0)
+        {
+            var = state->var + i;
+            free(var->xml);
+            break;
+        }
+    }
+    if (var == NULL)
+    {
+        if (state->vars == state->alloc)
+        {
+            size_t na = state->alloc * 2 + 8;
+            var_t* tmp = realloc(state->var, na * sizeof(var_t));
+            if (tmp == NULL)
+            {
+                return;
+            }
+            state->var = tmp;
+            state->alloc = na;
+        }
+        var = state->var + state->vars++;
+        var->name = dup_range(name, name_end);
+    }
+    var->xml = dup_range(xml, xml_end);
+    var->xmllen = xml_end - xml;
+}
+
+/* The properties of a propertyset, calls state_put for each variable if
+ * state isn't NULL. Returns false if body isn't a propertyset */
+static bool parse_propertyset(gena_state_t state, const char* pos,
+                              const char* end)
+{
+    const char* name_end, *local;
+    pos = skip_misc(pos, end);
+    if (pos == NULL || pos >= end || *pos != '<' ||
+        (name_end = element_name(pos, end, &local)) == NULL ||
+        !local_is(local, name_end, "propertyset"))
+    {
+        return false;
+    }
+    pos = memchr(name_end, '>', end - name_end);
+    if (pos == NULL || pos[-1] == '/')
+    {
+        return false;
+    }
+    ++pos;
+    for (;;)
+    {
+        const char* qname, *close, *inner, *var, *var_end;
+        char* tmp;
+        size_t qlen;
+        pos = skip_misc(pos, end);
+        if (pos == NULL || pos >= end || *pos != '<')
+        {
+            return false;
+        }
+        if (pos + 1 < end && pos[1] == '/')
+        {
+            /* End of the propertyset */
+            return true;
+        }
+        qname = pos + 1;
+        name_end = element_name(pos, end, &local);
+        if (name_end == NULL || !local_is(local, name_end, "property"))
+        {
+            return false;
+        }
+        pos = memchr(name_end, '>', end - name_end);
+        if (pos == NULL)
+        {
+            return false;
+        }
+        if (pos[-1] == '/')
+        {
+            /* Empty property */
+            ++pos;
+            continue;
+        }
+        inner = ++pos;
+        qlen = name_end - qname;
+        tmp = malloc(qlen + 4);
+        tmp[0] = '<';
+        tmp[1] = '/';
+        memcpy(tmp + 2, qname, qlen);
+        tmp[qlen + 2] = '>';
+        tmp[qlen + 3] = '\0';
+        close = find(inner, end, tmp);
+        free(tmp);
+        if (close == NULL)
+        {
+            return false;
+        }
+        pos = close + qlen + 3;
+        var = skip_misc(inner, close);
+        if (var == NULL || var >= close || *var != '<' ||
+            (var_end = element_name(var, close, &local)) == NULL)
+        {
+            /* No variable in it, nothing to remember */
+            continue;
+        }
+        if (state != NULL)
+        {
+            const char* xml_end = close;
+            while (xml_end > var &&
+                   (xml_end[-1] == ' ' || xml_end[-1] == '\t' ||
+                    xml_end[-1] == '\r' || xml_end[-1] == '\n'))
+            {
+                --xml_end;
+            }
+            state_put(state, var + 1, var_end, var, xml_end);
+        }
+    }
+}
+
+bool gena_state_update(gena_state_t state, const char* body, size_t len)
+{
+    /* Check it all first so that state isn't half updated */
+    if (!parse_propertyset(NULL, body, body + len))
+    {
+        return false;
+    }
+    parse_propertyset(state, body, body + len);
+    state->updated = true;
+    return true;
+}
+
+bool gena_state_empty(gena_state_t state)
+{
+    return !state->updated;
+}
+
+char* gena_state_body(gena_state_t state, size_t* len)
+{
+    size_t i, size = sizeof(PROPERTYSET_START) - 1 +
+        sizeof(PROPERTYSET_END) - 1;
+    char* ret, *pos;
+    for (i = 0; i < state->vars; ++i)
+    {
+        size += sizeof(PROPERTY_START) - 1 + state->var[i].xmllen +
+            sizeof(PROPERTY_END) - 1;
+    }
+    ret = malloc(size + 1);
+    if (ret == NULL)
+    {
+        *len = 0;
+        return NULL;
+    }
+    pos = ret;
+    memcpy(pos, PROPERTYSET_START, sizeof(PROPERTYSET_START) - 1);
+    pos += sizeof(PROPERTYSET_START) - 1;
+    for (i = 0; i < state->vars; ++i)
+    {
+        memcpy(pos, PROPERTY_START, sizeof(PROPERTY_START) - 1);
+        pos += sizeof(PROPERTY_START) - 1;
+        memcpy(pos, state->var[i].xml, state->var[i].xmllen);
+        pos += state->var[i].xmllen;
+        memcpy(pos, PROPERTY_END, sizeof(PROPERTY_END) - 1);
+        pos += sizeof(PROPERTY_END) - 1;
+    }
+    memcpy(pos, PROPERTYSET_END, sizeof(PROPERTYSET_END) - 1);
+    pos += sizeof(PROPERTYSET_END) - 1;
+    *pos = '\0';
+    *len = size;
+    return ret;
+}
+
+char* gena_status(const char* status, size_t* len)
+{
+    return gena_response(status, GENA_SERVER, NULL, GENA_TIMEOUT_NONE, len);
+}
+
+/* Subscriptions */
+
+/* The subscribers of an event URL of a remote service, in gena->watches
+ * which hands out the IDs */
+typedef struct _gena_watch_t
+{
+    uint32_t id;
+    gena_t gena;
+    void* link;
+    void* service;
+    /* Path of the event URL without any route, as sent in subscribe */
+    char* path;
+    /* gena_subscriber_t* */
+    vector_t subscribers;
+    /* The variables as the events so far left them */
+    gena_state_t state;
+    /* The parts received so far of the next event */
+    char* event;
+    size_t eventlen;
+} gena_watch_t;
+
+/* A message waiting to be sent to a subscriber */
+typedef struct _gena_msg_t
+{
+    char* data;
+    size_t len;
+} gena_msg_t;
+
+/* A client subscription, in gena->subscribers by SID */
+typedef struct _gena_subscriber_t
+{
+    char* sid;
+    gena_t gena;
+    gena_watch_t* watch;
+    /* Where the CALLBACK of the client points */
+    struct sockaddr* addr;
+    socklen_t addrlen;
+    char* host, *path;
+    /* SEQ of the next event, the first (0) has all the variables */
+    uint32_t seq;
+    timecb_t expirecb;
+    /* gena_msg_t, sent one at a time in order */
+    vector_t queue;
+    void* exchange;
+} gena_subscriber_t;
+
+typedef struct _gena_watcher_t
+{
+    void* link;
+    uint32_t watch_id;
+} gena_watcher_t;
+
+/* A subscription at a local service, in gena->upstreams which hands out
+ * the IDs used in the callback URL, see GENA_CALLBACK_PREFIX */
+typedef struct _gena_upstream_t
+{
+    uint32_t id;
+    gena_t gena;
+    struct sockaddr* addr;
+    socklen_t addrlen;
+    char* host, *path;
+    /* NULL until the service has accepted the subscription */
+    char* sid;
+    timecb_t renewcb;
+    void* exchange;
+    gena_state_t state;
+    /* gena_watcher_t */
+    vector_t watchers;
+} gena_upstream_t;
+
+struct _gena_t
+{
+    log_t log;
+    timers_t timers;
+    char* sid_prefix;
+    unsigned long sids;
+    gena_ops_t ops;
+    void* userdata;
+    /* gena_watch_t */
+    slotmap_t watches;
+    /* gena_subscriber_t */
+    map_t subscribers;
+    /* gena_upstream_t */
+    slotmap_t upstreams;
+};
+
+static uint32_t gena_subscriber_hash(const void* _sub)
+{
+    /* FNV-1a */
+    const char* sid = ((const gena_subscriber_t*)_sub)->sid;
+    uint32_t hash = 2166136261u;
+    for (; *sid != '\0'; ++sid)
+    {
+        hash ^= (uint8_t)*sid;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static bool gena_subscriber_eq(const void* _s1, const void* _s2)
+{
+    return strcmp(((const gena_subscriber_t*)_s1)->sid,
+                  ((const gena_subscriber_t*)_s2)->sid) == 0;
+}
+
+/* The client side, at the daemon that announces the remote service */
+
+static void gena_drop_watch(gena_watch_t* watch, bool tell)
+{
+    gena_t gena = watch->gena;
+    if (tell)
+    {
+        gena->ops.unsubscribe(gena->userdata, watch->link, watch->id, true);
+    }
+    slotmap_remove(gena->watches, watch->id);
+}
+
+static void gena_watch_free(void* _watch)
+{
+    gena_watch_t* watch = _watch;
+    while (vector_size(watch->subscribers) > 0)
+    {
+        gena_subscriber_t* sub =
+            *((gena_subscriber_t**)vector_get(watch->subscribers, 0));
+        vector_remove(watch->subscribers, 0);
+        sub->watch = NULL;
+        map_remove(watch->gena->subscribers, sub);
+    }
+    vector_free(watch->subscribers);
+    gena_state_free(watch->state);
+    free(watch->path);
+    free(watch->event);
+}
+
+static void gena_subscriber_free(void* _sub)
+{
+    gena_subscriber_t* sub = _sub;
+    gena_t gena = sub->gena;
+    size_t i;
+    if (sub->expirecb != NULL)
+    {
+        timecb_cancel(sub->expirecb);
+    }
+    if (sub->exchange != NULL)
+    {
+        gena->ops.cancel(gena->userdata, sub->exchange);
+    }
+    for (i = 0; i < vector_size(sub->queue); ++i)
+    {
+        free(((gena_msg_t*)vector_get(sub->queue, i))->data);
+    }
+    vector_free(sub->queue);
+    if (sub->watch != NULL)
+    {
+        gena_watch_t* watch = sub->watch;
+        for (i = 0; i < vector_size(watch->subscribers); ++i)
+        {
+            if (*((gena_subscriber_t**)vector_get(watch->subscribers, i))
+                == sub)
+            {
+                vector_remove(watch->subscribers, i);
+                break;
+            }
+        }
+        if (vector_size(watch->subscribers) == 0)
+        {
+            /* The server can stop sending the events */
+            gena_drop_watch(watch, true);
+        }
+    }
+    free(sub->sid);
+    free(sub->addr);
+    free(sub->host);
+    free(sub->path);
+}
+
+static long gena_subscriber_expire(void* userdata)
+{
+    gena_subscriber_t* sub = userdata;
+    sub->expirecb = NULL;
+    map_remove(sub->gena->subscribers, sub);
+    return -1;
+}
+
+static void gena_deliver(gena_subscriber_t* sub);
+
+static void gena_notify_done(void* userdata, const gena_response_t* resp)
+{
+    gena_subscriber_t* sub = userdata;
+    /* A lost event shows as a gap in SEQ, the client decides what to do */
+    sub->exchange = NULL;
+    gena_deliver(sub);
+}
+
+/* Send the next queued event unless one is on its way */
+static void gena_deliver(gena_subscriber_t* sub)
+{
+    gena_t gena = sub->gena;
+    while (sub->exchange == NULL && vector_size(sub->queue) > 0)
+    {
+        gena_msg_t msg = *((gena_msg_t*)vector_get(sub->queue, 0));
+        vector_remove(sub->queue, 0);
+        sub->exchange = gena->ops.connect(gena->userdata, sub->addr,
+                                          sub->addrlen);
+        if (sub->exchange == NULL)
+        {
+            free(msg.data);
+            continue;
+        }
+        gena->ops.send(gena->userdata, sub->exchange, msg.data, msg.len,
+                       gena_notify_done, sub);
+    }
+}
+
+static void gena_queue(gena_subscriber_t* sub, const char* body, size_t len)
+{
+    gena_msg_t msg;
+    uint32_t seq = sub->seq;
+    sub->seq = gena_next_seq(seq);
+    if (vector_size(sub->queue) >= GENA_QUEUE_MAX)
+    {
+        return;
+    }
+    msg.data = gena_notify(sub->path, sub->host, sub->sid, seq, body, len,
+                           &msg.len);
+    if (msg.data == NULL)
+    {
+        return;
+    }
+    vector_push(sub->queue, &msg);
+    gena_deliver(sub);
+}
+
+/* Queue all the variables of the watch for sub, its first event */
+static void gena_queue_state(gena_subscriber_t* sub)
+{
+    size_t len;
+    char* body = gena_state_body(sub->watch->state, &len);
+    if (body != NULL)
+    {
+        gena_queue(sub, body, len);
+        free(body);
+    }
+}
+
+bool gena_link_event(gena_t gena, void* link, uint32_t watch_id,
+                     const char* data, size_t len, bool last)
+{
+    gena_watch_t* watch = slotmap_get(gena->watches, watch_id);
+    size_t i;
+    if (watch == NULL || watch->link != link)
+    {
+        /* Unsubscribed, the server has yet to see it */
+        return true;
+    }
+    if (watch->eventlen + len > GENA_BODY_MAX)
+    {
+        gena_drop_watch(watch, true);
+        return false;
+    }
+    if (len > 0)
+    {
+        watch->event = realloc(watch->event, watch->eventlen + len);
+        memcpy(watch->event + watch->eventlen, data, len);
+        watch->eventlen += len;
+    }
+    if (!last || watch->eventlen == 0)
+    {
+        return true;
+    }
+    gena_state_update(watch->state, watch->event, watch->eventlen);
+    for (i = 0; i < vector_size(watch->subscribers); ++i)
+    {
+        gena_subscriber_t* sub =
+            *((gena_subscriber_t**)vector_get(watch->subscribers, i));
+        if (sub->seq == 0 && !gena_state_empty(watch->state))
+        {
+            /* Subscribed after the server sent the variables */
+            gena_queue_state(sub);
+        }
+        else
+        {
+            gena_queue(sub, watch->event, watch->eventlen);
+        }
+    }
+    free(watch->event);
+    watch->event = NULL;
+    watch->eventlen = 0;
+    return true;
+}
+
+/* Find the watch for path at service or subscribe to it */
+static gena_watch_t* gena_watch(gena_t gena, void* link, void* service,
+                                uint32_t service_id, const char* path)
+{
+    gena_watch_t watch, *watchptr;
+    size_t i;
+    for (i = slotmap_begin(gena->watches); i != slotmap_end(gena->watches);
+         i = slotmap_next(gena->watches, i))
+    {
+        watchptr = slotmap_getat(gena->watches, i);
+        if (watchptr->service == service && strcmp(watchptr->path, path) == 0)
+        {
+            return watchptr;
+        }
+    }
+    memset(&watch, 0, sizeof(gena_watch_t));
+    watch.gena = gena;
+    watch.link = link;
+    watch.service = service;
+    watch.path = strdup(path);
+    watch.subscribers = vector_new(sizeof(gena_subscriber_t*));
+    watch.state = gena_state_new();
+    watchptr = slotmap_put(gena->watches, &watch, &watch.id);
+    watchptr->id = watch.id;
+    gena->ops.subscribe(gena->userdata, link, service_id, watch.id, path);
+    return watchptr;
+}
+
+static gena_subscriber_t* gena_subscriber(gena_t gena, void* link,
+                                          void* service, uint32_t service_id,
+                                          const char* evpath,
+                                          const gena_request_t* req,
+                                          long timeout)
+{
+    gena_subscriber_t sub, *subptr;
+    char* proto = NULL, *path = NULL;
+    memset(&sub, 0, sizeof(gena_subscriber_t));
+    if (evpath == NULL ||
+        !parse_location(req->callback, &proto, &(sub.addr), &(sub.addrlen),
+                        &path) || strcasecmp(proto, "http") != 0)
+    {
+        free(proto);
+        free(path);
+        free(sub.addr);
+        return NULL;
+    }
+    free(proto);
+    if (asprintf(&(sub.path), "/%s", path) == -1)
+    {
+        sub.path = NULL;
+    }
+    free(path);
+    if (sub.path == NULL ||
+        asprintf(&(sub.sid), "%s-%lx-%lx", gena->sid_prefix,
+                 (unsigned long)time(NULL), ++gena->sids) == -1)
+    {
+        free(sub.addr);
+        free(sub.path);
+        return NULL;
+    }
+    asprinthost(&(sub.host), sub.addr, sub.addrlen);
+    sub.gena = gena;
+    sub.watch = gena_watch(gena, link, service, service_id, evpath);
+    sub.queue = vector_new(sizeof(gena_msg_t));
+    subptr = map_put(gena->subscribers, &sub);
+    subptr->expirecb = timers_add(gena->timers, timeout * 1000, subptr,
+                                  gena_subscriber_expire);
+    vector_push(subptr->watch->subscribers, &subptr);
+    return subptr;
+}
+
+char* gena_client_request(gena_t gena, void* link, void* service,
+                          uint32_t service_id, const char* path,
+                          const gena_request_t* req, size_t* len)
+{
+    gena_subscriber_t key, *sub;
+    char* ret;
+    long timeout;
+    if (req->sid != NULL)
+    {
+        if (req->callback != NULL || req->nt != NULL)
+        {
+            return gena_status("400 Bad Request", len);
+        }
+        key.sid = req->sid;
+        sub = map_get(gena->subscribers, &key);
+        if (sub == NULL || sub->watch == NULL ||
+            sub->watch->service != service)
+        {
+            return gena_status("412 Precondition Failed", len);
+        }
+    }
+    else
+    {
+        sub = NULL;
+    }
+    if (req->method == GENA_UNSUBSCRIBE)
+    {
+        if (sub == NULL)
+        {
+            return gena_status("412 Precondition Failed", len);
+        }
+        map_remove(gena->subscribers, sub);
+        return gena_status("200 OK", len);
+    }
+    if (req->method != GENA_SUBSCRIBE)
+    {
+        return gena_status("405 Method Not Allowed", len);
+    }
+    timeout = req->timeout > 0 && req->timeout <= GENA_TIMEOUT
+        ? req->timeout : GENA_TIMEOUT;
+    if (sub != NULL)
+    {
+        timecb_cancel(sub->expirecb);
+        sub->expirecb = timers_add(gena->timers, timeout * 1000, sub,
+                                   gena_subscriber_expire);
+        return gena_response("200 OK", GENA_SERVER, sub->sid, timeout, len);
+    }
+    if (req->callback == NULL || req->nt == NULL ||
+        strcmp(req->nt, "upnp:event") != 0)
+    {
+        return gena_status("412 Precondition Failed", len);
+    }
+    sub = gena_subscriber(gena, link, service, service_id, path, req,
+                          timeout);
+    if (sub == NULL)
+    {
+        return gena_status("412 Precondition Failed", len);
+    }
+    ret = gena_response("200 OK", GENA_SERVER, sub->sid, timeout, len);
+    if (!gena_state_empty(sub->watch->state))
+    {
+        /* Others are already subscribed. The event goes out once the
+         * connection to the callback is up, after the response */
+        gena_queue_state(sub);
+    }
+    return ret;
+}
+
+void gena_drop_service(gena_t gena, void* service)
+{
+    size_t i;
+    for (i = slotmap_begin(gena->watches); i != slotmap_end(gena->watches);
+         i = slotmap_next(gena->watches, i))
+    {
+        gena_watch_t* watch = slotmap_getat(gena->watches, i);
+        if (watch->service == service)
+        {
+            gena_drop_watch(watch, true);
+        }
+    }
+}
+
+/* The service side, at the daemon that has the local service */
+
+static void gena_upstream_free(void* _upstream)
+{
+    gena_upstream_t* upstream = _upstream;
+    gena_t gena = upstream->gena;
+    if (upstream->renewcb != NULL)
+    {
+        timecb_cancel(upstream->renewcb);
+    }
+    if (upstream->exchange != NULL)
+    {
+        gena->ops.cancel(gena->userdata, upstream->exchange);
+    }
+    free(upstream->addr);
+    free(upstream->host);
+    free(upstream->path);
+    free(upstream->sid);
+    gena_state_free(upstream->state);
+    vector_free(upstream->watchers);
+}
+
+/* Drop the subscription at the service, the watchers are told if tell */
+static void gena_drop_upstream(gena_upstream_t* upstream, bool tell)
+{
+    gena_t gena = upstream->gena;
+    if (tell)
+    {
+        size_t i;
+        for (i = 0; i < vector_size(upstream->watchers); ++i)
+        {
+            gena_watcher_t* watcher = vector_get(upstream->watchers, i);
+            gena->ops.unsubscribe(gena->userdata, watcher->link,
+                                  watcher->watch_id, false);
+        }
+    }
+    if (upstream->sid != NULL)
+    {
+        /* No one waits for the answer, the subscription times out if the
+         * service never gets it */
+        void* ex = gena->ops.connect(gena->userdata, upstream->addr,
+                                     upstream->addrlen);
+        if (ex != NULL)
+        {
+            size_t len;
+            char* msg = gena_unsubscribe(upstream->path, upstream->host,
+                                         upstream->sid, &len);
+            if (msg != NULL)
+            {
+                gena->ops.send(gena->userdata, ex, msg, len, NULL, NULL);
+            }
+            else
+            {
+                gena->ops.cancel(gena->userdata, ex);
+            }
+        }
+    }
+    slotmap_remove(gena->upstreams, upstream->id);
+}
+
+static bool gena_upstream_subscribe(gena_upstream_t* upstream);
+
+static long gena_upstream_renew(void* userdata)
+{
+    gena_upstream_t* upstream = userdata;
+    upstream->renewcb = NULL;
+    if (upstream->exchange == NULL && !gena_upstream_subscribe(upstream))
+    {
+        gena_drop_upstream(upstream, true);
+    }
+    return -1;
+}
+
+static void gena_upstream_done(void* userdata, const gena_response_t* resp)
+{
+    gena_upstream_t* upstream = userdata;
+    gena_t gena = upstream->gena;
+    long timeout, delay;
+    upstream->exchange = NULL;
+    if (resp == NULL || resp->status != 200 ||
+        (upstream->sid == NULL && resp->sid == NULL))
+    {
+        if (upstream->sid != NULL)
+        {
+            /* The subscription expired or the service restarted */
+            free(upstream->sid);
+            upstream->sid = NULL;
+            if (gena_upstream_subscribe(upstream))
+            {
+                return;
+            }
+        }
+        log_printf(gena->log, LVL_WARN,
+                   "Unable to subscribe to events at %s%s",
+                   upstream->host, upstream->path);
+        gena_drop_upstream(upstream, true);
+        return;
+    }
+    if (resp->sid != NULL &&
+        (upstream->sid == NULL || strcmp(upstream->sid, resp->sid) != 0))
+    {
+        free(upstream->sid);
+        upstream->sid = strdup(resp->sid);
+    }
+    timeout = resp->timeout > 0 ? resp->timeout : GENA_TIMEOUT;
+    delay = timeout > 2 * GENA_RENEW_BEFORE
+        ? timeout - GENA_RENEW_BEFORE : timeout / 2;
+    if (upstream->renewcb != NULL)
+    {
+        timecb_cancel(upstream->renewcb);
+    }
+    upstream->renewcb = timers_add(gena->timers,
+                                   (delay > 0 ? delay : 1) * 1000, upstream,
+                                   gena_upstream_renew);
+}
+
+/* Subscribe at the service, or renew if there is a SID. Returns false if
+ * the request couldn't be sent */
+static bool gena_upstream_subscribe(gena_upstream_t* upstream)
+{
+    gena_t gena = upstream->gena;
+    void* ex;
+    char* msg = NULL;
+    size_t len;
+    assert(upstream->exchange == NULL);
+    ex = gena->ops.connect(gena->userdata, upstream->addr,
+                           upstream->addrlen);
+    if (ex == NULL)
+    {
+        return false;
+    }
+    if (upstream->sid != NULL)
+    {
+        msg = gena_subscribe(upstream->path, upstream->host, NULL,
+                             upstream->sid, GENA_TIMEOUT, &len);
+    }
+    else
+    {
+        /* The service sends the events to the address it was reached
+         * from */
+        char* path, *callback = NULL;
+        if (asprintf(&path, "%s%lx", GENA_CALLBACK_PREFIX,
+                     (unsigned long)upstream->id) != -1)
+        {
+            callback = gena->ops.callback(gena->userdata, ex, path);
+            free(path);
+        }
+        if (callback != NULL)
+        {
+            msg = gena_subscribe(upstream->path, upstream->host, callback,
+                                 NULL, GENA_TIMEOUT, &len);
+            free(callback);
+        }
+    }
+    if (msg == NULL)
+    {
+        gena->ops.cancel(gena->userdata, ex);
+        return false;
+    }
+    upstream->exchange = ex;
+    gena->ops.send(gena->userdata, ex, msg, len, gena_upstream_done,
+                   upstream);
+    return true;
+}
+
+void gena_link_subscribe(gena_t gena, void* link, uint32_t watch_id,
+                         const struct sockaddr* addr, socklen_t addrlen,
+                         const char* path)
+{
+    gena_upstream_t* upstream = NULL;
+    gena_watcher_t watcher;
+    size_t i;
+    if (addr != NULL && path[0] == '/')
+    {
+        for (i = slotmap_begin(gena->upstreams);
+             i != slotmap_end(gena->upstreams);
+             i = slotmap_next(gena->upstreams, i))
+        {
+            gena_upstream_t* u = slotmap_getat(gena->upstreams, i);
+            if (socket_samehostandport(u->addr, u->addrlen, addr, addrlen) &&
+                strcmp(u->path, path) == 0)
+            {
+                upstream = u;
+                break;
+            }
+        }
+        if (upstream == NULL)
+        {
+            gena_upstream_t tmp;
+            memset(&tmp, 0, sizeof(gena_upstream_t));
+            tmp.gena = gena;
+            tmp.addr = malloc(addrlen);
+            memcpy(tmp.addr, addr, addrlen);
+            tmp.addrlen = addrlen;
+            asprinthost(&(tmp.host), addr, addrlen);
+            tmp.path = strdup(path);
+            tmp.state = gena_state_new();
+            tmp.watchers = vector_new(sizeof(gena_watcher_t));
+            upstream = slotmap_put(gena->upstreams, &tmp, &tmp.id);
+            upstream->id = tmp.id;
+            if (!gena_upstream_subscribe(upstream))
+            {
+                slotmap_remove(gena->upstreams, upstream->id);
+                upstream = NULL;
+            }
+        }
+    }
+    if (upstream == NULL)
+    {
+        gena->ops.unsubscribe(gena->userdata, link, watch_id, false);
+        return;
+    }
+    for (i = 0; i < vector_size(upstream->watchers); ++i)
+    {
+        gena_watcher_t* w = vector_get(upstream->watchers, i);
+        if (w->link == link && w->watch_id == watch_id)
+        {
+            return;
+        }
+    }
+    watcher.link = link;
+    watcher.watch_id = watch_id;
+    vector_push(upstream->watchers, &watcher);
+    if (!gena_state_empty(upstream->state))
+    {
+        /* The first event of a watch has all the variables */
+        size_t len;
+        char* body = gena_state_body(upstream->state, &len);
+        if (body != NULL)
+        {
+            gena->ops.event(gena->userdata, link, watch_id, body, len);
+            free(body);
+        }
+    }
+}
+
+void gena_link_unsubscribe(gena_t gena, void* link, uint32_t watch_id,
+                           bool local)
+{
+    size_t i, j;
+    if (!local)
+    {
+        /* The server dropped the subscription, the clients find out when
+         * they renew theirs */
+        gena_watch_t* watch = slotmap_get(gena->watches, watch_id);
+        if (watch != NULL && watch->link == link)
+        {
+            gena_drop_watch(watch, false);
+        }
+        return;
+    }
+    for (i = slotmap_begin(gena->upstreams);
+         i != slotmap_end(gena->upstreams);
+         i = slotmap_next(gena->upstreams, i))
+    {
+        gena_upstream_t* upstream = slotmap_getat(gena->upstreams, i);
+        for (j = 0; j < vector_size(upstream->watchers); ++j)
+        {
+            gena_watcher_t* w = vector_get(upstream->watchers, j);
+            if (w->link == link && w->watch_id == watch_id)
+            {
+                vector_remove(upstream->watchers, j);
+                if (vector_size(upstream->watchers) == 0)
+                {
+                    gena_drop_upstream(upstream, false);
+                }
+                return;
+            }
+        }
+    }
+}
+
+void gena_drop_link(gena_t gena, void* link, bool tell)
+{
+    size_t i, j;
+    for (i = slotmap_begin(gena->watches); i != slotmap_end(gena->watches);
+         i = slotmap_next(gena->watches, i))
+    {
+        gena_watch_t* watch = slotmap_getat(gena->watches, i);
+        if (watch->link == link)
+        {
+            gena_drop_watch(watch, tell);
+        }
+    }
+    for (i = slotmap_begin(gena->upstreams);
+         i != slotmap_end(gena->upstreams);
+         i = slotmap_next(gena->upstreams, i))
+    {
+        gena_upstream_t* upstream = slotmap_getat(gena->upstreams, i);
+        j = 0;
+        while (j < vector_size(upstream->watchers))
+        {
+            gena_watcher_t* w = vector_get(upstream->watchers, j);
+            if (w->link == link)
+            {
+                if (tell)
+                {
+                    gena->ops.unsubscribe(gena->userdata, link, w->watch_id,
+                                          false);
+                }
+                vector_remove(upstream->watchers, j);
+            }
+            else
+            {
+                ++j;
+            }
+        }
+        if (vector_size(upstream->watchers) == 0)
+        {
+            gena_drop_upstream(upstream, false);
+        }
+    }
+}
+
+const char* gena_service_notify(gena_t gena, const gena_request_t* req,
+                                const char* body, size_t len)
+{
+    const size_t prefixlen = sizeof(GENA_CALLBACK_PREFIX) - 1;
+    gena_upstream_t* upstream;
+    unsigned long x;
+    char* end;
+    size_t i;
+    if (strncmp(req->uri, GENA_CALLBACK_PREFIX, prefixlen) != 0)
+    {
+        return "404 Not Found";
+    }
+    errno = 0;
+    x = strtoul(req->uri + prefixlen, &end, 16);
+    if (errno || end == req->uri + prefixlen || *end != '\0' ||
+        x > 0xffffffff ||
+        (upstream = slotmap_get(gena->upstreams, x)) == NULL)
+    {
+        return "412 Precondition Failed";
+    }
+    if (req->nt == NULL || req->nts == NULL ||
+        strcmp(req->nt, "upnp:event") != 0 ||
+        strcmp(req->nts, "upnp:propchange") != 0 || len == 0)
+    {
+        return "400 Bad Request";
+    }
+    if (req->sid == NULL)
+    {
+        return "412 Precondition Failed";
+    }
+    if (upstream->sid == NULL)
+    {
+        /* The first event can beat the response to SUBSCRIBE */
+        upstream->sid = strdup(req->sid);
+    }
+    else if (strcmp(upstream->sid, req->sid) != 0)
+    {
+        return "412 Precondition Failed";
+    }
+    gena_state_update(upstream->state, body, len);
+    for (i = 0; i < vector_size(upstream->watchers); ++i)
+    {
+        gena_watcher_t* w = vector_get(upstream->watchers, i);
+        gena->ops.event(gena->userdata, w->link, w->watch_id, body, len);
+    }
+    return "200 OK";
+}
+
+gena_t gena_new(log_t log, timers_t timers, const char* sid_prefix,
+                const gena_ops_t* ops, void* userdata)
+{
+    gena_t gena = calloc(1, sizeof(struct _gena_t));
+    if (gena == NULL)
+    {
+        return NULL;
+    }
+    gena->log = log;
+    gena->timers = timers;
+    gena->sid_prefix = strdup(sid_prefix);
+    gena->ops = *ops;
+    gena->userdata = userdata;
+    gena->watches = slotmap_new(sizeof(gena_watch_t), gena_watch_free);
+    gena->subscribers = map_new(sizeof(gena_subscriber_t),
+                                gena_subscriber_hash, gena_subscriber_eq,
+                                gena_subscriber_free);
+    gena->upstreams = slotmap_new(sizeof(gena_upstream_t),
+                                  gena_upstream_free);
+    return gena;
+}
+
+void gena_free(gena_t gena)
+{
+    if (gena == NULL)
+    {
+        return;
+    }
+    /* The watches take their subscribers with them, without telling */
+    slotmap_free(gena->watches);
+    map_free(gena->subscribers);
+    slotmap_free(gena->upstreams);
+    free(gena->sid_prefix);
+    free(gena);
+}
+
+void gena_stats(gena_t gena, size_t* subscribers, size_t* upstreams)
+{
+    *subscribers = map_size(gena->subscribers);
+    *upstreams = slotmap_size(gena->upstreams);
+}
@@ -0,0 +1,203 @@
+/*
+ * Copyright (C) 2011, Joel Klinghed.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the project nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE PROJECT AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE PROJECT OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef GENA_H
+#define GENA_H
+
+#include "socket.h"
+#include "timers.h"
+#include "log.h"
+
+/* GENA, the eventing of UPnP: the messages SUBSCRIBE, UNSUBSCRIBE and
+ * NOTIFY with their responses, and the subscriptions the daemon relays
+ * them for (see gena_t). Nothing here touches a socket, the daemon runs
+ * the connections */
+
+typedef enum
+{
+    GENA_SUBSCRIBE,
+    GENA_UNSUBSCRIBE,
+    GENA_NOTIFY,
+    GENA_OTHER,
+} gena_method_t;
+
+/* TIMEOUT of a subscription is in seconds, or one of these */
+#define GENA_TIMEOUT_NONE (-1) /* No (valid) TIMEOUT header */
+#define GENA_TIMEOUT_INFINITE (0)
+
+typedef struct
+{
+    gena_method_t method;
+    char* uri;
+    /* The first URL in CALLBACK. The strings are NULL if the header is
+     * missing */
+    char* callback;
+    char* sid;
+    char* nt;
+    char* nts;
+    long timeout;
+    bool has_seq;
+    uint32_t seq;
+    /* Size of the header including the empty line that ends it */
+    size_t headlen;
+    /* 0 if there is no Content-Length */
+    size_t content_length;
+} gena_request_t;
+
+typedef struct
+{
+    unsigned int status;
+    char* sid;
+    long timeout;
+    size_t headlen;
+} gena_response_t;
+
+/* Returns 1 if data starts with a whole header, which is parsed into req.
+ * 0 if more data is needed and -1 if it isn't a valid request. req must be
+ * freed with gena_request_free if 1 was returned */
+int gena_parse_request(const char* data, size_t len, gena_request_t* req);
+void gena_request_free(gena_request_t* req);
+
+/* As gena_parse_request but for the response */
+int gena_parse_response(const char* data, size_t len, gena_response_t* resp);
+void gena_response_free(gena_response_t* resp);
+
+/* The messages are returned as a newly allocated string, and its length
+ * in len. host is "hostname[:port]" of the receiver */
+
+/* A new subscription if callback is given, else a renewal of sid */
+char* gena_subscribe(const char* path, const char* host, const char* callback,
+                     const char* sid, long timeout, size_t* len);
+char* gena_unsubscribe(const char* path, const char* host, const char* sid,
+                       size_t* len);
+char* gena_notify(const char* path, const char* host, const char* sid,
+                  uint32_t seq, const char* body, size_t bodylen,
+                  size_t* len);
+/* Response to any of the requests, status is "200 OK" say. sid and
+ * server may be NULL, timeout is only included with sid */
+char* gena_response(const char* status, const char* server, const char* sid,
+                    long timeout, size_t* len);
+
+/* The next SEQ of NOTIFY after seq, 0 is only used for the first */
+uint32_t gena_next_seq(uint32_t seq);
+
+/* The evented variables of a service, as the events of the service left
+ * them. What a new subscriber to a shared subscription gets as its first
+ * event, where the service would have sent all variables. */
+typedef struct _gena_state_t* gena_state_t;
+
+gena_state_t gena_state_new(void);
+void gena_state_free(gena_state_t state);
+
+/* Merge the variables of the event body, a propertyset, into state.
+ * Returns false, and leaves state as it was, if body isn't a propertyset */
+bool gena_state_update(gena_state_t state, const char* body, size_t len);
+/* true until the first successful gena_state_update */
+bool gena_state_empty(gena_state_t state);
+/* All the variables as an event body, newly allocated */
+char* gena_state_body(gena_state_t state, size_t* len);
+
+/* Response with only a status, "200 OK" say, from upnpproxy */
+char* gena_status(const char* status, size_t* len);
+
+/* Largest event body relayed */
+#define GENA_BODY_MAX (256 * 1024)
+
+/* The subscriptions of a daemon. Clients subscribe at the daemon that
+ * announces the service to them, which answers them itself. The
+ * subscribers of an event URL share a watch, with one subscription at the
+ * server of the service. The server has a single subscription, an
+ * upstream, at the service for the watches of all its servers. Each event
+ * crosses a link once per watch and is then sent to every subscriber of
+ * it. Links to the servers and remote services are the daemon's, they are
+ * only compared here */
+typedef struct _gena_t* gena_t;
+
+/* resp is NULL if the exchange failed */
+typedef void (* gena_done_t)(void* userdata, const gena_response_t* resp);
+
+typedef struct
+{
+    /* Send subscribe, unsubscribe and event packages over link */
+    void (* subscribe)(void* userdata, void* link, uint32_t service_id,
+                       uint32_t watch_id, const char* path);
+    void (* unsubscribe)(void* userdata, void* link, uint32_t watch_id,
+                         bool local);
+    void (* event)(void* userdata, void* link, uint32_t watch_id,
+                   const char* body, size_t len);
+    /* Start connecting to addr for a request, NULL on failure */
+    void* (* connect)(void* userdata, const struct sockaddr* addr,
+                      socklen_t addrlen);
+    /* The callback URL for events to path, at the address the connection
+     * is made from. NULL if events can't be received */
+    char* (* callback)(void* userdata, void* conn, const char* path);
+    /* Send msg on conn, both are freed when the exchange is done. done is
+     * called with the response unless it is cancelled before that */
+    void (* send)(void* userdata, void* conn, char* msg, size_t len,
+                  gena_done_t done, void* done_userdata);
+    /* Close conn, sent or not, without calling done */
+    void (* cancel)(void* userdata, void* conn);
+} gena_ops_t;
+
+/* sid_prefix starts the SIDs handed out to clients */
+gena_t gena_new(log_t log, timers_t timers, const char* sid_prefix,
+                const gena_ops_t* ops, void* userdata);
+void gena_free(gena_t gena);
+
+/* Answer SUBSCRIBE or UNSUBSCRIBE from a client of service, service_id at
+ * the server on link. path is the event URL without host and route, NULL
+ * if the URI isn't one. Returns the response */
+char* gena_client_request(gena_t gena, void* link, void* service,
+                          uint32_t service_id, const char* path,
+                          const gena_request_t* req, size_t* len);
+/* Part of an event for a watch, sent by the server on link. Returns false
+ * if the event is too large, the watch is dropped then */
+bool gena_link_event(gena_t gena, void* link, uint32_t watch_id,
+                     const char* data, size_t len, bool last);
+/* The server on link subscribes to path at the local service at addr,
+ * which is NULL if there is no such service */
+void gena_link_subscribe(gena_t gena, void* link, uint32_t watch_id,
+                         const struct sockaddr* addr, socklen_t addrlen,
+                         const char* path);
+/* The server on link drops a watch, its own if local, else ours */
+void gena_link_unsubscribe(gena_t gena, void* link, uint32_t watch_id,
+                           bool local);
+/* NOTIFY from a local service, returns the status to answer */
+const char* gena_service_notify(gena_t gena, const gena_request_t* req,
+                                const char* body, size_t len);
+
+/* Drop everything of link. The server is told if tell, else it is gone
+ * already */
+void gena_drop_link(gena_t gena, void* link, bool tell);
+/* Drop the watches of service, it is gone */
+void gena_drop_service(gena_t gena, void* service);
+
+void gena_stats(gena_t gena, size_t* subscribers, size_t* upstreams);
+
+#endif /* GENA_H */
@@ -59,6 +59,8 @@ struct _http_proxy_t
 {
     char* sourcehost;
     char* targethost;
+    /* See http_proxy_strip_segment, NULL if not set */
+    char* strip;
 
     buf_t input;
     buf_t output;
@@ -92,11 +94,32 @@ struct _http_proxy_t
     bool chunked;
     bool closed; /* true if the response will be terminated by
                   * connection close */
+    bool compressed; /* true if the body is already compressed, going by
+                      * Content-Type and Content-Encoding */
 };
 
 static const size_t DEFAULT_BUFFER_SIZE = 1024;
 static const size_t MAX_BUFFER_SIZE = 65535;
 
+/* Content types that are compressed already, those ending with '/' match
+ * the whole group */
+static const char* const compressed_types[] = {
+    "audio/",
+    "video/",
+    "image/",
+    "application/ogg",
+    "application/zip",
+    "application/gzip",
+    "application/x-gzip",
+    "application/x-bzip2",
+    "application/x-xz",
+    "application/zstd",
+    "application/x-7z-compressed",
+    "application/x-rar-compressed",
+    "application/vnd.rn-realmedia",
+    NULL
+};
+
 static bool proxy_flush(http_proxy_t proxy, bool force);
 
 http_proxy_t http_proxy_new(const char* sourcehost, const char* targethost,
@@ -145,6 +168,24 @@ bool http_proxy_flush(http_proxy_t proxy, bool force)
     return buf_ravail(proxy->input) == 0;
 }
 
+bool http_proxy_compressible(http_proxy_t proxy)
+{
+    return !(proxy->state == STATE_BODY && proxy->compressed);
+}
+
+bool http_proxy_idle(http_proxy_t proxy)
+{
+    return proxy->state <= STATE_DAWN && !proxy->active_transfer &&
+        !proxy->active_replace && buf_ravail(proxy->input) == 0;
+}
+
+void http_proxy_strip_segment(http_proxy_t proxy, const char* prefix)
+{
+    assert(prefix != NULL && *prefix == '/');
+    free(proxy->strip);
+    proxy->strip = strdup(prefix);
+}
+
 void http_proxy_free(http_proxy_t proxy)
 {
     if (proxy == NULL)
@@ -154,6 +195,7 @@ void http_proxy_free(http_proxy_t proxy)
 
     free(proxy->sourcehost);
     free(proxy->targethost);
+    free(proxy->strip);
     free(proxy->tmpstr);
 
     buf_free(proxy->input);
@@ -689,6 +731,7 @@ static void reset_state(http_proxy_t proxy)
     proxy->chunked = false;
     proxy->closed = false;
     proxy->in_chunk = false;
+    proxy->compressed = false;
 }
 
 /* This might destroy all iterators except proxy->last */
@@ -724,6 +767,35 @@ static bool need_input(http_proxy_t proxy)
     }
 }
 
+/* line is a Request-Line, remove the first segment of the path if it
+ * starts with proxy->strip. Returns false if there was nothing to remove */
+static bool strip_segment(http_proxy_t proxy, char* line)
+{
+    size_t len = strlen(proxy->strip);
+    char* uri, *next;
+    uri = strpbrk(line, " \t");
+    if (uri == NULL)
+    {
+        return false;
+    }
+    while (issp(*uri))
+    {
+        ++uri;
+    }
+    if (strncmp(uri, proxy->strip, len) != 0)
+    {
+        return false;
+    }
+    next = uri + len + strcspn(uri + len, "/? \t");
+    if (*next != '/')
+    {
+        /* Nothing after the segment, the path is still "/" */
+        ++uri;
+    }
+    memmove(uri, next, strlen(next) + 1);
+    return true;
+}
+
 static bool dawn(http_proxy_t proxy, bool force)
 {
     iter_t end, start, pos;
@@ -858,6 +930,22 @@ static bool dawn(http_proxy_t proxy, bool force)
     eat_crlf(&end);
     proxy->request = true;
     proxy->state = STATE_HEADER;
+    if (proxy->strip != NULL)
+    {
+        size_t need;
+        iter_begin(proxy, &start);
+        need = end.pos - start.pos;
+        if (alloc_str(proxy, need))
+        {
+            memcpy(proxy->tmpstr, start.pos, need);
+            proxy->tmpstr[need] = '\0';
+            if (strip_segment(proxy, proxy->tmpstr))
+            {
+                replace(proxy, start, proxy->tmpstr, end);
+                return true;
+            }
+        }
+    }
     transfer(proxy, end);
     return true;
 
@@ -1097,6 +1185,27 @@ static void header_value_list_remove(char* str, const char* token)
     }
 }
 
+static bool compressed_type(const char* type)
+{
+    size_t i, len;
+    /* Only one that isn't */
+    if (strncasecmp(type, "image/svg", 9) == 0)
+    {
+        return false;
+    }
+    for (i = 0; compressed_types[i] != NULL; ++i)
+    {
+        len = strlen(compressed_types[i]);
+        if (strncasecmp(type, compressed_types[i], len) == 0 &&
+            (compressed_types[i][len - 1] == '/' || type[len] == '\0' ||
+             type[len] == ';' || issp(type[len])))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
 static bool header(http_proxy_t proxy, bool force)
 {
     iter_t start, end;
@@ -1252,6 +1361,20 @@ static bool header(http_proxy_t proxy, bool force)
             proxy->closed = true;
         }
     }
+    else if (strcasecmp(str, "Content-Type") == 0)
+    {
+        if (compressed_type(pos))
+        {
+            proxy->compressed = true;
+        }
+    }
+    else if (strcasecmp(str, "Content-Encoding") == 0)
+    {
+        if (*pos != '\0' && strcasecmp(pos, "identity") != 0)
+        {
+            proxy->compressed = true;
+        }
+    }
 
     eat_crlf(&end);
     transfer(proxy, end);
@@ -1573,6 +1696,7 @@ static bool body(http_proxy_t proxy, bool force)
             return false;
         }
         buf_rmove(proxy->input, wrote);
+        iter_begin(proxy, &proxy->last);
         return true;
     }
 }
@@ -49,6 +49,19 @@ size_t http_proxy_write(http_proxy_t proxy, const void* data, size_t max);
  * Returns true when all data is transfered to buf (false if buf is full) */
 bool http_proxy_flush(http_proxy_t proxy, bool force);
 
+/* false while the body of a message that is compressed already (going by
+ * its Content-Type and Content-Encoding) is being written to buf */
+bool http_proxy_compressible(http_proxy_t proxy);
+
+/* true between messages with nothing buffered, a new proxy can then take
+ * over the stream */
+bool http_proxy_idle(http_proxy_t proxy);
+
+/* Requests for paths where the first segment starts with prefix, which
+ * also starts with '/', get that segment removed. So with a prefix of
+ * "/x-" a request for "/x-12/desc.xml" is written as one for "/desc.xml" */
+void http_proxy_strip_segment(http_proxy_t proxy, const char* prefix);
+
 void http_proxy_free(http_proxy_t proxy);
 
 #endif /* HTTP_PROXY_H */
@@ -35,18 +35,36 @@
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#if HAVE_PTHREAD
+# include <pthread.h>
+#endif
 
 struct _log_t
 {
     FILE* fh;
+#if HAVE_PTHREAD
+    /* Worker threads log too */
+    pthread_mutex_t lock;
+#endif
 };
 
+#if HAVE_PTHREAD
+# define log_lock(log) pthread_mutex_lock(&((log)->lock))
+# define log_unlock(log) pthread_mutex_unlock(&((log)->lock))
+#else
+# define log_lock(log)
+# define log_unlock(log)
+#endif
+
 log_t log_open(void)
 {
     log_t log = malloc(sizeof(struct _log_t));
     if (log == NULL)
         return NULL;
     log->fh = stderr;
+#if HAVE_PTHREAD
+    pthread_mutex_init(&log->lock, NULL);
+#endif
     return log;
 }
 
@@ -184,6 +202,7 @@ bool log_reopen(log_t log, const char* url)
         return false;
     }
 
+    log_lock(log);
     if (log->fh != NULL)
     {
         if (log->fh != stderr)
@@ -199,6 +218,7 @@ bool log_reopen(log_t log, const char* url)
         }
     }
     log->fh = fh;
+    log_unlock(log);
     return true;
 }
 
@@ -215,6 +235,9 @@ void log_close(log_t log)
     {
         closelog();
     }
+#if HAVE_PTHREAD
+    pthread_mutex_destroy(&log->lock);
+#endif
     free(log);
 }
 
@@ -248,6 +271,7 @@ static inline int lvl_prio(log_lvl_t lvl)
 
 void log_puts(log_t log, log_lvl_t lvl, const char* msg)
 {
+    log_lock(log);
     if (log->fh != NULL)
     {
         fputs(lvl_str(lvl), log->fh);
@@ -258,12 +282,14 @@ void log_puts(log_t log, log_lvl_t lvl, const char* msg)
     {
         syslog(lvl_prio(lvl), "%s", msg);
     }
+    log_unlock(log);
 }
 
 void log_printf(log_t log, log_lvl_t lvl, const char* format, ...)
 {
     va_list args;
     va_start(args, format);
+    log_lock(log);
     if (log->fh != NULL)
     {
         fputs(lvl_str(lvl), log->fh);
@@ -274,5 +300,6 @@ void log_printf(log_t log, log_lvl_t lvl, const char* format, ...)
     {
         vsyslog(lvl_prio(lvl), format, args);
     }
+    log_unlock(log);
     va_end(args);
 }
@@ -40,6 +40,8 @@ typedef struct _entry_t
 struct _map_t
 {
     size_t count, limit, tablesize, elementsize;
+    /* An empty slot, iteration starts after it, see map_begin */
+    size_t iter_start;
     map_hash_t hash_func;
     map_eq_t eq_func;
     map_free_t free_func;
@@ -148,6 +150,7 @@ void* map_put(map_t map, const void* element)
         map->table = table;
         map->tablesize = ns;
         map->limit = (map->tablesize * 3) / 4;
+        map->iter_start = 0;
         assert(map->limit > map->count);
     }
 
@@ -201,6 +204,43 @@ void* map_get(map_t map, const void* element)
     }
 }
 
+/* Free the element at idx and move the following elements in the same
+ * probe sequence back so that they can still be found */
+static void map_erase(map_t map, size_t idx)
+{
+    size_t i = idx, j = idx;
+
+    if (map->free_func != NULL)
+    {
+        map->free_func(map->table[idx].data);
+    }
+    free(map->table[idx].data);
+    map->table[idx].data = NULL;
+    map->count--;
+
+    for (;;)
+    {
+        size_t k;
+        if (++j == map->tablesize)
+        {
+            j = 0;
+        }
+        if (!map->table[j].data)
+        {
+            break;
+        }
+        k = map->hash_func(map->table[j].data) % map->tablesize;
+        /* Leave it if its home is cyclically in ]i, j] */
+        if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+        {
+            continue;
+        }
+        map->table[i].data = map->table[j].data;
+        map->table[j].data = NULL;
+        i = j;
+    }
+}
+
 size_t map_remove(map_t map, const void* element)
 {
     size_t ret = 0, i;
@@ -223,18 +263,14 @@ size_t map_remove(map_t map, const void* element)
             map->eq_func(map->table[i].data, element))
         {
             const bool done = map->table[i].data == element;
-            if (map->free_func != NULL)
-            {
-                map->free_func(map->table[i].data);
-            }
-            free(map->table[i].data);
-            map->table[i].data = NULL;
-            map->count--;
+            map_erase(map, i);
             ++ret;
             if (done)
             {
                 break;
             }
+            /* Something else might have been moved to i */
+            continue;
         }
 
         if (++i == map->tablesize)
@@ -252,22 +288,47 @@ void* map_getat(map_t map, size_t idx)
     return map->table[idx].data;
 }
 
-size_t map_begin(map_t map)
+/* The next element after idx in the order of iteration */
+static size_t map_scan(map_t map, size_t idx)
 {
-    size_t idx = 0;
+    for (;;)
+    {
+        if (++idx == map->tablesize)
+        {
+            idx = 0;
+        }
+        if (idx == map->iter_start)
+        {
+            return map->tablesize;
+        }
+        if (map->table[idx].data)
+        {
+            return idx;
+        }
+    }
+}
 
+size_t map_begin(map_t map)
+{
     if (map->count == 0)
     {
         return map->tablesize;
     }
 
-    for (;; idx++)
+    /* Start right after an empty slot so that no probe sequence wraps
+     * around the start of the iteration. map_erase then only moves
+     * elements back from slots not yet visited. The slot stays empty
+     * until the next map_put, so nested iterations start at the same
+     * place */
+    if (map->table[map->iter_start].data)
     {
-        if (map->table[idx].data)
+        size_t idx;
+        for (idx = 0; map->table[idx].data; idx++)
         {
-            return idx;
         }
+        map->iter_start = idx;
     }
+    return map_scan(map, map->iter_start);
 }
 
 size_t map_end(map_t map)
@@ -282,15 +343,7 @@ size_t map_next(map_t map, size_t idx)
     {
         return idx;
     }
-    ++idx;
-    for (; idx < map->tablesize; idx++)
-    {
-        if (map->table[idx].data)
-        {
-            break;
-        }
-    }
-    return idx;
+    return map_scan(map, idx);
 }
 
 size_t map_removeat(map_t map, size_t idx)
@@ -302,13 +355,12 @@ size_t map_removeat(map_t map, size_t idx)
     }
     if (map->table[idx].data)
     {
-        if (map->free_func != NULL)
+        map_erase(map, idx);
+        if (map->table[idx].data)
         {
-            map->free_func(map->table[idx].data);
+            /* Moved here from a slot the iteration had yet to visit */
+            return idx;
         }
-        free(map->table[idx].data);
-        map->table[idx].data = NULL;
-        map->count--;
     }
     return map_next(map, idx);
 }
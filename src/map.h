@@ -49,13 +49,19 @@ void* map_put(map_t map, const void* element);
 /* Returns the element in the map that returns true for eq_func */
 void* map_get(map_t map, const void* element);
 
-/* Removes all elements in the map that returns true for eq_func */
+/* Removes all elements in the map that returns true for eq_func.
+ * A match is freed before the search goes on, so element must not be
+ * or refer to data owned by an element in the map unless it is the
+ * element itself */
 size_t map_remove(map_t map, const void* element);
 
 void* map_getat(map_t map, size_t idx);
 size_t map_begin(map_t map);
 size_t map_end(map_t map);
 size_t map_next(map_t map, size_t idx);
+/* Returns the next element to visit, elements are visited once even if
+ * others are removed during the iteration. Adding elements during an
+ * iteration is not allowed */
 size_t map_removeat(map_t map, size_t idx);
 
 #endif /* MAP_H */
@@ -0,0 +1,420 @@
+/*
+ * Copyright (C) 2011, Joel Klinghed.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the project nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE PROJECT AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE PROJECT OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "common.h"
+
+#include "outq.h"
+#include <string.h>
+
+typedef struct _block_t
+{
+    struct _block_t* next;
+    buf_t buf;
+} block_t;
+
+typedef struct _class_t
+{
+    block_t* head, *tail;
+    size_t size;
+    /* Sizes of the records in the class, a ring of rec_alloc */
+    size_t* rec;
+    size_t rec_first, rec_count, rec_alloc;
+    /* Bytes of the first record that already has been sent */
+    size_t sent;
+} class_t;
+
+struct _outq_t
+{
+    class_t cls[OUTQ_MAX_CLASSES];
+    unsigned int classes;
+    /* The class with a partly sent record, or -1 */
+    int sending;
+    /* Unused blocks of block_size */
+    block_t* pool;
+    size_t pooled;
+    size_t block_size, high_water, size;
+};
+
+/* A piece of a class. outq_iov and outq_consume must walk the queue in the
+ * same order */
+typedef struct _seg_t
+{
+    unsigned int cls;
+    size_t offset, len;
+} seg_t;
+
+static const size_t POOL_SIZE = 4;
+
+static block_t* block_new(outq_t outq, size_t size);
+static void block_free(outq_t outq, block_t* block);
+static bool block_append(buf_t buf, size_t size);
+static void class_add_record(class_t* cls, size_t size);
+static void class_consume(outq_t outq, class_t* cls, size_t size);
+static unsigned int outq_order(outq_t outq, seg_t* seg);
+
+outq_t outq_new(size_t block_size, size_t high_water, unsigned int classes)
+{
+    outq_t outq;
+    assert(classes > 0 && classes <= OUTQ_MAX_CLASSES);
+    outq = calloc(1, sizeof(struct _outq_t));
+    if (outq == NULL)
+    {
+        return NULL;
+    }
+    outq->classes = classes;
+    outq->sending = -1;
+    outq->block_size = block_size;
+    outq->high_water = high_water;
+    return outq;
+}
+
+void outq_free(outq_t outq)
+{
+    unsigned int c;
+    if (outq == NULL)
+    {
+        return;
+    }
+    outq_clear(outq);
+    for (c = 0; c < outq->classes; ++c)
+    {
+        free(outq->cls[c].rec);
+    }
+    while (outq->pool != NULL)
+    {
+        block_t* block = outq->pool;
+        outq->pool = block->next;
+        buf_free(block->buf);
+        free(block);
+    }
+    free(outq);
+}
+
+void outq_clear(outq_t outq)
+{
+    unsigned int c;
+    for (c = 0; c < outq->classes; ++c)
+    {
+        class_t* cls = outq->cls + c;
+        while (cls->head != NULL)
+        {
+            block_t* block = cls->head;
+            cls->head = block->next;
+            block_free(outq, block);
+        }
+        cls->tail = NULL;
+        cls->size = 0;
+        cls->rec_first = 0;
+        cls->rec_count = 0;
+        cls->sent = 0;
+    }
+    outq->sending = -1;
+    outq->size = 0;
+}
+
+void outq_set_high_water(outq_t outq, size_t high_water)
+{
+    outq->high_water = high_water;
+}
+
+size_t outq_size(outq_t outq)
+{
+    return outq->size;
+}
+
+bool outq_empty(outq_t outq)
+{
+    return outq->size == 0;
+}
+
+bool outq_full(outq_t outq)
+{
+    return outq->high_water > 0 && outq->size > outq->high_water;
+}
+
+bool outq_drained(outq_t outq)
+{
+    return outq->size < outq->high_water / 2;
+}
+
+buf_t outq_wbuf(outq_t outq, unsigned int c, size_t size)
+{
+    class_t* cls;
+    block_t* block;
+    assert(c < outq->classes);
+    cls = outq->cls + c;
+    if (cls->tail != NULL)
+    {
+        if (block_append(cls->tail->buf, size))
+        {
+            return cls->tail->buf;
+        }
+        if (buf_rrotate(cls->tail->buf) &&
+            block_append(cls->tail->buf, size))
+        {
+            return cls->tail->buf;
+        }
+    }
+    block = block_new(outq, size);
+    if (cls->tail != NULL)
+    {
+        cls->tail->next = block;
+    }
+    else
+    {
+        cls->head = block;
+    }
+    cls->tail = block;
+    return block->buf;
+}
+
+void outq_wrote(outq_t outq, unsigned int c, size_t size)
+{
+    assert(c < outq->classes);
+    if (size == 0)
+    {
+        return;
+    }
+    outq->cls[c].size += size;
+    outq->size += size;
+    class_add_record(outq->cls + c, size);
+}
+
+void outq_write(outq_t outq, unsigned int c, const void* data, size_t size)
+{
+    const char* ptr = data;
+    size_t left = size;
+    assert(c < outq->classes);
+    if (size == 0)
+    {
+        return;
+    }
+    while (left > 0)
+    {
+        size_t len = left < outq->block_size ? left : outq->block_size;
+        buf_t buf = outq_wbuf(outq, c, len);
+        buf_write(buf, ptr, len);
+        ptr += len;
+        left -= len;
+    }
+    outq->cls[c].size += size;
+    outq->size += size;
+    class_add_record(outq->cls + c, size);
+}
+
+int outq_iov(outq_t outq, struct iovec* iov, int max)
+{
+    seg_t seg[OUTQ_MAX_CLASSES + 1];
+    unsigned int i, segs = outq_order(outq, seg);
+    int cnt = 0;
+    for (i = 0; i < segs && cnt < max; ++i)
+    {
+        block_t* block;
+        size_t offset = seg[i].offset, len = seg[i].len;
+        for (block = outq->cls[seg[i].cls].head;
+             block != NULL && len > 0 && cnt < max; block = block->next)
+        {
+            size_t avail;
+            const char* ptr = buf_rptr(block->buf, &avail);
+            if (offset >= avail)
+            {
+                offset -= avail;
+                continue;
+            }
+            ptr += offset;
+            avail -= offset;
+            offset = 0;
+            if (avail > len)
+            {
+                avail = len;
+            }
+            iov[cnt].iov_base = (void*)ptr;
+            iov[cnt].iov_len = avail;
+            ++cnt;
+            len -= avail;
+        }
+    }
+    return cnt;
+}
+
+void outq_consume(outq_t outq, size_t size)
+{
+    seg_t seg[OUTQ_MAX_CLASSES + 1];
+    unsigned int i, segs = outq_order(outq, seg);
+    assert(size <= outq->size);
+    outq->size -= size;
+    for (i = 0; i < segs && size > 0; ++i)
+    {
+        size_t len = seg[i].len < size ? seg[i].len : size;
+        class_consume(outq, outq->cls + seg[i].cls, len);
+        size -= len;
+    }
+    assert(size == 0);
+    outq->sending = -1;
+    for (i = 0; i < outq->classes; ++i)
+    {
+        if (outq->cls[i].sent > 0)
+        {
+            outq->sending = i;
+            break;
+        }
+    }
+}
+
+/* The rest of the partly sent record first, then the classes in order */
+unsigned int outq_order(outq_t outq, seg_t* seg)
+{
+    unsigned int c, segs = 0;
+    size_t first = 0;
+    if (outq->sending >= 0)
+    {
+        class_t* cls = outq->cls + outq->sending;
+        first = cls->rec[cls->rec_first] - cls->sent;
+        seg[segs].cls = outq->sending;
+        seg[segs].offset = 0;
+        seg[segs].len = first;
+        ++segs;
+    }
+    for (c = 0; c < outq->classes; ++c)
+    {
+        size_t offset = (int)c == outq->sending ? first : 0;
+        if (outq->cls[c].size > offset)
+        {
+            seg[segs].cls = c;
+            seg[segs].offset = offset;
+            seg[segs].len = outq->cls[c].size - offset;
+            ++segs;
+        }
+    }
+    return segs;
+}
+
+void class_add_record(class_t* cls, size_t size)
+{
+    if (cls->rec_count == cls->rec_alloc)
+    {
+        size_t alloc = cls->rec_alloc > 0 ? cls->rec_alloc * 2 : 16, i;
+        size_t* rec = malloc(alloc * sizeof(size_t));
+        for (i = 0; i < cls->rec_count; ++i)
+        {
+            rec[i] = cls->rec[(cls->rec_first + i) % cls->rec_alloc];
+        }
+        free(cls->rec);
+        cls->rec = rec;
+        cls->rec_alloc = alloc;
+        cls->rec_first = 0;
+    }
+    cls->rec[(cls->rec_first + cls->rec_count) % cls->rec_alloc] = size;
+    cls->rec_count++;
+}
+
+void class_consume(outq_t outq, class_t* cls, size_t size)
+{
+    size_t left = size;
+    assert(size <= cls->size);
+    cls->size -= size;
+    while (left > 0)
+    {
+        size_t rec = cls->rec[cls->rec_first] - cls->sent;
+        assert(cls->rec_count > 0);
+        if (left < rec)
+        {
+            cls->sent += left;
+            break;
+        }
+        left -= rec;
+        cls->sent = 0;
+        cls->rec_first = (cls->rec_first + 1) % cls->rec_alloc;
+        cls->rec_count--;
+    }
+    while (cls->head != NULL)
+    {
+        block_t* block = cls->head;
+        size_t avail = buf_ravail(block->buf);
+        if (size < avail)
+        {
+            buf_rmove(block->buf, size);
+            return;
+        }
+        size -= avail;
+        cls->head = block->next;
+        if (cls->head == NULL)
+        {
+            cls->tail = NULL;
+        }
+        block_free(outq, block);
+    }
+    assert(size == 0);
+}
+
+block_t* block_new(outq_t outq, size_t size)
+{
+    block_t* block;
+    if (size <= outq->block_size && outq->pool != NULL)
+    {
+        block = outq->pool;
+        outq->pool = block->next;
+        outq->pooled--;
+    }
+    else
+    {
+        block = malloc(sizeof(block_t));
+        block->buf = buf_new(size < outq->block_size
+                             ? outq->block_size : size);
+    }
+    block->next = NULL;
+    return block;
+}
+
+void block_free(outq_t outq, block_t* block)
+{
+    if (buf_size(block->buf) == outq->block_size &&
+        outq->pooled < POOL_SIZE)
+    {
+        buf_skip(block->buf, buf_ravail(block->buf));
+        block->next = outq->pool;
+        outq->pool = block;
+        outq->pooled++;
+    }
+    else
+    {
+        buf_free(block->buf);
+        free(block);
+    }
+}
+
+/* The data in a block is always kept in one piece, so only append if there
+ * is room directly after it */
+bool block_append(buf_t buf, size_t size)
+{
+    size_t wavail, ravail;
+    char* wptr = buf_wptr(buf, &wavail);
+    const char* rptr = buf_rptr(buf, &ravail);
+    return wptr == rptr + ravail && wavail >= size;
+}
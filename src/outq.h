@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2011, Joel Klinghed.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the project nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE PROJECT AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE PROJECT OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef OUTQ_H
+#define OUTQ_H
+
+/* Output queue, a chain of buffers that grows as needed so that everything
+ * written to it is kept until sent. Blocks of the standard size are reused.
+ * The data is sent with writev, a block at the time is never split into
+ * more than one iovec.
+ * The queue has one or more classes, lower classes are sent first.
+ * Each outq_wrote/outq_write is a record and once a record has started to
+ * be sent it is finished before anything else */
+
+typedef struct _outq_t* outq_t;
+
+#define OUTQ_MAX_CLASSES (4)
+
+#include "buf.h"
+#include <sys/uio.h>
+
+/* high_water is the number of queued bytes where outq_full starts to
+ * return true, 0 means never. classes is at most OUTQ_MAX_CLASSES */
+outq_t outq_new(size_t block_size, size_t high_water, unsigned int classes);
+void outq_free(outq_t outq);
+
+/* Drop everything queued */
+void outq_clear(outq_t outq);
+
+void outq_set_high_water(outq_t outq, size_t high_water);
+
+/* Number of bytes queued, in all classes */
+size_t outq_size(outq_t outq);
+bool outq_empty(outq_t outq);
+/* true if more than high_water bytes are queued. Producers that are able
+ * to should wait until outq_drained before writing more */
+bool outq_full(outq_t outq);
+/* true if less than half of high_water bytes are queued */
+bool outq_drained(outq_t outq);
+
+/* Return a buffer at the end of the class with at least size bytes
+ * available for writing in one continuous piece. Must be followed by
+ * outq_wrote with the number of bytes actually written to it */
+buf_t outq_wbuf(outq_t outq, unsigned int cls, size_t size);
+void outq_wrote(outq_t outq, unsigned int cls, size_t size);
+
+/* Write size bytes from data to the end of the class */
+void outq_write(outq_t outq, unsigned int cls, const void* data,
+                size_t size);
+
+/* Fill in at most max iovecs with the start of the queue, returns the
+ * number filled in */
+int outq_iov(outq_t outq, struct iovec* iov, int max);
+/* Remove size bytes from the start of the queue, as given by outq_iov */
+void outq_consume(outq_t outq, size_t size);
+
+#endif /* OUTQ_H */
@@ -36,18 +36,170 @@
 #include <errno.h>
 #include <string.h>
 
+#if HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <poll.h>
+#endif
+
 #include "selector.h"
 #include "timeval.h"
 
+#if HAVE_IO_URING
+typedef struct _stream_t stream_t;
+#endif
+
 typedef struct _client_t
 {
     socket_t sock;
     void* userdata;
     read_callback_t read_callback;
     write_callback_t write_callback;
+    /* Set instead of read_callback for a listening socket */
+    accept_callback_t accept_callback;
     bool delete;
+    /* true while sock is in requeue */
+    bool requeued;
+#if HAVE_IO_URING
+    /* POLLIN and/or POLLOUT as set by selector_chk */
+    uint32_t want;
+    /* Events of the poll in the ring, 0 if none is armed */
+    uint32_t armed;
+    /* The armed entry is a multishot accept and not a poll */
+    bool accepting;
+    /* Identifies the armed poll, see ring_arm */
+    uint32_t seq;
+    /* Events reported but not yet dispatched */
+    uint32_t revents;
+    /* true while sock is in ring->dirty */
+    bool dirty;
+    /* Set once selector_recv or selector_send moved the reads and writes
+     * of sock into the ring, nothing is polled for it after that */
+    stream_t* stream;
+#endif
 } client_t;
 
+#if HAVE_IO_URING
+/* Each stream takes one buffer for reads and one for writes, the ones
+ * that don't get any are polled */
+#define RING_BUFFERS (64)
+#define RING_BUFFER_SIZE (32 * 1024)
+
+/* A socket which reads and writes are done by the ring. There is at most
+ * one of each in the ring, a read is started when the last one is used
+ * up and a write when selector_send gets data */
+struct _stream_t
+{
+    socket_t sock;
+    /* Index in ring->buf */
+    unsigned int rbuf, wbuf;
+    /* rlen bytes read from rpos that selector_recv hasn't returned */
+    size_t rpos, rlen;
+    /* wlen bytes given to selector_send, wpos of them are sent */
+    size_t wpos, wlen;
+    bool reading, writing;
+    bool eof;
+    /* errno of a failed read or write, 0 if none */
+    int rerr, werr;
+    /* The client is removed but the write goes on, with a copy of its
+     * socket that is closed when it is done */
+    bool orphan;
+};
+
+typedef struct _ring_buf_t
+{
+    char* data;
+    /* NULL if free, or if the stream was removed while busy */
+    stream_t* stream;
+    /* true while a read or write to it is in the ring */
+    bool busy;
+    /* Tells the entries for the buffer apart, see ring_io */
+    uint32_t gen;
+} ring_buf_t;
+
+typedef struct _accepted_t
+{
+    socket_t listener;
+    /* -1 if accepting failed with err */
+    socket_t sock;
+    int err;
+} accepted_t;
+
+/* A one shot poll is armed in the ring for each socket that should be
+ * checked. The changes since the last tick are submitted by the same
+ * io_uring_enter that waits for completions, and a reported poll is armed
+ * again the next tick, which keeps it level triggered like select.
+ * Listeners get a multishot accept instead and streams their reads and
+ * writes, a stream with something to tell is reported each tick until
+ * the callbacks have taken care of it */
+typedef struct _ring_t
+{
+    int fd;
+    void* sq_ptr, *cq_ptr;
+    size_t sq_size, cq_size;
+    struct io_uring_sqe* sqes;
+    size_t sqes_size;
+    unsigned* sq_head, *sq_tail, *sq_array;
+    unsigned sq_mask, sq_entries;
+    unsigned* cq_head, *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe* cqes;
+    /* Local copy of *sq_tail */
+    unsigned tail;
+    uint32_t seq;
+    /* Index in selector->client by socket, NO_INDEX if there is none */
+    size_t* index;
+    size_t index_size;
+    /* Sockets which poll needs to be changed or armed again */
+    socket_t* dirty;
+    size_t dirty_cnt, dirty_alloc;
+    /* Sockets with reported events */
+    socket_t* ready;
+    size_t ready_cnt, ready_alloc;
+    /* Connections accepted by the ring but not yet given to the
+     * listener */
+    accepted_t* accepted;
+    size_t accepted_cnt, accepted_alloc;
+    /* The kernel has no multishot accept, listeners are polled */
+    bool no_multishot;
+    /* Buffers of the streams, mapped the first time one is needed.
+     * registered if the kernel has them too, so that the fixed opcodes
+     * can be used */
+    char* pool;
+    bool pool_failed, registered;
+    ring_buf_t buf[RING_BUFFERS];
+    unsigned int free_buf[RING_BUFFERS];
+    unsigned int free_cnt;
+} ring_t;
+
+#define RING_ENTRIES (256)
+#define NO_INDEX ((size_t)-1)
+
+/* The top bits of the user_data of an entry tell what it is, then comes
+ * the seq and the socket of the client, or the generation and the index
+ * of the buffer for reads and writes */
+#define UD_POLL ((uint64_t)0 << 62)
+#define UD_ACCEPT ((uint64_t)1 << 62)
+#define UD_IO ((uint64_t)2 << 62)
+#define UD_KIND ((uint64_t)3 << 62)
+#define SEQ_MASK (0x3fffffff)
+
+#ifndef IORING_ACCEPT_MULTISHOT
+# define IORING_ACCEPT_MULTISHOT (1U << 0)
+#endif
+#ifndef IORING_CQE_F_MORE
+# define IORING_CQE_F_MORE (1U << 1)
+#endif
+
+static ring_t* ring_new(void);
+static void ring_free(ring_t* ring);
+static bool ring_tick(selector_t selector, unsigned long timeout_ms);
+#endif
+
+#define DEFAULT_BUDGET (64 * 1024)
+
 struct _selector_t
 {
     fd_set read_set, write_set;
@@ -56,9 +208,61 @@ struct _selector_t
 
     size_t tick_pos, delete_cnt;
     bool in_tick;
+    /* Where select_tick starts looking, moved one step each tick so that
+     * the first clients don't always go first */
+    size_t tick_start;
+
+    size_t budget;
+    /* Sockets which read callback stopped because of the budget, they
+     * are called again next tick after the ready ones. requeue_run is the
+     * list of the running tick */
+    socket_t* requeue, *requeue_run;
+    size_t requeue_cnt, requeue_alloc, requeue_run_cnt, requeue_run_alloc;
+
+    /* May be NULL */
+    timers_t timers;
+
+#if HAVE_IO_URING
+    /* NULL when select is used */
+    ring_t* ring;
+#endif
 };
 
+static client_t* find_client(selector_t selector, socket_t sock, size_t* idx);
+static bool select_tick(selector_t selector, unsigned long timeout_ms);
+static void compact_clients(selector_t selector);
+static void woke_up(selector_t selector);
+static bool push_sock(socket_t** list, size_t* cnt, size_t* alloc,
+                      socket_t sock);
+#if HAVE_IO_URING
+static void ring_set_index(ring_t* ring, socket_t sock, size_t idx);
+static void ring_want(selector_t selector, socket_t sock, uint32_t events,
+                      bool check);
+static void ring_dirty(ring_t* ring, client_t* c);
+static void ring_disarm(ring_t* ring, client_t* c);
+static void ring_stop_accept(ring_t* ring, client_t* c);
+static stream_t* ring_stream(selector_t selector, socket_t sock);
+static void stream_free(ring_t* ring, client_t* c);
+static ssize_t stream_recv(ring_t* ring, stream_t* s,
+                           void* data, size_t size);
+static ssize_t stream_send(ring_t* ring, stream_t* s,
+                           const void* data, size_t size);
+static bool stream_idle(selector_t selector, stream_t* s);
+#endif
+
 selector_t selector_new(void)
+{
+    selector_t ret = selector_new_select();
+#if HAVE_IO_URING
+    if (ret != NULL)
+    {
+        ret->ring = ring_new();
+    }
+#endif
+    return ret;
+}
+
+selector_t selector_new_select(void)
 {
     selector_t ret = calloc(1, sizeof(struct _selector_t));
     if (ret == NULL)
@@ -66,38 +270,164 @@ selector_t selector_new(void)
 
     FD_ZERO(&(ret->read_set));
     FD_ZERO(&(ret->write_set));
+    ret->budget = DEFAULT_BUDGET;
 
     return ret;
 }
 
+const char* selector_backend(selector_t selector)
+{
+#if HAVE_IO_URING
+    if (selector->ring != NULL)
+    {
+        return "io_uring";
+    }
+#endif
+    return "select";
+}
+
 void selector_free(selector_t selector)
 {
     if (selector == NULL)
         return;
 
+#if HAVE_IO_URING
+    if (selector->ring != NULL)
+    {
+        ring_t* ring = selector->ring;
+        size_t i;
+        for (i = 0; i < RING_BUFFERS; ++i)
+        {
+            stream_t* s = ring->buf[i].stream;
+            if (s != NULL && s->orphan)
+            {
+                socket_close(s->sock);
+                free(s);
+            }
+        }
+        for (i = 0; i < selector->clients; ++i)
+        {
+            free(selector->client[i].stream);
+        }
+    }
+    ring_free(selector->ring);
+#endif
+    free(selector->requeue);
+    free(selector->requeue_run);
     free(selector->client);
     free(selector);
 }
 
-void selector_add(selector_t selector, socket_t sock,
-                  void* userdata,
-                  read_callback_t read_callback,
-                  write_callback_t write_callback)
+void selector_set_budget(selector_t selector, size_t budget)
+{
+    assert(budget > 0);
+    selector->budget = budget;
+}
+
+size_t selector_budget(selector_t selector)
+{
+    return selector->budget;
+}
+
+void selector_set_timers(selector_t selector, timers_t timers)
+{
+    selector->timers = timers;
+}
+
+static void woke_up(selector_t selector)
+{
+    if (selector->timers != NULL)
+    {
+        timers_update(selector->timers);
+    }
+    selector->in_tick = true;
+}
+
+void selector_requeue(selector_t selector, socket_t sock)
+{
+    client_t* c = find_client(selector, sock, NULL);
+    if (c == NULL || c->delete || c->requeued)
+    {
+        return;
+    }
+    assert(c->read_callback != NULL);
+    if (push_sock(&selector->requeue, &selector->requeue_cnt,
+                  &selector->requeue_alloc, sock))
+    {
+        c->requeued = true;
+    }
+}
+
+/* Run the read callbacks requeued before the tick that didn't get to run
+ * because they were ready anyway */
+static void run_requeued(selector_t selector)
+{
+    size_t i, idx;
+    for (i = 0; i < selector->requeue_run_cnt; ++i)
+    {
+        client_t* c = find_client(selector, selector->requeue_run[i], &idx);
+        if (c == NULL || !c->requeued || c->delete)
+        {
+            continue;
+        }
+        c->requeued = false;
+        selector->tick_pos = idx;
+        c->read_callback(c->userdata, c->sock);
+    }
+    selector->requeue_run_cnt = 0;
+}
+
+client_t* find_client(selector_t selector, socket_t sock, size_t* idx)
 {
     client_t* c;
     size_t i;
-    assert(read_callback != NULL || write_callback != NULL);
-
+#if HAVE_IO_URING
+    if (selector->ring != NULL)
+    {
+        ring_t* ring = selector->ring;
+        if (sock < 0 || (size_t)sock >= ring->index_size ||
+            ring->index[sock] == NO_INDEX)
+        {
+            return NULL;
+        }
+        if (idx != NULL)
+        {
+            *idx = ring->index[sock];
+        }
+        return selector->client + ring->index[sock];
+    }
+#endif
     for (i = 0, c = selector->client; i < selector->clients; ++i, ++c)
     {
         if (c->sock == sock)
         {
-            assert(c->delete);
-            --(selector->delete_cnt);
-            break;
+            if (idx != NULL)
+            {
+                *idx = i;
+            }
+            return c;
         }
     }
-    if (i == selector->clients)
+    return NULL;
+}
+
+static void add_client(selector_t selector, socket_t sock,
+                       void* userdata,
+                       read_callback_t read_callback,
+                       write_callback_t write_callback,
+                       accept_callback_t accept_callback)
+{
+    client_t* c;
+    size_t i;
+    bool check_read = read_callback != NULL || accept_callback != NULL;
+
+    c = find_client(selector, sock, &i);
+    if (c != NULL)
+    {
+        assert(c->delete);
+        --(selector->delete_cnt);
+    }
+    else
     {
         if (selector->clients == selector->clients_alloc)
         {
@@ -117,13 +447,28 @@ void selector_add(selector_t selector, socket_t sock,
             selector->client = c;
             selector->clients_alloc = na;
         }
-        c = selector->client + selector->clients++;
+        i = selector->clients++;
+        c = selector->client + i;
     }
     memset(c, 0, sizeof(client_t));
     c->read_callback = read_callback;
     c->write_callback = write_callback;
+    c->accept_callback = accept_callback;
+    c->sock = sock;
+    c->userdata = userdata;
+
+#if HAVE_IO_URING
+    if (selector->ring != NULL)
+    {
+        ring_set_index(selector->ring, sock, i);
+        c->want = (check_read ? POLLIN : 0) |
+            (write_callback != NULL ? POLLOUT : 0);
+        ring_dirty(selector->ring, c);
+        return;
+    }
+#endif
 
-    if (read_callback != NULL)
+    if (check_read)
     {
         FD_SET(sock, &selector->read_set);
     }
@@ -131,8 +476,23 @@ void selector_add(selector_t selector, socket_t sock,
     {
         FD_SET(sock, &selector->write_set);
     }
-    c->sock = sock;
-    c->userdata = userdata;
+}
+
+void selector_add(selector_t selector, socket_t sock,
+                  void* userdata,
+                  read_callback_t read_callback,
+                  write_callback_t write_callback)
+{
+    assert(read_callback != NULL || write_callback != NULL);
+    add_client(selector, sock, userdata, read_callback, write_callback,
+               NULL);
+}
+
+void selector_add_listener(selector_t selector, socket_t sock,
+                           void* userdata, accept_callback_t accept_callback)
+{
+    assert(accept_callback != NULL);
+    add_client(selector, sock, userdata, NULL, NULL, accept_callback);
 }
 
 void selector_chk(selector_t selector, socket_t sock,
@@ -145,23 +505,26 @@ void selector_chk(selector_t selector, socket_t sock,
 void selector_chkread(selector_t selector, socket_t sock,
                        bool check_read)
 {
+#ifdef DEBUG
     if (check_read)
     {
-#ifdef DEBUG
-        client_t* c;
-        size_t i;
-        for (i = 0, c = selector->client; i < selector->clients; ++i, ++c)
-        {
-            if (c->sock == sock)
-            {
-                assert(c->read_callback != NULL);
-                assert(!c->delete);
-                break;
-            }
-        }
-        assert(i < selector->clients);
+        client_t* c = find_client(selector, sock, NULL);
+        assert(c != NULL);
+        assert(c->read_callback != NULL || c->accept_callback != NULL);
+        assert(!c->delete);
+    }
+#endif
+
+#if HAVE_IO_URING
+    if (selector->ring != NULL)
+    {
+        ring_want(selector, sock, POLLIN, check_read);
+        return;
+    }
 #endif
 
+    if (check_read)
+    {
         FD_SET(sock, &selector->read_set);
     }
     else
@@ -173,24 +536,26 @@ void selector_chkread(selector_t selector, socket_t sock,
 void selector_chkwrite(selector_t selector, socket_t sock,
                        bool check_write)
 {
+#ifdef DEBUG
     if (check_write)
     {
-#ifdef DEBUG
-        client_t* c;
-        size_t i;
-        for (i = 0, c = selector->client; i < selector->clients; ++i, ++c)
-        {
-            if (c->sock == sock)
-            {
-                assert(c->write_callback != NULL);
-                assert(!c->delete);
-                break;
-            }
-        }
+        client_t* c = find_client(selector, sock, NULL);
+        assert(c != NULL);
+        assert(c->write_callback != NULL);
+        assert(!c->delete);
+    }
+#endif
 
-        assert(i < selector->clients);
+#if HAVE_IO_URING
+    if (selector->ring != NULL)
+    {
+        ring_want(selector, sock, POLLOUT, check_write);
+        return;
+    }
 #endif
 
+    if (check_write)
+    {
         FD_SET(sock, &selector->write_set);
     }
     else
@@ -204,6 +569,49 @@ void selector_remove(selector_t selector, socket_t sock)
     client_t* c;
     size_t i;
 
+#if HAVE_IO_URING
+    if (selector->ring != NULL)
+    {
+        c = find_client(selector, sock, &i);
+        if (c == NULL)
+        {
+            return;
+        }
+        c->want = 0;
+        if (c->stream != NULL)
+        {
+            stream_free(selector->ring, c);
+        }
+        if (c->accepting)
+        {
+            ring_stop_accept(selector->ring, c);
+        }
+        else if (c->armed != 0)
+        {
+            ring_disarm(selector->ring, c);
+        }
+        if (selector->in_tick)
+        {
+            if (!c->delete)
+            {
+                selector->delete_cnt++;
+                c->delete = true;
+            }
+        }
+        else
+        {
+            selector->ring->index[sock] = NO_INDEX;
+            selector->clients--;
+            memmove(c, c + 1, (selector->clients - i) * sizeof(client_t));
+            for (; i < selector->clients; ++i)
+            {
+                selector->ring->index[selector->client[i].sock] = i;
+            }
+        }
+        return;
+    }
+#endif
+
     FD_CLR(sock, &selector->read_set);
     FD_CLR(sock, &selector->write_set);
 
@@ -233,18 +641,149 @@ void selector_remove(selector_t selector, socket_t sock)
     }
 }
 
+ssize_t selector_recv(selector_t selector, socket_t sock,
+                      void* data, size_t size)
+{
+#if HAVE_IO_URING
+    if (selector->ring != NULL)
+    {
+        stream_t* s = ring_stream(selector, sock);
+        if (s != NULL)
+        {
+            return stream_recv(selector->ring, s, data, size);
+        }
+    }
+#endif
+    return socket_read(sock, data, size);
+}
+
+ssize_t selector_send(selector_t selector, socket_t sock,
+                      const void* data, size_t size)
+{
+#if HAVE_IO_URING
+    if (selector->ring != NULL)
+    {
+        stream_t* s = ring_stream(selector, sock);
+        if (s != NULL)
+        {
+            return stream_send(selector->ring, s, data, size);
+        }
+    }
+#endif
+    return socket_write(sock, data, size);
+}
+
+bool selector_idle(selector_t selector, socket_t sock)
+{
+#if HAVE_IO_URING
+    if (selector->ring != NULL)
+    {
+        client_t* c = find_client(selector, sock, NULL);
+        if (c != NULL && c->stream != NULL)
+        {
+            return stream_idle(selector, c->stream);
+        }
+    }
+#endif
+    return true;
+}
+
 bool selector_tick(selector_t selector, unsigned long timeout_ms)
+{
+    bool ret;
+    socket_t* tmp;
+    size_t alloc;
+
+    /* Requeued during the last tick run this time, the ones requeued now
+     * wait for the next */
+    tmp = selector->requeue_run;
+    alloc = selector->requeue_run_alloc;
+    selector->requeue_run = selector->requeue;
+    selector->requeue_run_alloc = selector->requeue_alloc;
+    selector->requeue_run_cnt = selector->requeue_cnt;
+    selector->requeue = tmp;
+    selector->requeue_alloc = alloc;
+    selector->requeue_cnt = 0;
+    if (selector->requeue_run_cnt > 0)
+    {
+        /* Don't wait when there is something to do */
+        timeout_ms = 0;
+    }
+
+    selector->delete_cnt = 0;
+
+#if HAVE_IO_URING
+    if (selector->ring != NULL)
+    {
+        ret = ring_tick(selector, timeout_ms);
+    }
+    else
+#endif
+    {
+        ret = select_tick(selector, timeout_ms);
+    }
+
+    if (ret)
+    {
+        selector->in_tick = true;
+        run_requeued(selector);
+    }
+    else
+    {
+        /* Nothing was called, keep them for the next try */
+        assert(selector->requeue_cnt == 0);
+        tmp = selector->requeue;
+        alloc = selector->requeue_alloc;
+        selector->requeue = selector->requeue_run;
+        selector->requeue_alloc = selector->requeue_run_alloc;
+        selector->requeue_cnt = selector->requeue_run_cnt;
+        selector->requeue_run = tmp;
+        selector->requeue_run_alloc = alloc;
+        selector->requeue_run_cnt = 0;
+    }
+
+    selector->in_tick = false;
+
+    compact_clients(selector);
+
+    return ret;
+}
+
+/* A listener that is readable has a connection to accept, unless some
+ * other process got it first */
+static void accept_ready(client_t* c)
+{
+    socket_t s = socket_accept(c->sock, NULL, NULL);
+    if (s < 0 && socket_blockingerror(c->sock))
+    {
+        return;
+    }
+    c->accept_callback(c->userdata, c->sock, s);
+}
+
+/* A read callback that is called because the socket is ready counts as
+ * the turn of a requeued one */
+static void dispatch_read(client_t* c)
+{
+    if (c->accept_callback != NULL)
+    {
+        accept_ready(c);
+        return;
+    }
+    c->requeued = false;
+    c->read_callback(c->userdata, c->sock);
+}
+
+bool select_tick(selector_t selector, unsigned long timeout_ms)
 {
     int ret;
-    struct timeval to, target;
+    struct timeval to;
     client_t* c;
-    size_t i;
+    size_t i, n, start, k;
     fd_set active_read_set, active_write_set;
 
     to.tv_sec = timeout_ms / 1000;
     to.tv_usec = (timeout_ms % 1000) * 1000;
-    gettimeofday(&target, NULL);
-    timeval_add(&target, &to);
 
     active_read_set = selector->read_set;
     active_write_set = selector->write_set;
@@ -267,18 +806,23 @@ bool selector_tick(selector_t selector, unsigned long timeout_ms)
         return false;
     }
 
-    selector->in_tick = true;
-    selector->delete_cnt = 0;
+    woke_up(selector);
 
-    for (i = 0, c = selector->client; ret > 0 && i < selector->clients; ++i, ++c)
+    /* Clients added by the callbacks weren't in the sets */
+    n = selector->clients;
+    start = n > 0 ? selector->tick_start++ % n : 0;
+    for (k = 0; ret > 0 && k < n; ++k)
     {
-        if (c->read_callback && FD_ISSET(c->sock, &active_read_set))
+        i = start + k < n ? start + k : start + k - n;
+        c = selector->client + i;
+        if ((c->read_callback || c->accept_callback) &&
+            FD_ISSET(c->sock, &active_read_set))
         {
             selector->tick_pos = i;
             --ret;
             if (!c->delete)
             {
-                c->read_callback(c->userdata, c->sock);
+                dispatch_read(c);
                 c = selector->client + i;
             }
             if (ret > 0 && c->write_callback &&
@@ -288,7 +832,6 @@ bool selector_tick(selector_t selector, unsigned long timeout_ms)
                 if (!c->delete)
                 {
                     c->write_callback(c->userdata, c->sock);
-                    c = selector->client + i;
                 }
             }
         }
@@ -299,14 +842,40 @@ bool selector_tick(selector_t selector, unsigned long timeout_ms)
             if (!c->delete)
             {
                 c->write_callback(c->userdata, c->sock);
-                c = selector->client + i;
             }
         }
     }
 
     assert(ret == 0);
 
-    selector->in_tick = false;
+    return true;
+}
+
+bool push_sock(socket_t** list, size_t* cnt, size_t* alloc, socket_t sock)
+{
+    if (*cnt == *alloc)
+    {
+        size_t na = *alloc * 2;
+        socket_t* tmp;
+        if (na < 16)
+            na = 16;
+        tmp = realloc(*list, na * sizeof(socket_t));
+        if (tmp == NULL)
+        {
+            return false;
+        }
+        *list = tmp;
+        *alloc = na;
+    }
+    (*list)[(*cnt)++] = sock;
+    return true;
+}
+
+/* Drop the clients removed during the tick */
+void compact_clients(selector_t selector)
+{
+    client_t* c;
+    size_t i;
 
     i = selector->clients;
     c = selector->client + i - 1;
@@ -314,9 +883,25 @@ bool selector_tick(selector_t selector, unsigned long timeout_ms)
     {
         if (c->delete)
         {
+#if HAVE_IO_URING
+            if (selector->ring != NULL)
+            {
+                selector->ring->index[c->sock] = NO_INDEX;
+            }
+#endif
             selector->delete_cnt--;
             selector->clients--;
             memmove(c, c + 1, (selector->clients - (i - 1)) * sizeof(client_t));
+#if HAVE_IO_URING
+            if (selector->ring != NULL)
+            {
+                size_t j;
+                for (j = i - 1; j < selector->clients; ++j)
+                {
+                    selector->ring->index[selector->client[j].sock] = j;
+                }
+            }
+#endif
         }
         --c;
         --i;
@@ -328,6 +913,933 @@ bool selector_tick(selector_t selector, unsigned long timeout_ms)
         assert(!c->delete);
     }
 #endif
+}
+
+#if HAVE_IO_URING
+
+static int ring_enter(ring_t* ring, unsigned int to_submit,
+                      unsigned int min_complete, unsigned int flags,
+                      void* arg, size_t argsize)
+{
+    return syscall(__NR_io_uring_enter, ring->fd, to_submit, min_complete,
+                   flags, arg, argsize);
+}
+
+ring_t* ring_new(void)
+{
+    struct io_uring_params p;
+    ring_t* ring;
+    int fd;
+
+    memset(&p, 0, sizeof(p));
+    fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &p);
+    if (fd < 0)
+    {
+        /* Not supported by the kernel, or not allowed */
+        return NULL;
+    }
+    if (!(p.features & IORING_FEAT_EXT_ARG) ||
+        !(p.features & IORING_FEAT_NODROP))
+    {
+        close(fd);
+        return NULL;
+    }
+
+    ring = calloc(1, sizeof(ring_t));
+    if (ring == NULL)
+    {
+        close(fd);
+        return NULL;
+    }
+    ring->fd = fd;
+    ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (ring->cq_size > ring->sq_size)
+        {
+            ring->sq_size = ring->cq_size;
+        }
+        ring->cq_size = 0;
+    }
+    ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED)
+    {
+        ring->sq_ptr = NULL;
+        ring_free(ring);
+        return NULL;
+    }
+    if (ring->cq_size > 0)
+    {
+        ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ptr == MAP_FAILED)
+        {
+            ring->cq_ptr = NULL;
+            ring_free(ring);
+            return NULL;
+        }
+    }
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+    {
+        ring->sqes = NULL;
+        ring_free(ring);
+        return NULL;
+    }
+
+    ring->sq_head = (unsigned*)((char*)ring->sq_ptr + p.sq_off.head);
+    ring->sq_tail = (unsigned*)((char*)ring->sq_ptr + p.sq_off.tail);
+    ring->sq_array = (unsigned*)((char*)ring->sq_ptr + p.sq_off.array);
+    ring->sq_mask = *(unsigned*)((char*)ring->sq_ptr + p.sq_off.ring_mask);
+    ring->sq_entries = p.sq_entries;
+    {
+        char* cq_ptr = ring->cq_ptr != NULL ? ring->cq_ptr : ring->sq_ptr;
+        ring->cq_head = (unsigned*)(cq_ptr + p.cq_off.head);
+        ring->cq_tail = (unsigned*)(cq_ptr + p.cq_off.tail);
+        ring->cq_mask = *(unsigned*)(cq_ptr + p.cq_off.ring_mask);
+        ring->cqes = (struct io_uring_cqe*)(cq_ptr + p.cq_off.cqes);
+    }
+    ring->tail = *ring->sq_tail;
+    return ring;
+}
+
+void ring_free(ring_t* ring)
+{
+    if (ring == NULL)
+    {
+        return;
+    }
+    if (ring->sqes != NULL)
+    {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ptr != NULL)
+    {
+        munmap(ring->cq_ptr, ring->cq_size);
+    }
+    if (ring->sq_ptr != NULL)
+    {
+        munmap(ring->sq_ptr, ring->sq_size);
+    }
+    close(ring->fd);
+    /* After the ring is gone, so nothing is read into it anymore */
+    if (ring->pool != NULL)
+    {
+        munmap(ring->pool, RING_BUFFERS * RING_BUFFER_SIZE);
+    }
+    while (ring->accepted_cnt > 0)
+    {
+        socket_t sock = ring->accepted[--ring->accepted_cnt].sock;
+        if (sock >= 0)
+        {
+            socket_close(sock);
+        }
+    }
+    free(ring->accepted);
+    free(ring->index);
+    free(ring->dirty);
+    free(ring->ready);
+    free(ring);
+}
+
+static unsigned int ring_unsubmitted(ring_t* ring)
+{
+    return ring->tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+}
+
+/* Returns a cleared entry that is submitted by the next ring_enter */
+static struct io_uring_sqe* ring_sqe(ring_t* ring)
+{
+    struct io_uring_sqe* sqe;
+    unsigned int idx;
+    while (ring_unsubmitted(ring) >= ring->sq_entries)
+    {
+        /* Full, submit what is there without waiting for anything */
+        if (ring_enter(ring, ring->sq_entries, 0, 0, NULL, 0) < 0 &&
+            errno != EINTR && errno != EAGAIN && errno != EBUSY)
+        {
+            return NULL;
+        }
+    }
+    idx = ring->tail & ring->sq_mask;
+    sqe = ring->sqes + idx;
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[idx] = idx;
+    return sqe;
+}
+
+static void ring_push(ring_t* ring)
+{
+    __atomic_store_n(ring->sq_tail, ++ring->tail, __ATOMIC_RELEASE);
+}
+
+static uint32_t poll_events(uint32_t events)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    /* The kernel swaps the halves of poll32_events on big endian */
+    return (events << 16) | (events >> 16);
+#else
+    return events;
+#endif
+}
+
+static uint64_t ring_userdata(client_t* c)
+{
+    return ((uint64_t)c->seq << 32) | (uint32_t)c->sock;
+}
+
+/* Never 0 so neither is any user_data, 0 is used for the entries which
+ * completions are ignored */
+static uint32_t ring_next_seq(ring_t* ring)
+{
+    ring->seq = (ring->seq + 1) & SEQ_MASK;
+    if (ring->seq == 0)
+    {
+        ring->seq = 1;
+    }
+    return ring->seq;
+}
+
+static void ring_arm(ring_t* ring, client_t* c, uint32_t events)
+{
+    struct io_uring_sqe* sqe = ring_sqe(ring);
+    if (sqe == NULL)
+    {
+        return;
+    }
+    c->seq = ring_next_seq(ring);
+    c->armed = events;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = c->sock;
+    sqe->poll32_events = poll_events(events);
+    sqe->user_data = ring_userdata(c) | UD_POLL;
+    ring_push(ring);
+}
+
+void ring_disarm(ring_t* ring, client_t* c)
+{
+    struct io_uring_sqe* sqe = ring_sqe(ring);
+    c->armed = 0;
+    if (sqe == NULL)
+    {
+        return;
+    }
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = ring_userdata(c) | UD_POLL;
+    sqe->user_data = 0;
+    ring_push(ring);
+}
+
+static void ring_accept(ring_t* ring, client_t* c)
+{
+    struct io_uring_sqe* sqe = ring_sqe(ring);
+    if (sqe == NULL)
+    {
+        return;
+    }
+    c->seq = ring_next_seq(ring);
+    c->armed = POLLIN;
+    c->accepting = true;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = c->sock;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = ring_userdata(c) | UD_ACCEPT;
+    ring_push(ring);
+}
+
+static void ring_cancel(ring_t* ring, uint64_t user_data)
+{
+    struct io_uring_sqe* sqe = ring_sqe(ring);
+    if (sqe == NULL)
+    {
+        return;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = user_data;
+    sqe->user_data = 0;
+    ring_push(ring);
+}
+
+/* Submitted right away, so that the ring stops taking connections that
+ * are for someone else now */
+void ring_stop_accept(ring_t* ring, client_t* c)
+{
+    ring_cancel(ring, ring_userdata(c) | UD_ACCEPT);
+    c->armed = 0;
+    c->accepting = false;
+    ring_enter(ring, ring_unsubmitted(ring), 0, 0, NULL, 0);
+}
+
+void ring_set_index(ring_t* ring, socket_t sock, size_t idx)
+{
+    assert(sock >= 0);
+    if ((size_t)sock >= ring->index_size)
+    {
+        size_t ns = ring->index_size * 2;
+        size_t* tmp;
+        if (ns < 64)
+            ns = 64;
+        if (ns <= (size_t)sock)
+            ns = (size_t)sock + 1;
+        tmp = realloc(ring->index, ns * sizeof(size_t));
+        if (tmp == NULL)
+        {
+            assert(false);
+            return;
+        }
+        memset(tmp + ring->index_size, 0xff,
+               (ns - ring->index_size) * sizeof(size_t));
+        ring->index = tmp;
+        ring->index_size = ns;
+    }
+    ring->index[sock] = idx;
+}
+
+void ring_dirty(ring_t* ring, client_t* c)
+{
+    if (!c->dirty &&
+        push_sock(&ring->dirty, &ring->dirty_cnt, &ring->dirty_alloc, c->sock))
+    {
+        c->dirty = true;
+    }
+}
+
+/* Dispatched by the tick, if the client still wants it then */
+static void ring_ready(ring_t* ring, client_t* c, uint32_t events)
+{
+    c->revents |= events;
+    push_sock(&ring->ready, &ring->ready_cnt, &ring->ready_alloc, c->sock);
+}
+
+void ring_want(selector_t selector, socket_t sock, uint32_t events,
+               bool check)
+{
+    client_t* c = find_client(selector, sock, NULL);
+    uint32_t want;
+    if (c == NULL || c->delete)
+    {
+        return;
+    }
+    want = check ? (c->want | events) : (c->want & ~events);
+    if (want != c->want)
+    {
+        c->want = want;
+        if (c->accepting && !(want & POLLIN))
+        {
+            ring_stop_accept(selector->ring, c);
+        }
+        ring_dirty(selector->ring, c);
+    }
+}
+
+/* Map the buffers of the streams. Registering them makes the kernel pin
+ * them, which may be over the limit of locked memory, they can still be
+ * used without that */
+static bool ring_pool(ring_t* ring)
+{
+    struct iovec iov;
+    unsigned int i;
+    if (ring->pool != NULL)
+    {
+        return true;
+    }
+    if (ring->pool_failed)
+    {
+        return false;
+    }
+    ring->pool = mmap(NULL, RING_BUFFERS * RING_BUFFER_SIZE,
+                      PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                      -1, 0);
+    if (ring->pool == MAP_FAILED)
+    {
+        ring->pool = NULL;
+        ring->pool_failed = true;
+        return false;
+    }
+    iov.iov_base = ring->pool;
+    iov.iov_len = RING_BUFFERS * RING_BUFFER_SIZE;
+    ring->registered = syscall(__NR_io_uring_register, ring->fd,
+                               IORING_REGISTER_BUFFERS, &iov, 1) == 0;
+    for (i = 0; i < RING_BUFFERS; ++i)
+    {
+        ring->buf[i].data = ring->pool + i * RING_BUFFER_SIZE;
+        ring->free_buf[i] = RING_BUFFERS - 1 - i;
+    }
+    ring->free_cnt = RING_BUFFERS;
+    return true;
+}
+
+static unsigned int ring_take_buf(ring_t* ring, stream_t* s)
+{
+    unsigned int idx = ring->free_buf[--ring->free_cnt];
+    ring->buf[idx].stream = s;
+    return idx;
+}
+
+/* A busy buffer is freed when its entry completes */
+static void ring_put_buf(ring_t* ring, unsigned int idx)
+{
+    ring->buf[idx].stream = NULL;
+    if (!ring->buf[idx].busy)
+    {
+        ring->free_buf[ring->free_cnt++] = idx;
+    }
+}
+
+static uint64_t ring_io_userdata(ring_t* ring, unsigned int idx)
+{
+    return UD_IO | ((uint64_t)ring->buf[idx].gen << 32) | idx;
+}
+
+static bool ring_io(ring_t* ring, unsigned int idx, socket_t sock,
+                    bool write, size_t offset, size_t size)
+{
+    ring_buf_t* b = ring->buf + idx;
+    struct io_uring_sqe* sqe = ring_sqe(ring);
+    if (sqe == NULL)
+    {
+        return false;
+    }
+    if (ring->registered)
+    {
+        sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+        sqe->buf_index = 0;
+    }
+    else
+    {
+        sqe->opcode = write ? IORING_OP_SEND : IORING_OP_RECV;
+        sqe->msg_flags = write ? MSG_NOSIGNAL : 0;
+    }
+    sqe->fd = sock;
+    sqe->addr = (uint64_t)(uintptr_t)(b->data + offset);
+    sqe->len = size;
+    b->gen = ring_next_seq(ring);
+    b->busy = true;
+    sqe->user_data = ring_io_userdata(ring, idx);
+    ring_push(ring);
+    return true;
+}
+
+static void stream_read(ring_t* ring, stream_t* s)
+{
+    s->rpos = 0;
+    s->rlen = 0;
+    s->reading = ring_io(ring, s->rbuf, s->sock, false, 0,
+                         RING_BUFFER_SIZE);
+}
+
+static void stream_write(ring_t* ring, stream_t* s)
+{
+    s->writing = ring_io(ring, s->wbuf, s->sock, true, s->wpos,
+                         s->wlen - s->wpos);
+    if (!s->writing)
+    {
+        s->werr = errno != 0 ? errno : EIO;
+    }
+}
+
+stream_t* ring_stream(selector_t selector, socket_t sock)
+{
+    ring_t* ring = selector->ring;
+    client_t* c = find_client(selector, sock, NULL);
+    stream_t* s;
+    if (c == NULL || c->delete || c->accept_callback != NULL)
+    {
+        return NULL;
+    }
+    if (c->stream != NULL)
+    {
+        return c->stream;
+    }
+    if (!ring_pool(ring) || ring->free_cnt < 2)
+    {
+        return NULL;
+    }
+    s = calloc(1, sizeof(stream_t));
+    if (s == NULL)
+    {
+        return NULL;
+    }
+    s->sock = sock;
+    s->rbuf = ring_take_buf(ring, s);
+    s->wbuf = ring_take_buf(ring, s);
+    if (c->armed != 0)
+    {
+        ring_disarm(ring, c);
+    }
+    c->stream = s;
+    ring_dirty(ring, c);
+    return s;
+}
+
+/* Same as close, what selector_send took is still sent. The entries of
+ * the stream are submitted right away, the socket is closed next */
+void stream_free(ring_t* ring, client_t* c)
+{
+    stream_t* s = c->stream;
+    c->stream = NULL;
+    if (s->reading)
+    {
+        ring_cancel(ring, ring_io_userdata(ring, s->rbuf));
+    }
+    if (s->reading || s->writing)
+    {
+        ring_enter(ring, ring_unsubmitted(ring), 0, 0, NULL, 0);
+    }
+    ring_put_buf(ring, s->rbuf);
+    if (s->writing)
+    {
+        s->sock = fcntl(s->sock, F_DUPFD_CLOEXEC, 0);
+        if (s->sock >= 0)
+        {
+            s->orphan = true;
+            return;
+        }
+    }
+    ring_put_buf(ring, s->wbuf);
+    free(s);
+}
+
+ssize_t stream_recv(ring_t* ring, stream_t* s, void* data, size_t size)
+{
+    if (s->rlen > 0)
+    {
+        if (size > s->rlen)
+        {
+            size = s->rlen;
+        }
+        memcpy(data, ring->buf[s->rbuf].data + s->rpos, size);
+        s->rpos += size;
+        s->rlen -= size;
+        if (s->rlen == 0 && !s->eof && s->rerr == 0)
+        {
+            /* The next is likely on its way already */
+            stream_read(ring, s);
+        }
+        return size;
+    }
+    if (s->rerr != 0)
+    {
+        errno = s->rerr;
+        return -1;
+    }
+    if (s->eof)
+    {
+        return 0;
+    }
+    if (!s->reading)
+    {
+        stream_read(ring, s);
+    }
+    errno = EAGAIN;
+    return -1;
+}
+
+ssize_t stream_send(ring_t* ring, stream_t* s, const void* data, size_t size)
+{
+    if (s->werr != 0)
+    {
+        errno = s->werr;
+        return -1;
+    }
+    if (s->writing)
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+    if (size > RING_BUFFER_SIZE)
+    {
+        size = RING_BUFFER_SIZE;
+    }
+    memcpy(ring->buf[s->wbuf].data, data, size);
+    s->wpos = 0;
+    s->wlen = size;
+    stream_write(ring, s);
+    if (!s->writing)
+    {
+        errno = s->werr;
+        return -1;
+    }
+    return size;
+}
+
+/* The completion of a read or write of a stream */
+static void ring_io_done(selector_t selector, struct io_uring_cqe* cqe)
+{
+    ring_t* ring = selector->ring;
+    unsigned int idx = (uint32_t)cqe->user_data;
+    uint32_t events;
+    ring_buf_t* b;
+    stream_t* s;
+    client_t* c;
+
+    if (idx >= RING_BUFFERS)
+    {
+        return;
+    }
+    b = ring->buf + idx;
+    if (!b->busy || b->gen != ((cqe->user_data >> 32) & SEQ_MASK))
+    {
+        return;
+    }
+    b->busy = false;
+    s = b->stream;
+    if (s == NULL)
+    {
+        ring->free_buf[ring->free_cnt++] = idx;
+        return;
+    }
+    if (idx == s->rbuf)
+    {
+        s->reading = false;
+        if (cqe->res > 0)
+        {
+            s->rlen = cqe->res;
+        }
+        else if (cqe->res == 0)
+        {
+            s->eof = true;
+        }
+        else if (cqe->res != -ECANCELED)
+        {
+            s->rerr = -cqe->res;
+        }
+        events = POLLIN;
+    }
+    else
+    {
+        s->writing = false;
+        if (cqe->res > 0)
+        {
+            s->wpos += cqe->res;
+            if (s->wpos < s->wlen)
+            {
+                /* Sockets take what fits, the rest goes when there is
+                 * room again */
+                stream_write(ring, s);
+                if (s->writing)
+                {
+                    return;
+                }
+            }
+        }
+        else
+        {
+            s->werr = cqe->res < 0 ? -cqe->res : EPIPE;
+        }
+        if (s->orphan)
+        {
+            socket_close(s->sock);
+            ring_put_buf(ring, s->wbuf);
+            free(s);
+            return;
+        }
+        events = POLLOUT;
+    }
+    if (s->rerr != 0 || s->werr != 0)
+    {
+        events |= POLLERR;
+    }
+    c = find_client(selector, s->sock, NULL);
+    if (c != NULL && !c->delete && c->want != 0)
+    {
+        ring_ready(ring, c, events);
+    }
+}
+
+/* The completion of a multishot accept. A connection that no one wants
+ * anymore is closed */
+static void ring_accept_done(selector_t selector, struct io_uring_cqe* cqe)
+{
+    ring_t* ring = selector->ring;
+    client_t* c = find_client(selector, (socket_t)(uint32_t)cqe->user_data,
+                              NULL);
+    accepted_t* a;
+    bool current;
+
+    if (c == NULL || c->delete || c->accept_callback == NULL)
+    {
+        if (cqe->res >= 0)
+        {
+            socket_close(cqe->res);
+        }
+        return;
+    }
+    current = c->accepting &&
+        c->seq == ((cqe->user_data >> 32) & SEQ_MASK);
+    if (current && !(cqe->flags & IORING_CQE_F_MORE))
+    {
+        c->armed = 0;
+        c->accepting = false;
+        ring_dirty(ring, c);
+    }
+    if (cqe->res < 0)
+    {
+        if (!current || cqe->res == -ECANCELED)
+        {
+            return;
+        }
+        if (cqe->res == -EINVAL)
+        {
+            /* Too old for multishot, poll instead */
+            ring->no_multishot = true;
+            return;
+        }
+    }
+    if (ring->accepted_cnt == ring->accepted_alloc)
+    {
+        size_t na = ring->accepted_alloc * 2;
+        if (na < 16)
+            na = 16;
+        a = realloc(ring->accepted, na * sizeof(accepted_t));
+        if (a == NULL)
+        {
+            if (cqe->res >= 0)
+            {
+                socket_close(cqe->res);
+            }
+            return;
+        }
+        ring->accepted = a;
+        ring->accepted_alloc = na;
+    }
+    a = ring->accepted + ring->accepted_cnt++;
+    a->listener = c->sock;
+    a->sock = cqe->res >= 0 ? cqe->res : -1;
+    a->err = cqe->res >= 0 ? 0 : -cqe->res;
+}
+
+/* A stream is ready as long as it has something for a callback that
+ * wants it, and gets a read going when it has nothing to read */
+static void stream_update(ring_t* ring, client_t* c)
+{
+    stream_t* s = c->stream;
+    uint32_t ready = 0;
+    if (s->rerr != 0 || s->werr != 0)
+    {
+        ready |= POLLERR;
+    }
+    if (c->want & POLLIN)
+    {
+        if (s->rlen > 0 || s->eof)
+        {
+            ready |= POLLIN;
+        }
+        else if (!s->reading && ready == 0)
+        {
+            stream_read(ring, s);
+        }
+    }
+    if ((c->want & POLLOUT) && !s->writing)
+    {
+        ready |= POLLOUT;
+    }
+    if (ready != 0 && c->want != 0)
+    {
+        ring_ready(ring, c, ready);
+    }
+}
+
+/* Queue the poll changes made since the last tick */
+static void ring_update(selector_t selector)
+{
+    ring_t* ring = selector->ring;
+    size_t i;
+    for (i = 0; i < ring->dirty_cnt; ++i)
+    {
+        client_t* c = find_client(selector, ring->dirty[i], NULL);
+        if (c == NULL || !c->dirty)
+        {
+            continue;
+        }
+        c->dirty = false;
+        if (c->delete)
+        {
+            continue;
+        }
+        if (c->stream != NULL)
+        {
+            stream_update(ring, c);
+            continue;
+        }
+        if (c->accept_callback != NULL && !ring->no_multishot)
+        {
+            if ((c->want & POLLIN) && c->armed == 0)
+            {
+                ring_accept(ring, c);
+            }
+            continue;
+        }
+        if (c->armed != 0 && (c->want & ~c->armed) != 0)
+        {
+            /* Events missing, replace the poll. An armed poll with events
+             * no longer wanted is left alone, ring_tick ignores them */
+            ring_disarm(ring, c);
+        }
+        if (c->armed == 0 && c->want != 0)
+        {
+            ring_arm(ring, c, c->want);
+        }
+    }
+    ring->dirty_cnt = 0;
+}
+
+/* Take the completions from the ring, the callbacks are called by
+ * ring_tick */
+static void ring_reap(selector_t selector)
+{
+    ring_t* ring = selector->ring;
+    unsigned int head, tail;
+    client_t* c;
+
+    head = *ring->cq_head;
+    tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head)
+    {
+        struct io_uring_cqe* cqe = ring->cqes + (head & ring->cq_mask);
+        if (cqe->user_data == 0)
+        {
+            continue;
+        }
+        switch (cqe->user_data & UD_KIND)
+        {
+        case UD_IO:
+            ring_io_done(selector, cqe);
+            continue;
+        case UD_ACCEPT:
+            ring_accept_done(selector, cqe);
+            continue;
+        }
+        c = find_client(selector, (socket_t)(uint32_t)cqe->user_data, NULL);
+        if (c == NULL || c->armed == 0 || c->accepting ||
+            c->seq != ((cqe->user_data >> 32) & SEQ_MASK))
+        {
+            /* Removed or replaced since */
+            continue;
+        }
+        c->armed = 0;
+        c->revents |= cqe->res < 0 ? POLLERR : (uint32_t)cqe->res;
+        ring_dirty(ring, c);
+        push_sock(&ring->ready, &ring->ready_cnt, &ring->ready_alloc,
+                  c->sock);
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/* Wait for the read of the stream to be canceled, the ring may have
+ * read something before that */
+bool stream_idle(selector_t selector, stream_t* s)
+{
+    ring_t* ring = selector->ring;
+    if (s->reading)
+    {
+        ring_cancel(ring, ring_io_userdata(ring, s->rbuf));
+        while (s->reading)
+        {
+            if (ring_enter(ring, ring_unsubmitted(ring), 1,
+                           IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+                errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            {
+                return false;
+            }
+            ring_reap(selector);
+        }
+    }
+    return !s->writing && s->rlen == 0 && !s->eof &&
+        s->rerr == 0 && s->werr == 0;
+}
+
+bool ring_tick(selector_t selector, unsigned long timeout_ms)
+{
+    ring_t* ring = selector->ring;
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    client_t* c;
+    size_t i, idx;
+
+    ring_update(selector);
+
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (timeout_ms % 1000) * 1000000;
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = (uint64_t)(uintptr_t)&ts;
+    if (ring_enter(ring, ring_unsubmitted(ring),
+                   timeout_ms > 0 && ring->ready_cnt == 0 &&
+                   ring->accepted_cnt == 0 ? 1 : 0,
+                   IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                   &arg, sizeof(arg)) < 0)
+    {
+        /* Interrupted, timed out or the completion queue overflowed,
+         * which all still means that there may be completions to reap */
+        if (errno != EINTR && errno != ETIME && errno != EAGAIN &&
+            errno != EBUSY)
+        {
+            return false;
+        }
+    }
+
+    ring_reap(selector);
+
+    woke_up(selector);
+
+    for (i = 0; i < ring->accepted_cnt; ++i)
+    {
+        accepted_t a = ring->accepted[i];
+        c = find_client(selector, a.listener, &idx);
+        if (c == NULL || c->delete || c->accept_callback == NULL)
+        {
+            if (a.sock >= 0)
+            {
+                socket_close(a.sock);
+            }
+            continue;
+        }
+        selector->tick_pos = idx;
+        errno = a.err;
+        c->accept_callback(c->userdata, c->sock, a.sock);
+    }
+    ring->accepted_cnt = 0;
+
+    for (i = 0; i < ring->ready_cnt; ++i)
+    {
+        uint32_t revents;
+        c = find_client(selector, ring->ready[i], &idx);
+        if (c == NULL)
+        {
+            continue;
+        }
+        revents = c->revents;
+        c->revents = 0;
+        selector->tick_pos = idx;
+        /* Same as select, errors and hangups are both readable and
+         * writable */
+        if ((revents & (POLLIN | POLLERR | POLLHUP)) &&
+            (c->want & POLLIN) && !c->delete)
+        {
+            dispatch_read(c);
+            c = selector->client + idx;
+        }
+        if ((revents & (POLLOUT | POLLERR | POLLHUP)) &&
+            (c->want & POLLOUT) && !c->delete)
+        {
+            c->write_callback(c->userdata, c->sock);
+            c = selector->client + idx;
+        }
+        if (c->stream != NULL && !c->delete && revents != 0)
+        {
+            /* Still ready next tick if the callbacks left anything */
+            ring_dirty(ring, c);
+        }
+    }
+    ring->ready_cnt = 0;
 
     return true;
 }
+
+#endif /* HAVE_IO_URING */
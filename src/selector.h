@@ -33,17 +33,36 @@
 typedef struct _selector_t* selector_t;
 
 #include "socket.h"
+#include "timers.h"
 
 typedef void (* read_callback_t)(void* userdata, socket_t sock);
 typedef void (* write_callback_t)(void* userdata, socket_t sock);
+/* client is the accepted connection, or -1 if accepting failed and then
+ * socket_strerror(sock) tells why */
+typedef void (* accept_callback_t)(void* userdata, socket_t sock,
+                                   socket_t client);
 
+/* Waits with io_uring if configure found it and the kernel allows it,
+ * select otherwise */
 selector_t selector_new(void);
+/* Always uses select */
+selector_t selector_new_select(void);
+
+/* "io_uring" or "select" */
+const char* selector_backend(selector_t selector);
 
 void selector_add(selector_t selector, socket_t sock,
                   void* userdata,
                   read_callback_t read_callback,
                   write_callback_t write_callback);
 
+/* sock is listening, accept_callback is called with each connection
+ * accepted on it. With io_uring a multishot accept in the ring accepts
+ * them, a connection it accepts while sock is removed is closed.
+ * selector_chkread stops and resumes accepting */
+void selector_add_listener(selector_t selector, socket_t sock,
+                           void* userdata, accept_callback_t accept_callback);
+
 /* This function does not check if you set a write_callback back when calling
  * add. If you set check_write to true and then have write_callback == NULL
  * you just caused a segfault. */
@@ -56,6 +75,36 @@ void selector_chkwrite(selector_t selector, socket_t sock,
 
 void selector_remove(selector_t selector, socket_t sock);
 
+/* Same as socket_read and socket_write for a connected stream socket that
+ * is added. With io_uring the ring reads from and writes to sock with
+ * buffers of the selector, while there are any left. selector_send then
+ * returns when the data is copied, and the write callback is called when
+ * it is sent. The read callback is called when something was read, and
+ * selector_recv returns that */
+ssize_t selector_recv(selector_t selector, socket_t sock,
+                      void* data, size_t size);
+ssize_t selector_send(selector_t selector, socket_t sock,
+                      const void* data, size_t size);
+/* Stops the read the ring has going on sock, if any, and returns false
+ * if the selector has data from sock that selector_recv hasn't returned
+ * yet or data for sock that isn't sent yet. Then sock can be handed to
+ * someone else without losing anything, once it's removed */
+bool selector_idle(selector_t selector, socket_t sock);
+
+/* Read callbacks should stop after about budget bytes (default 64 KiB)
+ * and call selector_requeue if there is more to read, so that the other
+ * ready sockets get their turn */
+void selector_set_budget(selector_t selector, size_t budget);
+size_t selector_budget(selector_t selector);
+/* Call the read callback of sock again next tick, after the sockets that
+ * are ready then, even if sock isn't. The tick doesn't wait for events
+ * while there are requeued callbacks */
+void selector_requeue(selector_t selector, socket_t sock);
+
+/* The clock of timers is updated when the tick is done waiting, before
+ * any callback is called, so timers_now is current in the callbacks */
+void selector_set_timers(selector_t selector, timers_t timers);
+
 void selector_free(selector_t selector);
 
 /* timeout_ms == 0 means no timeout */
@@ -0,0 +1,388 @@
+/*
+ * Copyright (C) 2011, Joel Klinghed.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the project nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE PROJECT AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE PROJECT OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "common.h"
+
+#include "slotmap.h"
+#include <string.h>
+
+/* The generation lives in the low bits so that the IDs of the first few
+ * hundred slots stay small, they are sent as varints */
+#define GEN_BITS (8)
+#define GEN_MASK ((1u << GEN_BITS) - 1)
+#define MAX_SLOTS (((uint32_t)~0) >> GEN_BITS)
+#define NO_SLOT ((uint32_t)~0)
+
+/* Elements are stored in chunks of this many, so that they never move */
+#define CHUNK_BITS (6)
+#define CHUNK_SLOTS (1u << CHUNK_BITS)
+#define CHUNK_MASK (CHUNK_SLOTS - 1)
+
+/* A freed slot is only reused once this many others are free. As the free
+ * slots are reused oldest first, a slot comes back at most every
+ * REUSE_AFTER removals and an ID only repeats after GEN_MASK times that */
+#define REUSE_AFTER (64)
+
+typedef struct _slot_t
+{
+    /* Never 0 */
+    uint32_t gen;
+    /* The list of free slots, NO_SLOT when in use */
+    uint32_t prev, next;
+    bool used;
+} slot_t;
+
+struct _slotmap_t
+{
+    size_t count, slots, limit, elementsize;
+    /* Free slots, oldest first. NO_SLOT if there is none */
+    uint32_t free_head, free_tail;
+    size_t free_cnt;
+    slotmap_free_t free_func;
+    slot_t* slot;
+    /* limit / CHUNK_SLOTS chunks of elements */
+    char** chunk;
+};
+
+static slot_t* get_slot(slotmap_t map, uint32_t id);
+
+slotmap_t slotmap_new(size_t elementsize, slotmap_free_t free_func)
+{
+    slotmap_t map;
+    assert(elementsize > 0);
+    map = calloc(1, sizeof(struct _slotmap_t));
+    map->elementsize = elementsize;
+    map->free_func = free_func;
+    map->free_head = NO_SLOT;
+    map->free_tail = NO_SLOT;
+    return map;
+}
+
+static void* slot_data(slotmap_t map, size_t idx)
+{
+    return map->chunk[idx >> CHUNK_BITS] +
+        (idx & CHUNK_MASK) * map->elementsize;
+}
+
+void slotmap_free(slotmap_t map)
+{
+    size_t i;
+
+    if (map == NULL)
+    {
+        return;
+    }
+
+    if (map->free_func != NULL)
+    {
+        for (i = 0; i < map->slots; i++)
+        {
+            if (map->slot[i].used)
+            {
+                map->free_func(slot_data(map, i));
+            }
+        }
+    }
+
+    for (i = 0; i < map->limit / CHUNK_SLOTS; i++)
+    {
+        free(map->chunk[i]);
+    }
+    free(map->chunk);
+    free(map->slot);
+    free(map);
+}
+
+size_t slotmap_size(slotmap_t map)
+{
+    return map->count;
+}
+
+static bool grow(slotmap_t map)
+{
+    size_t ns = map->limit * 2, nc, i;
+    slot_t* tmp;
+    char** chunk;
+    if (ns < CHUNK_SLOTS)
+    {
+        ns = CHUNK_SLOTS;
+    }
+    if (ns > MAX_SLOTS)
+    {
+        ns = MAX_SLOTS & ~CHUNK_MASK;
+    }
+    if (ns == map->limit)
+    {
+        return false;
+    }
+    nc = ns / CHUNK_SLOTS;
+    chunk = realloc(map->chunk, nc * sizeof(char*));
+    if (chunk == NULL)
+    {
+        return false;
+    }
+    map->chunk = chunk;
+    for (i = map->limit / CHUNK_SLOTS; i < nc; i++)
+    {
+        chunk[i] = malloc(CHUNK_SLOTS * map->elementsize);
+        if (chunk[i] == NULL)
+        {
+            for (; i > map->limit / CHUNK_SLOTS; i--)
+            {
+                free(chunk[i - 1]);
+            }
+            return false;
+        }
+    }
+    tmp = realloc(map->slot, ns * sizeof(slot_t));
+    if (tmp == NULL)
+    {
+        for (i = map->limit / CHUNK_SLOTS; i < nc; i++)
+        {
+            free(chunk[i]);
+        }
+        return false;
+    }
+    map->slot = tmp;
+    map->limit = ns;
+    return true;
+}
+
+static void free_push(slotmap_t map, size_t idx)
+{
+    slot_t* slot = map->slot + idx;
+    slot->used = false;
+    slot->prev = map->free_tail;
+    slot->next = NO_SLOT;
+    if (map->free_tail != NO_SLOT)
+    {
+        map->slot[map->free_tail].next = idx;
+    }
+    else
+    {
+        map->free_head = idx;
+    }
+    map->free_tail = idx;
+    map->free_cnt++;
+}
+
+static void free_unlink(slotmap_t map, size_t idx)
+{
+    slot_t* slot = map->slot + idx;
+    assert(!slot->used);
+    if (slot->prev != NO_SLOT)
+    {
+        map->slot[slot->prev].next = slot->next;
+    }
+    else
+    {
+        map->free_head = slot->next;
+    }
+    if (slot->next != NO_SLOT)
+    {
+        map->slot[slot->next].prev = slot->prev;
+    }
+    else
+    {
+        map->free_tail = slot->prev;
+    }
+    slot->prev = NO_SLOT;
+    slot->next = NO_SLOT;
+    slot->used = true;
+    map->free_cnt--;
+}
+
+/* Add free slots until there is one at idx */
+static bool add_slots(slotmap_t map, size_t idx)
+{
+    if (idx >= MAX_SLOTS)
+    {
+        return false;
+    }
+    while (map->slots <= idx)
+    {
+        if (map->slots == map->limit && !grow(map))
+        {
+            return false;
+        }
+        map->slot[map->slots].gen = 1;
+        free_push(map, map->slots++);
+    }
+    return true;
+}
+
+void* slotmap_put(slotmap_t map, const void* element, uint32_t* id)
+{
+    size_t idx;
+    slot_t* slot;
+    void* data;
+
+    if (map->free_cnt > REUSE_AFTER ||
+        (map->slots == map->limit && !grow(map)))
+    {
+        if (map->free_head == NO_SLOT)
+        {
+            assert(false);
+            return NULL;
+        }
+        idx = map->free_head;
+        free_unlink(map, idx);
+    }
+    else
+    {
+        idx = map->slots++;
+        slot = map->slot + idx;
+        slot->gen = 1;
+        slot->prev = NO_SLOT;
+        slot->next = NO_SLOT;
+        slot->used = true;
+    }
+
+    data = slot_data(map, idx);
+    memcpy(data, element, map->elementsize);
+    map->count++;
+    *id = ((uint32_t)idx << GEN_BITS) | map->slot[idx].gen;
+    return data;
+}
+
+void* slotmap_put_id(slotmap_t map, const void* element, uint32_t id)
+{
+    size_t idx = id >> GEN_BITS;
+    void* data;
+    if ((id & GEN_MASK) == 0 || !add_slots(map, idx) ||
+        map->slot[idx].used)
+    {
+        return NULL;
+    }
+    free_unlink(map, idx);
+
+    map->slot[idx].gen = id & GEN_MASK;
+    data = slot_data(map, idx);
+    memcpy(data, element, map->elementsize);
+    map->count++;
+    return data;
+}
+
+void slotmap_retire(slotmap_t map, uint32_t id)
+{
+    size_t idx = id >> GEN_BITS;
+    slot_t* slot;
+    if ((id & GEN_MASK) == 0 || !add_slots(map, idx))
+    {
+        return;
+    }
+    slot = map->slot + idx;
+    if (!slot->used)
+    {
+        slot->gen = (id & GEN_MASK) + 1;
+        if (slot->gen > GEN_MASK)
+        {
+            slot->gen = 1;
+        }
+    }
+}
+
+slot_t* get_slot(slotmap_t map, uint32_t id)
+{
+    size_t idx = id >> GEN_BITS;
+    if (idx >= map->slots || !map->slot[idx].used ||
+        map->slot[idx].gen != (id & GEN_MASK))
+    {
+        return NULL;
+    }
+    return map->slot + idx;
+}
+
+void* slotmap_get(slotmap_t map, uint32_t id)
+{
+    slot_t* slot = get_slot(map, id);
+    return slot != NULL ? slot_data(map, slot - map->slot) : NULL;
+}
+
+bool slotmap_remove(slotmap_t map, uint32_t id)
+{
+    slot_t* slot = get_slot(map, id);
+    size_t idx;
+    if (slot == NULL)
+    {
+        return false;
+    }
+    /* Free the slot before calling free_func so that the ID is already
+     * stale if free_func looks it up. It goes last in the list of free
+     * slots, so a put from free_func can't hand out the element that is
+     * being freed */
+    idx = slot - map->slot;
+    if (++slot->gen > GEN_MASK)
+    {
+        slot->gen = 1;
+    }
+    free_push(map, idx);
+    map->count--;
+    if (map->free_func != NULL)
+    {
+        map->free_func(slot_data(map, idx));
+    }
+    return true;
+}
+
+void* slotmap_getat(slotmap_t map, size_t idx)
+{
+    assert(idx < map->slots);
+    return map->slot[idx].used ? slot_data(map, idx) : NULL;
+}
+
+size_t slotmap_begin(slotmap_t map)
+{
+    size_t idx = 0;
+    while (idx < map->slots && !map->slot[idx].used)
+    {
+        ++idx;
+    }
+    return idx;
+}
+
+size_t slotmap_end(slotmap_t map)
+{
+    return map->slots;
+}
+
+size_t slotmap_next(slotmap_t map, size_t idx)
+{
+    assert(idx <= map->slots);
+    if (idx == map->slots)
+    {
+        return idx;
+    }
+    ++idx;
+    while (idx < map->slots && !map->slot[idx].used)
+    {
+        ++idx;
+    }
+    return idx;
+}
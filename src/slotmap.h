@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2011, Joel Klinghed.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the project nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE PROJECT AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE PROJECT OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef SLOTMAP_H
+#define SLOTMAP_H
+
+/* A table of elements that hands out their IDs. An ID is the index of
+ * the element's slot plus the slot's generation, which is bumped every
+ * time the slot is freed, so looking up an ID that has been removed
+ * returns NULL even if the slot has been reused since. Free slots are
+ * reused oldest first and only once a number of them are free, so the
+ * generation of a slot wraps after thousands of removals rather than
+ * hundreds. 0 is never used as an ID. Elements never move once added */
+
+typedef struct _slotmap_t* slotmap_t;
+typedef void (* slotmap_free_t)(void* element);
+
+/* free_func may be NULL, if it is, it is not called */
+slotmap_t slotmap_new(size_t elementsize, slotmap_free_t free_func);
+
+void slotmap_free(slotmap_t map);
+
+size_t slotmap_size(slotmap_t map);
+
+/* The data in element is copied, the new ID is written to id */
+void* slotmap_put(slotmap_t map, const void* element, uint32_t* id);
+
+/* Put the element at an ID handed out by another map, for taking over
+ * its elements with the same IDs. Returns NULL if the ID is in use */
+void* slotmap_put_id(slotmap_t map, const void* element, uint32_t id);
+
+/* Make sure the ID, handed out by another map, isn't handed out by this
+ * one until the generation of its slot wraps. Nothing happens if the slot
+ * is in use */
+void slotmap_retire(slotmap_t map, uint32_t id);
+
+/* Returns NULL if there is no element with that ID (anymore) */
+void* slotmap_get(slotmap_t map, uint32_t id);
+
+/* Returns false if there is no element with that ID (anymore) */
+bool slotmap_remove(slotmap_t map, uint32_t id);
+
+void* slotmap_getat(slotmap_t map, size_t idx);
+size_t slotmap_begin(slotmap_t map);
+size_t slotmap_end(slotmap_t map);
+size_t slotmap_next(slotmap_t map, size_t idx);
+
+#endif /* SLOTMAP_H */
@@ -436,7 +436,7 @@ socket_t socket_accept(socket_t sock, struct sockaddr** addr, socklen_t* addrlen
         }
         break;
     }
-    if (addr != NULL) *addr = tmp;
+    if (addr != NULL) *addr = tmp; else free(tmp);
     if (addrlen != NULL) *addrlen = tmplen;
     return ret;
 }
@@ -621,6 +621,160 @@ ssize_t socket_write(socket_t sock, const void* data, size_t max)
     }
 }
 
+ssize_t socket_writev(socket_t sock, const struct iovec* iov, int iovcnt)
+{
+    ssize_t ret;
+    for (;;)
+    {
+        ret = writev(sock, iov, iovcnt);
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+        }
+        return ret;
+    }
+}
+
+bool socket_unix_pair(socket_t pair[2])
+{
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+    {
+        return false;
+    }
+    pair[0] = fds[0];
+    pair[1] = fds[1];
+    return true;
+}
+
+#ifdef SCM_RIGHTS
+typedef union
+{
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(sizeof(int) * SOCKET_FDS_MAX)];
+} fds_cmsg_t;
+#endif
+
+bool socket_send_fds(socket_t sock, const void* data, size_t size,
+                     const int* fds, size_t count)
+{
+#ifdef SCM_RIGHTS
+    struct msghdr msg;
+    struct iovec iov;
+    fds_cmsg_t cmsg;
+    ssize_t ret;
+    assert(size > 0 && count <= SOCKET_FDS_MAX);
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = (void*)data;
+    iov.iov_len = size;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (count > 0)
+    {
+        struct cmsghdr* hdr;
+        memset(&cmsg, 0, sizeof(cmsg));
+        msg.msg_control = cmsg.buf;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+        hdr = CMSG_FIRSTHDR(&msg);
+        hdr->cmsg_level = SOL_SOCKET;
+        hdr->cmsg_type = SCM_RIGHTS;
+        hdr->cmsg_len = CMSG_LEN(sizeof(int) * count);
+        memcpy(CMSG_DATA(hdr), fds, sizeof(int) * count);
+    }
+    for (;;)
+    {
+        ret = sendmsg(sock, &msg, 0);
+        if (ret < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        break;
+    }
+    if (ret < 0)
+    {
+        return false;
+    }
+    if ((size_t)ret < size)
+    {
+        /* The descriptors went with the first part */
+        ssize_t wrote = socket_write(sock, (const char*)data + ret,
+                                     size - ret);
+        return wrote >= 0 && (size_t)wrote == size - ret;
+    }
+    return true;
+#else
+    errno = ENOSYS;
+    return false;
+#endif
+}
+
+ssize_t socket_recv_fds(socket_t sock, void* data, size_t size,
+                        int* fds, size_t* count)
+{
+#ifdef SCM_RIGHTS
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr* hdr;
+    fds_cmsg_t cmsg;
+    size_t got = 0;
+    ssize_t ret;
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = data;
+    iov.iov_len = size;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cmsg.buf;
+    msg.msg_controllen = sizeof(cmsg.buf);
+    for (;;)
+    {
+        ret = recvmsg(sock, &msg, 0);
+        if (ret < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        break;
+    }
+    if (ret < 0)
+    {
+        *count = 0;
+        return ret;
+    }
+    for (hdr = CMSG_FIRSTHDR(&msg); hdr != NULL; hdr = CMSG_NXTHDR(&msg, hdr))
+    {
+        size_t n, i;
+        int* in;
+        if (hdr->cmsg_level != SOL_SOCKET || hdr->cmsg_type != SCM_RIGHTS)
+        {
+            continue;
+        }
+        n = (hdr->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        in = (int*)CMSG_DATA(hdr);
+        for (i = 0; i < n; ++i)
+        {
+            int fd;
+            memcpy(&fd, in + i, sizeof(int));
+            if (got < *count)
+            {
+                fds[got++] = fd;
+            }
+            else
+            {
+                close(fd);
+            }
+        }
+    }
+    *count = got;
+    return ret;
+#else
+    *count = 0;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
 ssize_t socket_udp_read(socket_t sock, void* data, size_t max,
                         struct sockaddr* addr, socklen_t* addrlen)
 {
@@ -938,4 +1092,134 @@ bool socket_samehostandport(const struct sockaddr* a1, socklen_t a1len,
     return (a1len == a2len && memcmp(a1, a2, a1len) == 0);
 }
 
+bool parse_location(const char* location, char** proto,
+                    struct sockaddr** host, socklen_t* hostlen, char** path)
+{
+    const char* pos, *last;
+    char* tmp = NULL;
+    uint16_t port;
+    assert(location != NULL);
+    if (proto != NULL) *proto = NULL;
+    if (path != NULL) *path = NULL;
+    if (host != NULL) *host = NULL;
+    if (hostlen != NULL) *hostlen = 0;
+    pos = strstr(location, "://");
+    if (pos == NULL)
+    {
+        if (proto != NULL)
+        {
+            *proto = strdup("http");
+        }
+        last = location;
+    }
+    else
+    {
+        if (proto != NULL)
+        {
+            *proto = strndup(location, pos - location);
+        }
+        last = pos + 3;
+    }
+    pos = strchr(last, '/');
+    if (pos == NULL)
+    {
+        tmp = strdup(last);
+        last = last + strlen(last);
+    }
+    else
+    {
+        tmp = strndup(last, pos - last);
+        last = pos + 1;
+    }
+    if (path != NULL)
+    {
+        *path = strdup(last);
+    }
+    if (tmp[0] == '[')
+    {
+        pos = strstr(tmp, "]:");
+    }
+    else
+    {
+        pos = strchr(tmp, ':');
+    }
+    if (pos == NULL)
+    {
+        /* TODO: Use proto to check the correct default value */
+        port = 80;
+    }
+    else
+    {
+        unsigned long x;
+        char* end;
+        if (*pos == ']') ++pos;
+        tmp[pos - tmp] = '\0';
+        ++pos;
+        errno = 0;
+        x = strtoul(pos, &end, 10);
+        if (errno || !end || (*end != '/' && *end != '\0') || x < 1 || x >= 65535)
+        {
+            free(tmp);
+            return false;
+        }
+        port = (uint16_t)x;
+    }
+    if (host != NULL)
+    {
+        if (tmp[0] == '[')
+        {
+            size_t len = strlen(tmp);
+            if (tmp[len - 1] == ']')
+            {
+                memmove(tmp, tmp + 1, len - 2);
+                tmp[len - 2] = '\0';
+            }
+        }
+        *host = parse_addr(tmp, port, hostlen, false);
+        if (*host == NULL)
+        {
+            free(tmp);
+            return false;
+        }
+    }
+    free(tmp);
+    return true;
+}
+
+char* build_location(const char* proto, const struct sockaddr* host,
+                     socklen_t hostlen, const char* path)
+{
+    char* ret = NULL, * tmp = NULL, * pos;
+    unsigned int port;
+    assert(proto != NULL && host != NULL && path != NULL);
+    assert(*proto != '\0');
+    if (path[0] == '/')
+    {
+        ++path;
+    }
+    asprinthost(&tmp, host, hostlen);
+    pos = strchr(tmp, ':');
+    assert(pos != NULL);
+    port = strtoul(pos + 1, NULL, 10);
+    *pos = '\0';
+    if (addr_is_ipv6(host, hostlen))
+    {
+        if (asprintf(&ret, "%s://[%s]:%u/%s", proto, tmp, port, path) == -1)
+        {
+            free(tmp);
+            return NULL;
+        }
+    }
+    else
+    {
+        if (asprintf(&ret, "%s://%s:%u/%s", proto, tmp, port, path) == -1)
+        {
+            free(tmp);
+            return NULL;
+        }
+    }
+    free(tmp);
+    return ret;
+}
+
 #endif
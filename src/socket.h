@@ -32,6 +32,7 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 
 #ifdef _WIN32
 typedef int socklen_t;
@@ -72,6 +73,7 @@ bool socket_multicast_setttl(socket_t sock, unsigned char ttl);
 
 ssize_t socket_read(socket_t sock, void* data, size_t max);
 ssize_t socket_write(socket_t sock, const void* data, size_t max);
+ssize_t socket_writev(socket_t sock, const struct iovec* iov, int iovcnt);
 
 /* Addr may be NULL */
 ssize_t socket_udp_read(socket_t sock, void* data, size_t max,
@@ -91,6 +93,23 @@ void socket_close(socket_t sock);
 
 bool socket_setblocking(socket_t sock, bool blocking);
 
+/* Most file descriptors sent or received at once by socket_send_fds and
+ * socket_recv_fds */
+#define SOCKET_FDS_MAX (64)
+
+/* A connected pair of UNIX stream sockets, for handing over sockets */
+bool socket_unix_pair(socket_t pair[2]);
+/* Send all size bytes, at least one, and count (at most SOCKET_FDS_MAX)
+ * file descriptors attached to them. The descriptors are duplicated, the
+ * caller still has to close them */
+bool socket_send_fds(socket_t sock, const void* data, size_t size,
+                     const int* fds, size_t count);
+/* Read at most size bytes and the file descriptors attached to them, at
+ * most *count which is set to the number received. Returns the number of
+ * bytes read as socket_read */
+ssize_t socket_recv_fds(socket_t sock, void* data, size_t size,
+                        int* fds, size_t* count);
+
 void asprinthost(char** str, const struct sockaddr* addr, socklen_t addrlen);
 
 bool addr_is_ipv4(const struct sockaddr* addr, socklen_t addrlen);
@@ -120,4 +139,13 @@ bool socket_samehost(const struct sockaddr* a1, socklen_t a1len,
 bool socket_samehostandport(const struct sockaddr* a1, socklen_t a1len,
                             const struct sockaddr* a2, socklen_t a2len);
 
+/* Split an URL like http://host:port/path. proto defaults to http and
+ * port to 80, path is without the leading /. Any of the out arguments may
+ * be NULL, the others are set even if it fails and must be freed */
+bool parse_location(const char* location, char** proto,
+                    struct sockaddr** host, socklen_t* hostlen, char** path);
+/* The URL of path at host, a leading / in path is skipped */
+char* build_location(const char* proto, const struct sockaddr* host,
+                     socklen_t hostlen, const char* path);
+
 #endif /* SOCKET_H */
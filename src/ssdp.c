@@ -33,7 +33,9 @@
 #include "http.h"
 #include "util.h"
 #include "vector.h"
+#include "timeval.h"
 #include <time.h>
+#include <stdarg.h>
 #include <errno.h>
 #include <string.h>
 #include <strings.h>
@@ -60,29 +62,94 @@ struct _ssdp_t
     socklen_t addrbuflen, addrbufsize;
 
     inet_t inet4, inet6;
+    /* As given to ssdp_new or ssdp_rebind */
+    char* bindaddr;
+    uint16_t port;
+
+    /* search_job_t*, busy or waiting to be reused. The idle ones still
+     * know what they answered, see search_duplicate */
+    vector_t search_jobs;
+    /* The search given to search_cb while it runs, the job collecting
+     * the responses to it and the bucket they are taken from */
+    ssdp_search_t* open_search;
+    struct _search_job_t* open_job;
+    struct _search_sender_t* open_sender;
+
+    /* Token buckets of the last senders, rate 0 means no limit */
+    unsigned long search_rate, search_burst;
+    struct _search_sender_t* senders;
+    size_t senders_cnt;
+    /* Sender address without port while looking for its bucket */
+    struct sockaddr* keybuf;
 
-    vector_t search_responses;
+    ssdp_stats_t stats;
 };
 
-typedef struct _search_response_t
+/* Response bytes a sender (address without port) may still get */
+typedef struct _search_sender_t
+{
+    struct sockaddr* addr;
+    socklen_t addrlen;
+    unsigned long tokens;
+    uint64_t refilled, seen;
+} search_sender_t;
+
+/* All responses to one M-SEARCH. They are rendered when added and sent in
+ * batches spread over the MX window by one timer */
+typedef struct _search_job_t
 {
     ssdp_t ssdp;
-    http_resp_t resp;
+    bool busy;
     inet_t* inet;
     struct sockaddr* sender;
     socklen_t senderlen;
+    /* ST, S and MX of the search, with sender they are what makes another
+     * search a duplicate */
+    char* st, *s;
+    unsigned int mx;
+    /* The rendered responses after each other, response i ends at ends[i] */
+    char* data;
+    size_t size, alloc;
+    size_t* ends;
+    size_t count, ends_alloc;
+    /* Next response to send */
+    size_t next;
+    /* Response i is due (i * 1000 + phase) * window / (count * 1000) ms
+     * after start, phase moves them all by a random part of one step */
+    uint64_t start;
+    unsigned long window;
+    unsigned int phase;
     timecb_t timer;
-} search_response_t;
+} search_job_t;
+
+/* Shortest time between two batches of a job */
+static const unsigned long SEARCH_JOB_PACE_MS = 20;
+/* Buffer kept by an idle job, bigger ones are shrunk */
+static const size_t SEARCH_JOB_KEEP = 16 * 1024;
+/* A search is a duplicate while the identical one is being answered, or
+ * at least this long after it came */
+static const unsigned long SEARCH_DUP_MS = 500;
+/* Number of senders with a token bucket, the one not seen for the
+ * longest time is replaced by a new one */
+static const size_t SEARCH_SENDERS = 64;
+/* Searches are dropped while the bucket of the sender has less than this */
+static const unsigned long SEARCH_LIMIT_MIN = 1024;
+
+static const char IPV4_MCAST[] = "239.255.255.250";
+static const char IPV6_MCAST[] = "FF02::C";
 
 static void read_data(void* userdata, socket_t sock);
 static void inet_setup(ssdp_t ssdp, const char* name, inet_t* inet,
                        bool bind, const char* bindaddr,
                        const char* any, const char* mcast,
                        uint16_t port);
+static void inet_listen(ssdp_t ssdp, const char* name, inet_t* inet,
+                        const char* bindaddr, const char* mcast,
+                        uint16_t port);
 static void inet_free(ssdp_t ssdp, inet_t* inet);
 
 ssdp_t ssdp_new(log_t log, selector_t selector, timers_t timers,
-                const char* bindaddr, void* userdata,
+                const char* bindaddr, uint16_t port, void* userdata,
                 ssdp_search_callback_t search_callback,
                 ssdp_search_response_callback_t search_response_callback,
                 ssdp_notify_callback_t notify_callback)
@@ -100,19 +167,22 @@ ssdp_t ssdp_new(log_t log, selector_t selector, timers_t timers,
     ssdp->search_cb = search_callback;
     ssdp->search_response_cb = search_response_callback;
     ssdp->notify_cb = notify_callback;
+    ssdp->bindaddr = bindaddr != NULL ? strdup(bindaddr) : NULL;
+    ssdp->port = port;
 
     inet_setup(ssdp, "IPv4", &(ssdp->inet4),
                bindaddr == NULL || addrstr_is_ipv4(bindaddr), bindaddr,
-               IPV4_ANY, "239.255.255.250", 1900);
+               IPV4_ANY, IPV4_MCAST, port);
     inet_setup(ssdp, "IPv6", &(ssdp->inet6),
                bindaddr == NULL || addrstr_is_ipv6(bindaddr), bindaddr,
-               IPV6_ANY, "FF02::C", 1900);
+               IPV6_ANY, IPV6_MCAST, port);
 
     if (ssdp->inet4.rsock < 0 && ssdp->inet6.rsock < 0)
     {
         log_puts(log, LVL_ERR, "Unable to join any of IPv4 or IPv6 SSDP multicast group");
         inet_free(ssdp, &ssdp->inet4);
         inet_free(ssdp, &ssdp->inet6);
+        free(ssdp->bindaddr);
         free(ssdp);
         return NULL;
     }
@@ -122,13 +192,15 @@ ssdp_t ssdp_new(log_t log, selector_t selector, timers_t timers,
         log_puts(log, LVL_ERR, "Unable to setup sending IPv4 or IPv6 SSDP multicast group");
         inet_free(ssdp, &ssdp->inet4);
         inet_free(ssdp, &ssdp->inet6);
+        free(ssdp->bindaddr);
         free(ssdp);
         return NULL;
     }
 
     ssdp->addrbuf = socket_allocate_addrbuffer(&(ssdp->addrbufsize));
 
-    ssdp->search_responses = vector_new(sizeof(search_response_t*));
+    ssdp->search_jobs = vector_new(sizeof(search_job_t*));
+    ssdp->keybuf = socket_allocate_addrbuffer(NULL);
 
     return ssdp;
 }
@@ -150,37 +222,43 @@ void inet_free(ssdp_t ssdp, inet_t* inet)
     free(inet->notify_host);
 }
 
-void inet_setup(ssdp_t ssdp, const char* name, inet_t* inet,
-                bool bind,
-                const char* bindaddr, const char* any, const char* mcast,
-                uint16_t port)
+void inet_listen(ssdp_t ssdp, const char* name, inet_t* inet,
+                 const char* bindaddr, const char* mcast, uint16_t port)
 {
-    if (bind)
+    inet->rsock = socket_udp_listen(mcast, port);
+    if (inet->rsock >= 0)
     {
-        inet->rsock = socket_udp_listen(mcast, port);
-        if (inet->rsock >= 0)
+        if (!socket_multicast_join(inet->rsock, mcast, bindaddr))
         {
-            if (!socket_multicast_join(inet->rsock, mcast, bindaddr))
-            {
-                log_printf(ssdp->log, LVL_WARN,
-                           "Error joining %s multicast group (%s): %s",
-                           name, mcast, socket_strerror(inet->rsock));
-                socket_close(inet->rsock);
-                inet->rsock = -1;
-            }
-            else
-            {
-                selector_add(ssdp->selector, inet->rsock, ssdp,
-                             read_data, NULL);
-            }
+            log_printf(ssdp->log, LVL_WARN,
+                       "Error joining %s multicast group (%s): %s",
+                       name, mcast, socket_strerror(inet->rsock));
+            socket_close(inet->rsock);
+            inet->rsock = -1;
         }
         else
         {
-            log_printf(ssdp->log, LVL_WARN, "Error listening on %s:%u %s: %s",
-                       mcast, port, name, socket_strerror(inet->rsock));
+            selector_add(ssdp->selector, inet->rsock, ssdp,
+                         read_data, NULL);
         }
     }
     else
+    {
+        log_printf(ssdp->log, LVL_WARN, "Error listening on %s:%u %s: %s",
+                   mcast, port, name, socket_strerror(inet->rsock));
+    }
+}
+
+void inet_setup(ssdp_t ssdp, const char* name, inet_t* inet,
+                bool bind,
+                const char* bindaddr, const char* any, const char* mcast,
+                uint16_t port)
+{
+    if (bind)
+    {
+        inet_listen(ssdp, name, inet, bindaddr, mcast, port);
+    }
+    else
     {
         inet->rsock = -1;
     }
@@ -195,6 +273,65 @@ void inet_setup(ssdp_t ssdp, const char* name, inet_t* inet,
     inet->notify_host = parse_addr(mcast, port, &(inet->notify_hostlen), false);
 }
 
+/* The sending socket is kept as is, so are the jobs answering searches */
+static void inet_rebind(ssdp_t ssdp, const char* name, inet_t* inet,
+                        bool bind, const char* bindaddr, const char* mcast,
+                        uint16_t port)
+{
+    if (inet->rsock >= 0 && bind && port == ssdp->port)
+    {
+        /* Only the interface changed, move the membership */
+        if (bindaddr == NULL ? ssdp->bindaddr == NULL
+            : ssdp->bindaddr != NULL && strcmp(bindaddr, ssdp->bindaddr) == 0)
+        {
+            return;
+        }
+        socket_multicast_drop(inet->rsock, mcast, ssdp->bindaddr);
+        if (socket_multicast_join(inet->rsock, mcast, bindaddr))
+        {
+            return;
+        }
+        log_printf(ssdp->log, LVL_WARN,
+                   "Error joining %s multicast group (%s): %s",
+                   name, mcast, socket_strerror(inet->rsock));
+    }
+    if (inet->rsock >= 0)
+    {
+        selector_remove(ssdp->selector, inet->rsock);
+        socket_close(inet->rsock);
+        inet->rsock = -1;
+    }
+    if (bind)
+    {
+        inet_listen(ssdp, name, inet, bindaddr, mcast, port);
+    }
+    if (port != ssdp->port)
+    {
+        free(inet->notify_host);
+        inet->notify_host = parse_addr(mcast, port, &(inet->notify_hostlen),
+                                       false);
+    }
+}
+
+bool ssdp_rebind(ssdp_t ssdp, const char* bindaddr, uint16_t port)
+{
+    inet_rebind(ssdp, "IPv4", &(ssdp->inet4),
+                bindaddr == NULL || addrstr_is_ipv4(bindaddr), bindaddr,
+                IPV4_MCAST, port);
+    inet_rebind(ssdp, "IPv6", &(ssdp->inet6),
+                bindaddr == NULL || addrstr_is_ipv6(bindaddr), bindaddr,
+                IPV6_MCAST, port);
+    free(ssdp->bindaddr);
+    ssdp->bindaddr = bindaddr != NULL ? strdup(bindaddr) : NULL;
+    ssdp->port = port;
+    if (ssdp->inet4.rsock < 0 && ssdp->inet6.rsock < 0)
+    {
+        log_puts(ssdp->log, LVL_ERR, "Unable to join any of IPv4 or IPv6 SSDP multicast group");
+        return false;
+    }
+    return true;
+}
+
 struct sockaddr* ssdp_getnotifyhost(ssdp_t ssdp, socklen_t* hostlen)
 {
     struct sockaddr* addr;
@@ -231,24 +368,17 @@ static inet_t* select_inet(ssdp_t ssdp, const struct sockaddr* host, socklen_t h
     return NULL;
 }
 
-bool ssdp_search(ssdp_t ssdp, ssdp_search_t* search)
+static bool search_send(ssdp_t ssdp, inet_t* inet, ssdp_search_t* search)
 {
     char* tmp;
     http_req_t req;
-    inet_t* inet;
     bool ret;
-    assert(search && search->st && search->host);
-    inet = select_inet(ssdp, search->host, search->hostlen);
-    if (inet == NULL || inet->wsock < 0)
-    {
-        return false;
-    }
     req = req_new("M-SEARCH", "*", "1.1");
     if (req == NULL)
     {
         return false;
     }
-    asprinthost(&tmp, search->host, search->hostlen);
+    asprinthost(&tmp, inet->notify_host, inet->notify_hostlen);
     req_addheader(req, "Host", tmp);
     free(tmp);
     if (search->s != NULL)
@@ -270,105 +400,439 @@ bool ssdp_search(ssdp_t ssdp, ssdp_search_t* search)
     return ret;
 }
 
-static long search_response_cb(void* userdata)
+bool ssdp_search(ssdp_t ssdp, ssdp_search_t* search)
 {
-    search_response_t* search_response = userdata;
-    resp_send(search_response->resp, search_response->inet->rsock,
-              search_response->sender, search_response->senderlen,
-              search_response->ssdp->log);
-    resp_free(search_response->resp);
-    search_response->resp = NULL;
-    search_response->timer = NULL;
-    return -1;
+    inet_t* inet;
+    assert(search && search->st && search->host);
+    inet = select_inet(ssdp, search->host, search->hostlen);
+    if (inet == NULL || inet->wsock < 0)
+    {
+        return false;
+    }
+    return search_send(ssdp, inet, search);
 }
 
-bool ssdp_search_response(ssdp_t ssdp, ssdp_search_t* search,
-                          ssdp_notify_t* notify)
+bool ssdp_search_all(ssdp_t ssdp, ssdp_search_t* search)
 {
-    char* tmp;
-    http_resp_t resp;
-    bool ret;
-    inet_t* inet;
-    unsigned int delay;
-    assert(search && notify && search->host && search->st && search->sender &&
-           notify->expires >= time(NULL) && notify->usn);
-    inet = select_inet(ssdp, search->sender, search->senderlen);
-    if (inet == NULL || inet->rsock < 0)
+    bool ret = false;
+    assert(search && search->st);
+    if (ssdp->inet4.wsock >= 0)
     {
-        return false;
+        ret = search_send(ssdp, &ssdp->inet4, search) || ret;
     }
-    resp = resp_new(200, "OK", "1.1");
-    if (resp == NULL)
+    if (ssdp->inet6.wsock >= 0)
     {
-        return false;
+        ret = search_send(ssdp, &ssdp->inet6, search) || ret;
     }
-    if (search->s != NULL)
+    return ret;
+}
+
+static search_job_t* search_job_new(ssdp_t ssdp, ssdp_search_t* search,
+                                    inet_t* inet)
+{
+    size_t i;
+    search_job_t* job = NULL;
+    unsigned int mx = search->mx;
+    for (i = 0; i < vector_size(ssdp->search_jobs); ++i)
     {
-        resp_addheader(resp, "S", search->s);
+        job = *((search_job_t**)vector_get(ssdp->search_jobs, i));
+        if (!job->busy)
+        {
+            break;
+        }
+        job = NULL;
     }
-    resp_addheader(resp, "Ext", "");
-    if (asprintf(&tmp, "no-cache=\"Ext\", max-age = %u",
-                 ((unsigned int)(notify->expires - time(NULL)))) == -1)
+    if (job == NULL)
     {
-        resp_free(resp);
-        return false;
+        job = calloc(1, sizeof(search_job_t) + ssdp->addrbufsize);
+        if (job == NULL)
+        {
+            return NULL;
+        }
+        job->alloc = 1024;
+        job->data = malloc(job->alloc);
+        if (job->data == NULL)
+        {
+            free(job);
+            return NULL;
+        }
+        vector_push(ssdp->search_jobs, &job);
+        job->ssdp = ssdp;
+        job->sender = (struct sockaddr*)((char*)job + sizeof(search_job_t));
     }
-    resp_addheader(resp, "Cache-Control", tmp);
-    free(tmp);
-    resp_addheader(resp, "ST", search->st);
-    resp_addheader(resp, "USN", notify->usn);
-    resp_addheader(resp, "Location", notify->location);
-    if (search->mx <= 0)
+    job->busy = true;
+    job->inet = inet;
+    job->senderlen = search->senderlen;
+    memcpy(job->sender, search->sender, search->senderlen);
+    free(job->st);
+    free(job->s);
+    job->st = search->st != NULL ? strdup(search->st) : NULL;
+    job->s = search->s != NULL ? strdup(search->s) : NULL;
+    job->mx = search->mx;
+    job->start = ssdp->timers != NULL ? timers_now(ssdp->timers) : 0;
+    job->size = 0;
+    job->count = 0;
+    job->next = 0;
+    if (mx == 0)
     {
-        delay = 0;
+        job->window = 0;
     }
     else
     {
         /* Max delay, 2 hours and assume we took 0.5 seconds for processing */
-        if (search->mx > 2 * 60 * 60) search->mx = 2 * 60 * 60;
-        delay = rand() % ((search->mx * 1000) - 500);
+        if (mx > 2 * 60 * 60) mx = 2 * 60 * 60;
+        job->window = (mx * 1000) - 500;
+    }
+    job->phase = rand() % 1000;
+    return job;
+}
+
+static bool search_job_printf(search_job_t* job, const char* format, ...)
+{
+    for (;;)
+    {
+        va_list args;
+        int ret;
+        va_start(args, format);
+        ret = vsnprintf(job->data + job->size, job->alloc - job->size,
+                        format, args);
+        va_end(args);
+        if (ret < 0)
+        {
+            return false;
+        }
+        if ((size_t)ret < job->alloc - job->size)
+        {
+            job->size += ret;
+            return true;
+        }
+        {
+            size_t na = job->alloc * 2;
+            char* tmp;
+            if (na < job->size + ret + 1)
+            {
+                na = job->size + ret + 512;
+            }
+            tmp = realloc(job->data, na);
+            if (tmp == NULL)
+            {
+                return false;
+            }
+            job->data = tmp;
+            job->alloc = na;
+        }
+    }
+}
+
+static bool search_job_add(search_job_t* job, ssdp_search_t* search,
+                           ssdp_notify_t* notify)
+{
+    size_t size = job->size;
+    if (job->count == job->ends_alloc)
+    {
+        size_t na = job->ends_alloc ? job->ends_alloc * 2 : 16;
+        size_t* tmp = realloc(job->ends, na * sizeof(size_t));
+        if (tmp == NULL)
+        {
+            return false;
+        }
+        job->ends = tmp;
+        job->ends_alloc = na;
     }
-    if (delay <= 100)
+    /* Same as resp_new and resp_addheader would give */
+    if (!search_job_printf(job, "HTTP/1.1 200 OK\r\n") ||
+        (search->s != NULL &&
+         !search_job_printf(job, "S: %s\r\n", search->s)) ||
+        !search_job_printf(job, "Ext: \r\n"
+                           "Cache-Control: no-cache=\"Ext\", max-age = %u\r\n"
+                           "ST: %s\r\nUSN: %s\r\nLocation: %s\r\n\r\n",
+                           (unsigned int)(notify->expires -
+                                          ssdp_now(job->ssdp)),
+                           search->st, notify->usn, notify->location))
     {
-        ret = resp_send(resp, inet->rsock, search->sender, search->senderlen,
-                        ssdp->log);
-        resp_free(resp);
+        job->size = size;
+        return false;
     }
-    else
+    if (job == job->ssdp->open_job && job->ssdp->open_sender != NULL)
     {
-        /* Delay response */
-        size_t i;
-        search_response_t* search_response = NULL;
-        for (i = 0; i < vector_size(ssdp->search_responses); ++i)
+        search_sender_t* sender = job->ssdp->open_sender;
+        if (sender->tokens < job->size - size)
         {
-            search_response = *((search_response_t**)vector_get(ssdp->search_responses, i));
-            if (search_response->timer == NULL)
+            /* Empty for now, the sender gets nothing more until refilled */
+            sender->tokens = 0;
+            job->size = size;
+            job->ssdp->stats.answers_limited++;
+            return false;
+        }
+        sender->tokens -= job->size - size;
+    }
+    job->ends[job->count++] = job->size;
+    return true;
+}
+
+static unsigned long search_job_due(search_job_t* job, size_t i)
+{
+    return ((uint64_t)i * 1000 + job->phase) * job->window /
+        ((uint64_t)job->count * 1000);
+}
+
+/* Send the responses that are due, returns false when all are sent */
+static bool search_job_send(search_job_t* job, unsigned long elapsed)
+{
+    while (job->next < job->count && search_job_due(job, job->next) <= elapsed)
+    {
+        size_t begin = job->next > 0 ? job->ends[job->next - 1] : 0;
+        size_t len = job->ends[job->next] - begin;
+        if (socket_udp_write(job->inet->rsock, job->data + begin, len,
+                             job->sender, job->senderlen) != (ssize_t)len)
+        {
+            log_printf(job->ssdp->log, LVL_WARN,
+                       "Unable to send package: %s",
+                       socket_strerror(job->inet->rsock));
+        }
+        else
+        {
+            job->ssdp->stats.answers++;
+            job->ssdp->stats.answer_bytes += len;
+        }
+        job->next++;
+    }
+    return job->next < job->count;
+}
+
+static void search_job_done(search_job_t* job)
+{
+    job->busy = false;
+    if (job->alloc > SEARCH_JOB_KEEP)
+    {
+        /* Don't hold on to what a big ssdp:all needed */
+        char* tmp = realloc(job->data, 1024);
+        if (tmp != NULL)
+        {
+            job->data = tmp;
+            job->alloc = 1024;
+        }
+    }
+}
+
+static long search_job_cb(void* userdata)
+{
+    search_job_t* job = userdata;
+    unsigned long elapsed, due;
+    elapsed = timers_now(job->ssdp->timers) - job->start;
+    if (!search_job_send(job, elapsed))
+    {
+        job->timer = NULL;
+        search_job_done(job);
+        return -1;
+    }
+    due = search_job_due(job, job->next) - elapsed;
+    return due > SEARCH_JOB_PACE_MS ? due : SEARCH_JOB_PACE_MS;
+}
+
+static void search_job_start(search_job_t* job)
+{
+    if (job->window == 0 || job->count == 0)
+    {
+        search_job_send(job, job->window);
+        search_job_done(job);
+        return;
+    }
+    assert(job->ssdp->timers != NULL);
+    job->timer = timers_add(job->ssdp->timers, search_job_due(job, 0),
+                            job, search_job_cb);
+}
+
+/* true if an identical search from the same sender was answered, or is
+ * being answered, recently enough. Searches with different S headers are
+ * different searches even if the rest is the same */
+static bool search_duplicate(ssdp_t ssdp, ssdp_search_t* search,
+                             uint64_t now)
+{
+    size_t i;
+    for (i = 0; i < vector_size(ssdp->search_jobs); ++i)
+    {
+        search_job_t* job = *((search_job_t**)vector_get(ssdp->search_jobs, i));
+        if (job->st != NULL && job->mx == search->mx &&
+            job->senderlen == search->senderlen &&
+            now - job->start < (job->window > SEARCH_DUP_MS
+                                ? job->window : SEARCH_DUP_MS) &&
+            memcmp(job->sender, search->sender, search->senderlen) == 0 &&
+            strcmp(job->st, search->st) == 0 &&
+            (job->s == NULL ? search->s == NULL :
+             search->s != NULL && strcmp(job->s, search->s) == 0))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* The bucket of the sender of search, refilled up to now */
+static search_sender_t* search_sender(ssdp_t ssdp, ssdp_search_t* search,
+                                      uint64_t now)
+{
+    search_sender_t* sender = NULL;
+    size_t i;
+    uint64_t add;
+    memcpy(ssdp->keybuf, search->sender, search->senderlen);
+    addr_setport(ssdp->keybuf, search->senderlen, 0);
+    for (i = 0; i < ssdp->senders_cnt; ++i)
+    {
+        if (ssdp->senders[i].addrlen == search->senderlen &&
+            memcmp(ssdp->senders[i].addr, ssdp->keybuf,
+                   search->senderlen) == 0)
+        {
+            sender = ssdp->senders + i;
+            break;
+        }
+    }
+    if (sender == NULL)
+    {
+        if (ssdp->senders == NULL)
+        {
+            ssdp->senders = calloc(SEARCH_SENDERS, sizeof(search_sender_t));
+            if (ssdp->senders == NULL)
             {
-                break;
+                return NULL;
+            }
+        }
+        if (ssdp->senders_cnt < SEARCH_SENDERS)
+        {
+            sender = ssdp->senders + ssdp->senders_cnt;
+            sender->addr = socket_allocate_addrbuffer(NULL);
+            if (sender->addr == NULL)
+            {
+                return NULL;
             }
-            search_response = NULL;
+            ssdp->senders_cnt++;
         }
-        if (search_response == NULL)
+        else
         {
-            search_response = calloc(1, sizeof(search_response_t) + ssdp->addrbufsize);
-            vector_push(ssdp->search_responses, &search_response);
-            search_response->ssdp = ssdp;
-            search_response->sender = (struct sockaddr*)((char*)search_response + sizeof(search_response_t));
+            sender = ssdp->senders;
+            for (i = 1; i < ssdp->senders_cnt; ++i)
+            {
+                if (ssdp->senders[i].seen < sender->seen)
+                {
+                    sender = ssdp->senders + i;
+                }
+            }
         }
+        memcpy(sender->addr, ssdp->keybuf, search->senderlen);
+        sender->addrlen = search->senderlen;
+        sender->tokens = ssdp->search_burst;
+        sender->refilled = now;
+    }
+    sender->seen = now;
+    add = ((now - sender->refilled) * ssdp->search_rate) / 1000;
+    if (add > 0)
+    {
+        sender->tokens = add >= ssdp->search_burst - sender->tokens
+            ? ssdp->search_burst : sender->tokens + add;
+        sender->refilled = now;
+    }
+    return sender;
+}
+
+/* Called before search_cb, returns false if the search shouldn't be
+ * answered */
+static bool search_open(ssdp_t ssdp, ssdp_search_t* search)
+{
+    search_sender_t* sender = NULL;
+    inet_t* inet;
+    uint64_t now;
+    if (ssdp->timers == NULL || search->st == NULL || search->sender == NULL)
+    {
+        /* Can't answer with a job, only tell about it */
+        ssdp->stats.searches++;
+        return true;
+    }
+    now = timers_now(ssdp->timers);
+    if (search_duplicate(ssdp, search, now))
+    {
+        ssdp->stats.duplicates++;
+        return false;
+    }
+    if (ssdp->search_rate > 0)
+    {
+        sender = search_sender(ssdp, search, now);
+        if (sender != NULL && sender->tokens < SEARCH_LIMIT_MIN)
+        {
+            ssdp->stats.limited++;
+            return false;
+        }
+    }
+    ssdp->stats.searches++;
+    inet = select_inet(ssdp, search->sender, search->senderlen);
+    if (inet != NULL && inet->rsock >= 0)
+    {
+        ssdp->open_job = search_job_new(ssdp, search, inet);
+    }
+    ssdp->open_search = search;
+    ssdp->open_sender = sender;
+    return true;
+}
+
+static void search_close(ssdp_t ssdp)
+{
+    if (ssdp->open_job != NULL)
+    {
+        search_job_start(ssdp->open_job);
+    }
+    ssdp->open_search = NULL;
+    ssdp->open_job = NULL;
+    ssdp->open_sender = NULL;
+}
 
-        search_response->resp = resp;
-        search_response->inet = inet;
-        search_response->senderlen = search->senderlen;
-        memcpy(search_response->sender, search->sender, search->senderlen);
-        search_response->timer = timers_add(ssdp->timers,
-                                            delay,
-                                            search_response,
-                                            search_response_cb);
-        ret = true;
+bool ssdp_search_response(ssdp_t ssdp, ssdp_search_t* search,
+                          ssdp_notify_t* notify)
+{
+    inet_t* inet;
+    search_job_t* job;
+    bool ret;
+    assert(search && notify && search->host && search->st && search->sender &&
+           notify->expires >= ssdp_now(ssdp) && notify->usn);
+    if (search == ssdp->open_search && ssdp->open_job != NULL)
+    {
+        /* Called from search_cb, the job is started when it returns */
+        return search_job_add(ssdp->open_job, search, notify);
+    }
+    inet = select_inet(ssdp, search->sender, search->senderlen);
+    if (inet == NULL || inet->rsock < 0)
+    {
+        return false;
+    }
+    job = search_job_new(ssdp, search, inet);
+    if (job == NULL)
+    {
+        return false;
     }
+    ret = search_job_add(job, search, notify);
+    search_job_start(job);
     return ret;
 }
 
+void ssdp_set_search_limit(ssdp_t ssdp, unsigned long rate,
+                           unsigned long burst)
+{
+    size_t i;
+    assert(rate == 0 || burst > 0);
+    ssdp->search_rate = rate;
+    ssdp->search_burst = burst;
+    for (i = 0; i < ssdp->senders_cnt; ++i)
+    {
+        if (ssdp->senders[i].tokens > burst)
+        {
+            ssdp->senders[i].tokens = burst;
+        }
+    }
+}
+
+void ssdp_stats(ssdp_t ssdp, ssdp_stats_t* stats)
+{
+    *stats = ssdp->stats;
+}
+
 bool ssdp_notify(ssdp_t ssdp, ssdp_notify_t* notify)
 {
     char* tmp;
@@ -376,7 +840,7 @@ bool ssdp_notify(ssdp_t ssdp, ssdp_notify_t* notify)
     bool ret;
     inet_t* inet;
     assert(notify && notify->host && notify->nt && notify->usn
-           && notify->location && notify->expires >= time(NULL));
+           && notify->location && notify->expires >= ssdp_now(ssdp));
     inet = select_inet(ssdp, notify->host, notify->hostlen);
     if (inet == NULL || inet->wsock < 0)
     {
@@ -395,7 +859,7 @@ bool ssdp_notify(ssdp_t ssdp, ssdp_notify_t* notify)
     req_addheader(req, "USN", notify->usn);
     req_addheader(req, "Location", notify->location);
     if (asprintf(&tmp, "max-age = %u",
-                 ((unsigned int)(notify->expires - time(NULL)))) == -1)
+                 ((unsigned int)(notify->expires - ssdp_now(ssdp)))) == -1)
     {
         req_free(req);
         return false;
@@ -443,26 +907,49 @@ bool ssdp_byebye(ssdp_t ssdp, ssdp_notify_t* notify)
     return ret;
 }
 
+time_t ssdp_now(ssdp_t ssdp)
+{
+    if (ssdp->timers != NULL)
+    {
+        return timers_now(ssdp->timers) / 1000;
+    }
+    return timeval_monotonic() / 1000;
+}
+
+time_t ssdp_expires_wall(time_t expires)
+{
+    return time(NULL) + (expires - (time_t)(timeval_monotonic() / 1000));
+}
+
 void ssdp_free(ssdp_t ssdp)
 {
     size_t i;
     if (ssdp == NULL)
         return;
 
-    for (i = 0; i < vector_size(ssdp->search_responses); ++i)
+    for (i = 0; i < vector_size(ssdp->search_jobs); ++i)
     {
-        search_response_t* search_response = *((search_response_t**)vector_get(ssdp->search_responses, i));
-        if (search_response->timer != NULL)
+        search_job_t* job = *((search_job_t**)vector_get(ssdp->search_jobs, i));
+        if (job->timer != NULL)
         {
-            timecb_cancel(search_response->timer);
-            search_response->timer = NULL;
-            resp_free(search_response->resp);
+            timecb_cancel(job->timer);
         }
-        free(search_response);
+        free(job->data);
+        free(job->ends);
+        free(job->st);
+        free(job->s);
+        free(job);
     }
-    vector_free(ssdp->search_responses);
+    vector_free(ssdp->search_jobs);
+    for (i = 0; i < ssdp->senders_cnt; ++i)
+    {
+        free(ssdp->senders[i].addr);
+    }
+    free(ssdp->senders);
+    free(ssdp->keybuf);
     inet_free(ssdp, &ssdp->inet4);
     inet_free(ssdp, &ssdp->inet6);
+    free(ssdp->bindaddr);
     free(ssdp->addrbuf);
     free(ssdp);
 }
@@ -500,7 +987,7 @@ static bool parse_host(char* str, struct sockaddr** addr,
     uint16_t port;
     if (pos == NULL)
     {
-        port = 1900;
+        port = SSDP_PORT;
     }
     else
     {
@@ -783,7 +1270,7 @@ void read_data(void* userdata, socket_t sock)
                         err = true;
                         break;
                     }
-                    notify_data.expires = time(NULL) + tmp;
+                    notify_data.expires = ssdp_now(ssdp) + tmp;
                 }
                 else if (strcasecmp(key, "Expires") == 0)
                 {
@@ -795,7 +1282,8 @@ void read_data(void* userdata, socket_t sock)
                         err = true;
                         break;
                     }
-                    notify_data.expires = mktime(&_tm);
+                    notify_data.expires = ssdp_now(ssdp) +
+                        (mktime(&_tm) - time(NULL));
                 }
             }
         }
@@ -815,7 +1303,11 @@ void read_data(void* userdata, socket_t sock)
             }
             else if (ssdp->search_cb != NULL)
             {
-                ssdp->search_cb(ssdp->userdata, &search_data);
+                if (search_open(ssdp, &search_data))
+                {
+                    ssdp->search_cb(ssdp->userdata, &search_data);
+                    search_close(ssdp);
+                }
             }
         }
         else if (notify && ssdp->notify_cb)
@@ -55,6 +55,7 @@ typedef struct _ssdp_notify_t
     char* location;
     char* server;
     char* usn;
+    /* On the ssdp_now clock, not wall time */
     time_t expires;
     char* nt;
     char* nts;
@@ -65,20 +66,66 @@ typedef void (* ssdp_search_callback_t)(void* userdata, ssdp_search_t* search);
 typedef void (* ssdp_search_response_callback_t)(void* userdata, ssdp_search_t* search, ssdp_notify_t* notify);
 typedef void (* ssdp_notify_callback_t)(void* userdata, ssdp_notify_t* notify);
 
+/* Standard SSDP port, use it for port in ssdp_new unless you need
+ * a private SSDP "network" (for testing for example) */
+#define SSDP_PORT (1900)
+
 ssdp_t ssdp_new(log_t log,
                 selector_t selector,
                 timers_t timers,
                 const char* bindaddr,
+                uint16_t port,
                 void* userdata,
                 ssdp_search_callback_t search_callback,
                 ssdp_search_response_callback_t search_response_callback,
                 ssdp_notify_callback_t notify_callback);
 
+/* Seconds on the monotonic clock, timers_now / 1000 of the timers given to
+ * ssdp_new (or the clock itself if timers is NULL). max-age and Expires
+ * headers are converted to and from it */
+time_t ssdp_now(ssdp_t ssdp);
+/* Wall clock time of expires, for showing it */
+time_t ssdp_expires_wall(time_t expires);
+
+/* Join the multicast groups on another interface or listen on another
+ * port, as bindaddr and port to ssdp_new. Sockets that can stay are kept,
+ * the group memberships are moved. False if no group could be joined.
+ * Notify hosts from ssdp_getnotifyhost change with the port */
+bool ssdp_rebind(ssdp_t ssdp, const char* bindaddr, uint16_t port);
+
 struct sockaddr* ssdp_getnotifyhost(ssdp_t ssdp, socklen_t* hostlen);
 
 bool ssdp_search(ssdp_t ssdp, ssdp_search_t* search);
+/* Send the search to the multicast group of every address family SSDP is
+ * bound to, search->host is ignored. True if it was sent to any of them */
+bool ssdp_search_all(ssdp_t ssdp, ssdp_search_t* search);
+/* When called from the search callback all responses to the search are
+ * collected and sent in batches spread over its MX by one timer, once the
+ * callback returns. Called at any other time the response is sent alone
+ * the same way */
 bool ssdp_search_response(ssdp_t ssdp, ssdp_search_t* search,
                           ssdp_notify_t* notify);
+
+/* With timers given to ssdp_new a search identical to one still being
+ * answered (same sender, ST, MX and S if any) is merged into that one,
+ * the search callback isn't called for it. Responses to each sender
+ * address are also limited to rate bytes per second, allowing bursts of
+ * burst bytes. Searches are dropped while the sender is over the limit.
+ * rate 0 (the default) means no limit */
+void ssdp_set_search_limit(ssdp_t ssdp, unsigned long rate,
+                           unsigned long burst);
+
+typedef struct
+{
+    /* Searches given to the search callback, merged into an identical
+     * one and dropped because of the rate limit */
+    unsigned long searches, duplicates, limited;
+    /* Responses sent and responses left out because of the rate limit */
+    unsigned long answers, answers_limited;
+    uint64_t answer_bytes;
+} ssdp_stats_t;
+
+void ssdp_stats(ssdp_t ssdp, ssdp_stats_t* stats);
 bool ssdp_notify(ssdp_t ssdp, ssdp_notify_t* notify);
 /* Only host, nt and usn members need to be filled */
 bool ssdp_byebye(ssdp_t ssdp, ssdp_notify_t* notify);
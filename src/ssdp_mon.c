@@ -31,10 +31,65 @@
 
 #include <stdio.h>
 #include <signal.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/time.h>
 
 #include "ssdp.h"
 #include "log.h"
 
+/* Trace files start with TRACE_MAGIC and then contain one record per
+ * datagram: uint32 microseconds since the previous record, uint8 address
+ * family (4 or 6), uint16 length and then length bytes of data.
+ * All integers are big-endian. */
+static const char TRACE_MAGIC[8] = { 'S', 'S', 'D', 'P', 'T', 'R', 'C', '1' };
+#define TRACE_RECORD_HEADER (7)
+#define TRACE_MAX_DATA (2048)
+
+static const char* IPV4_GROUP = "239.255.255.250";
+static const char* IPV6_GROUP = "FF02::C";
+
+/* How long to wait for search responses after the last search was sent */
+static const unsigned long RESPONSE_GRACE_MS = 3000;
+
+typedef enum
+{
+    MON_MONITOR,
+    MON_RECORD,
+    MON_REPLAY,
+    MON_STORM,
+} mon_mode_t;
+
+typedef struct _options_t
+{
+    mon_mode_t mode;
+    uint16_t port, search_port;
+    const char* file;
+    unsigned int speed;
+    unsigned int devices, services;
+    unsigned int notify_interval;
+    unsigned int search_rate;
+    unsigned int mx_min, mx_max;
+    unsigned int duration;
+} options_t;
+
+typedef struct _latency_t
+{
+    uint32_t* usec;
+    size_t count, alloc;
+    unsigned long late;
+} latency_t;
+
+static bool handle_args(options_t* opts, int argc, char** argv,
+                        int* exitcode);
+static int run_monitor(const options_t* opts);
+static int run_record(const options_t* opts);
+static int run_replay(const options_t* opts);
+static int run_storm(const options_t* opts);
+
 static void search_cb(void* userdata, ssdp_search_t* search);
 static void search_resp_cb(void* userdata, ssdp_search_t* search,
                            ssdp_notify_t* notify);
@@ -43,15 +98,355 @@ static void quit_cb(int signum);
 static bool quit = false;
 
 int main(int argc, char** argv)
+{
+    options_t opts;
+    int exitcode;
+
+    if (!handle_args(&opts, argc, argv, &exitcode))
+    {
+        return exitcode;
+    }
+
+    signal(SIGINT, quit_cb);
+    signal(SIGTERM, quit_cb);
+    signal(SIGHUP, quit_cb);
+
+    switch (opts.mode)
+    {
+    case MON_MONITOR:
+        return run_monitor(&opts);
+    case MON_RECORD:
+        return run_record(&opts);
+    case MON_REPLAY:
+        return run_replay(&opts);
+    case MON_STORM:
+        return run_storm(&opts);
+    }
+    return EXIT_FAILURE;
+}
+
+static void print_usage(void)
+{
+    fputs("Usage: `ssdp_mon [OPTIONS ...]`\n", stdout);
+    fputs("\n", stdout);
+    fputs("Without any of -w, -r or -s all SSDP messages are printed.\n", stdout);
+    fputs("Mandatory arguments to long options are mandatory for short options too.\n", stdout);
+    fputs("  -P, --port=PORT      SSDP port to use (default 1900)\n", stdout);
+    fputs("  -w, --record=FILE    record SSDP multicast traffic to FILE\n", stdout);
+    fputs("  -r, --replay=FILE    replay traffic recorded in FILE\n", stdout);
+    fputs("  -x, --speed=N        replay N times faster than recorded (default 1)\n", stdout);
+    fputs("  -s, --storm          send a synthetic storm of NOTIFY and M-SEARCH\n", stdout);
+    fputs("  -n, --devices=N      storm: number of devices (default 10)\n", stdout);
+    fputs("  -m, --services=N     storm: services per device (default 5)\n", stdout);
+    fputs("  -i, --interval=SEC   storm: seconds between NOTIFY for each device (default 10)\n", stdout);
+    fputs("  -R, --rate=N         storm: M-SEARCH per second (default 10)\n", stdout);
+    fputs("  -M, --mx=MIN[-MAX]   storm: MX of each M-SEARCH, uniform in range (default 1-3)\n", stdout);
+    fputs("  -Q, --search-port=PORT storm: send M-SEARCH to PORT instead (default same as -P)\n", stdout);
+    fputs("  -t, --time=SEC       storm: how long to run (default 30)\n", stdout);
+    fputs("  -h, --help           display this text and exit\n", stdout);
+    fputs("\n", stdout);
+    fputs("Replay and storm report how many answers each M-SEARCH got and how long\n", stdout);
+    fputs("they took, answers later than MX seconds are counted as late.\n", stdout);
+    fputs("Replay only sees answers to searches it sent itself.\n", stdout);
+}
+
+static bool parse_uint(const char* str, unsigned long max, unsigned int* value)
+{
+    unsigned long tmp;
+    char* end = NULL;
+    errno = 0;
+    tmp = strtoul(str, &end, 10);
+    if (errno || end == NULL || *end != '\0' || end == str || tmp > max)
+    {
+        return false;
+    }
+    *value = tmp;
+    return true;
+}
+
+static bool parse_range(const char* str, unsigned int* min, unsigned int* max)
+{
+    const char* pos = strchr(str, '-');
+    char* tmp;
+    bool ret;
+    if (pos == NULL)
+    {
+        if (!parse_uint(str, 120, min))
+        {
+            return false;
+        }
+        *max = *min;
+        return true;
+    }
+    tmp = strndup(str, pos - str);
+    ret = parse_uint(tmp, 120, min) && parse_uint(pos + 1, 120, max) &&
+        *min <= *max;
+    free(tmp);
+    return ret;
+}
+
+bool handle_args(options_t* opts, int argc, char** argv, int* exitcode)
+{
+#if HAVE_GETOPT_LONG
+    static const struct option long_opts[] = {
+        { "help",        no_argument,       NULL, 'h' },
+        { "port",        required_argument, NULL, 'P' },
+        { "record",      required_argument, NULL, 'w' },
+        { "replay",      required_argument, NULL, 'r' },
+        { "speed",       required_argument, NULL, 'x' },
+        { "storm",       no_argument,       NULL, 's' },
+        { "devices",     required_argument, NULL, 'n' },
+        { "services",    required_argument, NULL, 'm' },
+        { "interval",    required_argument, NULL, 'i' },
+        { "rate",        required_argument, NULL, 'R' },
+        { "mx",          required_argument, NULL, 'M' },
+        { "search-port", required_argument, NULL, 'Q' },
+        { "time",        required_argument, NULL, 't' },
+        { NULL,          0,                 NULL, '\0' }
+    };
+#endif
+    static const char* short_opts = "hP:w:r:x:sn:m:i:R:M:Q:t:";
+    bool usage = false, error = false;
+    unsigned int tmp;
+    memset(opts, 0, sizeof(options_t));
+    opts->mode = MON_MONITOR;
+    opts->port = SSDP_PORT;
+    opts->speed = 1;
+    opts->devices = 10;
+    opts->services = 5;
+    opts->notify_interval = 10;
+    opts->search_rate = 10;
+    opts->mx_min = 1;
+    opts->mx_max = 3;
+    opts->duration = 30;
+    opterr = 1;
+    for (;;)
+    {
+        int c;
+#if HAVE_GETOPT_LONG
+        int idx;
+        c = getopt_long(argc, argv, short_opts, long_opts, &idx);
+#else
+        c = getopt(argc, argv, short_opts);
+#endif
+        if (c == -1)
+            break;
+
+        switch (c)
+        {
+        case 'h':
+            usage = true;
+            break;
+        case 'P':
+        case 'Q':
+            if (!parse_uint(optarg, 0xffff, &tmp) || tmp == 0)
+            {
+                fprintf(stderr, "ssdp_mon: Invalid port: %s\n", optarg);
+                error = true;
+            }
+            else if (c == 'P')
+            {
+                opts->port = tmp;
+            }
+            else
+            {
+                opts->search_port = tmp;
+            }
+            break;
+        case 'w':
+        case 'r':
+        case 's':
+            if (opts->mode != MON_MONITOR)
+            {
+                fputs("ssdp_mon: Only one of -w, -r and -s can be given\n",
+                      stderr);
+                error = true;
+            }
+            opts->mode = c == 'w' ? MON_RECORD :
+                (c == 'r' ? MON_REPLAY : MON_STORM);
+            opts->file = optarg;
+            break;
+        case 'x':
+            if (!parse_uint(optarg, 100000, &opts->speed) || opts->speed == 0)
+            {
+                fprintf(stderr, "ssdp_mon: Invalid speed: %s\n", optarg);
+                error = true;
+            }
+            break;
+        case 'n':
+            if (!parse_uint(optarg, 100000, &opts->devices))
+            {
+                fprintf(stderr, "ssdp_mon: Invalid number of devices: %s\n",
+                        optarg);
+                error = true;
+            }
+            break;
+        case 'm':
+            if (!parse_uint(optarg, 1000, &opts->services))
+            {
+                fprintf(stderr, "ssdp_mon: Invalid number of services: %s\n",
+                        optarg);
+                error = true;
+            }
+            break;
+        case 'i':
+            if (!parse_uint(optarg, 3600, &opts->notify_interval) ||
+                opts->notify_interval == 0)
+            {
+                fprintf(stderr, "ssdp_mon: Invalid interval: %s\n", optarg);
+                error = true;
+            }
+            break;
+        case 'R':
+            if (!parse_uint(optarg, 100000, &opts->search_rate))
+            {
+                fprintf(stderr, "ssdp_mon: Invalid search rate: %s\n",
+                        optarg);
+                error = true;
+            }
+            break;
+        case 'M':
+            if (!parse_range(optarg, &opts->mx_min, &opts->mx_max))
+            {
+                fprintf(stderr, "ssdp_mon: Invalid MX range: %s\n", optarg);
+                error = true;
+            }
+            break;
+        case 't':
+            if (!parse_uint(optarg, 86400, &opts->duration) ||
+                opts->duration == 0)
+            {
+                fprintf(stderr, "ssdp_mon: Invalid time: %s\n", optarg);
+                error = true;
+            }
+            break;
+        case '?':
+        default:
+            error = true;
+            break;
+        }
+    }
+
+    if (optind < argc)
+    {
+        fputs("ssdp_mon: Unexpected argument after options\n", stderr);
+        error = true;
+    }
+
+    if (usage)
+    {
+        print_usage();
+        *exitcode = error ? EXIT_FAILURE : EXIT_SUCCESS;
+        return false;
+    }
+    if (error)
+    {
+        fprintf(stderr, "Usage: `%s [OPTIONS ...]`\n", argv[0]);
+        *exitcode = EXIT_FAILURE;
+        return false;
+    }
+    if (opts->search_port == 0)
+    {
+        opts->search_port = opts->port;
+    }
+    return true;
+}
+
+void quit_cb(int signum)
+{
+    quit = true;
+}
+
+static uint64_t now_usec(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void latency_add(latency_t* latency, uint64_t usec, unsigned int mx)
+{
+    if (latency->count == latency->alloc)
+    {
+        size_t nalloc = latency->alloc ? latency->alloc * 2 : 256;
+        uint32_t* tmp = realloc(latency->usec, nalloc * sizeof(uint32_t));
+        if (tmp == NULL)
+        {
+            return;
+        }
+        latency->usec = tmp;
+        latency->alloc = nalloc;
+    }
+    if (usec > (uint64_t)mx * 1000000)
+    {
+        latency->late++;
+    }
+    latency->usec[latency->count++] = usec > 0xffffffff ? 0xffffffff : usec;
+}
+
+static int cmp_uint32(const void* a, const void* b)
+{
+    uint32_t x = *((const uint32_t*)a), y = *((const uint32_t*)b);
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static double latency_percentile(const latency_t* latency, unsigned int p)
+{
+    size_t idx = (latency->count * p) / 100;
+    if (idx >= latency->count)
+    {
+        idx = latency->count - 1;
+    }
+    return latency->usec[idx] / 1000.0;
+}
+
+static void latency_report(latency_t* latency, unsigned long searches,
+                           unsigned long answered)
+{
+    fprintf(stdout, "%lu M-SEARCH sent, %lu answered, %lu responses"
+            " (%lu late)\n", searches, answered,
+            (unsigned long)latency->count, latency->late);
+    if (latency->count > 0)
+    {
+        qsort(latency->usec, latency->count, sizeof(uint32_t), cmp_uint32);
+        fprintf(stdout, "response time: p50 %.2f ms, p90 %.2f ms,"
+                " p99 %.2f ms, max %.2f ms\n",
+                latency_percentile(latency, 50),
+                latency_percentile(latency, 90),
+                latency_percentile(latency, 99),
+                latency->usec[latency->count - 1] / 1000.0);
+    }
+    free(latency->usec);
+    latency->usec = NULL;
+    latency->count = latency->alloc = 0;
+}
+
+/* Returns true if a fatal error occurred */
+static bool loop(selector_t selector, timers_t timers)
+{
+    while (!quit)
+    {
+        unsigned long timeout = 1000;
+        if (timers != NULL)
+        {
+            timeout = timers_tick(timers);
+            if (timeout > 1000) timeout = 1000;
+        }
+        if (!selector_tick(selector, timeout))
+        {
+            fputs("ssdp_mon: Selector failed.\n", stderr);
+            return true;
+        }
+    }
+    return false;
+}
+
+int run_monitor(const options_t* opts)
 {
     selector_t selector;
     ssdp_t ssdp;
     log_t log;
-    if (argc > 1)
-    {
-        fputs("ssdp_mon: Expects no arguments.\n", stderr);
-        return EXIT_FAILURE;
-    }
+    bool err;
     log = log_open();
     selector = selector_new();
     if (selector == NULL)
@@ -60,7 +455,7 @@ int main(int argc, char** argv)
         log_close(log);
         return EXIT_FAILURE;
     }
-    ssdp = ssdp_new(log, selector, NULL, NULL, NULL, search_cb, search_resp_cb, notify_cb);
+    ssdp = ssdp_new(log, selector, NULL, NULL, opts->port, NULL, search_cb, search_resp_cb, notify_cb);
     if (ssdp == NULL)
     {
         fputs("ssdp_mon: Failed to setup SSDP.\n", stderr);
@@ -69,33 +464,766 @@ int main(int argc, char** argv)
         return EXIT_FAILURE;
     }
 
-    signal(SIGINT, quit_cb);
-    signal(SIGTERM, quit_cb);
-    signal(SIGHUP, quit_cb);
+    err = loop(selector, NULL);
 
-    while (!quit)
+    ssdp_free(ssdp);
+    selector_free(selector);
+    log_close(log);
+    return err ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* Record */
+
+typedef struct _recorder_t
+{
+    FILE* fh;
+    socket_t sock4, sock6;
+    uint64_t last;
+    unsigned long count;
+    uint64_t bytes;
+    bool err;
+} recorder_t;
+
+static void write_uint(unsigned char* ptr, uint32_t value, size_t size)
+{
+    while (size-- > 0)
+    {
+        ptr[size] = value & 0xff;
+        value >>= 8;
+    }
+}
+
+static uint32_t read_uint(const unsigned char* ptr, size_t size)
+{
+    uint32_t ret = 0;
+    size_t i;
+    for (i = 0; i < size; ++i)
+    {
+        ret = (ret << 8) | ptr[i];
+    }
+    return ret;
+}
+
+static void record_read_cb(void* userdata, socket_t sock)
+{
+    recorder_t* recorder = userdata;
+    unsigned char header[TRACE_RECORD_HEADER];
+    char buf[TRACE_MAX_DATA];
+    uint64_t now, delta;
+    ssize_t got = socket_udp_read(sock, buf, sizeof(buf), NULL, NULL);
+    if (got <= 0)
+    {
+        return;
+    }
+    now = now_usec();
+    delta = recorder->count == 0 ? 0 : now - recorder->last;
+    recorder->last = now;
+    write_uint(header, delta > 0xffffffff ? 0xffffffff : delta, 4);
+    header[4] = sock == recorder->sock6 ? 6 : 4;
+    write_uint(header + 5, got, 2);
+    if (fwrite(header, 1, sizeof(header), recorder->fh) != sizeof(header) ||
+        fwrite(buf, 1, got, recorder->fh) != (size_t)got)
+    {
+        fprintf(stderr, "ssdp_mon: Error writing trace: %s\n",
+                strerror(errno));
+        recorder->err = true;
+        quit = true;
+        return;
+    }
+    recorder->count++;
+    recorder->bytes += got;
+}
+
+static socket_t multicast_listen(const char* group, uint16_t port)
+{
+    socket_t sock = socket_udp_listen(group, port);
+    if (sock < 0)
+    {
+        return sock;
+    }
+    if (!socket_multicast_join(sock, group, NULL))
+    {
+        socket_close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+int run_record(const options_t* opts)
+{
+    selector_t selector;
+    recorder_t recorder;
+    bool err;
+
+    memset(&recorder, 0, sizeof(recorder));
+    recorder.fh = fopen(opts->file, "wb");
+    if (recorder.fh == NULL)
+    {
+        fprintf(stderr, "ssdp_mon: Unable to open %s for writing: %s\n",
+                opts->file, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    if (fwrite(TRACE_MAGIC, 1, sizeof(TRACE_MAGIC), recorder.fh) !=
+        sizeof(TRACE_MAGIC))
+    {
+        fprintf(stderr, "ssdp_mon: Error writing trace: %s\n",
+                strerror(errno));
+        fclose(recorder.fh);
+        return EXIT_FAILURE;
+    }
+    selector = selector_new();
+    recorder.sock4 = multicast_listen(IPV4_GROUP, opts->port);
+    recorder.sock6 = multicast_listen(IPV6_GROUP, opts->port);
+    if (recorder.sock4 < 0 && recorder.sock6 < 0)
+    {
+        fputs("ssdp_mon: Unable to join any SSDP multicast group.\n", stderr);
+        selector_free(selector);
+        fclose(recorder.fh);
+        return EXIT_FAILURE;
+    }
+    if (recorder.sock4 >= 0)
+    {
+        selector_add(selector, recorder.sock4, &recorder, record_read_cb,
+                     NULL);
+    }
+    if (recorder.sock6 >= 0)
+    {
+        selector_add(selector, recorder.sock6, &recorder, record_read_cb,
+                     NULL);
+    }
+
+    err = loop(selector, NULL);
+
+    if (recorder.sock4 >= 0)
+    {
+        selector_remove(selector, recorder.sock4);
+        socket_close(recorder.sock4);
+    }
+    if (recorder.sock6 >= 0)
+    {
+        selector_remove(selector, recorder.sock6);
+        socket_close(recorder.sock6);
+    }
+    selector_free(selector);
+    if (fclose(recorder.fh) != 0)
+    {
+        recorder.err = true;
+    }
+    fprintf(stdout, "Recorded %lu datagrams (%lu bytes) to %s\n",
+            recorder.count, (unsigned long)recorder.bytes, opts->file);
+    return err || recorder.err ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* Replay */
+
+#define REPLAY_SEARCHES (256)
+
+typedef struct _replay_search_t
+{
+    char s[128];
+    char st[256];
+    unsigned int mx;
+    uint64_t sent;
+    bool answered;
+} replay_search_t;
+
+typedef struct _replayer_t
+{
+    const options_t* opts;
+    FILE* fh;
+    socket_t sock4, sock6;
+    struct sockaddr* host4, * host6;
+    socklen_t host4len, host6len;
+    /* Next record to send, valid if have_next */
+    bool have_next;
+    unsigned char family;
+    char data[TRACE_MAX_DATA];
+    size_t datalen;
+    /* Trace time of next record and wall time replay started */
+    uint64_t trace_time, start;
+    unsigned long sent, searches, answered;
+    /* The most recent searches, responses are matched on S if the
+     * search had one and on ST otherwise */
+    replay_search_t search[REPLAY_SEARCHES];
+    size_t search_pos;
+    latency_t latency;
+    bool err;
+} replayer_t;
+
+/* Returns the value of header key in the HTTP-like message data
+ * (NUL terminated) in value, or false if not found */
+static bool find_header(const char* data, const char* key,
+                        char* value, size_t size)
+{
+    size_t keylen = strlen(key);
+    const char* line = strstr(data, "\r\n");
+    while (line != NULL)
     {
-        if (!selector_tick(selector, 1000))
+        const char* end;
+        line += 2;
+        end = strstr(line, "\r\n");
+        if (end == NULL || end == line)
         {
-            fputs("ssdp_mon: Selector failed.\n", stderr);
-            ssdp_free(ssdp);
-            selector_free(selector);
-            log_close(log);
-            return EXIT_FAILURE;
+            break;
+        }
+        if (strncasecmp(line, key, keylen) == 0 && line[keylen] == ':')
+        {
+            const char* pos = line + keylen + 1;
+            size_t len;
+            while (pos < end && (*pos == ' ' || *pos == '\t')) ++pos;
+            len = end - pos;
+            while (len > 0 && (pos[len - 1] == ' ' || pos[len - 1] == '\t'))
+                --len;
+            if (len >= size)
+            {
+                len = size - 1;
+            }
+            memcpy(value, pos, len);
+            value[len] = '\0';
+            return true;
         }
+        line = end;
     }
+    return false;
+}
 
-    ssdp_free(ssdp);
+static bool replay_read_next(replayer_t* replayer)
+{
+    unsigned char header[TRACE_RECORD_HEADER];
+    size_t got = fread(header, 1, sizeof(header), replayer->fh);
+    replayer->have_next = false;
+    if (got == 0 && feof(replayer->fh))
+    {
+        return true;
+    }
+    if (got != sizeof(header))
+    {
+        fputs("ssdp_mon: Truncated trace record\n", stderr);
+        return false;
+    }
+    replayer->trace_time += read_uint(header, 4);
+    replayer->family = header[4];
+    replayer->datalen = read_uint(header + 5, 2);
+    if (replayer->datalen >= sizeof(replayer->data) ||
+        (replayer->family != 4 && replayer->family != 6))
+    {
+        fputs("ssdp_mon: Invalid trace record\n", stderr);
+        return false;
+    }
+    if (fread(replayer->data, 1, replayer->datalen, replayer->fh) !=
+        replayer->datalen)
+    {
+        fputs("ssdp_mon: Truncated trace record\n", stderr);
+        return false;
+    }
+    replayer->data[replayer->datalen] = '\0';
+    replayer->have_next = true;
+    return true;
+}
+
+static void replay_send(replayer_t* replayer)
+{
+    socket_t sock;
+    struct sockaddr* host;
+    socklen_t hostlen;
+    if (replayer->family == 6)
+    {
+        sock = replayer->sock6;
+        host = replayer->host6;
+        hostlen = replayer->host6len;
+    }
+    else
+    {
+        sock = replayer->sock4;
+        host = replayer->host4;
+        hostlen = replayer->host4len;
+    }
+    if (sock < 0)
+    {
+        return;
+    }
+    if (socket_udp_write(sock, replayer->data, replayer->datalen,
+                         host, hostlen) != (ssize_t)replayer->datalen)
+    {
+        return;
+    }
+    replayer->sent++;
+    if (strncmp(replayer->data, "M-SEARCH ", 9) == 0)
+    {
+        replay_search_t* search = replayer->search + replayer->search_pos;
+        char mx[16];
+        replayer->search_pos = (replayer->search_pos + 1) % REPLAY_SEARCHES;
+        if (!find_header(replayer->data, "S", search->s, sizeof(search->s)))
+        {
+            search->s[0] = '\0';
+        }
+        if (!find_header(replayer->data, "ST", search->st,
+                         sizeof(search->st)))
+        {
+            search->st[0] = '\0';
+        }
+        search->mx = 0;
+        if (find_header(replayer->data, "MX", mx, sizeof(mx)))
+        {
+            search->mx = strtoul(mx, NULL, 10);
+        }
+        search->sent = now_usec();
+        search->answered = false;
+        replayer->searches++;
+    }
+}
+
+static long replay_timer_cb(void* userdata)
+{
+    replayer_t* replayer = userdata;
+    uint64_t elapsed, due;
+    for (;;)
+    {
+        if (!replayer->have_next)
+        {
+            /* Done, give the last searches a chance to get answered */
+            if (!replayer->err && now_usec() - replayer->start >=
+                replayer->trace_time / replayer->opts->speed +
+                RESPONSE_GRACE_MS * 1000)
+            {
+                quit = true;
+                return -1;
+            }
+            return 100;
+        }
+        elapsed = now_usec() - replayer->start;
+        due = replayer->trace_time / replayer->opts->speed;
+        if (due > elapsed)
+        {
+            unsigned long ms = (due - elapsed) / 1000;
+            return ms > 0 ? ms : 1;
+        }
+        replay_send(replayer);
+        if (!replay_read_next(replayer))
+        {
+            replayer->err = true;
+            quit = true;
+            return -1;
+        }
+    }
+}
+
+static void replay_read_cb(void* userdata, socket_t sock)
+{
+    replayer_t* replayer = userdata;
+    char buf[TRACE_MAX_DATA], s[128], st[256];
+    uint64_t now;
+    size_t i;
+    ssize_t got = socket_udp_read(sock, buf, sizeof(buf) - 1, NULL, NULL);
+    if (got <= 0)
+    {
+        return;
+    }
+    buf[got] = '\0';
+    if (strncmp(buf, "HTTP/1.1 200", 12) != 0 ||
+        !find_header(buf, "ST", st, sizeof(st)))
+    {
+        return;
+    }
+    if (!find_header(buf, "S", s, sizeof(s)))
+    {
+        s[0] = '\0';
+    }
+    now = now_usec();
+    /* Match with the most recent search with the same S or ST */
+    for (i = 0; i < REPLAY_SEARCHES; ++i)
+    {
+        size_t idx = (replayer->search_pos + REPLAY_SEARCHES - 1 - i) %
+            REPLAY_SEARCHES;
+        replay_search_t* search = replayer->search + idx;
+        if (search->sent == 0)
+        {
+            break;
+        }
+        if (search->s[0] != '\0' ? strcmp(search->s, s) == 0 :
+            (strcmp(search->st, st) == 0 ||
+             strcmp(search->st, "ssdp:all") == 0))
+        {
+            latency_add(&replayer->latency, now - search->sent, search->mx);
+            if (!search->answered)
+            {
+                search->answered = true;
+                replayer->answered++;
+            }
+            break;
+        }
+    }
+}
+
+static socket_t sender_setup(selector_t selector, const char* any,
+                             void* userdata, read_callback_t read_cb)
+{
+    socket_t sock = socket_udp_listen(any, 0);
+    if (sock >= 0)
+    {
+        socket_multicast_setttl(sock, 1);
+        selector_add(selector, sock, userdata, read_cb, NULL);
+    }
+    return sock;
+}
+
+int run_replay(const options_t* opts)
+{
+    selector_t selector;
+    timers_t timers;
+    replayer_t replayer;
+    char magic[sizeof(TRACE_MAGIC)];
+    bool err;
+
+    memset(&replayer, 0, sizeof(replayer));
+    replayer.opts = opts;
+    replayer.fh = fopen(opts->file, "rb");
+    if (replayer.fh == NULL)
+    {
+        fprintf(stderr, "ssdp_mon: Unable to open %s: %s\n",
+                opts->file, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    if (fread(magic, 1, sizeof(magic), replayer.fh) != sizeof(magic) ||
+        memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0)
+    {
+        fprintf(stderr, "ssdp_mon: %s is not a SSDP trace\n", opts->file);
+        fclose(replayer.fh);
+        return EXIT_FAILURE;
+    }
+    if (!replay_read_next(&replayer))
+    {
+        fclose(replayer.fh);
+        return EXIT_FAILURE;
+    }
+
+    selector = selector_new();
+    timers = timers_new();
+    replayer.sock4 = sender_setup(selector, IPV4_ANY, &replayer,
+                                  replay_read_cb);
+    replayer.sock6 = sender_setup(selector, IPV6_ANY, &replayer,
+                                  replay_read_cb);
+    replayer.host4 = parse_addr(IPV4_GROUP, opts->port, &replayer.host4len,
+                                false);
+    replayer.host6 = parse_addr(IPV6_GROUP, opts->port, &replayer.host6len,
+                                false);
+    replayer.start = now_usec();
+    timers_add(timers, 0, &replayer, replay_timer_cb);
+
+    err = loop(selector, timers);
+
+    fprintf(stdout, "Replayed %lu datagrams at %ux\n", replayer.sent,
+            opts->speed);
+    latency_report(&replayer.latency, replayer.searches, replayer.answered);
+
+    if (replayer.sock4 >= 0)
+    {
+        selector_remove(selector, replayer.sock4);
+        socket_close(replayer.sock4);
+    }
+    if (replayer.sock6 >= 0)
+    {
+        selector_remove(selector, replayer.sock6);
+        socket_close(replayer.sock6);
+    }
+    free(replayer.host4);
+    free(replayer.host6);
+    timers_free(timers);
     selector_free(selector);
-    log_close(log);
-    return EXIT_SUCCESS;
+    fclose(replayer.fh);
+    return err || replayer.err ? EXIT_FAILURE : EXIT_SUCCESS;
 }
 
-void quit_cb(int signum)
+/* Storm */
+
+typedef struct _storm_search_t
 {
-    quit = true;
+    uint64_t sent;
+    unsigned int mx;
+    bool answered;
+} storm_search_t;
+
+typedef struct _storm_t
+{
+    const options_t* opts;
+    ssdp_t notify_ssdp, search_ssdp;
+    struct sockaddr* notify_host, * search_host;
+    socklen_t notify_hostlen, search_hostlen;
+    char prefix[32];
+    char location[64];
+    /* Each device sends 3 + services NOTIFY per interval, for the root
+     * device, the uuid, the device type and each service */
+    unsigned long per_device;
+    uint64_t start, stop;
+    unsigned long notifies, searches, answered;
+    storm_search_t* search;
+    size_t search_alloc;
+    latency_t latency;
+    bool stopped;
+} storm_t;
+
+static const unsigned long STORM_TICK_MS = 10;
+static const char* STORM_DEVICE_TYPE = "urn:schemas-upnp-org:device:MediaServer:1";
+
+/* Fill notify with NOTIFY number idx, usn and nt must have room for 128 */
+static void storm_notify(storm_t* storm, unsigned long idx,
+                         ssdp_notify_t* notify, char* usn, char* nt)
+{
+    unsigned long device = idx / storm->per_device;
+    unsigned long type = idx % storm->per_device;
+    memset(notify, 0, sizeof(ssdp_notify_t));
+    notify->host = storm->notify_host;
+    notify->hostlen = storm->notify_hostlen;
+    notify->location = storm->location;
+    notify->server = (char*)"Linux/1.0 UPnP/1.0 ssdp_mon/" VERSION;
+    notify->expires = ssdp_now(storm->notify_ssdp) + 1800;
+    notify->usn = usn;
+    notify->nt = nt;
+    switch (type)
+    {
+    case 0:
+        strcpy(nt, "upnp:rootdevice");
+        break;
+    case 1:
+        snprintf(nt, 128, "%s%08lx", storm->prefix, device);
+        break;
+    case 2:
+        strcpy(nt, STORM_DEVICE_TYPE);
+        break;
+    default:
+        snprintf(nt, 128, "urn:schemas-upnp-org:service:Storm%lu:1",
+                 type - 3);
+        break;
+    }
+    if (type == 1)
+    {
+        strcpy(usn, nt);
+    }
+    else
+    {
+        snprintf(usn, 128, "%s%08lx::%s", storm->prefix, device, nt);
+    }
+}
+
+static void storm_search(storm_t* storm)
+{
+    ssdp_search_t search;
+    char s[64], st[128];
+    unsigned long pick;
+    if (storm->searches == storm->search_alloc)
+    {
+        size_t nalloc = storm->search_alloc ? storm->search_alloc * 2 : 256;
+        storm_search_t* tmp = realloc(storm->search,
+                                      nalloc * sizeof(storm_search_t));
+        if (tmp == NULL)
+        {
+            return;
+        }
+        storm->search = tmp;
+        storm->search_alloc = nalloc;
+    }
+    memset(&search, 0, sizeof(search));
+    search.host = storm->search_host;
+    search.hostlen = storm->search_hostlen;
+    snprintf(s, sizeof(s), "%ssearch-%lu", storm->prefix, storm->searches);
+    search.s = s;
+    /* Mix of wide and narrow searches, like real control points do */
+    pick = rand() % (storm->opts->services + 3);
+    switch (pick)
+    {
+    case 0:
+        search.st = (char*)"ssdp:all";
+        break;
+    case 1:
+        search.st = (char*)"upnp:rootdevice";
+        break;
+    case 2:
+        search.st = (char*)STORM_DEVICE_TYPE;
+        break;
+    default:
+        snprintf(st, sizeof(st), "urn:schemas-upnp-org:service:Storm%lu:1",
+                 pick - 3);
+        search.st = st;
+        break;
+    }
+    search.mx = storm->opts->mx_min +
+        rand() % (storm->opts->mx_max - storm->opts->mx_min + 1);
+    if (!ssdp_search(storm->search_ssdp, &search))
+    {
+        return;
+    }
+    storm->search[storm->searches].sent = now_usec();
+    storm->search[storm->searches].mx = search.mx;
+    storm->search[storm->searches].answered = false;
+    storm->searches++;
+}
+
+static long storm_timer_cb(void* userdata)
+{
+    storm_t* storm = userdata;
+    const options_t* opts = storm->opts;
+    uint64_t now = now_usec(), elapsed;
+    unsigned long total = opts->devices * storm->per_device, due;
+
+    if (storm->stopped)
+    {
+        if (now >= storm->stop)
+        {
+            quit = true;
+            return -1;
+        }
+        return 100;
+    }
+    if (now - storm->start >= (uint64_t)opts->duration * 1000000)
+    {
+        storm->stopped = true;
+        storm->stop = now + RESPONSE_GRACE_MS * 1000 +
+            (uint64_t)opts->mx_max * 1000000;
+        return 100;
+    }
+    elapsed = now - storm->start;
+
+    /* All NOTIFY for all devices are spread evenly over the interval */
+    due = (elapsed * total) / ((uint64_t)opts->notify_interval * 1000000);
+    while (storm->notifies <= due && total > 0)
+    {
+        ssdp_notify_t notify;
+        char usn[128], nt[128];
+        storm_notify(storm, storm->notifies % total, &notify, usn, nt);
+        ssdp_notify(storm->notify_ssdp, &notify);
+        storm->notifies++;
+    }
+    due = (elapsed * opts->search_rate) / 1000000;
+    while (storm->searches < due)
+    {
+        unsigned long before = storm->searches;
+        storm_search(storm);
+        if (storm->searches == before)
+        {
+            break;
+        }
+    }
+    return STORM_TICK_MS;
 }
 
+static void storm_search_resp_cb(void* userdata, ssdp_search_t* search,
+                                 ssdp_notify_t* notify)
+{
+    storm_t* storm = userdata;
+    size_t len = strlen(storm->prefix);
+    unsigned long idx;
+    char* end;
+    if (search->s == NULL || strncmp(search->s, storm->prefix, len) != 0 ||
+        strncmp(search->s + len, "search-", 7) != 0)
+    {
+        return;
+    }
+    errno = 0;
+    idx = strtoul(search->s + len + 7, &end, 10);
+    if (errno || *end != '\0' || idx >= storm->searches)
+    {
+        return;
+    }
+    latency_add(&storm->latency, now_usec() - storm->search[idx].sent,
+                storm->search[idx].mx);
+    if (!storm->search[idx].answered)
+    {
+        storm->search[idx].answered = true;
+        storm->answered++;
+    }
+}
+
+int run_storm(const options_t* opts)
+{
+    selector_t selector;
+    timers_t timers;
+    storm_t storm;
+    log_t log;
+    bool err;
+    unsigned long i;
+
+    memset(&storm, 0, sizeof(storm));
+    storm.opts = opts;
+    storm.per_device = 3 + opts->services;
+    srand(time(NULL) ^ getpid());
+    snprintf(storm.prefix, sizeof(storm.prefix), "uuid:storm-%08x-",
+             (unsigned int)rand());
+    snprintf(storm.location, sizeof(storm.location),
+             "http://127.0.0.1:9/storm.xml");
+
+    log = log_open();
+    selector = selector_new();
+    timers = timers_new();
+    storm.notify_ssdp = ssdp_new(log, selector, timers, NULL, opts->port,
+                                 &storm, NULL, storm_search_resp_cb, NULL);
+    if (storm.notify_ssdp != NULL && opts->search_port != opts->port)
+    {
+        storm.search_ssdp = ssdp_new(log, selector, timers, NULL,
+                                     opts->search_port, &storm, NULL,
+                                     storm_search_resp_cb, NULL);
+    }
+    else
+    {
+        storm.search_ssdp = storm.notify_ssdp;
+    }
+    if (storm.notify_ssdp == NULL || storm.search_ssdp == NULL)
+    {
+        fputs("ssdp_mon: Failed to setup SSDP.\n", stderr);
+        if (storm.notify_ssdp != NULL)
+        {
+            ssdp_free(storm.notify_ssdp);
+        }
+        timers_free(timers);
+        selector_free(selector);
+        log_close(log);
+        return EXIT_FAILURE;
+    }
+    storm.notify_host = ssdp_getnotifyhost(storm.notify_ssdp,
+                                           &storm.notify_hostlen);
+    storm.search_host = ssdp_getnotifyhost(storm.search_ssdp,
+                                           &storm.search_hostlen);
+
+    fprintf(stdout, "Storm of %u devices with %u services each, %lu NOTIFY"
+            " every %u s and %u M-SEARCH/s (MX %u-%u) for %u s\n",
+            opts->devices, opts->services,
+            (unsigned long)opts->devices * storm.per_device,
+            opts->notify_interval, opts->search_rate, opts->mx_min,
+            opts->mx_max, opts->duration);
+    fflush(stdout);
+
+    storm.start = now_usec();
+    timers_add(timers, STORM_TICK_MS, &storm, storm_timer_cb);
+
+    err = loop(selector, timers);
+
+    /* Say goodbye so the daemon doesn't keep the storm around */
+    for (i = 0; i < opts->devices * storm.per_device; ++i)
+    {
+        ssdp_notify_t notify;
+        char usn[128], nt[128];
+        storm_notify(&storm, i, &notify, usn, nt);
+        ssdp_byebye(storm.notify_ssdp, &notify);
+    }
+
+    fprintf(stdout, "%lu NOTIFY sent\n", storm.notifies);
+    latency_report(&storm.latency, storm.searches, storm.answered);
+
+    if (storm.search_ssdp != storm.notify_ssdp)
+    {
+        ssdp_free(storm.search_ssdp);
+    }
+    ssdp_free(storm.notify_ssdp);
+    free(storm.notify_host);
+    free(storm.search_host);
+    free(storm.search);
+    timers_free(timers);
+    selector_free(selector);
+    log_close(log);
+    return err ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* Monitor */
+
 void search_cb(void* userdata, ssdp_search_t* search)
 {
     char* tmp;
@@ -113,6 +1241,7 @@ void search_cb(void* userdata, ssdp_search_t* search)
 void search_resp_cb(void* userdata, ssdp_search_t* search, ssdp_notify_t* notify)
 {
     char* tmp;
+    time_t expires;
     fputs("*** Search response\n", stdout);
     if (search->s != NULL)
         fprintf(stdout, "* S: %s\n", search->s);
@@ -127,7 +1256,8 @@ void search_resp_cb(void* userdata, ssdp_search_t* search, ssdp_notify_t* notify
     if (notify->nls != NULL)
         fprintf(stdout, "* 01-NLS: %s\n", notify->nls);
     tmp = malloc(256);
-    strftime(tmp, 256, "%a, %d %b %Y %H:%M:%S %z", localtime(&notify->expires));
+    expires = ssdp_expires_wall(notify->expires);
+    strftime(tmp, 256, "%a, %d %b %Y %H:%M:%S %z", localtime(&expires));
     fprintf(stdout, "* Expires: %s\n", tmp);
     free(tmp);
 }
@@ -135,6 +1265,7 @@ void search_resp_cb(void* userdata, ssdp_search_t* search, ssdp_notify_t* notify
 void notify_cb(void* userdata, ssdp_notify_t* notify)
 {
     char* tmp;
+    time_t expires;
     fputs("*** Notify request\n", stdout);
     asprinthost(&tmp, notify->host, notify->hostlen);
     fprintf(stdout, "* Host: %s\n", tmp);
@@ -154,7 +1285,8 @@ void notify_cb(void* userdata, ssdp_notify_t* notify)
     if (notify->nls != NULL)
         fprintf(stdout, "* 01-NLS: %s\n", notify->nls);
     tmp = malloc(256);
-    strftime(tmp, 256, "%a, %d %b %Y %H:%M:%S %z", localtime(&notify->expires));
+    expires = ssdp_expires_wall(notify->expires);
+    strftime(tmp, 256, "%a, %d %b %Y %H:%M:%S %z", localtime(&expires));
     fprintf(stdout, "* Expires: %s\n", tmp);
     free(tmp);
 }
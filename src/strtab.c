@@ -0,0 +1,161 @@
+/*
+ * Copyright (C) 2011, Joel Klinghed.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the project nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE PROJECT AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE PROJECT OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "common.h"
+
+#include "strtab.h"
+#include "map.h"
+#include <string.h>
+
+/* The string is stored right after the entry, in the same allocation, so
+ * that strtab_release can find the entry without hashing the string */
+typedef struct _entry_t
+{
+    uint32_t hash;
+    size_t len;
+    unsigned long refs;
+    const char* str;
+} entry_t;
+
+struct _strtab_t
+{
+    /* Of entry_t pointers */
+    map_t entries;
+};
+
+static uint32_t entry_hash(const void* element);
+static bool entry_eq(const void* e1, const void* e2);
+static void entry_free(void* element);
+
+strtab_t strtab_new(void)
+{
+    strtab_t tab = calloc(1, sizeof(struct _strtab_t));
+    tab->entries = map_new(sizeof(entry_t*), entry_hash, entry_eq,
+                           entry_free);
+    return tab;
+}
+
+void strtab_free(strtab_t tab)
+{
+    if (tab == NULL)
+    {
+        return;
+    }
+    map_free(tab->entries);
+    free(tab);
+}
+
+static uint32_t str_hash(const char* str, size_t len)
+{
+    /* FNV-1a */
+    uint32_t hash = 2166136261u;
+    size_t i;
+    for (i = 0; i < len; ++i)
+    {
+        hash ^= (unsigned char)str[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+char* strtab_intern(strtab_t tab, const char* str)
+{
+    if (str == NULL)
+    {
+        return NULL;
+    }
+    return strtab_internn(tab, str, strlen(str));
+}
+
+char* strtab_internn(strtab_t tab, const char* str, size_t len)
+{
+    entry_t key, *keyptr = &key, **entryptr, *entry;
+    key.hash = str_hash(str, len);
+    key.len = len;
+    key.str = str;
+    entryptr = map_get(tab->entries, &keyptr);
+    if (entryptr != NULL)
+    {
+        entry = *entryptr;
+        entry->refs++;
+        return (char*)entry->str;
+    }
+    entry = malloc(sizeof(entry_t) + len + 1);
+    entry->hash = key.hash;
+    entry->len = len;
+    entry->refs = 1;
+    memcpy(entry + 1, str, len);
+    ((char*)(entry + 1))[len] = '\0';
+    entry->str = (const char*)(entry + 1);
+    map_put(tab->entries, &entry);
+    return (char*)entry->str;
+}
+
+void strtab_release(strtab_t tab, char* str)
+{
+    entry_t* entry, **entryptr;
+    if (str == NULL)
+    {
+        return;
+    }
+    entry = ((entry_t*)str) - 1;
+    assert(entry->str == str && entry->refs > 0);
+    if (--entry->refs == 0)
+    {
+        /* Remove by the element in the map, map_remove stops once that is
+         * freed. A key referring to the entry would be compared against
+         * the rest of the probe sequence after the entry is gone */
+        entryptr = map_get(tab->entries, &entry);
+        assert(entryptr != NULL && *entryptr == entry);
+        map_remove(tab->entries, entryptr);
+    }
+}
+
+size_t strtab_size(strtab_t tab)
+{
+    return map_size(tab->entries);
+}
+
+uint32_t entry_hash(const void* element)
+{
+    return (*((const entry_t* const*)element))->hash;
+}
+
+bool entry_eq(const void* e1, const void* e2)
+{
+    const entry_t* a = *((const entry_t* const*)e1);
+    const entry_t* b = *((const entry_t* const*)e2);
+    return a == b || (a->hash == b->hash && a->len == b->len &&
+                      memcmp(a->str, b->str, a->len) == 0);
+}
+
+void entry_free(void* element)
+{
+    free(*((entry_t**)element));
+}
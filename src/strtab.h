@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2011, Joel Klinghed.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the project nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE PROJECT AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE PROJECT OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef STRTAB_H
+#define STRTAB_H
+
+/* Table of interned strings. Equal strings added to the same table share
+ * one copy, so two interned strings are equal if and only if the pointers
+ * are. Each intern call adds a reference that strtab_release gives back,
+ * the string is freed with the last one. Interned strings must not be
+ * changed */
+
+typedef struct _strtab_t* strtab_t;
+
+strtab_t strtab_new(void);
+/* All strings still in the table are freed */
+void strtab_free(strtab_t tab);
+
+/* Returns NULL if str is NULL */
+char* strtab_intern(strtab_t tab, const char* str);
+/* As strtab_intern but str doesn't need to be NUL terminated */
+char* strtab_internn(strtab_t tab, const char* str, size_t len);
+/* Does nothing if str is NULL */
+void strtab_release(strtab_t tab, char* str);
+
+/* Number of distinct strings in the table */
+size_t strtab_size(strtab_t tab);
+
+#endif /* STRTAB_H */
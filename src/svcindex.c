@@ -0,0 +1,187 @@
+/*
+ * Copyright (C) 2011, Joel Klinghed.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the project nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE PROJECT AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE PROJECT OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "common.h"
+
+#include "svcindex.h"
+#include "map.h"
+#include "vector.h"
+#include <string.h>
+
+typedef struct _bucket_t
+{
+    /* In buckets in the map nt and usn are in one allocation starting at
+     * nt, owned by the bucket */
+    const char* nt;
+    size_t ntlen;
+    const char* usn;
+    size_t usnlen;
+    vector_t services;
+} bucket_t;
+
+struct _svcindex_t
+{
+    map_t buckets;
+    size_t count;
+};
+
+static uint32_t bucket_hash(const void* element);
+static bool bucket_eq(const void* e1, const void* e2);
+static void bucket_free(void* element);
+
+svcindex_t svcindex_new(void)
+{
+    svcindex_t index = calloc(1, sizeof(struct _svcindex_t));
+    index->buckets = map_new(sizeof(bucket_t), bucket_hash, bucket_eq,
+                             bucket_free);
+    return index;
+}
+
+void svcindex_free(svcindex_t index)
+{
+    if (index == NULL)
+    {
+        return;
+    }
+    map_free(index->buckets);
+    free(index);
+}
+
+static void bucket_key(bucket_t* key, const char* nt, size_t ntlen,
+                       const char* usn, size_t usnlen)
+{
+    key->nt = nt;
+    key->ntlen = ntlen;
+    key->usn = usn;
+    key->usnlen = usnlen;
+    key->services = NULL;
+}
+
+void svcindex_add(svcindex_t index, const char* nt, size_t ntlen,
+                  const char* usn, size_t usnlen, void* service)
+{
+    bucket_t key, *bucket;
+    bucket_key(&key, nt, ntlen, usn, usnlen);
+    bucket = map_get(index->buckets, &key);
+    if (bucket == NULL)
+    {
+        char* tmp = malloc(ntlen + usnlen + 1);
+        memcpy(tmp, nt, ntlen);
+        memcpy(tmp + ntlen, usn, usnlen);
+        tmp[ntlen + usnlen] = '\0';
+        bucket_key(&key, tmp, ntlen, tmp + ntlen, usnlen);
+        key.services = vector_new(sizeof(void*));
+        bucket = map_put(index->buckets, &key);
+    }
+    vector_push(bucket->services, &service);
+    index->count++;
+}
+
+bool svcindex_remove(svcindex_t index, const char* nt, size_t ntlen,
+                     const char* usn, size_t usnlen, void* service)
+{
+    bucket_t key, *bucket;
+    size_t i;
+    bucket_key(&key, nt, ntlen, usn, usnlen);
+    bucket = map_get(index->buckets, &key);
+    if (bucket == NULL)
+    {
+        return false;
+    }
+    for (i = 0; i < vector_size(bucket->services); ++i)
+    {
+        if (*((void**)vector_get(bucket->services, i)) == service)
+        {
+            vector_remove(bucket->services, i);
+            index->count--;
+            if (vector_size(bucket->services) == 0)
+            {
+                map_remove(index->buckets, &key);
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+void* const* svcindex_get(svcindex_t index, const char* nt, size_t ntlen,
+                          const char* usn, size_t usnlen, size_t* count)
+{
+    bucket_t key, *bucket;
+    bucket_key(&key, nt, ntlen, usn, usnlen);
+    bucket = map_get(index->buckets, &key);
+    if (bucket == NULL)
+    {
+        *count = 0;
+        return NULL;
+    }
+    *count = vector_size(bucket->services);
+    return vector_get(bucket->services, 0);
+}
+
+size_t svcindex_size(svcindex_t index)
+{
+    return index->count;
+}
+
+static uint32_t hash_bytes(uint32_t hash, const char* data, size_t len)
+{
+    /* FNV-1a */
+    size_t i;
+    for (i = 0; i < len; ++i)
+    {
+        hash ^= (unsigned char)data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+uint32_t bucket_hash(const void* element)
+{
+    const bucket_t* bucket = element;
+    uint32_t hash = hash_bytes(2166136261u, bucket->nt, bucket->ntlen);
+    /* So that moving chars between nt and usn changes the hash */
+    hash = hash_bytes(hash, "", 1);
+    return hash_bytes(hash, bucket->usn, bucket->usnlen);
+}
+
+bool bucket_eq(const void* e1, const void* e2)
+{
+    const bucket_t* b1 = e1, *b2 = e2;
+    return b1->ntlen == b2->ntlen && b1->usnlen == b2->usnlen &&
+        memcmp(b1->nt, b2->nt, b1->ntlen) == 0 &&
+        memcmp(b1->usn, b2->usn, b1->usnlen) == 0;
+}
+
+void bucket_free(void* element)
+{
+    bucket_t* bucket = element;
+    free((char*)bucket->nt);
+    vector_free(bucket->services);
+}
@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2011, Joel Klinghed.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the project nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE PROJECT AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE PROJECT OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef SVCINDEX_H
+#define SVCINDEX_H
+
+/* Index of services by their type and USN, so that SSDP messages can be
+ * matched with the services they are about without looking at all of
+ * them. Only the first ntlen and usnlen chars of the type and USN are
+ * part of the key, which lets the caller leave the UPnP version out.
+ * Each key can have any number of services */
+
+typedef struct _svcindex_t* svcindex_t;
+
+svcindex_t svcindex_new(void);
+void svcindex_free(svcindex_t index);
+
+void svcindex_add(svcindex_t index, const char* nt, size_t ntlen,
+                  const char* usn, size_t usnlen, void* service);
+/* Returns false if service wasn't added with the key */
+bool svcindex_remove(svcindex_t index, const char* nt, size_t ntlen,
+                     const char* usn, size_t usnlen, void* service);
+
+/* The services with the key in the order they were added, count is set to
+ * the number of them. Valid until the next add or remove */
+void* const* svcindex_get(svcindex_t index, const char* nt, size_t ntlen,
+                          const char* usn, size_t usnlen, size_t* count);
+
+size_t svcindex_size(svcindex_t index);
+
+#endif /* SVCINDEX_H */
@@ -35,12 +35,14 @@
 struct _timers_t
 {
     timecb_t first, last;
+    /* Cached monotonic time in ms, see timers_now */
+    uint64_t now;
 };
 
 struct _timecb_t
 {
     timecb_t prev, next;
-    struct timeval target;
+    uint64_t target;
     timers_t timers;
     void* userdata;
     timecb_callback_t callback;
@@ -49,7 +51,22 @@ struct _timecb_t
 
 timers_t timers_new(void)
 {
-    return calloc(1, sizeof(struct _timers_t));
+    timers_t timers = calloc(1, sizeof(struct _timers_t));
+    if (timers != NULL)
+    {
+        timers->now = timeval_monotonic();
+    }
+    return timers;
+}
+
+uint64_t timers_now(timers_t timers)
+{
+    return timers->now;
+}
+
+void timers_update(timers_t timers)
+{
+    timers->now = timeval_monotonic();
 }
 
 void timers_free(timers_t timers)
@@ -72,7 +89,7 @@ static void timecb_insert(timecb_t timer)
     timecb_t t = timers->first;
     if (t != NULL)
     {
-        if (timeval_cmp(&(timer->target), &(t->target)) <= 0)
+        if (timer->target <= t->target)
         {
             timers->first = timer;
             t->prev = timer;
@@ -89,7 +106,7 @@ static void timecb_insert(timecb_t timer)
         timer->next = NULL;
         return;
     }
-    if (timeval_cmp(&(timer->target), &(t->target)) > 0)
+    if (timer->target > t->target)
     {
         timers->last = timer;
         t->next = timer;
@@ -99,7 +116,7 @@ static void timecb_insert(timecb_t timer)
     }
     for (;;)
     {
-        if (timeval_cmp(&(timer->target), &(t->target)) <= 0)
+        if (timer->target <= t->target)
         {
             timer->prev = t->prev;
             timer->next = t;
@@ -142,23 +159,21 @@ timecb_t timers_add(timers_t timers, unsigned long delay_ms,
     timer->delay = delay_ms;
     timer->userdata = userdata;
     timer->callback = callback;
-    gettimeofday(&(timer->target), NULL);
-    timeval_add2(&(timer->target), delay_ms);
+    timer->target = timers->now + delay_ms;
     timecb_insert(timer);
     return timer;
 }
 
 unsigned long timers_tick(timers_t timers)
 {
+    timers_update(timers);
     for (;;)
     {
-        struct timeval now, diff;
         if (timers->first == NULL)
         {
             return 0;
         }
-        gettimeofday(&now, NULL);
-        if (timeval_diff(&diff, &(timers->first->target), &now) <= 0)
+        if (timers->first->target <= timers->now)
         {
             timecb_t t = timers->first;
             long ret;
@@ -173,8 +188,7 @@ unsigned long timers_tick(timers_t timers)
             {
                 t->delay = ret;
             }
-            gettimeofday(&(t->target), NULL);
-            timeval_add2(&(t->target), t->delay);
+            t->target = timers->now + t->delay;
             timecb_insert(t);
             if (timers->first == t)
             {
@@ -184,7 +198,7 @@ unsigned long timers_tick(timers_t timers)
         }
         else
         {
-            return (diff.tv_sec * 1000) + ((diff.tv_usec + 999) / 1000);
+            return (unsigned long)(timers->first->target - timers->now);
         }
     }
 }
@@ -197,11 +211,9 @@ void timecb_cancel(timecb_t timer)
 
 void timecb_reschedule(timecb_t timer, unsigned long delay_ms)
 {
-    struct timeval target;
-    gettimeofday(&target, NULL);
-    timeval_add2(&target, delay_ms);
+    uint64_t target = timer->timers->now + delay_ms;
     timer->delay = delay_ms;
-    if (timeval_cmp(&target, &(timer->target)) != 0)
+    if (target != timer->target)
     {
         timer->target = target;
         timecb_remove(timer);
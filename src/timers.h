@@ -45,6 +45,13 @@ void timers_free(timers_t timers);
 timecb_t timers_add(timers_t timers, unsigned long delay_ms,
                     void* userdata, timecb_callback_t callback);
 
+/* Milliseconds on the monotonic clock, sampled at the start of timers_tick
+ * and by timers_update. Everything run in the same loop iteration sees the
+ * same time, only compare it with other values from the same timers */
+uint64_t timers_now(timers_t timers);
+/* Sample the clock again, the selector does this when it wakes up */
+void timers_update(timers_t timers);
+
 /* Return the maximum delay until next call to timers_tick in ms.
  * OBS! If there are no timers 0 is returned */
 unsigned long timers_tick(timers_t timers);
@@ -31,6 +31,8 @@
 
 #include "timeval.h"
 
+#include <time.h>
+
 void timeval_add(struct timeval* target, const struct timeval* add)
 {
     target->tv_sec += add->tv_sec;
@@ -98,3 +100,17 @@ int timeval_cmp(const struct timeval* x, const struct timeval* y)
     return 0;
 }
 
+
+uint64_t timeval_monotonic(void)
+{
+    struct timeval tv;
+#if HAVE_CLOCK_GETTIME && defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+    {
+        return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    }
+#endif
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
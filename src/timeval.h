@@ -38,4 +38,8 @@ void timeval_add2(struct timeval* target, unsigned long ms);
 int timeval_diff(struct timeval* ret, const struct timeval* x, const struct timeval* y);
 int timeval_cmp(const struct timeval* x, const struct timeval* y);
 
+/* Milliseconds since some unspecified point, never jumps when the wall
+ * clock is changed. Falls back to gettimeofday without clock_gettime */
+uint64_t timeval_monotonic(void);
+
 #endif /* TIMEVAL_H */
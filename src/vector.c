@@ -199,6 +199,11 @@ void vector_removerange(vector_t vector, size_t begin, size_t end)
     char* ptr;
     assert(begin <= end);
     assert(end <= vector->count);
+    if (len == 0)
+    {
+        /* data may be NULL if the vector is empty */
+        return;
+    }
     ptr = vector->data + begin * vector->elementsize;
     vector->count -= len;
     memmove(ptr, ptr + len * vector->elementsize,
@@ -0,0 +1,338 @@
+/*
+ * Copyright (C) 2011, Joel Klinghed.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the project nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE PROJECT AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE PROJECT OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "common.h"
+
+#include "worker.h"
+#include "vector.h"
+
+#include <unistd.h>
+#include <signal.h>
+#if HAVE_PTHREAD
+# include <pthread.h>
+#endif
+
+/* Number of free buffers each worker keeps around */
+static const size_t POOL_SIZE = 32;
+/* Timeout used when there are no timers, 2 hours */
+static const unsigned long IDLE_TIMEOUT = 2 * 60 * 60 * 1000;
+
+typedef struct _job_t
+{
+    worker_job_t job;
+    void* userdata;
+} job_t;
+
+struct _worker_t
+{
+    selector_t selector;
+    timers_t timers;
+    /* selector and timers are created by the worker */
+    bool own_loop;
+    bool started;
+    bool quit;
+
+#if HAVE_PTHREAD
+    pthread_t thread;
+    pthread_mutex_t lock;
+#endif
+
+    /* Written to when queue goes from empty to non empty */
+    socket_t wake[2];
+    /* Protected by lock */
+    vector_t queue;
+    bool woken;
+
+    /* Only used by the worker thread */
+    vector_t running;
+    vector_t pool;
+};
+
+static bool worker_init(worker_t worker);
+static void worker_wake_cb(void* userdata, socket_t sock);
+static void worker_run_jobs(worker_t worker);
+
+#if HAVE_PTHREAD
+# define worker_lock(worker) pthread_mutex_lock(&((worker)->lock))
+# define worker_unlock(worker) pthread_mutex_unlock(&((worker)->lock))
+#else
+# define worker_lock(worker)
+# define worker_unlock(worker)
+#endif
+
+#if HAVE_PTHREAD
+static void* worker_main(void* userdata)
+{
+    worker_t worker = userdata;
+    while (!worker->quit)
+    {
+        unsigned long timeout_ms = timers_tick(worker->timers);
+        if (timeout_ms == 0)
+        {
+            timeout_ms = IDLE_TIMEOUT;
+        }
+        if (!selector_tick(worker->selector, timeout_ms))
+        {
+            break;
+        }
+    }
+    return NULL;
+}
+#endif
+
+worker_t worker_new(void)
+{
+#if HAVE_PTHREAD
+    worker_t worker = calloc(1, sizeof(struct _worker_t));
+    sigset_t all, old;
+    int ret;
+    if (worker == NULL)
+    {
+        return NULL;
+    }
+    worker->own_loop = true;
+    worker->selector = selector_new();
+    worker->timers = timers_new();
+    if (worker->selector == NULL || worker->timers == NULL ||
+        !worker_init(worker))
+    {
+        selector_free(worker->selector);
+        timers_free(worker->timers);
+        free(worker);
+        return NULL;
+    }
+    selector_set_timers(worker->selector, worker->timers);
+
+    /* Signals are handled by the main thread only */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    ret = pthread_create(&worker->thread, NULL, worker_main, worker);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (ret != 0)
+    {
+        worker_free(worker);
+        return NULL;
+    }
+    worker->started = true;
+    return worker;
+#else
+    return NULL;
+#endif
+}
+
+worker_t worker_new_inline(selector_t selector, timers_t timers)
+{
+    worker_t worker = calloc(1, sizeof(struct _worker_t));
+    if (worker == NULL)
+    {
+        return NULL;
+    }
+    worker->selector = selector;
+    worker->timers = timers;
+    if (!worker_init(worker))
+    {
+        free(worker);
+        return NULL;
+    }
+    return worker;
+}
+
+static bool worker_init(worker_t worker)
+{
+    if (pipe(worker->wake) != 0)
+    {
+        return false;
+    }
+    socket_setblocking(worker->wake[0], false);
+    socket_setblocking(worker->wake[1], false);
+#if HAVE_PTHREAD
+    pthread_mutex_init(&worker->lock, NULL);
+#endif
+    worker->queue = vector_new(sizeof(job_t));
+    worker->running = vector_new(sizeof(job_t));
+    worker->pool = vector_new(sizeof(buf_t));
+    selector_add(worker->selector, worker->wake[0], worker,
+                 worker_wake_cb, NULL);
+    return true;
+}
+
+#if HAVE_PTHREAD
+static void worker_quit_job(void* userdata)
+{
+    worker_t worker = userdata;
+    worker->quit = true;
+}
+#endif
+
+void worker_free(worker_t worker)
+{
+    size_t i;
+    if (worker == NULL)
+    {
+        return;
+    }
+
+#if HAVE_PTHREAD
+    if (worker->started)
+    {
+        worker_post(worker, worker_quit_job, worker);
+        pthread_join(worker->thread, NULL);
+    }
+    else
+#endif
+    {
+        for (;;)
+        {
+            bool empty;
+            worker_lock(worker);
+            empty = vector_size(worker->queue) == 0;
+            worker_unlock(worker);
+            if (empty)
+            {
+                break;
+            }
+            worker_run_jobs(worker);
+        }
+    }
+
+    selector_remove(worker->selector, worker->wake[0]);
+    close(worker->wake[0]);
+    close(worker->wake[1]);
+    if (worker->own_loop)
+    {
+        selector_free(worker->selector);
+        timers_free(worker->timers);
+    }
+#if HAVE_PTHREAD
+    pthread_mutex_destroy(&worker->lock);
+#endif
+    for (i = 0; i < vector_size(worker->pool); ++i)
+    {
+        buf_free(*((buf_t*)vector_get(worker->pool, i)));
+    }
+    vector_free(worker->pool);
+    vector_free(worker->queue);
+    vector_free(worker->running);
+    free(worker);
+}
+
+void worker_post(worker_t worker, worker_job_t job, void* userdata)
+{
+    job_t* j;
+    bool wake = false;
+    worker_lock(worker);
+    j = vector_add(worker->queue);
+    j->job = job;
+    j->userdata = userdata;
+    if (!worker->woken)
+    {
+        worker->woken = true;
+        wake = true;
+    }
+    worker_unlock(worker);
+    if (wake)
+    {
+        if (write(worker->wake[1], "", 1) < 0)
+        {
+            /* Pipe is full, so the worker is woken anyway */
+        }
+    }
+}
+
+static void worker_wake_cb(void* userdata, socket_t sock)
+{
+    worker_t worker = userdata;
+    char tmp[64];
+    while (read(sock, tmp, sizeof(tmp)) > 0)
+    {
+    }
+    worker_run_jobs(worker);
+}
+
+static void worker_run_jobs(worker_t worker)
+{
+    vector_t jobs;
+    size_t i;
+
+    worker_lock(worker);
+    jobs = worker->queue;
+    worker->queue = worker->running;
+    worker->running = jobs;
+    worker->woken = false;
+    worker_unlock(worker);
+
+    for (i = 0; i < vector_size(jobs); ++i)
+    {
+        job_t* j = vector_get(jobs, i);
+        j->job(j->userdata);
+    }
+    vector_removerange(jobs, 0, vector_size(jobs));
+}
+
+selector_t worker_selector(worker_t worker)
+{
+    return worker->selector;
+}
+
+timers_t worker_timers(worker_t worker)
+{
+    return worker->timers;
+}
+
+buf_t worker_buf_new(worker_t worker, size_t size)
+{
+    size_t i;
+    for (i = vector_size(worker->pool); i > 0; --i)
+    {
+        buf_t buf = *((buf_t*)vector_get(worker->pool, i - 1));
+        if (buf_size(buf) == size)
+        {
+            vector_remove(worker->pool, i - 1);
+            return buf;
+        }
+    }
+    return buf_new(size);
+}
+
+void worker_buf_free(worker_t worker, buf_t buf)
+{
+    if (buf == NULL)
+    {
+        return;
+    }
+    if (vector_size(worker->pool) < POOL_SIZE)
+    {
+        buf_skip(buf, buf_ravail(buf));
+        vector_push(worker->pool, &buf);
+    }
+    else
+    {
+        buf_free(buf);
+    }
+}
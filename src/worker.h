@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2011, Joel Klinghed.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the project nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE PROJECT AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE PROJECT OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef WORKER_H
+#define WORKER_H
+
+typedef struct _worker_t* worker_t;
+
+#include "selector.h"
+#include "timers.h"
+#include "buf.h"
+
+/* Called on the worker's thread */
+typedef void (* worker_job_t)(void* userdata);
+
+/* Start a new thread running its own selector and timers.
+ * Returns NULL if threads are not available or the thread failed to start */
+worker_t worker_new(void);
+
+/* Create a worker that runs its jobs in the given selector, ie. in the
+ * thread that calls selector_tick on it. Used both as the mailbox of that
+ * thread and as a worker when no threads should be started */
+worker_t worker_new_inline(selector_t selector, timers_t timers);
+
+/* Stops the worker thread (if any) after running all queued jobs.
+ * Jobs posted to an inline worker that haven't run yet are run here */
+void worker_free(worker_t worker);
+
+/* May be called from any thread, job is run on the worker's thread.
+ * Jobs from one thread are run in the order they where posted */
+void worker_post(worker_t worker, worker_job_t job, void* userdata);
+
+/* These may only be used from the worker's own thread */
+selector_t worker_selector(worker_t worker);
+timers_t worker_timers(worker_t worker);
+
+/* Buffers are recycled by the worker instead of being freed.
+ * May only be called from the worker's own thread */
+buf_t worker_buf_new(worker_t worker, size_t size);
+void worker_buf_free(worker_t worker, buf_t buf);
+
+#endif /* WORKER_H */
@@ -0,0 +1,421 @@
+/*
+ * Copyright (C) 2011, Joel Klinghed.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the project nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE PROJECT AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE PROJECT OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Benchmark of answering ssdp:all.
+ * A responder process answers M-SEARCH for a number of fake services on a
+ * private SSDP port, the benchmark sends ssdp:all searches to it and times
+ * the answers. The CPU use and the number of times the responder had to
+ * wake up are taken from its rusage when it exits */
+
+#include "common.h"
+
+#include "ssdp.h"
+#include "selector.h"
+#include "timers.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+typedef struct _options_t
+{
+    unsigned int services;
+    unsigned int searches;
+    unsigned int mx;
+    /* Times each search is sent, like control points do */
+    unsigned int copies;
+    /* search_rate of the responder, 0 for no limit */
+    unsigned long rate;
+    uint16_t port;
+} options_t;
+
+typedef struct _responder_t
+{
+    ssdp_t ssdp;
+    unsigned int count;
+    char** usn;
+    char* location;
+} responder_t;
+
+typedef struct _searcher_t
+{
+    const char* s;
+    unsigned long answers;
+    uint64_t sent, first, last;
+} searcher_t;
+
+static const char* SERVICE_TYPE = "urn:schemas-upnp-org:service:ContentDirectory:1";
+
+static bool parse_args(int argc, char** argv, options_t* opts);
+static pid_t start_responder(const options_t* opts);
+static bool run_search(const options_t* opts, ssdp_t ssdp,
+                       selector_t selector, searcher_t* searcher);
+
+static uint64_t now_usec(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void search_resp_cb(void* userdata, ssdp_search_t* search,
+                           ssdp_notify_t* notify)
+{
+    searcher_t* searcher = userdata;
+    uint64_t now;
+    if (searcher->s == NULL || search->s == NULL ||
+        strcmp(search->s, searcher->s) != 0)
+    {
+        return;
+    }
+    now = now_usec();
+    if (searcher->answers++ == 0)
+    {
+        searcher->first = now;
+    }
+    searcher->last = now;
+}
+
+int main(int argc, char** argv)
+{
+    options_t opts;
+    pid_t responder;
+    selector_t selector;
+    log_t log;
+    ssdp_t ssdp;
+    searcher_t searcher;
+    struct rusage usage;
+    unsigned long answers = 0;
+    unsigned int i;
+    int status;
+    bool ok = true;
+
+    if (!parse_args(argc, argv, &opts))
+    {
+        return EXIT_FAILURE;
+    }
+
+    srand(time(NULL) ^ getpid());
+    responder = start_responder(&opts);
+    if (responder <= 0)
+    {
+        return EXIT_FAILURE;
+    }
+    /* Give it time to join the group */
+    usleep(300 * 1000);
+
+    log = log_open();
+    selector = selector_new();
+    memset(&searcher, 0, sizeof(searcher));
+    ssdp = ssdp_new(log, selector, NULL, NULL, opts.port, &searcher, NULL,
+                    search_resp_cb, NULL);
+    if (ssdp == NULL)
+    {
+        fputs("bench: Unable to setup SSDP\n", stderr);
+        ok = false;
+    }
+    for (i = 0; ok && i < opts.searches; ++i)
+    {
+        char s[64];
+        memset(&searcher, 0, sizeof(searcher));
+        snprintf(s, sizeof(s), "uuid:bench-ssdp-%08x-%u",
+                 (unsigned int)rand(), i);
+        searcher.s = s;
+        ok = run_search(&opts, ssdp, selector, &searcher);
+        if (ok)
+        {
+            fprintf(stdout, "search %u: %lu/%u answers, first after %.1f ms,"
+                    " last after %.1f ms\n", i + 1, searcher.answers,
+                    opts.services,
+                    searcher.answers ?
+                    (searcher.first - searcher.sent) / 1000.0 : 0.0,
+                    searcher.answers ?
+                    (searcher.last - searcher.sent) / 1000.0 : 0.0);
+            answers += searcher.answers;
+        }
+        searcher.s = NULL;
+    }
+    ssdp_free(ssdp);
+    selector_free(selector);
+    log_close(log);
+
+    kill(responder, SIGTERM);
+    if (wait4(responder, &status, 0, &usage) == responder && ok)
+    {
+        double cpu_ms = (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) *
+            1000.0 + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) /
+            1000.0;
+        fprintf(stdout, "responder: cpu %.1f ms (%.2f us per answer),"
+                " %ld wakeups\n", cpu_ms,
+                answers ? cpu_ms * 1000.0 / answers : 0.0,
+                usage.ru_nvcsw);
+    }
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static void print_usage(void)
+{
+    fputs("Usage: `bench-ssdp [OPTIONS ...]`\n", stdout);
+    fputs("\n", stdout);
+    fputs("  -n N       services the responder has (default 3000)\n", stdout);
+    fputs("  -c N       number of ssdp:all searches (default 5)\n", stdout);
+    fputs("  -m MX      MX of the searches (default 3)\n", stdout);
+    fputs("  -d N       send each search N times (default 1)\n", stdout);
+    fputs("  -l BYTES   limit the responses to BYTES per second (default no limit)\n", stdout);
+    fputs("  -p PORT    SSDP port to use (default 25500)\n", stdout);
+    fputs("  -h         display this text and exit\n", stdout);
+}
+
+static bool parse_ulong(const char* str, unsigned long* value)
+{
+    char* end = NULL;
+    errno = 0;
+    *value = strtoul(str, &end, 10);
+    return !errno && end != NULL && *end == '\0' && end != str;
+}
+
+bool parse_args(int argc, char** argv, options_t* opts)
+{
+    unsigned long tmp;
+    int c;
+    memset(opts, 0, sizeof(options_t));
+    opts->services = 3000;
+    opts->searches = 5;
+    opts->mx = 3;
+    opts->copies = 1;
+    opts->port = 25500;
+    while ((c = getopt(argc, argv, "n:c:m:d:l:p:h")) != -1)
+    {
+        switch (c)
+        {
+        case 'n':
+            if (!parse_ulong(optarg, &tmp) || tmp == 0 || tmp > 1000000)
+            {
+                fprintf(stderr, "bench: Invalid number of services: %s\n",
+                        optarg);
+                return false;
+            }
+            opts->services = tmp;
+            break;
+        case 'c':
+            if (!parse_ulong(optarg, &tmp) || tmp == 0 || tmp > 1000)
+            {
+                fprintf(stderr, "bench: Invalid number of searches: %s\n",
+                        optarg);
+                return false;
+            }
+            opts->searches = tmp;
+            break;
+        case 'm':
+            if (!parse_ulong(optarg, &tmp) || tmp > 120)
+            {
+                fprintf(stderr, "bench: Invalid MX: %s\n", optarg);
+                return false;
+            }
+            opts->mx = tmp;
+            break;
+        case 'd':
+            if (!parse_ulong(optarg, &tmp) || tmp == 0 || tmp > 100)
+            {
+                fprintf(stderr, "bench: Invalid number of copies: %s\n",
+                        optarg);
+                return false;
+            }
+            opts->copies = tmp;
+            break;
+        case 'l':
+            if (!parse_ulong(optarg, &tmp) || tmp == 0)
+            {
+                fprintf(stderr, "bench: Invalid rate: %s\n", optarg);
+                return false;
+            }
+            opts->rate = tmp;
+            break;
+        case 'p':
+            if (!parse_ulong(optarg, &tmp) || tmp == 0 || tmp > 0xffff)
+            {
+                fprintf(stderr, "bench: Invalid port: %s\n", optarg);
+                return false;
+            }
+            opts->port = tmp;
+            break;
+        case 'h':
+            print_usage();
+            exit(EXIT_SUCCESS);
+        default:
+            print_usage();
+            return false;
+        }
+    }
+    if (optind < argc)
+    {
+        fputs("bench: Unexpected argument after options\n", stderr);
+        return false;
+    }
+    return true;
+}
+
+bool run_search(const options_t* opts, ssdp_t ssdp, selector_t selector,
+                searcher_t* searcher)
+{
+    ssdp_search_t search;
+    uint64_t timeout;
+    unsigned int i;
+    memset(&search, 0, sizeof(search));
+    search.host = ssdp_getnotifyhost(ssdp, &search.hostlen);
+    search.s = (char*)searcher->s;
+    search.st = (char*)"ssdp:all";
+    search.mx = opts->mx;
+    searcher->sent = now_usec();
+    for (i = 0; i < opts->copies; ++i)
+    {
+        if (!ssdp_search(ssdp, &search))
+        {
+            fputs("bench: Unable to send M-SEARCH\n", stderr);
+            free(search.host);
+            return false;
+        }
+    }
+    free(search.host);
+    /* Stragglers after MX + 2 seconds are counted as lost, wait for all of
+     * them when there are copies to see that each service is only
+     * answered once */
+    timeout = searcher->sent + (opts->mx + 2) * 1000000ull;
+    while ((opts->copies > 1 || searcher->answers < opts->services) &&
+           now_usec() < timeout)
+    {
+        if (!selector_tick(selector, 50))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Responder */
+
+static bool responder_quit = false;
+
+static void responder_quit_cb(int signum)
+{
+    responder_quit = true;
+}
+
+static void responder_search_cb(void* userdata, ssdp_search_t* search)
+{
+    responder_t* responder = userdata;
+    bool any = strcmp(search->st, "ssdp:all") == 0;
+    ssdp_notify_t notify;
+    unsigned int i;
+    memset(&notify, 0, sizeof(notify));
+    notify.location = responder->location;
+    notify.nt = (char*)SERVICE_TYPE;
+    notify.expires = ssdp_now(responder->ssdp) + 1800;
+    if (!any && strcmp(search->st, SERVICE_TYPE) != 0)
+    {
+        return;
+    }
+    for (i = 0; i < responder->count; ++i)
+    {
+        notify.usn = responder->usn[i];
+        ssdp_search_response(responder->ssdp, search, &notify);
+    }
+}
+
+pid_t start_responder(const options_t* opts)
+{
+    responder_t responder;
+    selector_t selector;
+    timers_t timers;
+    log_t log;
+    unsigned int i;
+    pid_t pid = fork();
+    if (pid != 0)
+    {
+        if (pid < 0)
+        {
+            fprintf(stderr, "bench: Unable to fork: %s\n", strerror(errno));
+        }
+        return pid;
+    }
+
+    signal(SIGTERM, responder_quit_cb);
+    memset(&responder, 0, sizeof(responder));
+    responder.count = opts->services;
+    responder.usn = calloc(responder.count, sizeof(char*));
+    for (i = 0; i < responder.count; ++i)
+    {
+        if (asprintf(&responder.usn[i], "uuid:bench-%08x::%s", i,
+                     SERVICE_TYPE) == -1)
+        {
+            _exit(EXIT_FAILURE);
+        }
+    }
+    responder.location = (char*)"http://127.0.0.1:9/desc.xml";
+    log = log_open();
+    selector = selector_new();
+    timers = timers_new();
+    selector_set_timers(selector, timers);
+    responder.ssdp = ssdp_new(log, selector, timers, NULL, opts->port,
+                              &responder, responder_search_cb, NULL, NULL);
+    if (responder.ssdp == NULL)
+    {
+        fputs("bench: Responder unable to setup SSDP\n", stderr);
+        _exit(EXIT_FAILURE);
+    }
+    ssdp_set_search_limit(responder.ssdp, opts->rate, opts->rate);
+
+    while (!responder_quit)
+    {
+        unsigned long timeout = timers_tick(timers);
+        /* No timers, wait for the next search */
+        if (!selector_tick(selector, timeout > 0 ? timeout : 1000))
+        {
+            break;
+        }
+    }
+    {
+        ssdp_stats_t stats;
+        ssdp_stats(responder.ssdp, &stats);
+        fprintf(stdout, "responder: %lu searches, %lu duplicates, %lu over"
+                " the limit, %lu answers, %lu answers over the limit\n",
+                stats.searches, stats.duplicates, stats.limited,
+                stats.answers, stats.answers_limited);
+        fflush(stdout);
+    }
+    _exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,2116 @@
+/*
+ * Copyright (C) 2011, Joel Klinghed.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the project nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE PROJECT AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE PROJECT OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* End-to-end benchmark of the tunnel data path.
+ * Starts two upnpproxy daemons (A and B) on loopback, each on its own private
+ * SSDP port so they act as if they were on two different networks.
+ * A fake device announces itself on A:s network, the daemons connect to
+ * each other and B announces the proxied device on its network, where
+ * the benchmark clients find it and run their requests through B and A.
+ * Last the clients subscribe to the events of the device at B, the device
+ * should only see the one subscription of A */
+
+#include "common.h"
+
+#include "ssdp.h"
+#include "selector.h"
+#include "socket.h"
+#include "timers.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+typedef struct _options_t
+{
+    const char* daemon;
+    /* If not NULL daemon A, the one with the device, is run from this */
+    const char* old_daemon;
+    unsigned int clients;
+    unsigned int requests;
+    unsigned int streams;
+    unsigned long stream_size;
+    /* Events each subscribed client waits for */
+    unsigned int events;
+    uint16_t base_port;
+    /* < 0 means use the daemon default */
+    int worker_threads;
+    /* NULL means use the daemon default */
+    const char* compression;
+    /* 0 means use the daemon default */
+    unsigned long tunnel_quantum;
+    /* Let the daemons share one port for all services */
+    bool service_port;
+    /* Hand over both daemons to new ones between the phases */
+    bool handover;
+    /* Stream while the daemons keep reloading their config */
+    bool reload;
+    /* Hold back what B sends A for this many ms after connecting */
+    unsigned long link_delay;
+    bool keep;
+} options_t;
+
+typedef struct _result_t
+{
+    uint32_t usec;
+    uint32_t ok;
+    uint64_t bytes;
+} result_t;
+
+typedef struct _stats_t
+{
+    uint32_t* usec;
+    size_t count, alloc;
+    size_t failed;
+    uint64_t bytes;
+} stats_t;
+
+static const char* SERVICE_TYPE = "urn:schemas-upnp-org:service:ContentDirectory:1";
+static const unsigned long DISCOVER_TIMEOUT = 20 * 1000;
+static const unsigned long REQUEST_TIMEOUT = 10 * 1000;
+/* Far more than fits in the buffers between the client and the device */
+static const uint64_t HANDOVER_STREAM = 1024 * 1024 * 1024;
+
+static char tmpdir[] = "/tmp/upnpproxy-bench.XXXXXX";
+
+static bool parse_args(int argc, char** argv, options_t* opts);
+static uint16_t b_peer_port(const options_t* opts);
+static bool write_config(const options_t* opts, const char* name,
+                         uint16_t port, uint16_t peer_port,
+                         uint16_t extra_port, uint16_t tunnel_port,
+                         uint16_t mcast_port);
+static pid_t start_daemon(const options_t* opts, const char* name,
+                          uint16_t port, uint16_t peer_port,
+                          uint16_t tunnel_port, uint16_t mcast_port);
+static pid_t start_reloader(const options_t* opts, pid_t daemon_a,
+                            pid_t daemon_b);
+static bool link_kept(const char* name, uint16_t peer_port);
+static bool write_all(socket_t sock, const char* data, size_t len);
+static pid_t start_relay(uint16_t port, uint16_t target,
+                         unsigned long delay);
+static pid_t start_device(const options_t* opts, const char* usn);
+static bool discover(const options_t* opts, const char* usn,
+                     struct sockaddr** addr, socklen_t* addrlen,
+                     char** base);
+static bool run_events(const options_t* opts,
+                       const struct sockaddr* addr, socklen_t addrlen,
+                       const char* base, pid_t daemon_a, pid_t daemon_b);
+static bool run_phase(const options_t* opts, const char* name, bool stream,
+                      bool loaded, const struct sockaddr* addr,
+                      socklen_t addrlen, const char* base,
+                      pid_t daemon_a, pid_t daemon_b);
+static pid_t handover(const char* name, pid_t pid);
+static pid_t handover_tunnels(const options_t* opts, const char* name,
+                              pid_t pid, const struct sockaddr* addr,
+                              socklen_t addrlen, const char* base);
+static void stop(pid_t pid);
+
+int main(int argc, char** argv)
+{
+    options_t opts;
+    pid_t device, daemon_a, daemon_b, relay = 0;
+    struct sockaddr* addr = NULL;
+    socklen_t addrlen = 0;
+    char* base = NULL;
+    char usn[128];
+    bool ok;
+
+    if (!parse_args(argc, argv, &opts))
+    {
+        return EXIT_FAILURE;
+    }
+
+    if (mkdtemp(tmpdir) == NULL)
+    {
+        fprintf(stderr, "bench: Unable to create temporary directory: %s\n",
+                strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    srand(time(NULL) ^ getpid());
+    snprintf(usn, sizeof(usn),
+             "uuid:bench-%08x-%04x::%s", (unsigned int)rand(),
+             (unsigned int)(getpid() & 0xffff), SERVICE_TYPE);
+
+    device = start_device(&opts, usn);
+    if (opts.link_delay > 0)
+    {
+        relay = start_relay(b_peer_port(&opts), opts.base_port,
+                            opts.link_delay);
+    }
+    /* Start A first and give it time to fail connecting to B, B then
+     * connects to A and we end up with only one connection between them */
+    daemon_a = start_daemon(&opts, "a", opts.base_port, opts.base_port + 1,
+                            opts.base_port + 100, opts.base_port + 40);
+    usleep(300 * 1000);
+    daemon_b = start_daemon(&opts, "b", opts.base_port + 1,
+                            b_peer_port(&opts), opts.base_port + 300,
+                            opts.base_port + 41);
+
+    ok = device > 0 && daemon_a > 0 && daemon_b > 0 && relay >= 0;
+    if (ok)
+    {
+        ok = discover(&opts, usn, &addr, &addrlen, &base);
+    }
+    if (ok)
+    {
+        ok = run_phase(&opts, "small", false, false, addr, addrlen,
+                       base, daemon_a, daemon_b);
+    }
+    if (ok && opts.handover)
+    {
+        /* b has the proxied service, a the local one */
+        daemon_b = handover_tunnels(&opts, "b", daemon_b, addr, addrlen,
+                                    base);
+        ok = daemon_b > 0;
+    }
+    if (ok)
+    {
+        ok = run_phase(&opts, "stream", true, false, addr, addrlen,
+                       base, daemon_a, daemon_b);
+    }
+    if (ok && opts.reload)
+    {
+        /* The streams and the link between the daemons must survive the
+         * reloads, a server is added to and removed from both each time */
+        pid_t reloader = start_reloader(&opts, daemon_a, daemon_b);
+        ok = reloader > 0 &&
+            run_phase(&opts, "reload", true, false, addr, addrlen,
+                      base, daemon_a, daemon_b);
+        stop(reloader);
+        ok = link_kept("a", opts.base_port + 1) &&
+            link_kept("b", opts.base_port) && ok;
+    }
+    if (ok && opts.handover)
+    {
+        daemon_a = handover_tunnels(&opts, "a", daemon_a, addr, addrlen,
+                                    base);
+        ok = daemon_a > 0;
+    }
+    if (ok)
+    {
+        /* Small requests while another client keeps streaming */
+        ok = run_phase(&opts, "loaded", false, true, addr, addrlen,
+                       base, daemon_a, daemon_b);
+    }
+    if (ok)
+    {
+        ok = run_events(&opts, addr, addrlen, base, daemon_a, daemon_b);
+    }
+
+    stop(daemon_b);
+    stop(daemon_a);
+    stop(relay);
+    stop(device);
+    free(addr);
+    free(base);
+
+    if (opts.keep)
+    {
+        fprintf(stdout, "logs and config kept in %s\n", tmpdir);
+    }
+    else
+    {
+        char* tmp;
+        if (asprintf(&tmp, "rm -rf '%s'", tmpdir) != -1)
+        {
+            if (system(tmp) != 0)
+            {
+                fprintf(stderr, "bench: Unable to remove %s\n", tmpdir);
+            }
+            free(tmp);
+        }
+    }
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static void print_usage(void)
+{
+    fputs("Usage: `bench-tunnel [OPTIONS ...]`\n", stdout);
+    fputs("\n", stdout);
+    fputs("  -d FILE    upnpproxy binary to run (default ../src/upnpproxy)\n", stdout);
+    fputs("  -o FILE    run daemon A from FILE, an older upnpproxy\n", stdout);
+    fputs("  -c N       number of concurrent clients (default 8)\n", stdout);
+    fputs("  -n N       small requests per client (default 200)\n", stdout);
+    fputs("  -s N       streamed requests per client (default 4)\n", stdout);
+    fputs("  -S BYTES   size of each streamed body (default 4194304)\n", stdout);
+    fputs("  -e N       events each client subscribes for (default 20)\n", stdout);
+    fputs("  -p PORT    first port to use, uses PORT...PORT+499 (default 25000)\n", stdout);
+    fputs("  -w N       worker_threads for the daemons (default is the daemon default)\n", stdout);
+    fputs("  -z METHOD  compression for the daemons (default is the daemon default)\n", stdout);
+    fputs("  -q BYTES   tunnel_quantum for the daemons (default is the daemon default)\n", stdout);
+    fputs("  -r         route all services through one service_port per daemon\n", stdout);
+    fputs("  -H         hand over each daemon to a new one between the phases,\n"
+          "             with an idle and a busy tunnel through it\n", stdout);
+    fputs("  -R         stream while the daemons reload their config every 50 ms\n", stdout);
+    fputs("  -L MS      hold back what B sends A for MS ms after connecting,\n"
+          "             as a slow link would (default 0)\n", stdout);
+    fputs("  -k         keep config and logs of the daemons\n", stdout);
+    fputs("  -h         display this text and exit\n", stdout);
+}
+
+static bool parse_ulong(const char* str, unsigned long* value)
+{
+    char* end = NULL;
+    errno = 0;
+    *value = strtoul(str, &end, 10);
+    return !errno && end != NULL && *end == '\0' && end != str;
+}
+
+bool parse_args(int argc, char** argv, options_t* opts)
+{
+    unsigned long tmp;
+    int c;
+    memset(opts, 0, sizeof(options_t));
+    opts->daemon = "../src/upnpproxy";
+    opts->clients = 8;
+    opts->requests = 200;
+    opts->streams = 4;
+    opts->stream_size = 4 * 1024 * 1024;
+    opts->events = 20;
+    opts->base_port = 25000;
+    opts->worker_threads = -1;
+    while ((c = getopt(argc, argv, "d:o:c:n:s:S:e:p:w:z:q:L:rHRkh")) != -1)
+    {
+        switch (c)
+        {
+        case 'd':
+            opts->daemon = optarg;
+            break;
+        case 'o':
+            opts->old_daemon = optarg;
+            break;
+        case 'c':
+            if (!parse_ulong(optarg, &tmp) || tmp == 0 || tmp > 1000)
+            {
+                fprintf(stderr, "bench: Invalid number of clients: %s\n",
+                        optarg);
+                return false;
+            }
+            opts->clients = tmp;
+            break;
+        case 'n':
+            if (!parse_ulong(optarg, &tmp) || tmp > 1000000)
+            {
+                fprintf(stderr, "bench: Invalid number of requests: %s\n",
+                        optarg);
+                return false;
+            }
+            opts->requests = tmp;
+            break;
+        case 's':
+            if (!parse_ulong(optarg, &tmp) || tmp > 1000000)
+            {
+                fprintf(stderr, "bench: Invalid number of streams: %s\n",
+                        optarg);
+                return false;
+            }
+            opts->streams = tmp;
+            break;
+        case 'S':
+            if (!parse_ulong(optarg, &tmp))
+            {
+                fprintf(stderr, "bench: Invalid stream size: %s\n", optarg);
+                return false;
+            }
+            opts->stream_size = tmp;
+            break;
+        case 'e':
+            if (!parse_ulong(optarg, &tmp) || tmp > 1000000)
+            {
+                fprintf(stderr, "bench: Invalid number of events: %s\n",
+                        optarg);
+                return false;
+            }
+            opts->events = tmp;
+            break;
+        case 'p':
+            if (!parse_ulong(optarg, &tmp) || tmp == 0 || tmp > 0xffff - 499)
+            {
+                fprintf(stderr, "bench: Invalid port: %s\n", optarg);
+                return false;
+            }
+            opts->base_port = tmp;
+            break;
+        case 'w':
+            if (!parse_ulong(optarg, &tmp) || tmp > 64)
+            {
+                fprintf(stderr, "bench: Invalid number of worker threads: %s\n",
+                        optarg);
+                return false;
+            }
+            opts->worker_threads = tmp;
+            break;
+        case 'z':
+            opts->compression = optarg;
+            break;
+        case 'q':
+            if (!parse_ulong(optarg, &tmp) || tmp == 0 || tmp > 0x7fffffff)
+            {
+                fprintf(stderr, "bench: Invalid tunnel quantum: %s\n", optarg);
+                return false;
+            }
+            opts->tunnel_quantum = tmp;
+            break;
+        case 'L':
+            if (!parse_ulong(optarg, &tmp) || tmp > 60 * 1000)
+            {
+                fprintf(stderr, "bench: Invalid link delay: %s\n", optarg);
+                return false;
+            }
+            opts->link_delay = tmp;
+            break;
+        case 'r':
+            opts->service_port = true;
+            break;
+        case 'H':
+            opts->handover = true;
+            break;
+        case 'R':
+            opts->reload = true;
+            break;
+        case 'k':
+            opts->keep = true;
+            break;
+        case 'h':
+            print_usage();
+            exit(EXIT_SUCCESS);
+        default:
+            print_usage();
+            return false;
+        }
+    }
+    if (optind < argc)
+    {
+        fputs("bench: Unexpected argument after options\n", stderr);
+        return false;
+    }
+    if (access(opts->daemon, X_OK) != 0)
+    {
+        fprintf(stderr, "bench: Unable to execute %s: %s\n", opts->daemon,
+                strerror(errno));
+        return false;
+    }
+    if (opts->old_daemon != NULL && access(opts->old_daemon, X_OK) != 0)
+    {
+        fprintf(stderr, "bench: Unable to execute %s: %s\n",
+                opts->old_daemon, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+/* Port B connects to A on */
+uint16_t b_peer_port(const options_t* opts)
+{
+    /* Through the relay, see start_relay */
+    return opts->link_delay > 0 ? opts->base_port + 4 : opts->base_port;
+}
+
+static uint64_t now_usec(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/* If extra_port isn't 0 a server nobody listens on is added. The config
+ * is replaced in one go, the daemon might be reading it */
+bool write_config(const options_t* opts, const char* name,
+                  uint16_t port, uint16_t peer_port, uint16_t extra_port,
+                  uint16_t tunnel_port, uint16_t mcast_port)
+{
+    char* cfgfile, *tmpfile;
+    FILE* fh;
+    bool ok;
+
+    if (asprintf(&cfgfile, "%s/%s.conf", tmpdir, name) == -1)
+    {
+        return false;
+    }
+    if (asprintf(&tmpfile, "%s.tmp", cfgfile) == -1)
+    {
+        free(cfgfile);
+        return false;
+    }
+    fh = fopen(tmpfile, "w");
+    if (fh == NULL)
+    {
+        fprintf(stderr, "bench: Unable to write %s: %s\n", tmpfile,
+                strerror(errno));
+        free(tmpfile);
+        free(cfgfile);
+        return false;
+    }
+    if (extra_port != 0)
+    {
+        fprintf(fh, "servers = 127.0.0.1:%u 127.0.0.1:%u\n", peer_port,
+                extra_port);
+    }
+    else
+    {
+        fprintf(fh, "servers = 127.0.0.1:%u\n", peer_port);
+    }
+    fprintf(fh, "server_port = %u\n", port);
+    fprintf(fh, "bind_server = 127.0.0.1\n");
+    fprintf(fh, "bind_tunnels = 127.0.0.1\n");
+    fprintf(fh, "bind_services = 127.0.0.1\n");
+    fprintf(fh, "tunnel_port = %u\n", tunnel_port);
+    if (opts->old_daemon != NULL && strcmp(name, "a") == 0)
+    {
+        /* Daemons from before tunnel_port have a range of ports */
+        fprintf(fh, "first_tunnel_port = %u\n", tunnel_port);
+        fprintf(fh, "last_tunnel_port = %u\n", tunnel_port + 9);
+    }
+    fprintf(fh, "multicast_port = %u\n", mcast_port);
+    /* Both daemons would share the state_file in the cache directory */
+    fprintf(fh, "state_file =\n");
+    if (opts->worker_threads >= 0)
+    {
+        fprintf(fh, "worker_threads = %d\n", opts->worker_threads);
+    }
+    if (opts->compression != NULL)
+    {
+        fprintf(fh, "compression = %s\n", opts->compression);
+    }
+    if (opts->service_port)
+    {
+        fprintf(fh, "service_port = %u\n", tunnel_port + 1);
+    }
+    if (opts->tunnel_quantum > 0)
+    {
+        fprintf(fh, "tunnel_quantum = %lu\n", opts->tunnel_quantum);
+    }
+    ok = fclose(fh) == 0 && rename(tmpfile, cfgfile) == 0;
+    free(tmpfile);
+    free(cfgfile);
+    return ok;
+}
+
+pid_t start_daemon(const options_t* opts, const char* name,
+                   uint16_t port, uint16_t peer_port,
+                   uint16_t tunnel_port, uint16_t mcast_port)
+{
+    const char* daemon = opts->daemon;
+    char* cfgfile, *logfile, *cachedir;
+    pid_t pid;
+
+    if (opts->old_daemon != NULL && strcmp(name, "a") == 0)
+    {
+        daemon = opts->old_daemon;
+    }
+    if (!write_config(opts, name, port, peer_port, 0, tunnel_port,
+                      mcast_port) ||
+        asprintf(&cfgfile, "%s/%s.conf", tmpdir, name) == -1 ||
+        asprintf(&logfile, "%s/%s.log", tmpdir, name) == -1 ||
+        asprintf(&cachedir, "%s/%s", tmpdir, name) == -1)
+    {
+        return -1;
+    }
+
+    pid = fork();
+    if (pid == 0)
+    {
+        int fd = open(logfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd >= 0)
+        {
+            dup2(fd, STDERR_FILENO);
+            close(fd);
+        }
+        setenv("XDG_CACHE_HOME", cachedir, 1);
+        execl(daemon, daemon, "-D", "-C", cfgfile, (char*)NULL);
+        fprintf(stderr, "bench: Unable to execute %s: %s\n", daemon,
+                strerror(errno));
+        _exit(127);
+    }
+    else if (pid < 0)
+    {
+        fprintf(stderr, "bench: Unable to fork: %s\n", strerror(errno));
+    }
+    free(cfgfile);
+    free(logfile);
+    free(cachedir);
+    return pid;
+}
+
+/* Rewrites the configs of both daemons, with and without an extra server,
+ * and has them reload every 50 ms until killed. The ports are the ones
+ * main gives start_daemon */
+pid_t start_reloader(const options_t* opts, pid_t daemon_a, pid_t daemon_b)
+{
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        uint16_t base = opts->base_port;
+        bool extra = true;
+        for (;;)
+        {
+            if (!write_config(opts, "a", base, base + 1,
+                              extra ? base + 2 : 0, base + 100, base + 40) ||
+                !write_config(opts, "b", base + 1, b_peer_port(opts),
+                              extra ? base + 3 : 0, base + 300, base + 41))
+            {
+                _exit(EXIT_FAILURE);
+            }
+            kill(daemon_a, SIGHUP);
+            kill(daemon_b, SIGHUP);
+            extra = !extra;
+            usleep(50 * 1000);
+        }
+    }
+    else if (pid < 0)
+    {
+        fprintf(stderr, "bench: Unable to fork: %s\n", strerror(errno));
+    }
+    return pid;
+}
+
+/* False if the daemon lost its link to the other one */
+bool link_kept(const char* name, uint16_t peer_port)
+{
+    char* logfile, *needle, line[512];
+    bool ok = true;
+    FILE* fh;
+    if (asprintf(&logfile, "%s/%s.log", tmpdir, name) == -1)
+    {
+        return false;
+    }
+    if (asprintf(&needle, "connection with server 127.0.0.1:%u", peer_port)
+        == -1)
+    {
+        free(logfile);
+        return false;
+    }
+    fh = fopen(logfile, "r");
+    while (fh != NULL && fgets(line, sizeof(line), fh) != NULL)
+    {
+        if (strstr(line, needle) != NULL)
+        {
+            fprintf(stderr, "bench: Daemon %s lost its link: %s", name, line);
+            ok = false;
+        }
+    }
+    if (fh != NULL)
+    {
+        fclose(fh);
+    }
+    free(needle);
+    free(logfile);
+    return ok;
+}
+
+/* Returns the pid of the new daemon, from the log of the old one */
+pid_t handover(const char* name, pid_t pid)
+{
+    static const char MARK[] = "Handing over to new daemon ";
+    char* logfile, line[512];
+    long newpid = -1;
+    int status;
+    FILE* fh;
+    if (asprintf(&logfile, "%s/%s.log", tmpdir, name) == -1)
+    {
+        return -1;
+    }
+    kill(pid, SIGUSR2);
+    if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != EXIT_SUCCESS)
+    {
+        fprintf(stderr, "bench: Daemon %s failed to hand over\n", name);
+        free(logfile);
+        return -1;
+    }
+    fh = fopen(logfile, "r");
+    while (fh != NULL && fgets(line, sizeof(line), fh) != NULL)
+    {
+        char* pos = strstr(line, MARK);
+        if (pos != NULL)
+        {
+            newpid = strtol(pos + sizeof(MARK) - 1, NULL, 10);
+        }
+    }
+    if (fh != NULL)
+    {
+        fclose(fh);
+    }
+    free(logfile);
+    if (newpid <= 0 || kill(newpid, 0) != 0)
+    {
+        fprintf(stderr, "bench: No new daemon %s after hand over\n", name);
+        return -1;
+    }
+    fprintf(stdout, "handover: daemon %s is now %ld\n", name, newpid);
+    fflush(stdout);
+    return newpid;
+}
+
+void stop(pid_t pid)
+{
+    int status;
+    if (pid <= 0)
+    {
+        return;
+    }
+    kill(pid, SIGTERM);
+    if (waitpid(pid, &status, 0) != pid)
+    {
+        /* Not our child, started by a hand over */
+        while (kill(pid, 0) == 0)
+        {
+            usleep(10 * 1000);
+        }
+    }
+}
+
+static long rss_kb(pid_t pid)
+{
+    char path[64], line[256];
+    long ret = -1;
+    FILE* fh;
+    snprintf(path, sizeof(path), "/proc/%ld/status", (long)pid);
+    fh = fopen(path, "r");
+    if (fh == NULL)
+    {
+        return -1;
+    }
+    while (fgets(line, sizeof(line), fh) != NULL)
+    {
+        if (strncmp(line, "VmRSS:", 6) == 0)
+        {
+            ret = strtol(line + 6, NULL, 10);
+            break;
+        }
+    }
+    fclose(fh);
+    return ret;
+}
+
+/* Fake device */
+
+/* A subscription to the events of the device */
+typedef struct _device_sub_t
+{
+    char sid[64];
+    struct sockaddr* addr;
+    socklen_t addrlen;
+    char* path;
+    uint32_t seq;
+} device_sub_t;
+
+#define DEVICE_SUBS (16)
+
+typedef struct _device_t
+{
+    selector_t selector;
+    ssdp_t ssdp;
+    socket_t sock;
+    ssdp_notify_t notify;
+    device_sub_t sub[DEVICE_SUBS];
+    unsigned int subs, subscriptions;
+    unsigned long update_id;
+} device_t;
+
+typedef struct _device_conn_t
+{
+    device_t* device;
+    socket_t sock;
+    selector_t selector;
+    char in[4096];
+    size_t fill;
+    /* Pending response, header first then body_left bytes of body */
+    char* head;
+    size_t head_pos, head_len;
+    uint64_t body_left;
+    bool close;
+} device_conn_t;
+
+static const char DEVICE_DESC[] =
+    "<?xml version=\"1.0\"?>\r\n"
+    "<root xmlns=\"urn:schemas-upnp-org:device-1-0\">"
+    "<specVersion><major>1</major><minor>0</minor></specVersion>"
+    "<device><deviceType>urn:schemas-upnp-org:device:MediaServer:1</deviceType>"
+    "<friendlyName>upnpproxy bench</friendlyName>"
+    "<serviceList><service>"
+    "<serviceType>urn:schemas-upnp-org:service:ContentDirectory:1</serviceType>"
+    "<controlURL>control</controlURL>"
+    "</service></serviceList></device></root>\r\n";
+
+static const char SOAP_REQUEST[] =
+    "<?xml version=\"1.0\"?>\r\n"
+    "<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" "
+    "s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">"
+    "<s:Body><u:Browse xmlns:u=\"urn:schemas-upnp-org:service:ContentDirectory:1\">"
+    "<ObjectID>0</ObjectID><BrowseFlag>BrowseDirectChildren</BrowseFlag>"
+    "<Filter>*</Filter><StartingIndex>0</StartingIndex>"
+    "<RequestedCount>10</RequestedCount><SortCriteria></SortCriteria>"
+    "</u:Browse></s:Body></s:Envelope>\r\n";
+
+static const char SOAP_RESPONSE[] =
+    "<?xml version=\"1.0\"?>\r\n"
+    "<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" "
+    "s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">"
+    "<s:Body><u:BrowseResponse xmlns:u=\"urn:schemas-upnp-org:service:ContentDirectory:1\">"
+    "<Result>&lt;DIDL-Lite xmlns=&quot;urn:schemas-upnp-org:metadata-1-0/DIDL-Lite/&quot;&gt;"
+    "&lt;container id=&quot;1&quot; parentID=&quot;0&quot; restricted=&quot;1&quot;&gt;"
+    "&lt;dc:title&gt;Music&lt;/dc:title&gt;&lt;/container&gt;&lt;/DIDL-Lite&gt;</Result>"
+    "<NumberReturned>1</NumberReturned><TotalMatches>1</TotalMatches>"
+    "<UpdateID>1</UpdateID></u:BrowseResponse></s:Body></s:Envelope>\r\n";
+
+static const char EVENT_BODY[] =
+    "<?xml version=\"1.0\"?>\r\n"
+    "<e:propertyset xmlns:e=\"urn:schemas-upnp-org:event-1-0\">"
+    "<e:property><SystemUpdateID>%lu</SystemUpdateID></e:property>"
+    "<e:property><ContainerUpdateIDs></ContainerUpdateIDs></e:property>"
+    "</e:propertyset>\r\n";
+
+static const char EVENT_RESPONSE[] =
+    "HTTP/1.1 200 OK\r\n"
+    "Content-Length: 0\r\n"
+    "\r\n";
+
+static char stream_data[65536];
+
+static void set_timeouts(socket_t sock)
+{
+    struct timeval tv;
+    /* Count a stalled request as failed instead of hanging the benchmark */
+    tv.tv_sec = REQUEST_TIMEOUT / 1000;
+    tv.tv_usec = (REQUEST_TIMEOUT % 1000) * 1000;
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+/* Copy the value of the header name in head to value, false if there is
+ * no such header or it doesn't fit */
+static bool find_header(const char* head, const char* name, char* value,
+                        size_t size)
+{
+    size_t namelen = strlen(name);
+    const char* line = strstr(head, "\r\n");
+    while (line != NULL && line[2] != '\r' && line[2] != '\0')
+    {
+        line += 2;
+        if (strncasecmp(line, name, namelen) == 0 && line[namelen] == ':')
+        {
+            const char* start = line + namelen + 1, *end;
+            while (*start == ' ' || *start == '\t')
+            {
+                ++start;
+            }
+            end = strstr(start, "\r\n");
+            if (end == NULL || (size_t)(end - start) >= size)
+            {
+                return false;
+            }
+            memcpy(value, start, end - start);
+            value[end - start] = '\0';
+            return true;
+        }
+        line = strstr(line, "\r\n");
+    }
+    return false;
+}
+
+/* Read a whole message, head and body, from sock into buf. Returns the
+ * length of the head or 0 on error */
+static size_t read_message(socket_t sock, char* buf, size_t size)
+{
+    size_t fill = 0;
+    for (;;)
+    {
+        char* end, value[32];
+        ssize_t got = socket_read(sock, buf + fill, size - 1 - fill);
+        if (got <= 0)
+        {
+            return 0;
+        }
+        fill += got;
+        buf[fill] = '\0';
+        end = strstr(buf, "\r\n\r\n");
+        if (end != NULL)
+        {
+            size_t head = (end + 4) - buf, body = 0;
+            if (find_header(buf, "Content-Length", value, sizeof(value)))
+            {
+                body = strtoul(value, NULL, 10);
+            }
+            if (fill >= head + body)
+            {
+                return head;
+            }
+        }
+        if (fill + 1 >= size)
+        {
+            return 0;
+        }
+    }
+}
+
+static void device_conn_free(device_conn_t* conn)
+{
+    selector_remove(conn->selector, conn->sock);
+    socket_close(conn->sock);
+    free(conn->head);
+    free(conn);
+}
+
+static void device_respond(device_conn_t* conn, const char* status,
+                           const char* type, const char* body,
+                           uint64_t body_len)
+{
+    int len;
+    free(conn->head);
+    conn->head = NULL;
+    len = asprintf(&conn->head,
+                   "HTTP/1.1 %s\r\n"
+                   "Server: Linux/1.0 UPnP/1.0 bench/1.0\r\n"
+                   "Content-Type: %s\r\n"
+                   "Content-Length: %llu\r\n"
+                   "\r\n%s",
+                   status, type, (unsigned long long)body_len,
+                   body != NULL ? body : "");
+    if (len < 0)
+    {
+        conn->head = NULL;
+        conn->close = true;
+        return;
+    }
+    conn->head_len = len;
+    conn->head_pos = 0;
+    conn->body_left = body != NULL ? 0 : body_len;
+}
+
+static void device_respond_sid(device_conn_t* conn, const char* sid)
+{
+    int len;
+    free(conn->head);
+    conn->head = NULL;
+    len = asprintf(&conn->head,
+                   "HTTP/1.1 200 OK\r\n"
+                   "Server: Linux/1.0 UPnP/1.0 bench/1.0\r\n"
+                   "SID: %s\r\n"
+                   "TIMEOUT: Second-1800\r\n"
+                   "Content-Length: 0\r\n"
+                   "\r\n", sid);
+    if (len < 0)
+    {
+        conn->head = NULL;
+        conn->close = true;
+        return;
+    }
+    conn->head_len = len;
+    conn->head_pos = 0;
+    conn->body_left = 0;
+}
+
+static device_sub_t* device_find_sub(device_t* device, const char* sid)
+{
+    unsigned int i;
+    for (i = 0; i < device->subs; ++i)
+    {
+        if (strcmp(device->sub[i].sid, sid) == 0)
+        {
+            return device->sub + i;
+        }
+    }
+    return NULL;
+}
+
+static void device_subscribe(device_conn_t* conn)
+{
+    device_t* device = conn->device;
+    device_sub_t* sub;
+    char value[256], *host, *path, *port, *end;
+    if (find_header(conn->in, "SID", value, sizeof(value)))
+    {
+        /* Renewal */
+        sub = device_find_sub(device, value);
+        if (sub == NULL)
+        {
+            device_respond(conn, "412 Precondition Failed", "text/plain",
+                           "", 0);
+            return;
+        }
+        device_respond_sid(conn, sub->sid);
+        return;
+    }
+    if (device->subs == DEVICE_SUBS ||
+        !find_header(conn->in, "CALLBACK", value, sizeof(value)) ||
+        strncmp(value, "<http://", 8) != 0 ||
+        (end = strchr(value, '>')) == NULL)
+    {
+        device_respond(conn, "412 Precondition Failed", "text/plain", "", 0);
+        return;
+    }
+    *end = '\0';
+    host = value + 8;
+    path = strchr(host, '/');
+    port = strrchr(host, ':');
+    sub = device->sub + device->subs;
+    memset(sub, 0, sizeof(device_sub_t));
+    if (path != NULL && port != NULL && port < path)
+    {
+        sub->path = strdup(path);
+        *path = '\0';
+        *port = '\0';
+        sub->addr = parse_addr(host, strtoul(port + 1, NULL, 10),
+                               &sub->addrlen, false);
+    }
+    if (sub->addr == NULL)
+    {
+        free(sub->path);
+        device_respond(conn, "412 Precondition Failed", "text/plain", "", 0);
+        return;
+    }
+    snprintf(sub->sid, sizeof(sub->sid), "uuid:bench-event-%u",
+             ++device->subscriptions);
+    device->subs++;
+    device_respond_sid(conn, sub->sid);
+}
+
+static void device_unsubscribe(device_conn_t* conn)
+{
+    device_t* device = conn->device;
+    device_sub_t* sub;
+    char value[256];
+    if (!find_header(conn->in, "SID", value, sizeof(value)) ||
+        (sub = device_find_sub(device, value)) == NULL)
+    {
+        device_respond(conn, "412 Precondition Failed", "text/plain", "", 0);
+        return;
+    }
+    free(sub->addr);
+    free(sub->path);
+    *sub = device->sub[--device->subs];
+    device_respond(conn, "200 OK", "text/plain", "", 0);
+}
+
+/* Send the event to sub and wait for the answer, the daemon answers at
+ * once so blocking will do */
+static void device_notify(device_t* device, device_sub_t* sub)
+{
+    char body[512], buf[1024], *host, *msg;
+    int len, bodylen;
+    socket_t sock;
+    bodylen = snprintf(body, sizeof(body), EVENT_BODY, device->update_id);
+    asprinthost(&host, sub->addr, sub->addrlen);
+    len = asprintf(&msg,
+                   "NOTIFY %s HTTP/1.1\r\n"
+                   "HOST: %s\r\n"
+                   "CONTENT-TYPE: text/xml; charset=\"utf-8\"\r\n"
+                   "NT: upnp:event\r\n"
+                   "NTS: upnp:propchange\r\n"
+                   "SID: %s\r\n"
+                   "SEQ: %lu\r\n"
+                   "Content-Length: %d\r\n"
+                   "\r\n%s", sub->path, host, sub->sid,
+                   (unsigned long)sub->seq, bodylen, body);
+    free(host);
+    if (len < 0)
+    {
+        return;
+    }
+    sub->seq = sub->seq == 0xffffffff ? 1 : sub->seq + 1;
+    sock = socket_tcp_connect2(sub->addr, sub->addrlen, true, NULL);
+    if (sock >= 0)
+    {
+        set_timeouts(sock);
+        if (write_all(sock, msg, len))
+        {
+            read_message(sock, buf, sizeof(buf));
+        }
+        socket_close(sock);
+    }
+    free(msg);
+}
+
+static long device_event_cb(void* userdata)
+{
+    device_t* device = userdata;
+    unsigned int i;
+    if (device->subs > 0)
+    {
+        device->update_id++;
+        for (i = 0; i < device->subs; ++i)
+        {
+            device_notify(device, device->sub + i);
+        }
+    }
+    return 0;
+}
+
+/* Returns true if a full request was found and a response queued */
+static bool device_parse(device_conn_t* conn)
+{
+    char* end, *pos;
+    size_t head_len, content_length = 0;
+    char method[16], path[256];
+
+    if (conn->fill == 0)
+    {
+        return false;
+    }
+    conn->in[conn->fill] = '\0';
+    end = strstr(conn->in, "\r\n\r\n");
+    if (end == NULL)
+    {
+        if (conn->fill + 1 >= sizeof(conn->in))
+        {
+            conn->close = true;
+        }
+        return false;
+    }
+    head_len = (end + 4) - conn->in;
+    pos = strstr(conn->in, "Content-Length:");
+    if (pos != NULL && pos < end)
+    {
+        content_length = strtoul(pos + 15, NULL, 10);
+    }
+    if (conn->fill < head_len + content_length)
+    {
+        if (head_len + content_length + 1 >= sizeof(conn->in))
+        {
+            conn->close = true;
+        }
+        return false;
+    }
+    if (sscanf(conn->in, "%15s %255s", method, path) != 2)
+    {
+        conn->close = true;
+        return false;
+    }
+    if (strcmp(method, "GET") == 0 && strcmp(path, "/desc.xml") == 0)
+    {
+        device_respond(conn, "200 OK", "text/xml; charset=\"utf-8\"",
+                       DEVICE_DESC, strlen(DEVICE_DESC));
+    }
+    else if (strcmp(method, "POST") == 0 && strcmp(path, "/control") == 0)
+    {
+        device_respond(conn, "200 OK", "text/xml; charset=\"utf-8\"",
+                       SOAP_RESPONSE, strlen(SOAP_RESPONSE));
+    }
+    else if (strcmp(method, "GET") == 0 &&
+             strncmp(path, "/stream?", 8) == 0)
+    {
+        device_respond(conn, "200 OK", "video/mpeg", NULL,
+                       strtoull(path + 8, NULL, 10));
+    }
+    else if (strcmp(method, "SUBSCRIBE") == 0 && strcmp(path, "/event") == 0)
+    {
+        device_subscribe(conn);
+    }
+    else if (strcmp(method, "UNSUBSCRIBE") == 0 &&
+             strcmp(path, "/event") == 0)
+    {
+        device_unsubscribe(conn);
+    }
+    else
+    {
+        device_respond(conn, "404 Not Found", "text/plain", "", 0);
+    }
+    memmove(conn->in, conn->in + head_len + content_length,
+            conn->fill - (head_len + content_length));
+    conn->fill -= head_len + content_length;
+    return true;
+}
+
+static void device_conn_write_cb(void* userdata, socket_t sock)
+{
+    device_conn_t* conn = userdata;
+    for (;;)
+    {
+        ssize_t got;
+        if (conn->head == NULL)
+        {
+            if (!device_parse(conn))
+            {
+                selector_chkwrite(conn->selector, sock, false);
+                if (conn->close)
+                {
+                    device_conn_free(conn);
+                }
+                return;
+            }
+        }
+        if (conn->head_pos < conn->head_len)
+        {
+            got = socket_write(sock, conn->head + conn->head_pos,
+                               conn->head_len - conn->head_pos);
+            if (got > 0)
+            {
+                conn->head_pos += got;
+            }
+        }
+        else if (conn->body_left > 0)
+        {
+            size_t avail = sizeof(stream_data);
+            if (avail > conn->body_left)
+            {
+                avail = conn->body_left;
+            }
+            got = socket_write(sock, stream_data, avail);
+            if (got > 0)
+            {
+                conn->body_left -= got;
+            }
+        }
+        else
+        {
+            free(conn->head);
+            conn->head = NULL;
+            continue;
+        }
+        if (got < 0)
+        {
+            if (socket_blockingerror(sock))
+            {
+                selector_chkwrite(conn->selector, sock, true);
+                return;
+            }
+            device_conn_free(conn);
+            return;
+        }
+    }
+}
+
+static void device_conn_read_cb(void* userdata, socket_t sock)
+{
+    device_conn_t* conn = userdata;
+    ssize_t got = socket_read(sock, conn->in + conn->fill,
+                              sizeof(conn->in) - 1 - conn->fill);
+    if (got <= 0)
+    {
+        if (got < 0 && socket_blockingerror(sock))
+        {
+            return;
+        }
+        device_conn_free(conn);
+        return;
+    }
+    conn->fill += got;
+    if (conn->head == NULL)
+    {
+        device_conn_write_cb(conn, sock);
+    }
+}
+
+static void device_accept_cb(void* userdata, socket_t sock)
+{
+    device_t* device = userdata;
+    device_conn_t* conn;
+    socket_t s = socket_accept(sock, NULL, NULL);
+    if (s < 0)
+    {
+        return;
+    }
+    socket_setblocking(s, false);
+    conn = calloc(1, sizeof(device_conn_t));
+    conn->device = device;
+    conn->sock = s;
+    conn->selector = device->selector;
+    selector_add(device->selector, s, conn, device_conn_read_cb,
+                 device_conn_write_cb);
+    selector_chkwrite(device->selector, s, false);
+}
+
+static long device_notify_cb(void* userdata)
+{
+    device_t* device = userdata;
+    device->notify.expires = ssdp_now(device->ssdp) + 1800;
+    ssdp_notify(device->ssdp, &device->notify);
+    return 0;
+}
+
+static bool device_quit = false;
+
+static void device_quit_cb(int signum)
+{
+    device_quit = true;
+}
+
+/* Forward connections to port on to target, holding back what the
+ * connecting side sends for delay ms first. One connection at a time */
+pid_t start_relay(uint16_t port, uint16_t target, unsigned long delay)
+{
+    socket_t sock;
+    pid_t pid = fork();
+    if (pid != 0)
+    {
+        if (pid < 0)
+        {
+            fprintf(stderr, "bench: Unable to fork: %s\n", strerror(errno));
+        }
+        return pid;
+    }
+
+    sock = socket_tcp_listen("127.0.0.1", port);
+    if (sock < 0)
+    {
+        fprintf(stderr, "bench: Relay unable to listen on port %u: %s\n",
+                port, socket_strerror(sock));
+        _exit(EXIT_FAILURE);
+    }
+    for (;;)
+    {
+        struct pollfd pfd[2];
+        char buf[8192];
+        uint64_t start;
+        bool open = true;
+        socket_t in = socket_accept(sock, NULL, NULL), out;
+        if (in < 0)
+        {
+            continue;
+        }
+        out = socket_tcp_connect("127.0.0.1", target, true, NULL);
+        if (out < 0)
+        {
+            socket_close(in);
+            continue;
+        }
+        start = now_usec();
+        while (open)
+        {
+            bool held = now_usec() - start < delay * 1000;
+            int i;
+            pfd[0].fd = in;
+            pfd[0].events = held ? 0 : POLLIN;
+            pfd[1].fd = out;
+            pfd[1].events = POLLIN;
+            if (poll(pfd, 2, held ? 10 : -1) < 0 && errno != EINTR)
+            {
+                break;
+            }
+            for (i = 0; i < 2 && open; ++i)
+            {
+                ssize_t got;
+                if (!(pfd[i].revents & (POLLIN | POLLHUP | POLLERR)))
+                {
+                    continue;
+                }
+                got = read(pfd[i].fd, buf, sizeof(buf));
+                open = got > 0 && write_all(pfd[1 - i].fd, buf, got);
+            }
+        }
+        socket_close(in);
+        socket_close(out);
+    }
+}
+
+pid_t start_device(const options_t* opts, const char* usn)
+{
+    device_t device;
+    timers_t timers;
+    log_t log;
+    pid_t pid = fork();
+    if (pid != 0)
+    {
+        if (pid < 0)
+        {
+            fprintf(stderr, "bench: Unable to fork: %s\n", strerror(errno));
+        }
+        return pid;
+    }
+
+    signal(SIGTERM, device_quit_cb);
+    memset(stream_data, 'x', sizeof(stream_data));
+    memset(&device, 0, sizeof(device));
+    log = log_open();
+    device.selector = selector_new();
+    timers = timers_new();
+    device.sock = socket_tcp_listen("127.0.0.1", opts->base_port + 30);
+    if (device.sock < 0)
+    {
+        fprintf(stderr, "bench: Device unable to listen on port %u: %s\n",
+                opts->base_port + 30, socket_strerror(device.sock));
+        _exit(EXIT_FAILURE);
+    }
+    socket_setblocking(device.sock, false);
+    selector_add(device.selector, device.sock, &device, device_accept_cb,
+                 NULL);
+    device.ssdp = ssdp_new(log, device.selector, timers, NULL,
+                           opts->base_port + 40, NULL, NULL, NULL, NULL);
+    if (device.ssdp == NULL)
+    {
+        fputs("bench: Device unable to setup SSDP\n", stderr);
+        _exit(EXIT_FAILURE);
+    }
+    device.notify.host = ssdp_getnotifyhost(device.ssdp,
+                                            &device.notify.hostlen);
+    device.notify.nt = (char*)SERVICE_TYPE;
+    device.notify.usn = (char*)usn;
+    device.notify.server = (char*)"Linux/1.0 UPnP/1.0 bench/1.0";
+    if (asprintf(&device.notify.location, "http://127.0.0.1:%u/desc.xml",
+                 opts->base_port + 30) == -1)
+    {
+        _exit(EXIT_FAILURE);
+    }
+    device_notify_cb(&device);
+    timers_add(timers, 1000, &device, device_notify_cb);
+    timers_add(timers, 20, &device, device_event_cb);
+
+    while (!device_quit)
+    {
+        unsigned long timeout = timers_tick(timers);
+        if (!selector_tick(device.selector, timeout))
+        {
+            break;
+        }
+    }
+    if (device.subscriptions > 0)
+    {
+        fprintf(stdout, "device: %u event subscriptions\n",
+                device.subscriptions);
+        fflush(stdout);
+    }
+    _exit(EXIT_SUCCESS);
+}
+
+/* Discovery of the proxied device on B:s network */
+
+typedef struct _discover_t
+{
+    const char* usn;
+    uint16_t device_port;
+    struct sockaddr* addr;
+    socklen_t addrlen;
+    /* Path of the location up to and including the last '/' */
+    char* base;
+} discover_t;
+
+static void discover_location(discover_t* disc, const char* usn,
+                              const char* location)
+{
+    const char* start, *end;
+    char* host, *pos;
+    unsigned long port = 80;
+    if (disc->addr != NULL || usn == NULL || location == NULL ||
+        strcmp(usn, disc->usn) != 0)
+    {
+        return;
+    }
+    start = strstr(location, "://");
+    if (start == NULL)
+    {
+        return;
+    }
+    start += 3;
+    end = strchr(start, '/');
+    if (end == NULL)
+    {
+        end = start + strlen(start);
+    }
+    host = strndup(start, end - start);
+    pos = strrchr(host, ':');
+    if (pos != NULL)
+    {
+        *pos = '\0';
+        port = strtoul(pos + 1, NULL, 10);
+    }
+    if (port != disc->device_port && port > 0 && port <= 0xffff)
+    {
+        disc->addr = parse_addr(host, port, &disc->addrlen, false);
+        if (disc->addr != NULL)
+        {
+            pos = strrchr(end, '/');
+            disc->base = pos != NULL ? strndup(end, pos + 1 - end)
+                : strdup("/");
+        }
+    }
+    free(host);
+}
+
+static void discover_search_resp_cb(void* userdata, ssdp_search_t* search,
+                                    ssdp_notify_t* notify)
+{
+    discover_location(userdata, notify->usn, notify->location);
+}
+
+static void discover_notify_cb(void* userdata, ssdp_notify_t* notify)
+{
+    if (notify->nts != NULL && strcmp(notify->nts, "ssdp:alive") == 0)
+    {
+        discover_location(userdata, notify->usn, notify->location);
+    }
+}
+
+bool discover(const options_t* opts, const char* usn,
+              struct sockaddr** addr, socklen_t* addrlen, char** base)
+{
+    discover_t disc;
+    selector_t selector = selector_new();
+    log_t log = log_open();
+    ssdp_t ssdp;
+    uint64_t start = now_usec(), last_search = 0;
+
+    memset(&disc, 0, sizeof(disc));
+    disc.usn = usn;
+    disc.device_port = opts->base_port + 30;
+    ssdp = ssdp_new(log, selector, NULL, NULL, opts->base_port + 41, &disc,
+                    NULL, discover_search_resp_cb, discover_notify_cb);
+    if (ssdp == NULL)
+    {
+        fputs("bench: Unable to setup SSDP for discovery\n", stderr);
+        selector_free(selector);
+        log_close(log);
+        return false;
+    }
+    while (disc.addr == NULL)
+    {
+        uint64_t now = now_usec();
+        if (now - start > DISCOVER_TIMEOUT * 1000)
+        {
+            break;
+        }
+        if (now - last_search > 1000 * 1000)
+        {
+            ssdp_search_t search;
+            memset(&search, 0, sizeof(search));
+            search.host = ssdp_getnotifyhost(ssdp, &search.hostlen);
+            search.st = (char*)SERVICE_TYPE;
+            search.mx = 1;
+            ssdp_search(ssdp, &search);
+            free(search.host);
+            last_search = now;
+        }
+        if (!selector_tick(selector, 100))
+        {
+            break;
+        }
+    }
+    ssdp_free(ssdp);
+    selector_free(selector);
+    log_close(log);
+
+    if (disc.addr == NULL)
+    {
+        fprintf(stderr, "bench: Proxied service not found within %lu seconds,"
+                " see the daemon logs (-k)\n", DISCOVER_TIMEOUT / 1000);
+        return false;
+    }
+    {
+        char* tmp;
+        asprinthost(&tmp, disc.addr, disc.addrlen);
+        fprintf(stdout, "proxied service found at %s%s after %.2f s\n",
+                tmp, disc.base, (now_usec() - start) / 1000000.0);
+        free(tmp);
+    }
+    *addr = disc.addr;
+    *addrlen = disc.addrlen;
+    *base = disc.base;
+    return true;
+}
+
+/* Clients */
+
+static bool write_all(socket_t sock, const char* data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t got = socket_write(sock, data, len);
+        if (got <= 0)
+        {
+            return false;
+        }
+        data += got;
+        len -= got;
+    }
+    return true;
+}
+
+/* Send request and read the whole response, returns number of body bytes
+ * or -1 on error */
+static int64_t client_request(const struct sockaddr* addr, socklen_t addrlen,
+                              const char* request, size_t request_len)
+{
+    char buf[65536];
+    size_t fill = 0;
+    uint64_t body_left = 0, body = 0;
+    bool got_head = false;
+    socket_t sock = socket_tcp_connect2(addr, addrlen, true, NULL);
+    if (sock < 0)
+    {
+        return -1;
+    }
+    set_timeouts(sock);
+    if (!write_all(sock, request, request_len))
+    {
+        socket_close(sock);
+        return -1;
+    }
+    for (;;)
+    {
+        ssize_t got;
+        if (got_head)
+        {
+            /* Only the body is left, no need to keep it */
+            fill = 0;
+        }
+        got = socket_read(sock, buf + fill, sizeof(buf) - 1 - fill);
+        if (got <= 0)
+        {
+            socket_close(sock);
+            return -1;
+        }
+        if (got_head)
+        {
+            body += got;
+            if ((uint64_t)got >= body_left)
+            {
+                break;
+            }
+            body_left -= got;
+            continue;
+        }
+        fill += got;
+        buf[fill] = '\0';
+        {
+            char* end = strstr(buf, "\r\n\r\n"), *pos;
+            size_t head_len;
+            if (end == NULL)
+            {
+                if (fill + 1 >= sizeof(buf))
+                {
+                    socket_close(sock);
+                    return -1;
+                }
+                continue;
+            }
+            if (strncmp(buf, "HTTP/1.1 200 ", 13) != 0)
+            {
+                socket_close(sock);
+                return -1;
+            }
+            head_len = (end + 4) - buf;
+            pos = strstr(buf, "Content-Length:");
+            if (pos == NULL || pos > end)
+            {
+                socket_close(sock);
+                return -1;
+            }
+            body_left = strtoull(pos + 15, NULL, 10);
+            got_head = true;
+            body = fill - head_len;
+            if (body >= body_left)
+            {
+                break;
+            }
+            body_left -= body;
+        }
+    }
+    socket_close(sock);
+    return body;
+}
+
+/* If fd is < 0 the requests are repeated until killed, without reporting
+ * any results */
+static void client_run(const options_t* opts, bool stream,
+                       const struct sockaddr* addr, socklen_t addrlen,
+                       const char* base, int fd)
+{
+    char* request;
+    int len;
+    unsigned int i, count;
+    char* host;
+    asprinthost(&host, addr, addrlen);
+    if (stream)
+    {
+        len = asprintf(&request,
+                       "GET %sstream?%lu HTTP/1.1\r\n"
+                       "Host: %s\r\n"
+                       "Connection: close\r\n"
+                       "\r\n", base, opts->stream_size, host);
+        count = opts->streams;
+    }
+    else
+    {
+        len = asprintf(&request,
+                       "POST %scontrol HTTP/1.1\r\n"
+                       "Host: %s\r\n"
+                       "Content-Type: text/xml; charset=\"utf-8\"\r\n"
+                       "SOAPAction: \"urn:schemas-upnp-org:service:ContentDirectory:1#Browse\"\r\n"
+                       "Content-Length: %lu\r\n"
+                       "Connection: close\r\n"
+                       "\r\n%s", base, host, (unsigned long)strlen(SOAP_REQUEST),
+                       SOAP_REQUEST);
+        count = opts->requests;
+    }
+    free(host);
+    if (len < 0)
+    {
+        _exit(EXIT_FAILURE);
+    }
+    for (i = 0; fd < 0 || i < count; ++i)
+    {
+        result_t result;
+        uint64_t start = now_usec();
+        int64_t got = client_request(addr, addrlen, request, len);
+        if (fd < 0)
+        {
+            continue;
+        }
+        result.usec = now_usec() - start;
+        result.ok = got >= 0 &&
+            (!stream || (uint64_t)got == opts->stream_size) ? 1 : 0;
+        result.bytes = got >= 0 ? got : 0;
+        if (write(fd, &result, sizeof(result)) != sizeof(result))
+        {
+            _exit(EXIT_FAILURE);
+        }
+    }
+    free(request);
+    _exit(EXIT_SUCCESS);
+}
+
+static int cmp_uint32(const void* a, const void* b)
+{
+    uint32_t x = *((const uint32_t*)a), y = *((const uint32_t*)b);
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static double percentile(const stats_t* stats, unsigned int p)
+{
+    size_t idx;
+    if (stats->count == 0)
+    {
+        return 0.0;
+    }
+    idx = (stats->count * p) / 100;
+    if (idx >= stats->count)
+    {
+        idx = stats->count - 1;
+    }
+    return stats->usec[idx] / 1000.0;
+}
+
+bool run_phase(const options_t* opts, const char* name, bool stream,
+               bool loaded, const struct sockaddr* addr, socklen_t addrlen,
+               const char* base, pid_t daemon_a, pid_t daemon_b)
+{
+    int fds[2];
+    unsigned int i;
+    pid_t* clients;
+    pid_t load = -1;
+    stats_t stats;
+    uint64_t start, elapsed;
+    result_t result;
+    double sec;
+
+    if ((stream ? opts->streams : opts->requests) == 0)
+    {
+        return true;
+    }
+    if (pipe(fds) != 0)
+    {
+        fprintf(stderr, "bench: Unable to create pipe: %s\n",
+                strerror(errno));
+        return false;
+    }
+    memset(&stats, 0, sizeof(stats));
+    clients = calloc(opts->clients, sizeof(pid_t));
+    if (loaded && opts->streams > 0)
+    {
+        load = fork();
+        if (load == 0)
+        {
+            close(fds[0]);
+            close(fds[1]);
+            client_run(opts, true, addr, addrlen, base, -1);
+        }
+        /* Let the stream get going */
+        usleep(200 * 1000);
+    }
+    start = now_usec();
+    for (i = 0; i < opts->clients; ++i)
+    {
+        clients[i] = fork();
+        if (clients[i] == 0)
+        {
+            close(fds[0]);
+            client_run(opts, stream, addr, addrlen, base, fds[1]);
+        }
+    }
+    close(fds[1]);
+    while (read(fds[0], &result, sizeof(result)) == sizeof(result))
+    {
+        if (!result.ok)
+        {
+            stats.failed++;
+            continue;
+        }
+        if (stats.count == stats.alloc)
+        {
+            stats.alloc = stats.alloc ? stats.alloc * 2 : 256;
+            stats.usec = realloc(stats.usec, stats.alloc * sizeof(uint32_t));
+        }
+        stats.usec[stats.count++] = result.usec;
+        stats.bytes += result.bytes;
+    }
+    elapsed = now_usec() - start;
+    close(fds[0]);
+    for (i = 0; i < opts->clients; ++i)
+    {
+        int status;
+        if (clients[i] > 0)
+        {
+            waitpid(clients[i], &status, 0);
+        }
+    }
+    free(clients);
+    if (load > 0)
+    {
+        int status;
+        kill(load, SIGTERM);
+        waitpid(load, &status, 0);
+    }
+
+    qsort(stats.usec, stats.count, sizeof(uint32_t), cmp_uint32);
+    sec = elapsed / 1000000.0;
+    fprintf(stdout, "%s: %lu requests (%lu failed) from %u clients in %.2f s,"
+            " %.1f req/s, %.2f MB/s, latency p50 %.2f ms p99 %.2f ms\n",
+            name, (unsigned long)stats.count, (unsigned long)stats.failed,
+            opts->clients, sec, sec > 0.0 ? stats.count / sec : 0.0,
+            sec > 0.0 ? (stats.bytes / (1024.0 * 1024.0)) / sec : 0.0,
+            percentile(&stats, 50), percentile(&stats, 99));
+    fprintf(stdout, "%s: rss daemon a %ld kB, daemon b %ld kB\n", name,
+            rss_kb(daemon_a), rss_kb(daemon_b));
+    fflush(stdout);
+    free(stats.usec);
+    return stats.failed == 0;
+}
+
+/* Events */
+
+/* Send request and read the response into buf, false unless it is 200 OK */
+static bool client_exchange(const struct sockaddr* addr, socklen_t addrlen,
+                            const char* request, size_t len,
+                            char* buf, size_t size)
+{
+    bool ok;
+    socket_t sock = socket_tcp_connect2(addr, addrlen, true, NULL);
+    if (sock < 0)
+    {
+        return false;
+    }
+    set_timeouts(sock);
+    ok = write_all(sock, request, len) &&
+        read_message(sock, buf, size) > 0 &&
+        strncmp(buf, "HTTP/1.1 200 ", 13) == 0;
+    socket_close(sock);
+    return ok;
+}
+
+/* Subscribe to the events of the device at addr and wait for
+ * opts->events of them. They must come in order, starting with SEQ 0, and
+ * the SystemUpdateID of the device must grow with each */
+static void client_events(const options_t* opts,
+                          const struct sockaddr* addr, socklen_t addrlen,
+                          const char* base, int fd)
+{
+    char buf[4096], sid[256], value[256], *host, *cbhost, *request;
+    struct sockaddr* cb = NULL;
+    socklen_t cblen;
+    socket_t listener;
+    result_t result;
+    uint32_t seq = 0;
+    unsigned long last = 0;
+    unsigned int got = 0;
+    uint64_t start = now_usec();
+    bool ok;
+    int len;
+
+    listener = socket_tcp_listen("127.0.0.1", 0);
+    if (listener >= 0)
+    {
+        cb = socket_getsockaddr(listener, &cblen);
+    }
+    if (cb == NULL)
+    {
+        _exit(EXIT_FAILURE);
+    }
+    asprinthost(&host, addr, addrlen);
+    asprinthost(&cbhost, cb, cblen);
+    free(cb);
+    len = asprintf(&request,
+                   "SUBSCRIBE %sevent HTTP/1.1\r\n"
+                   "HOST: %s\r\n"
+                   "CALLBACK: <http://%s/cb>\r\n"
+                   "NT: upnp:event\r\n"
+                   "TIMEOUT: Second-300\r\n"
+                   "\r\n", base, host, cbhost);
+    free(cbhost);
+    if (len < 0)
+    {
+        _exit(EXIT_FAILURE);
+    }
+    ok = client_exchange(addr, addrlen, request, len, buf, sizeof(buf)) &&
+        find_header(buf, "SID", sid, sizeof(sid));
+    free(request);
+    while (ok && got < opts->events)
+    {
+        struct pollfd pfd;
+        const char* pos;
+        socket_t sock;
+        pfd.fd = listener;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, REQUEST_TIMEOUT) != 1)
+        {
+            ok = false;
+            break;
+        }
+        sock = socket_accept(listener, NULL, NULL);
+        if (sock < 0)
+        {
+            continue;
+        }
+        set_timeouts(sock);
+        if (read_message(sock, buf, sizeof(buf)) == 0 ||
+            strncmp(buf, "NOTIFY /cb ", 11) != 0 ||
+            !find_header(buf, "SID", value, sizeof(value)) ||
+            strcmp(value, sid) != 0 ||
+            !find_header(buf, "SEQ", value, sizeof(value)) ||
+            strtoul(value, NULL, 10) != seq ||
+            (pos = strstr(buf, "<SystemUpdateID>")) == NULL ||
+            strtoul(pos + 16, NULL, 10) <= last)
+        {
+            ok = false;
+        }
+        else
+        {
+            last = strtoul(pos + 16, NULL, 10);
+        }
+        write_all(sock, EVENT_RESPONSE, sizeof(EVENT_RESPONSE) - 1);
+        socket_close(sock);
+        seq = seq == 0xffffffff ? 1 : seq + 1;
+        ++got;
+    }
+    socket_close(listener);
+    result.usec = now_usec() - start;
+    result.bytes = got;
+    result.ok = ok ? 1 : 0;
+    if (ok)
+    {
+        len = asprintf(&request,
+                       "UNSUBSCRIBE %sevent HTTP/1.1\r\n"
+                       "HOST: %s\r\n"
+                       "SID: %s\r\n"
+                       "\r\n", base, host, sid);
+        if (len < 0 ||
+            !client_exchange(addr, addrlen, request, len, buf, sizeof(buf)))
+        {
+            result.ok = 0;
+        }
+        if (len >= 0)
+        {
+            free(request);
+        }
+    }
+    free(host);
+    if (write(fd, &result, sizeof(result)) != sizeof(result))
+    {
+        _exit(EXIT_FAILURE);
+    }
+    _exit(EXIT_SUCCESS);
+}
+
+bool run_events(const options_t* opts,
+                const struct sockaddr* addr, socklen_t addrlen,
+                const char* base, pid_t daemon_a, pid_t daemon_b)
+{
+    int fds[2];
+    unsigned int i;
+    pid_t* clients;
+    unsigned long events = 0, failed = 0;
+    uint64_t start, elapsed;
+    result_t result;
+    double sec;
+
+    if (opts->events == 0)
+    {
+        return true;
+    }
+    if (pipe(fds) != 0)
+    {
+        fprintf(stderr, "bench: Unable to create pipe: %s\n",
+                strerror(errno));
+        return false;
+    }
+    clients = calloc(opts->clients, sizeof(pid_t));
+    start = now_usec();
+    for (i = 0; i < opts->clients; ++i)
+    {
+        clients[i] = fork();
+        if (clients[i] == 0)
+        {
+            close(fds[0]);
+            client_events(opts, addr, addrlen, base, fds[1]);
+        }
+    }
+    close(fds[1]);
+    while (read(fds[0], &result, sizeof(result)) == sizeof(result))
+    {
+        events += result.bytes;
+        if (!result.ok)
+        {
+            failed++;
+        }
+    }
+    elapsed = now_usec() - start;
+    close(fds[0]);
+    for (i = 0; i < opts->clients; ++i)
+    {
+        int status;
+        if (clients[i] > 0)
+        {
+            waitpid(clients[i], &status, 0);
+        }
+    }
+    free(clients);
+
+    sec = elapsed / 1000000.0;
+    fprintf(stdout, "events: %lu events to %u clients (%lu failed) in %.2f s,"
+            " %.1f events/s\n", events, opts->clients, failed, sec,
+            sec > 0.0 ? events / sec : 0.0);
+    fprintf(stdout, "events: rss daemon a %ld kB, daemon b %ld kB\n",
+            rss_kb(daemon_a), rss_kb(daemon_b));
+    fflush(stdout);
+    return failed == 0;
+}
+
+/* Handover */
+
+/* Hand over the daemon while a kept-alive connection through it is idle
+ * and another is in the middle of a stream. The idle one must still work
+ * after, compressed or not, and the busy one be closed */
+pid_t handover_tunnels(const options_t* opts, const char* name, pid_t pid,
+                       const struct sockaddr* addr, socklen_t addrlen,
+                       const char* base)
+{
+    char buf[8192], *host, *request = NULL, *stream = NULL;
+    int len = -1, stream_len = -1;
+    uint64_t streamed = 0;
+    socket_t idle, busy;
+    bool ok, kept = false, closed = false;
+    pid_t newpid;
+
+    asprinthost(&host, addr, addrlen);
+    if (host != NULL)
+    {
+        len = asprintf(&request,
+                       "POST %scontrol HTTP/1.1\r\n"
+                       "Host: %s\r\n"
+                       "Content-Type: text/xml; charset=\"utf-8\"\r\n"
+                       "SOAPAction: \"urn:schemas-upnp-org:service:ContentDirectory:1#Browse\"\r\n"
+                       "Content-Length: %lu\r\n"
+                       "\r\n%s", base, host,
+                       (unsigned long)strlen(SOAP_REQUEST), SOAP_REQUEST);
+        stream_len = asprintf(&stream,
+                              "GET %sstream?%llu HTTP/1.1\r\n"
+                              "Host: %s\r\n"
+                              "\r\n", base,
+                              (unsigned long long)HANDOVER_STREAM, host);
+    }
+    free(host);
+    idle = socket_tcp_connect2(addr, addrlen, true, NULL);
+    busy = socket_tcp_connect2(addr, addrlen, true, NULL);
+    if (idle >= 0)
+    {
+        set_timeouts(idle);
+    }
+    if (busy >= 0)
+    {
+        set_timeouts(busy);
+    }
+    ok = len >= 0 && stream_len >= 0 && idle >= 0 && busy >= 0 &&
+        write_all(idle, request, len) &&
+        read_message(idle, buf, sizeof(buf)) > 0 &&
+        strncmp(buf, "HTTP/1.1 200 ", 13) == 0 &&
+        write_all(busy, stream, stream_len) &&
+        socket_read(busy, buf, sizeof(buf)) > 0;
+    if (!ok)
+    {
+        fprintf(stderr, "bench: Unable to setup tunnels to hand over\n");
+    }
+    else
+    {
+        /* Let the stream fill the buffers */
+        usleep(300 * 1000);
+    }
+
+    newpid = handover(name, pid);
+    if (ok && newpid > 0)
+    {
+        kept = write_all(idle, request, len) &&
+            read_message(idle, buf, sizeof(buf)) > 0 &&
+            strncmp(buf, "HTTP/1.1 200 ", 13) == 0;
+        for (;;)
+        {
+            ssize_t got = socket_read(busy, buf, sizeof(buf));
+            if (got <= 0)
+            {
+                /* A timeout means the tunnel was left hanging */
+                closed = (got == 0 || !socket_blockingerror(busy)) &&
+                    streamed < HANDOVER_STREAM;
+                break;
+            }
+            streamed += got;
+        }
+        fprintf(stdout, "handover: idle tunnel %s, busy tunnel %s\n",
+                kept ? "kept" : "closed", closed ? "closed" : "hanging");
+        fflush(stdout);
+        if (!kept)
+        {
+            fprintf(stderr, "bench: Expected the idle tunnel to be kept\n");
+            ok = false;
+        }
+        if (!closed)
+        {
+            fprintf(stderr, "bench: Expected the busy tunnel to be closed\n");
+            ok = false;
+        }
+    }
+    socket_close(idle);
+    socket_close(busy);
+    free(request);
+    free(stream);
+    if (!ok)
+    {
+        stop(newpid);
+        return -1;
+    }
+    return newpid;
+}
@@ -0,0 +1,117 @@
+/*
+ * Copyright (C) 2011, Joel Klinghed.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the project nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE PROJECT AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE PROJECT OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Fuzz target for http_proxy, feeds the input through a proxy the same way
+ * flush_conn does in the daemon, discarding the output as if it was
+ * written to a socket.
+ * The first byte of the input selects the setup: if bit 0 is set there is
+ * no host rewriting (like the daemon side of a tunnel), bits 1-7 are the
+ * size of each write (0 means as much as fits). */
+
+#include "common.h"
+
+#include "http_proxy.h"
+
+#include <string.h>
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size);
+
+static const size_t OUTPUT_SIZE = 8192;
+
+static void drain(buf_t output)
+{
+    buf_skip(output, buf_ravail(output));
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+    buf_t output;
+    http_proxy_t proxy;
+    size_t chunk;
+    if (size < 1)
+    {
+        return 0;
+    }
+    output = buf_new(OUTPUT_SIZE);
+    if (data[0] & 1)
+    {
+        proxy = http_proxy_new("", "", output);
+    }
+    else
+    {
+        proxy = http_proxy_new("10.0.1.1:60582", "192.168.1.7:45000", output);
+    }
+    chunk = data[0] >> 1;
+    ++data;
+    --size;
+
+    while (size > 0)
+    {
+        size_t avail;
+        void* ptr = http_proxy_wptr(proxy, &avail);
+        if (avail == 0)
+        {
+            drain(output);
+            http_proxy_flush(proxy, false);
+            ptr = http_proxy_wptr(proxy, &avail);
+            if (avail == 0)
+            {
+                /* Proxy is stuck, the daemon would wait forever here */
+                break;
+            }
+        }
+        if (chunk > 0 && avail > chunk)
+        {
+            avail = chunk;
+        }
+        if (avail > size)
+        {
+            avail = size;
+        }
+        memcpy(ptr, data, avail);
+        data += avail;
+        size -= avail;
+        http_proxy_wmove(proxy, avail);
+        drain(output);
+        http_proxy_flush(proxy, false);
+    }
+
+    while (!http_proxy_flush(proxy, true))
+    {
+        if (buf_ravail(output) == 0)
+        {
+            break;
+        }
+        drain(output);
+    }
+
+    http_proxy_free(proxy);
+    buf_free(output);
+    return 0;
+}
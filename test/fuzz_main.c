@@ -0,0 +1,446 @@
+/*
+ * Copyright (C) 2011, Joel Klinghed.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the project nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE PROJECT AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE PROJECT OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Standalone driver for the fuzz harnesses, used when not building with
+ * libFuzzer (which brings its own main). Runs LLVMFuzzerTestOneInput on
+ * each given file (or each file in given directories) and reports parse
+ * throughput and allocations per input. It can also run simple random
+ * mutations of the inputs, which finds the shallow bugs without clang.
+ * Built with afl-clang-fast it works as an AFL target: `fuzz-xxx @@` */
+
+#include "common.h"
+
+#include "alloc_count.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <sys/time.h>
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size);
+
+typedef struct _input_t
+{
+    char* name;
+    uint8_t* data;
+    size_t size;
+    /* Time and allocations for one run */
+    uint64_t usec;
+    unsigned long allocs;
+} input_t;
+
+typedef struct _inputs_t
+{
+    input_t* input;
+    size_t count, alloc;
+} inputs_t;
+
+static const size_t MAX_INPUT_SIZE = 1024 * 1024;
+
+/* The mutated input being run, saved by crash_cb */
+static const uint8_t* current_data;
+static size_t current_size;
+/* Where crash_cb reports, stderr is silenced while mutating */
+static int report_fd = STDERR_FILENO;
+
+static bool load_path(inputs_t* inputs, const char* path);
+static void run_mutations(const inputs_t* inputs, unsigned long count,
+                          bool verbose);
+
+static void print_usage(const char* argv0)
+{
+    fprintf(stdout, "Usage: `%s [OPTIONS ...] FILE|DIR...`\n", argv0);
+    fputs("\n", stdout);
+    fputs("  -n N       run each input N times when measuring (default 1)\n", stdout);
+    fputs("  -m N       run N random mutations of the inputs (default 0),\n", stdout);
+    fputs("             an input that crashes is saved as fuzz-crash\n", stdout);
+    fputs("  -s SEED    seed for the mutations (default time)\n", stdout);
+    fputs("  -v         report time and allocations for each input and don't\n", stdout);
+    fputs("             silence stderr while mutating\n", stdout);
+    fputs("  -h         display this text and exit\n", stdout);
+}
+
+static uint64_t now_usec(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+int main(int argc, char** argv)
+{
+    inputs_t inputs;
+    unsigned long rounds = 1, mutations = 0, seed = time(NULL);
+    unsigned long allocs = 0, round;
+    uint64_t bytes = 0, usec = 0;
+    bool verbose = false;
+    size_t i, slowest = 0;
+    int c;
+
+    while ((c = getopt(argc, argv, "n:m:s:vh")) != -1)
+    {
+        switch (c)
+        {
+        case 'n':
+            rounds = strtoul(optarg, NULL, 10);
+            if (rounds == 0)
+            {
+                rounds = 1;
+            }
+            break;
+        case 'm':
+            mutations = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            seed = strtoul(optarg, NULL, 10);
+            break;
+        case 'v':
+            verbose = true;
+            break;
+        case 'h':
+            print_usage(argv[0]);
+            return EXIT_SUCCESS;
+        default:
+            print_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (optind >= argc)
+    {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    memset(&inputs, 0, sizeof(inputs));
+    for (; optind < argc; ++optind)
+    {
+        if (!load_path(&inputs, argv[optind]))
+        {
+            return EXIT_FAILURE;
+        }
+    }
+    if (inputs.count == 0)
+    {
+        fputs("No inputs found\n", stderr);
+        return EXIT_FAILURE;
+    }
+
+    for (i = 0; i < inputs.count; ++i)
+    {
+        input_t* input = inputs.input + i;
+        unsigned long before = alloc_count();
+        uint64_t start = now_usec();
+        for (round = 0; round < rounds; ++round)
+        {
+            LLVMFuzzerTestOneInput(input->data, input->size);
+        }
+        input->usec = (now_usec() - start) / rounds;
+        input->allocs = (alloc_count() - before) / rounds;
+        usec += input->usec;
+        bytes += input->size;
+        allocs += input->allocs;
+        if (input->size > 0 && inputs.input[slowest].size > 0 &&
+            input->usec * inputs.input[slowest].size >
+            inputs.input[slowest].usec * input->size)
+        {
+            slowest = i;
+        }
+        if (verbose)
+        {
+            fprintf(stdout, "%s: %lu bytes, %lu usec, %.2f MB/s, %lu allocs\n",
+                    input->name, (unsigned long)input->size,
+                    (unsigned long)input->usec,
+                    input->usec > 0 ? input->size / (double)input->usec : 0.0,
+                    input->allocs);
+        }
+    }
+
+    fprintf(stdout, "%lu inputs, %lu bytes, %.2f MB/s", (unsigned long)inputs.count,
+            (unsigned long)bytes, usec > 0 ? bytes / (double)usec : 0.0);
+    if (alloc_count_available())
+    {
+        fprintf(stdout, ", %.1f allocs per input",
+                allocs / (double)inputs.count);
+    }
+    fputs("\n", stdout);
+    if (inputs.input[slowest].usec > 0)
+    {
+        fprintf(stdout, "slowest input: %s, %.2f MB/s\n",
+                inputs.input[slowest].name,
+                inputs.input[slowest].size /
+                (double)inputs.input[slowest].usec);
+    }
+
+    if (mutations > 0)
+    {
+        fprintf(stdout, "running %lu mutations with seed %lu\n", mutations,
+                seed);
+        fflush(stdout);
+        srand(seed);
+        run_mutations(&inputs, mutations, verbose);
+        fputs("mutations done\n", stdout);
+    }
+
+    for (i = 0; i < inputs.count; ++i)
+    {
+        free(inputs.input[i].name);
+        free(inputs.input[i].data);
+    }
+    free(inputs.input);
+    return EXIT_SUCCESS;
+}
+
+static bool load_file(inputs_t* inputs, const char* path)
+{
+    input_t* input;
+    FILE* fh = fopen(path, "rb");
+    if (fh == NULL)
+    {
+        fprintf(stderr, "Unable to open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    if (inputs->count == inputs->alloc)
+    {
+        size_t nalloc = inputs->alloc ? inputs->alloc * 2 : 32;
+        input_t* tmp = realloc(inputs->input, nalloc * sizeof(input_t));
+        if (tmp == NULL)
+        {
+            fclose(fh);
+            return false;
+        }
+        inputs->input = tmp;
+        inputs->alloc = nalloc;
+    }
+    input = inputs->input + inputs->count;
+    memset(input, 0, sizeof(input_t));
+    input->data = malloc(MAX_INPUT_SIZE);
+    input->size = fread(input->data, 1, MAX_INPUT_SIZE, fh);
+    fclose(fh);
+    input->data = realloc(input->data, input->size > 0 ? input->size : 1);
+    input->name = strdup(path);
+    inputs->count++;
+    return true;
+}
+
+bool load_path(inputs_t* inputs, const char* path)
+{
+    struct stat st;
+    DIR* dir;
+    struct dirent* ent;
+    if (stat(path, &st) != 0)
+    {
+        fprintf(stderr, "Unable to stat %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    if (!S_ISDIR(st.st_mode))
+    {
+        return load_file(inputs, path);
+    }
+    dir = opendir(path);
+    if (dir == NULL)
+    {
+        fprintf(stderr, "Unable to open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    while ((ent = readdir(dir)) != NULL)
+    {
+        char* tmp;
+        bool ok;
+        if (ent->d_name[0] == '.')
+        {
+            continue;
+        }
+        if (asprintf(&tmp, "%s/%s", path, ent->d_name) == -1)
+        {
+            closedir(dir);
+            return false;
+        }
+        ok = load_path(inputs, tmp);
+        free(tmp);
+        if (!ok)
+        {
+            closedir(dir);
+            return false;
+        }
+    }
+    closedir(dir);
+    return true;
+}
+
+/* Mutates data (with room for max bytes) in place, returns new size */
+static size_t mutate(uint8_t* data, size_t size, size_t max,
+                     const inputs_t* inputs)
+{
+    unsigned int n = 1 + rand() % 4;
+    while (n-- > 0)
+    {
+        size_t pos = size > 0 ? rand() % size : 0;
+        switch (rand() % 6)
+        {
+        case 0:
+            /* Flip a bit */
+            if (size > 0)
+            {
+                data[pos] ^= 1 << (rand() % 8);
+            }
+            break;
+        case 1:
+            /* Interesting byte */
+            if (size > 0)
+            {
+                static const uint8_t interesting[] = {
+                    0x00, 0xff, 0x7f, 0x80, '\r', '\n', ' ', ':', '0', '9'
+                };
+                data[pos] = interesting[rand() % sizeof(interesting)];
+            }
+            break;
+        case 2:
+            /* Remove a run of bytes */
+            if (size > 0)
+            {
+                size_t len = 1 + rand() % (size - pos);
+                memmove(data + pos, data + pos + len, size - pos - len);
+                size -= len;
+            }
+            break;
+        case 3:
+            /* Duplicate a run of bytes */
+            if (size > 0)
+            {
+                size_t len = 1 + rand() % (size - pos);
+                if (len > max - size)
+                {
+                    len = max - size;
+                }
+                memmove(data + pos + len, data + pos, size - pos);
+                size += len;
+            }
+            break;
+        case 4:
+        {
+            /* Splice in a part of another input */
+            const input_t* other = inputs->input + rand() % inputs->count;
+            size_t start, len;
+            if (other->size == 0)
+            {
+                break;
+            }
+            start = rand() % other->size;
+            len = 1 + rand() % (other->size - start);
+            if (len > max - pos)
+            {
+                len = max - pos;
+            }
+            memcpy(data + pos, other->data + start, len);
+            if (pos + len > size)
+            {
+                size = pos + len;
+            }
+            break;
+        }
+        case 5:
+            /* Truncate */
+            size = pos;
+            break;
+        }
+    }
+    return size;
+}
+
+static void crash_cb(int signum)
+{
+    static const char msg[] = "Crashed, input saved as fuzz-crash\n";
+    int fd = open("fuzz-crash", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0)
+    {
+        if (write(fd, current_data, current_size) < 0 ||
+            write(report_fd, msg, sizeof(msg) - 1) < 0)
+        {
+            /* Nothing to do about it */
+        }
+        close(fd);
+    }
+    signal(signum, SIG_DFL);
+    raise(signum);
+}
+
+void run_mutations(const inputs_t* inputs, unsigned long count,
+                   bool verbose)
+{
+    size_t max = 0, i;
+    uint8_t* data;
+    int null_fd = -1;
+    for (i = 0; i < inputs->count; ++i)
+    {
+        if (inputs->input[i].size > max)
+        {
+            max = inputs->input[i].size;
+        }
+    }
+    max = max * 2 + 64;
+    data = malloc(max);
+    current_data = data;
+    signal(SIGSEGV, crash_cb);
+    signal(SIGABRT, crash_cb);
+    signal(SIGBUS, crash_cb);
+    signal(SIGFPE, crash_cb);
+    if (!verbose)
+    {
+        /* Debug builds complain loudly about invalid input */
+        null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd >= 0)
+        {
+            report_fd = dup(STDERR_FILENO);
+            dup2(null_fd, STDERR_FILENO);
+        }
+    }
+    while (count-- > 0)
+    {
+        const input_t* input = inputs->input + rand() % inputs->count;
+        size_t size;
+        memcpy(data, input->data, input->size);
+        size = mutate(data, input->size, max, inputs);
+        current_size = size;
+        LLVMFuzzerTestOneInput(data, size);
+    }
+    if (null_fd >= 0)
+    {
+        dup2(report_fd, STDERR_FILENO);
+        close(report_fd);
+        close(null_fd);
+        report_fd = STDERR_FILENO;
+    }
+    free(data);
+}
@@ -0,0 +1,212 @@
+/*
+ * Copyright (C) 2011, Joel Klinghed.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the project nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE PROJECT AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE PROJECT OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Fuzz target for the daemon protocol, feeds the input into a buffer of
+ * the size the daemon uses and reads packages the same way
+ * daemon_server_incoming_cb does. Every package read is also written and
+ * read back again, both as version 1 and compact, which must give the same
+ * package.
+ * The first byte of the input is the size of each write (0 means as much
+ * as fits). */
+
+#include "common.h"
+
+#include "daemon_proto.h"
+
+#include <string.h>
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size);
+
+/* Same as SERVER_BUFFER_IN in daemon.c */
+static const size_t INPUT_SIZE = 1024;
+
+static bool pkg_eq(const pkg_t* a, const pkg_view_t* b)
+{
+    if (a->type != b->type)
+    {
+        return false;
+    }
+    switch (a->type)
+    {
+    case PKG_NEW_SERVICE:
+        return a->content.new_service.service_id ==
+            b->content.new_service.service_id &&
+            pkg_str_eq(&(b->content.new_service.usn),
+                       a->content.new_service.usn) &&
+            pkg_str_eq(&(b->content.new_service.location),
+                       a->content.new_service.location) &&
+            pkg_str_eq(&(b->content.new_service.service),
+                       a->content.new_service.service) &&
+            pkg_str_eq(&(b->content.new_service.server),
+                       a->content.new_service.server) &&
+            pkg_str_eq(&(b->content.new_service.opt),
+                       a->content.new_service.opt) &&
+            pkg_str_eq(&(b->content.new_service.nls),
+                       a->content.new_service.nls);
+    case PKG_OLD_SERVICE:
+        return a->content.old_service.service_id ==
+            b->content.old_service.service_id;
+    case PKG_CREATE_TUNNEL:
+        return a->content.create_tunnel.service_id ==
+            b->content.create_tunnel.service_id &&
+            a->content.create_tunnel.tunnel_id ==
+            b->content.create_tunnel.tunnel_id &&
+            pkg_str_eq(&(b->content.create_tunnel.host),
+                       a->content.create_tunnel.host) &&
+            a->content.create_tunnel.port == b->content.create_tunnel.port &&
+            a->content.create_tunnel.compress ==
+            b->content.create_tunnel.compress;
+    case PKG_SETUP_TUNNEL:
+        return a->content.setup_tunnel.tunnel_id ==
+            b->content.setup_tunnel.tunnel_id &&
+            a->content.setup_tunnel.ok == b->content.setup_tunnel.ok &&
+            a->content.setup_tunnel.port == b->content.setup_tunnel.port;
+    case PKG_CLOSE_TUNNEL:
+        return a->content.close_tunnel.tunnel_id ==
+            b->content.close_tunnel.tunnel_id &&
+            a->content.close_tunnel.local == b->content.close_tunnel.local;
+    case PKG_RESTART_TUNNEL:
+        return a->content.restart_tunnel.tunnel_id ==
+            b->content.restart_tunnel.tunnel_id &&
+            a->content.restart_tunnel.local ==
+            b->content.restart_tunnel.local;
+    case PKG_HELLO:
+        return a->content.hello.version == b->content.hello.version &&
+            a->content.hello.compress == b->content.hello.compress;
+    case PKG_SUBSCRIBE:
+        return a->content.subscribe.service_id ==
+            b->content.subscribe.service_id &&
+            a->content.subscribe.watch_id == b->content.subscribe.watch_id &&
+            pkg_str_eq(&(b->content.subscribe.path),
+                       a->content.subscribe.path);
+    case PKG_UNSUBSCRIBE:
+        return a->content.unsubscribe.watch_id ==
+            b->content.unsubscribe.watch_id &&
+            a->content.unsubscribe.local == b->content.unsubscribe.local;
+    case PKG_EVENT:
+        return a->content.event.watch_id == b->content.event.watch_id &&
+            a->content.event.last == b->content.event.last &&
+            pkg_str_len(&(b->content.event.data)) == a->content.event.len &&
+            pkg_str_eq(&(b->content.event.data), a->content.event.data);
+    }
+    return false;
+}
+
+/* Write and read back the package, both as version 1 and compact using
+ * a dictionary pair that lives as long as the input */
+static void check_roundtrip(buf_t scratch, pkg_dict_t out, pkg_dict_t in,
+                            const pkg_view_t* view)
+{
+    pkg_t* pkg;
+    pkg_view_t copy;
+    bool ok;
+    buf_skip(scratch, buf_ravail(scratch));
+    pkg = pkg_dup(view);
+    if (!pkg_write(scratch, pkg))
+    {
+        /* Doesn't fit, can only happen for packages larger than input */
+        pkg_free(pkg);
+        return;
+    }
+    ok = pkg_peek(scratch, NULL, &copy);
+    if (!ok || !pkg_eq(pkg, &copy))
+    {
+        abort();
+    }
+    pkg_read(scratch, &copy);
+    if (pkg_write_dict(scratch, pkg, out, pkg->type == PKG_NEW_SERVICE
+                       ? pkg->content.new_service.service_id %
+                       PKG_DICT_CHANNELS : 0) > 0)
+    {
+        ok = pkg_peek(scratch, in, &copy);
+        if (!ok || !pkg_eq(pkg, &copy))
+        {
+            abort();
+        }
+        pkg_read(scratch, &copy);
+    }
+    pkg_free(pkg);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+    buf_t input, scratch;
+    pkg_dict_t dict, out, in;
+    size_t chunk;
+    if (size < 1)
+    {
+        return 0;
+    }
+    input = buf_new(INPUT_SIZE);
+    scratch = buf_new(INPUT_SIZE * 2);
+    dict = pkg_dict_new();
+    out = pkg_dict_new();
+    in = pkg_dict_new();
+    chunk = data[0];
+    ++data;
+    --size;
+
+    while (size > 0)
+    {
+        pkg_view_t pkg;
+        size_t avail;
+        char* ptr = buf_wptr(input, &avail);
+        if (avail == 0)
+        {
+            /* Package larger than the buffer, the daemon would wait
+             * forever here */
+            break;
+        }
+        if (chunk > 0 && avail > chunk)
+        {
+            avail = chunk;
+        }
+        if (avail > size)
+        {
+            avail = size;
+        }
+        memcpy(ptr, data, avail);
+        data += avail;
+        size -= avail;
+        buf_wmove(input, avail);
+
+        while (pkg_peek(input, dict, &pkg))
+        {
+            check_roundtrip(scratch, out, in, &pkg);
+            pkg_read(input, &pkg);
+        }
+    }
+
+    pkg_dict_free(in);
+    pkg_dict_free(out);
+    pkg_dict_free(dict);
+    buf_free(scratch);
+    buf_free(input);
+    return 0;
+}
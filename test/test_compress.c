@@ -0,0 +1,541 @@
+/*
+ * Copyright (C) 2011, Joel Klinghed.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the project nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE PROJECT AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE PROJECT OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "common.h"
+
+#include "codec.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define RUN_TEST(_test) \
+    ++tot; cnt += _test ? 1 : 0
+
+static bool test1(codec_method_t method, size_t chunk, size_t piece);
+static bool test2(codec_method_t method);
+static bool test3(codec_method_t method);
+static bool test4(codec_method_t method);
+static bool test5(void);
+static bool test6(codec_method_t method);
+
+int main(int argc, char** argv)
+{
+    unsigned int tot = 0, cnt = 0;
+    codec_method_t method;
+
+    for (method = CODEC_ZLIB; method <= CODEC_ZSTD; ++method)
+    {
+        if (!(codec_methods() & (1 << method)))
+        {
+            fprintf(stdout, "%s not available\n", codec_method_str(method));
+            continue;
+        }
+
+        RUN_TEST(test1(method, 65536, 65536));
+        RUN_TEST(test1(method, 1, 7));
+        RUN_TEST(test1(method, 1000, 1));
+        RUN_TEST(test1(method, 4093, 509));
+
+        RUN_TEST(test2(method));
+
+        RUN_TEST(test3(method));
+
+        RUN_TEST(test4(method));
+
+        RUN_TEST(test6(method));
+    }
+
+    RUN_TEST(test5());
+
+    fprintf(stdout, "OK %u/%u\n", cnt, tot);
+
+    return cnt == tot ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+#define DATA_SIZE (64 * 1024)
+#define OUT_SIZE (DATA_SIZE * 2)
+
+/* Something that looks like what goes through a tunnel */
+static char* make_data(void)
+{
+    static const char* const line =
+        "<service><serviceType>urn:schemas-upnp-org:service:"
+        "ContentDirectory:1</serviceType><controlURL>/ctl/%u</controlURL>"
+        "</service>\r\n";
+    char* data = malloc(DATA_SIZE);
+    size_t pos = 0;
+    unsigned int i = 0;
+    while (pos < DATA_SIZE)
+    {
+        char tmp[200];
+        size_t len = snprintf(tmp, sizeof(tmp), line, i++);
+        if (len > DATA_SIZE - pos)
+        {
+            len = DATA_SIZE - pos;
+        }
+        memcpy(data + pos, tmp, len);
+        pos += len;
+    }
+    return data;
+}
+
+/* Run the codec with at most piece bytes of output per codec_run until it
+ * has nothing more to give. Returns the number of bytes written to out or
+ * -1 on error */
+static ssize_t pump(codec_t codec, buf_t input, char* out, size_t size,
+                    size_t piece)
+{
+    size_t pos = 0;
+    for (;;)
+    {
+        size_t avail = size - pos < piece ? size - pos : piece;
+        ssize_t ret;
+        if (avail == 0)
+        {
+            return -1;
+        }
+        ret = codec_run(codec, input, out + pos, avail);
+        if (ret < 0)
+        {
+            return -1;
+        }
+        pos += ret;
+        if ((size_t)ret < avail && !codec_pending(codec))
+        {
+            return pos;
+        }
+    }
+}
+
+/* Give the codec size bytes of data, chunk bytes at a time */
+static ssize_t feed(codec_t codec, buf_t input, const char* data, size_t size,
+                    size_t chunk, char* out, size_t outsize, size_t piece)
+{
+    size_t pos = 0, done = 0;
+    while (pos < size)
+    {
+        size_t len = size - pos < chunk ? size - pos : chunk;
+        ssize_t ret;
+        len = buf_write(input, data + pos, len);
+        pos += len;
+        ret = pump(codec, input, out + done, outsize - done, piece);
+        if (ret < 0)
+        {
+            return -1;
+        }
+        done += ret;
+    }
+    return done;
+}
+
+/* Compress all of the data and decompress it again */
+static bool test1(codec_method_t method, size_t chunk, size_t piece)
+{
+    bool ok = false;
+    char* data = make_data();
+    char* packed = malloc(OUT_SIZE), *unpacked = malloc(OUT_SIZE);
+    buf_t input = buf_new(8192);
+    codec_t enc = codec_new(method, true), dec = codec_new(method, false);
+    ssize_t ret, size, size2;
+
+    if (enc == NULL || dec == NULL)
+    {
+        fprintf(stderr, "test1-%s: unable to create codecs\n",
+                codec_method_str(method));
+        goto out;
+    }
+    size = feed(enc, input, data, DATA_SIZE, chunk, packed, OUT_SIZE, piece);
+    if (size < 0)
+    {
+        fprintf(stderr, "test1-%s: compress failed\n",
+                codec_method_str(method));
+        goto out;
+    }
+    codec_finish(enc);
+    ret = pump(enc, input, packed + size, OUT_SIZE - size, piece);
+    if (ret < 0)
+    {
+        fprintf(stderr, "test1-%s: finish failed\n",
+                codec_method_str(method));
+        goto out;
+    }
+    size += ret;
+    if (size * 4 > DATA_SIZE)
+    {
+        fprintf(stderr, "test1-%s: compressed %lu bytes into %lu\n",
+                codec_method_str(method), (unsigned long)DATA_SIZE,
+                (unsigned long)size);
+        goto out;
+    }
+    size2 = feed(dec, input, packed, size, chunk, unpacked, OUT_SIZE, piece);
+    if (size2 != DATA_SIZE || memcmp(data, unpacked, DATA_SIZE) != 0)
+    {
+        fprintf(stderr, "test1-%s: decompressed data doesn't match (%ld)\n",
+                codec_method_str(method), (long)size2);
+        goto out;
+    }
+    ok = true;
+
+ out:
+    codec_free(enc);
+    codec_free(dec);
+    buf_free(input);
+    free(data);
+    free(packed);
+    free(unpacked);
+    return ok;
+}
+
+/* After a flush everything given so far can be decompressed, without the
+ * end of the stream */
+static bool test2(codec_method_t method)
+{
+    bool ok = false;
+    char* data = make_data();
+    char* packed = malloc(OUT_SIZE), *unpacked = malloc(OUT_SIZE);
+    buf_t input = buf_new(8192);
+    codec_t enc = codec_new(method, true), dec = codec_new(method, false);
+    ssize_t size = 0, size2 = 0, ret;
+    size_t pos = 0;
+    unsigned int i;
+
+    for (i = 0; i < 3; ++i)
+    {
+        size_t len = 1000 + i * 3000;
+        ret = feed(enc, input, data + pos, len, len, packed + size,
+                   OUT_SIZE - size, 100);
+        if (ret < 0)
+        {
+            fprintf(stderr, "test2-%s: compress failed\n",
+                    codec_method_str(method));
+            goto out;
+        }
+        size += ret;
+        pos += len;
+        if (!codec_flush(enc))
+        {
+            fprintf(stderr, "test2-%s: nothing to flush\n",
+                    codec_method_str(method));
+            goto out;
+        }
+        ret = pump(enc, input, packed + size, OUT_SIZE - size, 100);
+        if (ret <= 0)
+        {
+            fprintf(stderr, "test2-%s: flush failed\n",
+                    codec_method_str(method));
+            goto out;
+        }
+        size += ret;
+        if (codec_flush(enc))
+        {
+            fprintf(stderr, "test2-%s: flushed twice\n",
+                    codec_method_str(method));
+            goto out;
+        }
+        ret = feed(dec, input, packed, size, size, unpacked + size2,
+                   OUT_SIZE - size2, 100);
+        if (ret < 0)
+        {
+            fprintf(stderr, "test2-%s: decompress failed\n",
+                    codec_method_str(method));
+            goto out;
+        }
+        size2 += ret;
+        if ((size_t)size2 != pos || memcmp(data, unpacked, pos) != 0)
+        {
+            fprintf(stderr, "test2-%s: got %ld bytes after flush, expected %lu\n",
+                    codec_method_str(method), (long)size2, (unsigned long)pos);
+            goto out;
+        }
+        /* Only give the decompressor the new data the next time */
+        size = 0;
+    }
+    ok = true;
+
+ out:
+    codec_free(enc);
+    codec_free(dec);
+    buf_free(input);
+    free(data);
+    free(packed);
+    free(unpacked);
+    return ok;
+}
+
+/* Skipped data goes through as is but still decompresses */
+static bool test3(codec_method_t method)
+{
+    bool ok = false;
+    char* data = make_data();
+    char* packed = malloc(OUT_SIZE), *unpacked = malloc(OUT_SIZE);
+    buf_t input = buf_new(8192);
+    codec_t enc = codec_new(method, true), dec = codec_new(method, false);
+    ssize_t size = 0, size2, ret;
+    codec_stats_t stats;
+    unsigned int i;
+
+    for (i = 0; i < 4; ++i)
+    {
+        codec_skip(enc, i % 2 == 1);
+        ret = feed(enc, input, data + i * (DATA_SIZE / 4), DATA_SIZE / 4,
+                   1024, packed + size, OUT_SIZE - size, 512);
+        if (ret < 0)
+        {
+            fprintf(stderr, "test3-%s: compress failed\n",
+                    codec_method_str(method));
+            goto out;
+        }
+        size += ret;
+    }
+    codec_finish(enc);
+    ret = pump(enc, input, packed + size, OUT_SIZE - size, 512);
+    if (ret < 0)
+    {
+        fprintf(stderr, "test3-%s: finish failed\n",
+                codec_method_str(method));
+        goto out;
+    }
+    size += ret;
+    codec_stats(enc, &stats);
+    if (stats.skips != 2)
+    {
+        fprintf(stderr, "test3-%s: expected 2 skips, got %lu\n",
+                codec_method_str(method), stats.skips);
+        goto out;
+    }
+    /* Half of it was skipped, that half is hardly compressed at all */
+    if (size * 2 < DATA_SIZE / 2)
+    {
+        fprintf(stderr, "test3-%s: skipped data was compressed (%lu)\n",
+                codec_method_str(method), (unsigned long)size);
+        goto out;
+    }
+    size2 = feed(dec, input, packed, size, 4096, unpacked, OUT_SIZE, 4096);
+    if (size2 != DATA_SIZE || memcmp(data, unpacked, DATA_SIZE) != 0)
+    {
+        fprintf(stderr, "test3-%s: decompressed data doesn't match (%ld)\n",
+                codec_method_str(method), (long)size2);
+        goto out;
+    }
+    ok = true;
+
+ out:
+    codec_free(enc);
+    codec_free(dec);
+    buf_free(input);
+    free(data);
+    free(packed);
+    free(unpacked);
+    return ok;
+}
+
+/* Garbage and the stats */
+static bool test4(codec_method_t method)
+{
+    static const char garbage[] = "GET / HTTP/1.1\r\nHost: example\r\n\r\n";
+    bool ok = false;
+    char* data = make_data();
+    char* packed = malloc(OUT_SIZE), *unpacked = malloc(OUT_SIZE);
+    buf_t input = buf_new(8192);
+    codec_t enc = codec_new(method, true), dec = codec_new(method, false);
+    codec_t dec2 = codec_new(method, false);
+    ssize_t size, ret;
+    codec_stats_t stats;
+
+    if (feed(dec2, input, garbage, sizeof(garbage) - 1, 100, unpacked,
+             OUT_SIZE, 100) >= 0)
+    {
+        fprintf(stderr, "test4-%s: garbage decompressed\n",
+                codec_method_str(method));
+        goto out;
+    }
+    buf_skip(input, buf_ravail(input));
+
+    size = feed(enc, input, data, 10000, 10000, packed, OUT_SIZE, 1000);
+    codec_finish(enc);
+    size += pump(enc, input, packed + size, OUT_SIZE - size, 1000);
+    codec_stats(enc, &stats);
+    if (stats.in != 10000 || stats.out != (uint64_t)size || stats.skips != 0)
+    {
+        fprintf(stderr, "test4-%s: wrong compress stats %lu %lu %lu\n",
+                codec_method_str(method), (unsigned long)stats.in,
+                (unsigned long)stats.out, stats.skips);
+        goto out;
+    }
+    ret = feed(dec, input, packed, size, size, unpacked, OUT_SIZE, 1000);
+    codec_stats(dec, &stats);
+    if (ret != 10000 || stats.in != (uint64_t)size || stats.out != 10000)
+    {
+        fprintf(stderr, "test4-%s: wrong decompress stats %lu %lu\n",
+                codec_method_str(method), (unsigned long)stats.in,
+                (unsigned long)stats.out);
+        goto out;
+    }
+    /* Only another stream may follow the end of the stream */
+    if (feed(dec, input, data, 100, 100, unpacked, OUT_SIZE, 1000) >= 0)
+    {
+        fprintf(stderr, "test4-%s: data after the end accepted\n",
+                codec_method_str(method));
+        goto out;
+    }
+    ok = true;
+
+ out:
+    codec_free(enc);
+    codec_free(dec);
+    codec_free(dec2);
+    buf_free(input);
+    free(data);
+    free(packed);
+    free(unpacked);
+    return ok;
+}
+
+static bool test5(void)
+{
+    unsigned int methods = codec_methods();
+    if (!(methods & (1 << CODEC_NONE)) ||
+        codec_new(CODEC_NONE, true) != NULL)
+    {
+        fprintf(stderr, "test5: CODEC_NONE\n");
+        return false;
+    }
+    if (codec_pick(methods, 1 << CODEC_NONE) != CODEC_NONE ||
+        codec_pick(methods, 0) != CODEC_NONE)
+    {
+        fprintf(stderr, "test5: picked something the other end can't do\n");
+        return false;
+    }
+    if ((methods & (1 << CODEC_ZLIB)) &&
+        codec_pick(methods, (1 << CODEC_ZLIB) | (1 << CODEC_NONE))
+        != CODEC_ZLIB)
+    {
+        fprintf(stderr, "test5: zlib not picked\n");
+        return false;
+    }
+    if ((methods & (1 << CODEC_ZSTD)) &&
+        codec_pick(methods, 0xff) != CODEC_ZSTD)
+    {
+        fprintf(stderr, "test5: zstd not picked\n");
+        return false;
+    }
+    return true;
+}
+
+/* A restarted stream decompresses on its own */
+static bool test6(codec_method_t method)
+{
+    bool ok = false;
+    char* data = make_data();
+    char* packed = malloc(OUT_SIZE), *unpacked = malloc(OUT_SIZE);
+    buf_t input = buf_new(OUT_SIZE);
+    codec_t enc = codec_new(method, true), dec = codec_new(method, false);
+    codec_t dec2 = codec_new(method, false), dec3 = codec_new(method, false);
+    ssize_t size, size2, ret;
+
+    size = feed(enc, input, data, DATA_SIZE / 2, 1024, packed, OUT_SIZE, 512);
+    codec_restart(enc);
+    ret = pump(enc, input, packed + size, OUT_SIZE - size, 512);
+    if (size < 0 || ret < 0 || !codec_boundary(enc))
+    {
+        fprintf(stderr, "test6-%s: restart failed\n",
+                codec_method_str(method));
+        goto out;
+    }
+    size += ret;
+    /* Nothing new, nothing to restart */
+    codec_restart(enc);
+    if (codec_pending(enc))
+    {
+        fprintf(stderr, "test6-%s: empty restart\n",
+                codec_method_str(method));
+        goto out;
+    }
+    size2 = feed(enc, input, data + DATA_SIZE / 2, DATA_SIZE / 2, 1024,
+                 packed + size, OUT_SIZE - size, 512);
+    codec_finish(enc);
+    ret = pump(enc, input, packed + size + size2, OUT_SIZE - size - size2,
+               512);
+    if (size2 < 0 || ret < 0)
+    {
+        fprintf(stderr, "test6-%s: compress failed\n",
+                codec_method_str(method));
+        goto out;
+    }
+    size2 += ret;
+
+    /* Both streams one after the other */
+    ret = feed(dec, input, packed, size + size2, 1000, unpacked, OUT_SIZE,
+               4096);
+    if (ret != DATA_SIZE || memcmp(data, unpacked, DATA_SIZE) != 0)
+    {
+        fprintf(stderr, "test6-%s: decompressed data doesn't match (%ld)\n",
+                codec_method_str(method), (long)ret);
+        goto out;
+    }
+
+    /* Stopping at the end of the first, the rest is for a new codec */
+    buf_write(input, packed, size + size2);
+    ret = codec_run(dec2, input, unpacked, 100);
+    codec_stop(dec2, true);
+    if (ret != 100 || codec_stopped(dec2))
+    {
+        fprintf(stderr, "test6-%s: stopped too early\n",
+                codec_method_str(method));
+        goto out;
+    }
+    ret = pump(dec2, input, unpacked + 100, OUT_SIZE - 100, 4096);
+    if (ret + 100 != DATA_SIZE / 2 || !codec_stopped(dec2)
+        || buf_ravail(input) != (size_t)size2)
+    {
+        fprintf(stderr, "test6-%s: didn't stop at the end (%ld)\n",
+                codec_method_str(method), (long)ret);
+        goto out;
+    }
+    ret = pump(dec3, input, unpacked + DATA_SIZE / 2, OUT_SIZE - DATA_SIZE / 2,
+               4096);
+    if (ret != DATA_SIZE / 2 || memcmp(data, unpacked, DATA_SIZE) != 0)
+    {
+        fprintf(stderr, "test6-%s: second stream doesn't match (%ld)\n",
+                codec_method_str(method), (long)ret);
+        goto out;
+    }
+    ok = true;
+
+ out:
+    codec_free(enc);
+    codec_free(dec);
+    codec_free(dec2);
+    codec_free(dec3);
+    buf_free(input);
+    free(data);
+    free(packed);
+    free(unpacked);
+    return ok;
+}
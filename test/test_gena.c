@@ -0,0 +1,557 @@
+/*
+ * Copyright (C) 2011, Joel Klinghed.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the project nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE PROJECT AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE PROJECT OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "common.h"
+
+#include "gena.h"
+#include <stdio.h>
+#include <string.h>
+
+#define RUN_TEST(_test) \
+    ++tot; cnt += _test ? 1 : 0
+
+static bool test_request(void);
+static bool test_response(void);
+static bool test_messages(void);
+static bool test_state(void);
+static bool test_relay(void);
+
+int main(int argc, char** argv)
+{
+    unsigned int tot = 0, cnt = 0;
+
+    RUN_TEST(test_request());
+    RUN_TEST(test_response());
+    RUN_TEST(test_messages());
+    RUN_TEST(test_state());
+    RUN_TEST(test_relay());
+
+    fprintf(stdout, "OK %u/%u\n", cnt, tot);
+
+    return cnt == tot ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static bool streq(const char* a, const char* b)
+{
+    return a != NULL && b != NULL && strcmp(a, b) == 0;
+}
+
+bool test_request(void)
+{
+    static const char subscribe[] =
+        "SUBSCRIBE /upnpproxy-1f/evt HTTP/1.1\r\n"
+        "Host: 10.0.0.2:8200\r\n"
+        "callback: <http://10.0.0.3:49152/cb/1><http://10.0.0.3/cb/2>\r\n"
+        "NT: upnp:event\r\n"
+        "TIMEOUT:  Second-1800 \r\n"
+        "\r\n";
+    static const char renew[] =
+        "SUBSCRIBE /evt HTTP/1.1\n"
+        "SID: uuid:1234\n"
+        "TIMEOUT: Second-infinite\n"
+        "\n";
+    static const char notify[] =
+        "NOTIFY /cb HTTP/1.1\r\n"
+        "NT: upnp:event\r\n"
+        "NTS: upnp:propchange\r\n"
+        "SID: uuid:1234\r\n"
+        "SEQ: 4294967295\r\n"
+        "Content-Length: 12\r\n"
+        "\r\n"
+        "<propertyset";
+    static const char get[] = "GET /desc.xml HTTP/1.1\r\n\r\n";
+    static const char bad_seq[] =
+        "NOTIFY /cb HTTP/1.1\r\nSEQ: 4294967296\r\n\r\n";
+    static const char bad_line[] = "SUBSCRIBE /evt\r\n\r\n";
+    gena_request_t req;
+    bool ret = false;
+
+    if (gena_parse_request(subscribe, sizeof(subscribe) - 3, &req) != 0)
+    {
+        fputs("test_request: parsed incomplete header\n", stderr);
+        return false;
+    }
+    if (gena_parse_request(subscribe, sizeof(subscribe) - 1, &req) != 1)
+    {
+        fputs("test_request: subscribe not parsed\n", stderr);
+        return false;
+    }
+    if (req.method != GENA_SUBSCRIBE ||
+        !streq(req.uri, "/upnpproxy-1f/evt") ||
+        !streq(req.callback, "http://10.0.0.3:49152/cb/1") ||
+        !streq(req.nt, "upnp:event") || req.sid != NULL ||
+        req.timeout != 1800 || req.headlen != sizeof(subscribe) - 1)
+    {
+        fputs("test_request: subscribe missmatched\n", stderr);
+        goto out;
+    }
+    gena_request_free(&req);
+    if (gena_parse_request(renew, sizeof(renew) - 1, &req) != 1 ||
+        req.method != GENA_SUBSCRIBE || req.callback != NULL ||
+        !streq(req.sid, "uuid:1234") ||
+        req.timeout != GENA_TIMEOUT_INFINITE)
+    {
+        fputs("test_request: renew missmatched\n", stderr);
+        goto out;
+    }
+    gena_request_free(&req);
+    if (gena_parse_request(notify, sizeof(notify) - 1, &req) != 1 ||
+        req.method != GENA_NOTIFY || !streq(req.nts, "upnp:propchange") ||
+        !req.has_seq || req.seq != 0xffffffff ||
+        req.content_length != 12 ||
+        req.headlen + req.content_length != sizeof(notify) - 1 ||
+        req.timeout != GENA_TIMEOUT_NONE)
+    {
+        fputs("test_request: notify missmatched\n", stderr);
+        goto out;
+    }
+    gena_request_free(&req);
+    if (gena_parse_request(get, sizeof(get) - 1, &req) != 1 ||
+        req.method != GENA_OTHER || !streq(req.uri, "/desc.xml"))
+    {
+        fputs("test_request: get missmatched\n", stderr);
+        goto out;
+    }
+    gena_request_free(&req);
+    if (gena_parse_request(bad_seq, sizeof(bad_seq) - 1, &req) != -1 ||
+        gena_parse_request(bad_line, sizeof(bad_line) - 1, &req) != -1)
+    {
+        fputs("test_request: invalid request parsed\n", stderr);
+        return false;
+    }
+    return true;
+
+ out:
+    gena_request_free(&req);
+    return ret;
+}
+
+bool test_response(void)
+{
+    static const char ok[] =
+        "HTTP/1.1 200 OK\r\n"
+        "Server: Linux/1.0 UPnP/1.0 test/1.0\r\n"
+        "SID: uuid:abcd\r\n"
+        "Timeout: Second-300\r\n"
+        "\r\n";
+    static const char failed[] = "HTTP/1.0 412 Precondition Failed\r\n\r\n";
+    static const char bad[] = "HTTP/1.1 2x0 OK\r\n\r\n";
+    gena_response_t resp;
+    if (gena_parse_response(ok, sizeof(ok) - 1, &resp) != 1 ||
+        resp.status != 200 || !streq(resp.sid, "uuid:abcd") ||
+        resp.timeout != 300 || resp.headlen != sizeof(ok) - 1)
+    {
+        fputs("test_response: ok missmatched\n", stderr);
+        gena_response_free(&resp);
+        return false;
+    }
+    gena_response_free(&resp);
+    if (gena_parse_response(failed, sizeof(failed) - 1, &resp) != 1 ||
+        resp.status != 412 || resp.sid != NULL)
+    {
+        fputs("test_response: failed missmatched\n", stderr);
+        gena_response_free(&resp);
+        return false;
+    }
+    gena_response_free(&resp);
+    if (gena_parse_response(bad, sizeof(bad) - 1, &resp) != -1)
+    {
+        fputs("test_response: invalid response parsed\n", stderr);
+        return false;
+    }
+    return true;
+}
+
+/* What is built parses back to the same */
+bool test_messages(void)
+{
+    gena_request_t req;
+    gena_response_t resp;
+    char* msg;
+    size_t len;
+    bool ok;
+
+    msg = gena_subscribe("/evt", "10.0.0.2:8200", "http://10.0.0.1:3000/e/1",
+                         NULL, 1800, &len);
+    ok = gena_parse_request(msg, len, &req) == 1 &&
+        req.method == GENA_SUBSCRIBE && streq(req.uri, "/evt") &&
+        streq(req.callback, "http://10.0.0.1:3000/e/1") &&
+        streq(req.nt, "upnp:event") && req.timeout == 1800 &&
+        req.headlen == len;
+    gena_request_free(&req);
+    free(msg);
+    if (!ok)
+    {
+        fputs("test_messages: subscribe missmatched\n", stderr);
+        return false;
+    }
+
+    msg = gena_subscribe("/evt", "10.0.0.2:8200", NULL, "uuid:1", 300, &len);
+    ok = gena_parse_request(msg, len, &req) == 1 &&
+        req.method == GENA_SUBSCRIBE && req.callback == NULL &&
+        streq(req.sid, "uuid:1") && req.timeout == 300;
+    gena_request_free(&req);
+    free(msg);
+    if (!ok)
+    {
+        fputs("test_messages: renew missmatched\n", stderr);
+        return false;
+    }
+
+    msg = gena_unsubscribe("/evt", "10.0.0.2:8200", "uuid:1", &len);
+    ok = gena_parse_request(msg, len, &req) == 1 &&
+        req.method == GENA_UNSUBSCRIBE && streq(req.sid, "uuid:1");
+    gena_request_free(&req);
+    free(msg);
+    if (!ok)
+    {
+        fputs("test_messages: unsubscribe missmatched\n", stderr);
+        return false;
+    }
+
+    msg = gena_notify("/e/1", "10.0.0.1:3000", "uuid:2", 7, "<body/>", 7,
+                      &len);
+    ok = gena_parse_request(msg, len, &req) == 1 &&
+        req.method == GENA_NOTIFY && streq(req.uri, "/e/1") &&
+        streq(req.sid, "uuid:2") && req.has_seq && req.seq == 7 &&
+        streq(req.nts, "upnp:propchange") && req.content_length == 7 &&
+        req.headlen + 7 == len && memcmp(msg + req.headlen, "<body/>", 7) == 0;
+    gena_request_free(&req);
+    free(msg);
+    if (!ok)
+    {
+        fputs("test_messages: notify missmatched\n", stderr);
+        return false;
+    }
+
+    msg = gena_response("200 OK", "test/1.0", "uuid:3",
+                        GENA_TIMEOUT_INFINITE, &len);
+    ok = gena_parse_response(msg, len, &resp) == 1 && resp.status == 200 &&
+        streq(resp.sid, "uuid:3") && resp.timeout == GENA_TIMEOUT_INFINITE &&
+        resp.headlen == len;
+    gena_response_free(&resp);
+    free(msg);
+    if (!ok)
+    {
+        fputs("test_messages: response missmatched\n", stderr);
+        return false;
+    }
+    if (gena_next_seq(0) != 1 || gena_next_seq(0xffffffff) != 1)
+    {
+        fputs("test_messages: seq wrapped to 0\n", stderr);
+        return false;
+    }
+    return true;
+}
+
+bool test_state(void)
+{
+    static const char event1[] =
+        "<?xml version=\"1.0\"?>\n"
+        "<e:propertyset xmlns:e=\"urn:schemas-upnp-org:event-1-0\">\n"
+        "  <e:property><SystemUpdateID>1</SystemUpdateID></e:property>\n"
+        "  <!-- comment -->\n"
+        "  <e:property>\n    <ContainerUpdateIDs></ContainerUpdateIDs>\n"
+        "  </e:property>\n"
+        "  <e:property/>\n"
+        "</e:propertyset>\n";
+    static const char event2[] =
+        "<propertyset xmlns=\"urn:schemas-upnp-org:event-1-0\">"
+        "<property><TransferIDs>3</TransferIDs></property>"
+        "<property><SystemUpdateID>2</SystemUpdateID></property>"
+        "</propertyset>";
+    static const char expected[] =
+        "<?xml version=\"1.0\"?>\r\n"
+        "<e:propertyset xmlns:e=\"urn:schemas-upnp-org:event-1-0\">"
+        "<e:property><SystemUpdateID>2</SystemUpdateID></e:property>"
+        "<e:property><ContainerUpdateIDs></ContainerUpdateIDs></e:property>"
+        "<e:property><TransferIDs>3</TransferIDs></e:property>"
+        "</e:propertyset>\r\n";
+    static const char broken[] =
+        "<e:propertyset><e:property><SystemUpdateID>3</SystemUpdateID>"
+        "</e:propertyset>";
+    gena_state_t state = gena_state_new(), copy = gena_state_new();
+    char* body = NULL, *body2 = NULL;
+    size_t len, len2;
+    bool ret = false;
+
+    if (!gena_state_empty(state))
+    {
+        fputs("test_state: new state not empty\n", stderr);
+        goto out;
+    }
+    if (!gena_state_update(state, event1, sizeof(event1) - 1) ||
+        !gena_state_update(state, event2, sizeof(event2) - 1) ||
+        gena_state_empty(state))
+    {
+        fputs("test_state: events not parsed\n", stderr);
+        goto out;
+    }
+    if (gena_state_update(state, broken, sizeof(broken) - 1) ||
+        gena_state_update(state, "<root/>", 7))
+    {
+        fputs("test_state: broken event parsed\n", stderr);
+        goto out;
+    }
+    body = gena_state_body(state, &len);
+    if (len != sizeof(expected) - 1 || memcmp(body, expected, len) != 0)
+    {
+        fprintf(stderr, "test_state: merged body missmatched: %s\n", body);
+        goto out;
+    }
+    /* The body is itself an event giving the same state */
+    if (!gena_state_update(copy, body, len))
+    {
+        fputs("test_state: merged body not parsed\n", stderr);
+        goto out;
+    }
+    body2 = gena_state_body(copy, &len2);
+    ret = len == len2 && memcmp(body, body2, len) == 0;
+    if (!ret)
+    {
+        fputs("test_state: merged body changed\n", stderr);
+    }
+
+ out:
+    free(body);
+    free(body2);
+    gena_state_free(state);
+    gena_state_free(copy);
+    return ret;
+}
+
+/* What gena_t asked of the daemon, see test_relay */
+typedef struct
+{
+    unsigned int subscribes, unsubscribes, events, connects, conns;
+    uint32_t watch_id;
+    bool local;
+    char* path;
+    char* callback;
+    char* msg;
+    gena_done_t done;
+    void* done_userdata;
+} relay_t;
+
+static void relay_subscribe(void* userdata, void* link, uint32_t service_id,
+                            uint32_t watch_id, const char* path)
+{
+    relay_t* relay = userdata;
+    ++relay->subscribes;
+    relay->watch_id = watch_id;
+    free(relay->path);
+    relay->path = strdup(path);
+}
+
+static void relay_unsubscribe(void* userdata, void* link, uint32_t watch_id,
+                              bool local)
+{
+    relay_t* relay = userdata;
+    ++relay->unsubscribes;
+    relay->watch_id = watch_id;
+    relay->local = local;
+}
+
+static void relay_event(void* userdata, void* link, uint32_t watch_id,
+                        const char* body, size_t len)
+{
+    relay_t* relay = userdata;
+    ++relay->events;
+    relay->watch_id = watch_id;
+}
+
+static void* relay_connect(void* userdata, const struct sockaddr* addr,
+                           socklen_t addrlen)
+{
+    relay_t* relay = userdata;
+    ++relay->connects;
+    ++relay->conns;
+    return relay;
+}
+
+static char* relay_callback(void* userdata, void* conn, const char* path)
+{
+    relay_t* relay = userdata;
+    free(relay->callback);
+    relay->callback = strdup(path);
+    return strdup("http://127.0.0.1:4711/cb");
+}
+
+static void relay_send(void* userdata, void* conn, char* msg, size_t len,
+                       gena_done_t done, void* done_userdata)
+{
+    relay_t* relay = userdata;
+    free(relay->msg);
+    relay->msg = msg;
+    relay->done = done;
+    relay->done_userdata = done_userdata;
+}
+
+static void relay_cancel(void* userdata, void* conn)
+{
+    relay_t* relay = userdata;
+    --relay->conns;
+}
+
+/* Answer the last request sent */
+static void relay_done(relay_t* relay, const gena_response_t* resp)
+{
+    gena_done_t done = relay->done;
+    relay->done = NULL;
+    --relay->conns;
+    if (done != NULL)
+    {
+        done(relay->done_userdata, resp);
+    }
+}
+
+bool test_relay(void)
+{
+    static const char subscribe[] =
+        "SUBSCRIBE /upnpproxy-1/evt HTTP/1.1\r\n"
+        "CALLBACK: <http://127.0.0.1:49152/cb>\r\n"
+        "NT: upnp:event\r\n"
+        "\r\n";
+    static const char event[] =
+        "<e:propertyset xmlns:e=\"urn:schemas-upnp-org:event-1-0\">"
+        "<e:property><Volume>7</Volume></e:property></e:propertyset>";
+    static const gena_ops_t ops = {
+        relay_subscribe, relay_unsubscribe, relay_event, relay_connect,
+        relay_callback, relay_send, relay_cancel
+    };
+    relay_t relay;
+    log_t log = log_open();
+    timers_t timers = timers_new();
+    gena_t gena;
+    gena_request_t req;
+    gena_response_t resp;
+    struct sockaddr* addr = NULL;
+    socklen_t addrlen;
+    char* msg = NULL;
+    size_t len;
+    int link, service;
+    bool ret = false;
+    memset(&relay, 0, sizeof(relay));
+    gena = gena_new(log, timers, "uuid:test", &ops, &relay);
+
+    /* A client subscribes, the server is asked for the events */
+    if (gena_parse_request(subscribe, sizeof(subscribe) - 1, &req) != 1)
+    {
+        fputs("test_relay: subscribe not parsed\n", stderr);
+        goto out;
+    }
+    msg = gena_client_request(gena, &link, &service, 1, "/evt", &req, &len);
+    gena_request_free(&req);
+    if (msg == NULL || gena_parse_response(msg, len, &resp) != 1 ||
+        resp.status != 200 || resp.sid == NULL ||
+        relay.subscribes != 1 || !streq(relay.path, "/evt"))
+    {
+        fputs("test_relay: client not subscribed\n", stderr);
+        goto out;
+    }
+    /* The event from the server goes to the client */
+    if (!gena_link_event(gena, &link, relay.watch_id, event, 10, false) ||
+        !gena_link_event(gena, &link, relay.watch_id, event + 10,
+                         sizeof(event) - 11, true) ||
+        relay.connects != 1 || relay.msg == NULL ||
+        strncmp(relay.msg, "NOTIFY /cb HTTP/1.1\r\n", 21) != 0 ||
+        strstr(relay.msg, resp.sid) == NULL ||
+        strstr(relay.msg, "<Volume>7</Volume>") == NULL)
+    {
+        fputs("test_relay: event not relayed\n", stderr);
+        gena_response_free(&resp);
+        goto out;
+    }
+    gena_response_free(&resp);
+    relay_done(&relay, NULL);
+    /* The last client leaving drops the watch at the server */
+    gena_drop_service(gena, &service);
+    if (relay.unsubscribes != 1 || !relay.local)
+    {
+        fputs("test_relay: watch not dropped\n", stderr);
+        goto out;
+    }
+
+    /* A server subscribes, the service is asked for the events */
+    addr = parse_addr("127.0.0.1", 8200, &addrlen, false);
+    gena_link_subscribe(gena, &link, 7, addr, addrlen, "/evt");
+    if (relay.conns != 1 || relay.callback == NULL ||
+        strncmp(relay.msg, "SUBSCRIBE /evt HTTP/1.1\r\n", 25) != 0)
+    {
+        fputs("test_relay: service not subscribed\n", stderr);
+        goto out;
+    }
+    memset(&resp, 0, sizeof(resp));
+    resp.status = 200;
+    resp.sid = "uuid:service";
+    resp.timeout = 300;
+    relay_done(&relay, &resp);
+    free(msg);
+    msg = gena_notify(relay.callback, "127.0.0.1:4711", "uuid:service", 0,
+                      event, sizeof(event) - 1, &len);
+    if (gena_parse_request(msg, len, &req) != 1)
+    {
+        fputs("test_relay: notify not parsed\n", stderr);
+        goto out;
+    }
+    ret = streq(gena_service_notify(gena, &req, msg + req.headlen,
+                                    req.content_length), "200 OK") &&
+        relay.events == 1 && relay.watch_id == 7;
+    gena_request_free(&req);
+    if (!ret)
+    {
+        fputs("test_relay: event not sent to the server\n", stderr);
+        goto out;
+    }
+    /* Gone with the link, the service is told */
+    gena_drop_link(gena, &link, false);
+    ret = relay.conns == 1 &&
+        strncmp(relay.msg, "UNSUBSCRIBE /evt HTTP/1.1\r\n", 27) == 0;
+    if (!ret)
+    {
+        fputs("test_relay: service not unsubscribed\n", stderr);
+    }
+    relay_done(&relay, NULL);
+
+ out:
+    gena_free(gena);
+    if (relay.conns != 0)
+    {
+        fputs("test_relay: connections left\n", stderr);
+        ret = false;
+    }
+    free(relay.path);
+    free(relay.callback);
+    free(relay.msg);
+    free(addr);
+    free(msg);
+    timers_free(timers);
+    log_close(log);
+    return ret;
+}
@@ -38,6 +38,8 @@
 
 static bool test_sanity(void);
 static bool test_resize(void);
+static bool test_collide(void);
+static bool test_wrap(void);
 
 int main(int argc, char** argv)
 {
@@ -45,6 +47,8 @@ int main(int argc, char** argv)
 
     RUN_TEST(test_sanity());
     RUN_TEST(test_resize());
+    RUN_TEST(test_collide());
+    RUN_TEST(test_wrap());
 
     fprintf(stdout, "OK %u/%u\n", cnt, tot);
 
@@ -310,9 +314,10 @@ bool test_resize(void)
         map_remove(map, &cptr);
     }
 
-    if (map_size(map) == 0)
+    if (map_size(map) != 0)
     {
-        fprintf(stderr, "test_resize: map_size != 0\n");
+        fprintf(stderr, "test_resize: map_size should have returned 0, not %lu\n",
+                map_size(map));
         map_free(map);
         return false;
     }
@@ -320,3 +325,159 @@ bool test_resize(void)
     map_free(map);
     return true;
 }
+
+static uint32_t collide_hash(const void* element)
+{
+    /* Only a few different hashes so everything ends up in long chains */
+    return *((const unsigned int*)element) % 3;
+}
+
+static bool collide_eq(const void* e1, const void* e2)
+{
+    return *((const unsigned int*)e1) == *((const unsigned int*)e2);
+}
+
+bool test_collide(void)
+{
+    const unsigned int count = 40;
+    map_t map;
+    unsigned int i, *ptr;
+    size_t idx;
+    map = map_new(sizeof(unsigned int), collide_hash, collide_eq, NULL);
+
+    for (i = 0; i < count; i++)
+    {
+        map_put(map, &i);
+    }
+
+    for (i = 0; i < count; i += 2)
+    {
+        if (map_remove(map, &i) != 1)
+        {
+            fprintf(stderr, "test_collide: map_remove(%u) should have removed one item\n",
+                    i);
+            map_free(map);
+            return false;
+        }
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        ptr = map_get(map, &i);
+        if ((i % 2) == 0 ? ptr != NULL : ptr == NULL)
+        {
+            fprintf(stderr, "test_collide: map_get(%u) %s have returned a result\n",
+                    i, (i % 2) == 0 ? "should not" : "should");
+            map_free(map);
+            return false;
+        }
+    }
+
+    /* Remove every other of the rest while iterating */
+    idx = map_begin(map);
+    while (idx != map_end(map))
+    {
+        ptr = map_getat(map, idx);
+        if ((*ptr % 4) == 1)
+        {
+            idx = map_removeat(map, idx);
+        }
+        else
+        {
+            idx = map_next(map, idx);
+        }
+    }
+
+    if (map_size(map) != count / 4)
+    {
+        fprintf(stderr,
+                "test_collide: map_size should have returned %u, not %lu\n",
+                count / 4, map_size(map));
+        map_free(map);
+        return false;
+    }
+
+    for (i = 3; i < count; i += 4)
+    {
+        if (map_get(map, &i) == NULL)
+        {
+            fprintf(stderr, "test_collide: map_get(%u) should have returned a result\n",
+                    i);
+            map_free(map);
+            return false;
+        }
+    }
+
+    map_free(map);
+    return true;
+}
+
+static uint32_t wrap_hash(const void* element)
+{
+    return *((const unsigned int*)element);
+}
+
+bool test_wrap(void)
+{
+    /* The map starts out with 64 slots, so 126, 127 and 190 wrap around
+     * the end of the table into slot 0, 1 and 2 */
+    static const unsigned int values[] = { 10, 62, 63, 126, 127, 190, 0 };
+    const size_t count = sizeof(values) / sizeof(values[0]);
+    unsigned int visits[sizeof(values) / sizeof(values[0])];
+    map_t map;
+    unsigned int* ptr;
+    size_t i, idx;
+    map = map_new(sizeof(unsigned int), wrap_hash, collide_eq, NULL);
+
+    for (i = 0; i < count; i++)
+    {
+        map_put(map, values + i);
+        visits[i] = 0;
+    }
+
+    /* Removing 62 and 63 moves the wrapped ones back to the end of the
+     * table, they must not be visited again there */
+    idx = map_begin(map);
+    while (idx != map_end(map))
+    {
+        ptr = map_getat(map, idx);
+        for (i = 0; i < count; i++)
+        {
+            if (values[i] == *ptr)
+            {
+                visits[i]++;
+                break;
+            }
+        }
+        if (*ptr < 64)
+        {
+            idx = map_removeat(map, idx);
+        }
+        else
+        {
+            idx = map_next(map, idx);
+        }
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        if (visits[i] != 1)
+        {
+            fprintf(stderr, "test_wrap: %u visited %u times\n", values[i],
+                    visits[i]);
+            map_free(map);
+            return false;
+        }
+        ptr = map_get(map, values + i);
+        if (values[i] < 64 ? ptr != NULL : ptr == NULL)
+        {
+            fprintf(stderr, "test_wrap: map_get(%u) %s have returned a result\n",
+                    values[i], values[i] < 64 ? "should not" : "should");
+            map_free(map);
+            return false;
+        }
+    }
+
+    map_free(map);
+    return true;
+}
@@ -0,0 +1,340 @@
+/*
+ * Copyright (C) 2011, Joel Klinghed.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the project nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE PROJECT AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE PROJECT OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "common.h"
+
+#include "outq.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define RUN_TEST(_test) \
+    ++tot; cnt += _test ? 1 : 0
+
+static bool test1(size_t block, size_t chunk, size_t consume);
+static bool test2(void);
+static bool test3(void);
+static bool test4(void);
+static bool test5(void);
+
+int main(int argc, char** argv)
+{
+    unsigned int tot = 0, cnt = 0;
+
+    RUN_TEST(test1(64, 1, 7));
+    RUN_TEST(test1(64, 10, 3));
+    RUN_TEST(test1(64, 63, 50));
+    RUN_TEST(test1(100, 33, 100));
+    RUN_TEST(test1(16, 40, 17));
+
+    RUN_TEST(test2());
+
+    RUN_TEST(test3());
+
+    RUN_TEST(test4());
+
+    RUN_TEST(test5());
+
+    fprintf(stdout, "OK %u/%u\n", cnt, tot);
+
+    return cnt == tot ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* Read and consume at most max bytes from the queue using outq_iov */
+static size_t drain(outq_t outq, char* data, size_t max)
+{
+    struct iovec iov[4];
+    size_t done = 0;
+    int i, cnt = outq_iov(outq, iov, 4);
+    for (i = 0; i < cnt && done < max; ++i)
+    {
+        size_t len = iov[i].iov_len;
+        if (len > max - done)
+        {
+            len = max - done;
+        }
+        memcpy(data + done, iov[i].iov_base, len);
+        done += len;
+    }
+    outq_consume(outq, done);
+    return done;
+}
+
+/* Write a counting sequence, chunk bytes at the time, alternating between
+ * outq_write and outq_wbuf and draining consume bytes after each write.
+ * Checks that the data comes out in order */
+static bool test1(size_t block, size_t chunk, size_t consume)
+{
+    outq_t outq = outq_new(block, 0, 1);
+    const size_t total = 5000;
+    char* tmp = malloc(chunk > consume ? chunk : consume);
+    size_t wrote = 0, read = 0, i;
+    bool ok = true;
+
+    while (ok && read < total)
+    {
+        if (wrote < total)
+        {
+            size_t len = total - wrote < chunk ? total - wrote : chunk;
+            for (i = 0; i < len; ++i)
+            {
+                tmp[i] = (char)(wrote + i);
+            }
+            if ((wrote / chunk) % 2 == 0)
+            {
+                outq_write(outq, 0, tmp, len);
+            }
+            else
+            {
+                buf_t buf = outq_wbuf(outq, 0, len);
+                size_t avail;
+                char* ptr = buf_wptr(buf, &avail);
+                if (avail < len)
+                {
+                    fprintf(stderr, "test1:%lu:%lu:%lu: outq_wbuf(%lu) "
+                            "only has %lu continuous bytes\n",
+                            block, chunk, consume, len, avail);
+                    ok = false;
+                    break;
+                }
+                memcpy(ptr, tmp, len);
+                buf_wmove(buf, len);
+                outq_wrote(outq, 0, len);
+            }
+            wrote += len;
+        }
+        if (outq_size(outq) != wrote - read)
+        {
+            fprintf(stderr, "test1:%lu:%lu:%lu: outq_size %lu expected %lu\n",
+                    block, chunk, consume, outq_size(outq), wrote - read);
+            ok = false;
+            break;
+        }
+        {
+            size_t got = drain(outq, tmp, consume);
+            for (i = 0; i < got; ++i)
+            {
+                if (tmp[i] != (char)(read + i))
+                {
+                    fprintf(stderr, "test1:%lu:%lu:%lu: byte %lu is wrong\n",
+                            block, chunk, consume, read + i);
+                    ok = false;
+                    break;
+                }
+            }
+            read += got;
+        }
+    }
+
+    if (ok && !outq_empty(outq))
+    {
+        fprintf(stderr, "test1:%lu:%lu:%lu: queue not empty at end\n",
+                block, chunk, consume);
+        ok = false;
+    }
+
+    free(tmp);
+    outq_free(outq);
+    return ok;
+}
+
+/* Writes larger than the block size get a block of their own */
+static bool test2(void)
+{
+    outq_t outq = outq_new(32, 0, 1);
+    struct iovec iov[4];
+    buf_t buf;
+    size_t avail;
+    int cnt;
+
+    outq_write(outq, 0, "abc", 3);
+    buf = outq_wbuf(outq, 0, 100);
+    buf_wptr(buf, &avail);
+    if (avail < 100)
+    {
+        fprintf(stderr, "test2: outq_wbuf(100) only has %lu bytes\n", avail);
+        outq_free(outq);
+        return false;
+    }
+    memset(buf_wptr(buf, &avail), 'x', 100);
+    buf_wmove(buf, 100);
+    outq_wrote(outq, 0, 100);
+
+    cnt = outq_iov(outq, iov, 4);
+    if (cnt != 2 || iov[0].iov_len != 3 || iov[1].iov_len != 100 ||
+        memcmp(iov[0].iov_base, "abc", 3) != 0)
+    {
+        fprintf(stderr, "test2: unexpected iovecs\n");
+        outq_free(outq);
+        return false;
+    }
+    outq_consume(outq, 50);
+    cnt = outq_iov(outq, iov, 4);
+    if (cnt != 1 || iov[0].iov_len != 53 || outq_size(outq) != 53)
+    {
+        fprintf(stderr, "test2: unexpected iovecs after consume\n");
+        outq_free(outq);
+        return false;
+    }
+    outq_clear(outq);
+    if (!outq_empty(outq) || outq_iov(outq, iov, 4) != 0)
+    {
+        fprintf(stderr, "test2: not empty after clear\n");
+        outq_free(outq);
+        return false;
+    }
+    outq_free(outq);
+    return true;
+}
+
+static bool test3(void)
+{
+    outq_t outq = outq_new(64, 100, 1);
+    char tmp[60];
+    memset(tmp, 0, sizeof(tmp));
+
+    outq_write(outq, 0, tmp, 60);
+    if (outq_full(outq) || outq_drained(outq))
+    {
+        fprintf(stderr, "test3: 60 bytes queued, expected neither full "
+                "nor drained\n");
+        outq_free(outq);
+        return false;
+    }
+    outq_write(outq, 0, tmp, 60);
+    if (!outq_full(outq))
+    {
+        fprintf(stderr, "test3: 120 bytes queued, expected full\n");
+        outq_free(outq);
+        return false;
+    }
+    outq_consume(outq, 80);
+    if (outq_full(outq) || !outq_drained(outq))
+    {
+        fprintf(stderr, "test3: 40 bytes queued, expected drained\n");
+        outq_free(outq);
+        return false;
+    }
+    outq_set_high_water(outq, 0);
+    outq_write(outq, 0, tmp, 60);
+    outq_write(outq, 0, tmp, 60);
+    if (outq_full(outq))
+    {
+        fprintf(stderr, "test3: no high water, expected never full\n");
+        outq_free(outq);
+        return false;
+    }
+    outq_free(outq);
+    return true;
+}
+
+/* Lower classes go first, but never in the middle of a record */
+static bool test4(void)
+{
+    outq_t outq = outq_new(16, 0, 3);
+    char tmp[64];
+    size_t got;
+
+    outq_write(outq, 2, "AAAAAAAAAA", 10);
+    outq_write(outq, 2, "BBBBB", 5);
+    got = drain(outq, tmp, 4);
+    outq_write(outq, 2, "CC", 2);
+    outq_write(outq, 1, "SS", 2);
+    outq_write(outq, 0, "TTT", 3);
+    got += drain(outq, tmp + got, sizeof(tmp) - got);
+    if (got != 22 || memcmp(tmp, "AAAAAAAAAATTTSSBBBBBCC", 22) != 0)
+    {
+        fprintf(stderr, "test4: got %.*s\n", (int)got, tmp);
+        outq_free(outq);
+        return false;
+    }
+    if (!outq_empty(outq))
+    {
+        fprintf(stderr, "test4: queue not empty at end\n");
+        outq_free(outq);
+        return false;
+    }
+    outq_free(outq);
+    return true;
+}
+
+/* Bytes sent after a tunnel package is queued behind a resync of the given
+ * number of services until it is sent, with a link that takes 1000 bytes
+ * per tick */
+static size_t tunnel_latency(size_t services)
+{
+    outq_t outq = outq_new(4096, 0, 3);
+    char service[275], tmp[1000];
+    size_t i, sent = 0, tunnel_sent = 0, queued_at = 0, tick;
+    memset(service, 'r', sizeof(service));
+    for (i = 0; i < services; ++i)
+    {
+        outq_write(outq, 2, service, sizeof(service));
+    }
+    for (tick = 0; tunnel_sent < 20 && !outq_empty(outq); ++tick)
+    {
+        size_t got;
+        if (tick == 3)
+        {
+            outq_write(outq, 0, "TTTTTTTTTTTTTTTTTTTT", 20);
+            queued_at = sent;
+        }
+        got = drain(outq, tmp, sizeof(tmp));
+        for (i = 0; i < got && tunnel_sent < 20; ++i)
+        {
+            if (tmp[i] == 'T')
+            {
+                tunnel_sent++;
+            }
+            sent++;
+        }
+    }
+    outq_free(outq);
+    return sent - queued_at;
+}
+
+/* Tunnel setup latency does not depend on the size of the resync */
+static bool test5(void)
+{
+    size_t small = tunnel_latency(100);
+    size_t large = tunnel_latency(10000);
+    if (small != large)
+    {
+        fprintf(stderr, "test5: tunnel latency %lu bytes with 100 services "
+                "but %lu with 10000\n", small, large);
+        return false;
+    }
+    /* At most the rest of the service being sent and the tunnel itself */
+    if (large > 275 + 20)
+    {
+        fprintf(stderr, "test5: tunnel latency %lu bytes\n", large);
+        return false;
+    }
+    return true;
+}
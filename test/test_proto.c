@@ -30,20 +30,38 @@
 #include "common.h"
 
 #include "daemon_proto.h"
+#include "alloc_count.h"
 
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 
 #define RUN_TEST(_test) \
     ++tot; cnt += _test ? 1 : 0
 
 static bool test1(void);
+static bool test_token(void);
+static bool test_split(void);
+static bool test_alloc(void);
+static bool test_bench(void);
+static bool test_dict(void);
+static bool test_dict_copy(void);
+static bool test_old_fields(void);
+static bool test_events(void);
 
 int main(int argc, char** argv)
 {
     unsigned int tot = 0, cnt = 0;
 
     RUN_TEST(test1());
+    RUN_TEST(test_token());
+    RUN_TEST(test_split());
+    RUN_TEST(test_alloc());
+    RUN_TEST(test_bench());
+    RUN_TEST(test_dict());
+    RUN_TEST(test_dict_copy());
+    RUN_TEST(test_old_fields());
+    RUN_TEST(test_events());
 
     fprintf(stdout, "OK %u/%u\n", cnt, tot);
 
@@ -64,6 +82,16 @@ static const char* pkg_type_str(pkg_type_t type)
         return "setup_tunnel";
     case PKG_CLOSE_TUNNEL:
         return "close_tunnel";
+    case PKG_HELLO:
+        return "hello";
+    case PKG_SUBSCRIBE:
+        return "subscribe";
+    case PKG_UNSUBSCRIBE:
+        return "unsubscribe";
+    case PKG_EVENT:
+        return "event";
+    case PKG_RESTART_TUNNEL:
+        return "restart_tunnel";
     }
     return "[error]";
 }
@@ -71,6 +99,7 @@ static const char* pkg_type_str(pkg_type_t type)
 bool test1(void)
 {
     pkg_t pkg;
+    pkg_view_t view;
     char* usn, *location, *service, *server, *opt, *nls, *host;
     buf_t buf = buf_new(1024);
     size_t i;
@@ -108,7 +137,7 @@ bool test1(void)
         return false;
     }
     host = strdup("host");
-    pkg_create_tunnel(&pkg, 5678, 1212, host, 10026);
+    pkg_create_tunnel(&pkg, 5678, 1212, host, 10026, 1);
     if (!pkg_write(buf, &pkg))
     {
         fprintf(stderr, "test1: pkg4 did not fit\n");
@@ -135,7 +164,7 @@ bool test1(void)
 
     for (i = 0; i < 6; ++i)
     {
-        if (!pkg_peek(buf, &pkg))
+        if (!pkg_peek(buf, NULL, &view))
         {
             fprintf(stderr, "test1:pkg%lu: pkg_peek returned false\n",
                     i + 1);
@@ -145,19 +174,21 @@ bool test1(void)
         switch (i)
         {
         case 0:
-            if (pkg.type == PKG_NEW_SERVICE)
+            if (view.type == PKG_NEW_SERVICE)
             {
-                if (pkg.content.new_service.service_id != 1234 ||
-                    strcmp(pkg.content.new_service.usn, "usn") != 0 ||
-                    strcmp(pkg.content.new_service.location, "location") != 0 ||
-                    strcmp(pkg.content.new_service.service, "service") != 0 ||
-                    pkg.content.new_service.server != NULL ||
-                    pkg.content.new_service.opt != NULL ||
-                    pkg.content.new_service.nls != NULL)
+                if (view.content.new_service.service_id != 1234 ||
+                    !pkg_str_eq(&(view.content.new_service.usn), "usn") ||
+                    !pkg_str_eq(&(view.content.new_service.location),
+                                "location") ||
+                    !pkg_str_eq(&(view.content.new_service.service),
+                                "service") ||
+                    pkg_str_len(&(view.content.new_service.server)) != 0 ||
+                    pkg_str_len(&(view.content.new_service.opt)) != 0 ||
+                    pkg_str_len(&(view.content.new_service.nls)) != 0)
                 {
                     fprintf(stderr, "test1:pkg%lu: missmatched data\n",
                             i + 1);
-                    pkg_read(buf, &pkg);
+                    pkg_read(buf, &view);
                     buf_free(buf);
                     return false;
                 }
@@ -165,26 +196,29 @@ bool test1(void)
             else
             {
                 fprintf(stderr, "test1:pkg%lu: expected new_service got %s\n",
-                        i + 1, pkg_type_str(pkg.type));
-                pkg_read(buf, &pkg);
+                        i + 1, pkg_type_str(view.type));
+                pkg_read(buf, &view);
                 buf_free(buf);
                 return false;
             }
             break;
         case 1:
-            if (pkg.type == PKG_NEW_SERVICE)
+            if (view.type == PKG_NEW_SERVICE)
             {
-                if (pkg.content.new_service.service_id != 1235 ||
-                    strcmp(pkg.content.new_service.usn, "usn") != 0 ||
-                    strcmp(pkg.content.new_service.location, "location") != 0 ||
-                    strcmp(pkg.content.new_service.service, "service") != 0 ||
-                    strcmp(pkg.content.new_service.server, "server") != 0 ||
-                    strcmp(pkg.content.new_service.opt, "opt") != 0 ||
-                    strcmp(pkg.content.new_service.nls, "nls") != 0)
+                if (view.content.new_service.service_id != 1235 ||
+                    !pkg_str_eq(&(view.content.new_service.usn), "usn") ||
+                    !pkg_str_eq(&(view.content.new_service.location),
+                                "location") ||
+                    !pkg_str_eq(&(view.content.new_service.service),
+                                "service") ||
+                    !pkg_str_eq(&(view.content.new_service.server),
+                                "server") ||
+                    !pkg_str_eq(&(view.content.new_service.opt), "opt") ||
+                    !pkg_str_eq(&(view.content.new_service.nls), "nls"))
                 {
                     fprintf(stderr, "test1:pkg%lu: missmatched data\n",
                             i + 1);
-                    pkg_read(buf, &pkg);
+                    pkg_read(buf, &view);
                     buf_free(buf);
                     return false;
                 }
@@ -192,20 +226,20 @@ bool test1(void)
             else
             {
                 fprintf(stderr, "test1:pkg%lu: expected new_service got %s\n",
-                        i + 1, pkg_type_str(pkg.type));
-                pkg_read(buf, &pkg);
+                        i + 1, pkg_type_str(view.type));
+                pkg_read(buf, &view);
                 buf_free(buf);
                 return false;
             }
             break;
         case 2:
-            if (pkg.type == PKG_OLD_SERVICE)
+            if (view.type == PKG_OLD_SERVICE)
             {
-                if (pkg.content.old_service.service_id != 6666)
+                if (view.content.old_service.service_id != 6666)
                 {
                     fprintf(stderr, "test1:pkg%lu: missmatched data\n",
                             i + 1);
-                    pkg_read(buf, &pkg);
+                    pkg_read(buf, &view);
                     buf_free(buf);
                     return false;
                 }
@@ -213,23 +247,24 @@ bool test1(void)
             else
             {
                 fprintf(stderr, "test1:pkg%lu: expected old_service got %s\n",
-                        i + 1, pkg_type_str(pkg.type));
-                pkg_read(buf, &pkg);
+                        i + 1, pkg_type_str(view.type));
+                pkg_read(buf, &view);
                 buf_free(buf);
                 return false;
             }
             break;
         case 3:
-            if (pkg.type == PKG_CREATE_TUNNEL)
+            if (view.type == PKG_CREATE_TUNNEL)
             {
-                if (pkg.content.create_tunnel.service_id != 5678 ||
-                    pkg.content.create_tunnel.tunnel_id != 1212 ||
-                    strcmp(pkg.content.create_tunnel.host, "host") != 0 ||
-                    pkg.content.create_tunnel.port != 10026)
+                if (view.content.create_tunnel.service_id != 5678 ||
+                    view.content.create_tunnel.tunnel_id != 1212 ||
+                    !pkg_str_eq(&(view.content.create_tunnel.host), "host") ||
+                    view.content.create_tunnel.port != 10026 ||
+                    view.content.create_tunnel.compress != 1)
                 {
                     fprintf(stderr, "test1:pkg%lu: missmatched data\n",
                             i + 1);
-                    pkg_read(buf, &pkg);
+                    pkg_read(buf, &view);
                     buf_free(buf);
                     return false;
                 }
@@ -237,22 +272,22 @@ bool test1(void)
             else
             {
                 fprintf(stderr, "test1:pkg%lu: expected create_tunnel got %s\n",
-                        i + 1, pkg_type_str(pkg.type));
-                pkg_read(buf, &pkg);
+                        i + 1, pkg_type_str(view.type));
+                pkg_read(buf, &view);
                 buf_free(buf);
                 return false;
             }
             break;
         case 4:
-            if (pkg.type == PKG_SETUP_TUNNEL)
+            if (view.type == PKG_SETUP_TUNNEL)
             {
-                if (pkg.content.setup_tunnel.tunnel_id != 2525 ||
-                    !pkg.content.setup_tunnel.ok ||
-                    pkg.content.setup_tunnel.port != 26100)
+                if (view.content.setup_tunnel.tunnel_id != 2525 ||
+                    !view.content.setup_tunnel.ok ||
+                    view.content.setup_tunnel.port != 26100)
                 {
                     fprintf(stderr, "test1:pkg%lu: missmatched data\n",
                             i + 1);
-                    pkg_read(buf, &pkg);
+                    pkg_read(buf, &view);
                     buf_free(buf);
                     return false;
                 }
@@ -260,21 +295,21 @@ bool test1(void)
             else
             {
                 fprintf(stderr, "test1:pkg%lu: expected setup_tunnel got %s\n",
-                        i + 1, pkg_type_str(pkg.type));
-                pkg_read(buf, &pkg);
+                        i + 1, pkg_type_str(view.type));
+                pkg_read(buf, &view);
                 buf_free(buf);
                 return false;
             }
             break;
         case 5:
-            if (pkg.type == PKG_CLOSE_TUNNEL)
+            if (view.type == PKG_CLOSE_TUNNEL)
             {
-                if (pkg.content.close_tunnel.tunnel_id != 2424 ||
-                    !pkg.content.close_tunnel.local)
+                if (view.content.close_tunnel.tunnel_id != 2424 ||
+                    !view.content.close_tunnel.local)
                 {
                     fprintf(stderr, "test1:pkg%lu: missmatched data\n",
                             i + 1);
-                    pkg_read(buf, &pkg);
+                    pkg_read(buf, &view);
                     buf_free(buf);
                     return false;
                 }
@@ -282,14 +317,14 @@ bool test1(void)
             else
             {
                 fprintf(stderr, "test1:pkg%lu: expected close_tunnel got %s\n",
-                        i + 1, pkg_type_str(pkg.type));
-                pkg_read(buf, &pkg);
+                        i + 1, pkg_type_str(view.type));
+                pkg_read(buf, &view);
                 buf_free(buf);
                 return false;
             }
             break;
         }
-        pkg_read(buf, &pkg);
+        pkg_read(buf, &view);
     }
 
     if (buf_ravail(buf) != 0)
@@ -303,3 +338,713 @@ bool test1(void)
     buf_free(buf);
     return true;
 }
+
+bool test_token(void)
+{
+    pkg_tunnel_token_t token, token2;
+    char data[PKG_TUNNEL_TOKEN_SIZE];
+    token.server_port = 24234;
+    token.tunnel_id = 0x80402010;
+    token.local = true;
+    pkg_tunnel_token_write(data, &token);
+    if (!pkg_tunnel_token_read(data, &token2))
+    {
+        fprintf(stderr, "test_token: valid token not accepted\n");
+        return false;
+    }
+    if (token2.server_port != token.server_port ||
+        token2.tunnel_id != token.tunnel_id ||
+        token2.local != token.local)
+    {
+        fprintf(stderr, "test_token: missmatched data\n");
+        return false;
+    }
+    memcpy(data, "GET / HT", PKG_TUNNEL_TOKEN_SIZE);
+    if (pkg_tunnel_token_read(data, &token2))
+    {
+        fprintf(stderr, "test_token: invalid token accepted\n");
+        return false;
+    }
+    return true;
+}
+
+/* Number of packages written by write_all */
+#define ALL_PKGS (9)
+
+/* Write a package of each type into buf */
+static bool write_all(buf_t buf)
+{
+    pkg_t pkg;
+    pkg_new_service(&pkg, 1235, "uuid:1234::upnp:rootdevice",
+                    "http://192.168.0.2:49152/desc.xml", "upnp:rootdevice",
+                    "Linux UPnP/1.0", NULL, "nls");
+    if (!pkg_write(buf, &pkg))
+        return false;
+    pkg_old_service(&pkg, 6666);
+    if (!pkg_write(buf, &pkg))
+        return false;
+    pkg_create_tunnel(&pkg, 5678, 1212, "192.168.0.3:1900", 10026, 0);
+    if (!pkg_write(buf, &pkg))
+        return false;
+    pkg_setup_tunnel(&pkg, 2525, true, 26100);
+    if (!pkg_write(buf, &pkg))
+        return false;
+    pkg_close_tunnel(&pkg, 2424, true);
+    if (!pkg_write(buf, &pkg))
+        return false;
+    pkg_subscribe(&pkg, 1235, 77, "/evt/1");
+    if (!pkg_write(buf, &pkg))
+        return false;
+    pkg_unsubscribe(&pkg, 78, false);
+    if (!pkg_write(buf, &pkg))
+        return false;
+    pkg_event(&pkg, 77, true, "<e:propertyset/>", 16);
+    if (!pkg_write(buf, &pkg))
+        return false;
+    pkg_restart_tunnel(&pkg, 2323, false);
+    return pkg_write(buf, &pkg);
+}
+
+/* Check what write_all wrote, returns the number of packages that matched */
+static size_t check_all(buf_t buf, bool* split)
+{
+    pkg_view_t view;
+    size_t i;
+    for (i = 0; i < ALL_PKGS; ++i)
+    {
+        if (!pkg_peek(buf, NULL, &view))
+        {
+            return i;
+        }
+        switch (view.type)
+        {
+        case PKG_NEW_SERVICE:
+            if (i != 0 ||
+                view.content.new_service.service_id != 1235 ||
+                !pkg_str_eq(&(view.content.new_service.usn),
+                            "uuid:1234::upnp:rootdevice") ||
+                !pkg_str_eq(&(view.content.new_service.location),
+                            "http://192.168.0.2:49152/desc.xml") ||
+                !pkg_str_eq(&(view.content.new_service.service),
+                            "upnp:rootdevice") ||
+                !pkg_str_eq(&(view.content.new_service.server),
+                            "Linux UPnP/1.0") ||
+                pkg_str_len(&(view.content.new_service.opt)) != 0 ||
+                !pkg_str_eq(&(view.content.new_service.nls), "nls"))
+            {
+                return i;
+            }
+            if (view.content.new_service.usn.len[1] > 0 ||
+                view.content.new_service.location.len[1] > 0 ||
+                view.content.new_service.service.len[1] > 0 ||
+                view.content.new_service.server.len[1] > 0)
+            {
+                *split = true;
+            }
+            break;
+        case PKG_OLD_SERVICE:
+            if (i != 1 || view.content.old_service.service_id != 6666)
+            {
+                return i;
+            }
+            break;
+        case PKG_CREATE_TUNNEL:
+            if (i != 2 ||
+                view.content.create_tunnel.service_id != 5678 ||
+                view.content.create_tunnel.tunnel_id != 1212 ||
+                !pkg_str_eq(&(view.content.create_tunnel.host),
+                            "192.168.0.3:1900") ||
+                view.content.create_tunnel.port != 10026 ||
+                view.content.create_tunnel.compress != 0)
+            {
+                return i;
+            }
+            if (view.content.create_tunnel.host.len[1] > 0)
+            {
+                *split = true;
+            }
+            break;
+        case PKG_SETUP_TUNNEL:
+            if (i != 3 ||
+                view.content.setup_tunnel.tunnel_id != 2525 ||
+                !view.content.setup_tunnel.ok ||
+                view.content.setup_tunnel.port != 26100)
+            {
+                return i;
+            }
+            break;
+        case PKG_CLOSE_TUNNEL:
+            if (i != 4 ||
+                view.content.close_tunnel.tunnel_id != 2424 ||
+                !view.content.close_tunnel.local)
+            {
+                return i;
+            }
+            break;
+        case PKG_SUBSCRIBE:
+            if (i != 5 ||
+                view.content.subscribe.service_id != 1235 ||
+                view.content.subscribe.watch_id != 77 ||
+                !pkg_str_eq(&(view.content.subscribe.path), "/evt/1"))
+            {
+                return i;
+            }
+            if (view.content.subscribe.path.len[1] > 0)
+            {
+                *split = true;
+            }
+            break;
+        case PKG_UNSUBSCRIBE:
+            if (i != 6 ||
+                view.content.unsubscribe.watch_id != 78 ||
+                view.content.unsubscribe.local)
+            {
+                return i;
+            }
+            break;
+        case PKG_EVENT:
+            if (i != 7 ||
+                view.content.event.watch_id != 77 ||
+                !view.content.event.last ||
+                !pkg_str_eq(&(view.content.event.data), "<e:propertyset/>"))
+            {
+                return i;
+            }
+            if (view.content.event.data.len[1] > 0)
+            {
+                *split = true;
+            }
+            break;
+        case PKG_RESTART_TUNNEL:
+            if (i != 8 ||
+                view.content.restart_tunnel.tunnel_id != 2323 ||
+                view.content.restart_tunnel.local)
+            {
+                return i;
+            }
+            break;
+        case PKG_HELLO:
+            return i;
+        }
+        pkg_read(buf, &view);
+    }
+    return i;
+}
+
+/* Packages wrapping around the end of the buffer, at every possible
+ * position. One byte of fill is kept while writing, as the buffer starts
+ * over from the beginning when empty */
+bool test_split(void)
+{
+    const size_t size = 512;
+    buf_t buf = buf_new(size);
+    bool split = false;
+    size_t offset;
+    char fill[512];
+    memset(fill, 0, sizeof(fill));
+    for (offset = 0; offset < size - 1; ++offset)
+    {
+        size_t got;
+        buf_write(buf, fill, offset + 1);
+        buf_skip(buf, offset);
+        if (!write_all(buf))
+        {
+            fprintf(stderr, "test_split: packages did not fit\n");
+            buf_free(buf);
+            return false;
+        }
+        buf_skip(buf, 1);
+        got = check_all(buf, &split);
+        if (got != ALL_PKGS)
+        {
+            fprintf(stderr, "test_split:%lu: pkg%lu missmatched\n",
+                    (unsigned long)offset, (unsigned long)got + 1);
+            buf_free(buf);
+            return false;
+        }
+        if (buf_ravail(buf) != 0)
+        {
+            fprintf(stderr, "test_split:%lu: %lu bytes left in buffer\n",
+                    (unsigned long)offset, (unsigned long)buf_ravail(buf));
+            buf_free(buf);
+            return false;
+        }
+    }
+    buf_free(buf);
+    if (!split)
+    {
+        fprintf(stderr, "test_split: no string was split\n");
+        return false;
+    }
+    return true;
+}
+
+/* Decoding must not allocate, neither contiguous nor split packages */
+bool test_alloc(void)
+{
+    buf_t buf = buf_new(512);
+    char fill[400];
+    unsigned long before;
+    bool split = false;
+    size_t got;
+    if (!alloc_count_available())
+    {
+        buf_free(buf);
+        return true;
+    }
+    write_all(buf);
+    before = alloc_count();
+    got = check_all(buf, &split);
+    if (got != ALL_PKGS || alloc_count() != before)
+    {
+        fprintf(stderr, "test_alloc: %lu allocations decoding %lu packages\n",
+                alloc_count() - before, (unsigned long)got);
+        buf_free(buf);
+        return false;
+    }
+    memset(fill, 0, sizeof(fill));
+    buf_write(buf, fill, sizeof(fill));
+    buf_skip(buf, sizeof(fill) - 1);
+    write_all(buf);
+    buf_skip(buf, 1);
+    before = alloc_count();
+    got = check_all(buf, &split);
+    buf_free(buf);
+    if (got != ALL_PKGS || alloc_count() != before || !split)
+    {
+        fprintf(stderr, "test_alloc: %lu allocations decoding %lu split "
+                "packages\n", alloc_count() - before, (unsigned long)got);
+        return false;
+    }
+    return true;
+}
+
+/* Decode throughput, same size of buffer as the daemon uses */
+bool test_bench(void)
+{
+    const unsigned int rounds = 20000;
+    buf_t buf = buf_new(1024);
+    unsigned long pkgs = 0, allocs = 0, bytes = 0;
+    clock_t total = 0;
+    unsigned int i;
+    double secs;
+    for (i = 0; i < rounds; ++i)
+    {
+        pkg_view_t view;
+        clock_t start;
+        unsigned long before;
+        while (write_all(buf))
+        {
+        }
+        bytes += buf_ravail(buf);
+        before = alloc_count();
+        start = clock();
+        while (pkg_peek(buf, NULL, &view))
+        {
+            pkg_read(buf, &view);
+            ++pkgs;
+        }
+        total += clock() - start;
+        allocs += alloc_count() - before;
+        /* Drop any half written package */
+        buf_skip(buf, buf_ravail(buf));
+    }
+    buf_free(buf);
+    if (alloc_count_available() && allocs > 0)
+    {
+        fprintf(stderr, "test_bench: %lu allocations decoding %lu packages\n",
+                allocs, pkgs);
+        return false;
+    }
+    secs = (double)total / CLOCKS_PER_SEC;
+    if (secs > 0.0)
+    {
+        fprintf(stdout, "test_bench: %lu packages (%lu bytes) in %.3f s, "
+                "%.1f Mpkg/s %.1f MB/s\n", pkgs, bytes, secs,
+                pkgs / secs / 1e6, bytes / secs / 1e6);
+    }
+    return true;
+}
+
+/* Services of a typical network, DEVICES media servers each announcing
+ * DEVICE_SERVICES services */
+#define DEVICES (20)
+#define DEVICE_SERVICES (6)
+
+static void make_service(pkg_t* pkg, unsigned int i, char* usn,
+                         char* location, char* service)
+{
+    static const char* const nt[DEVICE_SERVICES] = {
+        "upnp:rootdevice",
+        NULL,
+        "urn:schemas-upnp-org:device:MediaServer:1",
+        "urn:schemas-upnp-org:service:ContentDirectory:1",
+        "urn:schemas-upnp-org:service:ConnectionManager:1",
+        "urn:microsoft.com:service:X_MS_MediaReceiverRegistrar:1",
+    };
+    unsigned int dev = i / DEVICE_SERVICES, srv = i % DEVICE_SERVICES;
+    if (nt[srv] == NULL)
+    {
+        sprintf(service, "uuid:4d696e69-444c-164e-9d41-%012u", dev);
+        strcpy(usn, service);
+    }
+    else
+    {
+        strcpy(service, nt[srv]);
+        sprintf(usn, "uuid:4d696e69-444c-164e-9d41-%012u::%s", dev, nt[srv]);
+    }
+    sprintf(location, "http://192.168.1.%u:8200/rootDesc.xml", 10 + dev);
+    pkg_new_service(pkg, 1000 + i, usn, location, service,
+                    "Linux/3.14 DLNADOC/1.50 UPnP/1.0 MiniDLNA/1.1.5",
+                    NULL, i % 2 ? "d1a6b7e8-0000-1000-8000-000000000001" : NULL);
+}
+
+static bool view_eq(const pkg_view_t* view, const pkg_t* pkg)
+{
+    return view->type == PKG_NEW_SERVICE &&
+        view->content.new_service.service_id ==
+        pkg->content.new_service.service_id &&
+        pkg_str_eq(&(view->content.new_service.usn),
+                   pkg->content.new_service.usn) &&
+        pkg_str_eq(&(view->content.new_service.location),
+                   pkg->content.new_service.location) &&
+        pkg_str_eq(&(view->content.new_service.service),
+                   pkg->content.new_service.service) &&
+        pkg_str_eq(&(view->content.new_service.server),
+                   pkg->content.new_service.server) &&
+        pkg_str_eq(&(view->content.new_service.opt),
+                   pkg->content.new_service.opt) &&
+        pkg_str_eq(&(view->content.new_service.nls),
+                   pkg->content.new_service.nls);
+}
+
+/* Compact encoding of a full service sync: read back the same, and
+ * much smaller. Goes through a small buffer so that packages wrap */
+bool test_dict(void)
+{
+    buf_t buf = buf_new(512), buf2 = buf_new(512);
+    pkg_dict_t out = pkg_dict_new(), in = pkg_dict_new();
+    size_t v1 = 0, v2 = 0;
+    unsigned long before;
+    unsigned int i;
+    char usn[128], location[128], service[128];
+    pkg_t pkg;
+    pkg_view_t view;
+    bool ret = false;
+
+    pkg_hello(&pkg, PKG_VERSION, 5);
+    if (pkg_write_dict(buf, &pkg, out, 0) != pkg_size(&pkg) ||
+        !pkg_peek(buf, in, &view) || view.type != PKG_HELLO ||
+        view.content.hello.version != PKG_VERSION ||
+        view.content.hello.compress != 5)
+    {
+        fprintf(stderr, "test_dict: hello missmatched\n");
+        goto out;
+    }
+    pkg_read(buf, &view);
+
+    for (i = 0; i < DEVICES * DEVICE_SERVICES; ++i)
+    {
+        size_t size;
+        make_service(&pkg, i, usn, location, service);
+        v1 += pkg_size(&pkg);
+        size = pkg_write_dict(buf, &pkg, out, 1);
+        if (size == 0 || size > pkg_size_dict(&pkg))
+        {
+            fprintf(stderr, "test_dict:%u: wrote %lu bytes\n", i,
+                    (unsigned long)size);
+            goto out;
+        }
+        v2 += size;
+        if (!pkg_peek(buf, in, &view) || !view_eq(&view, &pkg))
+        {
+            fprintf(stderr, "test_dict:%u: missmatched data\n", i);
+            goto out;
+        }
+        pkg_read(buf, &view);
+    }
+    fprintf(stdout, "test_dict: %u services in %lu bytes, %lu as version 1 "
+            "(%.1fx)\n", i, (unsigned long)v2, (unsigned long)v1,
+            (double)v1 / v2);
+    if (v2 * 6 > v1)
+    {
+        fprintf(stderr, "test_dict: compact encoding too large\n");
+        goto out;
+    }
+    if (pkg_dict_size(in) != pkg_dict_size(out))
+    {
+        fprintf(stderr, "test_dict: dictionaries differ, %lu != %lu\n",
+                (unsigned long)pkg_dict_size(in),
+                (unsigned long)pkg_dict_size(out));
+        goto out;
+    }
+
+    /* Channels are independent, packages can be read in any order
+     * between them. Both would use what the other added on the same
+     * channel */
+    make_service(&pkg, 7, usn, location, service);
+    if (pkg_write_dict(buf, &pkg, out, 2) == 0)
+    {
+        fprintf(stderr, "test_dict: channel 2 did not fit\n");
+        goto out;
+    }
+    make_service(&pkg, 8, usn, location, service);
+    if (pkg_write_dict(buf2, &pkg, out, 3) == 0 ||
+        !pkg_peek(buf2, in, &view) || !view_eq(&view, &pkg))
+    {
+        fprintf(stderr, "test_dict: channel 3 missmatched\n");
+        goto out;
+    }
+    pkg_read(buf2, &view);
+    if (!pkg_peek(buf, in, &view) ||
+        view.content.new_service.service_id != 1007 ||
+        !pkg_str_eq(&(view.content.new_service.usn),
+                    "uuid:4d696e69-444c-164e-9d41-000000000001"))
+    {
+        fprintf(stderr, "test_dict: channel 2 missmatched\n");
+        goto out;
+    }
+    pkg_read(buf, &view);
+
+    /* Only references left, reading them shouldn't allocate */
+    if (pkg_write_dict(buf, &pkg, out, 3) == 0)
+    {
+        fprintf(stderr, "test_dict: repeat did not fit\n");
+        goto out;
+    }
+    before = alloc_count();
+    if (!pkg_peek(buf, in, &view) || !view_eq(&view, &pkg))
+    {
+        fprintf(stderr, "test_dict: repeat missmatched\n");
+        goto out;
+    }
+    pkg_read(buf, &view);
+    if (alloc_count_available() && alloc_count() != before)
+    {
+        fprintf(stderr, "test_dict: %lu allocations reading a repeat\n",
+                alloc_count() - before);
+        goto out;
+    }
+
+    /* Without a dictionary compact packages are skipped */
+    if (pkg_write_dict(buf, &pkg, out, 3) == 0 ||
+        pkg_peek(buf, NULL, &view) || buf_ravail(buf) != 0)
+    {
+        fprintf(stderr, "test_dict: compact package read without dict\n");
+        goto out;
+    }
+    ret = true;
+
+ out:
+    pkg_dict_free(out);
+    pkg_dict_free(in);
+    buf_free(buf);
+    buf_free(buf2);
+    return ret;
+}
+
+static pkg_dict_t copy_dict(pkg_dict_t dict)
+{
+    pkg_dict_t copy = pkg_dict_new();
+    unsigned int ch;
+    for (ch = 0; ch < PKG_DICT_CHANNELS; ++ch)
+    {
+        size_t i;
+        for (i = 0; i < pkg_dict_entries(dict, ch); ++i)
+        {
+            size_t len;
+            const char* str = pkg_dict_entry(dict, ch, i, &len);
+            if (!pkg_dict_append(copy, ch, str, len))
+            {
+                pkg_dict_free(copy);
+                return NULL;
+            }
+        }
+    }
+    return copy;
+}
+
+/* Copies of both dictionaries of a link carry on where they left off, a
+ * service sent again is all references */
+bool test_dict_copy(void)
+{
+    buf_t buf = buf_new(512);
+    pkg_dict_t out = pkg_dict_new(), in = pkg_dict_new();
+    pkg_dict_t out2 = NULL, in2 = NULL;
+    unsigned int i;
+    char usn[128], location[128], service[128];
+    size_t first = 0, again = 0;
+    pkg_t pkg;
+    pkg_view_t view;
+    bool ret = false;
+
+    for (i = 0; i < DEVICE_SERVICES; ++i)
+    {
+        make_service(&pkg, i, usn, location, service);
+        first += pkg_write_dict(buf, &pkg, out, 1);
+        if (!pkg_peek(buf, in, &view) || !view_eq(&view, &pkg))
+        {
+            fprintf(stderr, "test_dict_copy:%u: missmatched data\n", i);
+            goto out;
+        }
+        pkg_read(buf, &view);
+    }
+    out2 = copy_dict(out);
+    in2 = copy_dict(in);
+    if (out2 == NULL || in2 == NULL ||
+        pkg_dict_size(out2) != pkg_dict_size(out) ||
+        pkg_dict_size(in2) != pkg_dict_size(in))
+    {
+        fprintf(stderr, "test_dict_copy: copies differ\n");
+        goto out;
+    }
+    for (i = 0; i < DEVICE_SERVICES; ++i)
+    {
+        make_service(&pkg, i, usn, location, service);
+        again += pkg_write_dict(buf, &pkg, out2, 1);
+        if (!pkg_peek(buf, in2, &view) || !view_eq(&view, &pkg))
+        {
+            fprintf(stderr, "test_dict_copy:%u: missmatched copy\n", i);
+            goto out;
+        }
+        pkg_read(buf, &view);
+    }
+    if (again * 3 > first)
+    {
+        fprintf(stderr, "test_dict_copy: %lu bytes again, %lu first\n",
+                (unsigned long)again, (unsigned long)first);
+        goto out;
+    }
+    ret = true;
+
+ out:
+    pkg_dict_free(out);
+    pkg_dict_free(in);
+    pkg_dict_free(out2);
+    pkg_dict_free(in2);
+    buf_free(buf);
+    return ret;
+}
+
+/* Older daemons don't send the fields added at the end of packages */
+bool test_old_fields(void)
+{
+    static const char hello[] = {
+        0, 0, 0, 1, 20, 0,
+        2
+    };
+    static const char create_tunnel[] = {
+        0, 0, 0, 18, 10, 0,
+        0, 0, 0, 1, 0, 0, 0, 2, 0, 0, 0, 4, 'h', 'o', 's', 't', 0, 80
+    };
+    buf_t buf = buf_new(256);
+    pkg_view_t view;
+    bool ret = false;
+    buf_write(buf, hello, sizeof(hello));
+    buf_write(buf, create_tunnel, sizeof(create_tunnel));
+    if (!pkg_peek(buf, NULL, &view) || view.type != PKG_HELLO ||
+        view.content.hello.version != 2 || view.content.hello.compress != 0)
+    {
+        fprintf(stderr, "test_old_fields: hello missmatched\n");
+        goto out;
+    }
+    pkg_read(buf, &view);
+    if (!pkg_peek(buf, NULL, &view) || view.type != PKG_CREATE_TUNNEL ||
+        view.content.create_tunnel.tunnel_id != 2 ||
+        !pkg_str_eq(&(view.content.create_tunnel.host), "host") ||
+        view.content.create_tunnel.port != 80 ||
+        view.content.create_tunnel.compress != 0)
+    {
+        fprintf(stderr, "test_old_fields: create_tunnel missmatched\n");
+        goto out;
+    }
+    pkg_read(buf, &view);
+    ret = buf_ravail(buf) == 0;
+
+ out:
+    buf_free(buf);
+    return ret;
+}
+
+/* The event packages, the parts of a large event must each fit the input
+ * buffer of the daemon (SERVER_BUFFER_IN) and parts claiming to be larger
+ * than PKG_EVENT_PART are skipped */
+bool test_events(void)
+{
+    static const char too_large[] = {
+        0, 0, 3, 10, 32, 0,
+        0, 0, 0, 7, 1, 0, 0, 3, 1
+    };
+    buf_t buf = buf_new(1024);
+    char* body = malloc(3 * PKG_EVENT_PART), *path = strdup("/evt/1");
+    size_t i, got = 0;
+    pkg_view_t view;
+    pkg_t pkg;
+    bool ret = false;
+    for (i = 0; i < 3 * PKG_EVENT_PART; ++i)
+    {
+        body[i] = 'a' + i % 26;
+    }
+    pkg_subscribe(&pkg, 12, 34, path);
+    pkg_write(buf, &pkg);
+    if (!pkg_peek(buf, NULL, &view) || view.type != PKG_SUBSCRIBE ||
+        view.content.subscribe.service_id != 12 ||
+        view.content.subscribe.watch_id != 34 ||
+        !pkg_str_eq(&(view.content.subscribe.path), "/evt/1"))
+    {
+        fprintf(stderr, "test_events: subscribe missmatched\n");
+        goto out;
+    }
+    pkg_read(buf, &view);
+    for (i = 0; i < 3; ++i)
+    {
+        pkg_event(&pkg, 34, i == 2, body + i * PKG_EVENT_PART,
+                  PKG_EVENT_PART);
+        if (!pkg_write(buf, &pkg))
+        {
+            fprintf(stderr, "test_events: event part %lu did not fit\n",
+                    (unsigned long)i);
+            goto out;
+        }
+        if (!pkg_peek(buf, NULL, &view) || view.type != PKG_EVENT ||
+            view.content.event.watch_id != 34 ||
+            view.content.event.last != (i == 2) ||
+            pkg_str_len(&(view.content.event.data)) != PKG_EVENT_PART)
+        {
+            fprintf(stderr, "test_events: event part %lu missmatched\n",
+                    (unsigned long)i);
+            goto out;
+        }
+        {
+            char* data = pkg_str_dup(&(view.content.event.data));
+            if (memcmp(data, body + got, PKG_EVENT_PART) != 0)
+            {
+                fprintf(stderr, "test_events: event data missmatched\n");
+                free(data);
+                goto out;
+            }
+            free(data);
+        }
+        got += PKG_EVENT_PART;
+        pkg_read(buf, &view);
+    }
+    buf_write(buf, too_large, sizeof(too_large));
+    buf_write(buf, body, PKG_EVENT_PART + 1);
+    pkg_unsubscribe(&pkg, 34, true);
+    pkg_write(buf, &pkg);
+    if (!pkg_peek(buf, NULL, &view) || view.type != PKG_UNSUBSCRIBE ||
+        view.content.unsubscribe.watch_id != 34 ||
+        !view.content.unsubscribe.local)
+    {
+        fprintf(stderr, "test_events: unsubscribe missmatched\n");
+        goto out;
+    }
+    pkg_read(buf, &view);
+    ret = buf_ravail(buf) == 0;
+
+ out:
+    free(body);
+    free(path);
+    buf_free(buf);
+    return ret;
+}
@@ -49,6 +49,9 @@ static bool test_req2(void);
 static bool test_req3(void);
 static bool test_req4(void);
 static bool test_req5(void);
+static bool test_compressible(void);
+static bool test_idle(void);
+static bool test_strip(void);
 
 int main(int argc, char** argv)
 {
@@ -66,6 +69,9 @@ int main(int argc, char** argv)
     RUN_TEST(test_req3());
     RUN_TEST(test_req4());
     RUN_TEST(test_req5());
+    RUN_TEST(test_compressible());
+    RUN_TEST(test_idle());
+    RUN_TEST(test_strip());
 
     fprintf(stdout, "OK %u/%u\n", cnt, tot);
 
@@ -178,14 +184,18 @@ static void transfer_output(buf_t buf, char** data, size_t *pos, size_t *size)
     buf_rmove(buf, avail);
 }
 
-static bool test2(const char* id, const char* srchost, const char* tgthost,
-                  const char* incoming, char** outgoing)
+static bool test3(const char* id, const char* srchost, const char* tgthost,
+                  const char* strip, const char* incoming, char** outgoing)
 {
     buf_t output = buf_new(32);
     size_t i, iend;
     size_t osize = 0, o = 0;
     http_proxy_t proxy = http_proxy_new(srchost, tgthost, output);
     *outgoing = NULL;
+    if (strip != NULL)
+    {
+        http_proxy_strip_segment(proxy, strip);
+    }
 
     iend = strlen(incoming);
     i = 0;
@@ -235,6 +245,12 @@ static bool test2(const char* id, const char* srchost, const char* tgthost,
     return false;
 }
 
+static bool test2(const char* id, const char* srchost, const char* tgthost,
+                  const char* incoming, char** outgoing)
+{
+    return test3(id, srchost, tgthost, NULL, incoming, outgoing);
+}
+
 static bool test(const char* id, const char* srchost, const char* requests,
                  const char* targethost, const char* responses,
                  char** reqs, char** resps)
@@ -815,3 +831,163 @@ static bool test_req5(void)
     free(req);
     return true;
 }
+
+/* Feed str to the proxy and check http_proxy_compressible afterwards */
+static bool feed_compressible(http_proxy_t proxy, buf_t output,
+                              const char* str, bool expect)
+{
+    size_t len = strlen(str), avail;
+    char* ptr = http_proxy_wptr(proxy, &avail);
+    if (avail < len)
+    {
+        fprintf(stderr, "test_compressible: no room for input\n");
+        return false;
+    }
+    memcpy(ptr, str, len);
+    http_proxy_wmove(proxy, len);
+    buf_skip(output, buf_ravail(output));
+    if (http_proxy_compressible(proxy) != expect)
+    {
+        fprintf(stderr, "test_compressible: expected %s after `%s`\n",
+                expect ? "compressible" : "not compressible", str);
+        return false;
+    }
+    return true;
+}
+
+static bool test_compressible(void)
+{
+    buf_t output = buf_new(4096);
+    http_proxy_t proxy = http_proxy_new("", "", output);
+    bool ok =
+        feed_compressible(proxy, output,
+                          "HTTP/1.1 200 OK\r\n"
+                          "Content-Type: video/mpeg\r\n"
+                          "Content-Length: 10\r\n\r\n", false) &&
+        feed_compressible(proxy, output, "0123456789", true) &&
+        feed_compressible(proxy, output,
+                          "HTTP/1.1 200 OK\r\n"
+                          "Content-Type: text/xml; charset=\"utf-8\"\r\n"
+                          "Content-Length: 10\r\n\r\n", true) &&
+        feed_compressible(proxy, output, "<a></a>", true) &&
+        feed_compressible(proxy, output, "<b>", true) &&
+        feed_compressible(proxy, output,
+                          "HTTP/1.1 200 OK\r\n"
+                          "Content-Type: image/svg+xml\r\n"
+                          "Content-Length: 3\r\n\r\n", true) &&
+        feed_compressible(proxy, output, "<a>", true) &&
+        feed_compressible(proxy, output,
+                          "HTTP/1.1 200 OK\r\n"
+                          "Content-Type: text/html\r\n"
+                          "Content-Encoding: gzip\r\n"
+                          "Content-Length: 3\r\n\r\n", false) &&
+        feed_compressible(proxy, output, "abc", true) &&
+        feed_compressible(proxy, output,
+                          "HTTP/1.1 200 OK\r\n"
+                          "Content-Type: application/octet-stream\r\n"
+                          "Content-Encoding: identity\r\n"
+                          "Content-Length: 3\r\n\r\n", true);
+    http_proxy_free(proxy);
+    buf_free(output);
+    return ok;
+}
+
+/* Feed str to the proxy and check http_proxy_idle afterwards */
+static bool feed_idle(http_proxy_t proxy, buf_t output, const char* str,
+                      bool skip, bool expect)
+{
+    size_t len = strlen(str), avail;
+    char* ptr = http_proxy_wptr(proxy, &avail);
+    if (avail < len)
+    {
+        fprintf(stderr, "test_idle: no room for input\n");
+        return false;
+    }
+    memcpy(ptr, str, len);
+    http_proxy_wmove(proxy, len);
+    if (skip)
+    {
+        buf_skip(output, buf_ravail(output));
+        http_proxy_flush(proxy, false);
+    }
+    if (http_proxy_idle(proxy) != expect)
+    {
+        fprintf(stderr, "test_idle: expected %s after `%s`\n",
+                expect ? "idle" : "busy", str);
+        return false;
+    }
+    return true;
+}
+
+static bool test_idle(void)
+{
+    /* Too small for the second response, it stays in the proxy until the
+     * output is read */
+    buf_t output = buf_new(64);
+    http_proxy_t proxy = http_proxy_new("", "", output);
+    bool ok = http_proxy_idle(proxy) &&
+        feed_idle(proxy, output, "HTTP/1.1 200 OK\r\n", true, false) &&
+        feed_idle(proxy, output, "Content-Length: 4\r\n\r\n", true, false) &&
+        feed_idle(proxy, output, "ab", true, false) &&
+        feed_idle(proxy, output, "cd", true, true) &&
+        feed_idle(proxy, output,
+                  "HTTP/1.1 200 OK\r\n"
+                  "Content-Type: text/xml; charset=\"utf-8\"\r\n"
+                  "Content-Length: 3\r\n\r\nabc", false, false) &&
+        feed_idle(proxy, output, "", true, true);
+    http_proxy_free(proxy);
+    buf_free(output);
+    return ok;
+}
+
+static bool test_strip(void)
+{
+    const char* request =
+        "GET /route-1f/desc.xml HTTP/1.1\r\n"
+        "Host: 10.0.1.1:48383\r\n"
+        "\r\n"
+        "POST /route-1f?x=1 HTTP/1.1\r\n"
+        "Host: 10.0.1.1:48383\r\n"
+        "Content-Length: 10\r\n"
+        "\r\n"
+        "/route-2/a"
+        "GET  /route-2 HTTP/1.1\r\n"
+        "Host: 10.0.1.1:48383\r\n"
+        "\r\n"
+        "GET /other/route-1f/control HTTP/1.1\r\n"
+        "Host: 10.0.1.1:48383\r\n"
+        "\r\n";
+    const char* request_conv =
+        "GET /desc.xml HTTP/1.1\r\n"
+        "Host: 192.168.1.7:45000\r\n"
+        "\r\n"
+        "POST /?x=1 HTTP/1.1\r\n"
+        "Host: 192.168.1.7:45000\r\n"
+        "Content-Length: 10\r\n"
+        "\r\n"
+        "/route-2/a"
+        "GET  / HTTP/1.1\r\n"
+        "Host: 192.168.1.7:45000\r\n"
+        "\r\n"
+        "GET /other/route-1f/control HTTP/1.1\r\n"
+        "Host: 192.168.1.7:45000\r\n"
+        "\r\n";
+    char* req = NULL;
+
+    if (!test3("strip", "10.0.1.1:48383", "192.168.1.7:45000", "/route-",
+               request, &req))
+    {
+        free(req);
+        return false;
+    }
+
+    if (strcmp(request_conv, req) != 0)
+    {
+        expected("strip", request_conv, req);
+        free(req);
+        return false;
+    }
+
+    free(req);
+    return true;
+}
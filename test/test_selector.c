@@ -0,0 +1,725 @@
+/*
+ * Copyright (C) 2011, Joel Klinghed.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the project nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE PROJECT AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE PROJECT OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "common.h"
+
+#include "selector.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/time.h>
+
+#define RUN_TEST(_test) \
+    ++tot; cnt += _test ? 1 : 0
+
+static bool test_events(selector_t selector);
+static bool test_remove(selector_t selector);
+static bool test_many(selector_t selector);
+static bool test_requeue(selector_t selector);
+static bool test_accept(selector_t selector);
+static bool test_stream(selector_t selector);
+static bool test_idle(selector_t selector);
+
+int main(int argc, char** argv)
+{
+    unsigned int tot = 0, cnt = 0;
+    selector_t selector[2];
+    unsigned int i;
+
+    selector[0] = selector_new_select();
+    selector[1] = selector_new();
+    for (i = 0; i < 2; ++i)
+    {
+        fprintf(stdout, "%s\n", selector_backend(selector[i]));
+        RUN_TEST(test_events(selector[i]));
+        RUN_TEST(test_remove(selector[i]));
+        RUN_TEST(test_many(selector[i]));
+        RUN_TEST(test_requeue(selector[i]));
+        RUN_TEST(test_accept(selector[i]));
+        RUN_TEST(test_stream(selector[i]));
+        RUN_TEST(test_idle(selector[i]));
+        selector_free(selector[i]);
+    }
+
+    fprintf(stdout, "OK %u/%u\n", cnt, tot);
+
+    return cnt == tot ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+typedef struct _peer_t
+{
+    selector_t selector;
+    int reads, writes;
+    /* Read this many bytes each time it is readable */
+    size_t drain;
+    /* Remove these sockets when readable */
+    socket_t remove[2];
+    /* Stop checking and requeue instead, this many times */
+    int requeue;
+} peer_t;
+
+static void read_cb(void* userdata, socket_t sock)
+{
+    peer_t* peer = userdata;
+    char buf[16];
+    size_t i;
+    peer->reads++;
+    if (peer->drain > 0)
+    {
+        ssize_t got = read(sock, buf, peer->drain < sizeof(buf)
+                           ? peer->drain : sizeof(buf));
+        if (got <= 0)
+        {
+            selector_chkread(peer->selector, sock, false);
+        }
+    }
+    if (peer->requeue > 0)
+    {
+        peer->requeue--;
+        selector_chkread(peer->selector, sock, false);
+        selector_requeue(peer->selector, sock);
+    }
+    for (i = 0; i < 2; ++i)
+    {
+        if (peer->remove[i] >= 0)
+        {
+            selector_remove(peer->selector, peer->remove[i]);
+            peer->remove[i] = -1;
+        }
+    }
+}
+
+static void write_cb(void* userdata, socket_t sock)
+{
+    peer_t* peer = userdata;
+    peer->writes++;
+    selector_chkwrite(peer->selector, sock, false);
+}
+
+static bool make_pair(socket_t fd[2])
+{
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fd) != 0)
+    {
+        return false;
+    }
+    fcntl(fd[0], F_SETFL, O_NONBLOCK);
+    fcntl(fd[1], F_SETFL, O_NONBLOCK);
+    return true;
+}
+
+static void init_peer(peer_t* peer, selector_t selector)
+{
+    memset(peer, 0, sizeof(peer_t));
+    peer->selector = selector;
+    peer->remove[0] = -1;
+    peer->remove[1] = -1;
+}
+
+bool test_events(selector_t selector)
+{
+    socket_t fd[2];
+    peer_t peer;
+    bool ret = false;
+
+    if (!make_pair(fd))
+    {
+        return false;
+    }
+    init_peer(&peer, selector);
+    selector_add(selector, fd[0], &peer, read_cb, write_cb);
+    /* Writable right away, but not readable */
+    if (!selector_tick(selector, 100) || peer.writes != 1 || peer.reads != 0)
+    {
+        goto out;
+    }
+    /* The write callback turned itself off */
+    if (!selector_tick(selector, 10) || peer.writes != 1 || peer.reads != 0)
+    {
+        goto out;
+    }
+    /* Level triggered, the same byte is reported until it is read */
+    if (write(fd[1], "ab", 2) != 2)
+    {
+        goto out;
+    }
+    if (!selector_tick(selector, 100) || peer.reads != 1 ||
+        !selector_tick(selector, 100) || peer.reads != 2)
+    {
+        goto out;
+    }
+    peer.drain = 1;
+    selector_tick(selector, 100);
+    selector_tick(selector, 100);
+    if (peer.reads != 4)
+    {
+        goto out;
+    }
+    /* Drained, no more reads */
+    selector_tick(selector, 10);
+    if (peer.reads != 4)
+    {
+        goto out;
+    }
+    selector_chk(selector, fd[0], false, true);
+    if (write(fd[1], "c", 1) != 1 ||
+        !selector_tick(selector, 100) || peer.writes != 2 || peer.reads != 4)
+    {
+        goto out;
+    }
+    selector_chkread(selector, fd[0], true);
+    if (!selector_tick(selector, 100) || peer.reads != 5)
+    {
+        goto out;
+    }
+    /* The other end closing makes it readable, read_cb stops checking
+     * when it gets the EOF */
+    close(fd[1]);
+    fd[1] = -1;
+    selector_tick(selector, 100);
+    selector_tick(selector, 10);
+    if (peer.reads != 6)
+    {
+        goto out;
+    }
+    ret = true;
+
+out:
+    selector_remove(selector, fd[0]);
+    close(fd[0]);
+    if (fd[1] >= 0)
+    {
+        close(fd[1]);
+    }
+    return ret;
+}
+
+bool test_remove(selector_t selector)
+{
+    socket_t a[2], b[2];
+    peer_t pa, pb;
+    bool ret = false;
+
+    if (!make_pair(a))
+    {
+        return false;
+    }
+    if (!make_pair(b))
+    {
+        close(a[0]);
+        close(a[1]);
+        return false;
+    }
+    init_peer(&pa, selector);
+    init_peer(&pb, selector);
+    selector_add(selector, a[0], &pa, read_cb, NULL);
+    selector_add(selector, b[0], &pb, read_cb, NULL);
+    /* Both readable, whichever runs first removes both so only one
+     * callback may run */
+    pa.remove[0] = a[0];
+    pa.remove[1] = b[0];
+    pb.remove[0] = a[0];
+    pb.remove[1] = b[0];
+    if (write(a[1], "x", 1) != 1 || write(b[1], "x", 1) != 1)
+    {
+        goto out;
+    }
+    if (!selector_tick(selector, 100) || pa.reads + pb.reads != 1)
+    {
+        goto out;
+    }
+    if (!selector_tick(selector, 10) || pa.reads + pb.reads != 1)
+    {
+        goto out;
+    }
+    /* Adding it back works */
+    selector_add(selector, a[0], &pa, read_cb, NULL);
+    if (!selector_tick(selector, 100) || pa.reads + pb.reads != 2)
+    {
+        goto out;
+    }
+    selector_remove(selector, a[0]);
+    /* A new socket can get the number of a removed one */
+    close(a[0]);
+    close(a[1]);
+    if (!make_pair(a))
+    {
+        a[0] = a[1] = -1;
+        goto out;
+    }
+    selector_add(selector, a[0], &pa, read_cb, NULL);
+    if (!selector_tick(selector, 10) || pa.reads + pb.reads != 2)
+    {
+        goto out;
+    }
+    if (write(a[1], "y", 1) != 1 ||
+        !selector_tick(selector, 100) || pa.reads + pb.reads != 3)
+    {
+        goto out;
+    }
+    selector_remove(selector, a[0]);
+    ret = true;
+
+out:
+    if (a[0] >= 0)
+    {
+        close(a[0]);
+        close(a[1]);
+    }
+    close(b[0]);
+    close(b[1]);
+    return ret;
+}
+
+bool test_many(selector_t selector)
+{
+    const unsigned int count = 200;
+    socket_t* fd = calloc(count * 2, sizeof(socket_t));
+    peer_t peer;
+    unsigned int i, made = 0;
+    bool ret = false;
+
+    init_peer(&peer, selector);
+    peer.drain = 16;
+    for (; made < count; ++made)
+    {
+        if (!make_pair(fd + made * 2))
+        {
+            goto out;
+        }
+        selector_add(selector, fd[made * 2], &peer, read_cb, NULL);
+    }
+    for (i = 0; i < count; i += 3)
+    {
+        if (write(fd[i * 2 + 1], "z", 1) != 1)
+        {
+            goto out;
+        }
+    }
+    for (i = 0; i < 10 && peer.reads < (int)((count + 2) / 3); ++i)
+    {
+        selector_tick(selector, 100);
+    }
+    if (peer.reads != (int)((count + 2) / 3))
+    {
+        goto out;
+    }
+    ret = true;
+
+out:
+    for (i = 0; i < made; ++i)
+    {
+        selector_remove(selector, fd[i * 2]);
+        close(fd[i * 2]);
+        close(fd[i * 2 + 1]);
+    }
+    free(fd);
+    return ret;
+}
+
+bool test_requeue(selector_t selector)
+{
+    socket_t a[2], b[2];
+    peer_t pa, pb;
+    struct timeval start, end;
+    int i;
+    bool ret = false;
+
+    if (!make_pair(a))
+    {
+        return false;
+    }
+    if (!make_pair(b))
+    {
+        close(a[0]);
+        close(a[1]);
+        return false;
+    }
+    init_peer(&pa, selector);
+    init_peer(&pb, selector);
+    pa.drain = 1;
+    pa.requeue = 3;
+    pb.drain = 1;
+    selector_add(selector, a[0], &pa, read_cb, NULL);
+    selector_add(selector, b[0], &pb, read_cb, NULL);
+    if (write(a[1], "abcd", 4) != 4 || write(b[1], "xy", 2) != 2)
+    {
+        goto out;
+    }
+    /* a stops checking after each byte, but is called again anyway and b
+     * gets its turn every tick */
+    gettimeofday(&start, NULL);
+    for (i = 1; i <= 3; ++i)
+    {
+        if (!selector_tick(selector, i == 1 ? 1000 : 5000))
+        {
+            goto out;
+        }
+        if (pa.reads != i || pb.reads != (i < 3 ? i : 2))
+        {
+            goto out;
+        }
+    }
+    /* The last requeue runs without waiting */
+    if (!selector_tick(selector, 5000) || pa.reads != 4)
+    {
+        goto out;
+    }
+    gettimeofday(&end, NULL);
+    if (end.tv_sec - start.tv_sec > 2)
+    {
+        goto out;
+    }
+    /* Not checking and nothing requeued, so nothing more */
+    if (!selector_tick(selector, 10) || pa.reads != 4)
+    {
+        goto out;
+    }
+    ret = true;
+
+out:
+    selector_remove(selector, a[0]);
+    selector_remove(selector, b[0]);
+    close(a[0]);
+    close(a[1]);
+    close(b[0]);
+    close(b[1]);
+    return ret;
+}
+
+typedef struct _listener_t
+{
+    int accepts, errors;
+} listener_t;
+
+static void accept_cb(void* userdata, socket_t sock, socket_t client)
+{
+    listener_t* listener = userdata;
+    if (client < 0)
+    {
+        listener->errors++;
+        return;
+    }
+    listener->accepts++;
+    close(client);
+}
+
+static bool wait_accepts(selector_t selector, listener_t* listener,
+                         int accepts)
+{
+    int i;
+    for (i = 0; i < 10 && listener->accepts < accepts; ++i)
+    {
+        selector_tick(selector, 100);
+    }
+    return listener->accepts == accepts && listener->errors == 0;
+}
+
+bool test_accept(selector_t selector)
+{
+    socket_t sock, c[3] = { -1, -1, -1 };
+    struct sockaddr* addr;
+    socklen_t addrlen;
+    uint16_t port;
+    listener_t listener;
+    unsigned int i;
+    bool ret = false;
+
+    sock = socket_tcp_listen("127.0.0.1", 0);
+    if (sock < 0)
+    {
+        return false;
+    }
+    addr = socket_getsockaddr(sock, &addrlen);
+    port = addr != NULL ? addr_getport(addr, addrlen) : 0;
+    free(addr);
+    socket_setblocking(sock, false);
+    memset(&listener, 0, sizeof(listener));
+    selector_add_listener(selector, sock, &listener, accept_cb);
+    /* Nothing to accept */
+    if (!selector_tick(selector, 10) || listener.accepts != 0)
+    {
+        goto out;
+    }
+    c[0] = socket_tcp_connect("127.0.0.1", port, true, NULL);
+    c[1] = socket_tcp_connect("127.0.0.1", port, true, NULL);
+    if (c[0] < 0 || c[1] < 0 || !wait_accepts(selector, &listener, 2))
+    {
+        goto out;
+    }
+    /* Not accepting, the connection waits until it is again */
+    selector_chkread(selector, sock, false);
+    selector_tick(selector, 10);
+    c[2] = socket_tcp_connect("127.0.0.1", port, true, NULL);
+    if (c[2] < 0)
+    {
+        goto out;
+    }
+    selector_tick(selector, 10);
+    selector_tick(selector, 10);
+    if (listener.accepts != 2)
+    {
+        goto out;
+    }
+    selector_chkread(selector, sock, true);
+    if (!wait_accepts(selector, &listener, 3))
+    {
+        goto out;
+    }
+    ret = true;
+
+out:
+    selector_remove(selector, sock);
+    close(sock);
+    for (i = 0; i < 3; ++i)
+    {
+        if (c[i] >= 0)
+        {
+            close(c[i]);
+        }
+    }
+    return ret;
+}
+
+#define STREAM_SEND (300 * 1024)
+#define STREAM_RECV (200 * 1024)
+
+typedef struct _stream_peer_t
+{
+    selector_t selector;
+    size_t sent, received;
+    bool eof, bad;
+} stream_peer_t;
+
+static void stream_read_cb(void* userdata, socket_t sock)
+{
+    stream_peer_t* peer = userdata;
+    char buf[5000];
+    for (;;)
+    {
+        ssize_t got = selector_recv(peer->selector, sock, buf, sizeof(buf));
+        ssize_t i;
+        if (got < 0)
+        {
+            if (!socket_blockingerror(sock))
+            {
+                peer->bad = true;
+                selector_chkread(peer->selector, sock, false);
+            }
+            return;
+        }
+        if (got == 0)
+        {
+            peer->eof = true;
+            selector_chkread(peer->selector, sock, false);
+            return;
+        }
+        for (i = 0; i < got; ++i)
+        {
+            if (buf[i] != (char)((peer->received + i) % 253))
+            {
+                peer->bad = true;
+            }
+        }
+        peer->received += got;
+    }
+}
+
+static void stream_write_cb(void* userdata, socket_t sock)
+{
+    stream_peer_t* peer = userdata;
+    char buf[7000];
+    while (peer->sent < STREAM_SEND)
+    {
+        size_t len = STREAM_SEND - peer->sent, i;
+        ssize_t got;
+        if (len > sizeof(buf))
+        {
+            len = sizeof(buf);
+        }
+        for (i = 0; i < len; ++i)
+        {
+            buf[i] = (char)((peer->sent + i) % 251);
+        }
+        got = selector_send(peer->selector, sock, buf, len);
+        if (got <= 0)
+        {
+            if (got == 0 || !socket_blockingerror(sock))
+            {
+                peer->bad = true;
+                selector_chkwrite(peer->selector, sock, false);
+            }
+            return;
+        }
+        peer->sent += got;
+    }
+    selector_chkwrite(peer->selector, sock, false);
+}
+
+/* Data goes both ways through a socket that is read and written with
+ * selector_recv and selector_send, then the other end closes */
+bool test_stream(selector_t selector)
+{
+    socket_t fd[2];
+    stream_peer_t peer;
+    size_t got = 0, put = 0;
+    int i;
+    bool ret = false;
+
+    if (!make_pair(fd))
+    {
+        return false;
+    }
+    memset(&peer, 0, sizeof(peer));
+    peer.selector = selector;
+    selector_add(selector, fd[0], &peer, stream_read_cb, stream_write_cb);
+    for (i = 0; i < 1000 && !peer.eof && !peer.bad; ++i)
+    {
+        char buf[4096];
+        ssize_t n, j;
+        selector_tick(selector, 10);
+        while ((n = read(fd[1], buf, sizeof(buf))) > 0)
+        {
+            for (j = 0; j < n; ++j)
+            {
+                if (buf[j] != (char)((got + j) % 251))
+                {
+                    goto out;
+                }
+            }
+            got += n;
+        }
+        while (put < STREAM_RECV)
+        {
+            size_t len = STREAM_RECV - put, k;
+            if (len > sizeof(buf))
+            {
+                len = sizeof(buf);
+            }
+            for (k = 0; k < len; ++k)
+            {
+                buf[k] = (char)((put + k) % 253);
+            }
+            n = write(fd[1], buf, len);
+            if (n <= 0)
+            {
+                break;
+            }
+            put += n;
+        }
+        if (put == STREAM_RECV && got == STREAM_SEND && fd[1] >= 0)
+        {
+            close(fd[1]);
+            fd[1] = -1;
+        }
+    }
+    if (peer.bad || !peer.eof || got != STREAM_SEND ||
+        peer.sent != STREAM_SEND || peer.received != STREAM_RECV)
+    {
+        goto out;
+    }
+    ret = true;
+
+out:
+    selector_remove(selector, fd[0]);
+    close(fd[0]);
+    if (fd[1] >= 0)
+    {
+        close(fd[1]);
+    }
+    return ret;
+}
+
+static void idle_read_cb(void* userdata, socket_t sock)
+{
+    peer_t* peer = userdata;
+    peer->reads++;
+    selector_chkread(peer->selector, sock, false);
+}
+
+/* Nothing is lost when a socket that was idle moves on */
+bool test_idle(selector_t selector)
+{
+    bool ring = strcmp(selector_backend(selector), "io_uring") == 0;
+    socket_t fd[2];
+    peer_t peer;
+    char c;
+    int i;
+    bool ret = false;
+
+    if (!make_pair(fd))
+    {
+        return false;
+    }
+    init_peer(&peer, selector);
+    selector_add(selector, fd[0], &peer, idle_read_cb, NULL);
+    /* Something read but not yet returned by selector_recv */
+    if (selector_recv(selector, fd[0], &c, 1) >= 0 ||
+        !socket_blockingerror(fd[0]) || write(fd[1], "x", 1) != 1)
+    {
+        goto out;
+    }
+    for (i = 0; i < 10 && peer.reads == 0; ++i)
+    {
+        selector_tick(selector, 100);
+    }
+    if (peer.reads != 1 || selector_idle(selector, fd[0]) == ring ||
+        selector_recv(selector, fd[0], &c, 1) != 1 || c != 'x')
+    {
+        goto out;
+    }
+    /* The read going on when the socket is idle is stopped */
+    if (selector_recv(selector, fd[0], &c, 1) >= 0)
+    {
+        goto out;
+    }
+    selector_chkread(selector, fd[0], true);
+    selector_tick(selector, 10);
+    if (!selector_idle(selector, fd[0]))
+    {
+        goto out;
+    }
+    selector_remove(selector, fd[0]);
+    if (write(fd[1], "y", 1) != 1)
+    {
+        goto out;
+    }
+    selector_tick(selector, 10);
+    if (read(fd[0], &c, 1) != 1 || c != 'y')
+    {
+        goto out;
+    }
+    ret = true;
+
+out:
+    selector_remove(selector, fd[0]);
+    close(fd[0]);
+    close(fd[1]);
+    return ret;
+}
@@ -0,0 +1,302 @@
+/*
+ * Copyright (C) 2011, Joel Klinghed.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the project nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE PROJECT AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE PROJECT OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "common.h"
+
+#include "slotmap.h"
+#include <stdio.h>
+
+#define RUN_TEST(_test) \
+    ++tot; cnt += _test ? 1 : 0
+
+static bool test_sanity(void);
+static bool test_stale(void);
+static bool test_many(void);
+static bool test_put_id(void);
+
+int main(int argc, char** argv)
+{
+    unsigned int tot = 0, cnt = 0;
+
+    RUN_TEST(test_sanity());
+    RUN_TEST(test_stale());
+    RUN_TEST(test_many());
+    RUN_TEST(test_put_id());
+
+    fprintf(stdout, "OK %u/%u\n", cnt, tot);
+
+    return cnt == tot ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+typedef struct _element_t
+{
+    uint32_t id;
+    int value;
+} element_t;
+
+static unsigned int freed;
+
+static void element_free(void* _element)
+{
+    ++freed;
+}
+
+bool test_sanity(void)
+{
+    slotmap_t map = slotmap_new(sizeof(element_t), element_free);
+    element_t e, *a, *b;
+    uint32_t ida, idb;
+    size_t i, seen = 0;
+    bool ret = false;
+
+    freed = 0;
+    e.value = 1;
+    a = slotmap_put(map, &e, &ida);
+    a->id = ida;
+    e.value = 2;
+    b = slotmap_put(map, &e, &idb);
+    b->id = idb;
+    if (ida == 0 || idb == 0 || ida == idb || slotmap_size(map) != 2)
+    {
+        goto out;
+    }
+    if (slotmap_get(map, ida) != a || slotmap_get(map, idb) != b)
+    {
+        goto out;
+    }
+    for (i = slotmap_begin(map); i != slotmap_end(map);
+         i = slotmap_next(map, i))
+    {
+        element_t* x = slotmap_getat(map, i);
+        if (slotmap_get(map, x->id) != x)
+        {
+            goto out;
+        }
+        ++seen;
+    }
+    if (seen != 2)
+    {
+        goto out;
+    }
+    if (!slotmap_remove(map, ida) || freed != 1 || slotmap_size(map) != 1)
+    {
+        goto out;
+    }
+    if (slotmap_get(map, ida) != NULL || slotmap_get(map, idb) != b)
+    {
+        goto out;
+    }
+    if (slotmap_get(map, 0) != NULL)
+    {
+        goto out;
+    }
+    ret = true;
+
+out:
+    slotmap_free(map);
+    return ret && freed == 2;
+}
+
+bool test_stale(void)
+{
+    slotmap_t map = slotmap_new(sizeof(element_t), NULL);
+    element_t e;
+    uint32_t first, id;
+    unsigned int i;
+    bool ret = false;
+
+    e.value = 0;
+    slotmap_put(map, &e, &first);
+    slotmap_remove(map, first);
+    /* The slots are reused, but the old ID must not come back to life
+     * when one element at a time is put and removed, far more times than
+     * a slot has generations */
+    for (i = 0; i < 10000; ++i)
+    {
+        element_t* x = slotmap_put(map, &e, &id);
+        if (id == 0 || id == first || slotmap_get(map, first) != NULL ||
+            slotmap_get(map, id) != x)
+        {
+            goto out;
+        }
+        if (slotmap_remove(map, first) || !slotmap_remove(map, id) ||
+            slotmap_remove(map, id))
+        {
+            goto out;
+        }
+        if (slotmap_get(map, id) != NULL)
+        {
+            goto out;
+        }
+    }
+    if (slotmap_size(map) != 0 || slotmap_begin(map) != slotmap_end(map))
+    {
+        goto out;
+    }
+    ret = true;
+
+out:
+    slotmap_free(map);
+    return ret;
+}
+
+bool test_many(void)
+{
+    const unsigned int count = 10000;
+    slotmap_t map = slotmap_new(sizeof(element_t), element_free);
+    uint32_t* ids = calloc(count, sizeof(uint32_t));
+    element_t e;
+    unsigned int i;
+    bool ret = false;
+
+    freed = 0;
+    for (i = 0; i < count; ++i)
+    {
+        element_t* x;
+        e.value = i;
+        x = slotmap_put(map, &e, ids + i);
+        x->id = ids[i];
+    }
+    for (i = 0; i < count; i += 2)
+    {
+        slotmap_remove(map, ids[i]);
+    }
+    if (slotmap_size(map) != count / 2 || freed != count / 2)
+    {
+        goto out;
+    }
+    for (i = 0; i < count; ++i)
+    {
+        element_t* x = slotmap_get(map, ids[i]);
+        if (i % 2 == 0 ? x != NULL : (x == NULL || x->value != (int)i))
+        {
+            goto out;
+        }
+    }
+    /* Refilling reuses the freed slots, all but the last few freed */
+    for (i = 0; i < count; i += 2)
+    {
+        e.value = i;
+        slotmap_put(map, &e, ids + i);
+    }
+    if (slotmap_end(map) > count + 100)
+    {
+        goto out;
+    }
+    ret = true;
+
+out:
+    slotmap_free(map);
+    free(ids);
+    return ret && freed == count + count / 2;
+}
+
+bool test_put_id(void)
+{
+    slotmap_t src = slotmap_new(sizeof(element_t), NULL);
+    slotmap_t map = slotmap_new(sizeof(element_t), NULL);
+    element_t e;
+    uint32_t ids[40], id, stale;
+    unsigned int i;
+    size_t seen = 0;
+    bool ret = false;
+
+    /* Give the other map a few holes and generations to copy */
+    e.value = 0;
+    for (i = 0; i < 40; ++i)
+    {
+        slotmap_put(src, &e, ids + i);
+    }
+    for (i = 0; i < 40; i += 3)
+    {
+        slotmap_remove(src, ids[i]);
+        slotmap_put(src, &e, ids + i);
+    }
+    /* A slot first used for ids[37], left free here */
+    slotmap_remove(src, ids[37]);
+    stale = ids[37];
+    for (i = 0; i < 39; i += 2)
+    {
+        element_t* x;
+        e.value = i;
+        x = slotmap_put_id(map, &e, ids[i]);
+        if (x == NULL || slotmap_get(map, ids[i]) != x)
+        {
+            goto out;
+        }
+        x->id = ids[i];
+    }
+    if (slotmap_put_id(map, &e, ids[0]) != NULL ||
+        slotmap_put_id(map, &e, 0) != NULL ||
+        slotmap_size(map) != 20)
+    {
+        goto out;
+    }
+    for (i = slotmap_begin(map); i != slotmap_end(map);
+         i = slotmap_next(map, i))
+    {
+        element_t* x = slotmap_getat(map, i);
+        if (slotmap_get(map, x->id) != x)
+        {
+            goto out;
+        }
+        ++seen;
+    }
+    if (seen != 20)
+    {
+        goto out;
+    }
+    /* New elements go in the holes, never on an ID that was put */
+    slotmap_retire(map, stale);
+    for (i = 0; i < 20; ++i)
+    {
+        unsigned int j;
+        if (slotmap_put(map, &e, &id) == NULL || id == stale)
+        {
+            goto out;
+        }
+        for (j = 0; j < 39; j += 2)
+        {
+            if (id == ids[j])
+            {
+                goto out;
+            }
+        }
+    }
+    if (slotmap_size(map) != 40)
+    {
+        goto out;
+    }
+    ret = true;
+
+out:
+    slotmap_free(map);
+    slotmap_free(src);
+    return ret;
+}
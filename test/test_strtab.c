@@ -0,0 +1,162 @@
+/*
+ * Copyright (C) 2011, Joel Klinghed.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the project nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE PROJECT AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE PROJECT OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "common.h"
+
+#include "strtab.h"
+#include <stdio.h>
+#include <string.h>
+
+#define RUN_TEST(_test) \
+    ++tot; cnt += _test ? 1 : 0
+
+static bool test_sanity(void);
+static bool test_refs(void);
+static bool test_many(void);
+
+int main(int argc, char** argv)
+{
+    unsigned int tot = 0, cnt = 0;
+
+    RUN_TEST(test_sanity());
+    RUN_TEST(test_refs());
+    RUN_TEST(test_many());
+
+    fprintf(stdout, "OK %u/%u\n", cnt, tot);
+
+    return cnt == tot ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+bool test_sanity(void)
+{
+    strtab_t tab = strtab_new();
+    char buf[] = "Linux/2.6 UPnP/1.0 Server/1.0";
+    char *a, *b, *c;
+    bool ret = false;
+
+    a = strtab_intern(tab, buf);
+    /* A different copy of the same string gives the same pointer */
+    b = strtab_intern(tab, "Linux/2.6 UPnP/1.0 Server/1.0");
+    c = strtab_internn(tab, "Linux/2.6 UPnP/1.0 Server/1.0 trailing", 29);
+    if (a == NULL || a == buf || a != b || a != c || strcmp(a, buf) != 0)
+    {
+        goto out;
+    }
+    if (strtab_size(tab) != 1 || strtab_intern(tab, NULL) != NULL)
+    {
+        goto out;
+    }
+    b = strtab_intern(tab, "Linux/2.6 UPnP/1.0 Server/1.1");
+    if (b == a || strcmp(b, "Linux/2.6 UPnP/1.0 Server/1.1") != 0 ||
+        strtab_size(tab) != 2)
+    {
+        goto out;
+    }
+    c = strtab_internn(tab, "", 0);
+    if (c == NULL || *c != '\0' || strtab_size(tab) != 3)
+    {
+        goto out;
+    }
+    strtab_release(tab, NULL);
+    ret = true;
+
+out:
+    /* Frees the strings still referenced */
+    strtab_free(tab);
+    return ret;
+}
+
+bool test_refs(void)
+{
+    strtab_t tab = strtab_new();
+    char *a, *b;
+    bool ret = false;
+
+    a = strtab_intern(tab, "max-age=1800");
+    b = strtab_intern(tab, "max-age=1800");
+    strtab_release(tab, a);
+    if (strtab_size(tab) != 1 || strcmp(b, "max-age=1800") != 0)
+    {
+        goto out;
+    }
+    strtab_release(tab, b);
+    if (strtab_size(tab) != 0)
+    {
+        goto out;
+    }
+    a = strtab_intern(tab, "max-age=1800");
+    if (a == NULL || strtab_size(tab) != 1)
+    {
+        goto out;
+    }
+    strtab_release(tab, a);
+    ret = strtab_size(tab) == 0;
+
+out:
+    strtab_free(tab);
+    return ret;
+}
+
+bool test_many(void)
+{
+    const unsigned int count = 2000;
+    strtab_t tab = strtab_new();
+    char** strs = calloc(count * 2, sizeof(char*));
+    char tmp[64];
+    unsigned int i;
+    bool ret = false;
+
+    for (i = 0; i < count * 2; ++i)
+    {
+        snprintf(tmp, sizeof(tmp), "uuid:%08x::upnp:rootdevice", i % count);
+        strs[i] = strtab_intern(tab, tmp);
+    }
+    if (strtab_size(tab) != count)
+    {
+        goto out;
+    }
+    for (i = 0; i < count; ++i)
+    {
+        snprintf(tmp, sizeof(tmp), "uuid:%08x::upnp:rootdevice", i);
+        if (strs[i] != strs[i + count] || strcmp(strs[i], tmp) != 0)
+        {
+            goto out;
+        }
+    }
+    for (i = 0; i < count * 2; ++i)
+    {
+        strtab_release(tab, strs[i]);
+    }
+    ret = strtab_size(tab) == 0;
+
+out:
+    strtab_free(tab);
+    free(strs);
+    return ret;
+}
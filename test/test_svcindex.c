@@ -0,0 +1,197 @@
+/*
+ * Copyright (C) 2011, Joel Klinghed.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the project nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE PROJECT AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE PROJECT OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "common.h"
+
+#include "svcindex.h"
+#include <stdio.h>
+#include <string.h>
+
+#define RUN_TEST(_test) \
+    ++tot; cnt += _test ? 1 : 0
+
+static bool test_sanity(void);
+static bool test_prefix(void);
+static bool test_many(void);
+
+int main(int argc, char** argv)
+{
+    unsigned int tot = 0, cnt = 0;
+
+    RUN_TEST(test_sanity());
+    RUN_TEST(test_prefix());
+    RUN_TEST(test_many());
+
+    fprintf(stdout, "OK %u/%u\n", cnt, tot);
+
+    return cnt == tot ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static const char* NT1 = "urn:schemas-upnp-org:service:ContentDirectory:1";
+static const char* USN1 = "uuid:a::urn:schemas-upnp-org:service:ContentDirectory:1";
+static const char* NT2 = "urn:schemas-upnp-org:service:ConnectionManager:1";
+static const char* USN2 = "uuid:a::urn:schemas-upnp-org:service:ConnectionManager:1";
+
+static size_t count_of(svcindex_t index, const char* nt, const char* usn)
+{
+    size_t count;
+    svcindex_get(index, nt, strlen(nt), usn, strlen(usn), &count);
+    return count;
+}
+
+bool test_sanity(void)
+{
+    svcindex_t index = svcindex_new();
+    int a, b, c;
+    void* const* got;
+    size_t count;
+    bool ret = false;
+
+    svcindex_add(index, NT1, strlen(NT1), USN1, strlen(USN1), &a);
+    svcindex_add(index, NT2, strlen(NT2), USN2, strlen(USN2), &b);
+    svcindex_add(index, NT1, strlen(NT1), USN1, strlen(USN1), &c);
+    if (svcindex_size(index) != 3)
+    {
+        fprintf(stderr, "test_sanity: size %lu != 3\n",
+                (unsigned long)svcindex_size(index));
+        goto out;
+    }
+    got = svcindex_get(index, NT1, strlen(NT1), USN1, strlen(USN1), &count);
+    if (count != 2 || got[0] != &a || got[1] != &c)
+    {
+        fprintf(stderr, "test_sanity: expected a and c for NT1\n");
+        goto out;
+    }
+    if (count_of(index, NT2, USN1) != 0 || count_of(index, NT1, USN2) != 0)
+    {
+        fprintf(stderr, "test_sanity: mixed type and USN matched\n");
+        goto out;
+    }
+    if (svcindex_remove(index, NT2, strlen(NT2), USN2, strlen(USN2), &a))
+    {
+        fprintf(stderr, "test_sanity: removed a from the wrong key\n");
+        goto out;
+    }
+    if (!svcindex_remove(index, NT1, strlen(NT1), USN1, strlen(USN1), &a) ||
+        !svcindex_remove(index, NT2, strlen(NT2), USN2, strlen(USN2), &b))
+    {
+        fprintf(stderr, "test_sanity: remove failed\n");
+        goto out;
+    }
+    got = svcindex_get(index, NT1, strlen(NT1), USN1, strlen(USN1), &count);
+    if (count != 1 || got[0] != &c || count_of(index, NT2, USN2) != 0 ||
+        svcindex_size(index) != 1)
+    {
+        fprintf(stderr, "test_sanity: wrong content after remove\n");
+        goto out;
+    }
+    ret = true;
+
+ out:
+    svcindex_free(index);
+    return ret;
+}
+
+/* Keys without the version, as the daemon uses them */
+bool test_prefix(void)
+{
+    const char* nt = "urn:schemas-upnp-org:service:ContentDirectory:2";
+    const char* usn = "uuid:a::urn:schemas-upnp-org:service:ContentDirectory:2";
+    svcindex_t index = svcindex_new();
+    size_t count;
+    int a;
+    bool ret = false;
+
+    svcindex_add(index, NT1, strlen(NT1) - 1, USN1, strlen(USN1) - 1, &a);
+    svcindex_get(index, nt, strlen(nt) - 1, usn, strlen(usn) - 1, &count);
+    if (count != 1)
+    {
+        fprintf(stderr, "test_prefix: version 2 didn't find version 1\n");
+        goto out;
+    }
+    /* Same chars, split differently */
+    svcindex_get(index, NT1, strlen(NT1), USN1, strlen(USN1) - 2, &count);
+    if (count != 0)
+    {
+        fprintf(stderr, "test_prefix: matched with other lengths\n");
+        goto out;
+    }
+    ret = true;
+
+ out:
+    svcindex_free(index);
+    return ret;
+}
+
+bool test_many(void)
+{
+    svcindex_t index = svcindex_new();
+    char usn[64];
+    static int services[1000];
+    unsigned int i;
+    bool ret = false;
+
+    for (i = 0; i < 1000; ++i)
+    {
+        snprintf(usn, sizeof(usn), "uuid:%u::%s", i, NT1);
+        svcindex_add(index, NT1, strlen(NT1), usn, strlen(usn),
+                     services + i);
+    }
+    for (i = 0; i < 1000; ++i)
+    {
+        void* const* got;
+        size_t count;
+        snprintf(usn, sizeof(usn), "uuid:%u::%s", i, NT1);
+        got = svcindex_get(index, NT1, strlen(NT1), usn, strlen(usn),
+                           &count);
+        if (count != 1 || got[0] != services + i)
+        {
+            fprintf(stderr, "test_many: service %u not found\n", i);
+            goto out;
+        }
+        if (i % 2 == 0 &&
+            !svcindex_remove(index, NT1, strlen(NT1), usn, strlen(usn),
+                             services + i))
+        {
+            fprintf(stderr, "test_many: service %u not removed\n", i);
+            goto out;
+        }
+    }
+    if (svcindex_size(index) != 500)
+    {
+        fprintf(stderr, "test_many: size %lu != 500\n",
+                (unsigned long)svcindex_size(index));
+        goto out;
+    }
+    ret = true;
+
+ out:
+    svcindex_free(index);
+    return ret;
+}
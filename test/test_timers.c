@@ -0,0 +1,218 @@
+/*
+ * Copyright (C) 2011, Joel Klinghed.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the project nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE PROJECT AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE PROJECT OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "common.h"
+
+#include "timers.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define RUN_TEST(_test) \
+    ++tot; cnt += _test ? 1 : 0
+
+static bool test_cached(void);
+static bool test_order(void);
+static bool test_repeat(void);
+
+int main(int argc, char** argv)
+{
+    unsigned int tot = 0, cnt = 0;
+
+    RUN_TEST(test_cached());
+    RUN_TEST(test_order());
+    RUN_TEST(test_repeat());
+
+    fprintf(stdout, "OK %u/%u\n", cnt, tot);
+
+    return cnt == tot ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+typedef struct
+{
+    timers_t timers;
+    unsigned int order[3];
+    size_t count;
+    uint64_t now;
+} record_t;
+
+static long record_cb(void* userdata, unsigned int id)
+{
+    record_t* rec = userdata;
+    if (rec->count < 3)
+    {
+        rec->order[rec->count] = id;
+    }
+    rec->count++;
+    rec->now = timers_now(rec->timers);
+    return -1;
+}
+
+static long record_cb1(void* userdata)
+{
+    return record_cb(userdata, 1);
+}
+
+static long record_cb2(void* userdata)
+{
+    return record_cb(userdata, 2);
+}
+
+static long record_cb3(void* userdata)
+{
+    return record_cb(userdata, 3);
+}
+
+/* Run timers_tick until count callbacks have been called or a second has
+ * passed */
+static bool run_until(record_t* rec, size_t count)
+{
+    unsigned int i;
+    for (i = 0; i < 1000 && rec->count < count; ++i)
+    {
+        unsigned long delay = timers_tick(rec->timers);
+        if (rec->count >= count)
+        {
+            break;
+        }
+        usleep((delay > 0 && delay < 1000 ? delay : 1) * 1000);
+    }
+    return rec->count == count;
+}
+
+bool test_cached(void)
+{
+    timers_t timers = timers_new();
+    uint64_t now;
+    bool ret = false;
+
+    now = timers_now(timers);
+    usleep(20 * 1000);
+    /* Only ticks and updates look at the clock */
+    if (timers_now(timers) != now)
+    {
+        goto out;
+    }
+    timers_update(timers);
+    if (timers_now(timers) < now + 20)
+    {
+        goto out;
+    }
+    now = timers_now(timers);
+    timers_tick(timers);
+    if (timers_now(timers) < now)
+    {
+        goto out;
+    }
+    ret = true;
+
+ out:
+    timers_free(timers);
+    return ret;
+}
+
+bool test_order(void)
+{
+    record_t rec;
+    uint64_t start;
+    bool ret = false;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.timers = timers_new();
+    start = timers_now(rec.timers);
+    timers_add(rec.timers, 30, &rec, record_cb3);
+    timers_add(rec.timers, 10, &rec, record_cb1);
+    timers_add(rec.timers, 20, &rec, record_cb2);
+    if (!run_until(&rec, 3))
+    {
+        goto out;
+    }
+    if (rec.order[0] != 1 || rec.order[1] != 2 || rec.order[2] != 3)
+    {
+        goto out;
+    }
+    /* Never called early */
+    if (rec.now < start + 30)
+    {
+        goto out;
+    }
+    ret = true;
+
+ out:
+    timers_free(rec.timers);
+    return ret;
+}
+
+typedef struct
+{
+    unsigned int calls;
+} repeat_t;
+
+static long repeat_cb(void* userdata)
+{
+    repeat_t* repeat = userdata;
+    ++repeat->calls;
+    if (repeat->calls == 1)
+    {
+        /* New delay */
+        return 5;
+    }
+    return repeat->calls < 3 ? 0 : -1;
+}
+
+bool test_repeat(void)
+{
+    timers_t timers = timers_new();
+    repeat_t repeat;
+    unsigned int i;
+    bool ret = false;
+
+    repeat.calls = 0;
+    timers_add(timers, 1, &repeat, repeat_cb);
+    for (i = 0; i < 1000 && repeat.calls < 3; ++i)
+    {
+        usleep(1000);
+        timers_tick(timers);
+    }
+    if (repeat.calls != 3)
+    {
+        goto out;
+    }
+    /* Cancelled itself, nothing left */
+    usleep(10 * 1000);
+    if (timers_tick(timers) != 0 || repeat.calls != 3)
+    {
+        goto out;
+    }
+    ret = true;
+
+ out:
+    timers_free(timers);
+    return ret;
+}